@@ -111,6 +111,7 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
     bool seen_mf = false;
     bool seen_md = false;
     bool seen_split_dwarf = false;
+    bool seen_ir = false;
     // if rewriting includes and precompiling on remote machine, then cpp args are not local
     Argument_Type Arg_Cpp = compiler_only_rewrite_includes(job) ? Arg_Rest : Arg_Local;
 
@@ -267,6 +268,10 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
                         CompileJob::Language lang = str_equal(opt, "c++") ? CompileJob::Lang_CXX : CompileJob::Lang_C;
                         job.setLanguage(lang); // will cause -x used remotely twice, but shouldn't be a problem
                         unsupported = false;
+                    } else if (str_equal(opt, "ir")) {
+                        // only ThinLTO backend jobs, checked below
+                        seen_ir = true;
+                        unsupported = false;
                     }
                 }
                 if (unsupported) {
@@ -327,7 +332,7 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
                                        << " missing, building locally" << endl;
                             always_local = true;
                         }
-                    } else {
+                    } else if (access((p + ".gch").c_str(), R_OK)) {
                         log_info() << "argument " << a << " " << p << ", building locally" << endl;
                         always_local = true;    /* Included file is not header.suffix or header.suffix.gch! */
                     }
@@ -336,13 +341,14 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
                     args.append(argv[i], Arg_Local);
                 }
             } else if (str_equal("-include-pch", a)) {
-                /* Clang's precompiled header, it's probably not worth it sending the PCH file. */
+                /* Clang's precompiled header, the compile server gets it
+                   with the job (see precompiled_header()).  */
+                args.append(a, Arg_Local);
+
                 if (argv[i + 1]) {
                     ++i;
+                    args.append(argv[i], Arg_Local);
                 }
-
-                always_local = true;
-                log_info() << "argument " << a << ", building locally" << endl;
             } else if (str_equal("-D", a) || str_equal("-U", a)) {
                 args.append(a, Arg_Cpp);
 
@@ -420,6 +426,10 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
             } else if (str_equal("-flto", a)) {
                 // pointless when preprocessing, and Clang would emit a warning
                 args.append(a, Arg_Remote);
+            } else if (str_startswith("-fthinlto-index=", a)) {
+                // the server gets the index with the bitcode, see thinlto_files()
+                job.setThinLTOIndex(a + strlen("-fthinlto-index="));
+                args.append(a, Arg_Local);
             } else if (str_startswith("-fplugin=", a)) {
                 string file = a + strlen("-fplugin=");
 
@@ -472,6 +482,16 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
         }
     }
 
+    /* Of bitcode only the ThinLTO backend jobs of clang go to the farm.  */
+    bool thinlto = seen_ir && !job.thinLTOIndex().empty() && compiler_is_clang(job);
+
+    if ((seen_ir || !job.thinLTOIndex().empty()) && !thinlto) {
+        if (!always_local) {
+            log_info() << "bitcode but no ThinLTO backend job of clang, building locally" << endl;
+        }
+        always_local = true;
+    }
+
     if (!seen_c && !seen_s) {
         if (!always_local) {
             log_info() << "neither -c nor -S argument, building locally" << endl;
@@ -534,7 +554,9 @@ bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun, list<s
             string::size_type dot_index = ifile.find_last_of('.');
             string ext = ifile.substr(dot_index + 1);
 
-            if (ext == "cc"
+            if (seen_ir) {
+                // bitcode, mostly named like an object file
+            } else if (ext == "cc"
                 || ext == "cpp" || ext == "cxx"
                 || ext == "cp" || ext == "c++"
                 || ext == "C" || ext == "ii") {
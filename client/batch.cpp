@@ -0,0 +1,585 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* "icecc --batch compile_commands.json" compiles all entries of a
+   compilation database.  Each job runs in a child forked from this process
+   like the job of an icecc of its own, without starting one, and many of
+   them wait for compile servers at the same time.  Only so many of them
+   preprocess at once, the local daemon limits those compiling here.  */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "client.h"
+
+extern const char *rs_program_name;
+
+using namespace std;
+
+// jobs running per CPU, most of them wait for their compile server
+#define JOBS_PER_CPU 4
+
+struct BatchEntry {
+    string directory;
+    string file;
+    vector<string> arguments;
+};
+
+/* Byte N of this (unlinked) file is locked by the job using preprocessor
+   slot N, a lock goes away with the job whatever happens to it.  */
+static int cpp_lock_fd = -1;
+static int cpp_slots = 0;
+
+static void skip_space(const char *&p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        ++p;
+    }
+}
+
+static void append_utf8(string &out, unsigned int c)
+{
+    if (c < 0x80) {
+        out += char(c);
+    } else if (c < 0x800) {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    } else {
+        out += char(0xf0 | (c >> 18));
+        out += char(0x80 | ((c >> 12) & 0x3f));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    }
+}
+
+static bool read_hex4(const char *&p, unsigned int &c)
+{
+    c = 0;
+
+    for (int i = 0; i < 4; ++i, ++p) {
+        c <<= 4;
+
+        if (*p >= '0' && *p <= '9') {
+            c |= *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            c |= *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            c |= *p - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool json_string(const char *&p, string &out)
+{
+    if (*p != '"') {
+        return false;
+    }
+
+    out.clear();
+
+    for (++p; *p != '"'; ++p) {
+        if (!*p) {
+            return false;
+        }
+
+        if (*p != '\\') {
+            out += *p;
+            continue;
+        }
+
+        switch (*++p) {
+        case 'b':
+            out += '\b';
+            break;
+        case 'f':
+            out += '\f';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        case 't':
+            out += '\t';
+            break;
+        case 'u': {
+            unsigned int c, low;
+
+            if (!read_hex4(++p, c)) {
+                return false;
+            }
+
+            // a surrogate pair
+            if (c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+                p += 2;
+
+                if (!read_hex4(p, low)) {
+                    return false;
+                }
+
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            }
+
+            append_utf8(out, c);
+            --p;
+            break;
+        }
+        case 0:
+            return false;
+        default:
+            out += *p;
+        }
+    }
+
+    ++p;
+    return true;
+}
+
+/* Skips a value of any type.  */
+static bool json_skip(const char *&p)
+{
+    string ignored;
+    skip_space(p);
+
+    if (*p == '"') {
+        return json_string(p, ignored);
+    }
+
+    if (*p == '[' || *p == '{') {
+        char close = *p == '[' ? ']' : '}';
+        skip_space(++p);
+
+        while (*p != close) {
+            if (close == '}') {
+                if (!json_string(p, ignored)) {
+                    return false;
+                }
+
+                skip_space(p);
+
+                if (*p++ != ':') {
+                    return false;
+                }
+            }
+
+            if (!json_skip(p)) {
+                return false;
+            }
+
+            skip_space(p);
+
+            if (*p == ',') {
+                skip_space(++p);
+            } else if (*p != close) {
+                return false;
+            }
+        }
+
+        ++p;
+        return true;
+    }
+
+    // numbers, true, false, null
+    const char *start = p;
+
+    while (*p && !strchr(",]} \t\r\n", *p)) {
+        ++p;
+    }
+
+    return p != start;
+}
+
+/* Splits COMMAND into its arguments the way a POSIX shell would without
+   expanding anything.  */
+static vector<string> split_command(const string &command)
+{
+    vector<string> args;
+    string arg;
+    bool in_arg = false;
+
+    for (string::size_type i = 0; i < command.size(); ++i) {
+        char c = command[i];
+
+        if (c == ' ' || c == '\t' || c == '\n') {
+            if (in_arg) {
+                args.push_back(arg);
+                arg.clear();
+                in_arg = false;
+            }
+
+            continue;
+        }
+
+        in_arg = true;
+
+        if (c == '\\' && i + 1 < command.size()) {
+            arg += command[++i];
+        } else if (c == '\'') {
+            while (++i < command.size() && command[i] != '\'') {
+                arg += command[i];
+            }
+        } else if (c == '"') {
+            while (++i < command.size() && command[i] != '"') {
+                if (command[i] == '\\' && i + 1 < command.size()
+                        && strchr("\"\\$`\n", command[i + 1])) {
+                    ++i;
+                }
+
+                arg += command[i];
+            }
+        } else {
+            arg += c;
+        }
+    }
+
+    if (in_arg) {
+        args.push_back(arg);
+    }
+
+    return args;
+}
+
+/* Reads the compilation database TEXT into ENTRIES.  */
+static bool parse_database(const string &text, vector<BatchEntry> &entries)
+{
+    const char *p = text.c_str();
+    skip_space(p);
+
+    if (*p++ != '[') {
+        return false;
+    }
+
+    skip_space(p);
+
+    while (*p != ']') {
+        if (*p++ != '{') {
+            return false;
+        }
+
+        BatchEntry entry;
+        string command;
+        skip_space(p);
+
+        while (*p != '}') {
+            string key;
+
+            if (!json_string(p, key)) {
+                return false;
+            }
+
+            skip_space(p);
+
+            if (*p++ != ':') {
+                return false;
+            }
+
+            skip_space(p);
+
+            if (key == "directory" || key == "file" || key == "command") {
+                string &value = key == "directory" ? entry.directory
+                                : key == "file" ? entry.file : command;
+
+                if (!json_string(p, value)) {
+                    return false;
+                }
+            } else if (key == "arguments" && *p == '[') {
+                skip_space(++p);
+
+                while (*p != ']') {
+                    string arg;
+
+                    if (!json_string(p, arg)) {
+                        return false;
+                    }
+
+                    entry.arguments.push_back(arg);
+                    skip_space(p);
+
+                    if (*p == ',') {
+                        skip_space(++p);
+                    } else if (*p != ']') {
+                        return false;
+                    }
+                }
+
+                ++p;
+            } else if (!json_skip(p)) {
+                return false;
+            }
+
+            skip_space(p);
+
+            if (*p == ',') {
+                skip_space(++p);
+            } else if (*p != '}') {
+                return false;
+            }
+        }
+
+        ++p;
+
+        if (entry.arguments.empty()) {
+            entry.arguments = split_command(command);
+        }
+
+        if (entry.arguments.empty()) {
+            return false;
+        }
+
+        entries.push_back(entry);
+        skip_space(p);
+
+        if (*p == ',') {
+            skip_space(++p);
+        } else if (*p != ']') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool read_file(const char *file, string &text)
+{
+    FILE *f = fopen(file, "r");
+
+    if (!f) {
+        return false;
+    }
+
+    char buffer[65536];
+    size_t len;
+
+    while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        text.append(buffer, len);
+    }
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+/* The job of ENTRY as argv of icecc (ICECC_PATH) with the compiler first.
+   A database written with icecc as the compiler or its launcher has that
+   in front of the compiler.  */
+static char **job_argv(const char *icecc_path, const BatchEntry &entry, int &argc)
+{
+    vector<string> args = entry.arguments;
+    string resolved;
+
+    if (args.size() > 1 && find_basename(args[0]) == rs_program_name) {
+        args.erase(args.begin());
+    } else if (resolve_link(args[0], resolved) == 0 && find_basename(resolved) == rs_program_name) {
+        // a symlink to icecc standing in for the compiler
+        args[0] = find_basename(args[0]);
+    }
+
+    char **argv = new char*[args.size() + 2];
+    argv[0] = strdup(icecc_path);
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv[i + 1] = strdup(args[i].c_str());
+    }
+
+    argc = args.size() + 1;
+    argv[argc] = 0;
+    return argv;
+}
+
+int run_batch(int &argc, char **&argv)
+{
+    if (argc < 3 || argc > 4) {
+        log_error() << "usage: icecc --batch compile_commands.json [jobs]" << endl;
+        return EXIT_BAD_ARGUMENTS;
+    }
+
+    string text;
+    vector<BatchEntry> entries;
+
+    if (!read_file(argv[2], text)) {
+        log_perror(argv[2]);
+        return EXIT_NO_SUCH_FILE;
+    }
+
+    if (!parse_database(text, entries)) {
+        log_error() << argv[2] << " is not a compilation database" << endl;
+        return EXIT_BAD_ARGUMENTS;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpp_slots = cpus > 0 ? cpus : 1;
+    int jobs = argc == 4 ? atoi(argv[3]) : cpp_slots * JOBS_PER_CPU;
+
+    if (jobs < 1) {
+        log_error() << "bad number of jobs " << argv[3] << endl;
+        return EXIT_BAD_ARGUMENTS;
+    }
+
+    char lock_name[] = "/tmp/icecc-batch-XXXXXX";
+    cpp_lock_fd = mkstemp(lock_name);
+
+    if (cpp_lock_fd >= 0) {
+        unlink(lock_name);
+    }
+
+    map<pid_t, size_t> running;
+    size_t next = 0;
+    int ret = 0;
+    unsigned int failed = 0;
+
+    while (next < entries.size() || !running.empty()) {
+        if (next < entries.size() && running.size() < (size_t) jobs) {
+            const BatchEntry &entry = entries[next];
+            flush_debug();
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                if (!entry.directory.empty() && chdir(entry.directory.c_str()) != 0) {
+                    log_perror(("chdir " + entry.directory).c_str());
+                    _exit(EXIT_NO_SUCH_FILE);
+                }
+
+                argv = job_argv(argv[0], entry, argc);
+                return -1;
+            }
+
+            if (pid < 0) {
+                log_perror("fork");
+
+                if (running.empty()) {
+                    return EXIT_DISTCC_FAILED;
+                }
+            } else {
+                running[pid] = next++;
+                continue;
+            }
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("waitpid");
+            return EXIT_DISTCC_FAILED;
+        }
+
+        map<pid_t, size_t>::iterator it = running.find(pid);
+
+        if (it == running.end()) {
+            continue;
+        }
+
+        if (shell_exit_status(status) != 0) {
+            log_error() << "compiling " << entries[it->second].file << " failed" << endl;
+            ++failed;
+
+            if (!ret) {
+                ret = shell_exit_status(status);
+            }
+        }
+
+        running.erase(it);
+    }
+
+    if (failed) {
+        log_error() << failed << " of " << entries.size() << " jobs failed" << endl;
+    }
+
+    return ret;
+}
+
+static bool lock_slot(int slot, bool wait)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = slot;
+    lock.l_len = 1;
+
+    while (fcntl(cpp_lock_fd, wait ? F_SETLKW : F_SETLK, &lock) != 0) {
+        if (!wait || errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BatchCppSlot::BatchCppSlot()
+    : slot(-1)
+{
+    if (cpp_lock_fd < 0) {
+        return;
+    }
+
+    for (int i = 0; i < cpp_slots; ++i) {
+        if (lock_slot(i, false)) {
+            slot = i;
+            return;
+        }
+    }
+
+    // all busy, wait for one of them
+    int i = getpid() % cpp_slots;
+
+    if (lock_slot(i, true)) {
+        slot = i;
+    }
+}
+
+BatchCppSlot::~BatchCppSlot()
+{
+    if (slot < 0) {
+        return;
+    }
+
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = slot;
+    lock.l_len = 1;
+    fcntl(cpp_lock_fd, F_SETLK, &lock);
+}
@@ -42,15 +42,41 @@ extern std::string remote_daemon;
 
 /* in remote.cpp */
 extern std::string get_absfilename(const std::string &_file);
+extern std::string make_tmp_file(const char *suffix);
+extern void copy_to_fd(const std::string &file, int fd);
 
 /* In arg.cpp.  */
 extern bool analyse_argv(const char * const *argv, CompileJob &job, bool icerun,
                          std::list<std::string> *extrafiles);
 
+/* In batch.cpp.  */
+extern int run_batch(int &argc, char **&argv);
+
+/* Holds one of the preprocessor slots of a batch while it exists.  */
+class BatchCppSlot
+{
+public:
+    BatchCppSlot();
+    ~BatchCppSlot();
+
+private:
+    int slot;
+};
+
 /* In cpp.cpp.  */
 extern pid_t call_cpp(CompileJob &job, int fdwrite, int fdread = -1);
+extern bool dcc_is_preprocessed(const std::string &sfile);
+extern std::string precompiled_header(const CompileJob &job);
+
+/* In headers.cpp.  */
+extern bool scan_headers(const CompileJob &job, HeaderManifestMsg &manifest);
+
+/* In hedge.cpp - compiles locally too after DELAY milliseconds */
+extern int build_hedged(CompileJob &job, MsgChannel *local_daemon, const Environments &envs,
+                        int permill, int delay);
 
 /* In local.cpp.  */
+extern MsgChannel *connect_local_daemon();
 extern int build_local(CompileJob &job, MsgChannel *daemon, struct rusage *usage = 0);
 extern std::string find_compiler(const CompileJob &job);
 extern bool compiler_is_clang(const CompileJob &job);
@@ -59,6 +85,9 @@ extern std::string compiler_path_lookup(const std::string &compiler);
 
 /* In remote.cpp - permill is the probability it will be compiled three times */
 extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+/* whether the command of icerun in JOB may run on a compile server, which
+   it is then set up for */
+extern bool remote_command(CompileJob &job);
 
 /* safeguard.cpp */
 extern void dcc_increment_safeguard(void);
@@ -34,6 +34,9 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 
 #include "client.h"
 
@@ -58,6 +61,40 @@ bool dcc_is_preprocessed(const string &sfile)
     return false;
 }
 
+/* The precompiled header JOB uses, which goes to the compile server with
+   it (CompileFileMsg::pch): the file of clang's -include-pch, or the .gch
+   gcc loads for the first -include, if that is relative to the working
+   directory or absolute.  Empty if there is none.  */
+string precompiled_header(const CompileJob &job)
+{
+    list<string> flags = job.localFlags();
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        list<string>::const_iterator arg = it;
+
+        if (++arg == flags.end()) {
+            break;
+        }
+
+        if (*it == "-include-pch" && compiler_is_clang(job)) {
+            return *arg;
+        }
+
+        if (*it == "-include" && !compiler_is_clang(job)) {
+            struct stat st;
+
+            // a directory of them is left to the preprocessor
+            if (stat((*arg + ".gch").c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                return *arg + ".gch";
+            }
+
+            break;
+        }
+    }
+
+    return string();
+}
+
 /**
  * If the input filename is a plain source file rather than a
  * preprocessed source file, then preprocess it to a temporary file
@@ -109,10 +146,30 @@ pid_t call_cpp(CompileJob &job, int fdwrite, int fdread)
         argv[2] = 0;
     } else {
         list<string> flags = job.localFlags();
+        string pch = precompiled_header(job);
+
+        if (!pch.empty() && !compiler_is_clang(job)) {
+            /* The output names the .gch, which the compile server gets and
+               finds where it is here, relative to the working directory.  */
+            list<string>::iterator arg = ++find(flags.begin(), flags.end(), string("-include"));
+
+            if ((*arg)[0] == '/') {
+                string up;
+
+                for (size_t slash = job.workingDirectory().find('/'); slash != string::npos;
+                        slash = job.workingDirectory().find('/', slash + 1)) {
+                    up += "../";
+                }
+
+                *arg = up + arg->substr(1);
+            }
+
+            flags.push_back("-fpch-preprocess");
+        }
 
         /* This has a duplicate meaning. it can either include a file
            for preprocessing or a precompiled header. decide which one.  */
-        for (list<string>::iterator it = flags.begin(); it != flags.end();) {
+        for (list<string>::iterator it = flags.begin(); pch.empty() && it != flags.end();) {
             if ((*it) == "-include") {
                 ++it;
 
@@ -0,0 +1,717 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Finding the files a job includes without preprocessing it, so that the
+   compile server can preprocess it (CompileFileMsg::remote_cpp).  Every
+   #include and __has_include is followed, also in conditionals that are
+   false, so more files are sent than are needed but none the preprocessor
+   would find is missing.  An #include of a macro can't be followed that
+   way, the job is preprocessed here then.  */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "client.h"
+#include "resultkey.h"
+
+using namespace std;
+
+/* As conditionals are not looked at, optional parts of libraries (like
+   TBB for the parallel algorithms of libstdc++) can make a job include far
+   more than it uses.  Above this many files sending and placing them costs
+   more than preprocessing here does.  */
+#define MAX_HEADERS 2000
+
+/* Runs the compiler with the flags of JOB to have it tell the directories
+   it searches, those for #include "..." only in QUOTE and then the others
+   in BRACKET.  */
+static bool search_dirs(const CompileJob &job, vector<string> &quote, vector<string> &bracket)
+{
+    list<string> flags;
+    list<string> local = job.localFlags();
+
+    for (list<string>::const_iterator it = local.begin(); it != local.end(); ++it) {
+        if (*it == "-include" || *it == "-imacros") {
+            if (++it == local.end()) {
+                break;
+            }
+        } else {
+            flags.push_back(*it);
+        }
+    }
+
+    appendList(flags, job.remoteFlags());
+    appendList(flags, job.restFlags());
+
+    int err_pipe[2];
+
+    if (pipe(err_pipe) < 0) {
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(err_pipe[0]);
+        int null_fd = open("/dev/null", O_RDWR);
+
+        if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(null_fd, STDOUT_FILENO) < 0
+                || dup2(err_pipe[1], STDERR_FILENO) < 0) {
+            _exit(1);
+        }
+
+        // the lines looked for are translated otherwise
+        setenv("LC_ALL", "C", 1);
+
+        char **argv = new char*[flags.size() + 7];
+        int i = 0;
+        argv[i++] = strdup(find_compiler(job).c_str());
+
+        for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+            argv[i++] = strdup(it->c_str());
+        }
+
+        argv[i++] = strdup("-E");
+        argv[i++] = strdup("-v");
+        argv[i++] = strdup("-x");
+        argv[i++] = strdup(job.language() == CompileJob::Lang_CXX ? "c++" : "c");
+        argv[i++] = strdup("/dev/null");
+        argv[i] = 0;
+
+        dcc_increment_safeguard();
+        execv(argv[0], argv);
+        _exit(1);
+    }
+
+    close(err_pipe[1]);
+    string output;
+    char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = read(err_pipe[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            break;
+        }
+
+        output.append(buffer, bytes);
+    }
+
+    close(err_pipe[0]);
+    int status = 1;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (shell_exit_status(status) != 0) {
+        return false;
+    }
+
+    vector<string> *dirs = 0;
+    string::size_type pos = 0;
+
+    while (pos < output.size()) {
+        string::size_type end = output.find('\n', pos);
+
+        if (end == string::npos) {
+            end = output.size();
+        }
+
+        string line = output.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (line.compare(0, 10, "#include \"") == 0) {
+            dirs = &quote;
+        } else if (line.compare(0, 10, "#include <") == 0) {
+            dirs = &bracket;
+        } else if (line.compare(0, 19, "End of search list.") == 0) {
+            return dirs != 0;
+        } else if (dirs && !line.empty() && line[0] == ' ') {
+            // frameworks of Darwin aren't searched as directories
+            if (line.find(" (framework directory)") == string::npos) {
+                dirs->push_back(line.substr(1));
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Whether the preprocessor flags of JOB are understood well enough to
+   preprocess with them somewhere else.  */
+static bool can_preprocess_remotely(const CompileJob &job)
+{
+    if (job.language() != CompileJob::Lang_C && job.language() != CompileJob::Lang_CXX) {
+        return false;
+    }
+
+    if (dcc_is_preprocessed(job.inputFile())) {
+        return false;
+    }
+
+    // its headers are not looked for, the compile server gets it instead
+    if (!precompiled_header(job).empty()) {
+        return false;
+    }
+
+    static const char *const local_flags[] = {
+        "-M", "-Wp,", "@", "-iprefix", "-iwithprefix", "-imultilib", "-isysroot", 0
+    };
+    // paths in the flags left as they are
+    static const char *const rest_flags[] = {
+        "-Wp,", "--sysroot", "-isysroot", "-isystem", "-iquote", "-idirafter", "-include",
+        "-imacros", "-fplugin", 0
+    };
+
+    list<string> local = job.localFlags();
+    list<string> rest = job.restFlags();
+
+    for (list<string>::const_iterator it = local.begin(); it != local.end(); ++it) {
+        for (int i = 0; local_flags[i]; ++i) {
+            if (it->compare(0, strlen(local_flags[i]), local_flags[i]) == 0) {
+                log_info() << "argument " << *it << ", preprocessing locally" << endl;
+                return false;
+            }
+        }
+    }
+
+    for (list<string>::const_iterator it = rest.begin(); it != rest.end(); ++it) {
+        for (int i = 0; rest_flags[i]; ++i) {
+            if (it->compare(0, strlen(rest_flags[i]), rest_flags[i]) == 0) {
+                log_info() << "argument " << *it << ", preprocessing locally" << endl;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool is_ident(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+static string join_path(const string &dir, const string &name)
+{
+    if (dir.empty()) {
+        return name;
+    }
+
+    return dir[dir.size() - 1] == '/' ? dir + name : dir + '/' + name;
+}
+
+static string dir_of(const string &path)
+{
+    string::size_type slash = path.find_last_of('/');
+
+    if (slash == string::npos) {
+        return string();
+    }
+
+    return slash == 0 ? string("/") : path.substr(0, slash);
+}
+
+/* TEXT with its comments blanked out, keeping the lines.  A string or
+   character literal ends at the end of the line at the latest, and a '
+   after a digit or letter is taken for a digit separator.  */
+static string strip_comments(const string &text)
+{
+    string code = text;
+    string::size_type i = 0;
+
+    while (i < code.size()) {
+        char c = code[i];
+
+        if (c == '/' && i + 1 < code.size() && code[i + 1] == '/') {
+            while (i < code.size() && code[i] != '\n') {
+                code[i++] = ' ';
+            }
+        } else if (c == '/' && i + 1 < code.size() && code[i + 1] == '*') {
+            code[i++] = ' ';
+            code[i++] = ' ';
+
+            while (i < code.size() && !(code[i] == '*' && i + 1 < code.size() && code[i + 1] == '/')) {
+                if (code[i] != '\n') {
+                    code[i] = ' ';
+                }
+
+                ++i;
+            }
+
+            for (int end = 0; end < 2 && i < code.size(); ++end) {
+                code[i++] = ' ';
+            }
+        } else if (c == '"' || (c == '\'' && (i == 0 || !is_ident(code[i - 1])))) {
+            for (++i; i < code.size() && code[i] != c && code[i] != '\n'; ++i) {
+                if (code[i] == '\\' && i + 1 < code.size()) {
+                    ++i;
+                }
+            }
+
+            if (i < code.size() && code[i] == c) {
+                ++i;
+            }
+        } else {
+            ++i;
+        }
+    }
+
+    return code;
+}
+
+namespace
+{
+
+/* A file to scan, by the path the preprocessor would open, and the index
+   in the search chain of the directory it was found in, -1 if it wasn't
+   found through the chain.  */
+typedef pair<string, int> Found;
+
+class IncludeScanner
+{
+public:
+    IncludeScanner(const string &_cwd, const vector<string> &quote, const vector<string> &bracket)
+        : cwd(_cwd)
+        , chain(quote)
+        , bracket_start(quote.size())
+        , wrappers_added(false)
+    {
+        chain.insert(chain.end(), bracket.begin(), bracket.end());
+    }
+
+    // adds the source or a file of -include, false if it isn't there
+    bool addRoot(const string &file, bool search);
+    // scans the files added and all they include, false if that can't be
+    // done for one of them
+    bool run();
+
+    // the absolute paths of the files and their hashes, in the order found
+    list<string> files;
+    list<string> hashes;
+
+private:
+    bool isFile(const string &path);
+    void add(const Found &found);
+    void resolve(const string &name, bool angled, bool next, const Found &from);
+    bool scan(const Found &file);
+    void scanUses(const string &line, const string &macro, bool next, const Found &file);
+
+    string cwd;
+    vector<string> chain;
+    size_t bracket_start;
+    map<string, bool> exists;
+    set<Found> seen;
+    list<Found> queue;
+    list<Found> scanned;
+    set<string> hashed;
+    // function-like macros that are __has_include(_next) of their argument
+    map<string, bool> wrappers;
+    bool wrappers_added;
+};
+
+bool IncludeScanner::isFile(const string &path)
+{
+    map<string, bool>::iterator it = exists.find(path);
+
+    if (it != exists.end()) {
+        return it->second;
+    }
+
+    struct stat st;
+    bool is_file = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    exists[path] = is_file;
+    return is_file;
+}
+
+void IncludeScanner::add(const Found &found)
+{
+    if (seen.insert(found).second) {
+        queue.push_back(found);
+    }
+}
+
+bool IncludeScanner::addRoot(const string &file, bool search)
+{
+    if (file[0] == '/' || isFile(file) || !search) {
+        if (!isFile(file)) {
+            return false;
+        }
+
+        add(Found(file, -1));
+        return true;
+    }
+
+    for (size_t i = 0; i < chain.size(); ++i) {
+        string path = join_path(chain[i], file);
+
+        if (isFile(path)) {
+            add(Found(path, i));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Adds the file the preprocessor would include for NAME in FROM, if it
+   finds one.  An include that finds nothing is left to the compile
+   server to complain about.  */
+void IncludeScanner::resolve(const string &name, bool angled, bool next, const Found &from)
+{
+    if (name.empty()) {
+        return;
+    }
+
+    if (name[0] == '/') {
+        if (isFile(name)) {
+            add(Found(name, -1));
+        }
+
+        return;
+    }
+
+    size_t start = angled ? bracket_start : 0;
+
+    if (next && from.second >= 0) {
+        start = from.second + 1;
+    } else if (!angled) {
+        string path = join_path(dir_of(from.first), name);
+
+        if (isFile(path)) {
+            add(Found(path, -1));
+            return;
+        }
+    }
+
+    for (size_t i = start; i < chain.size(); ++i) {
+        string path = join_path(chain[i], name);
+
+        if (isFile(path)) {
+            add(Found(path, i));
+            return;
+        }
+    }
+}
+
+/* Follows MACRO( <name> ) or MACRO( "name" ) in LINE, MACRO being
+   __has_include or a macro around it.  */
+void IncludeScanner::scanUses(const string &line, const string &macro, bool next, const Found &file)
+{
+    for (string::size_type pos = line.find(macro); pos != string::npos;
+            pos = line.find(macro, pos + macro.size())) {
+        string::size_type p = pos + macro.size();
+
+        if ((pos > 0 && is_ident(line[pos - 1])) || (p < line.size() && is_ident(line[p]))) {
+            continue;
+        }
+
+        while (p < line.size() && isspace((unsigned char) line[p])) {
+            ++p;
+        }
+
+        if (p >= line.size() || line[p] != '(') {
+            continue;
+        }
+
+        ++p;
+
+        while (p < line.size() && isspace((unsigned char) line[p])) {
+            ++p;
+        }
+
+        if (p >= line.size() || (line[p] != '<' && line[p] != '"')) {
+            continue;
+        }
+
+        char close = line[p] == '<' ? '>' : '"';
+        string::size_type end = line.find(close, p + 1);
+
+        if (end != string::npos) {
+            resolve(line.substr(p + 1, end - p - 1), close == '>', next, file);
+        }
+    }
+}
+
+bool IncludeScanner::scan(const Found &file)
+{
+    int fd = open(file.first.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        log_perror(("open " + file.first).c_str());
+        return false;
+    }
+
+    string text;
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            close(fd);
+            return false;
+        }
+
+        text.append(buffer, bytes);
+    }
+
+    close(fd);
+
+    string path = file.first[0] == '/' ? file.first : cwd + '/' + file.first;
+
+    if (hashed.insert(path).second) {
+        ResultKey contents;
+        contents.add(text.data(), text.size());
+        files.push_back(path);
+        hashes.push_back(contents.hex());
+
+        if (files.size() > MAX_HEADERS) {
+            log_info() << "job may include more than " << MAX_HEADERS
+                       << " files, preprocessing locally" << endl;
+            return false;
+        }
+    }
+
+    text = strip_comments(text);
+    string::size_type pos = 0;
+
+    while (pos < text.size()) {
+        string::size_type end = text.find('\n', pos);
+        string line;
+
+        for (;;) {
+            if (end == string::npos) {
+                end = text.size();
+            }
+
+            line.append(text, pos, end - pos);
+            pos = end + 1;
+
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+
+            if (line.empty() || line[line.size() - 1] != '\\' || pos >= text.size()) {
+                break;
+            }
+
+            line.erase(line.size() - 1);
+            end = text.find('\n', pos);
+        }
+
+        string::size_type p = line.find_first_not_of(" \t");
+
+        if (p != string::npos && line[p] == '#') {
+            p = line.find_first_not_of(" \t", p + 1);
+            string::size_type word_end = p;
+
+            while (word_end < line.size() && is_ident(line[word_end])) {
+                ++word_end;
+            }
+
+            string directive = p == string::npos ? string() : line.substr(p, word_end - p);
+
+            if (directive == "include" || directive == "include_next" || directive == "import") {
+                p = line.find_first_not_of(" \t", word_end);
+
+                if (p == string::npos || (line[p] != '<' && line[p] != '"')) {
+                    log_info() << "computed include in " << file.first << ", preprocessing locally"
+                               << endl;
+                    return false;
+                }
+
+                char close = line[p] == '<' ? '>' : '"';
+                string::size_type name_end = line.find(close, p + 1);
+
+                if (name_end != string::npos) {
+                    resolve(line.substr(p + 1, name_end - p - 1), close == '>',
+                            directive == "include_next", file);
+                }
+
+                continue;
+            }
+
+            if (directive == "define" && line.find("__has_include", word_end) != string::npos) {
+                p = line.find_first_not_of(" \t", word_end);
+                string::size_type name_end = p;
+
+                while (name_end < line.size() && is_ident(line[name_end])) {
+                    ++name_end;
+                }
+
+                if (name_end < line.size() && line[name_end] == '(') {
+                    string name = line.substr(p, name_end - p);
+                    bool next = line.find("__has_include_next", name_end) != string::npos;
+
+                    if (wrappers.insert(make_pair(name, next)).second) {
+                        wrappers_added = true;
+                    }
+                }
+            }
+        }
+
+        if (line.find("__has_include") != string::npos) {
+            scanUses(line, "__has_include", false, file);
+            scanUses(line, "__has_include_next", true, file);
+        }
+
+        for (map<string, bool>::const_iterator it = wrappers.begin(); it != wrappers.end(); ++it) {
+            if (line.find(it->first) != string::npos) {
+                scanUses(line, it->first, it->second, file);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool IncludeScanner::run()
+{
+    for (;;) {
+        while (!queue.empty()) {
+            Found file = queue.front();
+            queue.pop_front();
+            scanned.push_back(file);
+
+            if (!scan(file)) {
+                return false;
+            }
+        }
+
+        if (!wrappers_added) {
+            return true;
+        }
+
+        /* The files scanned before may use the macros found since.  */
+        wrappers_added = false;
+        list<Found> again = scanned;
+
+        for (list<Found>::const_iterator it = again.begin(); it != again.end(); ++it) {
+            if (!scan(*it)) {
+                return false;
+            }
+        }
+    }
+}
+
+}
+
+bool scan_headers(const CompileJob &job, HeaderManifestMsg &manifest)
+{
+    if (!can_preprocess_remotely(job)) {
+        return false;
+    }
+
+    vector<string> quote, bracket;
+
+    if (!search_dirs(job, quote, bracket)) {
+        log_info() << "can't get the include directories, preprocessing locally" << endl;
+        return false;
+    }
+
+    IncludeScanner scanner(job.workingDirectory(), quote, bracket);
+
+    if (!scanner.addRoot(job.inputFile(), false)) {
+        return false;
+    }
+
+    list<string> local = job.localFlags();
+    set<string> user_dirs;
+
+    for (list<string>::const_iterator it = local.begin(); it != local.end(); ++it) {
+        string arg;
+        bool dir = *it == "-I" || *it == "-isystem" || *it == "-iquote" || *it == "-idirafter";
+
+        if (dir || *it == "-include" || *it == "-imacros") {
+            list<string>::const_iterator next = it;
+
+            if (++next == local.end()) {
+                break;
+            }
+
+            arg = *++it;
+        } else if (it->compare(0, 2, "-I") == 0) {
+            arg = it->substr(2);
+            dir = true;
+        } else {
+            continue;
+        }
+
+        if (dir) {
+            char resolved[PATH_MAX];
+
+            if (realpath(arg.c_str(), resolved)) {
+                user_dirs.insert(resolved);
+            }
+        } else if (!scanner.addRoot(arg, true)) {
+            log_info() << "can't find " << arg << ", preprocessing locally" << endl;
+            return false;
+        }
+    }
+
+    if (!scanner.run()) {
+        return false;
+    }
+
+    /* What the compiler searches without being told to.  */
+    manifest.system_dirs.clear();
+
+    for (vector<string>::const_iterator it = bracket.begin(); it != bracket.end(); ++it) {
+        char resolved[PATH_MAX];
+
+        if (!realpath(it->c_str(), resolved) || !user_dirs.count(resolved)) {
+            manifest.system_dirs.push_back((*it)[0] == '/' ? *it
+                                           : job.workingDirectory() + '/' + *it);
+        }
+    }
+
+    manifest.cpp_flags = local;
+    manifest.files = scanner.files;
+    manifest.hashes = scanner.hashes;
+    trace() << "job includes at most " << manifest.files.size() << " files" << endl;
+    return true;
+}
@@ -0,0 +1,395 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* With $ICECC_HEDGE_DELAY set, a job that hasn't come back from the farm
+   after that many milliseconds is compiled here as well, and the result
+   that is there first is used.  */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+
+#include <comm.h>
+#include "client.h"
+#include "services/util.h"
+
+using namespace std;
+
+// exit status of the remote side when it has no result for the job
+#define NO_REMOTE_RESULT 42
+
+struct HedgeChild {
+    HedgeChild()
+        : pid(-1)
+        , exit_fd(-1)
+    {
+    }
+
+    pid_t pid;
+    int exit_fd;  // reads EOF once the child is gone
+    string out_file;  // its stdout and stderr
+    string err_file;
+};
+
+/* The file the dependencies of JOB go to, if it writes them.  */
+static string dependency_file(const CompileJob &job)
+{
+    list<string> flags = job.localFlags();
+    bool deps = false;
+    string file;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (*it == "-MD" || *it == "-MMD") {
+            deps = true;
+        } else if (*it == "-MF" && ++it != flags.end()) {
+            file = *it;
+        }
+    }
+
+    return deps ? file : string();
+}
+
+/* X.o becomes X.hedge.o.  */
+static string hedge_name(const string &file)
+{
+    string::size_type slash = file.find_last_of('/');
+    string::size_type dot = file.find_last_of('.');
+
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return file + ".hedge";
+    }
+
+    return file.substr(0, dot) + ".hedge" + file.substr(dot);
+}
+
+/* Forks CHILD with its stdout and stderr going to temporary files.
+   Returns like fork().  */
+static pid_t fork_child(HedgeChild &child)
+{
+    child.out_file = make_tmp_file(".out");
+    child.err_file = make_tmp_file(".err");
+    int pipe_fds[2];
+
+    if (child.out_file.empty() || child.err_file.empty() || pipe(pipe_fds) < 0) {
+        return -1;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+        int out_fd = open(child.out_file.c_str(), O_WRONLY | O_TRUNC);
+        int err_fd = open(child.err_file.c_str(), O_WRONLY | O_TRUNC);
+
+        if (out_fd < 0 || err_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0
+                || dup2(err_fd, STDERR_FILENO) < 0) {
+            _exit(EXIT_DISTCC_FAILED);
+        }
+
+        close(out_fd);
+        close(err_fd);
+        return 0;
+    }
+
+    close(pipe_fds[1]);
+    child.pid = pid;
+    child.exit_fd = pipe_fds[0];
+    return pid;
+}
+
+/* The local side compiles into files of its own, moved into place if it
+   wins, or the remote side would write over them.  The dependency file
+   keeps naming the real output.  */
+static CompileJob hedge_job(const CompileJob &job)
+{
+    CompileJob local_job = job;
+    local_job.setOutputFile(hedge_name(job.outputFile()));
+    list<string> flags = job.localFlags();
+    string deps = dependency_file(job);
+    bool target = false;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        if (*it == "-MT" || *it == "-MQ") {
+            target = true;
+        }
+    }
+
+    if (!deps.empty()) {
+        // the last -MF counts, and arg.cpp always adds one to -MD
+        local_job.appendFlag("-MF", Arg_Local);
+        local_job.appendFlag(hedge_name(deps), Arg_Local);
+
+        if (!target) {
+            local_job.appendFlag("-MQ", Arg_Local);
+            local_job.appendFlag(job.outputFile(), Arg_Local);
+        }
+    }
+
+    return local_job;
+}
+
+static bool start_local(const CompileJob &job, HedgeChild &child)
+{
+    pid_t pid = fork_child(child);
+
+    if (pid < 0) {
+        return false;
+    }
+
+    if (pid > 0) {
+        return true;
+    }
+
+    /* A connection of its own, the daemon counts the job against the
+       local slots like any other.  */
+    CompileJob local_job = hedge_job(job);
+    MsgChannel *local_daemon = connect_local_daemon();
+    struct rusage ru;
+
+    if (local_daemon && local_daemon->send_msg(JobLocalBeginMsg(0,
+                                              get_absfilename(job.outputFile())))) {
+        Msg *startme = local_daemon->get_msg(40 * 60);
+
+        if (!startme || startme->type != M_JOB_LOCAL_BEGIN) {
+            delete local_daemon;
+            local_daemon = 0;
+        }
+
+        delete startme;
+    } else {
+        delete local_daemon;
+        local_daemon = 0;
+    }
+
+    _exit(build_local(local_job, local_daemon, &ru));
+}
+
+static bool start_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &envs,
+                         int permill, HedgeChild &child)
+{
+    pid_t pid = fork_child(child);
+
+    if (pid < 0) {
+        return false;
+    }
+
+    if (pid > 0) {
+        return true;
+    }
+
+    int ret;
+
+    try {
+        ret = build_remote(job, local_daemon, envs, permill);
+
+        if (ret == 0) {
+            local_daemon->send_msg(EndMsg());
+        }
+    } catch (client_error &error) {
+        log_info() << "no remote result: " << error.what() << endl;
+        ret = NO_REMOTE_RESULT;
+    }
+
+    _exit(ret);
+}
+
+/* Waits for CHILD, after killing it if KILL_IT.  Returns its exit status.  */
+static int end_child(HedgeChild &child, bool kill_it)
+{
+    int status = 1;
+
+    if (kill_it) {
+        kill(child.pid, SIGTERM);
+    }
+
+    while (waitpid(child.pid, &status, 0) < 0 && errno == EINTR) {}
+
+    close(child.exit_fd);
+    child.pid = -1;
+    child.exit_fd = -1;
+    return kill_it ? -1 : shell_exit_status(status);
+}
+
+static void discard_output(HedgeChild &child)
+{
+    ::unlink(child.out_file.c_str());
+    ::unlink(child.err_file.c_str());
+}
+
+static void use_output(HedgeChild &child)
+{
+    copy_to_fd(child.out_file, STDOUT_FILENO);
+    copy_to_fd(child.err_file, STDERR_FILENO);
+    discard_output(child);
+}
+
+int build_hedged(CompileJob &job, MsgChannel *local_daemon, const Environments &envs,
+                 int permill, int delay)
+{
+    HedgeChild remote;
+    HedgeChild local;
+    int ret = -1;
+
+    if (!start_remote(job, local_daemon, envs, permill, remote)) {
+        throw client_error(34, "Error 34 - failed to start the remote job");
+    }
+
+    struct timeval deadline;
+    gettimeofday(&deadline, 0);
+    deadline.tv_sec += delay / 1000;
+    deadline.tv_usec += (delay % 1000) * 1000;
+
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+
+    while (ret < 0) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        int max_fd = -1;
+
+        if (remote.pid >= 0) {
+            FD_SET(remote.exit_fd, &read_set);
+            max_fd = remote.exit_fd;
+        }
+
+        if (local.pid >= 0) {
+            FD_SET(local.exit_fd, &read_set);
+            max_fd = max(max_fd, local.exit_fd);
+        }
+
+        struct timeval now;
+        struct timeval tv;
+        gettimeofday(&now, 0);
+        timersub(&deadline, &now, &tv);
+
+        if (tv.tv_sec < 0) {
+            timerclear(&tv);
+        }
+
+        bool waiting = local.pid < 0 && remote.pid >= 0;
+        int nfds = select(max_fd + 1, &read_set, 0, 0, waiting ? &tv : 0);
+
+        if (nfds < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (nfds < 0) {
+            log_perror("select failed");
+            break;
+        }
+
+        if (nfds == 0) {
+            log_info() << "no result from the farm after " << delay << " ms, compiling locally too"
+                       << endl;
+
+            if (!start_local(job, local)) {
+                log_perror("failed to start the local job");
+                deadline.tv_sec += 24 * 60 * 60;
+            }
+
+            continue;
+        }
+
+        if (remote.pid >= 0 && FD_ISSET(remote.exit_fd, &read_set)) {
+            int status = end_child(remote, false);
+
+            if (status != NO_REMOTE_RESULT) {
+                ret = status;
+                use_output(remote);
+                break;
+            }
+
+            discard_output(remote);
+
+            if (local.pid < 0 && !start_local(job, local)) {
+                throw client_error(35, "Error 35 - failed to start the local job");
+            }
+        }
+
+        if (local.pid >= 0 && FD_ISSET(local.exit_fd, &read_set)) {
+            ret = end_child(local, false);
+
+            if (remote.pid >= 0) {
+                log_info() << "the local job was done first" << endl;
+                end_child(remote, true);
+                discard_output(remote);
+                // what receive_file() left when it was killed
+                ::unlink((job.outputFile() + "_icetmp").c_str());
+            }
+
+            string deps = dependency_file(job);
+
+            if (ret == 0 && rename(hedge_name(job.outputFile()).c_str(),
+                                   job.outputFile().c_str()) < 0) {
+                log_perror("rename of the local output failed");
+                ret = EXIT_DISTCC_FAILED;
+            }
+
+            if (ret == 0 && !deps.empty()) {
+                ignore_result(rename(hedge_name(deps).c_str(), deps.c_str()));
+            }
+
+            use_output(local);
+        }
+    }
+
+    if (remote.pid >= 0) {
+        end_child(remote, true);
+        discard_output(remote);
+    }
+
+    if (local.pid >= 0) {
+        end_child(local, true);
+        discard_output(local);
+        ::unlink(hedge_name(job.outputFile()).c_str());
+
+        if (!dependency_file(job).empty()) {
+            ::unlink(hedge_name(dependency_file(job)).c_str());
+        }
+    }
+
+    if (ret < 0) {
+        throw client_error(36, "Error 36 - lost the jobs");
+    }
+
+    return ret;
+}
@@ -35,6 +35,8 @@
 #include <signal.h>
 #endif
 
+#include <map>
+
 #include <comm.h>
 #include "client.h"
 
@@ -45,7 +47,7 @@ const char *rs_program_name = "icecc";
 
 #define CLIENT_DEBUG 0
 
-static string compiler_path_lookup_helper(const string &compiler, const string &compiler_path)
+static string compiler_path_lookup_uncached(const string &compiler, const string &compiler_path)
 {
     if (compiler_path.find_first_of('/') != string::npos) {
         return compiler_path;
@@ -113,6 +115,22 @@ static string compiler_path_lookup_helper(const string &compiler, const string &
     return best_match;
 }
 
+/* The job looks up its compiler more than once (to preprocess, to find
+   the include directories, to build locally), each time going through
+   $PATH.  */
+static string compiler_path_lookup_helper(const string &compiler, const string &compiler_path)
+{
+    static map<pair<string, string>, string> found;
+    pair<string, string> key(compiler, compiler_path);
+    map<pair<string, string>, string>::const_iterator it = found.find(key);
+
+    if (it != found.end()) {
+        return it->second;
+    }
+
+    return found[key] = compiler_path_lookup_uncached(compiler, compiler_path);
+}
+
 string compiler_path_lookup(const string& compiler)
 {
     return compiler_path_lookup_helper(compiler, compiler);
@@ -213,6 +231,32 @@ static void handle_user_break(int sig)
  * log our resource usage.
  *
  **/
+MsgChannel *connect_local_daemon()
+{
+    if (getenv("ICECC_TEST_SOCKET")) {
+        return Service::createChannel(getenv("ICECC_TEST_SOCKET"));
+    }
+
+    /* try several options to reach the local daemon - 3 sockets, one TCP */
+    MsgChannel *local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("/var/run/iceccd.socket");
+    }
+
+    if (!local_daemon && getenv("HOME")) {
+        string path = getenv("HOME");
+        path += "/.iceccd.socket";
+        local_daemon = Service::createChannel(path);
+    }
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
+    }
+
+    return local_daemon;
+}
+
 int build_local(CompileJob &job, MsgChannel *local_daemon, struct rusage *used)
 {
     list<string> arguments;
@@ -0,0 +1,324 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utime.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+
+#include "job.h"
+#include "logging.h"
+#include "resultkey.h"
+#include "localcache.h"
+
+using namespace std;
+
+// megabytes kept without $ICECC_LOCAL_CACHE_SIZE
+#define DEFAULT_LOCAL_CACHE_SIZE 1024
+
+// the cache is trimmed after one in this many stored results
+#define TRIM_INTERVAL 16
+
+// seconds after which an incomplete result is thought to be left over
+#define STALE_RESULT_AGE 3600
+
+LocalCache *LocalCache::fromEnvironment()
+{
+    const char *dir = getenv("ICECC_LOCAL_CACHE");
+
+    if (!dir || !*dir) {
+        return 0;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        log_perror("mkdir for $ICECC_LOCAL_CACHE");
+        return 0;
+    }
+
+    size_t limit = DEFAULT_LOCAL_CACHE_SIZE;
+
+    if (const char *size = getenv("ICECC_LOCAL_CACHE_SIZE")) {
+        limit = atoi(size);
+    }
+
+    return new LocalCache(dir, limit * 1024 * 1024);
+}
+
+LocalCache::LocalCache(const string &_dir, size_t _limit)
+    : dir(_dir)
+    , limit(_limit)
+{
+}
+
+string LocalCache::path(const string &suffix) const
+{
+    return dir + "/" + key + suffix;
+}
+
+bool LocalCache::setKey(const CompileJob &job, const string &envs, const char *preproc_file)
+{
+    int fd = open(preproc_file, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    CompileJob keyed = job;
+    keyed.setEnvironmentVersion(envs);
+    ResultKey result_key(keyed);
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+        result_key.add(buffer, bytes);
+    }
+
+    close(fd);
+
+    if (bytes < 0) {
+        return false;
+    }
+
+    key = result_key.hex();
+    return true;
+}
+
+static bool read_file(const string &file, string &contents)
+{
+    contents.clear();
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return errno == ENOENT;
+    }
+
+    char buffer[8192];
+    size_t len;
+
+    while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        contents.append(buffer, len);
+    }
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+/* Copies what FD has to FILE, through a temporary file.  */
+static bool copy_fd_to(int fd, const string &file)
+{
+    string tmp_file = file + "_icetmp";
+    int out = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+
+    if (out < 0) {
+        return false;
+    }
+
+    char buffer[65536];
+    off_t off = 0;
+    ssize_t bytes;
+    bool ok = true;
+
+    while (ok && (bytes = pread(fd, buffer, sizeof(buffer), off)) != 0) {
+        if (bytes < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        ok = write(out, buffer, bytes) == bytes;
+        off += bytes;
+    }
+
+    if (close(out) != 0 || !ok || rename(tmp_file.c_str(), file.c_str()) != 0) {
+        unlink(tmp_file.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_file(const string &from, const string &to)
+{
+    int fd = open(from.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = copy_fd_to(fd, to);
+    close(fd);
+    return ok;
+}
+
+bool LocalCache::use(const CompileJob &job, string &out, string &err)
+{
+    if (key.empty() || access(path(".o").c_str(), R_OK) != 0) {
+        return false;
+    }
+
+    string output = job.outputFile();
+    string dwo_output = output.substr(0, output.find_last_of('.')) + ".dwo";
+
+    if (!read_file(path(".out"), out) || !read_file(path(".err"), err)
+            || (job.dwarfFissionEnabled() && !copy_file(path(".dwo"), dwo_output))
+            || !copy_file(path(".o"), output)) {
+        return false;
+    }
+
+    // the time of the object file tells how recently the result was used
+    utime(path(".o").c_str(), 0);
+    trace() << "using locally stored result " << key << endl;
+    return true;
+}
+
+void LocalCache::addFile(int fd, const string &suffix)
+{
+    if (key.empty()) {
+        return;
+    }
+
+    if (suffix != ".o") {
+        copy_fd_to(fd, path(suffix));
+        return;
+    }
+
+    char pid[32];
+    sprintf(pid, ".%d", (int) getpid());
+    obj_tmp = path(suffix) + pid;
+
+    if (!copy_fd_to(fd, obj_tmp)) {
+        obj_tmp.clear();
+    }
+}
+
+static bool write_file(const string &file, const string &contents)
+{
+    if (contents.empty()) {
+        return unlink(file.c_str()) == 0 || errno == ENOENT;
+    }
+
+    FILE *f = fopen(file.c_str(), "w");
+
+    if (!f) {
+        return false;
+    }
+
+    bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+    return fclose(f) == 0 && ok;
+}
+
+void LocalCache::store(const string &out, const string &err)
+{
+    if (obj_tmp.empty()) {
+        return;
+    }
+
+    if (!write_file(path(".out"), out) || !write_file(path(".err"), err)
+            || rename(obj_tmp.c_str(), path(".o").c_str()) != 0) {
+        unlink(obj_tmp.c_str());
+    }
+
+    obj_tmp.clear();
+
+    if (rand() % TRIM_INTERVAL == 0) {
+        trim();
+    }
+}
+
+/* Removes the least recently used results while they take more than the
+   limit, a result being all the files starting with its key.  */
+void LocalCache::trim()
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    struct Result {
+        Result() : used(0), changed(0), size(0) {}
+        time_t used;
+        time_t changed;
+        size_t size;
+        list<string> files;
+    };
+
+    map<string, Result> results;
+    size_t total = 0;
+
+    while (struct dirent *ent = readdir(d)) {
+        string name = ent->d_name;
+        struct stat st;
+
+        if (name[0] == '.' || stat((dir + "/" + name).c_str(), &st) != 0) {
+            continue;
+        }
+
+        string::size_type dot = name.find('.');
+        Result &result = results[name.substr(0, dot)];
+        result.size += st.st_size;
+        result.files.push_back(name);
+        result.changed = max(result.changed, st.st_mtime);
+        total += st.st_size;
+
+        if (dot != string::npos && name.compare(dot, string::npos, ".o") == 0) {
+            result.used = st.st_mtime;
+        }
+    }
+
+    closedir(d);
+
+    if (total <= limit) {
+        return;
+    }
+
+    /* Results without an object file are being stored, unless they were
+       left over long ago, then they go first.  */
+    multimap<time_t, const Result *> by_use;
+    time_t now = time(0);
+
+    for (map<string, Result>::const_iterator it = results.begin(); it != results.end(); ++it) {
+        if (it->second.used || now - it->second.changed > STALE_RESULT_AGE) {
+            by_use.insert(make_pair(it->second.used, &it->second));
+        }
+    }
+
+    for (multimap<time_t, const Result *>::const_iterator it = by_use.begin();
+            it != by_use.end() && total > limit; ++it) {
+        const list<string> &files = it->second->files;
+
+        for (list<string>::const_iterator f = files.begin(); f != files.end(); ++f) {
+            unlink((dir + "/" + *f).c_str());
+        }
+
+        total -= it->second->size;
+    }
+}
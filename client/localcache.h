@@ -0,0 +1,68 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_LOCALCACHE_H
+#define ICECREAM_LOCALCACHE_H
+
+#include <stddef.h>
+
+#include <string>
+
+class CompileJob;
+
+/* Results of remote jobs kept on this machine in $ICECC_LOCAL_CACHE, by
+   the same key as the daemons keep them (see ResultKey), so that a job
+   compiled before needs neither the scheduler nor a compile server.  Each
+   result is the object file KEY.o, and KEY.dwo, KEY.out and KEY.err if
+   there are such.  The object file is put in place last, so a result
+   without it is incomplete.  The least recently used results are removed
+   beyond $ICECC_LOCAL_CACHE_SIZE megabytes.  */
+class LocalCache
+{
+public:
+    // the cache, if $ICECC_LOCAL_CACHE is set and usable
+    static LocalCache *fromEnvironment();
+
+    // keys JOB, compiled with one of the environments ENVS, by the
+    // preprocessed source in PREPROC_FILE
+    bool setKey(const CompileJob &job, const std::string &envs, const char *preproc_file);
+
+    // puts a stored result in place of the output of JOB, with its stdout
+    // and stderr in OUT and ERR; false if there is none
+    bool use(const CompileJob &job, std::string &out, std::string &err);
+
+    // keeps what FD has as the file with SUFFIX (".o" or ".dwo") of the
+    // result, it's stored with store()
+    void addFile(int fd, const std::string &suffix);
+    void store(const std::string &out, const std::string &err);
+
+private:
+    LocalCache(const std::string &dir, size_t limit);
+
+    std::string path(const std::string &suffix) const;
+    void trim();
+
+    std::string dir;
+    size_t limit;
+    std::string key;
+    std::string obj_tmp;
+};
+
+#endif
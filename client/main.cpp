@@ -72,12 +72,15 @@ static void dcc_show_usage(void)
         "Usage:\n"
         "   icecc [compiler] [compile options] -o OBJECT -c SOURCE\n"
         "   icecc --build-native [compilertype] [file...]\n"
+        "   icecc --batch compile_commands.json [jobs]\n"
         "   icecc --help\n"
         "\n"
         "Options:\n"
         "   --help                     explain usage and exit\n"
         "   --version                  show version and exit\n"
         "   --build-native             create icecc environment\n"
+        "   --batch                    compile all entries of a compilation database, with\n"
+        "                              up to jobs (four per CPU by default) at a time\n"
         "Environment Variables:\n"
         "   ICECC                      If set to \"no\", just exec the real compiler.\n"
         "                              If set to \"disable\", just exec the real compiler, but without\n"
@@ -86,10 +89,15 @@ static void dcc_show_usage(void)
         "   ICECC_DEBUG                [info | warnings | debug]\n"
         "                              sets verboseness of icecream client.\n"
         "   ICECC_LOGFILE              if set, additional debug information is logged to the specified file\n"
+        "   ICECC_TRACE_FILE           if set, the phases of the job are appended to the file as\n"
+        "                              Chrome trace events, for chrome://tracing or Perfetto.\n"
         "   ICECC_REPEAT_RATE          the number of jobs out of 1000 that should be\n"
         "                              compiled on multiple hosts to ensure that they're\n"
         "                              producing the same output.  The default is 0.\n"
         "   ICECC_PREFERRED_HOST       overrides scheduler decisions if set.\n"
+        "   ICECC_JOB_CLASS            priority class of the jobs: interactive (the default),\n"
+        "                              ci or batch.  The scheduler shares the farm between\n"
+        "                              the submitters, weighted by the class.\n"
         "   ICECC_CC                   set C compiler name (default gcc).\n"
         "   ICECC_CXX                  set C++ compiler name (default g++).\n"
         "   ICECC_CLANG_REMOTE_CPP     set to 1 or 0 to override remote preprocessing with clang\n"
@@ -97,6 +105,26 @@ static void dcc_show_usage(void)
         "   ICECC_EXTRAFILES           additional files used in the compilation.\n"
         "   ICECC_COLOR_DIAGNOSTICS    set to 1 or 0 to override color diagnostics support.\n"
         "   ICECC_CARET_WORKAROUND     set to 1 or 0 to override gcc show caret workaround.\n"
+        "   ICECC_COMPRESSION          [zstd | lz4 | lzo | none][:level] codec for transfers, if\n"
+        "                              the remote side supports it; by default (auto) the codec\n"
+        "                              and level are chosen for each connection.\n"
+        "   ICECC_ENV_UPLOAD_RATE      KB/s environments are uploaded to compile servers with at\n"
+        "                              most, they go behind the jobs on the network anyway.\n"
+        "   ICECC_RAW_OUTPUT           set to 1 to get object files back uncompressed, useful\n"
+        "                              with compile servers on a fast local network.\n"
+        "   ICECC_LOCAL_CACHE          directory to keep the results of remote jobs in, a job\n"
+        "                              found there is neither scheduled nor sent anywhere.\n"
+        "   ICECC_LOCAL_CACHE_SIZE     megabytes kept in ICECC_LOCAL_CACHE, 1024 by default.\n"
+        "   ICECC_HEDGE_DELAY          milliseconds after which a job that hasn't come back from\n"
+        "                              the farm is compiled locally as well, whichever is done\n"
+        "                              first is used.\n"
+        "   ICECC_REMOTE_PREPROCESS    set to 1 to send the source and the headers it includes\n"
+        "                              instead of preprocessing, the compile server keeps the\n"
+        "                              headers and only asks for those it doesn't have.\n"
+        "   ICECC_DEDUP_SOURCES        set to 1 to send preprocessed sources as chunks, the\n"
+        "                              compile server keeps them and only asks for those it\n"
+        "                              doesn't have, like the parts of sources with the same\n"
+        "                              headers.\n"
         "\n");
 }
 
@@ -115,6 +143,11 @@ static void icerun_show_usage(void)
         "   ICECC_DEBUG                [info | warnings | debug]\n"
         "                              sets verboseness of icecream client.\n"
         "   ICECC_LOGFILE              if set, additional debug information is logged to the specified file\n"
+        "   ICERUN_OUTPUTS             colon separated files the command writes, if set and\n"
+        "                              ICECC_VERSION names an environment that has the command,\n"
+        "                              it is run on a compile server and the files are fetched.\n"
+        "   ICERUN_INPUTS              colon separated files the command reads, sent along.\n"
+        "                              Both are relative to the working directory.\n"
         "\n");
 }
 
@@ -271,6 +304,17 @@ int main(int argc, char **argv)
     string compiler_name = argv[0];
     dcc_client_catch_signals();
 
+    // the jobs of a batch come back here in their own process
+    if (argc > 1 && !strcmp(argv[1], "--batch") && find_basename(compiler_name) == rs_program_name) {
+        int ret = run_batch(argc, argv);
+
+        if (ret >= 0) {
+            return ret;
+        }
+
+        compiler_name = argv[0];
+    }
+
     char cwd[ PATH_MAX ];
     if( getcwd( cwd, PATH_MAX ) != NULL )
         job.setWorkingDirectory( cwd );
@@ -340,7 +384,14 @@ int main(int argc, char **argv)
     dcc_ignore_sigpipe(1);
 
     list<string> extrafiles;
-    local |= analyse_argv(argv, job, icerun, &extrafiles);
+    bool always_local = analyse_argv(argv, job, icerun, &extrafiles);
+
+    if (icerun && remote_command(job)) {
+        log_info() << "running " << job.compilerName() << " remotely" << endl;
+        always_local = false;
+    }
+
+    local |= always_local;
 
     /* If ICECC is set to disable, then run job locally, without contacting
        the daemon at all. Because of file-based locking that is used in this
@@ -387,30 +438,11 @@ int main(int argc, char **argv)
         }
     }
 
-    MsgChannel *local_daemon;
-    if (getenv("ICECC_TEST_SOCKET") == NULL) {
-        /* try several options to reach the local daemon - 3 sockets, one TCP */
-        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("/var/run/iceccd.socket");
-        }
-
-        if (!local_daemon && getenv("HOME")) {
-            string path = getenv("HOME");
-            path += "/.iceccd.socket";
-            local_daemon = Service::createChannel(path);
-        }
+    MsgChannel *local_daemon = connect_local_daemon();
 
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
-        }
-    } else {
-        local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
-        if (!local_daemon) {
-            log_error() << "test socket error" << endl;
-            return EXIT_TEST_SOCKET_ERROR;
-        }
+    if (!local_daemon && getenv("ICECC_TEST_SOCKET")) {
+        log_error() << "test socket error" << endl;
+        return EXIT_TEST_SOCKET_ERROR;
     }
 
     if (!local_daemon) {
@@ -497,14 +529,22 @@ int main(int argc, char **argv)
             // check if it should be compiled three times
             const char *s = getenv("ICECC_REPEAT_RATE");
             int rate = s ? atoi(s) : 0;
-            ret = build_remote(job, local_daemon, envs, rate);
+            const char *hedge = getenv("ICECC_HEDGE_DELAY");
+            int delay = hedge ? atoi(hedge) : 0;
+
+            // the name of the .dwo is in the object, it can't be moved
+            if (delay > 0 && !job.dwarfFissionEnabled() && !icerun) {
+                ret = build_hedged(job, local_daemon, envs, rate, delay);
+            } else {
+                ret = build_remote(job, local_daemon, envs, rate);
+            }
 
             /* We have to tell the local daemon that everything is fine and
                that the remote daemon will send the scheduler our done msg.
                If we don't, the local daemon will have to assume the job failed
                and tell the scheduler - and that fail message may arrive earlier
                than the remote daemon's success msg. */
-            if (ret == 0) {
+            if (ret == 0 && delay <= 0) {
                 local_daemon->send_msg(EndMsg());
             }
         } catch (remote_error& error) {
@@ -25,7 +25,11 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include <sys/wait.h>
 
 
@@ -41,8 +45,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include <map>
 #include <algorithm>
+#include <fstream>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <vector>
@@ -50,7 +56,8 @@
 #include <comm.h>
 #include "client.h"
 #include "tempfile.h"
-#include "md5.h"
+#include "resultkey.h"
+#include "localcache.h"
 #include "services/util.h"
 
 #ifndef O_LARGEFILE
@@ -163,7 +170,7 @@ rip_out_paths(const Environments &envs, map<string, string> &version_map, map<st
 
     Environments env2;
 
-    static const char *suffs[] = { ".tar.bz2", ".tar.gz", ".tar", ".tgz", NULL };
+    static const char *suffs[] = { ".tar.bz2", ".tar.gz", ".tar", ".tgz", ".tar.zst", ".squashfs", ".erofs", NULL };
 
     string versfile;
 
@@ -228,6 +235,7 @@ get_absfilename(const string &_file)
 
 static UseCSMsg *get_server(MsgChannel *local_daemon)
 {
+    log_block b("wait for scheduler");
     Msg *umsg = local_daemon->get_msg(4 * 60);
 
     if (!umsg || umsg->type != M_USE_CS) {
@@ -250,31 +258,90 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
-static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
+static string lookup(const map<string, string> &m, const string &key)
+{
+    map<string, string>::const_iterator it = m.find(key);
+    return it == m.end() ? string() : it->second;
+}
+
+static void write_failed(int cpp_fd, MsgChannel *cserver)
+{
+    Msg *m = cserver->get_msg(2);
+    check_for_failure(m, cserver);
+
+    log_error() << "write of source chunk to host "
+                << cserver->name.c_str() << endl;
+    log_perror("failed ");
+    close(cpp_fd);
+    throw client_error(15, "Error 15 - write to host failed");
+}
+
+/* Reading from cpp, compressing and sending are overlapped: chunks are only
+   queued on the channel and written out whenever the socket takes more data,
+   while we go on reading the next chunk.  At most PIPELINE_CHUNKS compressed
+   chunks are kept queued before we stop reading and wait for the network.
+   What is sent is added to KEY, if given.  */
+#define PIPELINE_CHUNKS 4
+
+static void write_server_cpp(int cpp_fd, MsgChannel *cserver, ResultKey *key = 0)
 {
     unsigned char buffer[100000]; // some random but huge number
     off_t offset = 0;
     size_t uncompressed = 0;
     size_t compressed = 0;
+    bool input_done = false;
 
-    do {
-        ssize_t bytes;
+    while (!input_done || cserver->pending()) {
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        int max_fd = -1;
 
-        do {
-            bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
+        if (!input_done && cserver->pending() < PIPELINE_CHUNKS * sizeof(buffer)) {
+            FD_SET(cpp_fd, &read_set);
+            max_fd = cpp_fd;
+        }
 
-            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
-                continue;
-            }
+        if (cserver->pending()) {
+            FD_SET(cserver->fd, &write_set);
+            max_fd = std::max(max_fd, cserver->fd);
+        }
 
-            if (bytes < 0) {
-                log_perror("reading from cpp_fd");
-                close(cpp_fd);
-                throw client_error(16, "Error 16 - error reading local cpp file");
-            }
+        /* Only time out while the network doesn't take our data, cpp may
+           legitimately take a long time.  */
+        struct timeval tv;
+        tv.tv_sec = 20;
+        tv.tv_usec = 0;
+        int ret = select(max_fd + 1, &read_set, &write_set, NULL,
+                         cserver->pending() ? &tv : NULL);
 
-            break;
-        } while (1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            write_failed(cpp_fd, cserver);
+        }
+
+        if (FD_ISSET(cserver->fd, &write_set) && !cserver->flush(false)) {
+            write_failed(cpp_fd, cserver);
+        }
+
+        if (!FD_ISSET(cpp_fd, &read_set)) {
+            continue;
+        }
+
+        ssize_t bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
+
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            log_perror("reading from cpp_fd");
+            close(cpp_fd);
+            throw client_error(16, "Error 16 - error reading local cpp file");
+        }
 
         offset += bytes;
 
@@ -282,15 +349,12 @@ static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
             if (offset) {
                 FileChunkMsg fcmsg(buffer, offset);
 
-                if (!cserver->send_msg(fcmsg)) {
-                    Msg *m = cserver->get_msg(2);
-                    check_for_failure(m, cserver);
+                if (key) {
+                    key->add(buffer, offset);
+                }
 
-                    log_error() << "write of source chunk to host "
-                                << cserver->name.c_str() << endl;
-                    log_perror("failed ");
-                    close(cpp_fd);
-                    throw client_error(15, "Error 15 - write to host failed");
+                if (!cserver->send_msg(fcmsg, MsgChannel::SendQueued)) {
+                    write_failed(cpp_fd, cserver);
                 }
 
                 uncompressed += fcmsg.len;
@@ -299,22 +363,559 @@ static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
             }
 
             if (!bytes) {
-                break;
+                input_done = true;
             }
         }
-    } while (1);
+    }
 
     if (compressed)
         trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
-                "%)" << endl;
+                "%, " << cserver->compressionMode() << ")" << endl;
 
     close(cpp_fd);
 }
 
-static void receive_file(const string& output_file, MsgChannel* cserver)
+/* Sends DATA, the preprocessed source kept in memory, adding it to KEY,
+   if given.  */
+static void write_server_buffer(const string &data, MsgChannel *cserver, ResultKey *key = 0)
 {
-    string tmp_file = output_file + "_icetmp";
-    int obj_fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 0666);
+    const size_t chunk = 100000;
+
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+        unsigned char *buffer = (unsigned char *) data.data() + offset;
+        FileChunkMsg fcmsg(buffer, min(chunk, data.size() - offset));
+
+        if (key) {
+            key->add(buffer, fcmsg.len);
+        }
+
+        if (!cserver->send_msg(fcmsg)) {
+            write_failed(-1, cserver);
+        }
+    }
+}
+
+/* Sends MANIFEST and then the files the server asks for, adding the
+   manifest to KEY, if given.  */
+static void write_server_headers(const HeaderManifestMsg &manifest, MsgChannel *cserver,
+                                 ResultKey *key = 0)
+{
+    if (!cserver->send_msg(manifest)) {
+        log_info() << "write of header manifest failed" << endl;
+        throw client_error(9, "Error 9 - error sending file to remote");
+    }
+
+    Msg *msg = cserver->get_msg(60);
+    check_for_failure(msg, cserver);
+    HeaderRequestMsg *request = dynamic_cast<HeaderRequestMsg *>(msg);
+
+    if (!request) {
+        delete msg;
+        throw remote_error(104, "Error 104 - remote did not ask for the headers, recompiling locally");
+    }
+
+    map<string, string> files;
+    list<string>::const_iterator file = manifest.files.begin();
+    list<string>::const_iterator hash = manifest.hashes.begin();
+
+    for (; file != manifest.files.end(); ++file, ++hash) {
+        files[*hash] = *file;
+    }
+
+    for (list<string>::const_iterator it = request->hashes.begin(); it != request->hashes.end(); ++it) {
+        string path = lookup(files, *it);
+        int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            delete msg;
+            throw remote_error(104, "Error 104 - remote asked for an unknown header, recompiling locally");
+        }
+
+        write_server_cpp(fd, cserver);
+
+        if (!cserver->send_msg(EndMsg())) {
+            delete msg;
+            log_info() << "write of header end failed" << endl;
+            throw client_error(12, "Error 12 - failed to send file to remote");
+        }
+    }
+
+    trace() << "sent " << request->hashes.size() << " of " << manifest.files.size() << " headers"
+            << endl;
+    delete msg;
+
+    if (key) {
+        const list<string> *parts[] = { &manifest.cpp_flags, &manifest.system_dirs,
+                                        &manifest.files, &manifest.hashes };
+
+        for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+            for (list<string>::const_iterator it = parts[i]->begin(); it != parts[i]->end(); ++it) {
+                key->add(it->c_str(), it->size() + 1);
+            }
+        }
+    }
+}
+
+/* Content-defined chunks: a boundary is where the gear hash of the bytes
+   before it has its top CHUNK_BITS bits clear, so about every 8 KB past
+   CHUNK_MIN.  It depends only on the last 32 bytes, so two sources sharing
+   some part, like the headers at their start, mostly share its chunks.  */
+#define CHUNK_MIN 2048
+#define CHUNK_MAX 65536
+#define CHUNK_BITS 13
+
+static void chunk_boundaries(const string &data, vector<size_t> &ends)
+{
+    static uint32_t gear[256];
+
+    // the same on every client, for the chunks to be the same
+    if (!gear[0]) {
+        uint32_t x = 2463534242U;
+
+        for (int i = 0; i < 256; ++i) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            gear[i] = x;
+        }
+    }
+
+    const uint32_t mask = ~(~0U >> CHUNK_BITS);
+    size_t start = 0;
+
+    while (start < data.size()) {
+        size_t end = min(start + CHUNK_MAX, data.size());
+        size_t cut = end;
+        uint32_t hash = 0;
+
+        for (size_t pos = start + CHUNK_MIN; pos < end; ++pos) {
+            hash = (hash << 1) + gear[(unsigned char) data[pos]];
+
+            if (!(hash & mask)) {
+                cut = pos + 1;
+                break;
+            }
+        }
+
+        ends.push_back(cut);
+        start = cut;
+    }
+}
+
+/* Sends SOURCE, the preprocessed source, as ChunkManifestMsg and then the
+   chunks the server asks for, adding SOURCE to KEY, if given.  */
+static void write_server_chunks(const string &source, MsgChannel *cserver, ResultKey *key = 0)
+{
+    vector<size_t> ends;
+    chunk_boundaries(source, ends);
+
+    ChunkManifestMsg manifest;
+    map<string, pair<size_t, size_t> > chunks;
+    size_t start = 0;
+
+    for (vector<size_t>::const_iterator it = ends.begin(); it != ends.end(); ++it) {
+        ResultKey hash;
+        hash.add(source.data() + start, *it - start);
+        manifest.hashes.push_back(hash.hex());
+        chunks[manifest.hashes.back()] = make_pair(start, *it - start);
+        start = *it;
+    }
+
+    if (key) {
+        key->add(source.data(), source.size());
+    }
+
+    if (!cserver->send_msg(manifest)) {
+        log_info() << "write of chunk manifest failed" << endl;
+        throw client_error(9, "Error 9 - error sending file to remote");
+    }
+
+    Msg *msg = cserver->get_msg(60);
+    check_for_failure(msg, cserver);
+    HeaderRequestMsg *request = dynamic_cast<HeaderRequestMsg *>(msg);
+
+    if (!request) {
+        delete msg;
+        throw remote_error(111, "Error 111 - remote did not ask for the chunks, recompiling locally");
+    }
+
+    size_t sent = 0;
+
+    for (list<string>::const_iterator it = request->hashes.begin(); it != request->hashes.end(); ++it) {
+        map<string, pair<size_t, size_t> >::const_iterator chunk = chunks.find(*it);
+
+        if (chunk == chunks.end()) {
+            delete msg;
+            throw remote_error(111, "Error 111 - remote asked for an unknown chunk, recompiling locally");
+        }
+
+        FileChunkMsg fcmsg((unsigned char *) source.data() + chunk->second.first,
+                           chunk->second.second);
+
+        if (!cserver->send_msg(fcmsg) || !cserver->send_msg(EndMsg())) {
+            delete msg;
+            write_failed(-1, cserver);
+        }
+
+        sent += fcmsg.len;
+    }
+
+    trace() << "sent " << request->hashes.size() << " of " << manifest.hashes.size()
+            << " chunks, " << sent << " of " << source.size() << " bytes" << endl;
+    delete msg;
+}
+
+/* Reads the preprocessed source in FILE into SOURCE.  */
+static bool read_source(const char *file, string &source)
+{
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            close(fd);
+            return false;
+        }
+
+        source.append(buffer, bytes);
+    }
+
+    close(fd);
+    return true;
+}
+
+/* The precompiled header of the job and its MD5, sent to the compile
+   server before the source (CompileFileMsg::pch).  Only set while a single
+   job is compiled, see build_remote().  */
+static string pch_file, pch_hash;
+
+/* The MD5 of the contents of FILE, empty if it can't be read.  */
+static string file_hash(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    ResultKey contents;
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            close(fd);
+            return string();
+        }
+
+        contents.add(buffer, bytes);
+    }
+
+    close(fd);
+    return contents.hex();
+}
+
+/* Sends the precompiled header of JOB like a header, so a server has it
+   from an earlier job already mostly.  */
+static void write_server_pch(const CompileJob &job, MsgChannel *cserver, ResultKey *key = 0)
+{
+    HeaderManifestMsg manifest;
+    manifest.files.push_back(pch_file[0] == '/' ? pch_file
+                             : job.workingDirectory() + '/' + pch_file);
+    manifest.hashes.push_back(pch_hash);
+    write_server_headers(manifest, cserver, key);
+}
+
+/* The bitcode of a ThinLTO backend job, its index and the modules the index
+   imports from, or the inputs of a command, sent like the headers of a job
+   the server preprocesses.  Only set while a single job is compiled, see
+   build_remote().  */
+static HeaderManifestMsg job_files;
+
+static bool is_command(const CompileJob &job)
+{
+    return job.language() == CompileJob::Lang_Custom;
+}
+
+/* The paths in the colon separated list of $NAME, false if one of them
+   is absolute.  */
+static bool command_paths(const char *name, list<string> &paths)
+{
+    const char *value = getenv(name);
+
+    for (const char *start = value; start && *start;) {
+        const char *colon = strchr(start, ':');
+        string path = colon ? string(start, colon - start) : string(start);
+        start = colon ? colon + 1 : 0;
+
+        if (path.empty()) {
+            continue;
+        }
+
+        if (path[0] == '/') {
+            log_info() << "$" << name << " has the absolute path " << path << endl;
+            return false;
+        }
+
+        paths.push_back(path);
+    }
+
+    return true;
+}
+
+bool remote_command(CompileJob &job)
+{
+    list<string> outputs;
+
+    if (!getenv("ICERUN_OUTPUTS") || !getenv("ICECC_VERSION")
+            || !command_paths("ICERUN_OUTPUTS", outputs) || outputs.empty()) {
+        return false;
+    }
+
+    /* The server gets the arguments as the rest ones, and the command as
+       the compiler.  */
+    list<string> flags = job.allFlags();
+    ArgumentsList args;
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        args.append(*it, Arg_Rest);
+    }
+
+    job.setFlags(args);
+    job.setCommandOutputs(outputs);
+    return true;
+}
+
+/* Fills MANIFEST with the files $ICERUN_INPUTS names for the command JOB.  */
+static bool command_files(const CompileJob &job, HeaderManifestMsg &manifest)
+{
+    list<string> inputs;
+
+    if (!command_paths("ICERUN_INPUTS", inputs)) {
+        return false;
+    }
+
+    for (list<string>::const_iterator it = inputs.begin(); it != inputs.end(); ++it) {
+        string hash = file_hash(*it);
+
+        if (hash.empty()) {
+            log_perror(("reading " + *it).c_str());
+            return false;
+        }
+
+        manifest.files.push_back(job.workingDirectory() + '/' + *it);
+        manifest.hashes.push_back(hash);
+    }
+
+    return true;
+}
+
+/* Fills MANIFEST for JOB from the .imports file the thin link wrote next to
+   the index (-Wl,-plugin-opt,thinlto-emit-imports-files).  The server
+   finds the modules where the index names them from the working directory,
+   which is why absolute names don't do.  */
+static bool thinlto_files(const CompileJob &job, HeaderManifestMsg &manifest)
+{
+    string index = job.thinLTOIndex();
+    string::size_type suffix = index.rfind(".thinlto.bc");
+    ifstream imports;
+
+    if (suffix != string::npos) {
+        imports.open((index.substr(0, suffix) + ".imports").c_str());
+    }
+
+    if (!imports) {
+        log_info() << "no imports file for " << index << endl;
+        return false;
+    }
+
+    list<string> files;
+    files.push_back(job.inputFile());
+    files.push_back(index);
+    string module;
+
+    while (getline(imports, module)) {
+        if (module.empty()) {
+            continue;
+        }
+
+        if (module[0] == '/') {
+            log_info() << "ThinLTO module " << module << " has an absolute name" << endl;
+            return false;
+        }
+
+        files.push_back(module);
+    }
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        string hash = file_hash(*it);
+
+        if (hash.empty()) {
+            log_perror(("reading " + *it).c_str());
+            return false;
+        }
+
+        manifest.files.push_back((*it)[0] == '/' ? *it : job.workingDirectory() + '/' + *it);
+        manifest.hashes.push_back(hash);
+    }
+
+    manifest.cpp_flags.push_back("-fthinlto-index=" + *++manifest.files.begin());
+    return true;
+}
+
+/* The environment tarball is compressed already, so only its start is sent
+   as a FileChunkMsg (the daemon looks at it to pick the decompressor), the
+   rest goes to the socket as is with sendfile().  */
+static void write_server_env(int env_fd, size_t size, MsgChannel *cserver)
+{
+    unsigned char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = read(env_fd, buffer, sizeof(buffer))) < 0 && errno == EINTR) {}
+
+    if (bytes < 0) {
+        log_perror("reading environment");
+        close(env_fd);
+        throw client_error(16, "Error 16 - error reading environment");
+    }
+
+    FileChunkMsg fcmsg(buffer, bytes);
+
+    if (!cserver->send_msg(fcmsg)
+            || ((size_t) bytes < size && !cserver->send_raw_file(env_fd, size - bytes))) {
+        write_failed(env_fd, cserver);
+    }
+
+    trace() << "sent " << size << " bytes of environment" << endl;
+    close(env_fd);
+}
+
+/* Receives the raw object file announced by a FileRawMsg into obj_fd.  The
+   file is allocated in one go and, where possible, mapped so that the data
+   is read from the socket directly into the page cache.  */
+static bool receive_raw_file(int obj_fd, size_t len, MsgChannel *cserver)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+    // just a hint for the filesystem, ftruncate() below is what matters
+    posix_fallocate(obj_fd, 0, len);
+#endif
+
+    if (ftruncate(obj_fd, len) != 0) {
+        return false;
+    }
+
+    char *map = 0;
+
+#ifdef HAVE_MMAP
+    if (len) {
+        map = (char *) mmap(NULL, len, PROT_WRITE, MAP_SHARED, obj_fd, 0);
+
+        if (map == MAP_FAILED) {
+            map = 0;
+        }
+    }
+#endif
+
+    size_t received = 0;
+    bool ok = true;
+
+    while (cserver->raw_pending()) {
+        ssize_t ret;
+
+        if (map) {
+            ret = cserver->read_raw(map + received, len - received);
+        } else {
+            ret = cserver->read_raw(obj_fd);
+        }
+
+        if (ret < 0) {
+            ok = false;
+            break;
+        }
+
+        received += ret;
+
+        if (ret == 0) {
+            fd_set read_set;
+            FD_ZERO(&read_set);
+            FD_SET(cserver->fd, &read_set);
+            struct timeval tv;
+            tv.tv_sec = 40;
+            tv.tv_usec = 0;
+
+            if (select(cserver->fd + 1, &read_set, NULL, NULL, &tv) <= 0 && errno != EINTR) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+#ifdef HAVE_MMAP
+    if (map) {
+        munmap(map, len);
+    }
+#endif
+
+    return ok;
+}
+
+/* A job compiled more than once for verification (ICECC_REPEAT_RATE) gets
+   what it receives hashed instead of read again afterwards, and only the
+   first one writes its output.  Only set in the children compiling those,
+   see build_remote().  */
+static bool hash_output = false;
+static bool discard_output = false;
+static uint64_t output_hash = 14695981039346656037ULL;
+
+static void hash_received(const unsigned char *data, size_t len)
+{
+    // FNV-1a, it only has to tell apart what the servers compiled
+    for (size_t i = 0; i < len; ++i) {
+        output_hash = (output_hash ^ data[i]) * 1099511628211ULL;
+    }
+}
+
+static void hash_file(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    unsigned char buffer[65536];
+    ssize_t bytes;
+
+    while (fd >= 0 && (bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            break;
+        }
+
+        hash_received(buffer, bytes);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int open_output_file(const string &tmp_file)
+{
+    int obj_fd = open(discard_output ? "/dev/null" : tmp_file.c_str(),
+                      O_CREAT | O_TRUNC | O_RDWR | O_LARGEFILE, 0666);
 
     if (obj_fd == -1) {
         std::string errmsg("can't create ");
@@ -323,6 +924,43 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
         throw client_error(31, "Error 31 - " + errmsg);
     }
 
+    return obj_fd;
+}
+
+/* Where the results of remote jobs are kept on this machine, if anywhere.
+   Only set while a single job is compiled, see build_remote().  */
+static LocalCache *local_cache = 0;
+
+/* Closes FD, which OUTPUT_FILE was received into, and moves it into
+   place.  With a CACHE_SUFFIX it's kept in the local cache too.  */
+static void finish_file(const string &output_file, int fd, const char *cache_suffix)
+{
+    string tmp_file = output_file + "_icetmp";
+
+    // it's still in the page cache
+    if (cache_suffix && local_cache) {
+        local_cache->addFile(fd, cache_suffix);
+    }
+
+    if (close(fd) != 0
+            || (!discard_output && rename(tmp_file.c_str(), output_file.c_str()) != 0)) {
+        unlink(tmp_file.c_str());
+        throw client_error(30, "Error 30 - error closing temp file");
+    }
+}
+
+/* Receives OUTPUT_FILE, continuing in OBJ_FD if the start of it came before
+   the compile result already (CompileFileMsg::stream_output).  With a
+   CACHE_SUFFIX it's kept in the local cache too.  */
+static void receive_file(const string& output_file, MsgChannel* cserver, int obj_fd = -1,
+                         const char *cache_suffix = 0)
+{
+    string tmp_file = output_file + "_icetmp";
+
+    if (obj_fd == -1) {
+        obj_fd = open_output_file(tmp_file);
+    }
+
     Msg* msg = 0;
     size_t uncompressed = 0;
     size_t compressed = 0;
@@ -343,57 +981,467 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
             break;
         }
 
-        if (msg->type != M_FILE_CHUNK) {
-            unlink(tmp_file.c_str());
-            delete msg;
-            throw client_error(20, "Error 20 - unexpcted message");
+        if (msg->type == M_FILE_RAW) {
+            size_t len = static_cast<FileRawMsg*>(msg)->len;
+            trace() << "receiving " << len << " bytes raw" << endl;
+
+            if (!receive_raw_file(obj_fd, len, cserver)) {
+                unlink(tmp_file.c_str());
+                delete msg;
+                throw client_error(21, "Error 21 - error writing file");
+            }
+
+            compressed += len;
+            uncompressed += len;
+            continue;
+        }
+
+        if (msg->type != M_FILE_CHUNK) {
+            unlink(tmp_file.c_str());
+            delete msg;
+            throw client_error(20, "Error 20 - unexpcted message");
+        }
+
+        FileChunkMsg *fcmsg = dynamic_cast<FileChunkMsg*>(msg);
+        compressed += fcmsg->compressed;
+        uncompressed += fcmsg->len;
+
+        if (hash_output) {
+            hash_received(fcmsg->buffer, fcmsg->len);
+        }
+
+        if (write(obj_fd, fcmsg->buffer, fcmsg->len) != (ssize_t)fcmsg->len) {
+            unlink(tmp_file.c_str());
+            delete msg;
+            throw client_error(21, "Error 21 - error writing file");
+        }
+    }
+
+    if (uncompressed)
+        trace() << "got " << compressed << " bytes ("
+                << (compressed * 100 / uncompressed) << "%)" << endl;
+
+    delete msg;
+    finish_file(output_file, obj_fd, cache_suffix);
+}
+
+/* Receives the object file OBJ_OUTPUT and DWO_OUTPUT at once, see
+   CompileFileMsg::interleaved_output.  Each is moved into place as soon as
+   it is complete.  */
+static void receive_files(const string &obj_output, const string &dwo_output,
+                          MsgChannel *cserver, bool keep)
+{
+    const string outputs[OutputChunkMsg::OUTPUT_FILES] = { obj_output, dwo_output };
+    const char *const suffixes[OutputChunkMsg::OUTPUT_FILES] = { ".o", ".dwo" };
+    int fds[OutputChunkMsg::OUTPUT_FILES];
+    int open_files = 0;
+    size_t uncompressed = 0;
+    size_t compressed = 0;
+
+    for (int i = 0; i < OutputChunkMsg::OUTPUT_FILES; ++i, ++open_files) {
+        try {
+            fds[i] = open_output_file(outputs[i] + "_icetmp");
+        } catch (...) {
+            for (int j = 0; j < i; ++j) {
+                close(fds[j]);
+                unlink((outputs[j] + "_icetmp").c_str());
+            }
+
+            throw;
+        }
+    }
+
+    Msg *msg = 0;
+
+    try {
+        while (open_files) {
+            delete msg;
+            msg = cserver->get_msg(40);
+
+            if (!msg) {   // the network went down?
+                throw client_error(19, "Error 19 - (network failure?)");
+            }
+
+            check_for_failure(msg, cserver);
+            OutputChunkMsg *ocmsg = dynamic_cast<OutputChunkMsg *>(msg);
+
+            if (!ocmsg || ocmsg->file >= OutputChunkMsg::OUTPUT_FILES || fds[ocmsg->file] == -1) {
+                throw client_error(20, "Error 20 - unexpcted message");
+            }
+
+            int &fd = fds[ocmsg->file];
+            compressed += ocmsg->compressed;
+            uncompressed += ocmsg->len;
+
+            if (!ocmsg->len) {
+                int done_fd = fd;
+                fd = -1;
+                open_files--;
+                finish_file(outputs[ocmsg->file], done_fd, keep ? suffixes[ocmsg->file] : 0);
+                continue;
+            }
+
+            if (write(fd, ocmsg->buffer, ocmsg->len) != (ssize_t)ocmsg->len) {
+                throw client_error(21, "Error 21 - error writing file");
+            }
+        }
+    } catch (...) {
+        delete msg;
+
+        for (int i = 0; i < OutputChunkMsg::OUTPUT_FILES; ++i) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+                unlink((outputs[i] + "_icetmp").c_str());
+            }
+        }
+
+        throw;
+    }
+
+    delete msg;
+
+    if (uncompressed)
+        trace() << "got " << compressed << " bytes ("
+                << (compressed * 100 / uncompressed) << "%) of both outputs" << endl;
+}
+
+/* The environments by platform and their files for a duplicate of the job,
+   which the scheduler has compiled on another server too if the first one
+   takes much longer than expected (protocol 46).  Only set while a single
+   job is compiled, see build_remote().  */
+static const map<string, string> *duplicate_versions = 0;
+static const map<string, string> *duplicate_version_files = 0;
+
+/* A duplicate of the job, compiled in a child.  */
+struct Duplicate {
+    Duplicate()
+        : pid(-1)
+        , exit_fd(-1)
+    {
+    }
+
+    pid_t pid;
+    int exit_fd;  // reads EOF once the child is gone
+    string hostname;
+    CompileJob job;
+    string out_file;  // its stdout and stderr
+    string err_file;
+};
+
+static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
+                            const string &environment, const string &version_file,
+                            const char *preproc_file, bool output,
+                            const string *preprocessed = 0);
+static int preprocess_to_memory(CompileJob &job, string &preprocessed);
+
+string make_tmp_file(const char *suffix)
+{
+    char *name = 0;
+
+    if (dcc_make_tmpnam("icecc", suffix, &name, 0) != 0) {
+        return string();
+    }
+
+    string result = name;
+    free(name);
+    return result;
+}
+
+void copy_to_fd(const string &file, int fd)
+{
+    int in = open(file.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return;
+    }
+
+    char buffer[8192];
+    ssize_t len;
+
+    while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+        ignore_result(write(fd, buffer, len));
+    }
+
+    close(in);
+}
+
+/* Compiles JOB on the server of USECS in a child, into files next to the
+   output of JOB, and with the diagnostics going to temporary files.  */
+static bool start_duplicate(const CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
+                            MsgChannel *cserver, Duplicate &duplicate)
+{
+    string output = job.outputFile();
+    string::size_type dot = output.find_last_of('.');
+    duplicate.job = job;
+    duplicate.job.setOutputFile(output.substr(0, dot) + ".duplicate"
+                                + (dot == string::npos ? string() : output.substr(dot)));
+    duplicate.hostname = usecs->hostname;
+    duplicate.out_file = make_tmp_file(".out");
+    duplicate.err_file = make_tmp_file(".err");
+    int pipe_fds[2];
+
+    if (duplicate.out_file.empty() || duplicate.err_file.empty() || pipe(pipe_fds) < 0) {
+        return false;
+    }
+
+    trace() << "compiling a duplicate on " << usecs->hostname << endl;
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+        close(cserver->fd);
+        int out_fd = open(duplicate.out_file.c_str(), O_WRONLY | O_TRUNC);
+        int err_fd = open(duplicate.err_file.c_str(), O_WRONLY | O_TRUNC);
+
+        if (out_fd < 0 || err_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0
+                || dup2(err_fd, STDERR_FILENO) < 0) {
+            _exit(42);
+        }
+
+        int ret = 42;
+
+        try {
+            string environment = lookup(*duplicate_versions, usecs->host_platform);
+            string version_file = lookup(*duplicate_version_files, usecs->host_platform);
+            duplicate_versions = duplicate_version_files = 0;
+            local_cache = 0;
+            ret = build_remote_int(duplicate.job, usecs, local_daemon, environment, version_file,
+                                   0, true);
+        } catch (std::exception &error) {
+            log_info() << "the duplicate failed: " << error.what() << endl;
+            ret = 42;
+        }
+
+        _exit(ret);
+    }
+
+    close(pipe_fds[1]);
+    duplicate.pid = pid;
+    duplicate.exit_fd = pipe_fds[0];
+
+    /* A connection passed along is the child's.  */
+    int pooled_fd = local_daemon->take_fd();
+
+    if (pooled_fd >= 0) {
+        close(pooled_fd);
+    }
+
+    return true;
+}
+
+/* Waits for the child of DUPLICATE, killing it first if KILL_IT.  Returns
+   whether it compiled the job successfully.  Unless USE_IT its files are
+   removed, otherwise the output is moved to that of JOB.  */
+static bool end_duplicate(const CompileJob &job, Duplicate &duplicate, bool kill_it, bool use_it)
+{
+    int status = 1;
+
+    if (kill_it) {
+        kill(duplicate.pid, SIGTERM);
+    }
+
+    while (waitpid(duplicate.pid, &status, 0) < 0 && errno == EINTR) {}
+
+    close(duplicate.exit_fd);
+    duplicate.pid = -1;
+    duplicate.exit_fd = -1;
+
+    bool ok = !kill_it && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    string output = duplicate.job.outputFile();
+    string dwo_output = output.substr(0, output.find_last_of('.')) + ".dwo";
+    string job_dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+
+    if (ok && use_it) {
+        if (rename(output.c_str(), job.outputFile().c_str()) < 0) {
+            log_perror("rename of the duplicate output failed");
+            ok = use_it = false;
+        } else if (job.dwarfFissionEnabled()) {
+            ignore_result(rename(dwo_output.c_str(), job_dwo_output.c_str()));
+        }
+    }
+
+    if (ok && use_it) {
+        copy_to_fd(duplicate.out_file, STDOUT_FILENO);
+        copy_to_fd(duplicate.err_file, STDERR_FILENO);
+    } else {
+        ::unlink(output.c_str());
+        ::unlink(dwo_output.c_str());
+        // what receive_file() left if it was killed
+        ::unlink((output + "_icetmp").c_str());
+        ::unlink((dwo_output + "_icetmp").c_str());
+    }
+
+    ::unlink(duplicate.out_file.c_str());
+    ::unlink(duplicate.err_file.c_str());
+    return ok;
+}
+
+/* Waits for the result of the job from CSERVER.  Meanwhile the scheduler
+   may send another server for a duplicate of the job, if this one takes
+   too long.  That one is compiled in a child, and if it finishes first
+   its output is used and DUPLICATE_WON set, the job on CSERVER is
+   cancelled by closing the connection then.  */
+static Msg *wait_for_result(CompileJob &job, MsgChannel *cserver, MsgChannel *local_daemon,
+                            bool &duplicate_won)
+{
+    duplicate_won = false;
+
+    if (!duplicate_versions) {
+        return cserver->get_msg(12 * 60);
+    }
+
+    Duplicate duplicate;
+    time_t deadline = time(0) + 12 * 60;
+    bool cserver_lost = false;
+    bool local_daemon_lost = false;
+    Msg *result = 0;
+
+    while (!result && !duplicate_won) {
+        if (!cserver_lost && cserver->has_msg()) {
+            result = cserver->get_msg(0);
+            break;
+        }
+
+        if (duplicate.pid < 0 && !local_daemon_lost && local_daemon->has_msg()) {
+            Msg *msg = local_daemon->get_msg(0);
+
+            if (msg && msg->type == M_USE_CS) {
+                remote_daemon = static_cast<UseCSMsg *>(msg)->hostname;
+                start_duplicate(job, static_cast<UseCSMsg *>(msg), local_daemon, cserver, duplicate);
+            }
+
+            delete msg;
+            continue;
+        }
+
+        time_t now = time(0);
+
+        if (now >= deadline || (cserver_lost && duplicate.pid < 0)) {
+            break;
+        }
+
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        int max_fd = -1;
+
+        if (!cserver_lost) {
+            FD_SET(cserver->fd, &read_set);
+            max_fd = cserver->fd;
+        }
+
+        if (duplicate.pid < 0 && !local_daemon_lost) {
+            FD_SET(local_daemon->fd, &read_set);
+            max_fd = max(max_fd, local_daemon->fd);
+        }
+
+        if (duplicate.exit_fd >= 0) {
+            FD_SET(duplicate.exit_fd, &read_set);
+            max_fd = max(max_fd, duplicate.exit_fd);
+        }
+
+        struct timeval tv;
+        tv.tv_sec = deadline - now;
+        tv.tv_usec = 0;
+        int ret = select(max_fd + 1, &read_set, 0, 0, &tv);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            log_perror("select failed");
+            break;
+        }
+
+        if (!cserver_lost && FD_ISSET(cserver->fd, &read_set)
+                && (!cserver->read_a_bit() || cserver->at_eof()) && !cserver->has_msg()) {
+            cserver_lost = true;
         }
 
-        FileChunkMsg *fcmsg = dynamic_cast<FileChunkMsg*>(msg);
-        compressed += fcmsg->compressed;
-        uncompressed += fcmsg->len;
+        if (duplicate.pid < 0 && !local_daemon_lost && FD_ISSET(local_daemon->fd, &read_set)
+                && (!local_daemon->read_a_bit() || local_daemon->at_eof())
+                && !local_daemon->has_msg()) {
+            local_daemon_lost = true;
+        }
 
-        if (write(obj_fd, fcmsg->buffer, fcmsg->len) != (ssize_t)fcmsg->len) {
-            unlink(tmp_file.c_str());
-            delete msg;
-            throw client_error(21, "Error 21 - error writing file");
+        if (duplicate.exit_fd >= 0 && FD_ISSET(duplicate.exit_fd, &read_set)) {
+            if (end_duplicate(job, duplicate, false, true)) {
+                log_info() << "the duplicate on " << duplicate.hostname << " was done first" << endl;
+                duplicate_won = true;
+            }
         }
     }
 
-    if (uncompressed)
-        trace() << "got " << compressed << " bytes ("
-                << (compressed * 100 / uncompressed) << "%)" << endl;
+    if (duplicate.pid >= 0) {
+        end_duplicate(job, duplicate, true, false);
+    }
 
-    delete msg;
+    return result;
+}
 
-    if (close(obj_fd) != 0 || rename(tmp_file.c_str(), output_file.c_str()) != 0) {
-        unlink(tmp_file.c_str());
-        throw client_error(30, "Error 30 - error closing temp file");
+/* Passes on what the compiler of JOB wrote.  */
+static void write_output(const CompileJob &job, const string &out, const string &err)
+{
+    ignore_result(write(STDOUT_FILENO, out.c_str(), out.size()));
+
+    if (colorify_wanted(job)) {
+        colorify_output(err);
+    } else {
+        ignore_result(write(STDERR_FILENO, err.c_str(), err.size()));
     }
 }
 
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output, const string *preprocessed)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
     int job_id = usecs->job_id;
     bool got_env = usecs->got_env;
+    bool env_from_peer = usecs->env_from_peer;
     job.setJobID(job_id);
+    trace_job_id = job_id;
     job.setEnvironmentVersion(environment);   // hoping on the scheduler's wisdom
     trace() << "Have to use host " << hostname << ":" << port << " - Job ID: "
             << job.jobID() << " - env: " << usecs->host_platform
-            << " - has env: " << (got_env ? "true" : "false")
+            << " - has env: " << (got_env ? "true" : (env_from_peer ? "from peer" : "false"))
             << " - match j: " << usecs->matched_job_id
             << "\n";
 
     int status = 255;
 
     MsgChannel *cserver = 0;
+    int streamed_fd = -1; // the object file sent while it was compiled
+    string streamed_file = job.outputFile() + "_icetmp";
+    bool interleaved = false; // the outputs come as OutputChunkMsgs
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
+        timeval connect_start;
+        gettimeofday(&connect_start, 0);
+
+        if (usecs->channel_protocol) {
+            /* The local daemon had a connection set up already.  */
+            int pooled_fd = local_daemon->take_fd();
+
+            if (pooled_fd >= 0) {
+                cserver = Service::adoptChannel(pooled_fd, usecs->channel_protocol,
+                                                usecs->channel_codecs);
+                trace() << "using pooled connection to " << hostname << endl;
+            }
+        }
+
+        if (!cserver) {
+            cserver = Service::createChannel(hostname, port, 10);
+        }
 
         if (!cserver) {
             log_error() << "no server found behind given hostname " << hostname << ":"
@@ -401,33 +1449,54 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(2, "Error 2 - no server found at " + hostname);
         }
 
+        cserver->setTrafficClass(TC_INTERACTIVE);
+
+        if (trace_fd >= 0) {
+            timeval connect_end;
+            gettimeofday(&connect_end, 0);
+            trace_span("connect", connect_start, connect_end, job_id);
+        }
+
         if (!got_env) {
-            log_block b("Transfer Environment");
-            // transfer env
-            struct stat buf;
+            /* Otherwise the server gets it from another one, while we wait
+               for the verification.  */
+            if (!env_from_peer) {
+                log_block b("Transfer Environment");
+                // transfer env
+                struct stat buf;
+
+                if (stat(version_file.c_str(), &buf)) {
+                    log_perror("error stat'ing version file");
+                    throw client_error(4, "Error 4 - unable to stat version file");
+                }
 
-            if (stat(version_file.c_str(), &buf)) {
-                log_perror("error stat'ing version file");
-                throw client_error(4, "Error 4 - unable to stat version file");
-            }
+                /* Behind the jobs of others on the links, and paced so that
+                   it doesn't fill the queues of the switches.  */
+                cserver->setTrafficClass(TC_BULK, env_upload_rate());
+                EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
 
-            EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
+                if (!cserver->send_msg(msg)) {
+                    throw client_error(6, "Error 6 - send environment to remove failed");
+                }
 
-            if (!cserver->send_msg(msg)) {
-                throw client_error(6, "Error 6 - send environment to remove failed");
-            }
+                int env_fd = open(version_file.c_str(), O_RDONLY);
 
-            int env_fd = open(version_file.c_str(), O_RDONLY);
+                if (env_fd < 0) {
+                    throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
+                }
 
-            if (env_fd < 0) {
-                throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
-            }
+                if (IS_PROTOCOL_37(cserver)) {
+                    write_server_env(env_fd, buf.st_size, cserver);
+                } else {
+                    write_server_cpp(env_fd, cserver);
+                }
 
-            write_server_cpp(env_fd, cserver);
+                if (!cserver->send_msg(EndMsg())) {
+                    log_error() << "write of environment failed" << endl;
+                    throw client_error(8, "Error 8 - write environment to remote failed");
+                }
 
-            if (!cserver->send_msg(EndMsg())) {
-                log_error() << "write of environment failed" << endl;
-                throw client_error(8, "Error 8 - write environment to remote failed");
+                cserver->setTrafficClass(TC_INTERACTIVE);
             }
 
             if (IS_PROTOCOL_31(cserver)) {
@@ -437,10 +1506,13 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                     throw client_error(22, "Error 22 - error sending environment");
                 }
 
-                Msg *verify_msg = cserver->get_msg(60);
+                Msg *verify_msg = cserver->get_msg(env_from_peer ? 300 : 60);
 
                 if (verify_msg && verify_msg->type == M_VERIFY_ENV_RESULT) {
-                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
+                    if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok && env_from_peer) {
+                        // Not the environment's fault, the fetch didn't work out.
+                        throw client_error(32, "Error 32 - remote " + hostname + " could not get the environment");
+                    } else if (!static_cast<VerifyEnvResultMsg*>(verify_msg)->ok) {
                         // The remote can't handle the environment at all (e.g. kernel too old),
                         // mark it as never to be used again for this environment.
                         log_info() << "Host " << hostname
@@ -466,6 +1538,50 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         CompileFileMsg compile_file(&job);
+        // raw output would go to the file without being hashed
+        compile_file.raw_output = raw_output_wanted() && !hash_output;
+        // a duplicate is given up for it as for the result, see wait_for_result()
+        compile_file.stream_output = true;
+        compile_file.pch = !pch_hash.empty();
+        // both outputs hashed at once wouldn't hash like they do one after the other
+        compile_file.interleaved_output = job.dwarfFissionEnabled() && !hash_output
+                                          && !compile_file.raw_output;
+        interleaved = compile_file.interleaved_output && IS_PROTOCOL_58(cserver);
+
+        /* The sources of the environment compress better with its
+           dictionary, which the server has.  */
+        if (usecs->dict_id && !usecs->dict.empty() && IS_PROTOCOL_62(cserver)) {
+            cserver->setCompressionDict(usecs->dict);
+            compile_file.dict_id = cserver->compressionDictId();
+        }
+
+        if (compile_file.pch && !IS_PROTOCOL_52(cserver)) {
+            throw remote_error(106, "Error 106 - remote can't take the precompiled header, recompiling locally");
+        }
+
+        /* The server preprocesses if it gets the files the source includes,
+           a ThinLTO backend job gets its bitcode and a command its inputs the
+           same way.  */
+        HeaderManifestMsg manifest = job_files;
+        bool thinlto = !job.thinLTOIndex().empty();
+        bool command = is_command(job);
+
+        if (thinlto && !IS_PROTOCOL_59(cserver)) {
+            throw remote_error(107, "Error 107 - remote can't take ThinLTO jobs, recompiling locally");
+        }
+
+        if (command && !IS_PROTOCOL_60(cserver)) {
+            throw remote_error(109, "Error 109 - remote can't run commands, running locally");
+        }
+
+        // the outputs of a command come back as they are written
+        compile_file.raw_output = compile_file.raw_output && !command;
+        compile_file.remote_cpp = thinlto || command
+                                  || (!preproc_file && !preprocessed && IS_PROTOCOL_51(cserver)
+                                      && remote_preprocess_wanted() && scan_headers(job, manifest));
+        // a source sharing chunks with one sent before is sent in part
+        compile_file.chunked = !compile_file.remote_cpp && !command && IS_PROTOCOL_63(cserver)
+                               && dedup_sources_wanted();
         {
             log_block b("send compile_file");
 
@@ -475,7 +1591,38 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
+        /* Servers that know the key look the result up before compiling.  */
+        ResultKey key(job);
+        ResultKey *result_key = IS_PROTOCOL_50(cserver) && !command ? &key : 0;
+
+        if (compile_file.pch) {
+            log_block b("write_server_pch");
+            write_server_pch(job, cserver, result_key);
+        }
+
+        if (compile_file.remote_cpp) {
+            log_block b("write_server_headers");
+            write_server_headers(manifest, cserver, result_key);
+        } else if (compile_file.chunked) {
+            log_block b("write_server_chunks");
+            string source;
+
+            if (!preprocessed && preproc_file && !read_source(preproc_file, source)) {
+                throw client_error(11, "Error 11 - unable to open preprocessed file");
+            }
+
+            if (!preprocessed && !preproc_file && (status = preprocess_to_memory(job, source))) {
+                delete cserver;
+                cserver = 0;
+                return status;
+            }
+
+            write_server_chunks(preprocessed ? *preprocessed : source, cserver, result_key);
+        } else if (preprocessed) {
+            log_block b("write_server_buffer");
+            write_server_buffer(*preprocessed, cserver, result_key);
+        } else if (!preproc_file) {
+            BatchCppSlot cpp_slot;
             int sockets[2];
 
             if (pipe(sockets)) {
@@ -494,7 +1641,7 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
 
             try {
                 log_block bl2("write_server_cpp from cpp");
-                write_server_cpp(sockets[0], cserver);
+                write_server_cpp(sockets[0], cserver, result_key);
             } catch (...) {
                 kill(cpp_pid, SIGTERM);
                 throw;
@@ -517,7 +1664,12 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
 
             log_block cpp_block("write_server_cpp");
-            write_server_cpp(cpp_fd, cserver);
+            write_server_cpp(cpp_fd, cserver, result_key);
+        }
+
+        if (result_key && !cserver->send_msg(ResultKeyMsg(result_key->hex()))) {
+            log_info() << "write of result key failed" << endl;
+            throw client_error(12, "Error 12 - failed to send file to remote");
         }
 
         if (!cserver->send_msg(EndMsg())) {
@@ -528,11 +1680,41 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         Msg *msg;
         {
             log_block wait_cs("wait for cs");
-            msg = cserver->get_msg(12 * 60);
+            bool duplicate_won = false;
+            msg = wait_for_result(job, cserver, local_daemon, duplicate_won);
+
+            if (duplicate_won) {
+                delete cserver;
+                return 0;
+            }
 
             if (!msg) {
                 throw client_error(14, "Error 14 - error reading message from remote");
             }
+
+            while (msg->type == M_FILE_CHUNK) {
+                FileChunkMsg *fcmsg = static_cast<FileChunkMsg*>(msg);
+
+                if (streamed_fd == -1) {
+                    streamed_fd = open_output_file(streamed_file);
+                }
+
+                if (hash_output) {
+                    hash_received(fcmsg->buffer, fcmsg->len);
+                }
+
+                if (write(streamed_fd, fcmsg->buffer, fcmsg->len) != (ssize_t)fcmsg->len) {
+                    delete msg;
+                    throw client_error(21, "Error 21 - error writing file");
+                }
+
+                delete msg;
+                msg = cserver->get_msg(12 * 60);
+
+                if (!msg) {
+                    throw client_error(14, "Error 14 - error reading message from remote");
+                }
+            }
         }
 
         check_for_failure(msg, cserver);
@@ -554,20 +1736,44 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
         }
 
+        /* Its compiler may not read the bitcode of the local one.  */
+        if (status && thinlto) {
+            delete crmsg;
+            log_info() << "remote ThinLTO backend failed, recompiling locally" << endl;
+            throw remote_error(108, "Error 108 - remote ThinLTO backend failed, recompiling locally");
+        }
+
+        // what the shell says for a command it doesn't find
+        if (status == 127 && command) {
+            delete crmsg;
+            log_info() << "the environment has no " << job.compilerName() << ", running locally" << endl;
+            throw remote_error(110, "Error 110 - the environment has no such command, running locally");
+        }
+
+        /* It may have been the preprocessing that went wrong there.  */
+        if (status && compile_file.remote_cpp && !command) {
+            delete crmsg;
+            log_info() << "remote preprocessing failed, recompiling locally" << endl;
+            throw remote_error(103, "Error 103 - remote preprocessing failed, recompiling locally");
+        }
+
+        /* Or the compiler there didn't take the precompiled header.  */
+        if (status && compile_file.pch) {
+            delete crmsg;
+            log_info() << "remote compile with precompiled header failed, recompiling locally" << endl;
+            throw remote_error(105, "Error 105 - remote compile with precompiled header failed, recompiling locally");
+        }
+
         if (output) {
-            if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
+            // with the sources there, the compiler shows the caret itself
+            if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)
+                    && !compile_file.remote_cpp) {
                 delete crmsg;
                 log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
                 throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
             }
 
-            ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
-
-            if (colorify_wanted(job)) {
-                colorify_output(crmsg->err);
-            } else {
-                ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
-            }
+            write_output(job, crmsg->out, crmsg->err);
 
             if (status && (crmsg->err.length() || crmsg->out.length())) {
                 log_error() << "Compiled on " << hostname << endl;
@@ -575,19 +1781,44 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         }
 
         bool have_dwo_file = crmsg->have_dwo_file;
+        string out = crmsg->out, err = crmsg->err;
         delete crmsg;
 
-        assert(!job.outputFile().empty());
+        if (status == 0 && command) {
+            log_block b("receive outputs");
+            list<string> outputs = job.commandOutputs();
+
+            for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+                receive_file(*it, cserver);
+            }
+        } else if (status == 0) {
+            assert(!job.outputFile().empty());
+            log_block b("receive result");
+            bool keep = output && local_cache;
+            int obj_fd = streamed_fd;
+            streamed_fd = -1;
+            string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+
+            if (have_dwo_file && interleaved && obj_fd == -1) {
+                receive_files(job.outputFile(), dwo_output, cserver, keep);
+            } else {
+                receive_file(job.outputFile(), cserver, obj_fd, keep ? ".o" : 0);
+                if (have_dwo_file) {
+                    receive_file(dwo_output, cserver, -1, keep ? ".dwo" : 0);
+                }
+            }
 
-        if (status == 0) {
-            receive_file(job.outputFile(), cserver);
-            if (have_dwo_file) {
-                string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
-                receive_file(dwo_output, cserver);
+            if (keep) {
+                local_cache->store(out, err);
             }
         }
 
     } catch (...) {
+        if (streamed_fd != -1) {
+            close(streamed_fd);
+            unlink(streamed_file.c_str());
+        }
+
         // Handle pending status messages, if any.
         if(cserver) {
             while(Msg* msg = cserver->get_msg(0)) {
@@ -603,49 +1834,13 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
         throw;
     }
 
-    delete cserver;
-    return status;
-}
-
-static string
-md5_for_file(const string & file)
-{
-    md5_state_t state;
-    string result;
-
-    md5_init(&state);
-    FILE *f = fopen(file.c_str(), "rb");
-
-    if (!f) {
-        return result;
-    }
-
-    md5_byte_t buffer[40000];
-
-    while (true) {
-        size_t size = fread(buffer, 1, 40000, f);
-
-        if (!size) {
-            break;
-        }
-
-        md5_append(&state, buffer, size);
-    }
-
-    fclose(f);
-
-    md5_byte_t digest[16];
-    md5_finish(&state, digest);
-
-    char digest_cache[33];
-
-    for (int di = 0; di < 16; ++di) {
-        sprintf(digest_cache + di * 2, "%02x", digest[di]);
+    if (streamed_fd != -1) { // the compile failed
+        close(streamed_fd);
+        unlink(streamed_file.c_str());
     }
 
-    digest_cache[32] = 0;
-    result = digest_cache;
-    return result;
+    delete cserver;
+    return status;
 }
 
 static bool
@@ -711,25 +1906,184 @@ maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
 }
 
 // Minimal version of remote host that we want to use for the job.
-static int minimalRemoteVersion( const CompileJob& )
+static int minimalRemoteVersion( const CompileJob& job )
 {
     int version = MIN_PROTOCOL_VERSION;
     if( ignore_unverified())
         version = max( version, 31 );
+    if( !pch_hash.empty())
+        version = max( version, 52 );
+    if( !job.thinLTOIndex().empty())
+        version = max( version, 59 );
+    if( is_command(job))
+        version = max( version, 60 );
     return version;
 }
 
+// Priority class of the job, as set by $ICECC_JOB_CLASS.
+static unsigned int jobClass()
+{
+    const char *env = getenv("ICECC_JOB_CLASS");
+
+    if (!env || !*env || !strcmp(env, "interactive")) {
+        return JC_INTERACTIVE;
+    }
+
+    if (!strcmp(env, "ci")) {
+        return JC_CI;
+    }
+
+    if (!strcmp(env, "batch")) {
+        return JC_BATCH;
+    }
+
+    log_warning() << "unknown $ICECC_JOB_CLASS " << env << ", using interactive" << endl;
+    return JC_INTERACTIVE;
+}
+
+/* Preprocesses JOB into a new temporary file, whose name goes to PREPROC.
+   Returns the exit status of the preprocessor.  */
+static int preprocess_to_file(CompileJob &job, char *&preproc)
+{
+    BatchCppSlot cpp_slot;
+    log_block b("preprocess");
+    dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
+    int cpp_fd = open(preproc, O_WRONLY);
+    /* When call_cpp returns normally (for the parent) it will have closed
+       the write fd, i.e. cpp_fd.  */
+    pid_t cpp_pid = call_cpp(job, cpp_fd);
+
+    if (cpp_pid == -1) {
+        ::unlink(preproc);
+        throw client_error(10, "Error 10 - (unable to fork process?)");
+    }
+
+    int status = 255;
+    waitpid(cpp_pid, &status, 0);
+
+    if (shell_exit_status(status)) {   // failure
+        ::unlink(preproc);
+    }
+
+    return shell_exit_status(status);
+}
+
+/* Preprocesses JOB into PREPROCESSED.  Returns the exit status of the
+   preprocessor.  */
+static int preprocess_to_memory(CompileJob &job, string &preprocessed)
+{
+    BatchCppSlot cpp_slot;
+    log_block b("preprocess");
+    int fds[2];
+
+    if (pipe(fds)) {
+        throw client_error(10, "Error 10 - (unable to fork process?)");
+    }
+
+    // closes the write end
+    pid_t cpp_pid = call_cpp(job, fds[1], fds[0]);
+
+    if (cpp_pid == -1) {
+        close(fds[0]);
+        throw client_error(10, "Error 10 - (unable to fork process?)");
+    }
+
+    char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fds[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        preprocessed.append(buffer, bytes);
+    }
+
+    close(fds[0]);
+    int status = 255;
+
+    while (waitpid(cpp_pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (bytes < 0 && !shell_exit_status(status)) {
+        throw client_error(16, "Error 16 - error reading local cpp file");
+    }
+
+    return shell_exit_status(status);
+}
+
+/* Looks JOB up in the local cache, in which case it's done.  Otherwise
+   the cache is set up to keep its result, and PREPROC is its preprocessed
+   source.  */
+static bool use_local_cache(CompileJob &job, const map<string, string> &version_map,
+                            char *&preproc, int &ret)
+{
+    local_cache = LocalCache::fromEnvironment();
+
+    if (!local_cache) {
+        return false;
+    }
+
+    ret = preprocess_to_file(job, preproc);
+
+    if (ret) {
+        return true;
+    }
+
+    /* Any of them may be used, so they all are part of the key.  */
+    string envs;
+
+    for (map<string, string>::const_iterator it = version_map.begin(); it != version_map.end(); ++it) {
+        envs += it->first + "=" + it->second + ";";
+    }
+
+    // the preprocessed source has just the name of it
+    if (!pch_hash.empty()) {
+        envs += "pch=" + pch_hash + ";";
+    }
+
+    string out, err;
+
+    if (local_cache->setKey(job, envs, preproc) && local_cache->use(job, out, err)) {
+        write_output(job, out, err);
+        ::unlink(preproc);
+        return true;
+    }
+
+    return false;
+}
+
 int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
 {
     srand(time(0) + getpid());
 
+    pch_file = precompiled_header(job);
+
+    if (!pch_file.empty() && (pch_hash = file_hash(pch_file)).empty()) {
+        log_perror(("reading " + pch_file).c_str());
+        throw client_error(33, "Error 33 - unable to read the precompiled header");
+    }
+
+    job_files = HeaderManifestMsg();
+
+    if (!job.thinLTOIndex().empty() && !thinlto_files(job, job_files)) {
+        throw remote_error(107, "Error 107 - can't send the ThinLTO backend job, building locally");
+    }
+
+    if (is_command(job) && !command_files(job, job_files)) {
+        throw remote_error(109, "Error 109 - can't send the inputs of the command, running locally");
+    }
+
     int torepeat = 1;
     bool has_split_dwarf = job.dwarfFissionEnabled();
 
     // older compilers do not support the options we need to make it reproducible
 #if defined(__GNUC__) && ( ( (__GNUC__ == 3) && (__GNUC_MINOR__ >= 3) ) || (__GNUC__ >=4) )
 
-    if (!compiler_is_clang(job)) {
+    if (!compiler_is_clang(job) && !is_command(job)) {
         if (rand() % 1000 < permill) {
             torepeat = 3;
         }
@@ -751,6 +2105,19 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
     const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
 
     if (torepeat == 1) {
+        char *preproc = 0;
+        int ret;
+
+        // bitcode and commands aren't preprocessed for the key
+        if (job.thinLTOIndex().empty() && !is_command(job)
+                && use_local_cache(job, version_map, preproc, ret)) {
+            free(preproc);
+            delete local_cache;
+            local_cache = 0;
+            return ret;
+        }
+
+        const CharBufferDeleter preproc_holder(preproc);
         string fake_filename;
         list<string> args = job.remoteFlags();
 
@@ -769,7 +2136,8 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         GetCSMsg getcs(envs, fake_filename, job.language(), torepeat,
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
-                       minimalRemoteVersion(job));
+                       minimalRemoteVersion(job), jobClass());
+        getcs.allow_duplicate = 1;
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
@@ -777,36 +2145,49 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         }
 
         UseCSMsg *usecs = get_server(local_daemon);
-        int ret;
 
-        if (!maybe_build_local(local_daemon, usecs, job, ret))
-            ret = build_remote_int(job, usecs, local_daemon,
-                                   version_map[usecs->host_platform],
-                                   versionfile_map[usecs->host_platform],
-                                   0, true);
+        if (!maybe_build_local(local_daemon, usecs, job, ret)) {
+            duplicate_versions = &version_map;
+            duplicate_version_files = &versionfile_map;
+
+            try {
+                ret = build_remote_int(job, usecs, local_daemon,
+                                       version_map[usecs->host_platform],
+                                       versionfile_map[usecs->host_platform],
+                                       preproc, true);
+            } catch (...) {
+                duplicate_versions = duplicate_version_files = 0;
+                delete usecs;
+
+                if (preproc) {
+                    ::unlink(preproc);
+                }
+
+                delete local_cache;
+                local_cache = 0;
+                throw;
+            }
+
+            duplicate_versions = duplicate_version_files = 0;
+        }
 
         delete usecs;
-        return ret;
-    } else {
-        char *preproc = 0;
-        dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
-        const CharBufferDeleter preproc_holder(preproc);
-        int cpp_fd = open(preproc, O_WRONLY);
-        /* When call_cpp returns normally (for the parent) it will have closed
-           the write fd, i.e. cpp_fd.  */
-        pid_t cpp_pid = call_cpp(job, cpp_fd);
 
-        if (cpp_pid == -1) {
+        if (preproc) {
             ::unlink(preproc);
-            throw client_error(10, "Error 10 - (unable to fork process?)");
         }
 
-        int status = 255;
-        waitpid(cpp_pid, &status, 0);
+        delete local_cache;
+        local_cache = 0;
+        return ret;
+    } else {
+        /* The preprocessed source is sent to all servers from memory, and
+           what they send back is compared by its hash.  */
+        string preprocessed;
+        int status = preprocess_to_memory(job, preprocessed);
 
-        if (shell_exit_status(status)) {   // failure
-            ::unlink(preproc);
-            return shell_exit_status(status);
+        if (status) {
+            return status;
         }
 
         char rand_seed[400]; // "designed to be oversized" (Levi's)
@@ -816,7 +2197,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         GetCSMsg getcs(envs, get_absfilename(job.inputFile()), job.language(), torepeat,
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
-                       minimalRemoteVersion(job));
+                       minimalRemoteVersion(job), jobClass());
 
 
         if (!local_daemon->send_msg(getcs)) {
@@ -825,60 +2206,82 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         }
 
         map<pid_t, int> jobmap;
-        CompileJob *jobs = new CompileJob[torepeat];
         UseCSMsg **umsgs = new UseCSMsg*[torepeat];
 
         bool misc_error = false;
         int *exit_codes = new int[torepeat];
+        int *hash_fds = new int[torepeat];
+        uint64_t *hashes = new uint64_t[torepeat];
 
         for (int i = 0; i < torepeat; i++) { // init
             exit_codes[i] = 42;
+            hash_fds[i] = -1;
+            hashes[i] = 0;
         }
 
 
         for (int i = 0; i < torepeat; i++) {
-            jobs[i] = job;
-            char *buffer = 0;
-
-            if (i) {
-                dcc_make_tmpnam("icecc", ".o", &buffer, 0);
-                jobs[i].setOutputFile(buffer);
-            } else {
-                buffer = strdup(job.outputFile().c_str());
-            }
-
-            const CharBufferDeleter buffer_holder(buffer);
-
             umsgs[i] = get_server(local_daemon);
 
             remote_daemon = umsgs[i]->hostname;
 
             trace() << "got_server_for_job " << umsgs[i]->hostname << endl;
 
+            int fds[2];
+
+            if (pipe(fds)) {
+                throw client_error(10, "Error 10 - (unable to fork process?)");
+            }
+
             flush_debug();
 
             pid_t pid = fork();
 
             if (!pid) {
                 int ret = 42;
+                close(fds[0]);
+                hash_output = true;
+                // only the first one writes the output
+                discard_output = i > 0;
 
                 try {
-                    if (!maybe_build_local(local_daemon, umsgs[i], jobs[i], ret))
+                    CompileJob child_job = job;
+                    char *buffer = 0;
+
+                    // built here it is a file after all, see maybe_build_local()
+                    if (i > 0 && umsgs[i]->hostname == "127.0.0.1") {
+                        dcc_make_tmpnam("icecc", ".o", &buffer, 0);
+                        child_job.setOutputFile(buffer);
+                    }
+
+                    const CharBufferDeleter buffer_holder(buffer);
+
+                    if (maybe_build_local(local_daemon, umsgs[i], child_job, ret)) {
+                        hash_file(child_job.outputFile());
+
+                        if (buffer) {
+                            ::unlink(buffer);
+                        }
+                    } else {
                         ret = build_remote_int(
-                                  jobs[i], umsgs[i], local_daemon,
+                                  child_job, umsgs[i], local_daemon,
                                   version_map[umsgs[i]->host_platform],
                                   versionfile_map[umsgs[i]->host_platform],
-                                  preproc, i == 0);
+                                  0, i == 0, &preprocessed);
+                    }
                 } catch (std::exception& error) {
                     log_info() << "build_remote_int failed and has thrown " << error.what() << endl;
                     kill(getpid(), SIGTERM);
                     return 0; // shouldn't matter
                 }
 
+                ignore_result(write(fds[1], &output_hash, sizeof(output_hash)));
                 _exit(ret);
                 return 0; // doesn't matter
             }
 
+            close(fds[1]);
+            hash_fds[i] = fds[0];
             jobmap[pid] = i;
         }
 
@@ -895,13 +2298,19 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                     break;
                 }
 
-                exit_codes[jobmap[pid]] = shell_exit_status(status);
+                int index = jobmap[pid];
+                exit_codes[index] = shell_exit_status(status);
+
+                if (read(hash_fds[index], &hashes[index], sizeof(hashes[index]))
+                        != sizeof(hashes[index])) {
+                    hashes[index] = 0;
+                }
             }
         }
 
-        if (!misc_error) {
-            string first_md5 = md5_for_file(jobs[0].outputFile());
+        string dwo_file = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
 
+        if (!misc_error) {
             for (int i = 1; i < torepeat; i++) {
                 if (!exit_codes[0]) {   // if the first failed, we fail anyway
                     if (exit_codes[i] == 42) { // they are free to fail for misc reasons
@@ -912,68 +2321,56 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                         log_error() << umsgs[i]->hostname << " compiled with exit code " << exit_codes[i]
                                     << " and " << umsgs[0]->hostname << " compiled with exit code "
                                     << exit_codes[0] << " - aborting!\n";
-                        ::unlink(jobs[0].outputFile().c_str());
+                        ::unlink(job.outputFile().c_str());
                         if (has_split_dwarf) {
-                            string dwo_file = jobs[0].outputFile().substr(0, jobs[0].outputFile().find_last_of('.')) + ".dwo";
                             ::unlink(dwo_file.c_str());
                         }
                         exit_codes[0] = -1; // overwrite
                         break;
                     }
 
-                    string other_md5 = md5_for_file(jobs[i].outputFile());
-
-                    if (other_md5 != first_md5) {
+                    if (hashes[i] != hashes[0]) {
+                        string caught = job.outputFile() + ".ix.caught";
                         log_error() << umsgs[i]->hostname << " compiled "
-                                    << jobs[0].outputFile() << " with md5 sum " << other_md5
-                                    << "(" << jobs[i].outputFile() << ")" << " and "
-                                    << umsgs[0]->hostname << " compiled with md5 sum "
-                                    << first_md5 << " - aborting!\n";
-                        rename(jobs[0].outputFile().c_str(),
-                               (jobs[0].outputFile() + ".caught").c_str());
-                        rename(preproc, (string(preproc) + ".caught").c_str());
+                                    << job.outputFile() << " with hash " << hex << hashes[i]
+                                    << " and " << umsgs[0]->hostname << " compiled with hash "
+                                    << hashes[0] << dec << " - aborting! (the preprocessed source is "
+                                    << caught << ")\n";
+                        rename(job.outputFile().c_str(),
+                               (job.outputFile() + ".caught").c_str());
+                        int caught_fd = open(caught.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+
+                        if (caught_fd >= 0) {
+                            ignore_result(write(caught_fd, preprocessed.data(), preprocessed.size()));
+                            close(caught_fd);
+                        }
+
                         if (has_split_dwarf) {
-                            string dwo_file = jobs[0].outputFile().substr(0, jobs[0].outputFile().find_last_of('.')) + ".dwo";
                             rename(dwo_file.c_str(), (dwo_file + ".caught").c_str());
                         }
                         exit_codes[0] = -1; // overwrite
                         break;
                     }
                 }
-
-                ::unlink(jobs[i].outputFile().c_str());
-                if (has_split_dwarf) {
-                    string dwo_file = jobs[i].outputFile().substr(0, jobs[i].outputFile().find_last_of('.')) + ".dwo";
-                    ::unlink(dwo_file.c_str());
-                }
-                delete umsgs[i];
             }
         } else {
-            ::unlink(jobs[0].outputFile().c_str());
+            ::unlink(job.outputFile().c_str());
             if (has_split_dwarf) {
-                string dwo_file = jobs[0].outputFile().substr(0, jobs[0].outputFile().find_last_of('.')) + ".dwo";
                 ::unlink(dwo_file.c_str());
             }
-
-            for (int i = 1; i < torepeat; i++) {
-                ::unlink(jobs[i].outputFile().c_str());
-                if (has_split_dwarf) {
-                    string dwo_file = jobs[i].outputFile().substr(0, jobs[i].outputFile().find_last_of('.')) + ".dwo";
-                    ::unlink(dwo_file.c_str());
-                }
-                delete umsgs[i];
-            }
         }
 
-        delete umsgs[0];
-
-        ::unlink(preproc);
+        for (int i = 0; i < torepeat; i++) {
+            close(hash_fds[i]);
+            delete umsgs[i];
+        }
 
         int ret = exit_codes[0];
 
         delete [] umsgs;
-        delete [] jobs;
         delete [] exit_codes;
+        delete [] hash_fds;
+        delete [] hashes;
 
         if (misc_error) {
             throw client_error(27, "Error 27 - misc error");
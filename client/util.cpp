@@ -310,6 +310,30 @@ bool ignore_unverified()
     return getenv("ICECC_IGNORE_UNVERIFIED");
 }
 
+bool raw_output_wanted()
+{
+    const char *raw_output = getenv("ICECC_RAW_OUTPUT");
+    return raw_output && *raw_output == '1';
+}
+
+bool remote_preprocess_wanted()
+{
+    const char *remote_preprocess = getenv("ICECC_REMOTE_PREPROCESS");
+    return remote_preprocess && *remote_preprocess == '1';
+}
+
+bool dedup_sources_wanted()
+{
+    const char *dedup = getenv("ICECC_DEDUP_SOURCES");
+    return dedup && *dedup == '1';
+}
+
+unsigned long env_upload_rate()
+{
+    const char *rate = getenv("ICECC_ENV_UPLOAD_RATE");
+    return rate ? strtoul(rate, NULL, 10) * 1024 : 0;
+}
+
 // GCC4.8+ has -fdiagnostics-show-caret, but when it prints the source code,
 // it tries to find the source file on the disk, rather than printing the input
 // it got like Clang does. This means that when compiling remotely, it of course
@@ -35,6 +35,11 @@ extern bool colorify_wanted(const CompileJob &job);
 extern bool compiler_has_color_output(const CompileJob &job);
 extern bool output_needs_workaround(const CompileJob &job);
 extern bool ignore_unverified();
+extern bool raw_output_wanted();
+extern bool remote_preprocess_wanted();
+extern bool dedup_sources_wanted();
+// bytes per second, 0 if environment uploads aren't paced
+extern unsigned long env_upload_rate();
 extern int resolve_link(const std::string &file, std::string &resolved);
 
 extern bool dcc_unlock(int lock_fd);
@@ -0,0 +1,301 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <comm.h>
+#include <md5.h>
+
+#include "benchmark.h"
+#include "environment.h"
+#include "exitcode.h"
+#include "logging.h"
+#include "tempfile.h"
+#include "util.h"
+
+using namespace std;
+
+/* Takes about two seconds with gcc -O2 on a current machine, mostly in the
+   optimizer, and it needs no headers, so every environment compiles it.
+   Changing it makes the results of older daemons incomparable.  */
+static const char benchmark_source[] =
+    "template<int N> struct Mix {\n"
+    "    static unsigned run(const unsigned *data, unsigned n, unsigned seed)\n"
+    "    {\n"
+    "        unsigned acc = seed + N;\n"
+    "        for (unsigned i = 0; i < n; ++i) {\n"
+    "            acc = acc * 31 + data[i] * N;\n"
+    "            if (acc & 1) {\n"
+    "                acc ^= data[(i + N) % n] >> (N % 7);\n"
+    "            }\n"
+    "        }\n"
+    "        return Mix<N - 1>::run(data, n, acc);\n"
+    "    }\n"
+    "};\n"
+    "template<> struct Mix<0> {\n"
+    "    static unsigned run(const unsigned *, unsigned, unsigned seed) { return seed; }\n"
+    "};\n"
+    "template<typename T, int N> struct Sort {\n"
+    "    static void run(T *a, int n)\n"
+    "    {\n"
+    "        for (int i = 1; i < n; ++i) {\n"
+    "            T v = a[i];\n"
+    "            int j = i - 1;\n"
+    "            while (j >= 0 && a[j] > v + T(N)) {\n"
+    "                a[j + 1] = a[j];\n"
+    "                --j;\n"
+    "            }\n"
+    "            a[j + 1] = v;\n"
+    "        }\n"
+    "        Sort<T, N - 1>::run(a, n);\n"
+    "    }\n"
+    "};\n"
+    "template<typename T> struct Sort<T, 0> {\n"
+    "    static void run(T *, int) {}\n"
+    "};\n"
+    "unsigned mix(const unsigned *data, unsigned n) { return Mix<120>::run(data, n, 0); }\n"
+    "void sort(int *a, int n) { Sort<int, 60>::run(a, n); }\n"
+    "void sort(double *a, int n) { Sort<double, 60>::run(a, n); }\n"
+    "void sort(long *a, int n) { Sort<long, 60>::run(a, n); }\n";
+
+// what the child writes to the daemon
+struct BenchmarkReport {
+    uint32_t status;
+    uint32_t real_msec;
+    uint32_t user_msec;
+    uint32_t out_size;
+    char hash[33];
+};
+
+static bool md5_file(const string &file, char hex[33])
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+    md5_byte_t buffer[65536];
+    ssize_t len;
+
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        md5_append(&state, buffer, len);
+    }
+
+    close(fd);
+
+    if (len < 0) {
+        return false;
+    }
+
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+
+    for (int i = 0; i < 16; ++i) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+
+    return true;
+}
+
+/* In the child, inside the environment.  */
+static void compile_benchmark(BenchmarkReport &report)
+{
+    const char *compiler = "/usr/bin/g++";
+    bool clang = false;
+
+    if (access(compiler, X_OK) != 0) {
+        compiler = "/usr/bin/clang++";
+        clang = true;
+    }
+
+    if (access(compiler, X_OK) != 0) {
+        compiler = "/usr/bin/clang";
+    }
+
+    char *tmp_output = 0;
+
+    if (dcc_make_tmpnam("icecc-benchmark", ".o", &tmp_output, 0) != 0) {
+        report.status = EXIT_IO_ERROR;
+        return;
+    }
+
+    string output = tmp_output;
+    free(tmp_output);
+    int source[2];
+
+    if (pipe(source) < 0) {
+        report.status = EXIT_IO_ERROR;
+        return;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, 0);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        setenv("PATH", "/usr/bin", 1);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(source[0], STDIN_FILENO);
+        close(source[0]);
+        close(source[1]);
+
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+
+        // gcc names some symbols randomly, which would change the object
+        const char *seed = clang ? "-O2" : "-frandom-seed=icecc";
+        execl(compiler, compiler, "-x", "c++", "-O2", seed, "-c", "-", "-o", output.c_str(),
+              (char *) 0);
+        _exit(EXIT_COMPILER_MISSING);
+    }
+
+    close(source[0]);
+
+    if (pid < 0) {
+        close(source[1]);
+        report.status = EXIT_OUT_OF_MEMORY;
+        return;
+    }
+
+    // a pipe holds it all, the compiler reads it at once
+    ignore_result(write(source[1], benchmark_source, sizeof(benchmark_source) - 1));
+    close(source[1]);
+
+    int status = 1;
+    struct rusage ru;
+
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR) {}
+
+    struct timeval end;
+    gettimeofday(&end, 0);
+    report.status = shell_exit_status(status);
+    report.real_msec = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    report.user_msec = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+    struct stat st;
+
+    if (report.status == 0 && stat(output.c_str(), &st) == 0 && md5_file(output, report.hash)) {
+        report.out_size = st.st_size;
+    } else if (report.status == 0) {
+        report.status = EXIT_IO_ERROR;
+    }
+
+    unlink(output.c_str());
+}
+
+bool Benchmark::start(const BenchmarkMsg &msg, const string &dirname, uid_t user_uid,
+                      gid_t user_gid)
+{
+    if (running()) {
+        return false;
+    }
+
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        log_perror("pipe for the benchmark failed");
+        return false;
+    }
+
+    flush_debug();
+    pid_t child = fork();
+
+    if (child < 0) {
+        log_perror("fork for the benchmark failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (child == 0) {
+        close(fds[0]);
+        reset_debug(0);
+        BenchmarkReport report;
+        memset(&report, 0, sizeof(report));
+        chdir_to_environment(0, dirname, user_uid, user_gid);
+        compile_benchmark(report);
+        ignore_result(write(fds[1], &report, sizeof(report)));
+        _exit(0);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    pid = child;
+    result_fd = fds[0];
+    target = msg.target;
+    environment = msg.environment;
+    trace() << "benchmark of " << target << "/" << environment << " started" << endl;
+    return true;
+}
+
+void Benchmark::add_fds(vector<int> &fds) const
+{
+    if (result_fd >= 0) {
+        fds.push_back(result_fd);
+    }
+}
+
+bool Benchmark::handle_fd(int fd, BenchmarkResultMsg &result)
+{
+    if (fd != result_fd) {
+        return false;
+    }
+
+    BenchmarkReport report;
+    memset(&report, 0, sizeof(report));
+
+    if (read(result_fd, &report, sizeof(report)) != sizeof(report)) {
+        report.status = EXIT_DISTCC_FAILED;
+    }
+
+    close(result_fd);
+    result_fd = -1;
+
+    while (waitpid(pid, 0, 0) < 0 && errno == EINTR) {}
+
+    pid = -1;
+    report.hash[sizeof(report.hash) - 1] = 0;
+    result.target = target;
+    result.environment = environment;
+    result.status = report.status;
+    result.real_msec = report.real_msec;
+    result.user_msec = report.user_msec;
+    result.out_size = report.out_size;
+    result.hash = report.hash;
+    log_info() << "benchmark of " << target << "/" << environment << ": status "
+               << result.status << ", " << result.user_msec << " ms" << endl;
+    return true;
+}
@@ -0,0 +1,60 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_BENCHMARK_H
+#define ICECREAM_BENCHMARK_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+class BenchmarkMsg;
+class BenchmarkResultMsg;
+
+/* Compiles a fixed source in an environment in a child, like a job but
+   without a client, see BenchmarkMsg.  Only one runs at a time.  */
+class Benchmark
+{
+public:
+    Benchmark()
+        : pid(-1)
+        , result_fd(-1) {}
+
+    bool running() const
+    {
+        return pid > 0;
+    }
+
+    // starts it in the environment installed at DIRNAME
+    bool start(const BenchmarkMsg &msg, const std::string &dirname, uid_t user_uid,
+               gid_t user_gid);
+    void add_fds(std::vector<int> &fds) const;
+    // true if FD was the one of the child, which is done then
+    bool handle_fd(int fd, BenchmarkResultMsg &result);
+
+private:
+    pid_t pid;
+    int result_fd;
+    std::string target;
+    std::string environment;
+};
+
+#endif
@@ -0,0 +1,186 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <unistd.h>
+
+#include <comm.h>
+
+#include "connpool.h"
+#include "logging.h"
+
+using namespace std;
+
+// seconds a set up connection is kept without being used
+#define MAX_POOL_IDLE 60
+// seconds to wait before trying again to connect to a host that failed
+#define POOL_RETRY_DELAY 60
+// seconds a connect may take
+#define POOL_CONNECT_TIMEOUT 5
+
+static string host_key(const string &host, unsigned int port)
+{
+    return host + ":" + toString(port);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    for (HostMap::iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        for (list<Connection>::iterator c = it->second.begin(); c != it->second.end(); ++c) {
+            if (c->channel) {
+                delete c->channel;
+            } else {
+                close(c->connecting);
+            }
+        }
+    }
+}
+
+/* One the client's side of the UseCSMsg can't speak is left in the pool.  */
+MsgChannel *ConnectionPool::take(const string &host, unsigned int port, int max_protocol)
+{
+    HostMap::iterator it = hosts.find(host_key(host, port));
+
+    if (it == hosts.end()) {
+        return 0;
+    }
+
+    for (list<Connection>::iterator c = it->second.begin(); c != it->second.end(); ++c) {
+        if (c->channel && c->channel->protocol_ready() && c->channel->protocol <= max_protocol) {
+            MsgChannel *ret = c->channel;
+            it->second.erase(c);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+void ConnectionPool::refill(const string &host, unsigned int port)
+{
+    if (!per_host) {
+        return;
+    }
+
+    string key = host_key(host, port);
+    map<string, time_t>::iterator f = failed.find(key);
+
+    if (f != failed.end()) {
+        if (time(0) - f->second < POOL_RETRY_DELAY) {
+            return;
+        }
+
+        failed.erase(f);
+    }
+
+    list<Connection> &conns = hosts[key];
+
+    while (conns.size() < per_host) {
+        /* The connect and the protocol setup are finished by handle_fd().  */
+        int fd = Service::startConnect(host, port);
+
+        if (fd < 0) {
+            log_warning() << "can't open pooled connection to " << key << endl;
+            failed[key] = time(0);
+            break;
+        }
+
+        Connection conn;
+        conn.channel = 0;
+        conn.connecting = fd;
+        conn.since = time(0);
+        conns.push_back(conn);
+        trace() << "pooled connection " << fd << " to " << key << endl;
+    }
+}
+
+void ConnectionPool::add_fds(vector<int> &fds) const
+{
+    for (HostMap::const_iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        for (list<Connection>::const_iterator c = it->second.begin(); c != it->second.end(); ++c) {
+            fds.push_back(c->channel ? c->channel->fd : c->connecting);
+        }
+    }
+}
+
+void ConnectionPool::handle_fd(int fd)
+{
+    for (HostMap::iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        for (list<Connection>::iterator c = it->second.begin(); c != it->second.end(); ++c) {
+            MsgChannel *channel = c->channel;
+
+            if (!channel && c->connecting == fd) {
+                // the protocol version of the other side is read next time
+                c->channel = Service::connectedChannel(fd);
+
+                if (!c->channel) {
+                    log_warning() << "can't open pooled connection to " << it->first << endl;
+                    failed[it->first] = time(0);
+                    it->second.erase(c);
+                }
+
+                return;
+            }
+
+            if (!channel || channel->fd != fd) {
+                continue;
+            }
+
+            /* Once the protocol is set up the compile server
+               doesn't send anything until it got a job.  */
+            bool ready = channel->protocol_ready();
+
+            if (!ready && channel->read_a_bit() && !channel->at_eof()) {
+                return;
+            }
+
+            trace() << "dropping pooled connection to " << it->first << endl;
+            delete channel;
+            it->second.erase(c);
+            return;
+        }
+    }
+}
+
+void ConnectionPool::expire(time_t now)
+{
+    for (HostMap::iterator it = hosts.begin(); it != hosts.end();) {
+        for (list<Connection>::iterator c = it->second.begin(); c != it->second.end();) {
+            if (!c->channel && now - c->since > POOL_CONNECT_TIMEOUT) {
+                log_warning() << "can't open pooled connection to " << it->first << endl;
+                failed[it->first] = now;
+                close(c->connecting);
+                c = it->second.erase(c);
+            } else if (now - c->since > MAX_POOL_IDLE) {
+                delete c->channel;
+                c = it->second.erase(c);
+            } else {
+                ++c;
+            }
+        }
+
+        if (it->second.empty()) {
+            hosts.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
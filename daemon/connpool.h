@@ -0,0 +1,84 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_CONNPOOL_H
+#define ICECREAM_CONNPOOL_H
+
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class MsgChannel;
+
+/* Connections to recently used compile servers that are set up already
+   (connected and with the protocol negotiated).  The local daemon passes
+   them to its clients along with the UseCSMsg, so that a job doesn't have
+   to wait for the connection setup.  Every connection is used for one job
+   only, as the compile server hands it to the forked job process.  */
+class ConnectionPool
+{
+public:
+    ConnectionPool()
+        : per_host(0) {}
+    ~ConnectionPool();
+
+    // connections to keep for each compile server, 0 disables the pool
+    void setSize(unsigned int size)
+    {
+        per_host = size;
+    }
+
+    bool enabled() const
+    {
+        return per_host > 0;
+    }
+
+    // a ready connection to host:port that speaks at most max_protocol,
+    // or 0; the caller owns it
+    MsgChannel *take(const std::string &host, unsigned int port, int max_protocol);
+    // starts connecting to host:port until there are enough connections
+    void refill(const std::string &host, unsigned int port);
+
+    // the connections have to be watched for the connect, the protocol
+    // setup and for the other side closing them
+    void add_fds(std::vector<int> &fds) const;
+    void handle_fd(int fd);
+    // closes connections that were not used for too long
+    void expire(time_t now);
+
+private:
+    struct Connection {
+        MsgChannel *channel; // 0 while connecting
+        int connecting;
+        time_t since;
+    };
+
+    typedef std::map<std::string, std::list<Connection> > HostMap;
+
+    HostMap hosts;
+    // time of the last failed connect, per host
+    std::map<std::string, time_t> failed;
+    unsigned int per_host;
+};
+
+#endif
@@ -0,0 +1,295 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#endif
+
+#include "logging.h"
+#include "file_util.h"
+#include "dicts.h"
+
+using namespace std;
+
+// where the samples go in the chroot of the environment
+#define DICT_SAMPLES_DIR "/tmp/.dict-samples"
+// the jobs whose samples a dictionary is trained from
+#define DICT_SAMPLES 64
+// what is saved of each chunk (up to 100 KB) of a job's input, and the most
+// of one job, so that large sources don't make up all of the samples
+#define DICT_SLICE 8192
+#define DICT_SAMPLE_MAX (128 * 1024)
+// the size zstd recommends
+#define DICT_SIZE (110 * 1024)
+
+void CompressionDicts::add(const string &target, const string &version, uint32_t id,
+                           const string &data)
+{
+    uint32_t &old = ids[make_pair(target, version)];
+
+    if (old && old != id) {
+        dicts.erase(old);
+    }
+
+    old = id;
+    dicts[id] = data;
+}
+
+bool CompressionDicts::has(const string &target, const string &version) const
+{
+    return ids.count(make_pair(target, version));
+}
+
+const string *CompressionDicts::find(uint32_t id) const
+{
+    map<uint32_t, string>::const_iterator it = dicts.find(id);
+    return it != dicts.end() ? &it->second : 0;
+}
+
+void want_dict_samples(const string &envdir, uid_t user_uid, gid_t user_gid)
+{
+#ifdef HAVE_ZSTD
+    string dir = envdir + DICT_SAMPLES_DIR;
+
+    if (mkdir(dir.c_str(), 0700) == 0) {
+        if (chown(dir.c_str(), user_uid, user_gid) != 0) {
+            log_perror("chown() of dictionary samples");
+        }
+    }
+#else
+    (void) envdir;
+    (void) user_uid;
+    (void) user_gid;
+#endif
+}
+
+/* The job that wrote it runs as the compile user, so it is checked like
+   anything else from there.  */
+bool take_trained_dict(const string &envdir, string &data, uint32_t &id)
+{
+#ifdef HAVE_ZSTD
+    string file = envdir + DICT_SAMPLES_DIR "/dict";
+    int fd = open(file.c_str(), O_RDONLY | O_NOFOLLOW);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    data.resize(DICT_SIZE + 1);
+    ssize_t len = read(fd, &data[0], data.size());
+    close(fd);
+    data.resize(len > 0 ? len : 0);
+    id = ZDICT_getDictID(data.data(), data.size());
+    drop_dict_samples(envdir);
+
+    if (len <= 0 || len > DICT_SIZE || !id) {
+        log_warning() << "invalid dictionary trained in " << envdir << endl;
+        return false;
+    }
+
+    return true;
+#else
+    (void) envdir;
+    (void) data;
+    (void) id;
+    return false;
+#endif
+}
+
+void drop_dict_samples(const string &envdir)
+{
+    string dir = envdir + DICT_SAMPLES_DIR;
+    struct stat st;
+
+    if (lstat(dir.c_str(), &st) == 0) {
+        rmpath(dir.c_str());
+    }
+}
+
+DictSample::DictSample()
+    : fd(-1)
+    , size(0)
+{
+}
+
+DictSample::~DictSample()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static size_t count_samples()
+{
+    DIR *dir = opendir(DICT_SAMPLES_DIR);
+    size_t count = 0;
+
+    if (!dir) {
+        return 0;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (!strncmp(ent->d_name, "sample.", 7)) {
+            ++count;
+        }
+    }
+
+    closedir(dir);
+    return count;
+}
+
+bool DictSample::open()
+{
+    if (access(DICT_SAMPLES_DIR, W_OK) != 0 || count_samples() >= DICT_SAMPLES) {
+        return false;
+    }
+
+    char name[] = DICT_SAMPLES_DIR "/sample.XXXXXX";
+    fd = mkstemp(name);
+    return fd >= 0;
+}
+
+void DictSample::add(const unsigned char *buf, size_t len)
+{
+    len = min(len, min(size_t(DICT_SLICE), DICT_SAMPLE_MAX - size));
+
+    if (fd < 0 || !len) {
+        return;
+    }
+
+    if (write(fd, buf, len) != ssize_t(len)) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    size += len;
+}
+
+#ifdef HAVE_ZSTD
+/* All samples, cut into DICT_SLICE pieces as they were saved.  */
+static void read_samples(string &samples, vector<size_t> &sizes)
+{
+    DIR *dir = opendir(DICT_SAMPLES_DIR);
+
+    if (!dir) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "sample.", 7)) {
+            continue;
+        }
+
+        int fd = open((DICT_SAMPLES_DIR "/" + string(ent->d_name)).c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        char buf[DICT_SLICE];
+        ssize_t len;
+
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            samples.append(buf, len);
+            sizes.push_back(len);
+        }
+
+        close(fd);
+    }
+
+    closedir(dir);
+}
+
+/* Samples it can't make a dictionary of are dropped, for new ones.  */
+static void drop_samples()
+{
+    DIR *dir = opendir(DICT_SAMPLES_DIR);
+
+    if (!dir) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (!strncmp(ent->d_name, "sample.", 7)) {
+            unlink((DICT_SAMPLES_DIR "/" + string(ent->d_name)).c_str());
+        }
+    }
+
+    closedir(dir);
+}
+#endif
+
+void train_dict()
+{
+#ifdef HAVE_ZSTD
+    if (count_samples() < DICT_SAMPLES) {
+        return;
+    }
+
+    int lock = open(DICT_SAMPLES_DIR "/lock", O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (lock < 0) {
+        return;
+    }
+
+    close(lock);
+
+    string samples;
+    vector<size_t> sizes;
+    read_samples(samples, sizes);
+    string dict(DICT_SIZE, '\0');
+    size_t len = sizes.empty() ? size_t(-1)
+                 : ZDICT_trainFromBuffer(&dict[0], dict.size(), samples.data(), &sizes[0],
+                                         sizes.size());
+
+    if (ZDICT_isError(len)) {
+        log_warning() << "training dictionary failed: " << ZDICT_getErrorName(len) << endl;
+        drop_samples();
+        unlink(DICT_SAMPLES_DIR "/lock");
+        return;
+    }
+
+    int fd = open(DICT_SAMPLES_DIR "/dict.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0) {
+        return;
+    }
+
+    bool ok = write(fd, dict.data(), len) == ssize_t(len);
+
+    if (close(fd) != 0 || !ok || rename(DICT_SAMPLES_DIR "/dict.tmp", DICT_SAMPLES_DIR "/dict") != 0) {
+        log_perror("writing dictionary");
+    }
+#endif
+}
@@ -0,0 +1,79 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_DICTS_H
+#define ICECREAM_DICTS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+/* The zstd dictionaries of environments (see CompressionDictMsg), one for
+   each, as the scheduler handed them out or this daemon trained them.  */
+class CompressionDicts
+{
+public:
+    void add(const std::string &target, const std::string &version, uint32_t id,
+             const std::string &data);
+    bool has(const std::string &target, const std::string &version) const;
+    // the dictionary with ID, 0 if there is none
+    const std::string *find(uint32_t id) const;
+
+private:
+    std::map<std::pair<std::string, std::string>, uint32_t> ids;
+    std::map<uint32_t, std::string> dicts;
+};
+
+/* The dictionary of an environment is trained from the sources its jobs
+   get.  Until there is one the daemon has the jobs save pieces of their
+   input in the environment, and the job that finds enough of them trains
+   it once its client is served.  */
+
+// the jobs in the environment at ENVDIR save samples, which USER may write
+void want_dict_samples(const std::string &envdir, uid_t user_uid, gid_t user_gid);
+// the dictionary trained in the environment at ENVDIR, if there is one
+bool take_trained_dict(const std::string &envdir, std::string &data, uint32_t &id);
+// no more samples are needed there
+void drop_dict_samples(const std::string &envdir);
+
+/* The sample of a job, in the environment's chroot.  */
+class DictSample
+{
+public:
+    DictSample();
+    ~DictSample();
+
+    // false if the environment wants no samples
+    bool open();
+    // saves the start of a chunk of the input
+    void add(const unsigned char *buf, size_t len);
+
+private:
+    int fd;
+    size_t size;
+};
+
+// trains the dictionary if there are enough samples and nobody else does
+void train_dict();
+
+#endif
@@ -0,0 +1,91 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include "envcache.h"
+
+using namespace std;
+
+list<EnvironmentCache::Entry>::iterator EnvironmentCache::entry(const string &env, time_t now)
+{
+    map<string, list<Entry>::iterator>::iterator it = entries.find(env);
+
+    if (it != entries.end()) {
+        return it->second;
+    }
+
+    Entry e;
+    e.name = env;
+    e.size = 0;
+    e.last_use = now;
+    e.pins = 0;
+    order.push_front(e);
+    entries[env] = order.begin();
+    return order.begin();
+}
+
+void EnvironmentCache::use(const string &env, time_t now)
+{
+    list<Entry>::iterator e = entry(env, now);
+    e->last_use = now;
+    order.splice(order.begin(), order, e);
+}
+
+void EnvironmentCache::installed(const string &env, size_t size, time_t now,
+                                 const string &native_key)
+{
+    list<Entry>::iterator e = entry(env, now);
+    total -= e->size;
+    e->size = size;
+    total += size;
+    e->native_key = native_key;
+    use(env, now);
+}
+
+size_t EnvironmentCache::remove(const string &env)
+{
+    map<string, list<Entry>::iterator>::iterator it = entries.find(env);
+
+    if (it == entries.end()) {
+        return 0;
+    }
+
+    size_t size = it->second->size;
+    total -= size;
+    order.erase(it->second);
+    entries.erase(it);
+    return size;
+}
+
+void EnvironmentCache::pin(const string &env, time_t now)
+{
+    entry(env, now)->pins++;
+}
+
+void EnvironmentCache::unpin(const string &env)
+{
+    map<string, list<Entry>::iterator>::iterator it = entries.find(env);
+
+    if (it != entries.end() && it->second->pins > 0) {
+        it->second->pins--;
+    }
+}
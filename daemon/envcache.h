@@ -0,0 +1,120 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_ENVCACHE_H
+#define ICECREAM_ENVCACHE_H
+
+#include <time.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+
+/* The environments the daemon has installed, and the native ones it
+   created, from the most recently used to the least.  Each keeps the size
+   it was installed with, so that removing it needs no look at the disk,
+   and the number of jobs using it, which pin it in the cache.  The files
+   the installed ones share are counted once, apart from them.  */
+class EnvironmentCache
+{
+public:
+    struct Entry {
+        std::string name;  // target/version, or the tarball of a native one
+        size_t size;
+        time_t last_use;
+        unsigned int pins;
+        std::string native_key;  // the key in native_environments, if native
+    };
+
+    typedef std::list<Entry>::const_iterator const_iterator;
+    typedef std::list<Entry>::const_reverse_iterator lru_iterator;
+
+    EnvironmentCache()
+        : total(0)
+        , shared(0) {}
+
+    // the size of all of them
+    size_t totalSize() const
+    {
+        return total + shared;
+    }
+
+    // files were added to the ones shared by the environments, or removed
+    void addShared(size_t size)
+    {
+        shared += size;
+    }
+
+    void removeShared(size_t size)
+    {
+        shared -= std::min(size, shared);
+    }
+
+    bool contains(const std::string &env) const
+    {
+        return entries.find(env) != entries.end();
+    }
+
+    // ENV is used NOW, it is added if it wasn't yet
+    void use(const std::string &env, time_t now);
+    // ENV was installed with SIZE bytes, NATIVE_KEY is set for native ones
+    void installed(const std::string &env, size_t size, time_t now,
+                   const std::string &native_key = std::string());
+    // forgets ENV, returning its size
+    size_t remove(const std::string &env);
+
+    // a job uses ENV, it's not removed until it's unpinned again
+    void pin(const std::string &env, time_t now);
+    void unpin(const std::string &env);
+
+    // most recently used first
+    const_iterator begin() const
+    {
+        return order.begin();
+    }
+
+    const_iterator end() const
+    {
+        return order.end();
+    }
+
+    // least recently used first, for picking what to remove
+    lru_iterator lru_begin() const
+    {
+        return order.rbegin();
+    }
+
+    lru_iterator lru_end() const
+    {
+        return order.rend();
+    }
+
+private:
+    std::list<Entry>::iterator entry(const std::string &env, time_t now);
+
+    std::list<Entry> order;
+    std::map<std::string, std::list<Entry>::iterator> entries;
+    size_t total;
+    size_t shared;
+};
+
+#endif
@@ -28,16 +28,40 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <linux/loop.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "comm.h"
 #include "exitcode.h"
+#include "md5.h"
+#include "ncpus.h"
 #include "util.h"
 
 using namespace std;
@@ -122,6 +146,216 @@ size_t sumup_dir(const string &dir)
     return res;
 }
 
+static void list_tree(const string &dir, const string &prefix, vector<string> &paths)
+{
+    DIR *envdir = opendir((dir + "/" + prefix).c_str());
+
+    if (!envdir) {
+        return;
+    }
+
+    for (struct dirent *ent = readdir(envdir); ent; ent = readdir(envdir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        string path = prefix + ent->d_name;
+
+        // the jobs' scratch space is not part of it
+        if (path == "tmp") {
+            continue;
+        }
+
+        struct stat st;
+
+        if (lstat((dir + "/" + path).c_str(), &st)) {
+            continue;
+        }
+
+        paths.push_back(path);
+
+        if (S_ISDIR(st.st_mode)) {
+            list_tree(dir, path + "/", paths);
+        }
+    }
+
+    closedir(envdir);
+}
+
+static bool md5_append_file(md5_state_t *state, const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    md5_byte_t buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close(fd);
+            return false;
+        }
+
+        md5_append(state, buffer, bytes);
+    }
+
+    close(fd);
+    return true;
+}
+
+static string md5_hex(md5_state_t *state)
+{
+    md5_byte_t digest[16];
+    md5_finish(state, digest);
+
+    char digest_cstr[33];
+
+    for (int di = 0; di < 16; ++di) {
+        sprintf(digest_cstr + di * 2, "%02x", digest[di]);
+    }
+
+    return digest_cstr;
+}
+
+/* A hash of the names, types and contents of everything in an installed
+   environment, to check that another daemon's copy arrived intact.  The
+   permissions are left out, unpacking applies the umask.  */
+string environment_hash(const string &dir)
+{
+    vector<string> paths;
+    list_tree(dir, "", paths);
+    sort(paths.begin(), paths.end());
+
+    md5_state_t state;
+    md5_init(&state);
+
+    for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        string file = dir + "/" + *it;
+        struct stat st;
+
+        if (lstat(file.c_str(), &st)) {
+            return string();
+        }
+
+        char type = S_ISDIR(st.st_mode) ? 'd' : S_ISLNK(st.st_mode) ? 'l' : S_ISREG(st.st_mode) ? 'f' : 'o';
+        string header = *it + '\0' + type + toString(st.st_size) + '\0';
+        md5_append(&state, (const md5_byte_t *) header.data(), header.size());
+
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(file.c_str(), target, sizeof(target));
+
+            if (len < 0) {
+                return string();
+            }
+
+            md5_append(&state, (const md5_byte_t *) target, len);
+        } else if (S_ISREG(st.st_mode) && !md5_append_file(&state, file)) {
+            return string();
+        }
+    }
+
+    return md5_hex(&state);
+}
+
+/* Where the files of the installed environments are kept once for all of
+   them, named by their contents.  The environments have hard links to them,
+   a file only linked from here is no longer used.  */
+#define SHARED_STORE "/.store"
+
+/* Replaces the files of the environment in DIRNAME by links to the same
+   files in the store of BASENAME, moving the ones it doesn't have yet
+   there.  Returns the size of the files that can't be shared, STORED gets
+   what was new to the store.  */
+static size_t share_files(const string &basename, const string &dirname, size_t &stored)
+{
+    string store = basename + SHARED_STORE;
+
+    if (mkdir(store.c_str(), 0755) && errno != EEXIST) {
+        log_perror("mkdir store");
+        return sumup_dir(dirname);
+    }
+
+    vector<string> paths;
+    list_tree(dirname, "", paths);
+    size_t own = 0;
+
+    for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        string file = dirname + "/" + *it;
+        struct stat st;
+
+        if (lstat(file.c_str(), &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        md5_state_t state;
+        md5_init(&state);
+
+        if (!md5_append_file(&state, file)) {
+            own += st.st_size;
+            continue;
+        }
+
+        // the mode is shared as well
+        char mode[20];
+        sprintf(mode, "-%o", (unsigned int)(st.st_mode & 07777));
+        string shared = store + "/" + md5_hex(&state) + "-" + toString(st.st_size) + mode;
+
+        if (link(file.c_str(), shared.c_str()) == 0) {
+            stored += st.st_size;
+            continue;
+        }
+
+        if (errno == EEXIST) {
+            string tmp = file + ".icecc-shared";
+
+            if (link(shared.c_str(), tmp.c_str()) == 0 && rename(tmp.c_str(), file.c_str()) == 0) {
+                continue;
+            }
+
+            unlink(tmp.c_str());
+        }
+
+        // e.g. too many links already
+        own += st.st_size;
+    }
+
+    return own;
+}
+
+/* Removes the files from the store of BASENAME that no environment uses
+   anymore, returning their size.  */
+static size_t collect_shared_files(const string &basename)
+{
+    string store = basename + SHARED_STORE;
+    DIR *dir = opendir(store.c_str());
+    size_t freed = 0;
+
+    if (!dir) {
+        return 0;
+    }
+
+    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
+        string file = store + "/" + ent->d_name;
+        struct stat st;
+
+        if (ent->d_name[0] != '.' && !lstat(file.c_str(), &st) && S_ISREG(st.st_mode)
+                && st.st_nlink == 1 && !unlink(file.c_str())) {
+            freed += st.st_size;
+        }
+    }
+
+    closedir(dir);
+    return freed;
+}
+
 static void list_target_dirs(const string &current_target, const string &targetdir, Environments &envs)
 {
     DIR *envdir = opendir(targetdir.c_str());
@@ -164,8 +398,9 @@ static bool exec_and_wait(const char *const argv[])
     _exit(execv(argv[0], const_cast<char * const *>(argv)));
 }
 
-// Removes everything in the directory recursively, but not the directory itself.
-static bool cleanup_directory(const string &directory)
+// Removes everything in the directory recursively, but not the directory itself
+// and not its entry KEEP.
+static bool cleanup_directory(const string &directory, const char *keep = NULL)
 {
     DIR *dir = opendir(directory.c_str());
 
@@ -174,7 +409,8 @@ static bool cleanup_directory(const string &directory)
     }
 
     while (dirent *f = readdir(dir)) {
-        if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0) {
+        if (strcmp(f->d_name, ".") == 0 || strcmp(f->d_name, "..") == 0
+                || (keep && strcmp(f->d_name, keep) == 0)) {
             continue;
         }
 
@@ -201,11 +437,48 @@ static bool cleanup_directory(const string &directory)
     return true;
 }
 
+/* Scratch tmpfs and image mounts left by a daemon that didn't exit
+   cleanly would keep rm from removing its environments.  */
+static void release_stale_mounts(const string &basedir)
+{
+#ifdef __linux__
+    FILE *mounts = fopen("/proc/mounts", "r");
+
+    if (!mounts) {
+        return;
+    }
+
+    string prefix = basedir + "/";
+    vector<string> stale;
+    char device[PATH_MAX], mountpoint[PATH_MAX], fstype[100];
+
+    while (fscanf(mounts, "%4095s %4095s %99s %*[^\n]", device, mountpoint, fstype) == 3) {
+        if (!strncmp(mountpoint, prefix.c_str(), prefix.size())) {
+            stale.push_back(mountpoint);
+        }
+    }
+
+    fclose(mounts);
+
+    // the ones on top (a tmp on its image) come later in the list
+    for (vector<string>::reverse_iterator it = stale.rbegin(); it != stale.rend(); ++it) {
+        if (umount2(it->c_str(), MNT_DETACH) && errno != EINVAL) {
+            log_perror("umount stale mount");
+        }
+    }
+#else
+    (void) basedir;
+#endif
+}
+
 bool cleanup_cache(const string &basedir, uid_t user_uid, gid_t user_gid)
 {
     flush_debug();
 
-    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_directory(basedir)) {
+    release_stale_mounts(basedir);
+
+    // the native environments are reused, see load_native_index()
+    if (access(basedir.c_str(), R_OK) == 0 && !cleanup_directory(basedir, "native")) {
         log_error() << "failed to clean up envs dir" << endl;
         return false;
     }
@@ -256,66 +529,218 @@ Environments available_environmnents(const string &basedir)
     return envs;
 }
 
-void save_compiler_timestamps(time_t &gcc_bin_timestamp, time_t &gpp_bin_timestamp, time_t &clang_bin_timestamp)
+/* The binaries a native environment of COMPILER is made from.  */
+static list<string> native_compiler_files(const string &compiler)
 {
-    struct stat st;
+    list<string> files;
 
-    if (stat("/usr/bin/gcc", &st) == 0) {
-        gcc_bin_timestamp = st.st_mtime;
+    if (compiler == "clang") {
+        files.push_back("/usr/bin/clang");
     } else {
-        gcc_bin_timestamp = 0;
+        files.push_back("/usr/bin/gcc");
+        files.push_back("/usr/bin/g++");
     }
 
-    if (stat("/usr/bin/g++", &st) == 0) {
-        gpp_bin_timestamp = st.st_mtime;
-    } else {
-        gpp_bin_timestamp = 0;
+    return files;
+}
+
+struct FileHash {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    string hash;
+};
+
+/* The contents of FILE hashed, a compiler is read again only when it
+   is not the same file anymore.  Empty if it can't be read.  */
+static string file_hash(const string &file)
+{
+    static map<string, FileHash> hashes;
+    struct stat st;
+
+    if (stat(file.c_str(), &st) != 0) {
+        hashes.erase(file);
+        return string();
     }
 
-    if (stat("/usr/bin/clang", &st) == 0) {
-        clang_bin_timestamp = st.st_mtime;
-    } else {
-        clang_bin_timestamp = 0;
+    map<string, FileHash>::const_iterator it = hashes.find(file);
+
+    if (it != hashes.end() && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+            && it->second.size == st.st_size && it->second.mtime == st.st_mtime
+            && it->second.ctime == st.st_ctime) {
+        return it->second.hash;
+    }
+
+    md5_state_t state;
+    md5_init(&state);
+
+    if (!md5_append_file(&state, file)) {
+        return string();
     }
+
+    FileHash &entry = hashes[file];
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.ctime = st.st_ctime;
+    entry.hash = md5_hex(&state);
+    return entry.hash;
 }
 
-bool compilers_uptodate(time_t gcc_bin_timestamp, time_t gpp_bin_timestamp, time_t clang_bin_timestamp)
+/* What a native environment of COMPILER with EXTRAFILES is built from:
+   it needs a rebuild when this changes, and a tarball built for the
+   same one can be used again.  Empty if one of the files is missing.  */
+string compiler_fingerprint(const string &compiler, const list<string> &extrafiles)
 {
-    struct stat st;
+    list<string> files = native_compiler_files(compiler);
+    files.insert(files.end(), extrafiles.begin(), extrafiles.end());
 
-    if (stat("/usr/bin/gcc", &st) == 0) {
-        if (st.st_mtime != gcc_bin_timestamp) {
-            return false;
-        }
-    } else {
-        if (gcc_bin_timestamp != 0) {
-            return false;
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *) compiler.c_str(), compiler.size() + 1);
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        string hash = file_hash(*it);
+
+        if (hash.empty()) {
+            return string();
         }
+
+        string entry = *it + '\0' + hash;
+        md5_append(&state, (const md5_byte_t *) entry.c_str(), entry.size() + 1);
     }
 
-    if (stat("/usr/bin/g++", &st) == 0) {
-        if (st.st_mtime != gpp_bin_timestamp) {
-            return false;
+    return md5_hex(&state);
+}
+
+/* The index of the native environments, so that a restarted daemon
+   doesn't have to build them again.  A line per tarball with its
+   fingerprint, name and the key it was built for, the key last as the
+   extra files may have spaces.  */
+list<NativeEnvRecord> load_native_index(const string &basedir)
+{
+    string nativedir = basedir + "/native/";
+    list<NativeEnvRecord> records;
+    set<string> tarballs;
+    ifstream index((nativedir + "index").c_str());
+    string line;
+
+    while (getline(index, line)) {
+        string::size_type first = line.find(' ');
+        string::size_type second = first == string::npos ? first : line.find(' ', first + 1);
+
+        if (second == string::npos) {
+            continue;
         }
-    } else {
-        if (gpp_bin_timestamp != 0) {
-            return false;
+
+        NativeEnvRecord record;
+        record.fingerprint = line.substr(0, first);
+        record.tarball = nativedir + line.substr(first + 1, second - first - 1);
+        record.key = line.substr(second + 1);
+
+        if (access(record.tarball.c_str(), R_OK) == 0 && !tarballs.count(record.tarball)) {
+            tarballs.insert(record.tarball);
+            records.push_back(record);
         }
     }
 
-    if (stat("/usr/bin/clang", &st) == 0) {
-        if (st.st_mtime != clang_bin_timestamp) {
-            return false;
-        }
-    } else {
-        if (clang_bin_timestamp != 0) {
-            return false;
+    // what isn't in the index was left by a build that didn't finish
+    if (DIR *dir = opendir(nativedir.c_str())) {
+        while (dirent *f = readdir(dir)) {
+            string path = nativedir + f->d_name;
+
+            if (f->d_name[0] != '.' && strcmp(f->d_name, "index") && !tarballs.count(path)) {
+                unlink(path.c_str());
+            }
         }
+
+        closedir(dir);
+    }
+
+    return records;
+}
+
+bool save_native_index(const string &basedir, const list<NativeEnvRecord> &records)
+{
+    string nativedir = basedir + "/native/";
+    string tmp = nativedir + "index.tmp";
+    ofstream index(tmp.c_str());
+
+    for (list<NativeEnvRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        index << it->fingerprint << ' ' << it->tarball.substr(it->tarball.rfind('/') + 1)
+              << ' ' << it->key << '\n';
+    }
+
+    index.close();
+
+    if (!index || rename(tmp.c_str(), (nativedir + "index").c_str())) {
+        log_perror("failed to save the native environments");
+        unlink(tmp.c_str());
+        return false;
     }
 
     return true;
 }
 
+/* Watches the directories of the compilers for packages being upgraded,
+   returns the fd to read the changes from or -1.  */
+int watch_compilers()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0) {
+        log_perror("inotify_init1");
+        return -1;
+    }
+
+    list<string> files = native_compiler_files("gcc");
+    list<string> clang = native_compiler_files("clang");
+    files.insert(files.end(), clang.begin(), clang.end());
+    set<string> dirs;
+
+    for (list<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        dirs.insert(it->substr(0, it->rfind('/')));
+        char target[PATH_MAX];
+
+        // the links in /usr/bin stay, what they point to is replaced
+        if (realpath(it->c_str(), target)) {
+            string path = target;
+            dirs.insert(path.substr(0, path.rfind('/')));
+        }
+    }
+
+    for (set<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        if (inotify_add_watch(fd, it->c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+                              | IN_DELETE | IN_ATTRIB) < 0) {
+            log_perror("inotify_add_watch");
+        }
+    }
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Reads what came in on the fd of watch_compilers(), returns whether
+   something changed.  */
+bool compilers_changed(int fd)
+{
+    char buffer[4096];
+    bool changed = false;
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0 || (bytes < 0 && errno == EINTR)) {
+        changed = changed || bytes > 0;
+    }
+
+    return changed;
+}
+
 // Returns fd for icecc-create-env output
 int start_create_env(const string &basedir, uid_t user_uid, gid_t user_gid,
                      const std::string &compiler, const list<string> &extrafiles)
@@ -441,60 +866,528 @@ size_t finish_create_env(int pipe, const string &basedir, string &native_environ
 }
 
 
-pid_t start_install_environment(const std::string &basename, const std::string &target,
-                                const std::string &name, MsgChannel *c,
-                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
-                                uid_t user_uid, gid_t user_gid)
+/* Environments can also come as a squashfs or erofs image, which is
+   mounted instead of extracted with --mount-environments.  Returns its
+   filesystem type, if the data starts one.  */
+static const char *image_type(const unsigned char *buffer, size_t len)
 {
-    if (!name.size()) {
-        log_error() << "illegal name for environment " << name << endl;
-        return 0;
-    }
+    // 0xE0F5E1E2 at the start of the superblock, which is at 1024
+    static const unsigned char erofs_magic[] = { 0xe2, 0xe1, 0xf5, 0xe0 };
 
-    for (string::size_type i = 0; i < name.size(); ++i) {
-        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
-            continue;
-        }
+    if (len >= 4 && !memcmp(buffer, "hsqs", 4)) {
+        return "squashfs";
+    }
 
-        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
-        return 0;
+    if (len >= 1028 && !memcmp(buffer + 1024, erofs_magic, 4)) {
+        return "erofs";
     }
 
-    string dirname = basename + "/target=" + target;
-    Msg *msg = c->get_msg(30);
+    return NULL;
+}
 
-    if (!msg || msg->type != M_FILE_CHUNK) {
-        trace() << "Expected first file chunk\n";
-        return 0;
+static const char *image_file_type(const string &image)
+{
+    unsigned char buffer[1028];
+    int fd = open(image.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
     }
 
-    fmsg = dynamic_cast<FileChunkMsg*>(msg);
-    enum { BZip2, Gzip, None} compression = None;
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+    close(fd);
 
-    if (fmsg->len > 2) {
-        if (fmsg->buffer[0] == 037 && fmsg->buffer[1] == 0213) {
-            compression = Gzip;
-        } else if (fmsg->buffer[0] == 'B' && fmsg->buffer[1] == 'Z') {
-            compression = BZip2;
+    return len > 0 ? image_type(buffer, len) : NULL;
+}
+
+static string find_tool(const char *name)
+{
+    static const char *const dirs[] = { "/usr/bin/", "/usr/sbin/", "/bin/", "/sbin/", NULL };
+
+    for (const char *const *dir = dirs; *dir; ++dir) {
+        string path = string(*dir) + name;
+
+        if (access(path.c_str(), X_OK) == 0) {
+            return path;
         }
     }
 
-    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
-        log_perror("mkdir target");
-        return 0;
-    }
+    return string();
+}
 
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod target");
-        return 0;
+#ifdef __linux__
+static bool loop_mount(const string &image, const string &dirname, const char *type)
+{
+    int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+
+    if (control < 0) {
+        return false;
     }
 
-    dirname = dirname + "/" + name;
+    int image_fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    bool mounted = false;
 
-    if (mkdir(dirname.c_str(), 0770)) {
-        log_perror("mkdir name");
-        return 0;
-    }
+    // someone else may take the free device before us
+    for (int tries = 0; image_fd >= 0 && !mounted && tries < 3; ++tries) {
+        int nr = ioctl(control, LOOP_CTL_GET_FREE);
+
+        if (nr < 0) {
+            break;
+        }
+
+        char device[32];
+        snprintf(device, sizeof(device), "/dev/loop%d", nr);
+        int loop = open(device, O_RDONLY | O_CLOEXEC);
+
+        if (loop < 0) {
+            break;
+        }
+
+        if (ioctl(loop, LOOP_SET_FD, image_fd)) {
+            close(loop);
+
+            if (errno == EBUSY) {
+                continue;
+            }
+
+            break;
+        }
+
+        // the device goes away with the mount
+        struct loop_info64 info;
+        memset(&info, 0, sizeof(info));
+        info.lo_flags = LO_FLAGS_AUTOCLEAR;
+        ioctl(loop, LOOP_SET_STATUS64, &info);
+
+        mounted = mount(device, dirname.c_str(), type, MS_RDONLY | MS_NODEV | MS_NOSUID, NULL) == 0;
+
+        if (!mounted) {
+            log_perror("mount environment image");
+            ioctl(loop, LOOP_CLR_FD, 0);
+            close(loop);
+            break;
+        }
+
+        close(loop);
+    }
+
+    if (image_fd >= 0) {
+        close(image_fd);
+    }
+
+    close(control);
+    return mounted;
+}
+#endif
+
+static void unmount_image(const string &dirname)
+{
+#ifdef __linux__
+    if (umount2(dirname.c_str(), MNT_DETACH) == 0 || errno != EPERM) {
+        return;
+    }
+
+    // mounted with FUSE by a daemon that can't unmount itself
+    string fusermount = find_tool("fusermount");
+
+    if (!fusermount.empty()) {
+        const char *argv[] = { fusermount.c_str(), "-u", "-z", dirname.c_str(), NULL };
+        exec_and_wait(argv);
+    }
+#else
+    (void) dirname;
+#endif
+}
+
+/* Mounts the image read-only on dirname, with loop devices and otherwise
+   FUSE, and a writable directory next to it on its tmp.  */
+static bool mount_image(const string &image, const string &dirname, uid_t user_uid, gid_t user_gid)
+{
+#ifdef __linux__
+    const char *type = image_file_type(image);
+
+    if (!type) {
+        return false;
+    }
+
+    bool mounted = loop_mount(image, dirname, type);
+
+    if (!mounted) {
+        string fuse = find_tool(strcmp(type, "squashfs") ? "erofsfuse" : "squashfuse");
+
+        if (!fuse.empty()) {
+            const char *argv[] = { fuse.c_str(), "-o", "ro,allow_other", image.c_str(), dirname.c_str(), NULL };
+            mounted = exec_and_wait(argv);
+        }
+    }
+
+    if (!mounted) {
+        return false;
+    }
+
+    string scratch = dirname + ".tmp";
+
+    if ((mkdir(scratch.c_str(), 01775) == 0 || errno == EEXIST)
+            && chown(scratch.c_str(), user_uid, user_gid) == 0 && chmod(scratch.c_str(), 01775) == 0
+            && mount(scratch.c_str(), (dirname + "/tmp").c_str(), NULL, MS_BIND, NULL) == 0) {
+        return true;
+    }
+
+    log_perror("bind mount tmp of environment image");
+    unmount_image(dirname);
+#else
+    (void) image;
+    (void) dirname;
+    (void) user_uid;
+    (void) user_gid;
+#endif
+    return false;
+}
+
+/* For daemons that don't mount images or where that fails, runs as the
+   user of the jobs.  */
+static bool extract_image(const string &image, const string &dirname, uid_t user_uid, gid_t user_gid)
+{
+    const char *type = image_file_type(image);
+    bool erofs = type && !strcmp(type, "erofs");
+    string tool = find_tool(erofs ? "fsck.erofs" : "unsquashfs");
+
+    if (!type || tool.empty()) {
+        return false;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("fork");
+        return false;
+    }
+
+    if (pid) {
+        int status = 1;
+
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+        return shell_exit_status(status) == 0;
+    }
+
+#ifndef HAVE_LIBCAP_NG
+
+    if (setgroups(0, NULL) < 0) {
+        log_perror("setgroups fails");
+        _exit(143);
+    }
+
+    if (setgid(user_gid) < 0) {
+        log_perror("setgid fails");
+        _exit(143);
+    }
+
+    if (!geteuid() && setuid(user_uid) < 0) {
+        log_perror("setuid fails");
+        _exit(142);
+    }
+
+#else
+    (void) user_uid;
+    (void) user_gid;
+#endif
+
+    close(STDOUT_FILENO);
+
+    if (erofs) {
+        string extract = "--extract=" + dirname;
+        const char *argv[] = { tool.c_str(), extract.c_str(), "--force", image.c_str(), NULL };
+        _exit(execv(argv[0], const_cast<char * const *>(argv)));
+    }
+
+    const char *argv[] = { tool.c_str(), "-f", "-d", dirname.c_str(), image.c_str(), NULL };
+    _exit(execv(argv[0], const_cast<char * const *>(argv)));
+}
+
+
+#ifdef HAVE_ZSTD
+static ssize_t read_full(int fd, unsigned char *buffer, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t bytes = read(fd, buffer + done, len - done);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            return -1;
+        }
+
+        if (bytes == 0) {
+            break;
+        }
+
+        done += bytes;
+    }
+
+    return done;
+}
+
+static bool write_full(int fd, const unsigned char *buffer, size_t len)
+{
+    while (len) {
+        ssize_t bytes = write(fd, buffer, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        buffer += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+/* pzstd precedes each frame with a skippable frame holding its compressed
+   size, which lets the frames be decompressed in parallel.  */
+static const size_t pzstd_header_size = 12;
+
+static bool is_pzstd_header(const unsigned char *header)
+{
+    static const unsigned char magic[] = { 0x50, 0x2a, 0x4d, 0x18, 4, 0, 0, 0 };
+    return !memcmp(header, magic, sizeof(magic));
+}
+
+struct ZstdFrame {
+    pthread_t thread;
+    bool threaded;
+    bool ok;
+    vector<unsigned char> in;
+    vector<unsigned char> out;
+};
+
+static void *decompress_frame(void *arg)
+{
+    ZstdFrame *frame = static_cast<ZstdFrame *>(arg);
+    unsigned long long content_size = ZSTD_getFrameContentSize(&frame->in[0], frame->in.size());
+
+    if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR) {
+        frame->out.reserve(content_size);
+    }
+
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer input = { &frame->in[0], frame->in.size(), 0 };
+    size_t ret = 1;
+
+    frame->ok = false;
+
+    while (ret != 0) {
+        size_t pos = frame->out.size();
+        frame->out.resize(pos + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer output = { &frame->out[pos], ZSTD_DStreamOutSize(), 0 };
+        ret = ZSTD_decompressStream(stream, &output, &input);
+        frame->out.resize(pos + output.pos);
+
+        // truncated if neither input nor output is left
+        if (ZSTD_isError(ret) || (ret != 0 && input.pos == input.size && output.pos == 0)) {
+            break;
+        }
+    }
+
+    frame->ok = ret == 0;
+    ZSTD_freeDStream(stream);
+    return NULL;
+}
+
+static bool finish_frame(ZstdFrame *frame, int out)
+{
+    if (frame->threaded) {
+        pthread_join(frame->thread, NULL);
+    }
+
+    bool ok = frame->ok && write_full(out, frame->out.empty() ? NULL : &frame->out[0], frame->out.size());
+    delete frame;
+    return ok;
+}
+
+/* Each frame gets a thread, at most as many as there are CPUs run while
+   the next ones are read.  They are written out in order.  */
+static bool zstd_decompress_parallel(int in, int out, unsigned char *header)
+{
+    int threads = 1;
+    dcc_ncpus(&threads);
+    threads = max(threads, 2);
+
+    deque<ZstdFrame *> running;
+    bool ok = true;
+    ssize_t got = pzstd_header_size;
+
+    while (ok && got) {
+        if (got != (ssize_t) pzstd_header_size || !is_pzstd_header(header)) {
+            ok = false;
+            break;
+        }
+
+        uint32_t size = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t) header[11] << 24);
+        ZstdFrame *frame = new ZstdFrame;
+        frame->in.resize(size);
+
+        if (!size || read_full(in, &frame->in[0], size) != (ssize_t) size) {
+            delete frame;
+            ok = false;
+            break;
+        }
+
+        frame->threaded = pthread_create(&frame->thread, NULL, decompress_frame, frame) == 0;
+
+        if (!frame->threaded) {
+            decompress_frame(frame);
+        }
+
+        running.push_back(frame);
+
+        while (ok && running.size() >= (size_t) threads) {
+            ok = finish_frame(running.front(), out);
+            running.pop_front();
+        }
+
+        got = read_full(in, header, pzstd_header_size);
+    }
+
+    while (!running.empty()) {
+        ok = finish_frame(running.front(), out) && ok;
+        running.pop_front();
+    }
+
+    return ok;
+}
+
+static bool zstd_decompress_stream(int in, int out, const unsigned char *start, size_t start_len)
+{
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    vector<unsigned char> inbuf(ZSTD_DStreamInSize());
+    vector<unsigned char> outbuf(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer input = { start, start_len, 0 };
+    size_t ret = 0;
+    bool ok = true;
+
+    while (ok) {
+        ZSTD_outBuffer output = { &outbuf[0], outbuf.size(), 0 };
+
+        // also flush what the decoder holds when the output was full
+        while (ok && (input.pos < input.size || output.pos == output.size)) {
+            output.pos = 0;
+            ret = ZSTD_decompressStream(stream, &output, &input);
+            ok = !ZSTD_isError(ret) && write_full(out, &outbuf[0], output.pos);
+        }
+
+        if (!ok) {
+            break;
+        }
+
+        ssize_t bytes = read_full(in, &inbuf[0], inbuf.size());
+
+        if (bytes <= 0) {
+            ok = bytes == 0 && ret == 0;
+            break;
+        }
+
+        input.src = &inbuf[0];
+        input.size = bytes;
+        input.pos = 0;
+    }
+
+    ZSTD_freeDStream(stream);
+    return ok;
+}
+
+/* Decompresses the archive from in to out, the way tar would run zstd,
+   but in parallel for archives made by pzstd.  */
+static bool zstd_decompress(int in, int out)
+{
+    unsigned char header[pzstd_header_size];
+    ssize_t got = read_full(in, header, sizeof(header));
+
+    if (got < 0) {
+        return false;
+    }
+
+    if (got == (ssize_t) sizeof(header) && is_pzstd_header(header)) {
+        return zstd_decompress_parallel(in, out, header);
+    }
+
+    return zstd_decompress_stream(in, out, header, got);
+}
+#endif
+
+
+pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                const std::string &name, MsgChannel *c,
+                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
+                                uid_t user_uid, gid_t user_gid)
+{
+    if (!name.size()) {
+        log_error() << "illegal name for environment " << name << endl;
+        return 0;
+    }
+
+    for (string::size_type i = 0; i < name.size(); ++i) {
+        if (isascii(name[i]) && !isspace(name[i]) && name[i] != '/' && isprint(name[i])) {
+            continue;
+        }
+
+        log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
+        return 0;
+    }
+
+    string dirname = basename + "/target=" + target;
+    Msg *msg = c->get_msg(30);
+
+    if (!msg || msg->type != M_FILE_CHUNK) {
+        trace() << "Expected first file chunk\n";
+        return 0;
+    }
+
+    fmsg = dynamic_cast<FileChunkMsg*>(msg);
+    enum { BZip2, Gzip, Zstd, None} compression = None;
+    const char *image = image_type(fmsg->buffer, fmsg->len);
+    static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+    static const unsigned char skippable_magic[] = { 0x50, 0x2a, 0x4d, 0x18 };
+
+    if (fmsg->len > 2) {
+        if (fmsg->buffer[0] == 037 && fmsg->buffer[1] == 0213) {
+            compression = Gzip;
+        } else if (fmsg->buffer[0] == 'B' && fmsg->buffer[1] == 'Z') {
+            compression = BZip2;
+        } else if (fmsg->len > 4 && (!memcmp(fmsg->buffer, zstd_magic, 4)
+                                     || !memcmp(fmsg->buffer, skippable_magic, 4))) {
+            compression = Zstd;
+        }
+    }
+
+    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir target");
+        return 0;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod target");
+        return 0;
+    }
+
+    dirname = dirname + "/" + name;
+
+    if (mkdir(dirname.c_str(), 0770)) {
+        log_perror("mkdir name");
+        return 0;
+    }
 
     if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
         log_perror("chown,chmod name");
@@ -547,29 +1440,184 @@ pid_t start_install_environment(const std::string &basename, const std::string &
     close(fds[1]);
     dup2(fds[0], 0);
 
+    if (image) {
+        // kept as it is, finalize_install_environment() mounts or extracts it
+        int fd = open((dirname + ".image").c_str(), O_WRONLY | O_CREAT | O_EXCL, 0640);
+        unsigned char buffer[100000];
+
+        while (fd >= 0) {
+            ssize_t bytes = read(0, buffer, sizeof(buffer));
+
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytes == 0) {
+                _exit(close(fd) ? 1 : 0);
+            }
+
+            if (bytes < 0 || write(fd, buffer, bytes) != bytes) {
+                break;
+            }
+        }
+
+        log_perror("write environment image");
+        _exit(1);
+    }
+
+#ifdef HAVE_ZSTD
+    /* Decompressed here, while the chunks are still coming, and fed
+       to tar like an uncompressed archive.  */
+    if (compression == Zstd) {
+        int tar_fds[2];
+
+        if (pipe(tar_fds)) {
+            _exit(1);
+        }
+
+        pid_t tar_pid = fork();
+
+        if (tar_pid < 0) {
+            _exit(1);
+        }
+
+        if (tar_pid) {
+            close(tar_fds[0]);
+            bool ok = zstd_decompress(0, tar_fds[1]);
+            close(tar_fds[1]);
+
+            if (!ok) {
+                log_error() << "failed to decompress environment " << name << endl;
+            }
+
+            int status = 1;
+
+            while (waitpid(tar_pid, &status, 0) < 0 && errno == EINTR) {}
+
+            _exit(ok ? shell_exit_status(status) : 1);
+        }
+
+        close(tar_fds[1]);
+        dup2(tar_fds[0], 0);
+        close(tar_fds[0]);
+        compression = None;
+    }
+#endif
+
     char **argv;
-    argv = new char*[6];
-    argv[0] = strdup(TAR);
-    argv[1] = strdup("-C");
-    argv[2] = strdup(dirname.c_str());
+    argv = new char*[7];
+    int argc = 0;
+    argv[argc++] = strdup(TAR);
+    argv[argc++] = strdup("-C");
+    argv[argc++] = strdup(dirname.c_str());
 
     if (compression == BZip2) {
-        argv[3] = strdup("-xjf");
+        argv[argc++] = strdup("-xjf");
     } else if (compression == Gzip) {
-        argv[3] = strdup("-xzf");
+        argv[argc++] = strdup("-xzf");
+    } else if (compression == Zstd) {
+        argv[argc++] = strdup("--zstd");
+        argv[argc++] = strdup("-xf");
     } else if (compression == None) {
-        argv[3] = strdup("-xf");
+        argv[argc++] = strdup("-xf");
     }
 
-    argv[4] = strdup("-");
-    argv[5] = 0;
+    argv[argc++] = strdup("-");
+    argv[argc] = 0;
     _exit(execv(argv[0], argv));
 }
 
 
+/* Sends the installed environment to another daemon, the way a client
+   uploads one: an EnvTransferMsg with the environment_hash(), the tar
+   archive in file chunks and an EndMsg.  That happens in a child process,
+   whose pid is returned.  */
+pid_t start_send_environment(const std::string &basename, const std::string &target,
+                             const std::string &name, MsgChannel *c)
+{
+    string dirname = basename + "/target=" + target + "/" + name;
+
+    if (name.empty() || name.find('/') != string::npos || target.find('/') != string::npos
+            || access((dirname + "/usr/bin/as").c_str(), X_OK)) {
+        log_error() << "can't send environment " << name << " (" << target << ")" << endl;
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid) {
+        if (pid < 0) {
+            log_perror("fork");
+            return 0;
+        }
+
+        return pid;
+    }
+
+    reset_debug(0);
+
+    int fds[2];
+
+    if (pipe(fds)) {
+        _exit(1);
+    }
+
+    pid_t tar_pid = fork();
+
+    if (tar_pid < 0) {
+        _exit(1);
+    }
+
+    if (!tar_pid) {
+        close(fds[0]);
+        dup2(fds[1], 1);
+        close(fds[1]);
+
+        const char *argv[] = { TAR, "-C", dirname.c_str(), "--exclude=./tmp", "-cf", "-", ".", 0 };
+        _exit(execv(argv[0], const_cast<char * const *>(argv)));
+    }
+
+    close(fds[1]);
+
+    bool ok = c->send_msg(EnvTransferMsg(target, name, environment_hash(dirname)));
+    unsigned char buffer[100000];
+
+    while (ok) {
+        ssize_t bytes = read(fds[0], buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+
+        ok = c->send_msg(FileChunkMsg(buffer, bytes));
+    }
+
+    close(fds[0]);
+
+    int status = 1;
+
+    while (waitpid(tar_pid, &status, 0) < 0 && errno == EINTR) {}
+
+    /* Only a complete archive ends with an EndMsg.  */
+    if (ok && shell_exit_status(status) == 0) {
+        ok = c->send_msg(EndMsg());
+    }
+
+    _exit(ok ? 0 : 1);
+}
+
 size_t finalize_install_environment(const std::string &basename, const std::string &target,
-                                    pid_t pid, uid_t user_uid, gid_t user_gid)
+                                    pid_t pid, uid_t user_uid, gid_t user_gid, bool mount_images,
+                                    size_t &own_size, size_t &stored_size)
 {
+    own_size = stored_size = 0;
+
     int status = 1;
 
     while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
@@ -581,6 +1629,24 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
     }
 
     string dirname = basename + "/target=" + target;
+    string image = dirname + ".image";
+    struct stat st;
+
+    if (lstat(image.c_str(), &st) == 0) {
+        if (mount_images && mount_image(image, dirname, user_uid, user_gid)) {
+            own_size = st.st_size;
+            return st.st_size;
+        }
+
+        bool extracted = extract_image(image, dirname, user_uid, user_gid);
+        unlink(image.c_str());
+
+        if (!extracted) {
+            log_error() << "can't mount or extract " << image << endl;
+            remove_environment(basename, target);
+            return 0;
+        }
+    }
 
     errno = 0;
     mkdir((dirname + "/tmp").c_str(), 01775);
@@ -591,14 +1657,63 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
                     << strerror(errno) << endl;
     }
 
-    return sumup_dir(dirname);
+    size_t size = sumup_dir(dirname);
+
+    if (size) {
+        own_size = share_files(basename, dirname, stored_size);
+    }
+
+    return size;
+}
+
+bool mount_scratch_space(const string &basename, const string &env, unsigned int size_mb,
+                         uid_t user_uid, gid_t user_gid)
+{
+#ifdef __linux__
+    string dirname = basename + "/target=" + env + "/tmp";
+    char options[100];
+    snprintf(options, sizeof(options), "size=%um,mode=1775,uid=%d,gid=%d", size_mb,
+             (int) user_uid, (int) user_gid);
+
+    if (mount("tmpfs", dirname.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options) == 0) {
+        return true;
+    }
+
+    log_perror("mount scratch tmpfs");
+#else
+    (void) basename;
+    (void) env;
+    (void) size_mb;
+    (void) user_uid;
+    (void) user_gid;
+#endif
+    return false;
+}
+
+static void release_scratch_space(const string &dirname)
+{
+#ifdef __linux__
+    // EINVAL: it's on disk, no tmpfs was mounted there
+    if (umount2((dirname + "/tmp").c_str(), MNT_DETACH) && errno != EINVAL && errno != ENOENT
+            && errno != EPERM) {
+        log_perror("umount scratch space");
+    }
+#else
+    (void) dirname;
+#endif
 }
 
+/* The daemon knows the size it was installed with, see EnvironmentCache.
+   Returns the size of the shared files only it used.  */
 size_t remove_environment(const string &basename, const string &env)
 {
     string dirname = basename + "/target=" + env;
 
-    size_t res = sumup_dir(dirname);
+    release_scratch_space(dirname);
+
+    if (access((dirname + ".image").c_str(), F_OK) == 0) {
+        unmount_image(dirname);
+    }
 
     flush_debug();
     pid_t pid = fork();
@@ -608,23 +1723,20 @@ size_t remove_environment(const string &basename, const string &env)
 
         while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
 
-        if (WIFEXITED(status)) {
-            return res;
-        }
-
-        // something went wrong. assume no disk space was free'd.
-        return 0;
+        return collect_shared_files(basename);
     }
 
     // else
 
     char **argv;
-    argv = new char*[5];
+    argv = new char*[7];
     argv[0] = strdup("/bin/rm");
     argv[1] = strdup("-rf");
     argv[2] = strdup("--");
     argv[3] = strdup(dirname.c_str());
-    argv[4] = NULL;
+    argv[4] = strdup((dirname + ".image").c_str());
+    argv[5] = strdup((dirname + ".tmp").c_str());
+    argv[6] = NULL;
 
     _exit(execv(argv[0], argv));
 }
@@ -648,7 +1760,7 @@ size_t remove_native_environment(const string &env)
 static void
 error_client(MsgChannel *client, string error)
 {
-    if (IS_PROTOCOL_23(client)) {
+    if (client && IS_PROTOCOL_23(client)) {
         client->send_msg(StatusTextMsg(error));
     }
 }
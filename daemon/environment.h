@@ -35,16 +35,37 @@ extern int start_create_env(const std::string &basedir,
                             const std::string &compiler, const std::list<std::string> &extrafiles);
 extern size_t finish_create_env(int pipe, const std::string &basedir, std::string &native_environment);
 Environments available_environmnents(const std::string &basename);
-extern void save_compiler_timestamps(time_t &gcc_bin_timestamp, time_t &gpp_bin_timestamp, time_t &clang_bin_timestamp);
-bool compilers_uptodate(time_t gcc_bin_timestamp, time_t gpp_bin_timestamp, time_t clang_bin_timestamp);
+extern std::string compiler_fingerprint(const std::string &compiler,
+                                        const std::list<std::string> &extrafiles);
+
+// a native environment as kept across restarts
+struct NativeEnvRecord {
+    std::string key;
+    std::string fingerprint;
+    std::string tarball;
+};
+
+extern std::list<NativeEnvRecord> load_native_index(const std::string &basedir);
+extern bool save_native_index(const std::string &basedir, const std::list<NativeEnvRecord> &records);
+extern int watch_compilers();
+extern bool compilers_changed(int fd);
 extern pid_t start_install_environment(const std::string &basename,
                                        const std::string &target,
                                        const std::string &name,
                                        MsgChannel *c, int& pipe_to_child,
                                        FileChunkMsg*& fmsg,
                                        uid_t user_uid, gid_t user_gid);
+extern std::string environment_hash(const std::string &dir);
+extern pid_t start_send_environment(const std::string &basename, const std::string &target,
+                                    const std::string &name, MsgChannel *c);
+// returns the size of the environment, OWN_SIZE of it isn't shared with others
+// and STORED_SIZE was added to the files they share, images are only mounted
+// with MOUNT_IMAGES
 extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
-        pid_t pid, uid_t user_uid, gid_t user_gid);
+        pid_t pid, uid_t user_uid, gid_t user_gid, bool mount_images,
+        size_t &own_size, size_t &stored_size);
+extern bool mount_scratch_space(const std::string &basedir, const std::string &env,
+                                unsigned int size_mb, uid_t user_uid, gid_t user_gid);
 extern size_t remove_environment(const std::string &basedir, const std::string &env);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
@@ -0,0 +1,607 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <set>
+
+#include <comm.h>
+#include <job.h>
+
+#include "headers.h"
+#include "logging.h"
+#include "resultkey.h"
+#include "workit.h"
+
+using namespace std;
+
+/* The files of jobs and the chunks of their sources are kept in the
+   environment by the MD5 of their contents, for all clients using it.  */
+#define HEADER_STORE "/tmp/.headers"
+
+// megabytes the store may take before the least recently used files go
+#define HEADER_STORE_SIZE 512
+
+// the store is trimmed after one in this many jobs that added to it
+#define TRIM_INTERVAL 16
+
+// seconds after which the time of a file used again is updated
+#define TOUCH_INTERVAL 3600
+
+static string store_path(const string &hash)
+{
+    return HEADER_STORE "/" + hash;
+}
+
+/* Whether PATH is absolute and doesn't leave the directory it's put in
+   with "..".  Nothing in that directory is a symlink, so ".." always
+   goes to the directory above.  */
+static bool path_inside(const string &path)
+{
+    if (path.empty() || path[0] != '/') {
+        return false;
+    }
+
+    int depth = 0;
+    string::size_type start = 1;
+
+    while (start < path.size()) {
+        string::size_type end = path.find('/', start);
+
+        if (end == string::npos) {
+            end = path.size();
+        }
+
+        string part = path.substr(start, end - start);
+
+        if (part == "..") {
+            if (--depth < 0) {
+                return false;
+            }
+        } else if (!part.empty() && part != ".") {
+            ++depth;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+/* Creates the directories the file PATH is in below ROOT, remembering
+   them in MADE.  */
+static bool make_dirs(const string &root, const string &path, set<string> &made)
+{
+    for (string::size_type slash = path.find('/', 1); slash != string::npos;
+            slash = path.find('/', slash + 1)) {
+        string dir = root + path.substr(0, slash);
+
+        if (made.insert(dir).second && mkdir(dir.c_str(), 0775) != 0 && errno != EEXIST) {
+            log_perror(("mkdir " + dir).c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool write_all(int fd, const unsigned char *buf, size_t len)
+{
+    while (len) {
+        ssize_t bytes = write(fd, buf, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        buf += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+/* Reads the file with HASH from CLIENT into the store.  What arrives has
+   to have that hash, other jobs take it for it.  */
+static bool receive_file(MsgChannel *client, const string &hash, unsigned int job_stat[])
+{
+    char *name = strdup((store_path(hash) + ".XXXXXX").c_str());
+    int fd = mkstemp(name);
+    string tmp_file = name;
+    free(name);
+
+    if (fd < 0) {
+        log_perror("mkstemp for header");
+        return false;
+    }
+
+    ResultKey contents;
+    bool ok = true;
+
+    for (;;) {
+        Msg *msg = client->get_msg(60);
+
+        if (!msg || (msg->type != M_FILE_CHUNK && msg->type != M_END)) {
+            log_error() << "protocol error while reading header " << hash << endl;
+            delete msg;
+            ok = false;
+            break;
+        }
+
+        if (msg->type == M_END) {
+            delete msg;
+            break;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
+        job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+        contents.add(fcmsg->buffer, fcmsg->len);
+        ok = write_all(fd, fcmsg->buffer, fcmsg->len);
+        delete msg;
+
+        if (!ok) {
+            log_perror("write of header");
+            break;
+        }
+    }
+
+    // jobs get it linked, none may change it for the others
+    if (ok && fchmod(fd, 0444) != 0) {
+        log_perror("fchmod of header");
+        ok = false;
+    }
+
+    if (close(fd) != 0 || !ok) {
+        unlink(tmp_file.c_str());
+        return false;
+    }
+
+    if (contents.hex() != hash) {
+        log_error() << "header " << hash << " doesn't match its hash" << endl;
+        unlink(tmp_file.c_str());
+        return false;
+    }
+
+    if (rename(tmp_file.c_str(), store_path(hash).c_str()) != 0) {
+        log_perror("rename of header");
+        unlink(tmp_file.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_file(const string &from, const string &to)
+{
+    int in = open(from.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool ok = out >= 0;
+    unsigned char buffer[65536];
+    ssize_t bytes;
+
+    while (ok && (bytes = read(in, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        ok = write_all(out, buffer, bytes);
+    }
+
+    close(in);
+    return out >= 0 && close(out) == 0 && ok;
+}
+
+/* Removes the least recently used files while the store takes more than
+   HEADER_STORE_SIZE.  Running jobs have theirs linked already.  */
+static void trim_store()
+{
+    DIR *d = opendir(HEADER_STORE);
+
+    if (!d) {
+        return;
+    }
+
+    multimap<time_t, pair<string, off_t> > by_use;
+    size_t total = 0;
+
+    while (struct dirent *ent = readdir(d)) {
+        string file = HEADER_STORE "/" + string(ent->d_name);
+        struct stat st;
+
+        if (ent->d_name[0] == '.' || stat(file.c_str(), &st) != 0) {
+            continue;
+        }
+
+        by_use.insert(make_pair(st.st_mtime, make_pair(file, st.st_size)));
+        total += st.st_size;
+    }
+
+    closedir(d);
+
+    for (multimap<time_t, pair<string, off_t> >::const_iterator it = by_use.begin();
+            it != by_use.end() && total > HEADER_STORE_SIZE * 1024 * 1024; ++it) {
+        unlink(it->second.first.c_str());
+        total -= it->second.second;
+    }
+}
+
+/* Asks CLIENT for the files of HASHES not in the store and stores them,
+   counting them in FETCHED.  The caller trims the store once it has what
+   it needs of it.  */
+static bool fetch_missing(const list<string> &hashes, MsgChannel *client,
+                          unsigned int job_stat[], size_t &fetched)
+{
+    if (mkdir(HEADER_STORE, 0755) != 0 && errno != EEXIST) {
+        log_perror("mkdir " HEADER_STORE);
+        return false;
+    }
+
+    HeaderRequestMsg request;
+    set<string> requested;
+    time_t now = time(0);
+
+    for (list<string>::const_iterator it = hashes.begin(); it != hashes.end(); ++it) {
+        struct stat st;
+
+        if (stat(store_path(*it).c_str(), &st) != 0) {
+            if (requested.insert(*it).second) {
+                request.hashes.push_back(*it);
+            }
+        } else if (now - st.st_mtime > TOUCH_INTERVAL) {
+            utime(store_path(*it).c_str(), 0);
+        }
+    }
+
+    trace() << "job has " << hashes.size() << " files, " << request.hashes.size()
+            << " missing" << endl;
+
+    if (!client->send_msg(request)) {
+        return false;
+    }
+
+    for (list<string>::const_iterator it = request.hashes.begin(); it != request.hashes.end(); ++it) {
+        if (!receive_file(client, *it, job_stat)) {
+            return false;
+        }
+    }
+
+    fetched = request.hashes.size();
+    return true;
+}
+
+static string below(const string &root, const string &path)
+{
+    return path[0] == '/' ? root + path : path;
+}
+
+static bool one_of(const string &flag, const char *const flags[])
+{
+    for (int i = 0; flags[i]; ++i) {
+        if (flag == flags[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Reads a HeaderManifestMsg of JOB from CLIENT, gets the files of it the
+   store doesn't have and links all of them below ROOT, or copies them with
+   COPY, remembering the directories made in MADE.  Returns the manifest,
+   or 0.  Only a command may have no files.  */
+static HeaderManifestMsg *receive_files(const CompileJob &job, MsgChannel *client,
+                                        const string &root, set<string> &made,
+                                        unsigned int job_stat[], bool copy = false)
+{
+    Msg *msg = client->get_msg(60);
+    HeaderManifestMsg *manifest = dynamic_cast<HeaderManifestMsg *>(msg);
+
+    if (!manifest || (manifest->files.empty() && job.language() != CompileJob::Lang_Custom)
+            || manifest->files.size() != manifest->hashes.size()) {
+        log_error() << "no header manifest for job " << job.jobID() << endl;
+        delete msg;
+        return 0;
+    }
+
+    list<string>::const_iterator file = manifest->files.begin();
+    list<string>::const_iterator hash = manifest->hashes.begin();
+
+    for (; file != manifest->files.end(); ++file, ++hash) {
+        if (!path_inside(*file) || !ResultKey::valid(*hash)) {
+            log_error() << "bad header " << *file << " for job " << job.jobID() << endl;
+            delete msg;
+            return 0;
+        }
+    }
+
+    size_t fetched = 0;
+
+    if (!fetch_missing(manifest->hashes, client, job_stat, fetched)) {
+        delete msg;
+        return 0;
+    }
+
+    /* The store is in the same file system, so the files are just linked
+       where they are on the client.  */
+    file = manifest->files.begin();
+    hash = manifest->hashes.begin();
+
+    for (; file != manifest->files.end(); ++file, ++hash) {
+        string target = root + *file;
+
+        if (!make_dirs(root, *file, made)
+                || ((copy || link(store_path(*hash).c_str(), target.c_str()) != 0)
+                    && !copy_file(store_path(*hash), target))) {
+            log_perror(("placing header " + target).c_str());
+            delete msg;
+            return 0;
+        }
+    }
+
+    if (fetched && rand() % TRIM_INTERVAL == 0) {
+        trim_store();
+    }
+
+    return manifest;
+}
+
+/* Like the client does, the files are in by their hashes, which
+   receive_files() checked.  */
+static void add_manifest(ResultKey *key, const HeaderManifestMsg &manifest)
+{
+    if (!key) {
+        return;
+    }
+
+    const list<string> *parts[] = { &manifest.cpp_flags, &manifest.system_dirs,
+                                    &manifest.files, &manifest.hashes };
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i) {
+        for (list<string>::const_iterator it = parts[i]->begin(); it != parts[i]->end(); ++it) {
+            key->add(it->c_str(), it->size() + 1);
+        }
+    }
+}
+
+bool receive_headers(const CompileJob &job, MsgChannel *client, RemoteCpp &cpp,
+                     unsigned int job_stat[], ResultKey *key)
+{
+    set<string> made;
+    HeaderManifestMsg *manifest = receive_files(job, client, cpp.root, made, job_stat);
+
+    if (!manifest) {
+        return false;
+    }
+
+    add_manifest(key, *manifest);
+
+    const string &source = job.inputFile().empty() ? manifest->files.front() : job.inputFile();
+    cpp.source = below(cpp.root, source);
+    cpp.flags.clear();
+
+    /* A ThinLTO backend job, whose index names the modules it imports from
+       relative to the working directory.  */
+    static const string thinlto_index = "-fthinlto-index=";
+
+    if (manifest->cpp_flags.size() == 1
+            && manifest->cpp_flags.front().compare(0, thinlto_index.size(), thinlto_index) == 0) {
+        cpp.flags.push_back(thinlto_index + below(cpp.root, manifest->cpp_flags.front()
+                                                  .substr(thinlto_index.size())));
+        delete manifest;
+        return true;
+    }
+
+    /* Directories searched have to be there for ".." in their path.  */
+    static const char *const dir_flags[] = { "-I", "-isystem", "-iquote", "-idirafter", 0 };
+    static const char *const file_flags[] = { "-include", "-imacros", 0 };
+    list<string>::const_iterator it = manifest->cpp_flags.begin();
+
+    while (it != manifest->cpp_flags.end()) {
+        string flag = *it++;
+        string arg;
+        bool dir = one_of(flag, dir_flags);
+
+        if (dir || one_of(flag, file_flags)) {
+            if (it == manifest->cpp_flags.end()) {
+                cpp.flags.push_back(flag);
+                break;
+            }
+
+            arg = *it++;
+        } else if (flag.compare(0, 2, "-I") == 0) {
+            arg = flag.substr(2);
+            flag = "-I";
+            dir = true;
+        } else {
+            cpp.flags.push_back(flag);
+            continue;
+        }
+
+        string abs_arg = arg[0] == '/' ? arg : job.workingDirectory() + "/" + arg;
+
+        if (dir && path_inside(abs_arg)) {
+            make_dirs(cpp.root, abs_arg + "/", made);
+        }
+
+        cpp.flags.push_back(flag);
+        cpp.flags.push_back(below(cpp.root, arg));
+    }
+
+    /* Only the client's system headers are used, in the order it has.  */
+    cpp.flags.push_back("-nostdinc");
+
+    if (job.language() == CompileJob::Lang_CXX) {
+        cpp.flags.push_back("-nostdinc++");
+    }
+
+    for (list<string>::const_iterator it = manifest->system_dirs.begin();
+            it != manifest->system_dirs.end(); ++it) {
+        if (path_inside(*it)) {
+            make_dirs(cpp.root, *it + "/", made);
+        }
+
+        cpp.flags.push_back("-isystem");
+        cpp.flags.push_back(below(cpp.root, *it));
+    }
+
+    cpp.flags.push_back("-fdebug-prefix-map=" + cpp.root + "/=/");
+    cpp.flags.push_back("-fmacro-prefix-map=" + cpp.root + "/=/");
+
+    delete manifest;
+    return true;
+}
+
+bool receive_pch(CompileJob &job, MsgChannel *client, const string &root,
+                 unsigned int job_stat[], ResultKey *key)
+{
+    set<string> made;
+    HeaderManifestMsg *manifest = receive_files(job, client, root, made, job_stat);
+
+    if (!manifest) {
+        return false;
+    }
+
+    add_manifest(key, *manifest);
+
+    /* gcc loads it for the #pragma GCC pch_preprocess in the source, which
+       names it relative to the working directory.  Clang is told.  */
+    if (job.compilerName().find("clang") != string::npos) {
+        job.appendFlag("-include-pch", Arg_Rest);
+        job.appendFlag(root + manifest->files.front(), Arg_Rest);
+        // the headers it was made from are not here
+        job.appendFlag("-Xclang", Arg_Rest);
+        job.appendFlag("-fno-validate-pch", Arg_Rest);
+    }
+
+    delete manifest;
+    return true;
+}
+
+bool receive_inputs(const CompileJob &job, MsgChannel *client, const string &root,
+                    unsigned int job_stat[])
+{
+    set<string> made;
+    // a command may well write to its inputs
+    HeaderManifestMsg *manifest = receive_files(job, client, root, made, job_stat, true);
+
+    if (!manifest) {
+        return false;
+    }
+
+    delete manifest;
+    return true;
+}
+
+static bool append_file(const string &file, string &data)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    char buffer[65536];
+    ssize_t bytes;
+    bool ok = true;
+
+    while (ok && (bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        data.append(buffer, bytes);
+    }
+
+    close(fd);
+    return ok;
+}
+
+bool receive_chunks(const CompileJob &job, MsgChannel *client, string &input,
+                    unsigned int job_stat[])
+{
+    Msg *msg = client->get_msg(60);
+    ChunkManifestMsg *manifest = dynamic_cast<ChunkManifestMsg *>(msg);
+
+    if (!manifest) {
+        log_error() << "no chunk manifest for job " << job.jobID() << endl;
+        delete msg;
+        return false;
+    }
+
+    for (list<string>::const_iterator it = manifest->hashes.begin();
+            it != manifest->hashes.end(); ++it) {
+        if (!ResultKey::valid(*it)) {
+            log_error() << "bad chunk " << *it << " for job " << job.jobID() << endl;
+            delete msg;
+            return false;
+        }
+    }
+
+    /* Only what came over the network counts as received, the source as
+       what the compiler got.  */
+    unsigned int fetch_stat[JobStatistics::count];
+    memset(fetch_stat, 0, sizeof(fetch_stat));
+    size_t fetched = 0;
+    bool ok = fetch_missing(manifest->hashes, client, fetch_stat, fetched);
+    job_stat[JobStatistics::in_compressed] += fetch_stat[JobStatistics::in_compressed];
+
+    for (list<string>::const_iterator it = manifest->hashes.begin();
+            ok && it != manifest->hashes.end(); ++it) {
+        if (!append_file(store_path(*it), input)) {
+            log_perror(("reading chunk " + *it).c_str());
+            ok = false;
+        }
+    }
+
+    trace() << "job has " << input.size() << " bytes in " << manifest->hashes.size()
+            << " chunks, " << fetched << " of them sent" << endl;
+    job_stat[JobStatistics::in_uncompressed] += input.size();
+    delete msg;
+
+    if (fetched && rand() % TRIM_INTERVAL == 0) {
+        trim_store();
+    }
+
+    return ok;
+}
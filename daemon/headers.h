@@ -0,0 +1,68 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_HEADERS_H
+#define ICECREAM_HEADERS_H
+
+#include <list>
+#include <string>
+
+class CompileJob;
+class MsgChannel;
+class ResultKey;
+
+/* How a job with CompileFileMsg::remote_cpp is compiled from its source
+   instead of the preprocessed one.  */
+struct RemoteCpp {
+    // the directory the files of the job are put in, at their path on the
+    // client below it
+    std::string root;
+    // the source as the compiler gets it
+    std::string source;
+    // the client's preprocessor flags, with paths below root
+    std::list<std::string> flags;
+};
+
+// reads HeaderManifestMsg of JOB from CLIENT, asks for the files the
+// environment doesn't have yet and puts all of them below CPP.root, adding
+// what the client sent to JOB_STAT and the manifest to KEY, if given; false
+// if that didn't work out
+bool receive_headers(const CompileJob &job, MsgChannel *client, RemoteCpp &cpp,
+                     unsigned int job_stat[], ResultKey *key = 0);
+
+// reads the precompiled header of JOB (CompileFileMsg::pch) from CLIENT the
+// same way, puts it below ROOT and adds what the compiler needs to load it
+// to the flags of JOB; false if that didn't work out
+bool receive_pch(CompileJob &job, MsgChannel *client, const std::string &root,
+                 unsigned int job_stat[], ResultKey *key = 0);
+
+// reads the inputs of the command of icerun JOB from CLIENT the same way and
+// puts them below ROOT; false if that didn't work out
+bool receive_inputs(const CompileJob &job, MsgChannel *client, const std::string &root,
+                    unsigned int job_stat[]);
+
+// reads ChunkManifestMsg of JOB (CompileFileMsg::chunked) from CLIENT, asks
+// for the chunks the environment doesn't have yet and puts the source they
+// make up in INPUT; false if that didn't work out
+bool receive_chunks(const CompileJob &job, MsgChannel *client, std::string &input,
+                    unsigned int job_stat[]);
+
+#endif
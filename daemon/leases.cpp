@@ -0,0 +1,147 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include <comm.h>
+
+#include "leases.h"
+#include "logging.h"
+
+using namespace std;
+
+// seconds a lease is kept without a client taking it
+#define MAX_LEASE_IDLE 10
+
+LeasePool::~LeasePool()
+{
+    for (list<Lease>::iterator it = leases.begin(); it != leases.end(); ++it) {
+        delete it->usecs;
+    }
+}
+
+/* Requests for the same environments and target, which need the same
+   kind of server, can take each other's leases.  */
+string LeasePool::kind(const GetCSMsg &msg)
+{
+    string result = msg.target + "/" + toString(msg.minimal_host_version) + "/"
+                    + toString(msg.job_class);
+
+    for (Environments::const_iterator it = msg.versions.begin(); it != msg.versions.end(); ++it) {
+        result += "/" + it->first + ":" + it->second;
+    }
+
+    return result;
+}
+
+unsigned int LeasePool::wanted(const GetCSMsg &msg) const
+{
+    /* Repeated jobs and ones for a preferred host are not like others.  */
+    if (!per_kind || msg.count != 1 || !msg.preferred_host.empty() || msg.lease) {
+        return 0;
+    }
+
+    string k = kind(msg);
+    unsigned int have = 0;
+
+    for (list<Lease>::const_iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (it->kind == k) {
+            ++have;
+        }
+    }
+
+    return have < per_kind ? per_kind - have : 0;
+}
+
+void LeasePool::requested(const GetCSMsg &request, time_t now)
+{
+    Lease lease;
+    lease.kind = kind(request);
+    lease.id = request.client_id;
+    lease.usecs = 0;
+    lease.since = now;
+    leases.push_back(lease);
+}
+
+bool LeasePool::granted(const UseCSMsg &msg, time_t now)
+{
+    for (list<Lease>::iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (!it->usecs && it->id == msg.client_id) {
+            trace() << "lease " << msg.client_id << " granted: job " << msg.job_id << " on "
+                    << msg.hostname << endl;
+            it->usecs = new UseCSMsg(msg);
+            it->since = now;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+UseCSMsg *LeasePool::take(const GetCSMsg &msg)
+{
+    if (!per_kind || msg.count != 1 || !msg.preferred_host.empty()) {
+        return 0;
+    }
+
+    string k = kind(msg);
+
+    for (list<Lease>::iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (it->usecs && it->kind == k) {
+            UseCSMsg *usecs = it->usecs;
+            leases.erase(it);
+            return usecs;
+        }
+    }
+
+    return 0;
+}
+
+void LeasePool::expire(time_t now, list<unsigned int> &jobs, list<unsigned int> &requests)
+{
+    for (list<Lease>::iterator it = leases.begin(); it != leases.end();) {
+        if (now - it->since < MAX_LEASE_IDLE) {
+            ++it;
+            continue;
+        }
+
+        if (it->usecs) {
+            jobs.push_back(it->usecs->job_id);
+            delete it->usecs;
+        } else {
+            requests.push_back(it->id);
+        }
+
+        leases.erase(it++);
+    }
+}
+
+void LeasePool::clear(list<unsigned int> &jobs)
+{
+    for (list<Lease>::iterator it = leases.begin(); it != leases.end(); ++it) {
+        if (it->usecs) {
+            jobs.push_back(it->usecs->job_id);
+            delete it->usecs;
+        }
+    }
+
+    leases.clear();
+}
@@ -0,0 +1,88 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_LEASES_H
+#define ICECREAM_LEASES_H
+
+#include <time.h>
+
+#include <list>
+#include <string>
+
+class GetCSMsg;
+class UseCSMsg;
+
+/* Compile servers the scheduler granted ahead of time (protocol 47).
+   While clients ask for compile servers, the local daemon keeps asking for
+   a few more like them with GetCSMsg::lease, so that the next client is
+   answered at once instead of waiting for the round trip to the scheduler.
+   The scheduler is told with UseLeaseMsg which client took one, and the
+   leases not taken for a while are given back.  */
+class LeasePool
+{
+public:
+    LeasePool()
+        : per_kind(0) {}
+    ~LeasePool();
+
+    // leases to keep for each kind of request, 0 disables them
+    void setSize(unsigned int size)
+    {
+        per_kind = size;
+    }
+
+    bool enabled() const
+    {
+        return per_kind > 0;
+    }
+
+    // how many more to ask for with requests like MSG
+    unsigned int wanted(const GetCSMsg &msg) const;
+    // REQUEST, with lease and client_id set, was sent to the scheduler
+    void requested(const GetCSMsg &request, time_t now);
+    // keeps MSG if it answers a request for a lease
+    bool granted(const UseCSMsg &msg, time_t now);
+    // a compile server for a request like MSG if one was granted, or 0,
+    // the caller owns it
+    UseCSMsg *take(const GetCSMsg &msg);
+
+    // gives up the leases not taken for too long: the granted ones go
+    // back by job id, the requests are cancelled by their client id
+    void expire(time_t now, std::list<unsigned int> &jobs, std::list<unsigned int> &requests);
+    // forgets them all, when the scheduler goes away, the granted ones
+    // are returned by job id
+    void clear(std::list<unsigned int> &jobs);
+
+private:
+    struct Lease {
+        std::string kind;
+        unsigned int id;  // the client id of the request
+        UseCSMsg *usecs;  // 0 until it's granted
+        time_t since;
+    };
+
+    static std::string kind(const GetCSMsg &msg);
+
+    std::list<Lease> leases;
+    unsigned int per_kind;
+};
+
+#endif
@@ -28,6 +28,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
 #ifdef HAVE_SYS_PARAM_H
 #include <sys/param.h>
 #endif
@@ -59,6 +62,9 @@ using namespace std;
 // what the kernel puts as ticks in /proc/stat
 typedef unsigned long long load_t;
 
+// stalled for that percentage of the time, a machine takes no more jobs
+#define PRESSURE_FULL_LOAD 50
+
 
 struct CPULoadInfo {
     /* A CPU can be loaded with user processes, reniced processes and
@@ -76,6 +82,13 @@ struct CPULoadInfo {
     load_t sysTicks;
     load_t idleTicks;
     load_t waitTicks;
+    // what the hypervisor gave to other machines, not idle for us
+    load_t stealTicks;
+
+    /* The same in a cgroup with a CPU limit, as usage_usec of cpu.stat
+       and the time it was read.  */
+    unsigned long long cgroupUsage;
+    double cgroupTime;
 
     CPULoadInfo() {
         userTicks = 0;
@@ -83,13 +96,147 @@ struct CPULoadInfo {
         sysTicks = 0;
         idleTicks = 0;
         waitTicks = 0;
+        stealTicks = 0;
+        cgroupUsage = 0;
+        cgroupTime = 0;
     }
 };
 
+#ifdef __linux__
+/* Reads the start of FILE into BUF as a string.  */
+static bool read_file(const string &file, char *buf, size_t size)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    ssize_t n;
+
+    while ((n = read(fd, buf, size - 1)) < 0 && errno == EINTR) {}
+
+    close(fd);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = 0;
+    return true;
+}
+
+/* The cgroup v2 directory of the daemon, empty if there is none, which is
+   where a container gets its CPU and memory limits from.  */
+static const string &cgroup_dir()
+{
+    static bool looked = false;
+    static string dir;
+
+    if (looked) {
+        return dir;
+    }
+
+    looked = true;
+    char buf[4096];
+
+    if (!read_file("/proc/self/cgroup", buf, sizeof(buf))) {
+        return dir;
+    }
+
+    // the v2 hierarchy is the line "0::/path"
+    const char *line = strstr(buf, "0::/");
+
+    if (!line || (line != buf && line[-1] != '\n')) {
+        return dir;
+    }
+
+    string path(line + 3, strcspn(line + 3, "\n"));
+    const char *const mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+
+    for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); ++i) {
+        string candidate = string(mounts[i]) + (path == "/" ? string() : path);
+
+        if (access((candidate + "/cgroup.controllers").c_str(), R_OK) == 0) {
+            dir = candidate;
+            break;
+        }
+    }
+
+    return dir;
+}
+
+/* The CPUs cpu.max of the cgroup allows, 0 if it has no limit.  */
+static double cgroup_cpus()
+{
+    char buf[64];
+    unsigned long long quota = 0, period = 0;
+
+    if (cgroup_dir().empty() || !read_file(cgroup_dir() + "/cpu.max", buf, sizeof(buf))
+            || sscanf(buf, "%llu %llu", &quota, &period) != 2 || !period) {
+        return 0;    // also "max 100000"
+    }
+
+    return double(quota) / period;
+}
+
+/* Makes the idle load of LOAD no more than what the cgroup leaves of its
+   CPU limit, as the machine can be idle while the container is not.  */
+static void updateCgroupLoad(CPULoadInfo *load)
+{
+    double cpus = cgroup_cpus();
+    char buf[256];
+    unsigned long long usage = 0;
+
+    if (cpus <= 0 || !read_file(cgroup_dir() + "/cpu.stat", buf, sizeof(buf))
+            || sscanf(buf, "usage_usec %llu", &usage) != 1) {
+        return;
+    }
+
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    double now = tv.tv_sec + tv.tv_usec / 1000000.0;
+    double elapsed = now - load->cgroupTime;
+
+    if (load->cgroupTime && elapsed > 0.01 && usage >= load->cgroupUsage) {
+        double used = (usage - load->cgroupUsage) / (elapsed * 1000000.0 * cpus);
+        int idle = used >= 1 ? 0 : int(1000 * (1 - used));
+
+        if (idle < load->idleLoad) {
+            load->idleLoad = idle;
+        }
+    }
+
+    load->cgroupUsage = usage;
+    load->cgroupTime = now;
+}
+
+/* The avg10 of the LINE ("some" or "full") of a pressure file, in percent
+   of the time tasks were stalled, -1 if there is none.  */
+static double pressure_avg10(const string &file, const char *line)
+{
+    char buf[256];
+
+    if (!read_file(file, buf, sizeof(buf))) {
+        return -1;
+    }
+
+    const char *b = strstr(buf, line);
+    double avg10;
+
+    if (!b || sscanf(b + strlen(line), " avg10=%lf", &avg10) != 1) {
+        return -1;
+    }
+
+    return avg10;
+}
+#endif
+
 static void updateCPULoad(CPULoadInfo *load)
 {
     load_t totalTicks;
     load_t currUserTicks, currSysTicks, currNiceTicks, currIdleTicks, currWaitTicks;
+    load_t currStealTicks = 0;
 
 #if defined(USE_SYSCTL) && defined(__DragonFly__)
     static struct kinfo_cputime cp_time;
@@ -181,22 +328,27 @@ static void updateCPULoad(CPULoadInfo *load)
 
     /* wait ticks only exist with Linux >= 2.6.0. treat as 0 otherwise */
     currWaitTicks = 0;
+    load_t irqTicks = 0, softIrqTicks = 0;
     //   sscanf( buf, "%*s %lu %lu %lu %lu %lu", &currUserTicks, &currNiceTicks,
-    sscanf(buf, "%*s %llu %llu %llu %llu %llu", &currUserTicks, &currNiceTicks,  // RL modif
-           &currSysTicks, &currIdleTicks, &currWaitTicks);
+    sscanf(buf, "%*s %llu %llu %llu %llu %llu %llu %llu %llu", &currUserTicks, &currNiceTicks,  // RL modif
+           &currSysTicks, &currIdleTicks, &currWaitTicks, &irqTicks, &softIrqTicks,
+           &currStealTicks);
+    currSysTicks += irqTicks + softIrqTicks;
 #endif
 
     totalTicks = (currUserTicks - load->userTicks)
                  + (currSysTicks - load->sysTicks)
                  + (currNiceTicks - load->niceTicks)
                  + (currIdleTicks - load->idleTicks)
-                 + (currWaitTicks - load->waitTicks);
+                 + (currWaitTicks - load->waitTicks)
+                 + (currStealTicks - load->stealTicks);
 
     if (totalTicks > 10) {
         load->userLoad = (1000 * (currUserTicks - load->userTicks)) / totalTicks;
         load->sysLoad = (1000 * (currSysTicks - load->sysTicks)) / totalTicks;
         load->niceLoad = (1000 * (currNiceTicks - load->niceTicks)) / totalTicks;
-        load->idleLoad = (1000 - (load->userLoad + load->sysLoad + load->niceLoad));
+        int stealLoad = (1000 * (currStealTicks - load->stealTicks)) / totalTicks;
+        load->idleLoad = (1000 - (load->userLoad + load->sysLoad + load->niceLoad + stealLoad));
 
         if (load->idleLoad < 0) {
             load->idleLoad = 0;
@@ -211,6 +363,10 @@ static void updateCPULoad(CPULoadInfo *load)
     load->niceTicks = currNiceTicks;
     load->idleTicks = currIdleTicks;
     load->waitTicks = currWaitTicks;
+    load->stealTicks = currStealTicks;
+#ifdef __linux__
+    updateCgroupLoad(load);
+#endif
 }
 
 #ifndef USE_SYSCTL
@@ -321,6 +477,30 @@ static unsigned int calculateMemLoad(unsigned long int &NetMemFree)
 
     NetMemFree = MemFree + Cached + Buffers;
 
+#ifdef __linux__
+    /* A container can't have more than its memory.max, of which the page
+       cache in memory.current is reclaimable like Cached above.  */
+    unsigned long long limit = 0, current = 0;
+
+    if (!cgroup_dir().empty() && read_file(cgroup_dir() + "/memory.max", buf, sizeof(buf))
+            && sscanf(buf, "%llu", &limit) == 1
+            && read_file(cgroup_dir() + "/memory.current", buf, sizeof(buf))
+            && sscanf(buf, "%llu", &current) == 1) {
+        unsigned long long file = 0;
+
+        if (read_file(cgroup_dir() + "/memory.stat", buf, sizeof(buf))) {
+            sscanf(buf, "anon %*u file %llu", &file);
+        }
+
+        current -= min(current, file / 2);
+        unsigned long long cgroupFree = (limit - min(limit, current)) / 1024;
+
+        if (cgroupFree < NetMemFree) {
+            NetMemFree = cgroupFree;
+        }
+    }
+#endif
+
     if (NetMemFree > 128 * 1024) {
         return 0;
     }
@@ -408,3 +588,33 @@ bool fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned i
 
     return true;
 }
+
+unsigned int pressure_load()
+{
+#ifdef __linux__
+    /* The cgroup of a container has the stalls of its own tasks.  */
+    string dir = cgroup_dir();
+    string cpu = dir.empty() ? "/proc/pressure/cpu" : dir + "/cpu.pressure";
+    string memory = dir.empty() ? "/proc/pressure/memory" : dir + "/memory.pressure";
+    string io = dir.empty() ? "/proc/pressure/io" : dir + "/io.pressure";
+    double stalled = pressure_avg10(cpu, "some");
+
+    if (stalled < 0) {
+        return 0;
+    }
+
+    // tasks waiting for the memory or the disk are as bad as for the CPU
+    stalled = max(stalled, pressure_avg10(memory, "some"));
+    stalled = max(stalled, pressure_avg10(io, "full"));
+    return (unsigned int) min(1000.0, stalled * 1000 / PRESSURE_FULL_LOAD);
+#else
+    return 0;
+#endif
+}
+
+unsigned int free_memory()
+{
+    unsigned long int MemFree = 0;
+    calculateMemLoad(MemFree);
+    return (unsigned int)(MemFree / 1024.0 + 0.5);
+}
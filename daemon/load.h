@@ -28,4 +28,11 @@
 // 'hint' is used to approximate the load, whenever getloadavg() is unavailable.
 bool fill_stats(unsigned long &myidleload, unsigned long &myniceload, unsigned int &memory_fillgrade, StatsMsg *msg, unsigned int hint);
 
+/* Load from the time tasks stall for CPU, memory or I/O, see
+   /proc/pressure, or 0 where the kernel doesn't tell.  */
+unsigned int pressure_load();
+
+// The memory in MB that's free for new processes, as StatsMsg::freeMem.
+unsigned int free_memory();
+
 #endif
@@ -85,11 +85,13 @@
 #endif
 
 #include <deque>
+#include <list>
 #include <map>
 #include <algorithm>
 #include <set>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "ncpus.h"
 #include "exitcode.h"
@@ -98,6 +100,17 @@
 #include "logging.h"
 #include <comm.h>
 #include "load.h"
+#include "connpool.h"
+#include "leases.h"
+#include "workers.h"
+#include "phases.h"
+#include "benchmark.h"
+#include "placement.h"
+#include "warmer.h"
+#include "envcache.h"
+#include "results.h"
+#include "dicts.h"
+#include "poller.h"
 #include "environment.h"
 #include "platform.h"
 #include "util.h"
@@ -105,6 +118,28 @@
 static std::string pidFilePath;
 static volatile sig_atomic_t exit_main_loop = 0;
 
+// how long clients wait for a new scheduler when the connection is lost
+#define SCHEDULER_FAILOVER_TIMEOUT 15
+
+// the longest random wait before looking for a scheduler again, in seconds
+#define MAX_RECONNECT_BACKOFF 64
+
+// environments fetched for the scheduler ahead of time may only fill the
+// cache up to this percentage, so that they never push out others
+#define SEED_CACHE_PERCENT 75
+
+// inputs smaller than this don't tell much about the throughput of a link
+#define MIN_LINK_SAMPLE_BYTES (64 * 1024)
+
+// bytes of the input of a job waiting for a slot read ahead at most, for
+// as many jobs as there are slots
+#define PREFETCH_SIZE (8 * 1024 * 1024)
+
+// a slot taken or freed is reported with what else happens that soon, in ms
+#define STATS_COALESCE_MSEC 250
+// the reported load changes by that much before it is reported again
+#define STATS_LOAD_STEP 100
+
 #ifndef __attribute_warn_unused_result__
 #define __attribute_warn_unused_result__
 #endif
@@ -138,10 +173,23 @@ public:
         channel = 0;
         job = 0;
         usecsmsg = 0;
+        getcs = 0;
         client_id = 0;
         status = UNKNOWN;
         pipe_to_child = -1;
         child_pid = -1;
+        raw_output = false;
+        stream_output = false;
+        remote_cpp = false;
+        pch = false;
+        interleaved_output = false;
+        chunked = false;
+        prefetch = false;
+        prefetched = false;
+        seeding = false;
+        local_job = false;
+        upload = 0;
+        job_slot = -1;
     }
 
     static string status_str(Status status) {
@@ -182,8 +230,12 @@ public:
         channel = 0;
         delete usecsmsg;
         usecsmsg = 0;
+        delete getcs;
+        getcs = 0;
         delete job;
         job = 0;
+        delete upload;
+        upload = 0;
 
         if (pipe_to_child >= 0) {
             close(pipe_to_child);
@@ -194,11 +246,45 @@ public:
     string outfile; // only useful for LINKJOB or TOINSTALL
     MsgChannel *channel;
     UseCSMsg *usecsmsg;
+    GetCSMsg *getcs; // asked again if the scheduler changes while WAITFORCS
+    struct timeval asked_cs; // when it sent getcs, for the trace
     CompileJob *job;
     int client_id;
     int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD or TOINSTALL
     pid_t child_pid;
     string pending_create_env; // only for WAITCREATEENV
+    bool raw_output; // send the object files back with FileRawMsg
+    bool stream_output; // send the object file while it's compiled, if possible
+    bool remote_cpp; // the job is preprocessed here, see HeaderManifestMsg
+    bool pch; // the client sends a precompiled header first
+    bool interleaved_output; // send the object and .dwo files at once
+    bool chunked; // the source comes as chunks, see ChunkManifestMsg
+    bool prefetch; // TOCOMPILE, its input is read ahead until the job starts
+    bool prefetched; // some of its input was read before the job started
+    string fetch_env; // a daemon we fetch this environment from for the scheduler
+    bool seeding; // fetching it ahead of time, it may not push out others
+    string env_hash; // what the environment being installed has to hash to
+    string waiting_env; // the client waits for the fetched environment to verify it
+    bool local_job; // CLIENTWORK in one of the slots for local jobs
+    string pinned_env; // the environment its job keeps in the cache
+    ResultUpload *upload; // another daemon stores a result here
+    int job_slot; // its job process is placed there, see JobPlacement
+    list<Client *>::iterator status_pos; // position in Clients::queues[status]
+
+    // its job uses the environment, which can't be removed meanwhile
+    bool uses_env() const {
+        return job && (status == TOCOMPILE || status == TOINSTALL || status == WAITFORCHILD);
+    }
+
+    // the channel is handed to a job process, or will be
+    bool channel_busy() const {
+        return status == TOCOMPILE || status == WAITFORCHILD;
+    }
+
+    // the input is read ahead while it waits for a slot
+    bool prefetching() const {
+        return status == TOCOMPILE && prefetch;
+    }
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
@@ -236,8 +322,26 @@ class Clients : public map<MsgChannel*, Client*>
 public:
     Clients() {
         active_processes = 0;
+        local_processes = 0;
+        envs = 0;
     }
     unsigned int active_processes;
+    unsigned int local_processes; // the ones of them in local job slots
+    EnvironmentCache *envs; // pinned for the clients with Client::uses_env()
+
+    // CLIENT leaves CLIENTWORK, which frees its slot
+    void end_work(Client *client) {
+        if (client->status != Client::CLIENTWORK) {
+            return;
+        }
+
+        active_processes--;
+
+        if (client->local_job) {
+            local_processes--;
+            client->local_job = false;
+        }
+    }
 
     Client *find_by_client_id(int id) const {
         for (const_iterator it = begin(); it != end(); ++it)
@@ -278,14 +382,64 @@ public:
         return cl;
     }
 
-    string dump_status(Client::Status s) const {
-        int count = 0;
+    void add(Client *client) {
+        (*this)[client->channel] = client;
+        client->status_pos = queues[client->status].insert(queues[client->status].end(), client);
+        changed.insert(client->channel->fd);
+        update_pin(client);
+    }
 
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s) {
-                count++;
-            }
+    bool remove(Client *client) {
+        if (!erase(client->channel)) {
+            return false;
+        }
+
+        queues[client->status].erase(client->status_pos);
+        changed.erase(client->channel->fd);
+
+        if (!client->pinned_env.empty()) {
+            envs->unpin(client->pinned_env);
+            client->pinned_env.clear();
+        }
+
+        return true;
+    }
+
+    // pins or unpins the environment of CLIENT after its status changed
+    void update_pin(Client *client) {
+        if (client->pinned_env.empty() == !client->uses_env() || !envs) {
+            return;
+        }
+
+        if (client->pinned_env.empty()) {
+            client->pinned_env = client->job->targetPlatform() + "/" + client->job->environmentVersion();
+            envs->pin(client->pinned_env, time(0));
+        } else {
+            envs->unpin(client->pinned_env);
+            client->pinned_env.clear();
         }
+    }
+
+    /* Clients are queued per status in the order they got it, so that
+       the one waiting the longest is found without looking at the others.  */
+    void set_status(Client *client, Client::Status s) {
+        if (client->status == s) {
+            return;
+        }
+
+        queues[client->status].erase(client->status_pos);
+        client->status = s;
+        client->status_pos = queues[s].insert(queues[s].end(), client);
+        changed.insert(client->channel->fd);
+        update_pin(client);
+    }
+
+    size_t count(Client::Status s) const {
+        return queues[s].size();
+    }
+
+    string dump_status(Client::Status s) const {
+        size_t count = queues[s].size();
 
         if (count) {
             return toString(count) + " " + Client::status_str(s) + ", ";
@@ -304,20 +458,24 @@ public:
 
         return s;
     }
-    Client *get_earliest_client(Client::Status s) const {
-        // TODO: possibly speed this up in adding some sorted lists
-        Client *client = 0;
-        int min_client_id = 0;
 
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s && (!min_client_id || min_client_id > it->second->client_id)) {
-                client = it->second;
-                min_client_id = client->client_id;
-            }
+    const list<Client *> &queue(Client::Status s) const {
+        return queues[s];
+    }
+
+    Client *get_earliest_client(Client::Status s) const {
+        if (queues[s].empty()) {
+            return 0;
         }
 
-        return client;
+        return queues[s].front();
     }
+
+    // channels of clients that got a new status since the main loop looked at them
+    set<int> changed;
+
+private:
+    list<Client *> queues[Client::LASTSTATE + 1];
 };
 
 static int set_new_pgrp(void)
@@ -403,35 +561,80 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-w] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]"
+        " [--connection-pool <connections>] [--leases <servers>] [--max-local-jobs <count>]"
+        " [--local-job-memory <MB>] [--worker-pool <workers>] [--scratch-tmpfs <MB>]"
+        " [--stream-output] [--mount-environments] [--result-cache <MB>]"
+        " [--pin-jobs cores|numa] [--job-cgroup <cgroup v2 dir>]"
+        " [--prefetch-environments] [--lock-environments <MB>] [--async-log <KB/s>]"
+        " [--bulk-rate <KB/s>]" << endl;
     exit(1);
 }
 
 struct timeval last_stat;
 int mem_limit = 100;
 unsigned int max_kids = 0;
+// Local jobs that don't compile (linking, icerun) get slots of their own,
+// 0 makes them share the compile slots.  Each one is thought to need
+// local_job_memory MB, it waits for that much to be free unless it's alone.
+int max_local_kids = -1;
+unsigned int local_job_memory = 512;
+// Size of the tmpfs mounted on each environment's tmp, where remote jobs
+// write their outputs, 0 keeps them on disk.  Whatever of it is not filled
+// yet is held back from the free memory jobs are given.
+unsigned int scratch_tmpfs = 0;
+// Bytes per second environments are sent to other daemons with at most,
+// 0 leaves it to the network.
+unsigned long bulk_rate = 0;
+// Whether clang jobs write their object file to a pipe it is sent from.
+bool stream_outputs = false;
+// Whether to keep the capability to mount environments sent as images.
+bool mount_environments = false;
+// How job processes are pinned to CPUs ("cores", "numa") and the cgroup
+// they are put in, see JobPlacement.
+string pin_jobs;
+string job_cgroup;
 
 size_t cache_size_limit = 100 * 1024 * 1024;
+// Space for the results of jobs kept for the farm, 0 keeps none.
+size_t result_cache_limit = 0;
+
+// A native environment is built ahead of a client asking for it, at
+// startup and when the compilers change, so that it doesn't wait.
+#define COMPILERS_SETTLE_TIME 10
 
 struct NativeEnvironment {
     string name; // the hash
-    map<string, time_t> extrafilestimes;
-    // Timestamps for compiler binaries, if they have changed since the time
-    // the native env was built, it needs to be rebuilt.
-    time_t gcc_bin_timestamp;
-    time_t gpp_bin_timestamp;
-    time_t clang_bin_timestamp;
+    string compiler;
+    list<string> extrafiles;
+    // of the compiler binaries and extra files, if it has changed since the
+    // native env was built, it needs to be rebuilt
+    string fingerprint;
     int create_env_pipe; // if in progress of creating the environment
 };
 
 struct Daemon {
     Clients clients;
-    map<string, time_t> envs_last_use;
+    EnvironmentCache env_cache;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
     // (or just the compiler name for the basic ones).
     map<string, NativeEnvironment> native_environments;
+    // changes of the compiler binaries, and when the last one came
+    int compiler_watch_fd;
+    time_t compilers_changed_at;
+    // set up connections to compile servers, passed to clients with UseCSMsg
+    ConnectionPool connection_pool;
+    WorkerPool workers;
+    Benchmark benchmark;
+    JobPlacement placement;
+    EnvironmentWarmer warmer;
+    LeasePool leases;
+    // the daemons keeping results, from the scheduler, and the ones kept here
+    ResultRing result_owners;
+    ResultCache results;
+    CompressionDicts dicts;
     string envbasedir;
     uid_t user_uid;
     gid_t user_gid;
@@ -442,14 +645,39 @@ struct Daemon {
     string nodename;
     bool noremote;
     bool custom_nodename;
-    size_t cache_size;
-    map<int, MsgChannel *> fd2chan;
+    Poller poller;
+    // channels of the clients and the pipes from their job processes
+    map<int, Client *> fd2client;
     int new_client_id;
     string remote_name;
     time_t next_scheduler_connect;
+    // the longest wait before the next scheduler discovery, doubled while
+    // there is none
+    int reconnect_backoff;
+    // the address of the scheduler last connected to, asked first again
+    // when it went away
+    string last_scheduler;
+    bool try_last_scheduler;
+    bool discover_last_scheduler;
+    // the environments the last login sent
+    string last_env_digest;
+    time_t scheduler_connected;
+    // while a lost scheduler is being replaced, what the new one needs to know
+    time_t scheduler_lost;
+    list<Msg *> scheduler_backlog;
+    // measured on the connections of the peers that sent jobs, by IP; the
+    // changed ones are reported with the next StatsMsg
+    map<string, PeerLink> peer_links;
+    set<string> changed_links;
     unsigned long icecream_load;
     struct timeval icecream_usage;
     int current_load;
+    // what the scheduler was told last, and when
+    int reported_load;
+    unsigned int reported_busy;
+    struct timeval last_report;
+    // the free memory last reported, in MB; the scheduler admits jobs by it
+    int current_free_mem;
     int num_cpus;
     MsgChannel *scheduler;
     DiscoverSched *discover;
@@ -462,7 +690,17 @@ struct Daemon {
     int max_scheduler_ping;
     unsigned int current_kids;
 
+    // free memory as last read, less what local jobs started since then need
+    unsigned int local_memory;
+    time_t local_memory_time;
+    // environments with a scratch tmpfs, and the MB those may still fill
+    set<string> scratch_mounts;
+    unsigned int scratch_reserved;
+
     Daemon() {
+        local_memory = 0;
+        local_memory_time = 0;
+        scratch_reserved = 0;
         warn_icecc_user_errno = 0;
         if (getuid() == 0) {
             struct passwd *pw = getpwnam("icecc");
@@ -485,12 +723,23 @@ struct Daemon {
         unix_listen_fd = -1;
         new_client_id = 0;
         next_scheduler_connect = 0;
-        cache_size = 0;
+        reconnect_backoff = 2;
+        try_last_scheduler = false;
+        discover_last_scheduler = false;
+        scheduler_connected = 0;
+        scheduler_lost = 0;
+        clients.envs = &env_cache;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
         icecream_usage.tv_sec = icecream_usage.tv_usec = 0;
         current_load = - 1000;
+        reported_load = -1000;
+        reported_busy = 0;
+        last_report.tv_sec = last_report.tv_usec = 0;
+        current_free_mem = 0;
+        compiler_watch_fd = -1;
+        compilers_changed_at = 0;
         num_cpus = 0;
         scheduler = 0;
         discover = 0;
@@ -503,19 +752,35 @@ struct Daemon {
 
     bool reannounce_environments() __attribute_warn_unused_result__;
     int answer_client_requests();
+    void watch_client(Client *client);
+    void handle_client_input(Client *client, bool read);
+    void prefetch_input(Client *client);
+    int handle_scheduler_messages() __attribute_warn_unused_result__;
     bool handle_transfer_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_transfer_env_done(Client *client);
+    int handle_fetch_env(FetchEnvMsg *msg);
+    int handle_benchmark(BenchmarkMsg *msg);
+    void answer_env_waiters(const string &env);
+    bool handle_get_env(Client *client, GetEnvMsg *msg) __attribute_warn_unused_result__;
+    bool handle_get_result(Client *client, GetResultMsg *msg) __attribute_warn_unused_result__;
+    bool handle_put_result(Client *client, PutResultMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
+    bool local_job_fits();
+    unsigned int scratch_reserve();
     bool handle_compile_file(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_activity(Client *client) __attribute_warn_unused_result__;
     bool handle_file_chunk_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    bool handle_raw_env(Client *client) __attribute_warn_unused_result__;
     void handle_end(Client *client, int exitcode);
     int scheduler_get_internals() __attribute_warn_unused_result__;
     void clear_children();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_job_wait(JobWaitMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    void request_leases(const GetCSMsg &msg);
+    void expire_leases();
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
@@ -526,13 +791,23 @@ struct Daemon {
     string determine_nodename();
     void determine_system();
     bool maybe_stats(bool force = false);
-    bool send_scheduler(const Msg &msg) __attribute_warn_unused_result__;
+    void measure_link(Client *client, const unsigned int job_stat[]);
+    bool send_scheduler(const Msg &msg, int flags = MsgChannel::SendBlocking) __attribute_warn_unused_result__;
+    bool send_scheduler_job_msg(Msg *msg);
+    void compile_locally(Client *client, const GetCSMsg &msg);
     void close_scheduler();
+    void scheduler_replaced();
+    void scheduler_not_replaced();
     bool reconnect();
     int working_loop();
     bool setup_listen_fds();
     void check_cache_size(const string &new_env);
+    bool start_native_env(const string &env_key, const string &compiler,
+                          const list<string> &extrafiles);
     bool create_env_finished(string env_key);
+    void save_native_envs();
+    void load_native_envs();
+    void prepare_native_envs();
 };
 
 bool Daemon::setup_listen_fds()
@@ -681,14 +956,16 @@ string Daemon::determine_nodename()
     return nodename;
 }
 
-bool Daemon::send_scheduler(const Msg& msg)
+/* Messages that are not urgent may be queued with SendQueued, they go out
+   together with the next urgent one or at the end of the loop iteration.  */
+bool Daemon::send_scheduler(const Msg& msg, int flags)
 {
     if (!scheduler) {
         log_error() << "scheduler dead ?!" << endl;
         return false;
     }
 
-    if (!scheduler->send_msg(msg)) {
+    if (!scheduler->send_msg(msg, flags)) {
         log_error() << "sending to scheduler failed.." << endl;
         close_scheduler();
         return false;
@@ -702,6 +979,7 @@ bool Daemon::reannounce_environments()
     log_error() << "reannounce_environments " << endl;
     LoginMsg lmsg(0, nodename, "");
     lmsg.envs = available_environmnents(envbasedir);
+    last_env_digest = environments_digest(lmsg.envs);
     return send_scheduler(lmsg);
 }
 
@@ -711,6 +989,12 @@ void Daemon::close_scheduler()
         return;
     }
 
+    /* The leases of the scheduler are gone with it, unless it was a
+       standby one taking over, see handle_scheduler_messages().  */
+    list<unsigned int> leased;
+    leases.clear(leased);
+
+    poller.unwatch(scheduler->fd);
     delete scheduler;
     scheduler = 0;
     delete discover;
@@ -718,14 +1002,84 @@ void Daemon::close_scheduler()
     next_scheduler_connect = time(0) + 20 + (rand() & 31);
 }
 
+/* Job messages are kept while the clients wait for a new scheduler, a
+   standby scheduler that took over knows the jobs.  */
+bool Daemon::send_scheduler_job_msg(Msg *msg)
+{
+    if (!scheduler && scheduler_lost) {
+        scheduler_backlog.push_back(msg);
+        return true;
+    }
+
+    bool ret = send_scheduler(*msg, MsgChannel::SendQueued);
+    delete msg;
+    return ret;
+}
+
+/* A new scheduler got our login, it gets what the lost one missed.  */
+void Daemon::scheduler_replaced()
+{
+    if (!scheduler_lost) {
+        return;
+    }
+
+    log_info() << "scheduler replaced, asking it again for " << clients.queue(Client::WAITFORCS).size()
+               << " jobs" << endl;
+    scheduler_lost = 0;
+
+    while (!scheduler_backlog.empty()) {
+        Msg *msg = scheduler_backlog.front();
+        scheduler_backlog.pop_front();
+
+        if (scheduler) {
+            send_scheduler_job_msg(msg);
+        } else {
+            delete msg;
+        }
+    }
+
+    const list<Client *> &waiting = clients.queue(Client::WAITFORCS);
+
+    for (list<Client *>::const_iterator it = waiting.begin(); scheduler && it != waiting.end(); ++it) {
+        if ((*it)->getcs && !send_scheduler(*(*it)->getcs)) {
+            break;
+        }
+    }
+}
+
+/* No new scheduler showed up, the waiting clients compile locally.  */
+void Daemon::scheduler_not_replaced()
+{
+    log_warning() << "no new scheduler found, compiling locally" << endl;
+    scheduler_lost = 0;
+
+    while (!scheduler_backlog.empty()) {
+        delete scheduler_backlog.front();
+        scheduler_backlog.pop_front();
+    }
+
+    while (Client *client = clients.get_earliest_client(Client::WAITFORCS)) {
+        compile_locally(client, *client->getcs);
+    }
+}
+
+/* The load is looked at every max_scheduler_pong seconds and reported when
+   it changed much.  A slot taken or freed is reported at once, together
+   with what else happens within STATS_COALESCE_MSEC, and if nothing changes
+   the scheduler still hears from us every max_scheduler_ping / 2 seconds.  */
 bool Daemon::maybe_stats(bool send_ping)
 {
     struct timeval now;
     gettimeofday(&now, 0);
 
     time_t diff_sent = (now.tv_sec - last_stat.tv_sec) * 1000 + (now.tv_usec - last_stat.tv_usec) / 1000;
+    time_t diff_report = (now.tv_sec - last_report.tv_sec) * 1000
+                         + (now.tv_usec - last_report.tv_usec) / 1000;
+    unsigned int busy = current_kids + clients.active_processes;
+    bool slots_changed = busy != reported_busy && diff_report >= STATS_COALESCE_MSEC
+                         && diff_sent >= STATS_COALESCE_MSEC;
 
-    if (diff_sent >= max_scheduler_pong * 1000) {
+    if (diff_sent >= max_scheduler_pong * 1000 || slots_changed) {
         StatsMsg msg;
         unsigned int memory_fillgrade;
         unsigned long idleLoad = 0;
@@ -771,6 +1125,9 @@ bool Daemon::maybe_stats(bool send_ping)
         }
 
         msg.load = ((700 * (1000 - idle_average)) + (300 * memory_fillgrade)) / 1000;
+        /* Stalled tasks show contention the idle time doesn't, e.g. with
+           steal time or other containers on the host.  */
+        msg.load = std::max(msg.load, (uint32_t) pressure_load());
 
         if (memory_fillgrade > 600) {
             msg.load = 1000;
@@ -790,13 +1147,39 @@ bool Daemon::maybe_stats(bool send_ping)
 
 #endif
 
+        scratch_reserved = scratch_reserve();
+        msg.freeMem -= std::min(msg.freeMem, (uint32_t) scratch_reserved);
+
         // Matz got in the urine that not all CPUs are always feed
         mem_limit = std::max(int(msg.freeMem / std::min(std::max(max_kids, 1U), 4U)), int(100U));
 
-        if (abs(int(msg.load) - current_load) >= 100 || send_ping) {
-            if (!send_scheduler(msg)) {
+        for (set<string>::const_iterator it = changed_links.begin(); it != changed_links.end(); ++it) {
+            msg.links.push_back(peer_links[*it]);
+        }
+
+        bool mem_changed = abs(int(msg.freeMem) - current_free_mem)
+                           >= std::max(256, current_free_mem / 8);
+
+        bool load_changed = abs(int(msg.load) - reported_load) >= STATS_LOAD_STEP
+                            || (msg.load >= 1000) != (reported_load >= 1000);
+        bool heartbeat = diff_report >= max_scheduler_ping * 1000 / 2;
+
+        if (load_changed || slots_changed || heartbeat || send_ping || !changed_links.empty()
+                || mem_changed) {
+            changed_links.clear();
+
+            if (scheduler && IS_PROTOCOL_53(scheduler)) {
+                take_phase_counts(msg.phases);
+            }
+
+            if (!send_scheduler(msg, MsgChannel::SendQueued)) {
                 return false;
             }
+
+            current_free_mem = msg.freeMem;
+            reported_load = msg.load;
+            reported_busy = busy;
+            last_report = now;
         }
 
         icecream_load = 0;
@@ -813,16 +1196,16 @@ string Daemon::dump_internals() const
     result += "Node Name: " + nodename + "\n";
     result += "  Remote name: " + remote_name + "\n";
 
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin(); it != fd2chan.end(); ++it)  {
-        result += "  fd2chan[" + toString(it->first) + "] = " + it->second->dump() + "\n";
+    for (map<int, Client *>::const_iterator it = fd2client.begin(); it != fd2client.end(); ++it)  {
+        result += "  fd2client[" + toString(it->first) + "] = " + toString(it->second->client_id) + "\n";
     }
 
     for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
         result += "  client " + toString(it->second->client_id) + ": " + it->second->dump() + "\n";
     }
 
-    if (cache_size) {
-        result += "  Cache Size: " + toString(cache_size) + "\n";
+    if (env_cache.totalSize()) {
+        result += "  Cache Size: " + toString(env_cache.totalSize()) + "\n";
     }
 
     result += "  Architecture: " + machine_name + "\n";
@@ -833,16 +1216,22 @@ string Daemon::dump_internals() const
             + (it->second.create_env_pipe ? " (creating)" : "" ) + "\n";
     }
 
-    if (!envs_last_use.empty()) {
+    if (env_cache.begin() != env_cache.end()) {
         result += "  Now: " + toString(time(0)) + "\n";
     }
 
-    for (map<string, time_t>::const_iterator it = envs_last_use.begin();
-            it != envs_last_use.end(); ++it)  {
-        result += "  envs_last_use[" + it->first  + "] = " + toString(it->second) + "\n";
+    for (EnvironmentCache::const_iterator it = env_cache.begin(); it != env_cache.end(); ++it)  {
+        result += "  env_cache[" + it->name  + "] = " + toString(it->last_use) + ", "
+            + toString(it->size) + " bytes, " + toString(it->pins) + " jobs\n";
+    }
+
+    for (map<string, PeerLink>::const_iterator it = peer_links.begin(); it != peer_links.end(); ++it) {
+        result += "  peer_links[" + it->first + "] = rtt " + toString(it->second.rtt_usec) + "us, "
+                  + toString(it->second.bytes_per_sec) + " bytes/s\n";
     }
 
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
+    result += "  Local jobs: " + toString(clients.local_processes) + " (max: " + toString(max_local_kids) + ")\n";
 
     if (scheduler) {
         result += "  Scheduler protocol: " + toString(scheduler->protocol) + "\n";
@@ -873,6 +1262,15 @@ int Daemon::scheduler_get_internals()
 
 int Daemon::scheduler_use_cs(UseCSMsg *msg)
 {
+    if (leases.granted(*msg, time(0))) {
+        /* Have a connection ready for the client that takes it.  */
+        if (connection_pool.enabled() && msg->hostname != remote_name) {
+            connection_pool.refill(msg->hostname, msg->port);
+        }
+
+        return 0;
+    }
+
     Client *c = clients.find_by_client_id(msg->client_id);
     trace() << "handle_use_cs " << msg->job_id << " " << msg->client_id
             << " " << c << " " << msg->hostname << " " << remote_name <<  endl;
@@ -885,24 +1283,103 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         return 1;
     }
 
+    // it answered before it got the cancel of scheduler_job_wait()
+    if (c->status == Client::PENDING_USE_CS && !c->job_id
+            && !send_scheduler(JobLocalDoneMsg(c->client_id), MsgChannel::SendQueued)) {
+        return 1;
+    }
+
+    /* Clients get more than one for repeated jobs and duplicates of
+       straggling ones.  */
+    delete c->usecsmsg;
+
     if (msg->hostname == remote_name && int(msg->port) == daemon_port) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
-        c->status = Client::PENDING_USE_CS;
+        clients.set_status(c, Client::PENDING_USE_CS);
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
 
-        if (!c->channel->send_msg(*msg)) {
+        // the client compresses with it, see offer_dict() of the scheduler
+        const string *dict = msg->dict_id && IS_PROTOCOL_62(c->channel) ? dicts.find(msg->dict_id) : 0;
+
+        if (dict) {
+            msg->dict = *dict;
+        } else {
+            msg->dict_id = 0;
+        }
+
+        bool pool = connection_pool.enabled() && IS_PROTOCOL_39(c->channel)
+                    && c->channel->is_unix_socket();
+        // the client has to speak the protocol the connection was set up with
+        MsgChannel *pooled = pool ? connection_pool.take(msg->hostname, msg->port, c->channel->protocol)
+                             : 0;
+        bool sent;
+
+        if (pooled) {
+            trace() << "giving the client a pooled connection to " << msg->hostname << ":"
+                    << msg->port << endl;
+            msg->channel_protocol = pooled->protocol;
+            msg->channel_codecs = pooled->remoteCodecs();
+            sent = c->channel->send_msg_fd(*msg, pooled->fd);
+            delete pooled;
+        } else {
+            sent = c->channel->send_msg(*msg);
+        }
+
+        if (!sent) {
             handle_end(c, 143);
             return 0;
         }
 
-        c->status = Client::WAITCOMPILE;
+        /* Now that the client is on its way, prepare for the next job.  */
+        if (pool) {
+            connection_pool.refill(msg->hostname, msg->port);
+        }
+
+        clients.set_status(c, Client::WAITCOMPILE);
     }
 
     c->job_id = msg->job_id;
 
+    if (trace_fd >= 0) {
+        struct timeval now;
+        gettimeofday(&now, 0);
+        trace_span("scheduler", c->asked_cs, now, msg->job_id);
+    }
+
+    return 0;
+}
+
+/* A job waiting for a server is compiled here if that's faster and a slot
+   is free.  The scheduler forgets the request like one of a client that
+   went away, and gets told about a local job instead.  */
+int Daemon::scheduler_job_wait(JobWaitMsg *msg)
+{
+    Client *c = clients.find_by_client_id(msg->client_id);
+
+    if (!c || c->status != Client::WAITFORCS || !c->getcs || c->getcs->count != 1
+            || msg->local_msec >= msg->remote_msec
+            || current_kids + clients.active_processes - clients.local_processes >= max_kids) {
+        return 0;
+    }
+
+    trace() << "compiling the job of client " << c->client_id << " here, " << msg->local_msec
+            << "ms instead of " << msg->remote_msec << "ms" << endl;
+
+    if (!send_scheduler(JobDoneMsg(c->client_id, CLIENT_WAS_WAITING_FOR_CS,
+                                   JobDoneMsg::FROM_SUBMITTER))
+            || !send_scheduler(JobLocalBeginMsg(c->client_id, c->getcs->filename),
+                               MsgChannel::SendQueued)) {
+        return 1;
+    }
+
+    // job id 0, the client compiles it like a job the scheduler gave back
+    delete c->usecsmsg;
+    c->usecsmsg = new UseCSMsg(machine_name, "127.0.0.1", daemon_port, 0, true, 1, 0);
+    c->job_id = 0;
+    clients.set_status(c, Client::PENDING_USE_CS);
     return 0;
 }
 
@@ -928,8 +1405,9 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     pid_t pid = start_install_environment(envbasedir, target, emsg->name, client->channel,
                                           sock_to_stdin, fmsg, user_uid, user_gid);
 
-    client->status = Client::TOINSTALL;
+    clients.set_status(client, Client::TOINSTALL);
     client->outfile = emsg->target + "/" + emsg->name;
+    client->env_hash = emsg->hash;
     current_kids++;
 
     if (pid > 0) {
@@ -957,8 +1435,11 @@ bool Daemon::handle_transfer_env_done(Client *client)
     assert(client->outfile.size());
     assert(client->status == Client::TOINSTALL);
 
+    size_t own_size, stored_size;
     size_t installed_size = finalize_install_environment(envbasedir, client->outfile,
-                            client->child_pid, user_uid, user_gid);
+                            client->child_pid, user_uid, user_gid, mount_environments,
+                            own_size, stored_size);
+    env_cache.addShared(stored_size);
 
     if (client->pipe_to_child >= 0) {
         installed_size = 0;
@@ -966,7 +1447,7 @@ bool Daemon::handle_transfer_env_done(Client *client)
         client->pipe_to_child = -1;
     }
 
-    client->status = Client::UNKNOWN;
+    clients.set_status(client, Client::UNKNOWN);
     string current = client->outfile;
     client->outfile.clear();
     client->child_pid = -1;
@@ -976,10 +1457,45 @@ bool Daemon::handle_transfer_env_done(Client *client)
     log_error() << "installed_size: " << installed_size << endl;
 
     if (installed_size) {
-        cache_size += installed_size;
-        envs_last_use[current] = time(NULL);
+        env_cache.installed(current, own_size, time(NULL));
         log_error() << "installed " << current << " size: " << installed_size
-                    << " all: " << cache_size << endl;
+                    << " unshared: " << own_size << " all: " << env_cache.totalSize() << endl;
+    }
+
+    if (installed_size && !client->env_hash.empty()
+            && environment_hash(envbasedir + "/target=" + current) != client->env_hash) {
+        log_error() << "environment " << current << " from " << client->channel->name
+                    << " doesn't match its hash, removing it" << endl;
+        installed_size = 0;
+    }
+
+    /* Nobody asked for it yet, so it doesn't get to push out others.  */
+    if (client->seeding && installed_size && env_cache.totalSize() > cache_size_limit) {
+        trace() << "seeded " << current << " doesn't fit, removing it" << endl;
+        installed_size = 0;
+    }
+
+    if (!installed_size && env_cache.contains(current)) {
+        warmer.remove(current);
+        env_cache.removeShared(remove_environment(envbasedir, current));
+        env_cache.remove(current);
+        scratch_mounts.erase(current);
+        workers.remove(current);
+    } else if (installed_size && scratch_tmpfs
+               && mount_scratch_space(envbasedir, current, scratch_tmpfs, user_uid, user_gid)) {
+        scratch_mounts.insert(current);
+    }
+
+    if (installed_size) {
+        warmer.installed(envbasedir, current);
+    }
+
+    client->env_hash.clear();
+    client->seeding = false;
+
+    if (!client->fetch_env.empty()) {
+        client->fetch_env.clear();
+        answer_env_waiters(current);
     }
 
     check_cache_size(current);
@@ -994,145 +1510,290 @@ bool Daemon::handle_transfer_env_done(Client *client)
     return r;
 }
 
-void Daemon::check_cache_size(const string &new_env)
+/* The scheduler wants an environment here from a daemon that has it,
+   for a job whose client then doesn't upload it, or ahead of time.  That
+   daemon is asked like a client would be and sends it like a client
+   upload.  */
+int Daemon::handle_fetch_env(FetchEnvMsg *msg)
 {
-    time_t now = time(NULL);
+    string env = msg->target + "/" + msg->name;
+    bool seeding = msg->job_id == 0;
+    bool wanted = !env_cache.contains(env);
 
-    while (cache_size > cache_size_limit) {
-        string oldest;
-        // I don't dare to use (time_t)-1
-        time_t oldest_time = time(NULL) + 90000;
-        string oldest_native_env_key;
+    if (seeding && env_cache.totalSize() >= cache_size_limit / 100 * SEED_CACHE_PERCENT) {
+        wanted = false;
+    }
 
-        for (map<string, time_t>::const_iterator it = envs_last_use.begin();
-                it != envs_last_use.end(); ++it) {
-            trace() << "considering cached environment: " << it->first << " " << it->second << " " << oldest_time << endl;
-            // ignore recently used envs (they might be in use _right_ now)
-            int keep_timeout = 200;
-            string native_env_key;
+    for (Clients::const_iterator it = clients.begin(); wanted && it != clients.end(); ++it) {
+        if (it->second->fetch_env == env || it->second->outfile == env) {
+            wanted = false;    // on its way already
+        } else if (seeding && (it->second->status == Client::TOINSTALL
+                               || !it->second->fetch_env.empty())) {
+            wanted = false;    // one install at a time ahead of time
+        }
+    }
 
-            // If it is a native environment, allow removing it only after a longer period,
-            // unless there are many native environments.
-            for (map<string, NativeEnvironment>::const_iterator it2 = native_environments.begin();
-                    it2 != native_environments.end(); ++it2) {
-                if (it2->second.name == it->first) {
-                    native_env_key = it2->first;
+    MsgChannel *c = 0;
 
-                    if (native_environments.size() < 5) {
-                        keep_timeout = 24 * 60 * 60;    // 1 day
-                    }
+    if (wanted) {
+        trace() << "fetching " << env << " from " << msg->hostname << ":" << msg->port << endl;
+        c = Service::createChannel(msg->hostname, msg->port, 5);
 
-                    if (it2->second.create_env_pipe) {
-                        keep_timeout = 365 * 24 * 60 * 60; // do not remove if it's still being created
-                    }
-                    break;
-                }
-            }
+        if (c) {
+            c->setTrafficClass(TC_BULK);
+        }
+
+        if (c && !c->send_msg(GetEnvMsg(msg->target, msg->name))) {
+            delete c;
+            c = 0;
+        }
+    }
 
-            if (it->second < oldest_time && now - it->second > keep_timeout) {
-                bool env_currently_in_use = false;
+    if (!c) {
+        // the scheduler thinks we're busy installing until we log in again
+        return !reannounce_environments();
+    }
 
-                for (Clients::const_iterator it2 = clients.begin(); it2 != clients.end(); ++it2)  {
-                    if (it2->second->status == Client::TOCOMPILE
-                            || it2->second->status == Client::TOINSTALL
-                            || it2->second->status == Client::WAITFORCHILD) {
+    Client *client = new Client;
+    client->client_id = ++new_client_id;
+    client->channel = c;
+    client->fetch_env = env;
+    client->seeding = seeding;
+    clients.add(client);
+    fd2client[c->fd] = client;
+    return 0;
+}
 
-                        assert(it2->second->job);
-                        string envforjob = it2->second->job->targetPlatform() + "/"
-                                           + it2->second->job->environmentVersion();
+/* Answers the clients that wait for ENV to be fetched, see
+   handle_verify_env().  */
+void Daemon::answer_env_waiters(const string &env)
+{
+    list<Client *> waiting;
 
-                        if (envforjob == it->first) {
-                            env_currently_in_use = true;
-                        }
-                    }
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->waiting_env == env) {
+            waiting.push_back(it->second);
+        }
+    }
+
+    string::size_type slash = env.find('/');
+
+    for (list<Client *>::const_iterator it = waiting.begin(); it != waiting.end(); ++it) {
+        Client *client = *it;
+        client->waiting_env.clear();
+        VerifyEnvMsg msg(env.substr(0, slash), env.substr(slash + 1));
+
+        if (!handle_verify_env(client, &msg)) {
+            handle_end(client, 142);
+        }
+    }
+}
+
+/* Only when idle, the scheduler asks again later otherwise.  */
+int Daemon::handle_benchmark(BenchmarkMsg *msg)
+{
+    string env = msg->target + "/" + msg->environment;
+
+    if (benchmark.running() || current_kids || clients.active_processes
+            || !env_cache.contains(env)) {
+        trace() << "not running the benchmark of " << env << endl;
+        return 0;
+    }
+
+    benchmark.start(*msg, envbasedir + "/target=" + env, user_uid, user_gid);
+    return 0;
+}
+
+/* Another daemon wants an installed environment, see handle_fetch_env().  */
+bool Daemon::handle_get_env(Client *client, GetEnvMsg *msg)
+{
+    client->channel->setTrafficClass(TC_BULK, bulk_rate);
+    pid_t pid = start_send_environment(envbasedir, msg->target, msg->name, client->channel);
+
+    if (pid <= 0) {
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 140);
+        return false;
+    }
+
+    trace() << "sending " << msg->target << "/" << msg->name << " to " << client->channel->name
+            << " in " << pid << endl;
+    env_cache.use(msg->target + "/" + msg->name, time(NULL));
+
+    // the child has the connection now, so the client is gone either way
+    handle_end(client, 141);
+    return false;
+}
+
+/* A job process of another daemon wants a result this one keeps.  */
+bool Daemon::handle_get_result(Client *client, GetResultMsg *msg)
+{
+    string file = results.lookup(msg->key);
+    pid_t pid = file.empty() ? 0 : start_send_result(file, client->channel);
+
+    if (pid <= 0) {
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 143);
+        return false;
+    }
+
+    trace() << "sending result " << msg->key << " to " << client->channel->name
+            << " in " << pid << endl;
+
+    // the child has the connection now, so the client is gone either way
+    handle_end(client, 144);
+    return false;
+}
+
+/* A job process of another daemon gives a result to keep, the rest of it
+   follows and goes to the upload, see handle_activity().  */
+bool Daemon::handle_put_result(Client *client, PutResultMsg *msg)
+{
+    if (!results.enabled() || client->upload) {
+        handle_end(client, 145);
+        return false;
+    }
+
+    client->upload = new ResultUpload(results, msg->key);
+    return true;
+}
+
+void Daemon::check_cache_size(const string &new_env)
+{
+    time_t now = time(NULL);
+
+    while (env_cache.totalSize() > cache_size_limit) {
+        EnvironmentCache::lru_iterator oldest = env_cache.lru_end();
+
+        for (EnvironmentCache::lru_iterator it = env_cache.lru_begin(); it != env_cache.lru_end(); ++it) {
+            trace() << "considering cached environment: " << it->name << " " << it->last_use << endl;
+
+            // ignore recently used envs (they might be in use _right_ now),
+            // all after this one were used later still
+            if (now - it->last_use <= 200) {
+                break;
+            }
+
+            if (it->pins) {
+                continue;
+            }
+
+            // If it is a native environment, allow removing it only after a longer period,
+            // unless there are many native environments.
+            if (!it->native_key.empty()) {
+                map<string, NativeEnvironment>::const_iterator native = native_environments.find(it->native_key);
+
+                if (native != native_environments.end() && native->second.create_env_pipe) {
+                    continue; // do not remove if it's still being created
                 }
 
-                if (!env_currently_in_use) {
-                    oldest_time = it->second;
-                    oldest = it->first;
-                    oldest_native_env_key = native_env_key;
+                if (native_environments.size() < 5 && now - it->last_use <= 24 * 60 * 60) {
+                    continue;
                 }
             }
+
+            oldest = it;
+            break;
         }
 
-        if (oldest.empty() || oldest == new_env) {
+        if (oldest == env_cache.lru_end() || oldest->name == new_env) {
             break;
         }
 
-        size_t removed;
+        string name = oldest->name;
 
-        if (!oldest_native_env_key.empty()) {
-            removed = remove_native_environment(oldest);
-            native_environments.erase(oldest_native_env_key);
-            trace() << "removing " << oldest << " " << oldest_time << " " << removed << endl;
+        if (!oldest->native_key.empty()) {
+            remove_native_environment(name);
+            native_environments.erase(oldest->native_key);
+            save_native_envs();
+            trace() << "removing " << name << " " << oldest->last_use << " " << oldest->size << endl;
         } else {
-            removed = remove_environment(envbasedir, oldest);
-            trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time
-                    << " " << removed << endl;
+            warmer.remove(name);
+            env_cache.removeShared(remove_environment(envbasedir, name));
+            scratch_mounts.erase(name);
+            trace() << "removing " << envbasedir << "/" << name << " " << oldest->last_use
+                    << " " << oldest->size << endl;
+        }
+
+        env_cache.remove(name);
+        workers.remove(name);
+    }
+}
+
+/* Makes sure the native environment ENV_KEY is there or being built,
+   false if it can't be.  */
+bool Daemon::start_native_env(const string &env_key, const string &compiler,
+                              const list<string> &extrafiles)
+{
+    NativeEnvironment &env = native_environments[env_key]; // also inserts it
+
+    if (env.create_env_pipe) {
+        trace() << "waiting for already running create_env " << env_key << endl;
+        return true;
+    }
+
+    string fingerprint = compiler_fingerprint(compiler, extrafiles);
+
+    if (env.name.length()) {
+        if (env.fingerprint == fingerprint && access(env.name.c_str(), R_OK) == 0) {
+            return true;
         }
 
-        cache_size -= min(removed, cache_size);
-        envs_last_use.erase(oldest);
+        trace() << "native_env needs rebuild" << endl;
+        remove_native_environment(env.name);
+        env_cache.remove(env.name);
+        env.name.clear();
+        save_native_envs();
+    }
+
+    env.compiler = compiler;
+    env.extrafiles = extrafiles;
+    env.fingerprint = fingerprint;
+    trace() << "start_create_env " << env_key << endl;
+    env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, compiler, extrafiles);
+
+    if (!env.create_env_pipe) {
+        native_environments.erase(env_key);
+        return false;
     }
+
+    return true;
 }
 
 bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
 {
     string env_key;
-    map<string, time_t> extrafilestimes;
     env_key = msg->compiler;
 
     for (list<string>::const_iterator it = msg->extrafiles.begin();
             it != msg->extrafiles.end(); ++it) {
         env_key += ':';
         env_key += *it;
-        struct stat st;
 
-        if (stat(it->c_str(), &st) != 0) {
+        if (access(it->c_str(), R_OK) != 0) {
             log_error() << "Extra file " << *it << " for environment not found." << endl;
             client->channel->send_msg(EndMsg());
             handle_end(client, 122);
             return false;
         }
-
-        extrafilestimes[*it] = st.st_mtime;
     }
 
-    if (native_environments[env_key].name.length()) {
-        const NativeEnvironment &env = native_environments[env_key];
-
-        if (!compilers_uptodate(env.gcc_bin_timestamp, env.gpp_bin_timestamp, env.clang_bin_timestamp)
-                || env.extrafilestimes != extrafilestimes
-                || access(env.name.c_str(), R_OK) != 0) {
-            trace() << "native_env needs rebuild" << endl;
-            cache_size -= remove_native_environment(env.name);
-            envs_last_use.erase(env.name);
-            if (env.create_env_pipe) {
-                close(env.create_env_pipe);
-                // TODO kill the still running icecc-create-env process?
-            }
-            native_environments.erase(env_key);   // invalidates 'env'
-        }
+    if (!start_native_env(env_key, msg->compiler, msg->extrafiles)) {
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 121);
+        return false;
     }
 
     trace() << "get_native_env " << native_environments[env_key].name
             << " (" << env_key << ")" << endl;
 
-    client->status = Client::WAITCREATEENV;
+    clients.set_status(client, Client::WAITCREATEENV);
     client->pending_create_env = env_key;
 
     if (native_environments[env_key].name.length()) { // already available
         return finish_get_native_env(client, env_key);
-    } else {
-        NativeEnvironment &env = native_environments[env_key]; // also inserts it
-        if (!env.create_env_pipe) { // start creating it only if not already in progress
-            env.extrafilestimes = extrafilestimes;
-            trace() << "start_create_env " << env_key << endl;
-            env.create_env_pipe = start_create_env(envbasedir, user_uid, user_gid, msg->compiler, msg->extrafiles);
-        } else {
-            trace() << "waiting for already running create_env " << env_key << endl;
-        }
     }
+
     return true;
 }
 
@@ -1147,8 +1808,8 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
         return false;
     }
 
-    envs_last_use[native_environments[env_key].name] = time(NULL);
-    client->status = Client::GOTNATIVE;
+    env_cache.use(native_environments[env_key].name, time(NULL));
+    clients.set_status(client, Client::GOTNATIVE);
     client->pending_create_env.clear();
     return true;
 }
@@ -1163,10 +1824,6 @@ bool Daemon::create_env_finished(string env_key)
     size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
     env.create_env_pipe = 0;
 
-    // we only clean out cache on next target install
-    cache_size += installed_size;
-    trace() << "cache_size = " << cache_size << endl;
-
     if (!installed_size) {
         for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it)  {
             if (it->second->pending_create_env == env_key) {
@@ -1177,8 +1834,9 @@ bool Daemon::create_env_finished(string env_key)
         return false;
     }
 
-    save_compiler_timestamps(env.gcc_bin_timestamp, env.gpp_bin_timestamp, env.clang_bin_timestamp);
-    envs_last_use[env.name] = time(NULL);
+    env_cache.installed(env.name, installed_size, time(NULL), env_key);
+    save_native_envs();
+    trace() << "cache_size = " << env_cache.totalSize() << endl;
     check_cache_size(env.name);
 
     for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
@@ -1188,15 +1846,94 @@ bool Daemon::create_env_finished(string env_key)
     return true;
 }
 
-bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
+void Daemon::save_native_envs()
 {
-    if (cl->status == Client::CLIENTWORK) {
-        clients.active_processes--;
-    }
+    list<NativeEnvRecord> records;
 
-    cl->status = Client::JOBDONE;
-    JobDoneMsg *msg = static_cast<JobDoneMsg *>(m);
-    trace() << "handle_job_done " << msg->job_id << " " << msg->exitcode << endl;
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        if (it->second.name.length() && it->second.fingerprint.length()) {
+            NativeEnvRecord record;
+            record.key = it->first;
+            record.fingerprint = it->second.fingerprint;
+            record.tarball = it->second.name;
+            records.push_back(record);
+        }
+    }
+
+    save_native_index(envbasedir, records);
+}
+
+/* Takes the native environments a previous daemon left.  */
+void Daemon::load_native_envs()
+{
+    list<NativeEnvRecord> records = load_native_index(envbasedir);
+
+    for (list<NativeEnvRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        NativeEnvironment &env = native_environments[it->key];
+        // the key is the compiler and the extra files, see handle_get_native_env()
+        string::size_type pos = it->key.find(':');
+        env.compiler = it->key.substr(0, pos);
+
+        while (pos != string::npos) {
+            string::size_type next = it->key.find(':', pos + 1);
+            env.extrafiles.push_back(it->key.substr(pos + 1, next == string::npos ? next : next - pos - 1));
+            pos = next;
+        }
+
+        env.name = it->tarball;
+        env.fingerprint = it->fingerprint;
+        env.create_env_pipe = 0;
+
+        struct stat st;
+
+        if (stat(env.name.c_str(), &st) == 0) {
+            env_cache.installed(env.name, st.st_size, time(NULL), it->key);
+        }
+
+        trace() << "reusing native environment " << env.name << " (" << it->key << ")" << endl;
+    }
+}
+
+/* Builds the native environments of the compilers there are, and
+   rebuilds the ones there were if the compilers changed.  */
+void Daemon::prepare_native_envs()
+{
+    list<string> keys;
+
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        keys.push_back(it->first);
+    }
+
+    for (list<string>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+        map<string, NativeEnvironment>::const_iterator env = native_environments.find(*it);
+
+        if (env != native_environments.end() && env->second.name.length()) {
+            // copies, the entry may go away
+            string compiler = env->second.compiler;
+            list<string> extrafiles = env->second.extrafiles;
+            start_native_env(*it, compiler, extrafiles);
+        }
+    }
+
+    if (!native_environments.count("gcc") && access("/usr/bin/gcc", X_OK) == 0
+            && access("/usr/bin/g++", X_OK) == 0) {
+        start_native_env("gcc", "gcc", list<string>());
+    }
+
+    if (!native_environments.count("clang") && access("/usr/bin/clang", X_OK) == 0) {
+        start_native_env("clang", "clang", list<string>());
+    }
+}
+
+bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
+{
+    clients.end_work(cl);
+
+    clients.set_status(cl, Client::JOBDONE);
+    JobDoneMsg *msg = static_cast<JobDoneMsg *>(m);
+    trace() << "handle_job_done " << msg->job_id << " " << msg->exitcode << endl;
 
     if (!m->is_from_server()
             && (m->user_msec + m->sys_msec) <= m->real_msec) {
@@ -1205,14 +1942,70 @@ bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 
     assert(msg->job_id == cl->job_id);
     cl->job_id = 0; // the scheduler doesn't have it anymore
-    return send_scheduler(*msg);
+
+    if (!msg->job_id) {
+        // see scheduler_job_wait()
+        return send_scheduler_job_msg(new JobLocalDoneMsg(cl->client_id));
+    }
+
+    return send_scheduler_job_msg(new JobDoneMsg(*msg));
+}
+
+/* The MB of the scratch tmpfs, counted once for all environments, that
+   are not filled yet.  What is filled is no longer in the free memory.  */
+unsigned int Daemon::scratch_reserve()
+{
+    if (scratch_mounts.empty()) {
+        return 0;
+    }
+
+    unsigned long used = 0;
+#ifdef HAVE_SYS_VFS_H
+
+    for (set<string>::const_iterator it = scratch_mounts.begin(); it != scratch_mounts.end(); ++it) {
+        struct statfs buf;
+
+        if (!statfs((envbasedir + "/target=" + *it + "/tmp").c_str(), &buf)) {
+            used += (unsigned long long)(buf.f_blocks - buf.f_bfree) * buf.f_bsize / (1024 * 1024);
+        }
+    }
+
+#endif
+    return used < scratch_tmpfs ? scratch_tmpfs - used : 0;
+}
+
+/* Whether another local job may start in its own slots.  */
+bool Daemon::local_job_fits()
+{
+    if (clients.local_processes >= (unsigned int) max_local_kids) {
+        return false;
+    }
+
+    // one always runs, or a link larger than the budget would never do
+    if (!local_job_memory || !clients.local_processes) {
+        return true;
+    }
+
+    time_t now = time(0);
+
+    if (now != local_memory_time) {
+        local_memory_time = now;
+        local_memory = free_memory();
+        local_memory -= std::min(local_memory, scratch_reserved);
+    }
+
+    return local_memory >= local_job_memory;
 }
 
 void Daemon::handle_old_request()
 {
-    while ((current_kids + clients.active_processes) < max_kids) {
+    while (true) {
+        bool compile_slot = (current_kids + clients.active_processes - clients.local_processes) < max_kids;
+        Client *client = 0;
 
-        Client *client = clients.get_earliest_client(Client::LINKJOB);
+        if (max_local_kids ? local_job_fits() : compile_slot) {
+            client = clients.get_earliest_client(Client::LINKJOB);
+        }
 
         if (client) {
             trace() << "send JobLocalBeginMsg to client" << endl;
@@ -1221,11 +2014,19 @@ void Daemon::handle_old_request()
                 log_warning() << "can't send start message to client" << endl;
                 handle_end(client, 112);
             } else {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 clients.active_processes++;
+
+                if (max_local_kids) {
+                    client->local_job = true;
+                    clients.local_processes++;
+                    local_memory -= std::min(local_memory, local_job_memory);
+                }
+
                 trace() << "pushed local job " << client->client_id << endl;
 
-                if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile))) {
+                if (!send_scheduler(JobLocalBeginMsg(client->client_id, client->outfile),
+                                    MsgChannel::SendQueued)) {
                     return;
                 }
             }
@@ -1233,13 +2034,19 @@ void Daemon::handle_old_request()
             continue;
         }
 
+        if (!compile_slot) {
+            break;
+        }
+
         client = clients.get_earliest_client(Client::PENDING_USE_CS);
 
         if (client) {
-            trace() << "pending " << client->dump() << endl;
+            if (log_enabled(Debug)) {
+                trace() << "pending " << client->dump() << endl;
+            }
 
             if (client->channel->send_msg(*client->usecsmsg)) {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 /* we make sure we reserve a spot and the rest is done if the
                  * client contacts as back with a Compile request */
                 clients.active_processes++;
@@ -1267,19 +2074,44 @@ void Daemon::handle_old_request()
             trace() << "requests--" << job->jobID() << endl;
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
-            envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
+            env_cache.use(envforjob, time(NULL));
+
+            if (!job->environmentVersion().empty() && scheduler && IS_PROTOCOL_62(scheduler)
+                    && !dicts.has(job->targetPlatform(), job->environmentVersion())) {
+                want_dict_samples(envbasedir + "/target=" + job->targetPlatform() + "/"
+                                  + job->environmentVersion(), user_uid, user_gid);
+            }
+
+            if (!job->environmentVersion().empty()) {
+                pid = workers.run(envforjob, *job, client->channel, sock, mem_limit, client->raw_output,
+                                  client->stream_output, client->remote_cpp, client->pch,
+                                  client->interleaved_output, client->chunked, result_owners);
+            }
+
+            if (pid <= 0) {
+                pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                        client->raw_output, client->stream_output, client->remote_cpp,
+                                        client->pch, client->interleaved_output, client->chunked,
+                                        result_owners);
+            }
+
             trace() << "handle connection returned " << pid << endl;
 
             if (pid > 0) {
                 current_kids++;
-                client->status = Client::WAITFORCHILD;
+                clients.set_status(client, Client::WAITFORCHILD);
                 client->pipe_to_child = sock;
                 client->child_pid = pid;
+                client->job_slot = placement.take();
+                placement.place(pid, client->job_slot, mem_limit);
 
-                if (!send_scheduler(JobBeginMsg(job->jobID()))) {
+                if (!send_scheduler(JobBeginMsg(job->jobID()), MsgChannel::SendQueued)) {
                     log_info() << "failed sending scheduler about " << job->jobID() << endl;
                 }
+
+                if (!job->environmentVersion().empty()) {
+                    workers.refill(envbasedir, envforjob, user_uid, user_gid);
+                }
             } else {
                 handle_end(client, 117);
             }
@@ -1291,6 +2123,49 @@ void Daemon::handle_old_request()
     }
 }
 
+/* Smooths what the job process of CLIENT measured into the link to the
+   peer it came from.  */
+void Daemon::measure_link(Client *client, const unsigned int job_stat[])
+{
+    if (client->channel->is_unix_socket() || client->channel->name.empty()) {
+        return;
+    }
+
+    PeerLink &link = peer_links[client->channel->name];
+    bool changed = false;
+    link.peer = client->channel->name;
+
+    if (job_stat[JobStatistics::rtt_usec]) {
+        if (link.rtt_usec) {
+            link.rtt_usec = (link.rtt_usec * 3 + job_stat[JobStatistics::rtt_usec]) / 4;
+        } else {
+            link.rtt_usec = job_stat[JobStatistics::rtt_usec];
+        }
+
+        changed = true;
+    }
+
+    // what was read ahead came faster than it seems
+    if (job_stat[JobStatistics::in_compressed] >= MIN_LINK_SAMPLE_BYTES
+            && job_stat[JobStatistics::in_msec] && !client->prefetched) {
+        unsigned long long bytes_per_sec = 1000ULL * job_stat[JobStatistics::in_uncompressed]
+                                           / job_stat[JobStatistics::in_msec];
+        bytes_per_sec = min(bytes_per_sec, 0xffffffffULL);
+
+        if (link.bytes_per_sec) {
+            link.bytes_per_sec = (link.bytes_per_sec * 3ULL + bytes_per_sec) / 4;
+        } else {
+            link.bytes_per_sec = bytes_per_sec;
+        }
+
+        changed = true;
+    }
+
+    if (changed) {
+        changed_links.insert(link.peer);
+    }
+}
+
 bool Daemon::handle_compile_done(Client *client)
 {
     assert(client->status == Client::WAITFORCHILD);
@@ -1302,7 +2177,7 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::count];
     int end_status = 151;
 
     if (read(client->pipe_to_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
@@ -1314,15 +2189,36 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->max_rss = job_stat[JobStatistics::max_rss_kb];
         end_status = job_stat[JobStatistics::exit_code];
+        measure_link(client, job_stat);
     }
 
+    fd2client.erase(client->pipe_to_child);
+    poller.unwatch(client->pipe_to_child);
     close(client->pipe_to_child);
     client->pipe_to_child = -1;
     string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
-    envs_last_use[envforjob] = time(NULL);
+    env_cache.use(envforjob, time(NULL));
+
+    const string &target = client->job->targetPlatform();
+    const string &version = client->job->environmentVersion();
+    string dict;
+    uint32_t dict_id;
+
+    if (!version.empty() && !dicts.has(target, version)
+            && take_trained_dict(envbasedir + "/target=" + target + "/" + version, dict, dict_id)) {
+        trace() << "trained dictionary " << dict_id << " for " << envforjob << endl;
+        dicts.add(target, version, dict_id, dict);
+
+        if (scheduler && IS_PROTOCOL_62(scheduler)
+                && !send_scheduler(CompressionDictMsg(target, version, dict_id, dict),
+                                   MsgChannel::SendQueued)) {
+            log_warning() << "failed to send dictionary to scheduler" << endl;
+        }
+    }
 
-    bool r = send_scheduler(*msg);
+    bool r = send_scheduler(*msg, MsgChannel::SendQueued);
     handle_end(client, end_status);
     delete msg;
     return r;
@@ -1330,15 +2226,36 @@ bool Daemon::handle_compile_done(Client *client)
 
 bool Daemon::handle_compile_file(Client *client, Msg *msg)
 {
-    CompileJob *job = dynamic_cast<CompileFileMsg *>(msg)->takeJob();
+    CompileFileMsg *fmsg = dynamic_cast<CompileFileMsg *>(msg);
+    CompileJob *job = fmsg->takeJob();
     assert(client);
     assert(job);
     client->job = job;
+    client->raw_output = fmsg->raw_output;
+    client->stream_output = fmsg->stream_output && stream_outputs;
+    client->remote_cpp = fmsg->remote_cpp;
+    client->pch = fmsg->pch;
+    client->interleaved_output = fmsg->interleaved_output;
+    client->chunked = fmsg->chunked;
+
+    /* The scheduler sent it before the job, see offer_dict() there.  */
+    if (fmsg->dict_id) {
+        const string *dict = dicts.find(fmsg->dict_id);
+
+        if (!dict) {
+            log_error() << "job " << job->jobID() << " compressed with unknown dictionary "
+                        << fmsg->dict_id << endl;
+            return false;
+        }
+
+        client->channel->setCompressionDict(*dict, false);
+    }
 
     if (client->status == Client::CLIENTWORK) {
         assert(job->environmentVersion() == "__client");
 
-        if (!send_scheduler(JobBeginMsg(job->jobID()))) {
+        // 0 for a job taken back from the scheduler's queue, see scheduler_job_wait()
+        if (job->jobID() && !send_scheduler(JobBeginMsg(job->jobID()), MsgChannel::SendQueued)) {
             trace() << "can't reach scheduler to tell him about compile file job "
                     << job->jobID() << endl;
             return false;
@@ -1346,7 +2263,8 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 
         // no scheduler is not an error case!
     } else {
-        client->status = Client::TOCOMPILE;
+        clients.set_status(client, Client::TOCOMPILE);
+        client->prefetch = clients.count(Client::TOCOMPILE) <= max_kids;
     }
 
     return true;
@@ -1355,6 +2273,18 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 bool Daemon::handle_verify_env(Client *client, VerifyEnvMsg *msg)
 {
     assert(msg);
+    string env = msg->target + "/" + msg->environment;
+
+    /* The scheduler had us fetch it from another daemon instead of the
+       client uploading it, the answer comes when it is here.  */
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->fetch_env == env) {
+            trace() << "verify of " << env << " waits for it to be fetched" << endl;
+            client->waiting_env = env;
+            return true;
+        }
+    }
+
     bool ok = verify_env(client->channel, envbasedir, msg->target, msg->environment, user_uid, user_gid);
     trace() << "Verify environment done, " << (ok ? "success" : "failure") << ", environment " << msg->environment
             << " (" << msg->target << ")" << endl;
@@ -1387,7 +2317,15 @@ void Daemon::handle_end(Client *client, int exitcode)
     trace() << "handle_end " << client->dump() << endl;
     trace() << dump_internals() << endl;
 #endif
-    fd2chan.erase(client->channel->fd);
+    fd2client.erase(client->channel->fd);
+    poller.unwatch(client->channel->fd);
+
+    if (client->pipe_to_child >= 0) {
+        /* The job processes forked later have the pipe too, so closing it
+           doesn't end the registration, it has to be removed first.  */
+        fd2client.erase(client->pipe_to_child);
+        poller.unwatch(client->pipe_to_child);
+    }
 
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
         close(client->pipe_to_child);
@@ -1395,8 +2333,18 @@ void Daemon::handle_end(Client *client, int exitcode)
         handle_transfer_env_done(client);
     }
 
-    if (client->status == Client::CLIENTWORK) {
-        clients.active_processes--;
+    clients.end_work(client);
+
+    if (!client->fetch_env.empty()) {
+        string env = client->fetch_env;
+        client->fetch_env.clear();
+
+        // the other daemon didn't send it, we're not busy for the scheduler
+        if (!reannounce_environments()) {
+            log_error() << "failed to reannounce environments" << endl;
+        }
+
+        answer_env_waiters(env);
     }
 
     if (client->status == Client::WAITCOMPILE && exitcode == 119) {
@@ -1406,7 +2354,7 @@ void Daemon::handle_end(Client *client, int exitcode)
 
     /* Delete from the clients map before send_scheduler, which causes a
        double deletion. */
-    if (!clients.erase(client->channel)) {
+    if (!clients.remove(client)) {
         log_error() << "client can't be erased: " << client->channel << endl;
         flush_debug();
         log_error() << dump_internals() << endl;
@@ -1414,7 +2362,7 @@ void Daemon::handle_end(Client *client, int exitcode)
         assert(false);
     }
 
-    if (scheduler && client->status != Client::WAITFORCHILD) {
+    if ((scheduler || scheduler_lost) && client->status != Client::WAITFORCHILD) {
         int job_id = client->job_id;
 
         if (client->status == Client::TOCOMPILE) {
@@ -1450,44 +2398,59 @@ void Daemon::handle_end(Client *client, int exitcode)
                 break;
             }
 
-            trace() << "scheduler->send_msg( JobDoneMsg( " << client->dump() << ", " << exitcode << "))\n";
+            if (log_enabled(Debug)) {
+                trace() << "scheduler->send_msg( JobDoneMsg( " << client->dump() << ", " << exitcode << "))\n";
+            }
 
-            if (!send_scheduler(JobDoneMsg(job_id, exitcode, flag))) {
+            if (!send_scheduler_job_msg(new JobDoneMsg(job_id, exitcode, flag))) {
                 trace() << "failed to reach scheduler for remote job done msg!" << endl;
             }
-        } else if (client->status == Client::CLIENTWORK) {
-            // Clientwork && !job_id == LINK
+        } else if (client->status == Client::CLIENTWORK
+                   || client->status == Client::PENDING_USE_CS) {
+            // Clientwork && !job_id == LINK, or see scheduler_job_wait()
             trace() << "scheduler->send_msg( JobLocalDoneMsg( " << client->client_id << ") );\n";
 
-            if (!send_scheduler(JobLocalDoneMsg(client->client_id))) {
+            if (!send_scheduler_job_msg(new JobLocalDoneMsg(client->client_id))) {
                 trace() << "failed to reach scheduler for local job done msg!" << endl;
             }
         }
     }
 
+    placement.release(client->job_slot);
     delete client;
 }
 
 void Daemon::clear_children()
 {
+    /* What's counted in current_kids once the clients are gone, workers
+       running a job among them.  */
+    list<pid_t> jobs;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::WAITFORCHILD && it->second->child_pid > 0) {
+            jobs.push_back(it->second->child_pid);
+        }
+    }
+
     while (!clients.empty()) {
         Client *cl = clients.first();
         handle_end(cl, 116);
     }
 
-    while (current_kids > 0) {
-        int status;
-        pid_t child;
+    workers.clear();
 
-        while ((child = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
+    assert(current_kids == jobs.size());
 
-        current_kids--;
+    for (list<pid_t>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        while (waitpid(*it, 0, 0) < 0 && errno == EINTR) {}
     }
 
+    current_kids = 0;
+
     // they should be all in clients too
-    assert(fd2chan.empty());
+    assert(fd2client.empty());
 
-    fd2chan.clear();
+    fd2client.clear();
     new_client_id = 0;
     trace() << "cleared children\n";
 }
@@ -1496,34 +2459,110 @@ bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
-    client->status = Client::WAITFORCS;
+    clients.set_status(client, Client::WAITFORCS);
     umsg->client_id = client->client_id;
     trace() << "handle_get_cs " << umsg->client_id << endl;
+    gettimeofday(&client->asked_cs, 0);
+    delete client->getcs;
+    client->getcs = new GetCSMsg(*umsg);
 
     if (!scheduler) {
         /* now the thing is this: if there is no scheduler
            there is no point in trying to ask him. So we just
-           redefine this as local job */
-        client->usecsmsg = new UseCSMsg(umsg->target, "127.0.0.1", daemon_port,
-                                        umsg->client_id, true, 1, 0);
-        client->status = Client::PENDING_USE_CS;
-        client->job_id = umsg->client_id;
+           redefine this as local job, unless a new scheduler
+           is about to take over */
+        if (!scheduler_lost) {
+            compile_locally(client, *umsg);
+        }
+
         return true;
     }
 
-    return send_scheduler(*umsg);
+    if (UseCSMsg *lease = IS_PROTOCOL_47(scheduler) ? leases.take(*umsg) : 0) {
+        trace() << "answering " << client->client_id << " with the lease of job "
+                << lease->job_id << endl;
+
+        if (!send_scheduler(UseLeaseMsg(lease->job_id, client->client_id, *umsg))) {
+            delete lease;
+            return false;
+        }
+
+        lease->client_id = client->client_id;
+        bool ok = scheduler_use_cs(lease) == 0;
+        delete lease;
+        request_leases(*umsg);
+        return ok;
+    }
+
+    if (!send_scheduler(*umsg)) {
+        return false;
+    }
+
+    request_leases(*umsg);
+    return true;
+}
+
+/* Asks the scheduler for compile servers for the next requests like MSG,
+   as long as there are fewer leases for them than wanted.  */
+void Daemon::request_leases(const GetCSMsg &msg)
+{
+    if (!scheduler || !IS_PROTOCOL_47(scheduler)) {
+        return;
+    }
+
+    for (unsigned int n = leases.wanted(msg); n > 0; --n) {
+        GetCSMsg request(msg);
+        request.lease = 1;
+        request.client_id = ++new_client_id;
+        request.filename.clear();
+
+        if (!send_scheduler(request, MsgChannel::SendQueued)) {
+            return;
+        }
+
+        leases.requested(request, time(0));
+    }
+}
+
+/* Gives back the leases no client took for a while.  */
+void Daemon::expire_leases()
+{
+    list<unsigned int> jobs, requests;
+    leases.expire(time(0), jobs, requests);
+
+    for (list<unsigned int>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        send_scheduler_job_msg(new JobDoneMsg(*it, LEASE_RETURNED, JobDoneMsg::FROM_SUBMITTER));
+    }
+
+    for (list<unsigned int>::const_iterator it = requests.begin(); it != requests.end(); ++it) {
+        send_scheduler_job_msg(new JobDoneMsg(*it, CLIENT_WAS_WAITING_FOR_CS,
+                                              JobDoneMsg::FROM_SUBMITTER));
+    }
+}
+
+void Daemon::compile_locally(Client *client, const GetCSMsg &msg)
+{
+    client->usecsmsg = new UseCSMsg(msg.target, "127.0.0.1", daemon_port,
+                                    msg.client_id, true, 1, 0);
+    clients.set_status(client, Client::PENDING_USE_CS);
+    client->job_id = msg.client_id;
 }
 
 int Daemon::handle_cs_conf(ConfCSMsg *msg)
 {
     max_scheduler_pong = msg->max_scheduler_pong;
     max_scheduler_ping = msg->max_scheduler_ping;
+
+    if (msg->need_environments && !reannounce_environments()) {
+        return 1;
+    }
+
     return 0;
 }
 
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
-    client->status = Client::LINKJOB;
+    clients.set_status(client, Client::LINKJOB);
     client->outfile = dynamic_cast<JobLocalBeginMsg *>(msg)->outfile;
     return true;
 }
@@ -1579,6 +2618,19 @@ bool Daemon::handle_file_chunk_env(Client *client, Msg *msg)
     return false;
 }
 
+bool Daemon::handle_raw_env(Client *client)
+{
+    assert(client && client->status == Client::TOINSTALL);
+
+    if (client->pipe_to_child < 0 || client->channel->read_raw(client->pipe_to_child) < 0) {
+        log_perror("write to transfer env pipe failed. ");
+        handle_end(client, 139);
+        return false;
+    }
+
+    return true;
+}
+
 bool Daemon::handle_activity(Client *client)
 {
     assert(client->status != Client::TOCOMPILE);
@@ -1592,7 +2644,25 @@ bool Daemon::handle_activity(Client *client)
 
     bool ret = false;
 
+    if (client->upload) {
+        bool done;
+        ret = client->upload->handle(msg, done) && !done;
+        delete msg;
+
+        if (!ret) {
+            handle_end(client, done ? 146 : 147);
+        }
+
+        return ret;
+    }
+
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
+        if (msg->type == M_FILE_RAW) {
+            // the data follows unframed, handle_raw_env() moves it as it arrives
+            delete msg;
+            return handle_raw_env(client);
+        }
+
         ret = handle_file_chunk_env(client, msg);
     }
 
@@ -1611,6 +2681,15 @@ bool Daemon::handle_activity(Client *client)
     case M_TRANFER_ENV:
         ret = handle_transfer_env(client, msg);
         break;
+    case M_GET_ENV:
+        ret = handle_get_env(client, dynamic_cast<GetEnvMsg *>(msg));
+        break;
+    case M_GET_RESULT:
+        ret = handle_get_result(client, dynamic_cast<GetResultMsg *>(msg));
+        break;
+    case M_PUT_RESULT:
+        ret = handle_put_result(client, dynamic_cast<PutResultMsg *>(msg));
+        break;
     case M_GET_CS:
         ret = handle_get_cs(client, msg);
         break;
@@ -1667,150 +2746,141 @@ int Daemon::answer_client_requests()
         maybe_stats();
     }
 
-    fd_set listen_set;
-    struct timeval tv;
+    int timeout = max_scheduler_pong * 1000;
 
-    FD_ZERO(&listen_set);
-    int max_fd = 0;
-
-    if (tcp_listen_fd != -1) {
-        FD_SET(tcp_listen_fd, &listen_set);
-        max_fd = tcp_listen_fd;
+    if (scheduler && current_kids + clients.active_processes != reported_busy) {
+        timeout = STATS_COALESCE_MSEC;
     }
 
-    FD_SET(unix_listen_fd, &listen_set);
+    /* Clients with a new status have to be watched differently, and may
+       have messages left that were not handled while their channel was
+       busy.  Nobody else has to be looked at.  */
+    while (!clients.changed.empty()) {
+        set<int> changed;
+        changed.swap(clients.changed);
 
-    if (unix_listen_fd > max_fd) { // very likely
-        max_fd = unix_listen_fd;
-    }
-
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-            it != fd2chan.end();) {
-        int i = it->first;
-        MsgChannel *c = it->second;
-        ++it;
-        /* don't select on a fd that we're currently not interested in.
-           Avoids that we wake up on an event we're not handling anyway */
-        Client *client = clients.find_by_channel(c);
-        assert(client);
-        int current_status = client->status;
-        bool ignore_channel = current_status == Client::TOCOMPILE
-                              || current_status == Client::WAITFORCHILD;
+        for (set<int>::const_iterator it = changed.begin(); it != changed.end(); ++it) {
+            map<int, Client *>::const_iterator cit = fd2client.find(*it);
 
-        if (!ignore_channel && (!c->has_msg() || handle_activity(client))) {
-            if (i > max_fd) {
-                max_fd = i;
+            if (cit == fd2client.end()) {
+                continue;
             }
 
-            FD_SET(i, &listen_set);
-        }
+            Client *client = cit->second;
+            watch_client(client);
 
-        if (current_status == Client::WAITFORCHILD
-                && client->pipe_to_child != -1) {
-            if (client->pipe_to_child > max_fd) {
-                max_fd = client->pipe_to_child;
+            if (!client->channel_busy() && client->channel->has_msg()) {
+                handle_client_input(client, false);
+                // handle_old_request() may have something to do now
+                timeout = 0;
             }
-
-            FD_SET(client->pipe_to_child, &listen_set);
         }
     }
 
+    if (tcp_listen_fd != -1) {
+        poller.watch(tcp_listen_fd, Poller::Read);
+    }
+
+    poller.watch(unix_listen_fd, Poller::Read);
+
+    /* Send what was queued for the scheduler in this iteration at once.  */
+    if (scheduler && scheduler->pending() && !scheduler->flush(false)) {
+        log_error() << "sending to scheduler failed.." << endl;
+        close_scheduler();
+    }
+
     if (scheduler) {
-        FD_SET(scheduler->fd, &listen_set);
+        poller.watch(scheduler->fd, Poller::Read | (scheduler->pending() ? Poller::Write : 0));
+    }
 
-        if (max_fd < scheduler->fd) {
-            max_fd = scheduler->fd;
-        }
-    } else if (discover && discover->listen_fd() >= 0) {
-        /* We don't explicitely check for discover->get_fd() being in
-        the selected set below.  If it's set, we simply will return
-        and our call will make sure we try to get the scheduler.  */
-        FD_SET(discover->listen_fd(), &listen_set);
+    /* These descriptors come and go without us noticing, so they are
+       watched only while waiting.  */
+    vector<int> transient_fds;
 
-        if (max_fd < discover->listen_fd()) {
-            max_fd = discover->listen_fd();
-        }
+    if (!scheduler && discover && discover->listen_fd() >= 0) {
+        /* We don't explicitely check for discover->get_fd() being
+        ready below.  If it is, we simply will return and our call
+        will make sure we try to get the scheduler.  */
+        transient_fds.push_back(discover->listen_fd());
+    }
+
+    // the connection is tried again with the next call
+    if (!scheduler && discover && discover->connect_fd() >= 0) {
+        timeout = min(timeout, 100);
     }
 
     for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
             it != native_environments.end(); ++it) {
         if (it->second.create_env_pipe) {
-            FD_SET(it->second.create_env_pipe, &listen_set);
-            if (max_fd < it->second.create_env_pipe)
-                max_fd = it->second.create_env_pipe;
+            transient_fds.push_back(it->second.create_env_pipe);
         }
     }
 
-    tv.tv_sec = max_scheduler_pong;
-    tv.tv_usec = 0;
-
-    int ret = select(max_fd + 1, &listen_set, NULL, NULL, &tv);
+    if (compiler_watch_fd >= 0) {
+        transient_fds.push_back(compiler_watch_fd);
+    }
 
-    if (ret < 0 && errno != EINTR) {
-        log_perror("select");
-        return 5;
+    // an upgrade replaces a number of files, the last one is waited for
+    if (compilers_changed_at && time(0) - compilers_changed_at >= COMPILERS_SETTLE_TIME) {
+        compilers_changed_at = 0;
+        prepare_native_envs();
+    } else if (compilers_changed_at) {
+        timeout = min(timeout, COMPILERS_SETTLE_TIME * 1000);
     }
 
-    if (ret > 0) {
-        bool had_scheduler = scheduler;
+    connection_pool.expire(time(0));
+    connection_pool.add_fds(transient_fds);
+    workers.expire(time(0));
+    workers.add_fds(transient_fds);
+    warmer.update(envbasedir, env_cache, time(0));
+    benchmark.add_fds(transient_fds);
 
-        if (scheduler && FD_ISSET(scheduler->fd, &listen_set)) {
-            while (!scheduler->read_a_bit() || scheduler->has_msg()) {
-                Msg *msg = scheduler->get_msg();
+    if (scheduler) {
+        expire_leases();
+    }
 
-                if (!msg) {
-                    log_error() << "scheduler closed connection" << endl;
-                    close_scheduler();
-                    clear_children();
-                    return 1;
-                }
+    for (vector<int>::const_iterator it = transient_fds.begin(); it != transient_fds.end(); ++it) {
+        poller.watch(*it, Poller::Read);
+    }
 
-                ret = 0;
+    int ret = poller.wait(timeout);
+    int wait_errno = errno;
 
-                switch (msg->type) {
-                case M_PING:
+    for (vector<int>::const_iterator it = transient_fds.begin(); it != transient_fds.end(); ++it) {
+        poller.unwatch(*it);
+    }
 
-                    if (!IS_PROTOCOL_27(scheduler)) {
-                        ret = !send_scheduler(PingMsg());
-                    }
+    if (ret < 0 && wait_errno != EINTR) {
+        errno = wait_errno;
+        log_perror("poller");
+        return 5;
+    }
 
-                    break;
-                case M_USE_CS:
-                    ret = scheduler_use_cs(static_cast<UseCSMsg *>(msg));
-                    break;
-                case M_GET_INTERNALS:
-                    ret = scheduler_get_internals();
-                    break;
-                case M_CS_CONF:
-                    ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
-                    break;
-                default:
-                    log_error() << "unknown scheduler type " << (char)msg->type << endl;
-                    ret = 1;
-                }
+    bool had_scheduler = scheduler;
 
-                delete msg;
+    for (int r = 0; r < ret; ++r) {
+        int fd = poller.ready_fd(r);
 
-                if (ret) {
-                    return ret;
-                }
-            }
+        if (!(poller.ready_events(r) & Poller::Read)) {
+            /* Only the scheduler is watched for writing, its queue
+               is flushed in the next iteration.  */
+            continue;
         }
 
-        int listen_fd = -1;
+        if (scheduler && fd == scheduler->fd) {
+            int sret = handle_scheduler_messages();
 
-        if (tcp_listen_fd != -1 && FD_ISSET(tcp_listen_fd, &listen_set)) {
-            listen_fd = tcp_listen_fd;
-        }
+            if (sret) {
+                return sret;
+            }
 
-        if (FD_ISSET(unix_listen_fd, &listen_set)) {
-            listen_fd = unix_listen_fd;
+            continue;
         }
 
-        if (listen_fd != -1) {
+        if (fd == tcp_listen_fd || fd == unix_listen_fd) {
             struct sockaddr cli_addr;
             socklen_t cli_len = sizeof cli_addr;
-            int acc_fd = accept(listen_fd, &cli_addr, &cli_len);
+            int acc_fd = accept(fd, &cli_addr, &cli_len);
 
             if (acc_fd < 0) {
                 log_perror("accept error");
@@ -1824,7 +2894,7 @@ int Daemon::answer_client_requests()
             MsgChannel *c = Service::createChannel(acc_fd, &cli_addr, cli_len);
 
             if (!c) {
-                return 0;
+                continue;
             }
 
             trace() << "accepted " << c->fd << " " << c->name << endl;
@@ -1832,76 +2902,219 @@ int Daemon::answer_client_requests()
             Client *client = new Client;
             client->client_id = ++new_client_id;
             client->channel = c;
-            clients[c] = client;
+            clients.add(client);
 
-            fd2chan[c->fd] = c;
+            fd2client[c->fd] = client;
+            handle_client_input(client, true);
+            continue;
+        }
 
-            while (!c->read_a_bit() || c->has_msg()) {
-                if (!handle_activity(client)) {
-                    break;
-                }
+        map<int, Client *>::const_iterator cit = fd2client.find(fd);
 
-                if (client->status == Client::TOCOMPILE
-                        || client->status == Client::WAITFORCHILD) {
-                    break;
+        if (cit != fd2client.end()) {
+            Client *client = cit->second;
+
+            if (fd == client->pipe_to_child) {
+                if (client->status == Client::WAITFORCHILD && !handle_compile_done(client)) {
+                    return 1;
                 }
+            } else if (!client->channel_busy()) {
+                handle_client_input(client, true);
+            } else if (client->prefetching()) {
+                prefetch_input(client);
             }
-        } else {
-            for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-                    max_fd && it != fd2chan.end();)  {
-                int i = it->first;
-                MsgChannel *c = it->second;
-                Client *client = clients.find_by_channel(c);
-                assert(client);
-                ++it;
-
-                if (client->status == Client::WAITFORCHILD
-                        && client->pipe_to_child >= 0
-                        && FD_ISSET(client->pipe_to_child, &listen_set)) {
-                    max_fd--;
-
-                    if (!handle_compile_done(client)) {
-                        return 1;
-                    }
-                }
 
-                if (FD_ISSET(i, &listen_set)) {
-                    assert(client->status != Client::TOCOMPILE);
+            continue;
+        }
+
+        bool native_env = false;
 
-                    while (!c->read_a_bit() || c->has_msg()) {
-                        if (!handle_activity(client)) {
-                            break;
-                        }
+        if (fd == compiler_watch_fd) {
+            if (compilers_changed(fd)) {
+                trace() << "compilers changed" << endl;
+                compilers_changed_at = time(0);
+            }
 
-                        if (client->status == Client::TOCOMPILE
-                                || client->status == Client::WAITFORCHILD) {
-                            break;
-                        }
-                    }
+            continue;
+        }
 
-                    max_fd--;
+        for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
+                it != native_environments.end(); ++it) {
+            if (it->second.create_env_pipe && it->second.create_env_pipe == fd) {
+                if (!create_env_finished(it->first)) {
+                    native_environments.erase(it);
                 }
+
+                native_env = true;
+                break;
             }
+        }
 
-            for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
-                 it != native_environments.end(); ) {
-                if (it->second.create_env_pipe && FD_ISSET(it->second.create_env_pipe, &listen_set)) {
-                    if(!create_env_finished(it->first))
-                    {
-                        native_environments.erase(it++);
-                        continue;
-                    }
+        BenchmarkResultMsg result;
+
+        if (!native_env && benchmark.handle_fd(fd, result)) {
+            if (scheduler) {
+                ignore_result(send_scheduler(result));
+            }
+        } else if (!native_env) {
+            connection_pool.handle_fd(fd);
+            workers.handle_fd(fd);
+        }
+    }
+
+    if (had_scheduler && !scheduler) {
+        clear_children();
+        return 2;
+    }
+
+    return 0;
+}
+
+/* Watches the channel of client unless a job process handles it, and
+   the pipe from the job process.  */
+void Daemon::watch_client(Client *client)
+{
+    poller.watch(client->channel->fd,
+                 client->channel_busy() && !client->prefetching() ? 0 : Poller::Read);
+
+    if (client->status == Client::WAITFORCHILD && client->pipe_to_child >= 0) {
+        fd2client[client->pipe_to_child] = client;
+        poller.watch(client->pipe_to_child, Poller::Read);
+    }
+}
+
+/* Reads ahead what the client of a job waiting for a slot sends, which
+   the job process takes from the channel then.  The transfer overlaps
+   with the jobs that hold the slots.  */
+void Daemon::prefetch_input(Client *client)
+{
+    client->prefetched = true;
+
+    if (!client->channel->prefetch(PREFETCH_SIZE)) {
+        trace() << "read ahead the input of job " << client->job->jobID() << endl;
+        client->prefetch = false;
+        clients.changed.insert(client->channel->fd);
+    }
+}
+
+/* Reads from the channel of client if read is set, and handles its
+   messages until the job is handed to a job process.  */
+void Daemon::handle_client_input(Client *client, bool read)
+{
+    MsgChannel *c = client->channel;
+    int fd = c->fd;
+
+    if (read && c->raw_pending() && (!handle_raw_env(client) || c->raw_pending())) {
+        return;
+    }
+
+    while ((read && !c->read_a_bit()) || c->has_msg()) {
+        if (!handle_activity(client)) {
+            break;
+        }
+
+        if (client->channel_busy()) {
+            break;
+        }
+
+        /* read_a_bit() may have buffered the raw data of an environment
+           and what follows it already, nothing wakes us up for that.  */
+        if (c->raw_pending() && (!handle_raw_env(client) || c->raw_pending())) {
+            return;
+        }
+    }
+
+    /* handle_activity() can end the client, or fail with messages left,
+       which the poller doesn't wake us up for.  */
+    map<int, Client *>::const_iterator it = fd2client.find(fd);
+
+    if (it != fd2client.end() && it->second == client
+            && !client->channel_busy() && c->has_msg()) {
+        clients.changed.insert(fd);
+    }
+}
+
+int Daemon::handle_scheduler_messages()
+{
+    while (!scheduler->read_a_bit() || scheduler->has_msg()) {
+        Msg *msg = scheduler->get_msg();
+
+        if (!msg) {
+            log_error() << "scheduler closed connection" << endl;
+            bool established = time(0) - scheduler_connected >= SCHEDULER_FAILOVER_TIMEOUT;
+            list<unsigned int> leased;
+            leases.clear(leased);
+            close_scheduler();
+
+            /* The clients wait for a new scheduler a bit, there may be a
+               standby one taking over.  Otherwise they'd all fall back
+               to compiling locally at once.  */
+            if (established) {
+                scheduler_lost = time(0);
+                next_scheduler_connect = time(0) + (rand() & 3);
+                // most likely it is restarted
+                try_last_scheduler = true;
+
+                // that one knows the leased jobs, but they are not needed
+                for (list<unsigned int>::const_iterator it = leased.begin(); it != leased.end(); ++it) {
+                    scheduler_backlog.push_back(new JobDoneMsg(*it, LEASE_RETURNED,
+                                                               JobDoneMsg::FROM_SUBMITTER));
                 }
-                ++it;
+            } else {
+                clear_children();
             }
 
+            return 1;
         }
 
-        if (had_scheduler && !scheduler) {
-            clear_children();
-            return 2;
+        int ret = 0;
+
+        switch (msg->type) {
+        case M_PING:
+
+            if (!IS_PROTOCOL_27(scheduler)) {
+                ret = !send_scheduler(PingMsg(), MsgChannel::SendQueued);
+            }
+
+            break;
+        case M_USE_CS:
+            ret = scheduler_use_cs(static_cast<UseCSMsg *>(msg));
+            break;
+        case M_JOB_WAIT:
+            ret = scheduler_job_wait(static_cast<JobWaitMsg *>(msg));
+            break;
+        case M_GET_INTERNALS:
+            ret = scheduler_get_internals();
+            break;
+        case M_CS_CONF:
+            ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
+            break;
+        case M_FETCH_ENV:
+            ret = handle_fetch_env(static_cast<FetchEnvMsg *>(msg));
+            break;
+        case M_BENCHMARK:
+            ret = handle_benchmark(static_cast<BenchmarkMsg *>(msg));
+            break;
+        case M_COMPRESSION_DICT: {
+            CompressionDictMsg *m = static_cast<CompressionDictMsg *>(msg);
+            dicts.add(m->target, m->version, m->id, m->data);
+            drop_dict_samples(envbasedir + "/target=" + m->target + "/" + m->version);
+            break;
+        }
+        case M_RESULT_OWNERS:
+            result_owners.setMembers(static_cast<ResultOwnersMsg *>(msg)->owners);
+            trace() << "result owners: " << result_owners.members().size() << endl;
+            break;
+        default:
+            log_error() << "unknown scheduler type " << (char)msg->type << endl;
+            ret = 1;
         }
 
+        delete msg;
+
+        if (ret) {
+            return ret;
+        }
     }
 
     return 0;
@@ -1913,6 +3126,10 @@ bool Daemon::reconnect()
         return true;
     }
 
+    if (scheduler_lost && time(0) - scheduler_lost >= SCHEDULER_FAILOVER_TIMEOUT) {
+        scheduler_not_replaced();
+    }
+
     if (!discover && next_scheduler_connect > time(0)) {
         trace() << "timeout.." << endl;
         return false;
@@ -1922,9 +3139,31 @@ bool Daemon::reconnect()
     trace() << "reconn " << dump_internals() << endl;
 #endif
 
-    if (!discover || (NULL == (scheduler = discover->try_get_scheduler()) && discover->timed_out())) {
+    if (discover && NULL == (scheduler = discover->try_get_scheduler()) && discover->timed_out()) {
         delete discover;
-        discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
+        discover = 0;
+
+        /* A whole farm loses the scheduler at the same time, so the daemons
+           look for it again at random times, and less often while there is
+           none.  If only the last one didn't answer, broadcast at once.  */
+        if (!discover_last_scheduler) {
+            next_scheduler_connect = time(0) + rand() % reconnect_backoff;
+            reconnect_backoff = min(reconnect_backoff * 2, MAX_RECONNECT_BACKOFF);
+            return false;
+        }
+    }
+
+    if (!discover) {
+        discover_last_scheduler = try_last_scheduler && schedname.empty() && !last_scheduler.empty();
+
+        if (discover_last_scheduler) {
+            trace() << "trying the last scheduler " << last_scheduler << endl;
+        }
+
+        discover = new DiscoverSched(netname, max_scheduler_pong,
+                                     discover_last_scheduler ? last_scheduler : schedname,
+                                     scheduler_port);
+        try_last_scheduler = false;
     }
 
     if (!scheduler) {
@@ -1934,6 +3173,9 @@ bool Daemon::reconnect()
 
     delete discover;
     discover = 0;
+    reconnect_backoff = 2;
+    last_scheduler = scheduler->name;
+    scheduler->setTrafficClass(TC_CONTROL);
     sockaddr_in name;
     socklen_t len = sizeof(name);
     int error = getsockname(scheduler->fd, (struct sockaddr*)&name, &len);
@@ -1946,14 +3188,34 @@ bool Daemon::reconnect()
 
     log_info() << "Connected to scheduler (I am known as " << remote_name << ")" << endl;
     current_load = -1000;
+    reported_load = -1000;
     gettimeofday(&last_stat, 0);
+    last_report = last_stat;
     icecream_load = 0;
 
     LoginMsg lmsg(daemon_port, determine_nodename(), machine_name);
     lmsg.envs = available_environmnents(envbasedir);
+    string env_digest = environments_digest(lmsg.envs);
+
+    // a scheduler that knows them asks for them if it doesn't anymore
+    if (IS_PROTOCOL_56(scheduler) && env_digest == last_env_digest) {
+        lmsg.envs.clear();
+        lmsg.env_digest = env_digest;
+    }
+
+    last_env_digest = env_digest;
     lmsg.max_kids = max_kids;
+    lmsg.max_local_jobs = max_local_kids;
     lmsg.noremote = noremote;
-    return send_scheduler(lmsg);
+    lmsg.result_cache = results.enabled();
+
+    if (!send_scheduler(lmsg)) {
+        return false;
+    }
+
+    scheduler_connected = time(0);
+    scheduler_replaced();
+    return scheduler != 0;
 }
 
 int Daemon::working_loop()
@@ -1984,6 +3246,8 @@ int main(int argc, char **argv)
     int debug_level = Error;
     string logfile;
     bool detach = false;
+    bool async_log = false;
+    int async_log_rate = 0;
     nice_level = 5; // defined in serve.h
 
     while (true) {
@@ -2001,6 +3265,21 @@ int main(int argc, char **argv)
             { "user-uid", 1, NULL, 'u'},
             { "cache-limit", 1, NULL, 0},
             { "no-remote", 0, NULL, 0},
+            { "connection-pool", 1, NULL, 0},
+            { "leases", 1, NULL, 0},
+            { "max-local-jobs", 1, NULL, 0},
+            { "local-job-memory", 1, NULL, 0},
+            { "worker-pool", 1, NULL, 0},
+            { "scratch-tmpfs", 1, NULL, 0},
+            { "stream-output", 0, NULL, 0},
+            { "mount-environments", 0, NULL, 0},
+            { "result-cache", 1, NULL, 0},
+            { "pin-jobs", 1, NULL, 0},
+            { "prefetch-environments", 0, NULL, 0},
+            { "lock-environments", 1, NULL, 0},
+            { "job-cgroup", 1, NULL, 0},
+            { "async-log", 1, NULL, 0},
+            { "bulk-rate", 1, NULL, 0},
             { "port", 1, NULL, 'p'},
             { 0, 0, 0, 0 }
         };
@@ -2045,6 +3324,85 @@ int main(int argc, char **argv)
                 }
             } else if (optname == "no-remote") {
                 d.noremote = true;
+            } else if (optname == "connection-pool") {
+                if (optarg && *optarg) {
+                    d.connection_pool.setSize(atoi(optarg));
+                } else {
+                    usage("Error: --connection-pool requires argument");
+                }
+            } else if (optname == "leases") {
+                if (optarg && *optarg) {
+                    d.leases.setSize(atoi(optarg));
+                } else {
+                    usage("Error: --leases requires argument");
+                }
+            } else if (optname == "max-local-jobs") {
+                if (optarg && *optarg) {
+                    max_local_kids = std::max(atoi(optarg), 0);
+                } else {
+                    usage("Error: --max-local-jobs requires argument");
+                }
+            } else if (optname == "local-job-memory") {
+                if (optarg && *optarg) {
+                    local_job_memory = std::max(atoi(optarg), 0);
+                } else {
+                    usage("Error: --local-job-memory requires argument");
+                }
+            } else if (optname == "worker-pool") {
+                if (optarg && *optarg) {
+                    d.workers.setSize(atoi(optarg));
+                } else {
+                    usage("Error: --worker-pool requires argument");
+                }
+            } else if (optname == "scratch-tmpfs") {
+                if (optarg && *optarg) {
+                    scratch_tmpfs = std::max(atoi(optarg), 0);
+                } else {
+                    usage("Error: --scratch-tmpfs requires argument");
+                }
+            } else if (optname == "stream-output") {
+                stream_outputs = true;
+            } else if (optname == "mount-environments") {
+                mount_environments = true;
+            } else if (optname == "prefetch-environments") {
+                d.warmer.setPrefetch(true);
+            } else if (optname == "lock-environments") {
+                if (optarg && *optarg) {
+                    d.warmer.setLockBudget(size_t(std::max(atoi(optarg), 0)) * 1024 * 1024);
+                } else {
+                    usage("Error: --lock-environments requires argument");
+                }
+            } else if (optname == "pin-jobs") {
+                if (optarg && (!strcmp(optarg, "cores") || !strcmp(optarg, "numa"))) {
+                    pin_jobs = optarg;
+                } else {
+                    usage("Error: --pin-jobs requires cores or numa");
+                }
+            } else if (optname == "job-cgroup") {
+                if (optarg && *optarg) {
+                    job_cgroup = optarg;
+                } else {
+                    usage("Error: --job-cgroup requires argument");
+                }
+            } else if (optname == "async-log") {
+                if (optarg && *optarg) {
+                    async_log_rate = std::max(atoi(optarg), 0);
+                    async_log = true;
+                } else {
+                    usage("Error: --async-log requires argument");
+                }
+            } else if (optname == "bulk-rate") {
+                if (optarg && *optarg) {
+                    bulk_rate = std::max(atoi(optarg), 0) * 1024UL;
+                } else {
+                    usage("Error: --bulk-rate requires argument");
+                }
+            } else if (optname == "result-cache") {
+                if (optarg && *optarg) {
+                    result_cache_limit = size_t(std::max(atoi(optarg), 0)) * 1024 * 1024;
+                } else {
+                    usage("Error: --result-cache requires argument");
+                }
             }
 
         }
@@ -2188,6 +3546,12 @@ int main(int argc, char **argv)
 #ifdef HAVE_LIBCAP_NG
         capng_clear(CAPNG_SELECT_BOTH);
         capng_update(CAPNG_ADD, (capng_type_t)(CAPNG_EFFECTIVE | CAPNG_PERMITTED), CAP_SYS_CHROOT);
+
+        // mounting and unmounting the scratch space and environment images
+        if (scratch_tmpfs || mount_environments) {
+            capng_update(CAPNG_ADD, (capng_type_t)(CAPNG_EFFECTIVE | CAPNG_PERMITTED), CAP_SYS_ADMIN);
+        }
+
         int r = capng_change_id(d.user_uid, d.user_gid,
                                 (capng_flags_t)(CAPNG_DROP_SUPP_GRP | CAPNG_CLEAR_BOUNDING));
         if (r) {
@@ -2217,6 +3581,7 @@ int main(int argc, char **argv)
         d.daemon_port = 0;
 
     d.determine_system();
+    init_phase_counts();
 
     if (chdir("/") != 0) {
         log_error() << "failed to switch to root directory: "
@@ -2230,6 +3595,11 @@ int main(int argc, char **argv)
             exit(EXIT_DISTCC_FAILED);
         }
 
+    // the writer thread doesn't survive daemon()
+    if (async_log && !start_async_logging(async_log_rate * 1024UL)) {
+        log_error() << "failed to start logging asynchronously" << endl;
+    }
+
     if (dcc_ncpus(&d.num_cpus) == 0) {
         log_info() << d.num_cpus << " CPU(s) online on this server" << endl;
     }
@@ -2242,6 +3612,18 @@ int main(int argc, char **argv)
 
     log_info() << "allowing up to " << max_kids << " active jobs" << endl;
 
+    if (!d.placement.init(pin_jobs, job_cgroup, max_kids)) {
+        log_error() << "jobs are not placed on CPUs or in cgroups" << endl;
+    }
+
+    if (max_local_kids < 0) {
+        max_local_kids = max_kids;
+    }
+
+    if (max_local_kids) {
+        log_info() << "allowing up to " << max_local_kids << " local jobs besides them" << endl;
+    }
+
     int ret;
 
     /* Still create a new process group, even if not detached */
@@ -2280,17 +3662,30 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    list<string> nl = get_netnames(200, d.scheduler_port);
-    trace() << "Netnames:" << endl;
+    d.load_native_envs();
 
-    for (list<string>::const_iterator it = nl.begin(); it != nl.end(); ++it) {
-        trace() << *it << endl;
+    // hidden from the environments like the shared files
+    if (result_cache_limit && !d.results.setup(d.envbasedir + "/.results", result_cache_limit)) {
+        return 1;
+    }
+
+    // only for the log, it keeps the daemon from looking for its scheduler
+    if (log_enabled(Debug)) {
+        list<string> nl = get_netnames(200, d.scheduler_port);
+        trace() << "Netnames:" << endl;
+
+        for (list<string>::const_iterator it = nl.begin(); it != nl.end(); ++it) {
+            trace() << *it << endl;
+        }
     }
 
     if (!d.setup_listen_fds()) { // error
         return 1;
     }
 
+    d.compiler_watch_fd = watch_compilers();
+    d.prepare_native_envs();
+
     return d.working_loop();
 }
 
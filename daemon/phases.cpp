@@ -0,0 +1,87 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <sys/mman.h>
+
+#include "phases.h"
+#include "logging.h"
+
+using namespace std;
+
+static uint32_t *counts = 0;
+
+void init_phase_counts()
+{
+    if (counts) {
+        return;
+    }
+
+    void *mem = mmap(0, PHASE_COUNT * PHASE_VALUES * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        log_perror("mmap of the phase counts failed");
+        return;
+    }
+
+    counts = static_cast<uint32_t *>(mem);
+}
+
+void count_phase(JobPhase phase, unsigned int msec)
+{
+    if (!counts) {
+        return;
+    }
+
+    int bucket = 0;
+
+    while (bucket < PHASE_BUCKETS - 1 && msec > job_phase_bucket_msec[bucket]) {
+        ++bucket;
+    }
+
+    __sync_fetch_and_add(&counts[phase * PHASE_VALUES + bucket], 1);
+    __sync_fetch_and_add(&counts[phase * PHASE_VALUES + PHASE_BUCKETS], msec);
+}
+
+bool take_phase_counts(vector<uint32_t> &result)
+{
+    result.assign(PHASE_COUNT * PHASE_VALUES, 0);
+
+    if (!counts) {
+        return false;
+    }
+
+    bool any = false;
+
+    /* What is counted meanwhile stays for the next time.  */
+    for (int i = 0; i < PHASE_COUNT * PHASE_VALUES; ++i) {
+        result[i] = counts[i];
+        __sync_fetch_and_sub(&counts[i], result[i]);
+        any = any || result[i];
+    }
+
+    if (!any) {
+        result.clear();
+    }
+
+    return any;
+}
@@ -0,0 +1,37 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_PHASES_H
+#define ICECREAM_PHASES_H
+
+#include <vector>
+
+#include <comm.h>
+
+/* How long the phases of the jobs took, in the layout of StatsMsg::phases.
+   The counts are in memory shared with the job processes, which count the
+   phases of their job themselves, so init_phase_counts() has to be called
+   before forking any.  */
+extern void init_phase_counts();
+extern void count_phase(JobPhase phase, unsigned int msec);
+// moves the counts to COUNTS, false if there were none
+extern bool take_phase_counts(std::vector<uint32_t> &counts);
+
+#endif
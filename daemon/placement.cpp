@@ -0,0 +1,277 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "placement.h"
+#include "logging.h"
+#include "util.h"
+
+using namespace std;
+
+/* Parses a CPU list like "0-31,64-95".  */
+static vector<int> parse_cpulist(const string &list)
+{
+    vector<int> result;
+    const char *p = list.c_str();
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+
+        if (end == p) {
+            break;
+        }
+
+        long last = first;
+
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            result.push_back(cpu);
+        }
+
+        p = end;
+
+        while (*p == ',' || *p == '\n' || *p == ' ') {
+            ++p;
+        }
+    }
+
+    return result;
+}
+
+static string format_cpulist(const vector<int> &cpus)
+{
+    string result;
+
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        result += (i ? "," : "") + toString(cpus[i]);
+    }
+
+    return result;
+}
+
+static string read_line(const string &file)
+{
+    char buf[4096];
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    return n > 0 ? string(buf, n) : string();
+}
+
+static bool write_value(const string &file, const string &value)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = write(fd, value.c_str(), value.size()) == ssize_t(value.size());
+    close(fd);
+    return ok;
+}
+
+bool JobPlacement::init(const string &mode, const string &_cgroup, unsigned int slots)
+{
+    if ((mode.empty() && _cgroup.empty()) || !slots) {
+        return true;
+    }
+
+#ifndef __linux__
+    log_error() << "placing jobs on CPUs and in cgroups needs Linux" << endl;
+    return false;
+#else
+
+    if (!mode.empty() && mode != "cores" && mode != "numa") {
+        log_error() << "unknown placement of jobs: " << mode << endl;
+        return false;
+    }
+
+    // the CPUs of each NUMA node, or one node with all of them
+    vector<vector<int> > node_cpus;
+
+    for (int node = 0;; ++node) {
+        string list = read_line("/sys/devices/system/node/node" + toString(node) + "/cpulist");
+
+        if (list.empty()) {
+            break;
+        }
+
+        node_cpus.push_back(parse_cpulist(list));
+    }
+
+    if (node_cpus.empty()) {
+        node_cpus.push_back(parse_cpulist(read_line("/sys/devices/system/cpu/online")));
+    }
+
+    vector<int> all_cpus;
+    vector<int> cpu_node;
+
+    for (size_t node = 0; node < node_cpus.size(); ++node) {
+        for (size_t i = 0; i < node_cpus[node].size(); ++i) {
+            all_cpus.push_back(node_cpus[node][i]);
+            cpu_node.push_back(node);
+        }
+    }
+
+    if (all_cpus.empty()) {
+        log_error() << "no CPUs found to place jobs on" << endl;
+        return false;
+    }
+
+    cpus.assign(slots, vector<int>());
+    nodes.assign(slots, -1);
+    used.assign(slots, false);
+
+    for (unsigned int slot = 0; slot < slots; ++slot) {
+        if (mode == "numa") {
+            size_t node = size_t(slot) * node_cpus.size() / slots;
+            cpus[slot] = node_cpus[node];
+            nodes[slot] = node;
+        } else if (mode == "cores") {
+            // a share of the CPUs, ordered by node so it doesn't span two
+            size_t first = size_t(slot) * all_cpus.size() / slots;
+            size_t last = max(first + 1, size_t(slot + 1) * all_cpus.size() / slots);
+            cpus[slot].assign(all_cpus.begin() + first, all_cpus.begin() + last);
+            nodes[slot] = cpu_node[first] == cpu_node[last - 1] ? cpu_node[first] : -1;
+        }
+    }
+
+    cgroup = _cgroup;
+
+    if (cgroup.empty()) {
+        return true;
+    }
+
+    /* Without a controller the limits of it are missing, the others
+       still work.  */
+    const char *const controllers[] = { "+cpu", "+memory", "+cpuset" };
+
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); ++i) {
+        if (!write_value(cgroup + "/cgroup.subtree_control", controllers[i])) {
+            log_warning() << "cannot enable " << controllers[i] + 1 << " in " << cgroup << ": "
+                          << strerror(errno) << endl;
+        }
+    }
+
+    for (unsigned int slot = 0; slot < slots; ++slot) {
+        string dir = cgroup + "/slot" + toString(slot);
+
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            log_perror(("cannot create cgroup " + dir).c_str());
+            used.clear();
+            return false;
+        }
+
+        // as many CPUs as it is pinned to, or one
+        size_t quota = max(cpus[slot].size(), size_t(1));
+        write_value(dir + "/cpu.max", toString(quota * 100000) + " 100000");
+
+        if (!cpus[slot].empty()) {
+            write_value(dir + "/cpuset.cpus", format_cpulist(cpus[slot]));
+        }
+
+        if (nodes[slot] >= 0) {
+            write_value(dir + "/cpuset.mems", toString(nodes[slot]));
+        }
+    }
+
+    return true;
+#endif
+}
+
+int JobPlacement::take()
+{
+    vector<bool>::iterator it = find(used.begin(), used.end(), false);
+
+    if (it == used.end()) {
+        return -1;
+    }
+
+    *it = true;
+    return it - used.begin();
+}
+
+void JobPlacement::release(int slot)
+{
+    if (slot >= 0 && slot < int(used.size())) {
+        used[slot] = false;
+    }
+}
+
+void JobPlacement::place(pid_t pid, int slot, unsigned int mem_limit)
+{
+    if (slot < 0 || slot >= int(used.size())) {
+        return;
+    }
+
+#ifdef __linux__
+
+    if (!cgroup.empty()) {
+        string dir = cgroup + "/slot" + toString(slot);
+        write_value(dir + "/memory.max", toString((unsigned long long) mem_limit * 1024 * 1024));
+
+        if (!write_value(dir + "/cgroup.procs", toString(pid))) {
+            log_perror(("cannot move job to " + dir).c_str());
+        }
+    }
+
+    if (!cpus[slot].empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for (size_t i = 0; i < cpus[slot].size(); ++i) {
+            if (cpus[slot][i] < CPU_SETSIZE) {
+                CPU_SET(cpus[slot][i], &set);
+            }
+        }
+
+        if (sched_setaffinity(pid, sizeof(set), &set) < 0) {
+            log_perror("sched_setaffinity() failed");
+        }
+    }
+
+#else
+    (void) pid;
+    (void) mem_limit;
+#endif
+}
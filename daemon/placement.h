@@ -0,0 +1,62 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_PLACEMENT_H
+#define ICECREAM_PLACEMENT_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+/* Where the job processes run on big machines.  Each job takes one of
+   max_kids slots, and the process is moved into the slot once forked:
+   pinned to its CPUs (a share of the cores, or a whole NUMA node, where
+   the kernel then allocates its memory) and into a cgroup v2 of its own
+   with a CPU quota and a memory limit.  A worker of the WorkerPool moves
+   with every job it gets.  */
+class JobPlacement
+{
+public:
+    JobPlacement() {}
+
+    // MODE is "cores", "numa" or empty; CGROUP a cgroup v2 directory
+    // delegated to the daemon, or empty
+    bool init(const std::string &mode, const std::string &cgroup, unsigned int slots);
+
+    bool enabled() const
+    {
+        return !used.empty();
+    }
+
+    // a free slot, -1 if there is none or placement is off
+    int take();
+    void release(int slot);
+    // moves PID to SLOT, MEM_LIMIT is in MB
+    void place(pid_t pid, int slot, unsigned int mem_limit);
+
+private:
+    std::vector<std::vector<int> > cpus;  // for each slot, empty if not pinned
+    std::vector<int> nodes;  // the NUMA node of the slot, -1 if any
+    std::vector<bool> used;
+    std::string cgroup;
+};
+
+#endif
@@ -0,0 +1,458 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <comm.h>
+
+#include "logging.h"
+#include "results.h"
+
+using namespace std;
+
+// "ICR1", the start of a stored result
+#define RESULT_MAGIC 0x49435231
+
+// seconds to connect to the daemon owning a key
+#define OWNER_CONNECT_TIMEOUT 2
+
+// seconds the owner has to answer or send the next part of a result
+#define OWNER_TIMEOUT 30
+
+/* A stored result is this header, the compiler's output and error text,
+   then the object file and the .dwo file.  */
+struct ResultHeader {
+    uint32_t magic;
+    uint32_t have_dwo;
+    uint32_t out_len;
+    uint32_t err_len;
+    uint64_t obj_len;
+    uint64_t dwo_len;
+};
+
+bool ResultCache::setup(const string &_dir, size_t _limit)
+{
+    if (mkdir(_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        log_perror(("mkdir " + _dir).c_str());
+        return false;
+    }
+
+    dir = _dir;
+    limit = _limit;
+    return true;
+}
+
+string ResultCache::path(const string &key) const
+{
+    return dir + "/" + key;
+}
+
+string ResultCache::lookup(const string &key)
+{
+    map<string, list<Entry>::iterator>::iterator it = entries.find(key);
+
+    if (it == entries.end()) {
+        return string();
+    }
+
+    order.splice(order.begin(), order, it->second);
+    return path(key);
+}
+
+int ResultCache::create(const string &key, string &tmp_file)
+{
+    if (!enabled() || !ResultKey::valid(key)) {
+        return -1;
+    }
+
+    // several daemons may store the same result at once
+    char *name = strdup((path(key) + ".XXXXXX").c_str());
+    int fd = mkstemp(name);
+
+    if (fd < 0) {
+        log_perror("mkstemp for result");
+    } else {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        tmp_file = name;
+    }
+
+    free(name);
+    return fd;
+}
+
+void ResultCache::commit(const string &key, const string &tmp_file, size_t size)
+{
+    if (rename(tmp_file.c_str(), path(key).c_str()) != 0) {
+        log_perror("rename of result");
+        unlink(tmp_file.c_str());
+        return;
+    }
+
+    map<string, list<Entry>::iterator>::iterator it = entries.find(key);
+
+    if (it != entries.end()) {
+        total -= it->second->size;
+        order.erase(it->second);
+        entries.erase(it);
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.size = size;
+    order.push_front(entry);
+    entries[key] = order.begin();
+    total += size;
+
+    /* Files being sent stay open, so removing them doesn't hurt.  */
+    while (total > limit && order.size() > 1) {
+        Entry &oldest = order.back();
+        trace() << "removing result " << oldest.key << endl;
+        unlink(path(oldest.key).c_str());
+        total -= oldest.size;
+        entries.erase(oldest.key);
+        order.pop_back();
+    }
+}
+
+ResultUpload::ResultUpload(ResultCache &_cache, const string &_key)
+    : part(RESULT)
+    , cache(_cache)
+    , key(_key)
+    , out_len(0)
+    , err_len(0)
+    , obj_len(0)
+    , dwo_len(0)
+    , have_dwo(false)
+{
+    fd = cache.create(key, tmp_file);
+
+    if (fd >= 0 && lseek(fd, sizeof(ResultHeader), SEEK_SET) < 0) {
+        close(fd);
+        fd = -1;
+        unlink(tmp_file.c_str());
+    }
+}
+
+ResultUpload::~ResultUpload()
+{
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp_file.c_str());
+    }
+}
+
+bool ResultUpload::write_data(const void *data, size_t len)
+{
+    const char *buf = static_cast<const char *>(data);
+
+    while (len) {
+        ssize_t bytes = write(fd, buf, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            log_perror("write of result");
+            return false;
+        }
+
+        buf += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+bool ResultUpload::finish()
+{
+    ResultHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = RESULT_MAGIC;
+    header.have_dwo = have_dwo;
+    header.out_len = out_len;
+    header.err_len = err_len;
+    header.obj_len = obj_len;
+    header.dwo_len = dwo_len;
+
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || close(fd) != 0) {
+        log_perror("write of result header");
+        return false;
+    }
+
+    fd = -1;
+    cache.commit(key, tmp_file, sizeof(header) + out_len + err_len + obj_len + dwo_len);
+    trace() << "stored result " << key << endl;
+    return true;
+}
+
+bool ResultUpload::handle(Msg *msg, bool &done)
+{
+    done = false;
+
+    if (fd < 0) {
+        return false;
+    }
+
+    switch (part) {
+    case RESULT: {
+        CompileResultMsg *rmsg = dynamic_cast<CompileResultMsg *>(msg);
+
+        // only what compiled is worth keeping
+        if (!rmsg || rmsg->status != 0 || rmsg->was_out_of_memory) {
+            return false;
+        }
+
+        out_len = rmsg->out.size();
+        err_len = rmsg->err.size();
+        have_dwo = rmsg->have_dwo_file;
+        part = OBJECT;
+        return write_data(rmsg->out.data(), out_len) && write_data(rmsg->err.data(), err_len);
+    }
+    case OBJECT:
+    case DWO:
+        if (msg->type == M_FILE_CHUNK) {
+            FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+            (part == OBJECT ? obj_len : dwo_len) += fcmsg->len;
+            return write_data(fcmsg->buffer, fcmsg->len);
+        }
+
+        if (msg->type != M_END) {
+            return false;
+        }
+
+        if (part == OBJECT && have_dwo) {
+            part = DWO;
+            return true;
+        }
+
+        done = true;
+        return finish();
+    }
+
+    return false;
+}
+
+/* Sends LEN bytes from FD as file chunks, or all up to the end of FD with
+   a LEN of -1, followed by EndMsg.  */
+static bool send_chunks(int fd, uint64_t len, MsgChannel *c)
+{
+    unsigned char buffer[100000];
+
+    while (len) {
+        ssize_t bytes = read(fd, buffer, min<uint64_t>(len, sizeof(buffer)));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes < 0) {
+            return false;
+        }
+
+        if (bytes == 0) {
+            if (len != uint64_t(-1)) {
+                return false;
+            }
+
+            break;
+        }
+
+        if (!c->send_msg(FileChunkMsg(buffer, bytes))) {
+            return false;
+        }
+
+        if (len != uint64_t(-1)) {
+            len -= bytes;
+        }
+    }
+
+    return c->send_msg(EndMsg());
+}
+
+static bool read_string(int fd, uint32_t len, string &s)
+{
+    s.resize(len);
+    return len == 0 || read(fd, &s[0], len) == (ssize_t) len;
+}
+
+pid_t start_send_result(const string &file, MsgChannel *c)
+{
+    /* Opened here, so it can't be removed before the child got it.  */
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        log_perror(("open of result " + file).c_str());
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid) {
+        close(fd);
+
+        if (pid < 0) {
+            log_perror("fork");
+            return 0;
+        }
+
+        return pid;
+    }
+
+    reset_debug(0);
+
+    ResultHeader header;
+    CompileResultMsg rmsg;
+
+    if (read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) || header.magic != RESULT_MAGIC
+            || !read_string(fd, header.out_len, rmsg.out) || !read_string(fd, header.err_len, rmsg.err)) {
+        c->send_msg(EndMsg());
+        _exit(1);
+    }
+
+    rmsg.have_dwo_file = header.have_dwo;
+
+    bool ok = c->send_msg(rmsg) && send_chunks(fd, header.obj_len, c)
+              && (!header.have_dwo || send_chunks(fd, header.dwo_len, c));
+
+    _exit(ok ? 0 : 1);
+}
+
+static MsgChannel *connect_owner(const ResultRing &owners, const string &key)
+{
+    string host;
+    unsigned int port;
+
+    if (!owners.owner(key, host, port)) {
+        return 0;
+    }
+
+    MsgChannel *c = Service::createChannel(host, port, OWNER_CONNECT_TIMEOUT);
+
+    if (!c) {
+        log_warning() << "can't reach " << host << ":" << port << " for result " << key << endl;
+    }
+
+    return c;
+}
+
+bool fetch_result(JobResult &result, CompileResultMsg &rmsg)
+{
+    MsgChannel *c = connect_owner(result.owners, result.key);
+
+    if (!c) {
+        return false;
+    }
+
+    Msg *msg = 0;
+
+    if (c->send_msg(GetResultMsg(result.key))) {
+        msg = c->get_msg(OWNER_TIMEOUT);
+    }
+
+    CompileResultMsg *cached = dynamic_cast<CompileResultMsg *>(msg);
+
+    if (!cached) {
+        delete msg;
+        delete c;
+        return false;
+    }
+
+    rmsg.status = cached->status;
+    rmsg.out = cached->out;
+    rmsg.err = cached->err;
+    rmsg.was_out_of_memory = false;
+    rmsg.have_dwo_file = cached->have_dwo_file;
+    delete msg;
+
+    trace() << "result " << result.key << " is stored already" << endl;
+    result.cached = c;
+    return true;
+}
+
+static bool forward_chunks(MsgChannel *from, MsgChannel *to)
+{
+    for (;;) {
+        Msg *msg = from->get_msg(OWNER_TIMEOUT);
+
+        if (!msg || (msg->type != M_FILE_CHUNK && msg->type != M_END)) {
+            delete msg;
+            return false;
+        }
+
+        bool ok = to->send_msg(*msg);
+        bool end = msg->type == M_END;
+        delete msg;
+
+        if (!ok || end) {
+            return ok;
+        }
+    }
+}
+
+bool forward_result(JobResult &result, MsgChannel *client, bool have_dwo)
+{
+    bool ok = forward_chunks(result.cached, client)
+              && (!have_dwo || forward_chunks(result.cached, client));
+
+    delete result.cached;
+    result.cached = 0;
+    return ok;
+}
+
+static bool send_file(const string &file, MsgChannel *c)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = send_chunks(fd, uint64_t(-1), c);
+    close(fd);
+    return ok;
+}
+
+void store_result(const JobResult &result, const CompileResultMsg &rmsg,
+                  const string &obj_file, const string &dwo_file)
+{
+    MsgChannel *c = connect_owner(result.owners, result.key);
+
+    if (!c) {
+        return;
+    }
+
+    if (!c->send_msg(PutResultMsg(result.key)) || !c->send_msg(rmsg) || !send_file(obj_file, c)
+            || (rmsg.have_dwo_file && !send_file(dwo_file, c))) {
+        log_warning() << "failed to store result " << result.key << endl;
+    }
+
+    delete c;
+}
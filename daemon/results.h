@@ -0,0 +1,132 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_RESULTS_H
+#define ICECREAM_RESULTS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "resultkey.h"
+
+class CompileResultMsg;
+class MsgChannel;
+class Msg;
+
+/* Results of jobs the daemon owns by their key (see ResultRing), one file
+   each, from the most recently used to the least.  The least recently used
+   ones are removed when they take more than the limit.  */
+class ResultCache
+{
+public:
+    ResultCache()
+        : limit(0)
+        , total(0) {}
+
+    // keeps results in DIR, up to LIMIT bytes; false if DIR can't be used
+    bool setup(const std::string &dir, size_t limit);
+
+    bool enabled() const
+    {
+        return limit > 0;
+    }
+
+    // the file the result of KEY is in, empty if there is none
+    std::string lookup(const std::string &key);
+
+    // a new file for the result of KEY, put in place with commit()
+    int create(const std::string &key, std::string &tmp_file);
+    void commit(const std::string &key, const std::string &tmp_file, size_t size);
+
+private:
+    std::string path(const std::string &key) const;
+
+    struct Entry {
+        std::string key;
+        size_t size;
+    };
+
+    std::string dir;
+    size_t limit;
+    size_t total;
+    std::list<Entry> order;
+    std::map<std::string, std::list<Entry>::iterator> entries;
+};
+
+/* A result another daemon stores here, as it arrives after PutResultMsg.  */
+class ResultUpload
+{
+public:
+    ResultUpload(ResultCache &cache, const std::string &key);
+    ~ResultUpload();
+
+    // takes the next message of the upload, false if it failed; DONE is
+    // set once the result is stored
+    bool handle(Msg *msg, bool &done);
+
+private:
+    bool write_data(const void *data, size_t len);
+    bool finish();
+
+    enum { RESULT, OBJECT, DWO } part;
+    ResultCache &cache;
+    std::string key;
+    std::string tmp_file;
+    int fd;
+    uint32_t out_len, err_len;
+    uint64_t obj_len, dwo_len;
+    bool have_dwo;
+};
+
+// sends the result stored in FILE to C in a child, returns its pid or 0
+pid_t start_send_result(const std::string &file, MsgChannel *c);
+
+/* The result cache from a job process.  */
+struct JobResult {
+    JobResult(const ResultRing &_owners, const CompileJob &job)
+        : owners(_owners)
+        , inputs(job)
+        , cached(0) {}
+
+    const ResultRing &owners;
+    // the key of JOB, what the client sends is added as it comes
+    ResultKey inputs;
+    // the key of the result once the client asked for it with ResultKeyMsg
+    // and came to the same one, empty otherwise
+    std::string key;
+    // the owner has the result, the files follow on this channel
+    MsgChannel *cached;
+};
+
+// asks the owner of RESULT's key for the result, setting RESULT.cached and
+// RMSG if it has it
+bool fetch_result(JobResult &result, CompileResultMsg &rmsg);
+// sends the files of the fetched result on to CLIENT
+bool forward_result(JobResult &result, MsgChannel *client, bool have_dwo);
+// gives the result of a job that compiled to the owner of RESULT's key
+void store_result(const JobResult &result, const CompileResultMsg &rmsg,
+                  const std::string &obj_file, const std::string &dwo_file);
+
+#endif
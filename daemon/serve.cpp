@@ -32,7 +32,10 @@
 #include <errno.h>
 #include <signal.h>
 #include <cassert>
+#include <dirent.h>
+#include <vector>
 
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -40,6 +43,9 @@
 #  include <sys/signal.h>
 #endif /* HAVE_SYS_SIGNAL_H */
 #include <sys/param.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <job.h>
@@ -47,10 +53,14 @@
 
 #include "environment.h"
 #include "exitcode.h"
+#include "headers.h"
 #include "tempfile.h"
 #include "workit.h"
+#include "phases.h"
 #include "logging.h"
 #include "serve.h"
+#include "results.h"
+#include "dicts.h"
 #include "util.h"
 #include "file_util.h"
 
@@ -69,6 +79,9 @@
 #define _PATH_TMP "/tmp"
 #endif
 
+// seconds a worker waits for its next job before it ends on its own
+#define MAX_WORKER_WAIT 300
+
 using namespace std;
 
 int nice_level = 5;
@@ -81,7 +94,7 @@ error_client(MsgChannel *client, string error)
     }
 }
 
-static void write_output_file( const string& file, MsgChannel* client )
+static void write_output_file( const string& file, MsgChannel* client, bool raw_output )
 {
     int obj_fd = -1;
     try {
@@ -93,6 +106,25 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
+        if (raw_output) {
+            /* The client preallocates the whole file from the size
+               announced by FileRawMsg and reads directly into it.  */
+            struct stat st;
+
+            if (fstat(obj_fd, &st) != 0 || !client->send_raw_file(obj_fd, st.st_size)) {
+                log_info() << "write of raw obj failed " << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            if (!client->send_msg(EndMsg())) {
+                log_info() << "write of obj end failed " << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            close(obj_fd);
+            return;
+        }
+
         unsigned char buffer[100000];
 
         do {
@@ -111,6 +143,7 @@ static void write_output_file( const string& file, MsgChannel* client )
                     log_info() << "write of obj end failed " << endl;
                     throw myexception(EXIT_DISTCC_FAILED);
                 }
+                trace() << "sent " << file << " (" << client->compressionMode() << ")" << endl;
                 break;
             }
 
@@ -129,66 +162,343 @@ static void write_output_file( const string& file, MsgChannel* client )
     }
 }
 
-/**
- * Read a request, run the compiler, and send a response.
- **/
-int handle_connection(const string &basedir, CompileJob *job,
-                      MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+/* Sends OBJ_FILE and DWO_FILE at once, a chunk of each in turn, so the
+   client has the smaller one complete without waiting for the other.  */
+static void write_output_files(const string &obj_file, const string &dwo_file,
+                               MsgChannel *client)
 {
-    int socket[2];
+    const string files[OutputChunkMsg::OUTPUT_FILES] = { obj_file, dwo_file };
+    int fds[OutputChunkMsg::OUTPUT_FILES] = { -1, -1 };
+    static unsigned char buffer[100000];
 
-    if (pipe(socket) == -1) {
-        return -1;
+    try {
+        for (int i = 0; i < OutputChunkMsg::OUTPUT_FILES; ++i) {
+            fds[i] = open(files[i].c_str(), O_RDONLY | O_LARGEFILE);
+
+            if (fds[i] == -1) {
+                log_error() << "open failed" << endl;
+                error_client(client, "open of object file failed");
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+        }
+
+        int open_files = OutputChunkMsg::OUTPUT_FILES;
+
+        while (open_files) {
+            for (int i = 0; i < OutputChunkMsg::OUTPUT_FILES; ++i) {
+                if (fds[i] == -1) {
+                    continue;
+                }
+
+                ssize_t bytes;
+
+                while ((bytes = read(fds[i], buffer, sizeof(buffer))) < 0 && errno == EINTR) {}
+
+                if (bytes < 0) {
+                    throw myexception(EXIT_DISTCC_FAILED);
+                }
+
+                // the empty chunk ends the file
+                if (!client->send_msg(OutputChunkMsg(i, buffer, bytes))) {
+                    log_info() << "write of output chunk failed " << bytes << endl;
+                    throw myexception(EXIT_DISTCC_FAILED);
+                }
+
+                if (!bytes) {
+                    close(fds[i]);
+                    fds[i] = -1;
+                    open_files--;
+                }
+            }
+        }
+
+        trace() << "sent " << obj_file << " and " << dwo_file << " ("
+                << client->compressionMode() << ")" << endl;
+    } catch (...) {
+        for (int i = 0; i < OutputChunkMsg::OUTPUT_FILES; ++i) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+
+        throw;
+    }
+}
+
+static unsigned int elapsed_msec(const struct timeval &since)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_usec - since.tv_usec) / 1000;
+}
+
+static void strip_prefix(string &text, const string &prefix)
+{
+    for (string::size_type pos = text.find(prefix); pos != string::npos; pos = text.find(prefix, pos)) {
+        text.erase(pos, prefix.size());
+    }
+}
+
+/* Reads what the command prints to OUT_FD and ERR_FD until it closes
+   both.  */
+static void read_command_output(int out_fd, int err_fd, string &out, string &err)
+{
+    int fds[] = { out_fd, err_fd };
+    string *texts[] = { &out, &err };
+    char buffer[4096];
+
+    while (fds[0] >= 0 || fds[1] >= 0) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i] >= 0) {
+                FD_SET(fds[i], &read_set);
+            }
+        }
+
+        if (select(std::max(fds[0], fds[1]) + 1, &read_set, 0, 0, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i] < 0 || !FD_ISSET(fds[i], &read_set)) {
+                continue;
+            }
+
+            ssize_t bytes = read(fds[i], buffer, sizeof(buffer));
+
+            if (bytes > 0) {
+                texts[i]->append(buffer, bytes);
+            } else if (bytes == 0 || errno != EINTR) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
     }
 
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+/* Runs the command of JOB in WORK_DIR, with what it prints going to RMSG.
+   Returns its exit status.  */
+static int run_command(const CompileJob &job, const string &work_dir, unsigned int mem_limit,
+                       CompileResultMsg &rmsg, unsigned int job_stat[])
+{
+    list<string> args = job.remoteFlags();
+    appendList(args, job.restFlags());
+    args.push_front(job.compilerName());
+    int out_pipe[2];
+    int err_pipe[2];
+
+    if (pipe(out_pipe)) {
+        return EXIT_DISTCC_FAILED;
+    }
+
+    if (pipe(err_pipe)) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return EXIT_DISTCC_FAILED;
+    }
+
+    struct timeval start;
+    gettimeofday(&start, 0);
     flush_debug();
     pid_t pid = fork();
-    assert(pid >= 0);
 
-    if (pid > 0) {  // parent
-        close(socket[1]);
-        out_fd = socket[0];
-        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
-        return pid;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+
+        if (null_fd < 0 || chdir(work_dir.c_str()) != 0 || dup2(null_fd, STDIN_FILENO) < 0
+                || dup2(out_pipe[1], STDOUT_FILENO) < 0 || dup2(err_pipe[1], STDERR_FILENO) < 0) {
+            _exit(EXIT_DISTCC_FAILED);
+        }
+
+#ifdef RLIMIT_AS
+        if (mem_limit) {
+            struct rlimit rlim;
+            rlim.rlim_cur = rlim.rlim_max = rlim_t(mem_limit) * 1024 * 1024;
+            setrlimit(RLIMIT_AS, &rlim);
+        }
+#endif
+
+        char **argv = new char*[args.size() + 1];
+        int i = 0;
+
+        for (list<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+            argv[i++] = strdup(it->c_str());
+        }
+
+        argv[i] = 0;
+        execvp(argv[0], argv);
+        // what the shell says for a command it doesn't find
+        _exit(127);
     }
 
-    reset_debug(0);
-    close(socket[0]);
-    out_fd = socket[1];
+    close(out_pipe[1]);
+    close(err_pipe[1]);
 
-    /* internal communication channel, don't inherit to gcc */
-    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+    if (pid < 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return EXIT_DISTCC_FAILED;
+    }
 
-    errno = 0;
-    int niceval = nice(nice_level);
-    (void) niceval;
-    if (errno != 0) {
-        log_warning() << "failed to set nice value: " << strerror(errno)
-                      << endl;
+    read_command_output(out_pipe[0], err_pipe[0], rmsg.out, rmsg.err);
+    int status = 0;
+    struct rusage ru;
+
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            return EXIT_DISTCC_FAILED;
+        }
     }
 
-    Msg *msg = 0; // The current read message
-    unsigned int job_id = 0;
-    string tmp_path, obj_file, dwo_file;
+    job_stat[JobStatistics::real_msec] = elapsed_msec(start);
+    job_stat[JobStatistics::user_msec] = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+    job_stat[JobStatistics::sys_msec] = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
+    job_stat[JobStatistics::max_rss_kb] = ru.ru_maxrss;
+    return shell_exit_status(status);
+}
+
+/* Runs the command of icerun JOB, see remote_command() of the client: its
+   inputs go below a temporary directory where the working directory of the
+   client is mirrored, it runs there and its outputs are sent back after the
+   result.  Takes JOB and CLIENT like serve_job().  */
+static int serve_command(CompileJob *job, MsgChannel *client, int out_fd,
+                         unsigned int mem_limit)
+{
+    unsigned int job_stat[JobStatistics::count];
+    memset(job_stat, 0, sizeof(job_stat));
+    list<string> outputs = job->commandOutputs();
+    string tmp_path;
+    int ret = EXIT_DISTCC_FAILED;
 
     try {
-        if (job->environmentVersion().size()) {
-            string dirname = basedir + "/target=" + job->targetPlatform() + "/" + job->environmentVersion();
+        char *tmp_output = 0;
 
-            if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
-                error_client(client, dirname + "/usr/bin/as is not executable");
-                log_error() << "I don't have environment " << job->environmentVersion() << "(" << job->targetPlatform() << ") " << job->jobID() << endl;
-                throw myexception(EXIT_DISTCC_FAILED);   // the scheduler didn't listen to us!
+        if (dcc_make_tmpdir(&tmp_output) != 0) {
+            error_client(client, "could not create a directory for the command");
+            throw myexception(EXIT_IO_ERROR);
+        }
+
+        tmp_path = tmp_output;
+        free(tmp_output);
+        string work_dir = tmp_path + job->workingDirectory();
+
+        for (list<string>::iterator it = outputs.begin(); it != outputs.end(); ++it) {
+            *it = work_dir + '/' + *it;
+
+            if (!mkpath(it->substr(0, it->find_last_of('/')))) {
+                error_client(client, "could not create the output directories of the command");
+                throw myexception(EXIT_IO_ERROR);
             }
+        }
 
-            chdir_to_environment(client, dirname, user_uid, user_gid);
-        } else {
-            error_client(client, "empty environment");
-            log_error() << "Empty environment (" << job->targetPlatform() << ") " << job->jobID() << endl;
+        if (!mkpath(work_dir) || !receive_inputs(*job, client, tmp_path, job_stat)) {
+            error_client(client, "could not get the inputs of the command");
+            throw myexception(EXIT_IO_ERROR);
+        }
+
+        Msg *msg = client->get_msg(60);
+        bool ended = msg && msg->type == M_END;
+        delete msg;
+
+        if (!ended) {
+            log_error() << "no end of the command " << job->jobID() << endl;
+            throw myexception(EXIT_PROTOCOL_ERROR);
+        }
+
+        CompileResultMsg rmsg;
+        rmsg.status = run_command(*job, work_dir, mem_limit, rmsg, job_stat);
+        rmsg.have_dwo_file = false;
+        strip_prefix(rmsg.out, tmp_path);
+        strip_prefix(rmsg.err, tmp_path);
+
+        for (list<string>::const_iterator it = outputs.begin(); it != outputs.end() && !rmsg.status; ++it) {
+            struct stat st;
+
+            if (stat(it->c_str(), &st) != 0) {
+                rmsg.err += "icerun: " + it->substr(work_dir.size() + 1) + " was not written\n";
+                rmsg.status = EXIT_DISTCC_FAILED;
+            } else {
+                job_stat[JobStatistics::out_uncompressed] += st.st_size;
+            }
+        }
+
+        job_stat[JobStatistics::exit_code] = rmsg.status;
+        job_stat[JobStatistics::rtt_usec] = client->rtt_usec();
+
+        if (!client->send_msg(rmsg)) {
+            log_info() << "write of command result failed" << endl;
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
+        ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
+        close(out_fd);
+        out_fd = -1;
+
+        if (rmsg.status == 0) {
+            log_block b("send outputs");
+
+            for (list<string>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+                write_output_file(*it, client, false);
+            }
+        }
+
+        ret = rmsg.status;
+    } catch (const myexception &e) {
+        ret = e.exitcode();
+    }
+
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+
+    if (!tmp_path.empty()) {
+        rmpath(tmp_path.c_str());
+    }
+
+    delete client;
+    delete job;
+    return ret;
+}
+
+/* Runs JOB in the environment entered already: reads the input from
+   CLIENT, compiles it and sends the result back.  The statistics go
+   to OUT_FD once the compiler is done.  Results are looked up and stored
+   with the daemons in OWNERS.  With REMOTE_CPP the source is preprocessed
+   here, see HeaderManifestMsg, with PCH the precompiled header comes
+   first, with CHUNKED the source comes as ChunkManifestMsg.  Takes JOB and
+   CLIENT, returns the exit code of the job.  */
+static int serve_job(CompileJob *job, MsgChannel *client, int out_fd,
+                     unsigned int mem_limit, bool raw_output, bool stream_output,
+                     bool remote_cpp, bool pch, bool interleaved_output, bool chunked,
+                     const ResultRing &owners)
+{
+    Msg *msg = 0; // The current read message
+    unsigned int job_id = 0;
+    string tmp_path, obj_file, dwo_file;
+    int stream_fd = -1; // reading the FIFO the object file is written to
+    int stream_writer = -1;
+    string input; // the source of a chunked job
+
+    // the results go ahead of the environments others are sent
+    client->setTrafficClass(TC_INTERACTIVE);
+
+    if (job->language() == CompileJob::Lang_Custom) {
+        return serve_command(job, client, out_fd, mem_limit);
+    }
+
+    try {
         if (::access(_PATH_TMP + 1, W_OK)) {
             error_client(client, "can't write to " _PATH_TMP);
             log_error() << "can't write into " << _PATH_TMP << " " << strerror(errno) << endl;
@@ -196,9 +506,13 @@ int handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[JobStatistics::count];
         CompileResultMsg rmsg;
+        struct timeval start;
+        gettimeofday(&start, 0);
+        JobResult result(owners, *job);
         job_id = job->jobID();
+        trace_job_id = job_id;
 
         memset(job_stat, 0, sizeof(job_stat));
 
@@ -206,7 +520,8 @@ int handle_connection(const string &basedir, CompileJob *job,
         char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
         sprintf(prefix_output, "icecc-%d", job_id);
 
-        if (job->dwarfFissionEnabled() && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
+        /* A job preprocessed here has its files in the same tree.  */
+        if ((job->dwarfFissionEnabled() || remote_cpp || pch) && (ret = dcc_make_tmpdir(&tmp_output)) == 0) {
             tmp_path = tmp_output;
             free(tmp_output);
 
@@ -257,7 +572,36 @@ int handle_connection(const string &basedir, CompileJob *job,
             obj_file = output_dir + '/' + file_name;
             dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1);
+            RemoteCpp cpp;
+            cpp.root = tmp_path;
+
+            if (pch || remote_cpp) {
+                log_block b("receive headers");
+
+                if (pch && !receive_pch(*job, client, tmp_path, job_stat, &result.inputs)) {
+                    error_client(client, "could not get the precompiled header of the job");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+
+                if (remote_cpp && !receive_headers(*job, client, cpp, job_stat, &result.inputs)) {
+                    error_client(client, "could not get the headers of the job");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+            }
+
+            if (chunked && !receive_chunks(*job, client, input, job_stat)) {
+                error_client(client, "could not get the chunks of the source");
+                throw myexception(EXIT_IO_ERROR);
+            }
+
+            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1,
+                          -1, &result, remote_cpp ? &cpp : 0, chunked ? &input : 0);
+
+            /* The paths the compiler saw are not the ones the user knows.  */
+            if (remote_cpp || pch) {
+                strip_prefix(rmsg.out, tmp_path);
+                strip_prefix(rmsg.err, tmp_path);
+            }
         }
         else if ((ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
             obj_file = tmp_output;
@@ -265,7 +609,38 @@ int handle_connection(const string &basedir, CompileJob *job,
             string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
             string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1);
+            /* GNU as seeks in its output, but clang's integrated assembler
+               can write to a pipe, where it's sent from while it writes.
+               Opening a write end ourselves lets the reader open without
+               waiting and not see EOF before the compiler opened it.  */
+            if (stream_output && job->compilerName().find("clang") != string::npos
+                    && unlink(obj_file.c_str()) == 0 && mkfifo(obj_file.c_str(), 0600) == 0) {
+                stream_fd = open(obj_file.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+                stream_writer = open(obj_file.c_str(), O_WRONLY | O_CLOEXEC);
+
+                if (stream_fd < 0 || stream_writer < 0) {
+                    log_perror("open of output FIFO failed");
+                    throw myexception(EXIT_IO_ERROR);
+                }
+            }
+
+            if (chunked && !receive_chunks(*job, client, input, job_stat)) {
+                error_client(client, "could not get the chunks of the source");
+                throw myexception(EXIT_IO_ERROR);
+            }
+
+            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1,
+                          stream_fd, &result, 0, chunked ? &input : 0);
+        }
+
+        job_stat[JobStatistics::rtt_usec] = client->rtt_usec();
+
+        if (!ret && !result.cached) {
+            unsigned int real_msec = job_stat[JobStatistics::real_msec];
+            unsigned int in_msec = job_stat[JobStatistics::in_msec];
+            count_phase(PHASE_SETUP, std::max(int(elapsed_msec(start) - real_msec), 0));
+            count_phase(PHASE_INPUT, in_msec);
+            count_phase(PHASE_COMPILE, real_msec > in_msec ? real_msec - in_msec : 0);
         }
 
         if (ret) {
@@ -283,7 +658,21 @@ int handle_connection(const string &basedir, CompileJob *job,
 
         struct stat st;
 
-        if (!stat(obj_file.c_str(), &st)) {
+        /* A stored result isn't what this host compiled, so it doesn't
+           count for its speed.  */
+        if (result.cached) {
+            ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
+            close(out_fd);
+
+            if (!forward_result(result, client, rmsg.have_dwo_file)) {
+                log_info() << "write of stored result failed" << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            throw myexception(rmsg.status);
+        }
+
+        if (stream_fd < 0 && !stat(obj_file.c_str(), &st)) {
             job_stat[JobStatistics::out_uncompressed] += st.st_size;
         }
         if (!stat(dwo_file.c_str(), &st)) {
@@ -295,10 +684,29 @@ int handle_connection(const string &basedir, CompileJob *job,
         ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
         close(out_fd);
 
-        if (rmsg.status == 0) {
-            write_output_file(obj_file, client);
-            if (rmsg.have_dwo_file) {
-                write_output_file(dwo_file, client);
+        if (rmsg.status == 0 && stream_fd >= 0) {
+            if (!client->send_msg(EndMsg())) {
+                log_info() << "write of streamed obj end failed " << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+        } else if (rmsg.status == 0) {
+            log_block b("send result");
+            struct timeval send_start;
+            gettimeofday(&send_start, 0);
+            if (rmsg.have_dwo_file && interleaved_output && !raw_output) {
+                write_output_files(obj_file, dwo_file, client);
+            } else {
+                write_output_file(obj_file, client, raw_output);
+                if (rmsg.have_dwo_file) {
+                    write_output_file(dwo_file, client, raw_output);
+                }
+            }
+
+            count_phase(PHASE_OUTPUT, elapsed_msec(send_start));
+
+            // the client has its result, others may profit from it later
+            if (!result.key.empty() && !owners.empty() && !rmsg.was_out_of_memory) {
+                store_result(result, rmsg, obj_file, dwo_file);
             }
         }
 
@@ -308,6 +716,13 @@ int handle_connection(const string &basedir, CompileJob *job,
         delete client;
         client = 0;
 
+        if (stream_fd >= 0) {
+            close(stream_fd);
+        }
+        if (stream_writer >= 0) {
+            close(stream_writer);
+        }
+
         if (!obj_file.empty()) {
             unlink(obj_file.c_str());
         }
@@ -321,6 +736,204 @@ int handle_connection(const string &basedir, CompileJob *job,
         delete msg;
         delete job;
 
+        // the client is served, a dictionary can take its time now
+        train_dict();
+        return e.exitcode();
+    }
+}
+
+/**
+ * Read a request, run the compiler, and send a response.
+ **/
+int handle_connection(const string &basedir, CompileJob *job,
+                      MsgChannel *client, int &out_fd,
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      bool raw_output, bool stream_output, bool remote_cpp, bool pch,
+                      bool interleaved_output, bool chunked, const ResultRing &owners)
+{
+    int socket[2];
+
+    if (pipe(socket) == -1) {
+        return -1;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid > 0) {  // parent
+        close(socket[1]);
+        out_fd = socket[0];
+        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+        return pid;
+    }
+
+    reset_debug(0);
+    close(socket[0]);
+    out_fd = socket[1];
+
+    /* internal communication channel, don't inherit to gcc */
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+
+    errno = 0;
+    int niceval = nice(nice_level);
+    (void) niceval;
+    if (errno != 0) {
+        log_warning() << "failed to set nice value: " << strerror(errno)
+                      << endl;
+    }
+
+    try {
+        if (job->environmentVersion().size()) {
+            string dirname = basedir + "/target=" + job->targetPlatform() + "/" + job->environmentVersion();
+
+            if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
+                error_client(client, dirname + "/usr/bin/as is not executable");
+                log_error() << "I don't have environment " << job->environmentVersion() << "(" << job->targetPlatform() << ") " << job->jobID() << endl;
+                throw myexception(EXIT_DISTCC_FAILED);   // the scheduler didn't listen to us!
+            }
+
+            chdir_to_environment(client, dirname, user_uid, user_gid);
+        } else {
+            error_client(client, "empty environment");
+            log_error() << "Empty environment (" << job->targetPlatform() << ") " << job->jobID() << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
+        }
+    } catch (const myexception &e) {
+        delete client;
+        delete job;
         _exit(e.exitcode());
     }
+
+    _exit(serve_job(job, client, out_fd, mem_limit, raw_output, stream_output, remote_cpp, pch,
+                    interleaved_output, chunked, owners));
+}
+
+void close_other_fds(int keep_fd)
+{
+    vector<int> fds;
+    DIR *dir = opendir("/proc/self/fd");
+
+    if (dir) {
+        while (struct dirent *ent = readdir(dir)) {
+            if (ent->d_name[0] != '.') {
+                fds.push_back(atoi(ent->d_name));
+            }
+        }
+
+        closedir(dir);
+    } else {
+        for (int fd = 0; fd < FD_SETSIZE; ++fd) {
+            fds.push_back(fd);
+        }
+    }
+
+    for (vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (*it > 2 && *it != keep_fd && *it != trace_fd) {
+            close(*it);
+        }
+    }
+}
+
+/* A job process kept for the jobs in the environment at DIRNAME, see
+   WorkerPool.  It enters the environment once and then runs the jobs the
+   daemon sends over CONTROL_FD one after the other, answering each with
+   EndMsg when it is ready for the next.  */
+void serve_worker(const string &dirname, int control_fd, uid_t user_uid, gid_t user_gid)
+{
+    /* Unlike a job process it outlives the connections the daemon has
+       open now, keeping them would hide that they were closed.  */
+    close_other_fds(control_fd);
+    reset_debug(0);
+
+    errno = 0;
+    int niceval = nice(nice_level);
+    (void) niceval;
+    if (errno != 0) {
+        log_warning() << "failed to set nice value: " << strerror(errno)
+                      << endl;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    MsgChannel *control = Service::createChannel(control_fd, (struct sockaddr *) &addr, sizeof(addr));
+
+    if (!control) {
+        _exit(EXIT_DISTCC_FAILED);
+    }
+
+    if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
+        log_error() << dirname << "/usr/bin/as is not executable" << endl;
+        _exit(EXIT_DISTCC_FAILED);
+    }
+
+    chdir_to_environment(control, dirname, user_uid, user_gid);
+
+    for (;;) {
+        /* The daemon closes the channel to end the worker, this is in
+           case it doesn't.  */
+        Msg *msg = control->get_msg(MAX_WORKER_WAIT);
+        CompileFileMsg *fmsg = dynamic_cast<CompileFileMsg *>(msg);
+
+        if (!fmsg) {
+            delete msg;
+            break;
+        }
+
+        CompileJob *job = fmsg->takeJob();
+        bool raw_output = fmsg->raw_output;
+        bool stream_output = fmsg->stream_output;
+        bool remote_cpp = fmsg->remote_cpp;
+        bool pch = fmsg->pch;
+        bool interleaved_output = fmsg->interleaved_output;
+        bool chunked = fmsg->chunked;
+        delete fmsg;
+
+        msg = control->get_msg(10);
+        WorkerJobMsg *wmsg = dynamic_cast<WorkerJobMsg *>(msg);
+        int client_fd = control->take_fd();
+        int out_fd = control->take_fd();
+        MsgChannel *client = 0;
+
+        if (wmsg && client_fd >= 0 && out_fd >= 0) {
+            client = Service::adoptChannel(client_fd, wmsg->protocol, wmsg->remote_codecs,
+                                           wmsg->unread);
+            client_fd = -1;
+
+            if (client && !wmsg->dict.empty()) {
+                client->setCompressionDict(wmsg->dict, false);
+            }
+        }
+
+        if (!client) {
+            log_error() << "worker got no connection for job " << job->jobID() << endl;
+
+            if (client_fd >= 0) {
+                close(client_fd);
+            }
+
+            if (out_fd >= 0) {
+                close(out_fd);
+            }
+
+            delete job;
+            delete msg;
+            break;
+        }
+
+        ResultRing owners;
+        owners.setMembers(wmsg->result_owners);
+        int ret = serve_job(job, client, out_fd, wmsg->mem_limit, raw_output, stream_output,
+                            remote_cpp, pch, interleaved_output, chunked, owners);
+        trace() << "worker job done: " << ret << endl;
+        delete msg;
+
+        if (!control->send_msg(EndMsg())) {
+            break;
+        }
+    }
+
+    delete control;
+    _exit(0);
 }
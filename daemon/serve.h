@@ -28,11 +28,20 @@
 
 class CompileJob;
 class MsgChannel;
+class ResultRing;
 
 extern int nice_level;
 
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      bool raw_output, bool stream_output, bool remote_cpp, bool pch,
+                      bool interleaved_output, bool chunked, const ResultRing &owners);
+
+void serve_worker(const std::string &dirname, int control_fd, uid_t user_uid, gid_t user_gid);
+
+// in a child of the daemon, closes what it has open apart from stdio,
+// KEEP_FD and the trace file
+void close_other_fds(int keep_fd);
 
 #endif
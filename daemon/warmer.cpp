@@ -0,0 +1,216 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <vector>
+
+#include "warmer.h"
+#include "envcache.h"
+#include "logging.h"
+#include "serve.h"
+#include "util.h"
+
+using namespace std;
+
+// how often the locked environments may change, in seconds
+#define LOCK_UPDATE_INTERVAL 60
+
+/* The binaries of an environment: what is executable and the shared
+   libraries, which is what a job reads each time.  */
+static vector<pair<string, size_t> > *binaries_found = 0;
+
+static int add_binary(const char *path, const struct stat *st, int flag, struct FTW *)
+{
+    if (flag == FTW_F && S_ISREG(st->st_mode) && st->st_size > 0
+            && ((st->st_mode & S_IXUSR) || strstr(path, ".so"))) {
+        binaries_found->push_back(make_pair(string(path), size_t(st->st_size)));
+    }
+
+    return 0;
+}
+
+static vector<pair<string, size_t> > binaries(const string &dir)
+{
+    vector<pair<string, size_t> > result;
+    binaries_found = &result;
+    nftw(dir.c_str(), add_binary, 16, FTW_PHYS);
+    binaries_found = 0;
+    return result;
+}
+
+EnvironmentWarmer::~EnvironmentWarmer()
+{
+    stop();
+}
+
+void EnvironmentWarmer::installed(const string &basedir, const string &env)
+{
+    if (!prefetching) {
+        return;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        if (pid < 0) {
+            log_perror("fork for reading ahead failed");
+        }
+
+        return;    // the daemon reaps it
+    }
+
+    // the connections of the daemon mustn't stay open here
+    close_other_fds(-1);
+    reset_debug(0);
+    ignore_result(nice(19));
+
+    vector<pair<string, size_t> > files = binaries(basedir + "/target=" + env);
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        int fd = open(files[i].first.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+
+    _exit(0);
+}
+
+void EnvironmentWarmer::update(const string &basedir, const EnvironmentCache &cache, time_t now)
+{
+    if (!lock_budget || now - last_update < LOCK_UPDATE_INTERVAL) {
+        return;
+    }
+
+    last_update = now;
+
+    // the most recently used ones that fit, by their installed size
+    set<string> wanted;
+    size_t size = 0;
+
+    for (EnvironmentCache::const_iterator it = cache.begin(); it != cache.end(); ++it) {
+        if (!it->native_key.empty()) {
+            continue;    // a tarball for clients
+        }
+
+        if (size + it->size > lock_budget) {
+            break;
+        }
+
+        size += it->size;
+        wanted.insert(it->name);
+    }
+
+    if (wanted == locked && (locker > 0 || wanted.empty())) {
+        return;
+    }
+
+    stop();
+    locked = wanted;
+
+    if (wanted.empty()) {
+        return;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork for locking environments failed");
+        return;
+    }
+
+    if (pid > 0) {
+        locker = pid;
+        trace() << "locking " << wanted.size() << " environments in memory" << endl;
+        return;
+    }
+
+    close_other_fds(-1);
+    reset_debug(0);
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    size_t budget = lock_budget;
+
+    for (set<string>::const_iterator it = wanted.begin(); it != wanted.end(); ++it) {
+        vector<pair<string, size_t> > files = binaries(basedir + "/target=" + *it);
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            int fd = files[i].second <= budget ? open(files[i].first.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+
+            if (fd < 0) {
+                continue;
+            }
+
+            // the mapping stays after closing, for as long as the process
+            void *map = mmap(0, files[i].second, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (map == MAP_FAILED) {
+                continue;
+            }
+
+            if (mlock(map, files[i].second) < 0) {
+                log_perror("mlock() of an environment failed");
+                munmap(map, files[i].second);
+                _exit(1);
+            }
+
+            budget -= files[i].second;
+        }
+    }
+
+    for (;;) {
+        pause();
+    }
+}
+
+void EnvironmentWarmer::remove(const string &env)
+{
+    if (locked.erase(env)) {
+        stop();
+        last_update = 0;    // lock the others again soon
+    }
+}
+
+void EnvironmentWarmer::stop()
+{
+    if (locker > 0) {
+        kill(locker, SIGTERM);
+        locker = -1;
+    }
+}
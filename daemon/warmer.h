@@ -0,0 +1,75 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_WARMER_H
+#define ICECREAM_WARMER_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <set>
+#include <string>
+
+class EnvironmentCache;
+
+/* Keeps the compilers of the environments in the page cache, so that the
+   first job in one doesn't wait for them to be read from the disk.  A new
+   environment is read ahead in the background, and the binaries of the
+   most recently used ones are locked in memory up to a budget, by a child
+   that maps them and waits.  */
+class EnvironmentWarmer
+{
+public:
+    EnvironmentWarmer()
+        : prefetching(false)
+        , lock_budget(0)
+        , locker(-1)
+        , last_update(0) {}
+    ~EnvironmentWarmer();
+
+    void setPrefetch(bool prefetch)
+    {
+        prefetching = prefetch;
+    }
+
+    // in bytes, 0 locks nothing
+    void setLockBudget(size_t budget)
+    {
+        lock_budget = budget;
+    }
+
+    // ENV (target/version) in BASEDIR was installed
+    void installed(const std::string &basedir, const std::string &env);
+    // locks the most recently used ones of CACHE, if they changed
+    void update(const std::string &basedir, const EnvironmentCache &cache, time_t now);
+    // ENV is about to be removed, it mustn't stay mapped
+    void remove(const std::string &env);
+
+private:
+    void stop();
+
+    bool prefetching;
+    size_t lock_budget;
+    pid_t locker;
+    std::set<std::string> locked;
+    time_t last_update;
+};
+
+#endif
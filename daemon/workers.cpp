@@ -0,0 +1,267 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <comm.h>
+#include <resultkey.h>
+
+#include "workers.h"
+#include "logging.h"
+#include "serve.h"
+
+using namespace std;
+
+// seconds an idle worker is kept
+#define MAX_WORKER_IDLE 60
+// jobs a worker runs before it is replaced
+#define MAX_WORKER_JOBS 100
+
+WorkerPool::~WorkerPool()
+{
+    clear();
+}
+
+pid_t WorkerPool::run(const string &env, const CompileJob &job, MsgChannel *client, int &out_fd,
+                      unsigned int mem_limit, bool raw_output, bool stream_output,
+                      bool remote_cpp, bool pch, bool interleaved_output, bool chunked,
+                      const ResultRing &owners)
+{
+    EnvMap::iterator it = envs.find(env);
+
+    if (it == envs.end()) {
+        return 0;
+    }
+
+    WorkerJobMsg wmsg;
+
+    if (!client->unread_input(wmsg.unread)) {
+        return 0;
+    }
+
+    wmsg.protocol = client->protocol;
+    wmsg.remote_codecs = client->remoteCodecs();
+    wmsg.mem_limit = mem_limit;
+    wmsg.result_owners = owners.members();
+    wmsg.dict = client->compressionDict();
+
+    for (list<Worker>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+        if (w->busy || !w->channel->protocol_ready()) {
+            continue;
+        }
+
+        int socket[2];
+
+        if (pipe(socket) == -1) {
+            return 0;
+        }
+
+        /* The worker only reads the job, it is deleted here.  */
+        CompileFileMsg fmsg(new CompileJob(job), true);
+        fmsg.raw_output = raw_output;
+        fmsg.stream_output = stream_output;
+        fmsg.remote_cpp = remote_cpp;
+        fmsg.pch = pch;
+        fmsg.interleaved_output = interleaved_output;
+        fmsg.chunked = chunked;
+        int fds[2] = { client->fd, socket[1] };
+
+        if (!w->channel->send_msg(fmsg) || !w->channel->send_msg_fds(wmsg, fds, 2)) {
+            log_warning() << "can't pass job " << job.jobID() << " to worker " << w->pid << endl;
+            close(socket[0]);
+            close(socket[1]);
+            delete w->channel;
+            it->second.erase(w);
+            return 0;
+        }
+
+        close(socket[1]);
+        out_fd = socket[0];
+        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+        w->busy = true;
+        w->jobs++;
+        trace() << "job " << job.jobID() << " passed to worker " << w->pid << endl;
+        return w->pid;
+    }
+
+    return 0;
+}
+
+void WorkerPool::refill(const string &basedir, const string &env, uid_t user_uid, gid_t user_gid)
+{
+    if (!per_env || env.find('/') == string::npos) {
+        return;
+    }
+
+    list<Worker> &workers = envs[env];
+
+    while (workers.size() < per_env) {
+        int sockets[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+            log_perror("socketpair() for worker");
+            break;
+        }
+
+        flush_debug();
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            log_perror("fork() for worker");
+            close(sockets[0]);
+            close(sockets[1]);
+            break;
+        }
+
+        if (pid == 0) {
+            serve_worker(basedir + "/target=" + env, sockets[1], user_uid, user_gid);
+        }
+
+        close(sockets[1]);
+
+        /* The worker answers the protocol setup right after the fork.  */
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        MsgChannel *c = Service::createChannel(sockets[0], (struct sockaddr *) &addr, sizeof(addr));
+
+        if (!c) {
+            log_warning() << "worker " << pid << " for " << env << " failed to start" << endl;
+            break;
+        }
+
+        Worker worker;
+        worker.channel = c;
+        worker.pid = pid;
+        worker.busy = false;
+        worker.jobs = 0;
+        worker.since = time(0);
+        workers.push_back(worker);
+        trace() << "worker " << pid << " started for " << env << endl;
+    }
+}
+
+void WorkerPool::add_fds(vector<int> &fds) const
+{
+    for (EnvMap::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        for (list<Worker>::const_iterator w = it->second.begin(); w != it->second.end(); ++w) {
+            fds.push_back(w->channel->fd);
+        }
+    }
+}
+
+void WorkerPool::handle_fd(int fd)
+{
+    for (EnvMap::iterator it = envs.begin(); it != envs.end(); ++it) {
+        for (list<Worker>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+            MsgChannel *channel = w->channel;
+
+            if (channel->fd != fd) {
+                continue;
+            }
+
+            bool ok = channel->read_a_bit() && !channel->at_eof();
+
+            while (ok && channel->has_msg()) {
+                Msg *msg = channel->get_msg(0);
+                ok = w->busy && msg && msg->type == M_END;
+                w->busy = false;
+                w->since = time(0);
+                delete msg;
+            }
+
+            if (ok && w->jobs < MAX_WORKER_JOBS) {
+                return;
+            }
+
+            trace() << "ending worker " << w->pid << " after " << w->jobs << " jobs" << endl;
+            delete channel;
+            it->second.erase(w);
+            return;
+        }
+    }
+}
+
+void WorkerPool::expire(time_t now)
+{
+    for (EnvMap::iterator it = envs.begin(); it != envs.end();) {
+        for (list<Worker>::iterator w = it->second.begin(); w != it->second.end();) {
+            if (!w->busy && now - w->since > MAX_WORKER_IDLE) {
+                delete w->channel;
+                w = it->second.erase(w);
+            } else {
+                ++w;
+            }
+        }
+
+        if (it->second.empty()) {
+            envs.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void WorkerPool::remove(const string &env)
+{
+    EnvMap::iterator it = envs.find(env);
+
+    if (it == envs.end()) {
+        return;
+    }
+
+    /* The busy ones end after their job.  */
+    for (list<Worker>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+        delete w->channel;
+    }
+
+    envs.erase(it);
+}
+
+void WorkerPool::clear()
+{
+    for (EnvMap::iterator it = envs.begin(); it != envs.end(); ++it) {
+        for (list<Worker>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+            delete w->channel;
+        }
+    }
+
+    /* The idle ones end with their channel.  The busy ones are the
+       processes of jobs, those are waited for like the others.  */
+    for (EnvMap::iterator it = envs.begin(); it != envs.end(); ++it) {
+        for (list<Worker>::iterator w = it->second.begin(); w != it->second.end(); ++w) {
+            if (!w->busy) {
+                while (waitpid(w->pid, 0, 0) < 0 && errno == EINTR) {}
+            }
+        }
+    }
+
+    envs.clear();
+}
@@ -0,0 +1,97 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#ifndef ICECREAM_WORKERS_H
+#define ICECREAM_WORKERS_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class CompileJob;
+class MsgChannel;
+class ResultRing;
+
+/* Job processes forked ahead of time for each environment, already in its
+   chroot and running as the compile user (see serve_worker()).  A job only
+   costs them the fork of the compiler, instead of also forking the daemon
+   and entering the environment.  The daemon passes them the client
+   connection over a unix socket.  They are ended after a number of jobs,
+   when not used for a while and when their environment is removed.  */
+class WorkerPool
+{
+public:
+    WorkerPool()
+        : per_env(0) {}
+    ~WorkerPool();
+
+    // workers to keep for each environment, 0 disables the pool
+    void setSize(unsigned int size)
+    {
+        per_env = size;
+    }
+
+    bool enabled() const
+    {
+        return per_env > 0;
+    }
+
+    // hands JOB from CLIENT to an idle worker of ENV (target/version), like
+    // handle_connection() returns the pid with the statistics pipe in
+    // OUT_FD; 0 if there is no idle worker or the channel can't be passed
+    pid_t run(const std::string &env, const CompileJob &job, MsgChannel *client, int &out_fd,
+              unsigned int mem_limit, bool raw_output, bool stream_output,
+              bool remote_cpp, bool pch, bool interleaved_output, bool chunked,
+              const ResultRing &owners);
+    // starts workers in BASEDIR for ENV until there are enough
+    void refill(const std::string &basedir, const std::string &env, uid_t user_uid, gid_t user_gid);
+
+    // the workers have to be watched for the end of their jobs
+    void add_fds(std::vector<int> &fds) const;
+    void handle_fd(int fd);
+    // ends the workers not used for too long
+    void expire(time_t now);
+    // ends the workers of ENV, as it is removed
+    void remove(const std::string &env);
+    // ends them all, waiting for those without a job
+    void clear();
+
+private:
+    struct Worker {
+        MsgChannel *channel;
+        pid_t pid;
+        bool busy;
+        unsigned int jobs;
+        time_t since;
+    };
+
+    typedef std::map<std::string, std::list<Worker> > EnvMap;
+
+    EnvMap envs;
+    unsigned int per_env;
+};
+
+#endif
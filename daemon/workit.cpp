@@ -26,7 +26,10 @@
 #include "tempfile.h"
 #include "assert.h"
 #include "exitcode.h"
+#include "headers.h"
 #include "logging.h"
+#include "results.h"
+#include "dicts.h"
 #include <sys/select.h>
 #include <algorithm>
 
@@ -67,6 +70,8 @@
 using namespace std;
 
 static int death_pipe[2];
+// the process group of the running compiler, it ends with the job process
+static volatile pid_t compiler_pgrp = 0;
 
 extern "C" {
 
@@ -76,6 +81,25 @@ extern "C" {
         ignore_result(write(death_pipe[1], &foo, 1));
     }
 
+    static void theSigTermHandler(int sig)
+    {
+        if (compiler_pgrp > 0) {
+            kill(-compiler_pgrp, SIGTERM);
+        }
+
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+
+}
+
+/* The compiler runs in a process group of its own, so that cc1 and the
+   assembler stop with the driver when the job is cancelled.  */
+static void kill_compiler(pid_t pid)
+{
+    if (kill(-pid, SIGTERM) < 0) {
+        kill(pid, SIGTERM);
+    }
 }
 
 static void
@@ -90,15 +114,60 @@ error_client(MsgChannel *client, string error)
  * This is all happening in a forked child.
  * That means that we can block and be lazy about closing fds
  * (in the error cases which exit quickly).
+ *
+ * If output_fd is given, file_name is a FIFO the compiler writes the object
+ * file to and what it writes is sent to the client right away.
+ *
+ * If result is given, what the client sends is added to result->inputs.
+ * If the key the client sends is the one that comes out and its owner has
+ * the result stored, the compiler is stopped and rmsg is the stored
+ * result, whose files follow on result->cached.
+ *
+ * If cpp is given, the compiler preprocesses cpp->source itself and the
+ * client sends nothing more than EndMsg.
+ *
+ * If input is given, it is the preprocessed source, which the client
+ * doesn't send then (see receive_chunks()).
  */
 
+/* Send what the compiler wrote to the output FIFO so far.  Returns false
+   if the client can't take it.  */
+static bool forward_output(int output_fd, MsgChannel *client, unsigned int job_stat[])
+{
+    static unsigned char buffer[100000];
+
+    for (;;) {
+        ssize_t bytes = read(output_fd, buffer, sizeof(buffer));
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) { // EAGAIN, we hold a write end ourselves
+            return true;
+        }
+
+        job_stat[JobStatistics::out_uncompressed] += bytes;
+
+        if (!client->send_msg(FileChunkMsg(buffer, bytes))) {
+            log_info() << "write of streamed obj chunk failed " << bytes << endl;
+            return false;
+        }
+    }
+}
+
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/)
+            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/, int output_fd,
+            JobResult *result, const RemoteCpp *cpp, const std::string *input)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
 
+    // the input is already on its way, how long it takes tells about the link
+    struct timeval receivetv;
+    gettimeofday(&receivetv, 0);
+
     std::list<string> list = j.remoteFlags();
     appendList(list, j.restFlags());
 
@@ -106,6 +175,10 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         list.push_back("-gsplit-dwarf");
     }
 
+    if (cpp) {
+        appendList(list, cpp->flags);
+    }
+
     int sock_err[2];
     int sock_out[2];
     int sock_in[2];
@@ -170,6 +243,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         return EXIT_OUT_OF_MEMORY;
     } else if (pid == 0) {
 
+        setpgid(0, 0);
         setenv("PATH", "/usr/bin", 1);
 
         // Safety check
@@ -256,7 +330,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup(it->c_str());
         }
 
-        if (!clang) {
+        if (!clang && !cpp) {
             argv[i++] = strdup("-fpreprocessed");
         }
 
@@ -264,7 +338,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup("-pipe");
         }
 
-        argv[i++] = strdup("-");
+        argv[i++] = strdup(cpp ? cpp->source.c_str() : "-");
         argv[i++] = strdup("-o");
         argv[i++] = strdup(file_name.c_str());
 
@@ -281,7 +355,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
         }
 
-        if (!clang && j.dwarfFissionEnabled()) {
+        if (!clang && j.dwarfFissionEnabled() && !cpp) {
             sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
             argv[i++] = strdup(buffer);
         }
@@ -327,6 +401,15 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         _exit(-1);
     }
 
+    // either side may get here first
+    setpgid(pid, pid);
+    compiler_pgrp = pid;
+    act.sa_handler = theSigTermHandler;
+    act.sa_flags = 0;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGTERM, &act, 0);
+    sigaction(SIGINT, &act, 0);
+
     close(sock_in[0]);
     close(sock_out[1]);
     close(sock_err[1]);
@@ -364,17 +447,45 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     // Pending data to send to stdin
     FileChunkMsg *fcmsg = 0;
     size_t off = 0;
+    // what of input went to fcmsg already
+    size_t input_off = 0;
+    // the stored result, if there is one
+    CompileResultMsg cached_rmsg;
+    // for the dictionary of the environment, see DictSample
+    DictSample sample;
+
+    if (!cpp) {
+        sample.open();
+    }
+
+    if (result && input) {
+        result->inputs.add(input->data(), input->size());
+    }
+
+    // the key is final once the client sent it
+    bool keyed = false;
 
     log_block parent_wait("parent, waiting");
 
     for (;;) {
+        /* The buffer stays input's, the message doesn't own it.  */
+        if (input && !fcmsg && sock_in[1] >= 0 && input_off < input->size()) {
+            size_t len = std::min(input->size() - input_off, size_t(100000));
+            fcmsg = new FileChunkMsg((unsigned char *) input->data() + input_off, len);
+            off = 0;
+            input_off += len;
+            sample.add(fcmsg->buffer, fcmsg->len);
+        }
+
+        bool input_fed = !input || input_off == input->size();
+
         if (client_fd >= 0 && !fcmsg) {
             if (Msg *msg = client->get_msg(0)) {
                 if (input_complete) {
                     rmsg.err.append("client cancelled\n");
                     return_value = EXIT_CLIENT_KILLED;
                     client_fd = -1;
-                    kill(pid, SIGTERM);
+                    kill_compiler(pid);
                     delete fcmsg;
                     fcmsg = 0;
                     delete msg;
@@ -382,15 +493,50 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     if (msg->type == M_END) {
                         input_complete = true;
 
-                        if (!fcmsg) {
+                        struct timeval endtv;
+                        gettimeofday(&endtv, 0);
+                        job_stat[JobStatistics::in_msec] = ((endtv.tv_sec - receivetv.tv_sec) * 1000)
+                                                           + ((long(endtv.tv_usec) - long(receivetv.tv_usec)) / 1000);
+                        trace_span("receive input", receivetv, endtv, j.jobID());
+
+                        if (!fcmsg && input_fed) {
                             close(sock_in[1]);
                             sock_in[1] = -1;
                         }
 
                         delete msg;
-                    } else if (msg->type == M_FILE_CHUNK) {
+
+                        /* The compiler is running already, it's only
+                           stopped if the result turns out to be stored.  */
+                        if (result && !result->key.empty() && !result->owners.empty() && output_fd < 0
+                                && fetch_result(*result, cached_rmsg)) {
+                            kill_compiler(pid);
+                            client_fd = -1;
+                        }
+                    } else if (msg->type == M_RESULT_KEY && !keyed) {
+                        /* The client only says it wants the result kept,
+                           it can't choose under which key.  */
+                        if (result) {
+                            string key = result->inputs.hex();
+
+                            if (key == static_cast<ResultKeyMsg*>(msg)->key) {
+                                result->key = key;
+                            } else {
+                                log_warning() << "result key of the client doesn't match, not keeping the result"
+                                              << endl;
+                            }
+                        }
+
+                        keyed = true;
+                        delete msg;
+                    } else if (msg->type == M_FILE_CHUNK && !input && !keyed) {
                         fcmsg = static_cast<FileChunkMsg*>(msg);
                         off = 0;
+                        sample.add(fcmsg->buffer, fcmsg->len);
+
+                        if (result) {
+                            result->inputs.add(fcmsg->buffer, fcmsg->len);
+                        }
 
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
@@ -398,17 +544,23 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         log_error() << "protocol error while reading preprocessed file" << endl;
                         return_value = EXIT_IO_ERROR;
                         client_fd = -1;
-                        kill(pid, SIGTERM);
+                        kill_compiler(pid);
                         delete fcmsg;
                         fcmsg = 0;
                         delete msg;
                     }
                 }
+            } else if (client->at_eof() && input_complete) {
+                // the client went away, there is nobody to compile for
+                rmsg.err.append("client went away\n");
+                return_value = EXIT_CLIENT_KILLED;
+                client_fd = -1;
+                kill_compiler(pid);
             } else if (client->at_eof()) {
                 log_error() << "unexpected EOF while reading preprocessed file" << endl;
                 return_value = EXIT_IO_ERROR;
                 client_fd = -1;
-                kill(pid, SIGTERM);
+                kill_compiler(pid);
                 delete fcmsg;
                 fcmsg = 0;
             }
@@ -444,6 +596,14 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             max_fd = death_pipe[0];
         }
 
+        if (output_fd >= 0) {
+            FD_SET(output_fd, &rfds);
+
+            if (output_fd > max_fd) {
+                max_fd = output_fd;
+            }
+        }
+
         fd_set wfds, *wfdsp = 0;
         FD_ZERO(&wfds);
 
@@ -464,12 +624,26 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
             tvp = &tv;
         }
 
+        /* What came in with the last message (EndMsg right after
+           ResultKeyMsg) doesn't wake select() up.  */
+        bool buffered = client_fd >= 0 && !fcmsg && client->has_msg();
+
+        if (buffered) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            tvp = &tv;
+        }
+
         switch (select(max_fd + 1, &rfds, wfdsp, 0, tvp)) {
         case 0:
 
+            if (buffered) {
+                continue;
+            }
+
             if (!input_complete) {
                 log_error() << "timeout while reading preprocessed file" << endl;
-                kill(pid, SIGTERM); // Won't need it any more ...
+                kill_compiler(pid); // Won't need it any more ...
                 return_value = EXIT_IO_ERROR;
                 client_fd = -1;
                 input_complete = true;
@@ -500,10 +674,11 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         continue;
                     }
 
-                    kill(pid, SIGTERM); // Most likely crashed anyway ...
+                    kill_compiler(pid); // Most likely crashed anyway ...
                     return_value = EXIT_COMPILER_CRASHED;
                     client_fd = -1;
                     input_complete = true;
+                    input = 0;
                     delete fcmsg;
                     fcmsg = 0;
                     continue;
@@ -518,7 +693,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     delete fcmsg;
                     fcmsg = 0;
 
-                    if (input_complete) {
+                    if (input_complete && (!input || input_off == input->size())) {
                         close(sock_in[1]);
                         sock_in[1] = -1;
                     }
@@ -549,11 +724,23 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                 }
             }
 
+            if (output_fd >= 0 && FD_ISSET(output_fd, &rfds) && !FD_ISSET(death_pipe[0], &rfds)
+                    && !forward_output(output_fd, client, job_stat)) {
+                kill_compiler(pid);
+                return_value = EXIT_IO_ERROR;
+                output_fd = -1;
+            }
+
             if (FD_ISSET(death_pipe[0], &rfds)) {
                 // Note that we have already read any remaining stdout/stderr:
                 // the sigpipe is delivered after everything was written,
                 // and the notification is multiplexed into the select above.
 
+                // the compiler is done writing, the rest is in the pipe
+                if (output_fd >= 0 && !forward_output(output_fd, client, job_stat)) {
+                    return_value = EXIT_IO_ERROR;
+                }
+
                 struct rusage ru;
                 int status;
 
@@ -563,6 +750,21 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     return EXIT_DISTCC_FAILED;
                 }
 
+                compiler_pgrp = 0;
+
+                // what the driver left running is of no use anymore
+                if (return_value == EXIT_CLIENT_KILLED) {
+                    kill(-pid, SIGKILL);
+                }
+
+                if (result && result->cached) {
+                    rmsg.status = cached_rmsg.status;
+                    rmsg.out = cached_rmsg.out;
+                    rmsg.err = cached_rmsg.err;
+                    rmsg.have_dwo_file = cached_rmsg.have_dwo_file;
+                    return 0;
+                }
+
                 if (shell_exit_status(status) != 0) {
                     unsigned long int mem_used = ((ru.ru_minflt + ru.ru_majflt) * getpagesize()) / 1024;
                     rmsg.status = EXIT_OUT_OF_MEMORY;
@@ -586,11 +788,17 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                     job_stat[JobStatistics::exit_code] = shell_exit_status(status);
                     job_stat[JobStatistics::real_msec] = ((endtv.tv_sec - starttv.tv_sec) * 1000)
                                                          + ((long(endtv.tv_usec) - long(starttv.tv_usec)) / 1000);
+                    trace_span("compile", starttv, endtv, j.jobID());
                     job_stat[JobStatistics::user_msec] = (ru.ru_utime.tv_sec * 1000)
                                                          + (ru.ru_utime.tv_usec / 1000);
                     job_stat[JobStatistics::sys_msec] = (ru.ru_stime.tv_sec * 1000)
                                                         + (ru.ru_stime.tv_usec / 1000);
                     job_stat[JobStatistics::sys_pfaults] = ru.ru_majflt + ru.ru_nswap + ru.ru_minflt;
+#ifdef __APPLE__
+                    job_stat[JobStatistics::max_rss_kb] = ru.ru_maxrss / 1024;    // in bytes there
+#else
+                    job_stat[JobStatistics::max_rss_kb] = ru.ru_maxrss;
+#endif
                 }
 
                 return return_value;
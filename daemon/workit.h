@@ -32,6 +32,8 @@
 
 class MsgChannel;
 class CompileResultMsg;
+struct JobResult;
+struct RemoteCpp;
 
 // No icecream ;(
 class myexception : public std::exception
@@ -47,12 +49,17 @@ public:
 namespace JobStatistics
 {
 enum job_stat_fields { in_compressed, in_uncompressed, out_uncompressed, exit_code,
-                       real_msec, user_msec, sys_msec, sys_pfaults
+                       real_msec, user_msec, sys_msec, sys_pfaults,
+                       in_msec, rtt_usec, // receiving the input, round-trip time to the client
+                       max_rss_kb, // peak memory of the compiler
+                       count
                      };
 }
 
 extern int work_it(CompileJob &j, unsigned int job_stats[], MsgChannel *client, CompileResultMsg &msg,
                    const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-                   unsigned long int mem_limit, int client_fd, int job_in_fd);
+                   unsigned long int mem_limit, int client_fd, int job_in_fd, int output_fd = -1,
+                   JobResult *result = 0, const RemoteCpp *cpp = 0,
+                   const std::string *input = 0);
 
 #endif
@@ -42,8 +42,12 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_busyInstalling(0)
     , m_hostPlatform()
     , m_load(1000)
+    , m_freeMem(0)
+    , m_freeMemTime(0)
     , m_maxJobs(0)
+    , m_maxLocalJobs(0)
     , m_noRemote(false)
+    , m_resultCache(false)
     , m_jobList()
     , m_submittedJobsCount(0)
     , m_state(CONNECTED)
@@ -52,10 +56,9 @@ CompileServer::CompileServer(const int fd, struct sockaddr *_addr, const socklen
     , m_compilerVersions()
     , m_lastCompiledJobs()
     , m_lastRequestedJobs()
-    , m_cumCompiled()
-    , m_cumRequested()
     , m_clientMap()
     , m_blacklist()
+    , m_quarantined(false)
 {
 }
 
@@ -132,11 +135,13 @@ string CompileServer::can_install(const Job *job)
         return string();
     }
 
-    Environments environments = job->environments();
-    for (Environments::const_iterator it = environments.begin();
-            it != environments.end(); ++it) {
-        if (platforms_compatible(it->first) && !blacklisted(job, *it)) {
-            return it->first;
+    const EnvIds &environments = job->environmentIds();
+    for (EnvIds::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        const string &platform = name_of(env_platform(*it));
+
+        if (platforms_compatible(platform)
+                && !blacklisted(job, make_pair(platform, name_of(env_name(*it))))) {
+            return platform;
         }
     }
 
@@ -147,10 +152,16 @@ bool CompileServer::is_eligible(const Job *job)
 {
     bool jobs_okay = int(m_jobList.size()) < m_maxJobs;
     bool load_okay = m_load < 1000;
+    // with all slots taken by links the machine has no CPU to spare
+    bool linking_okay = m_maxLocalJobs <= 0 || localJobs() < m_maxLocalJobs;
     bool version_okay = job->minimalHostVersion() <= protocol;
+    bool memory_okay = job->submitter() == this || memoryFits(job->memoryKb());
     return jobs_okay
+           && memory_okay
+           && (!m_quarantined || job->submitter() == this)
            && (m_chrootPossible || job->submitter() == this)
            && load_okay
+           && linking_okay
            && version_okay
            && can_install(job).size()
            && this->check_remote(job);
@@ -221,6 +232,37 @@ void CompileServer::setLoad(unsigned int load)
     m_load = load;
 }
 
+unsigned int CompileServer::freeMem() const
+{
+    return m_freeMem;
+}
+
+void CompileServer::setFreeMem(unsigned int mem)
+{
+    m_freeMem = mem;
+    m_freeMemTime = time(0);
+}
+
+bool CompileServer::memoryFits(unsigned int memory_kb) const
+{
+    /* A server without jobs takes anything, or a job bigger than all
+       of them would never be compiled.  */
+    if (!memory_kb || !m_freeMem || m_jobList.empty()) {
+        return true;
+    }
+
+    // the free memory doesn't have the jobs yet that started since, or not at all
+    unsigned long long committed = memory_kb;
+
+    for (list<Job *>::const_iterator it = m_jobList.begin(); it != m_jobList.end(); ++it) {
+        if (!(*it)->startOnScheduler() || (*it)->startOnScheduler() >= m_freeMemTime) {
+            committed += (*it)->memoryKb();
+        }
+    }
+
+    return committed <= (unsigned long long) m_freeMem * 1024;
+}
+
 int CompileServer::maxJobs() const
 {
     return m_maxJobs;
@@ -231,6 +273,21 @@ void CompileServer::setMaxJobs(int jobs)
     m_maxJobs = jobs;
 }
 
+int CompileServer::maxLocalJobs() const
+{
+    return m_maxLocalJobs;
+}
+
+void CompileServer::setMaxLocalJobs(int jobs)
+{
+    m_maxLocalJobs = jobs;
+}
+
+int CompileServer::localJobs() const
+{
+    return m_clientMap.size();
+}
+
 bool CompileServer::noRemote() const
 {
     return m_noRemote;
@@ -241,6 +298,16 @@ void CompileServer::setNoRemote(bool value)
     m_noRemote = value;
 }
 
+bool CompileServer::resultCache() const
+{
+    return m_resultCache;
+}
+
+void CompileServer::setResultCache(bool value)
+{
+    m_resultCache = value;
+}
+
 list<Job *> CompileServer::jobList() const
 {
     return m_jobList;
@@ -303,62 +370,42 @@ void CompileServer::setChrootPossible(const bool possible)
 
 Environments CompileServer::compilerVersions() const
 {
-    return m_compilerVersions;
+    return m_compilerVersions.environments();
 }
 
 void CompileServer::setCompilerVersions(const Environments &environments)
 {
-    m_compilerVersions = environments;
+    m_compilerVersions = EnvSet(environments);
 }
 
-list<JobStat> CompileServer::lastCompiledJobs() const
+const JobStatHistory &CompileServer::lastCompiledJobs() const
 {
     return m_lastCompiledJobs;
 }
 
 void CompileServer::appendCompiledJob(const JobStat &stats)
 {
-    m_lastCompiledJobs.push_back(stats);
+    m_lastCompiledJobs.append(stats);
 }
 
-void CompileServer::popCompiledJob()
+const JobStat &CompileServer::cumCompiled() const
 {
-    m_lastCompiledJobs.pop_front();
+    return m_lastCompiledJobs.cumulated();
 }
 
-list<JobStat> CompileServer::lastRequestedJobs() const
+const JobStatHistory &CompileServer::lastRequestedJobs() const
 {
     return m_lastRequestedJobs;
 }
 
 void CompileServer::appendRequestedJobs(const JobStat &stats)
 {
-    m_lastRequestedJobs.push_back(stats);
-}
-
-void CompileServer::popRequestedJobs()
-{
-    m_lastRequestedJobs.pop_front();
+    m_lastRequestedJobs.append(stats);
 }
 
-JobStat CompileServer::cumCompiled() const
+const JobStat &CompileServer::cumRequested() const
 {
-    return m_cumCompiled;
-}
-
-void CompileServer::setCumCompiled(const JobStat &stats)
-{
-    m_cumCompiled = stats;
-}
-
-JobStat CompileServer::cumRequested() const
-{
-    return m_cumRequested;
-}
-
-void CompileServer::setCumRequested(const JobStat &stats)
-{
-    m_cumRequested = stats;
+    return m_lastRequestedJobs.cumulated();
 }
 
 int CompileServer::getClientJobId(const int localJobId)
@@ -396,6 +443,69 @@ void CompileServer::eraseCSFromBlacklist(CompileServer *cs)
     m_blacklist.erase(cs);
 }
 
+void CompileServer::setPeerLink(const PeerLink &link)
+{
+    PeerLink &known = m_peerLinks[link.peer];
+    known.peer = link.peer;
+
+    // the daemons don't measure everything every time
+    if (link.rtt_usec) {
+        known.rtt_usec = link.rtt_usec;
+    }
+
+    if (link.bytes_per_sec) {
+        known.bytes_per_sec = link.bytes_per_sec;
+    }
+}
+
+bool CompileServer::quarantined() const
+{
+    return m_quarantined;
+}
+
+void CompileServer::setQuarantined(const bool value)
+{
+    m_quarantined = value;
+}
+
+bool CompileServer::hasDict(unsigned int id) const
+{
+    return m_dictIds.count(id);
+}
+
+void CompileServer::addDict(unsigned int id)
+{
+    m_dictIds.insert(id);
+}
+
+void CompileServer::addPhaseCounts(const vector<uint32_t> &counts)
+{
+    m_phaseCounts.resize(counts.size());
+
+    for (size_t i = 0; i < counts.size(); ++i) {
+        m_phaseCounts[i] += counts[i];
+    }
+}
+
+unsigned long CompileServer::transferMsec(const string &peer, unsigned long size) const
+{
+    map<string, PeerLink>::const_iterator it = m_peerLinks.find(peer);
+
+    if (it == m_peerLinks.end()) {
+        return 0;
+    }
+
+    /* The job is one round trip to send the source and one for the
+       result, and then the bytes themselves.  */
+    unsigned long msec = 2 * it->second.rtt_usec / 1000;
+
+    if (it->second.bytes_per_sec) {
+        msec += (unsigned long long) size * 1000 / it->second.bytes_per_sec;
+    }
+
+    return msec;
+}
+
 bool CompileServer::blacklisted(const Job *job, const pair<string, string> &environment)
 {
     Environments blacklist = job->submitter()->getEnvsForBlacklistedCS(this);
@@ -27,14 +27,34 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
 
 #include "../services/comm.h"
+#include "envid.h"
 #include "jobstat.h"
 
 class Job;
 
 using namespace std;
 
+/* What the calibration benchmarks of a server showed, see BenchmarkMsg.  */
+struct BenchmarkInfo {
+    BenchmarkInfo()
+        : sent_msec(0)
+        , done(0)
+        , runs(0)
+        , user_msec(0)
+        , overhead_msec(0) {}
+
+    unsigned long long sent_msec;  // of the one outstanding, 0 if none
+    time_t done;  // when the last one came back
+    unsigned int runs;
+    unsigned long user_msec;  // of the last one
+    unsigned long overhead_msec;  // what the last one took on top of compiling
+    // the fastest run for each environment, in user msec
+    map<pair<string, string>, unsigned long> best_msec;
+};
+
 /* One compile server (receiver, compile daemon)  */
 class CompileServer : public MsgChannel
 {
@@ -48,7 +68,9 @@ public:
         UNKNOWN,
         DAEMON,
         MONITOR,
-        LINE
+        LINE,
+        STANDBY,
+        FEDERATION
     };
 
     CompileServer(const int fd, struct sockaddr *_addr, const socklen_t _len, const bool text_based);
@@ -80,12 +102,28 @@ public:
     unsigned int load() const;
     void setLoad(const unsigned int load);
 
+    // the memory for new jobs in MB, as of the last StatsMsg, 0 if not known
+    unsigned int freeMem() const;
+    void setFreeMem(const unsigned int mem);
+    // whether a job taking MEMORY_KB fits next to the ones sent since then
+    bool memoryFits(unsigned int memory_kb) const;
+
     int maxJobs() const;
     void setMaxJobs(const int jobs);
 
+    // the slots of the daemon for local jobs that don't compile and how many
+    // of them run, see LoginMsg::max_local_jobs
+    int maxLocalJobs() const;
+    void setMaxLocalJobs(const int jobs);
+    int localJobs() const;
+
     bool noRemote() const;
     void setNoRemote(const bool value);
 
+    // the daemon keeps results of jobs for the farm, see ResultOwnersMsg
+    bool resultCache() const;
+    void setResultCache(const bool value);
+
     list<Job *> jobList() const;
     void appendJob(Job *job);
     void removeJob(Job *job);
@@ -104,21 +142,20 @@ public:
     void setChrootPossible(const bool possible);
 
     Environments compilerVersions() const;
+    const EnvSet &compilerVersionIds() const
+    {
+        return m_compilerVersions;
+    }
+
     void setCompilerVersions(const Environments &environments);
 
-    list<JobStat> lastCompiledJobs() const;
+    const JobStatHistory &lastCompiledJobs() const;
     void appendCompiledJob(const JobStat &stats);
-    void popCompiledJob();
+    const JobStat &cumCompiled() const;
 
-    list<JobStat> lastRequestedJobs() const;
+    const JobStatHistory &lastRequestedJobs() const;
     void appendRequestedJobs(const JobStat &stats);
-    void popRequestedJobs();
-
-    JobStat cumCompiled() const;
-    void setCumCompiled(const JobStat &stats);
-
-    JobStat cumRequested() const;
-    void setCumRequested(const JobStat &stats);
+    const JobStat &cumRequested() const;
 
 
     unsigned int hostidCounter() const;
@@ -132,6 +169,38 @@ public:
     void blacklistCompileServer(CompileServer *cs, const std::pair<std::string, std::string> &env);
     void eraseCSFromBlacklist(CompileServer *cs);
 
+    // the links to the peers that sent jobs, as this server measured them
+    void setPeerLink(const PeerLink &link);
+    // what sending SIZE bytes between the peer and this server takes in
+    // msec, including the round trips; 0 if nothing is known about the link
+    unsigned long transferMsec(const string &peer, unsigned long size) const;
+
+    BenchmarkInfo &benchmark()
+    {
+        return m_benchmark;
+    }
+    const BenchmarkInfo &benchmark() const
+    {
+        return m_benchmark;
+    }
+
+    // no jobs go to a server with a compiler that is broken or got slow
+    bool quarantined() const;
+    void setQuarantined(const bool value);
+
+    // the daemon has the compression dictionary, see CompressionDictMsg
+    bool hasDict(unsigned int id) const;
+    void addDict(unsigned int id);
+
+    // adds the durations of job phases from a StatsMsg
+    void addPhaseCounts(const vector<uint32_t> &counts);
+    // totals of those since it logged in, PHASE_VALUES for each phase, or
+    // nothing if it never reported any
+    const vector<unsigned long long> &phaseCounts() const
+    {
+        return m_phaseCounts;
+    }
+
 private:
     bool blacklisted(const Job *job, const pair<string, string> &environment);
 
@@ -144,24 +213,31 @@ private:
 
     // LOAD is load * 1000
     unsigned int m_load;
+    unsigned int m_freeMem;
+    time_t m_freeMemTime;
     int m_maxJobs;
+    int m_maxLocalJobs;
     bool m_noRemote;
+    bool m_resultCache;
     list<Job *> m_jobList;
     int m_submittedJobsCount;
     State m_state;
     Type m_type;
     bool m_chrootPossible;
 
-    Environments m_compilerVersions;  // Available compilers
+    EnvSet m_compilerVersions;  // Available compilers
 
-    list<JobStat> m_lastCompiledJobs;
-    list<JobStat> m_lastRequestedJobs;
-    JobStat m_cumCompiled;  // cumulated
-    JobStat m_cumRequested;
+    JobStatHistory m_lastCompiledJobs;
+    JobStatHistory m_lastRequestedJobs;
 
     static unsigned int s_hostIdCounter;
     map<int, int> m_clientMap; // map client ID for daemon to our IDs
     map<CompileServer *, Environments> m_blacklist;
+    map<string, PeerLink> m_peerLinks; // by IP address of the peer
+    vector<unsigned long long> m_phaseCounts;
+    BenchmarkInfo m_benchmark;
+    bool m_quarantined;
+    set<unsigned int> m_dictIds;
 };
 
 #endif
@@ -0,0 +1,115 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "envid.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+static map<string, NameId> name_ids;
+static vector<const string *> names;
+static map<pair<NameId, NameId>, EnvId> env_ids;
+static vector<pair<NameId, NameId> > envs;
+
+NameId intern_name(const string &name)
+{
+    map<string, NameId>::iterator it = name_ids.find(name);
+
+    if (it != name_ids.end()) {
+        return it->second;
+    }
+
+    it = name_ids.insert(make_pair(name, NameId(names.size()))).first;
+    names.push_back(&it->first);
+    return it->second;
+}
+
+const string &name_of(NameId id)
+{
+    return *names[id];
+}
+
+EnvId intern_env(NameId platform, NameId name)
+{
+    pair<NameId, NameId> key(platform, name);
+    map<pair<NameId, NameId>, EnvId>::iterator it = env_ids.find(key);
+
+    if (it != env_ids.end()) {
+        return it->second;
+    }
+
+    env_ids.insert(make_pair(key, EnvId(envs.size())));
+    envs.push_back(key);
+    return envs.size() - 1;
+}
+
+EnvId intern_env(const pair<string, string> &env)
+{
+    return intern_env(intern_name(env.first), intern_name(env.second));
+}
+
+NameId env_platform(EnvId id)
+{
+    return envs[id].first;
+}
+
+NameId env_name(EnvId id)
+{
+    return envs[id].second;
+}
+
+EnvIds intern_envs(const Environments &environments)
+{
+    EnvIds ids;
+    ids.reserve(environments.size());
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        ids.push_back(intern_env(*it));
+    }
+
+    return ids;
+}
+
+Environments envs_of(const EnvIds &ids)
+{
+    Environments environments;
+
+    for (EnvIds::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        environments.push_back(make_pair(name_of(env_platform(*it)), name_of(env_name(*it))));
+    }
+
+    return environments;
+}
+
+EnvSet::EnvSet(const Environments &environments)
+    : m_ids(intern_envs(environments))
+{
+    sort(m_ids.begin(), m_ids.end());
+    m_ids.erase(unique(m_ids.begin(), m_ids.end()), m_ids.end());
+    EnvIds(m_ids).swap(m_ids);
+}
+
+bool EnvSet::contains(EnvId id) const
+{
+    return binary_search(m_ids.begin(), m_ids.end(), id);
+}
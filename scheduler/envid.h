@@ -0,0 +1,79 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ENVID_H
+#define ENVID_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../services/comm.h"
+
+/* Platforms, environment names and the (platform, name) pairs of the
+   environments are kept once, and jobs and servers refer to them by these
+   numbers, so that matching a job to a server compares integers.  They are
+   never freed, a farm only has so many compilers.  */
+typedef unsigned int NameId;
+typedef unsigned int EnvId;
+typedef std::vector<EnvId> EnvIds;
+
+NameId intern_name(const std::string &name);
+const std::string &name_of(NameId id);
+
+EnvId intern_env(NameId platform, NameId name);
+EnvId intern_env(const std::pair<std::string, std::string> &env);
+NameId env_platform(EnvId id);
+NameId env_name(EnvId id);
+
+// in the order given, which for a job is the client's preference
+EnvIds intern_envs(const Environments &envs);
+Environments envs_of(const EnvIds &ids);
+
+/* The environments a server has installed, sorted by ID so looking one up
+   is a binary search.  */
+class EnvSet
+{
+public:
+    EnvSet() {}
+    explicit EnvSet(const Environments &envs);
+
+    bool contains(EnvId id) const;
+    const EnvIds &ids() const
+    {
+        return m_ids;
+    }
+
+    bool empty() const
+    {
+        return m_ids.empty();
+    }
+
+    Environments environments() const
+    {
+        return envs_of(m_ids);
+    }
+
+private:
+    EnvIds m_ids;
+};
+
+#endif
@@ -0,0 +1,173 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "federation.h"
+
+#include "compileserver.h"
+
+// what moving a MB between the farms takes until configured, 10 MB/s
+#define FEDERATION_MSEC_PER_MB 100
+
+using namespace std;
+
+Federation::Federation()
+    : m_msecPerMB(FEDERATION_MSEC_PER_MB)
+{
+}
+
+void Federation::addHost(const string &host, unsigned int port)
+{
+    FederationPeer peer;
+    peer.host = host;
+    peer.port = port;
+    m_peers.push_back(peer);
+}
+
+void Federation::setMsecPerMB(unsigned int msec)
+{
+    m_msecPerMB = msec;
+}
+
+FederationPeer *Federation::peer(CompileServer *channel)
+{
+    for (list<FederationPeer>::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+        if (it->channel == channel) {
+            return &*it;
+        }
+    }
+
+    return 0;
+}
+
+void Federation::connected(CompileServer *channel)
+{
+    FederationPeer peer;
+    peer.channel = channel;
+    m_peers.push_back(peer);
+}
+
+/* The configured ones are connected to again after RETRY.  */
+void Federation::disconnected(CompileServer *channel, time_t retry)
+{
+    for (list<FederationPeer>::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+        if (it->channel != channel) {
+            continue;
+        }
+
+        if (it->host.empty()) {
+            m_peers.erase(it);
+        } else {
+            it->channel = 0;
+            it->nextConnect = retry;
+            it->freeSlots.clear();
+        }
+
+        return;
+    }
+}
+
+void Federation::setCapacity(CompileServer *channel, const FederationCapacityMsg &msg)
+{
+    FederationPeer *p = peer(channel);
+
+    if (!p) {
+        return;
+    }
+
+    p->freeSlots.clear();
+    list<uint32_t>::const_iterator slots = msg.slots.begin();
+
+    for (Environments::const_iterator it = msg.envs.begin();
+            it != msg.envs.end() && slots != msg.slots.end(); ++it, ++slots) {
+        p->freeSlots[*it] = *slots;
+    }
+}
+
+static unsigned int free_slots(const FederationPeer &peer, const pair<string, string> &env)
+{
+    map<pair<string, string>, unsigned int>::const_iterator it = peer.freeSlots.find(env);
+    return it != peer.freeSlots.end() ? it->second : 0;
+}
+
+/* A server that has the environment costs the round trips and the transfer,
+   one that has to install it the installation on top.  */
+FederationPeer *Federation::pick(const Environments &envs, unsigned long guessMsec,
+                                 unsigned long transferSize, unsigned long installMsec)
+{
+    FederationPeer *best = 0;
+    unsigned long best_cost = 0;
+
+    for (list<FederationPeer>::iterator it = m_peers.begin(); it != m_peers.end(); ++it) {
+        if (!it->channel) {
+            continue;
+        }
+
+        bool found = false;
+        unsigned long env_cost = 0;
+
+        for (Environments::const_iterator env = envs.begin(); env != envs.end(); ++env) {
+            if (free_slots(*it, *env)) {
+                found = true;
+                env_cost = 0;
+                break;
+            }
+
+            if (free_slots(*it, make_pair(env->first, string()))) {
+                found = true;
+                env_cost = installMsec;
+            }
+        }
+
+        if (!found) {
+            continue;
+        }
+
+        unsigned long cost = env_cost + 2 * (it->channel->rtt_usec() / 1000)
+                             + transferSize / 1024 * m_msecPerMB / 1024;
+
+        if (!best || cost < best_cost) {
+            best = &*it;
+            best_cost = cost;
+        }
+    }
+
+    if (best && guessMsec && best_cost >= guessMsec) {
+        return 0;
+    }
+
+    return best;
+}
+
+void Federation::taken(FederationPeer *peer, const Environments &envs)
+{
+    for (Environments::const_iterator env = envs.begin(); env != envs.end(); ++env) {
+        map<pair<string, string>, unsigned int>::iterator it = peer->freeSlots.find(*env);
+
+        if (it != peer->freeSlots.end() && it->second) {
+            --it->second;
+        }
+
+        it = peer->freeSlots.find(make_pair(env->first, string()));
+
+        if (it != peer->freeSlots.end() && it->second) {
+            --it->second;
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "../services/comm.h"
+
+class CompileServer;
+
+/* The scheduler of another farm, see Federation.  */
+struct FederationPeer {
+    FederationPeer()
+        : port(0)
+        , channel(0)
+        , nextConnect(0)
+    {
+    }
+
+    // as given with --federate, empty if the other one connected here
+    std::string host;
+    unsigned int port;
+    CompileServer *channel; // 0 while not connected
+    time_t nextConnect;
+    // its free job slots by environment, see FederationCapacityMsg
+    std::map<std::pair<std::string, std::string>, unsigned int> freeSlots;
+};
+
+/* The schedulers of other farms (other netnames or sites) this one shares
+   idle servers with.  They tell each other how many job slots they have
+   free, and a job that finds no server in its own farm goes to the one
+   where moving it costs least.  That one picks a server for it, and the
+   submitter connects to that server directly.  */
+class Federation
+{
+public:
+    Federation();
+
+    void addHost(const std::string &host, unsigned int port);
+    // what moving a MB of source and object files between the farms takes
+    void setMsecPerMB(unsigned int msec);
+
+    bool empty() const
+    {
+        return m_peers.empty();
+    }
+
+    std::list<FederationPeer> &peers()
+    {
+        return m_peers;
+    }
+
+    FederationPeer *peer(CompileServer *channel);
+    // a scheduler that connected here
+    void connected(CompileServer *channel);
+    void disconnected(CompileServer *channel, time_t retry);
+    void setCapacity(CompileServer *channel, const FederationCapacityMsg &msg);
+
+    /* The peer a job for one of ENVS is best sent to, 0 if none has a slot
+       for it or moving it there takes longer than compiling it.  */
+    FederationPeer *pick(const Environments &envs, unsigned long guessMsec,
+                         unsigned long transferSize, unsigned long installMsec);
+    // a job for ENVS went to PEER, which reports the slot free no more
+    void taken(FederationPeer *peer, const Environments &envs);
+
+private:
+    std::list<FederationPeer> m_peers;
+    unsigned int m_msecPerMB;
+};
+
+#endif
@@ -25,6 +25,12 @@
 
 #include "compileserver.h"
 
+// jobs are allocated this many at a time
+#define JOB_POOL_CHUNK 256
+
+// the pooled ones not in use, each pointing to the next
+static void *free_jobs = 0;
+
 Job::Job(const unsigned int _id, CompileServer *subm)
     : m_id(_id)
     , m_localClientId(0)
@@ -34,13 +40,19 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_startTime(0)
     , m_startOnScheduler(0)
     , m_doneTime(0)
-    , m_targetPlatform()
+    , m_targetPlatform(intern_name(std::string()))
     , m_fileName()
     , m_masterJobFor()
     , m_argFlags(0)
-    , m_language()
+    , m_language(intern_name(std::string()))
     , m_preferredHost()
     , m_minimalHostVersion(0)
+    , m_jobClass(JC_INTERACTIVE)
+    , m_allowDuplicate(false)
+    , m_hedged(false)
+    , m_leased(false)
+    , m_memoryKb(0)
+    , m_waitNotice(0)
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -53,6 +65,43 @@ Job::~Job()
     m_submitter->submittedJobsDecrement();
 }
 
+void *Job::operator new(size_t size)
+{
+    if (size != sizeof(Job)) {
+        return ::operator new(size);
+    }
+
+    if (!free_jobs) {
+        char *chunk = static_cast<char *>(::operator new(JOB_POOL_CHUNK * sizeof(Job)));
+
+        for (int i = 0; i < JOB_POOL_CHUNK; ++i) {
+            void *slot = chunk + i * sizeof(Job);
+            *static_cast<void **>(slot) = free_jobs;
+            free_jobs = slot;
+        }
+    }
+
+    void *job = free_jobs;
+    free_jobs = *static_cast<void **>(job);
+    return job;
+}
+
+/* The chunks are kept for the next peak.  */
+void Job::operator delete(void *job, size_t size)
+{
+    if (!job) {
+        return;
+    }
+
+    if (size != sizeof(Job)) {
+        ::operator delete(job);
+        return;
+    }
+
+    *static_cast<void **>(job) = free_jobs;
+    free_jobs = job;
+}
+
 unsigned int Job::id() const
 {
     return m_id;
@@ -105,22 +154,36 @@ void Job::setSubmitter(CompileServer *submitter)
 
 Environments Job::environments() const
 {
-    return m_environments;
+    return envs_of(m_environments);
 }
 
 void Job::setEnvironments(const Environments &environments)
 {
-    m_environments = environments;
+    m_environments = intern_envs(environments);
+    updateTargetEnvironments();
 }
 
 void Job::appendEnvironment(const std::pair<std::string, std::string> &env)
 {
-    m_environments.push_back(env);
+    m_environments.push_back(intern_env(env));
+    updateTargetEnvironments();
 }
 
 void Job::clearEnvironments()
 {
     m_environments.clear();
+    m_targetEnvironments.clear();
+}
+
+/* The client names the platform an environment runs on, the daemons the
+   one it compiles for.  */
+void Job::updateTargetEnvironments()
+{
+    m_targetEnvironments.clear();
+
+    for (EnvIds::const_iterator it = m_environments.begin(); it != m_environments.end(); ++it) {
+        m_targetEnvironments.push_back(intern_env(m_targetPlatform, env_name(*it)));
+    }
 }
 
 time_t Job::startTime() const
@@ -153,14 +216,15 @@ void Job::setDoneTime(const time_t time)
     m_doneTime = time;
 }
 
-std::string Job::targetPlatform() const
+const std::string &Job::targetPlatform() const
 {
-    return m_targetPlatform;
+    return name_of(m_targetPlatform);
 }
 
 void Job::setTargetPlatform(const std::string &platform)
 {
-    m_targetPlatform = platform;
+    m_targetPlatform = intern_name(platform);
+    updateTargetEnvironments();
 }
 
 std::string Job::fileName() const
@@ -193,14 +257,14 @@ void Job::setArgFlags(const unsigned int argFlags)
     m_argFlags = argFlags;
 }
 
-std::string Job::language() const
+const std::string &Job::language() const
 {
-    return m_language;
+    return name_of(m_language);
 }
 
 void Job::setLanguage(const std::string &language)
 {
-    m_language = language;
+    m_language = intern_name(language);
 }
 
 std::string Job::preferredHost() const
@@ -222,3 +286,63 @@ void Job::setMinimalHostVersion(int version)
 {
     m_minimalHostVersion = version;
 }
+
+unsigned int Job::jobClass() const
+{
+    return m_jobClass;
+}
+
+void Job::setJobClass(unsigned int jobClass)
+{
+    m_jobClass = jobClass;
+}
+
+bool Job::allowDuplicate() const
+{
+    return m_allowDuplicate;
+}
+
+void Job::setAllowDuplicate(bool allow)
+{
+    m_allowDuplicate = allow;
+}
+
+bool Job::hedged() const
+{
+    return m_hedged;
+}
+
+void Job::setHedged(bool hedged)
+{
+    m_hedged = hedged;
+}
+
+bool Job::leased() const
+{
+    return m_leased;
+}
+
+void Job::setLeased(bool leased)
+{
+    m_leased = leased;
+}
+
+unsigned int Job::memoryKb() const
+{
+    return m_memoryKb;
+}
+
+void Job::setMemoryKb(unsigned int memory)
+{
+    m_memoryKb = memory;
+}
+
+time_t Job::waitNotice() const
+{
+    return m_waitNotice;
+}
+
+void Job::setWaitNotice(time_t time)
+{
+    m_waitNotice = time;
+}
@@ -24,11 +24,13 @@
 #ifndef JOB_H
 #define JOB_H
 
+#include <stddef.h>
 #include <list>
 #include <string>
 #include <time.h>
 
 #include "../services/comm.h"
+#include "envid.h"
 
 class CompileServer;
 
@@ -44,6 +46,10 @@ public:
     Job(const unsigned int _id, CompileServer *subm);
     ~Job();
 
+    // from a pool, there are tens of thousands of them at peak times
+    static void *operator new(size_t size);
+    static void operator delete(void *job, size_t size);
+
     unsigned int id() const;
     void setId(const unsigned int id);
 
@@ -60,6 +66,17 @@ public:
     void setSubmitter(CompileServer *submitter);
 
     Environments environments() const;
+    const EnvIds &environmentIds() const
+    {
+        return m_environments;
+    }
+
+    // the same as servers have them installed, for the target platform
+    const EnvIds &targetEnvironmentIds() const
+    {
+        return m_targetEnvironments;
+    }
+
     void setEnvironments(const Environments &environments);
     void appendEnvironment(const std::pair<std::string, std::string> &env);
     void clearEnvironments();
@@ -73,7 +90,7 @@ public:
     time_t doneTime() const;
     void setDoneTime(const time_t time);
 
-    std::string targetPlatform() const;
+    const std::string &targetPlatform() const;
     void setTargetPlatform(const std::string &platform);
 
     std::string fileName() const;
@@ -85,7 +102,7 @@ public:
     unsigned int argFlags() const;
     void setArgFlags(const unsigned int argFlags);
 
-    std::string language() const;
+    const std::string &language() const;
     void setLanguage(const std::string &language);
 
     std::string preferredHost() const;
@@ -94,13 +111,34 @@ public:
     int minimalHostVersion() const;
     void setMinimalHostVersion( int version );
 
+    unsigned int jobClass() const;
+    void setJobClass(unsigned int jobClass);
+
+    bool allowDuplicate() const;
+    void setAllowDuplicate(bool allow);
+
+    bool hedged() const;
+    void setHedged(bool hedged);
+
+    bool leased() const;
+    void setLeased(bool leased);
+
+    // the peak memory the compiler is expected to take in KiB, 0 if not known
+    unsigned int memoryKb() const;
+    void setMemoryKb(unsigned int memory);
+
+    // when the submitter was last told how long the job waits, see JobWaitMsg
+    time_t waitNotice() const;
+    void setWaitNotice(time_t time);
+
 private:
     unsigned int m_id;
     unsigned int m_localClientId;
     State m_state;
     CompileServer *m_server;  // on which server we build
     CompileServer *m_submitter;  // who submitted us
-    Environments m_environments;
+    EnvIds m_environments;
+    EnvIds m_targetEnvironments;
     time_t m_startTime;  // _local_ to the compiler server
     time_t m_startOnScheduler;  // starttime local to scheduler
     /**
@@ -111,13 +149,21 @@ private:
      * and after 10s no signal, kill the daemon (and let it rehup) **/
     time_t m_doneTime;
 
-    std::string m_targetPlatform;
+    NameId m_targetPlatform;
     std::string m_fileName;
     std::list<Job *> m_masterJobFor;
     unsigned int m_argFlags;
-    std::string m_language; // for debugging
+    NameId m_language; // for debugging
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
+    unsigned int m_jobClass; // JobClass, the priority class of the request
+    bool m_allowDuplicate; // the client can take a second server for the job
+    bool m_hedged; // a straggler given a duplicate, or that duplicate
+    bool m_leased; // asked for ahead of time, no client has taken it yet
+    unsigned int m_memoryKb;
+    time_t m_waitNotice;
+
+    void updateTargetEnvironments();
 };
 
 #endif
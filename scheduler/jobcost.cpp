@@ -0,0 +1,128 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "jobcost.h"
+
+#include <algorithm>
+
+using namespace std;
+
+JobCosts::JobCosts(size_t max_files)
+    : m_maxFiles(max_files)
+{
+}
+
+/* Averages over the last few samples, files change over time.  */
+static unsigned int average(unsigned int current, unsigned int value, unsigned int samples)
+{
+    if (samples == 0) {
+        return value;
+    }
+
+    if (samples > 3) {
+        samples = 3;
+    }
+
+    return (unsigned int)(((unsigned long long) current * samples + value) / (samples + 1));
+}
+
+void JobCosts::learn(const string &file, unsigned int user_msec, unsigned int input_size,
+                     unsigned int output_size, unsigned int memory_kb)
+{
+    if (file.empty()) {
+        return;
+    }
+
+    map<string, Entry>::iterator it = m_costs.find(file);
+
+    if (it == m_costs.end()) {
+        if (m_costs.size() >= m_maxFiles) {
+            m_costs.erase(m_recent.back());
+            m_recent.pop_back();
+        }
+
+        m_recent.push_front(file);
+        it = m_costs.insert(make_pair(file, Entry())).first;
+        it->second.recent = m_recent.begin();
+    } else {
+        m_recent.splice(m_recent.begin(), m_recent, it->second.recent);
+    }
+
+    JobCost &cost = it->second.cost;
+    cost.userMsec = average(cost.userMsec, user_msec, cost.samples);
+    cost.outputSize = average(cost.outputSize, output_size, cost.samples);
+
+    // jobs compiled by the submitter itself don't send the preprocessed source
+    if (input_size) {
+        cost.inputSize = cost.inputSize ? average(cost.inputSize, input_size, cost.samples) : input_size;
+    }
+
+    // running out of memory is worse than a slow guess, a bigger peak counts at once
+    if (memory_kb) {
+        cost.memoryKb = max(memory_kb, average(cost.memoryKb, memory_kb, cost.samples));
+    }
+
+    cost.samples++;
+}
+
+bool JobCosts::predict(const string &file, JobCost &cost) const
+{
+    map<string, Entry>::const_iterator it = m_costs.find(file);
+
+    if (it == m_costs.end()) {
+        return false;
+    }
+
+    cost = it->second.cost;
+    return true;
+}
+
+void JobCosts::files(vector<pair<string, JobCost> > &result) const
+{
+    result.clear();
+    result.reserve(m_costs.size());
+
+    for (Recent::const_iterator it = m_recent.begin(); it != m_recent.end(); ++it) {
+        result.push_back(make_pair(*it, m_costs.find(*it)->second.cost));
+    }
+}
+
+void JobCosts::restore(const string &file, const JobCost &cost)
+{
+    if (file.empty()) {
+        return;
+    }
+
+    map<string, Entry>::iterator it = m_costs.find(file);
+
+    if (it != m_costs.end()) {
+        it->second.cost = cost;
+        return;
+    }
+
+    if (m_costs.size() >= m_maxFiles) {
+        return;
+    }
+
+    m_recent.push_back(file);
+    Entry &entry = m_costs[file];
+    entry.cost = cost;
+    entry.recent = --m_recent.end();
+}
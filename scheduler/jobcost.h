@@ -0,0 +1,84 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef JOBCOST_H
+#define JOBCOST_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* What compiling one source file took the last times.  */
+struct JobCost {
+    JobCost()
+        : userMsec(0)
+        , inputSize(0)
+        , outputSize(0)
+        , memoryKb(0)
+        , samples(0)
+    {
+    }
+
+    unsigned int userMsec;
+    unsigned int inputSize;  // preprocessed, uncompressed
+    unsigned int outputSize;
+    unsigned int memoryKb;  // peak of the compiler, 0 if not known
+    unsigned int samples;
+};
+
+/* The cost of the jobs seen, by the file name the client sends with the
+   request (the relevant flags and the absolute path of the source), so the
+   scheduler can tell in advance whether a job is trivial or heavy.  Only the
+   most recently compiled files are remembered.  */
+class JobCosts
+{
+public:
+    explicit JobCosts(size_t max_files = 50000);
+
+    void learn(const std::string &file, unsigned int user_msec, unsigned int input_size,
+               unsigned int output_size, unsigned int memory_kb = 0);
+    bool predict(const std::string &file, JobCost &cost) const;
+
+    // for saving them, the most recently learned first
+    void files(std::vector<std::pair<std::string, JobCost> > &result) const;
+    // adds a saved file as the least recently learned one, or updates it
+    void restore(const std::string &file, const JobCost &cost);
+
+    size_t size() const
+    {
+        return m_costs.size();
+    }
+
+private:
+    typedef std::list<std::string> Recent;
+
+    struct Entry {
+        JobCost cost;
+        Recent::iterator recent;
+    };
+
+    std::map<std::string, Entry> m_costs;
+    Recent m_recent;  // the most recently learned first
+    size_t m_maxFiles;
+};
+
+#endif
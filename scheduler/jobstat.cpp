@@ -23,6 +23,9 @@
 
 #include "jobstat.h"
 
+// weight of the newest job in the moving average of the speed
+static const float SPEED_WEIGHT = 0.1;
+
 JobStat::JobStat()
     : m_outputSize(0)
     , m_compileTimeReal(0)
@@ -128,3 +131,64 @@ JobStat &JobStat::operator/=(int d)
     m_jobId = 0;
     return *this;
 }
+
+JobStatHistory::JobStatHistory(size_t capacity)
+    : m_jobs(capacity)
+    , m_first(0)
+    , m_size(0)
+    , m_speed(0)
+{
+}
+
+void JobStatHistory::append(const JobStat &stats)
+{
+    if (m_jobs.empty()) {
+        return;
+    }
+
+    if (m_size == m_jobs.size()) {
+        m_cumulated -= m_jobs[m_first];
+        m_jobs[m_first] = stats;
+        m_first = (m_first + 1) % m_jobs.size();
+    } else {
+        m_jobs[(m_first + m_size) % m_jobs.size()] = stats;
+        m_size++;
+    }
+
+    m_cumulated += stats;
+
+    if (stats.compileTimeUser()) {
+        float speed = (float) stats.outputSize() / (float) stats.compileTimeUser();
+
+        if (m_speed == 0) {
+            m_speed = speed;
+        } else {
+            m_speed += SPEED_WEIGHT * (speed - m_speed);
+        }
+    }
+}
+
+size_t JobStatHistory::size() const
+{
+    return m_size;
+}
+
+bool JobStatHistory::empty() const
+{
+    return m_size == 0;
+}
+
+const JobStat &JobStatHistory::at(size_t i) const
+{
+    return m_jobs[(m_first + i) % m_jobs.size()];
+}
+
+const JobStat &JobStatHistory::cumulated() const
+{
+    return m_cumulated;
+}
+
+float JobStatHistory::speed() const
+{
+    return m_speed;
+}
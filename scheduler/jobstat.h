@@ -24,6 +24,9 @@
 #ifndef JOBSTAT_H
 #define JOBSTAT_H
 
+#include <stddef.h>
+#include <vector>
+
 struct JobStat {
 public:
     JobStat();
@@ -63,4 +66,31 @@ private:
     unsigned int m_jobId;
 };
 
+/* The statistics of the last jobs of a server, in a ring buffer that
+   drops the oldest ones when it is full.  Their sum and an exponentially
+   weighted moving average of the throughput (output bytes per user
+   millisecond) are updated as jobs are added.  */
+class JobStatHistory
+{
+public:
+    explicit JobStatHistory(size_t capacity = 200);
+
+    void append(const JobStat &stats);
+
+    size_t size() const;
+    bool empty() const;
+    // 0 is the oldest job
+    const JobStat &at(size_t i) const;
+
+    const JobStat &cumulated() const;
+    float speed() const;
+
+private:
+    std::vector<JobStat> m_jobs;
+    size_t m_first;
+    size_t m_size;
+    JobStat m_cumulated;
+    float m_speed;
+};
+
 #endif
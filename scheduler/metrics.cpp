@@ -0,0 +1,136 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "metrics.h"
+
+using namespace std;
+
+// 10us to 100ms, picking a server is done for every job
+static const double pick_server_bounds[] = {
+    0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1
+};
+
+Histogram::Histogram(const double *bounds, size_t count)
+    : m_bounds(bounds, bounds + count)
+    , m_counts(count + 1, 0)
+    , m_sum(0)
+    , m_count(0)
+{
+}
+
+void Histogram::observe(double value)
+{
+    size_t i = 0;
+
+    while (i < m_bounds.size() && value > m_bounds[i]) {
+        ++i;
+    }
+
+    ++m_counts[i];
+    m_sum += value;
+    ++m_count;
+}
+
+void Histogram::write(ostream &out, const string &name, const string &help) const
+{
+    unsigned long long cumulative = 0;
+
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " histogram\n";
+
+    for (size_t i = 0; i < m_bounds.size(); ++i) {
+        cumulative += m_counts[i];
+        out << name << "_bucket{le=\"" << m_bounds[i] << "\"} " << cumulative << "\n";
+    }
+
+    out << name << "_bucket{le=\"+Inf\"} " << m_count << "\n";
+    out << name << "_sum " << m_sum << "\n";
+    out << name << "_count " << m_count << "\n";
+}
+
+Metrics::Metrics()
+    : queuedJobs(0)
+    , jobsRequested(0)
+    , jobsAssigned(0)
+    , jobsLocal(0)
+    , jobsDone(0)
+    , jobsFailed(0)
+    , jobsLost(0)
+    , jobsHedged(0)
+    , jobsForwarded(0)
+    , jobsLent(0)
+    , deliveryFailures(0)
+    , envInstalls(0)
+    , envPeerFetches(0)
+    , inBytes(0)
+    , outBytes(0)
+    , daemonLogins(0)
+    , daemonLogouts(0)
+    , pickServerSeconds(pick_server_bounds, sizeof(pick_server_bounds) / sizeof(pick_server_bounds[0]))
+{
+}
+
+static void write_metric(ostream &out, const char *name, const char *type, const char *help,
+                         unsigned long long value)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << value << "\n";
+}
+
+void Metrics::write(ostream &out) const
+{
+    write_metric(out, "icecc_scheduler_queued_jobs", "gauge",
+                 "Job requests waiting for a compile server.", queuedJobs);
+    write_metric(out, "icecc_scheduler_jobs_requested_total", "counter",
+                 "Job requests from clients.", jobsRequested);
+    write_metric(out, "icecc_scheduler_jobs_assigned_total", "counter",
+                 "Jobs given a compile server.", jobsAssigned);
+    write_metric(out, "icecc_scheduler_jobs_local_total", "counter",
+                 "Jobs compiled locally by their submitter.", jobsLocal);
+    write_metric(out, "icecc_scheduler_jobs_done_total", "counter",
+                 "Jobs finished, successful or not.", jobsDone);
+    write_metric(out, "icecc_scheduler_jobs_failed_total", "counter",
+                 "Jobs finished with a non-zero exit code.", jobsFailed);
+    write_metric(out, "icecc_scheduler_jobs_lost_total", "counter",
+                 "Jobs whose daemon disconnected during them.", jobsLost);
+    write_metric(out, "icecc_scheduler_jobs_hedged_total", "counter",
+                 "Straggling jobs compiled on a second server as well.", jobsHedged);
+    write_metric(out, "icecc_scheduler_jobs_forwarded_total", "counter",
+                 "Jobs compiled in another farm.", jobsForwarded);
+    write_metric(out, "icecc_scheduler_jobs_lent_total", "counter",
+                 "Jobs of other farms given a compile server here.", jobsLent);
+    write_metric(out, "icecc_scheduler_delivery_failures_total", "counter",
+                 "Compile servers that could not be sent to a submitter.", deliveryFailures);
+    write_metric(out, "icecc_scheduler_env_installs_total", "counter",
+                 "Jobs given a compile server without their environment.", envInstalls);
+    write_metric(out, "icecc_scheduler_env_peer_fetches_total", "counter",
+                 "Environments fetched from another compile server for a job.", envPeerFetches);
+    write_metric(out, "icecc_scheduler_in_bytes_total", "counter",
+                 "Compressed job input sent to compile servers.", inBytes);
+    write_metric(out, "icecc_scheduler_out_bytes_total", "counter",
+                 "Compressed job output sent back from compile servers.", outBytes);
+    write_metric(out, "icecc_scheduler_daemon_logins_total", "counter",
+                 "Daemons that logged in.", daemonLogins);
+    write_metric(out, "icecc_scheduler_daemon_logouts_total", "counter",
+                 "Daemons that disconnected or were removed.", daemonLogouts);
+    pickServerSeconds.write(out, "icecc_scheduler_pick_server_seconds",
+                            "Time to pick a compile server for a job.");
+}
@@ -0,0 +1,73 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Counts observations by the upper bounds of its buckets, like a
+   Prometheus histogram: a bucket counts everything up to its bound.  */
+class Histogram
+{
+public:
+    Histogram(const double *bounds, size_t count);
+
+    void observe(double value);
+    void write(std::ostream &out, const std::string &name, const std::string &help) const;
+
+private:
+    std::vector<double> m_bounds;
+    std::vector<unsigned long long> m_counts;  // the last one is for +Inf
+    double m_sum;
+    unsigned long long m_count;
+};
+
+/* What the scheduler did since it started, counted as it happens so that
+   reporting it costs nothing, see the "metrics" command of the text port.  */
+struct Metrics {
+    Metrics();
+
+    // in the Prometheus text format
+    void write(std::ostream &out) const;
+
+    unsigned long queuedJobs;          // requests waiting for a server
+    unsigned long long jobsRequested;
+    unsigned long long jobsAssigned;
+    unsigned long long jobsLocal;       // compiled by the submitter, without asking
+    unsigned long long jobsDone;
+    unsigned long long jobsFailed;      // a non-zero exit code
+    unsigned long long jobsLost;        // the daemon went away during it
+    unsigned long long jobsHedged;      // straggling jobs given a duplicate
+    unsigned long long jobsForwarded;   // sent to the scheduler of another farm
+    unsigned long long jobsLent;        // of other farms, given a server here
+    unsigned long long deliveryFailures;
+    unsigned long long envInstalls;     // jobs put on a server without their environment
+    unsigned long long envPeerFetches;  // of those, fetched from another server
+    unsigned long long inBytes;         // compressed, as transferred
+    unsigned long long outBytes;
+    unsigned long long daemonLogins;
+    unsigned long long daemonLogouts;
+    Histogram pickServerSeconds;
+};
+
+#endif
@@ -0,0 +1,668 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "monitorfeed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+
+#include "../services/comm.h"
+#include "../services/logging.h"
+#include "compileserver.h"
+
+// queued output a monitor may have before it is considered blocking
+#define MAX_MONITOR_BACKLOG (1024 * 1024)
+// the shortest interval a monitor can have its notifications batched in, in msec
+#define MIN_MONITOR_BATCH_MSEC 100
+// a monitor with batched notifications that is blocking that long is closed, in seconds
+#define MONITOR_STALL_TIMEOUT 60
+// how often output a monitor didn't take is retried without the thread, in msec
+#define MONITOR_RETRY_MSEC 50
+
+using namespace std;
+
+struct MonitorFeed::Event {
+    enum Type {
+        ADD,
+        NOTIFY,
+        HOST_STATS,
+        DROP_ALL,
+        STOP
+    };
+
+    explicit Event(Type _type)
+        : type(_type)
+        , monitor(0)
+        , batch_msec(0)
+        , snapshot(false)
+        , msg(0)
+        , next(0)
+    {
+    }
+
+    Type type;
+    CompileServer *monitor;
+    unsigned int batch_msec;
+    bool snapshot;
+    Msg *msg;
+    MonitorHostStats stats;
+    Event *next;
+};
+
+/* What a monitor that wants its notifications batched got meanwhile,
+   see send().  */
+struct MonitorFeed::Batch {
+    Batch()
+        : batch_msec(0)
+        , last_sent(0)
+        , stalled_since(0)
+        , dropped(0) {}
+
+    // 0 if it is fed right away
+    unsigned batch_msec;
+    unsigned long long last_sent;
+    // since when it has more than MAX_MONITOR_BACKLOG queued
+    time_t stalled_since;
+    // job notifications it didn't get meanwhile
+    unsigned dropped;
+    // host id -> stats lines by key, as the monitor knows them
+    map<unsigned, map<string, string> > known;
+    // host id -> stats lines by key, to be sent with the next batch
+    map<unsigned, map<string, string> > changed;
+};
+
+static unsigned long long now_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static map<string, string> parse_stats_lines(const string &statmsg)
+{
+    map<string, string> lines;
+    string::size_type pos = 0;
+
+    while (pos < statmsg.size()) {
+        string::size_type end = statmsg.find('\n', pos);
+
+        if (end == string::npos) {
+            end = statmsg.size();
+        }
+
+        string::size_type colon = statmsg.find(':', pos);
+
+        if (colon != string::npos && colon < end) {
+            lines[statmsg.substr(pos, colon - pos)] = statmsg.substr(colon + 1, end - colon - 1);
+        }
+
+        pos = end + 1;
+    }
+
+    return lines;
+}
+
+static string stats_lines(const map<string, string> &lines)
+{
+    string statmsg;
+
+    for (map<string, string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+        statmsg += it->first + ":" + it->second + "\n";
+    }
+
+    return statmsg;
+}
+
+static string format_stats(const MonitorHostStats &stats)
+{
+    string msg;
+    char buffer[1000];
+    sprintf(buffer, "Name:%s\n", stats.name.c_str());
+    msg += buffer;
+    sprintf(buffer, "IP:%s\n", stats.ip.c_str());
+    msg += buffer;
+    sprintf(buffer, "MaxJobs:%d\n", stats.maxJobs);
+    msg += buffer;
+    sprintf(buffer, "NoRemote:%s\n", stats.noRemote ? "true" : "false");
+    msg += buffer;
+    sprintf(buffer, "Platform:%s\n", stats.platform.c_str());
+    msg += buffer;
+    sprintf(buffer, "Speed:%f\n", stats.speed);
+    msg += buffer;
+    sprintf(buffer, "Load:%d\n", stats.load);
+    msg += buffer;
+
+    if (stats.hasStats) {
+        sprintf(buffer, "LoadAvg1:%d\n", stats.loadAvg1);
+        msg += buffer;
+        sprintf(buffer, "LoadAvg5:%d\n", stats.loadAvg5);
+        msg += buffer;
+        sprintf(buffer, "LoadAvg10:%d\n", stats.loadAvg10);
+        msg += buffer;
+        sprintf(buffer, "FreeMem:%d\n", stats.freeMem);
+        msg += buffer;
+    }
+
+    return msg;
+}
+
+MonitorFeed::MonitorFeed()
+    : m_head(new Event(Event::STOP))
+    , m_tail(m_head)
+    , m_queued(false)
+    , m_count(0)
+    , m_tracking(false)
+    , m_version(1)
+    , m_snapshot(0)
+    , m_snapshotVersion(0)
+    , m_threaded(false)
+    , m_stop(false)
+{
+    m_wake[0] = m_wake[1] = -1;
+}
+
+MonitorFeed::~MonitorFeed()
+{
+    stop();
+
+    while (m_head) {
+        Event *next = m_head->next;
+        delete m_head->msg;
+        delete m_head;
+        m_head = next;
+    }
+
+    if (m_wake[0] >= 0) {
+        close(m_wake[0]);
+        close(m_wake[1]);
+    }
+
+    delete m_snapshot;
+}
+
+bool MonitorFeed::start()
+{
+    if (m_threaded) {
+        return true;
+    }
+
+    if (m_wake[0] < 0) {
+        if (pipe(m_wake) < 0) {
+            log_perror("pipe()");
+            return false;
+        }
+
+        for (int i = 0; i < 2; ++i) {
+            fcntl(m_wake[i], F_SETFL, O_NONBLOCK);
+            fcntl(m_wake[i], F_SETFD, FD_CLOEXEC);
+        }
+
+        m_poller.watch(m_wake[0], Poller::Read);
+    }
+
+    m_stop = false;
+
+    // the signals are for the main loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int ret = pthread_create(&m_thread, 0, thread, this);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if (ret != 0) {
+        return false;
+    }
+
+    m_threaded = true;
+    return true;
+}
+
+void MonitorFeed::stop()
+{
+    if (m_threaded) {
+        push(new Event(Event::STOP));
+        flush();
+        pthread_join(m_thread, 0);
+        m_threaded = false;
+    }
+
+    // what came after STOP
+    run();
+
+    while (!m_monitors.empty()) {
+        remove(m_monitors.begin()->first);
+    }
+}
+
+void MonitorFeed::add(CompileServer *monitor, unsigned int batch_msec, bool snapshot)
+{
+    Event *event = new Event(Event::ADD);
+    event->monitor = monitor;
+    event->batch_msec = batch_msec;
+    event->snapshot = snapshot;
+    m_tracking = true;
+    __atomic_add_fetch(&m_count, 1, __ATOMIC_RELEASE);
+    push(event);
+}
+
+void MonitorFeed::notify(Msg *m)
+{
+    Event *event = new Event(Event::NOTIFY);
+    event->msg = m;
+    push(event);
+}
+
+void MonitorFeed::hostStats(const MonitorHostStats &stats)
+{
+    Event *event = new Event(Event::HOST_STATS);
+    event->stats = stats;
+    push(event);
+}
+
+void MonitorFeed::dropAll()
+{
+    push(new Event(Event::DROP_ALL));
+}
+
+int MonitorFeed::flush()
+{
+    if (!m_threaded) {
+        int timeout = run();
+        // no poller tells when a monitor takes the rest
+        return m_pending.empty() ? timeout : min(timeout, MONITOR_RETRY_MSEC);
+    }
+
+    if (m_queued) {
+        char c = 0;
+
+        // a full pipe wakes it up as well
+        if (write(m_wake[1], &c, 1) < 0 && errno != EAGAIN) {
+            log_perror("waking the monitor feed");
+        }
+
+        m_queued = false;
+    }
+
+    return INT_MAX;
+}
+
+/* Only the main loop pushes and only the feed takes, so the list needs
+   no lock.  The feed keeps the last node it took as the stub, so the
+   two never touch the same next pointer of a node that is deleted.  */
+void MonitorFeed::push(Event *event)
+{
+    event->next = 0;
+    __atomic_store_n(&m_tail->next, event, __ATOMIC_RELEASE);
+    m_tail = event;
+    m_queued = true;
+}
+
+/* Handles what was queued and sends what is due.  Returns the msec until
+   the next batch is due.  */
+int MonitorFeed::run()
+{
+    while (Event *next = __atomic_load_n(&m_head->next, __ATOMIC_ACQUIRE)) {
+        delete m_head;
+        m_head = next;
+        handle(next);
+    }
+
+    int timeout = flushBatches();
+    flushMonitors();
+    return timeout;
+}
+
+void MonitorFeed::handle(Event *event)
+{
+    switch (event->type) {
+    case Event::ADD: {
+        Batch *batch = new Batch;
+
+        if (event->batch_msec) {
+            batch->batch_msec = max(event->batch_msec, unsigned(MIN_MONITOR_BATCH_MSEC));
+            batch->last_sent = now_msec();
+        }
+
+        m_monitors[event->monitor] = batch;
+        m_pending.insert(event->monitor);
+        welcome(event->monitor, *batch, event->snapshot);
+        break;
+    }
+    case Event::NOTIFY:
+        send(event->msg);
+        break;
+    case Event::HOST_STATS: {
+        MonStatsMsg m(event->stats.hostId, format_stats(event->stats));
+        send(&m);
+        break;
+    }
+    case Event::DROP_ALL:
+        while (!m_monitors.empty()) {
+            remove(m_monitors.begin()->first);
+        }
+
+        break;
+    case Event::STOP:
+        m_stop = true;
+        break;
+    }
+
+    if (event->type == Event::NOTIFY) {
+        delete event->msg;
+        event->msg = 0;
+    }
+}
+
+/* A monitor that isn't batching gets everything as it comes.  If it
+   doesn't keep up, don't be clever, simply close it.  */
+void MonitorFeed::send(Msg *m)
+{
+    if (m->type == M_MON_STATS) {
+        remember(*static_cast<MonStatsMsg *>(m));
+    }
+
+    for (map<CompileServer *, Batch *>::iterator it = m_monitors.begin(); it != m_monitors.end();) {
+        CompileServer *monitor = it->first;
+        Batch &batch = *it->second;
+        ++it;
+
+        if (batch.batch_msec) {
+            bool ok;
+
+            if (m->type == M_MON_STATS) {
+                ok = sendStats(monitor, batch, m);
+            } else if (monitor->pending() > MAX_MONITOR_BACKLOG) {
+                /* It gets the stats again when it caught up, but misses the
+                   jobs meanwhile, see flushBatches().  */
+                ++batch.dropped;
+                ok = true;
+            } else {
+                ok = monitor->send_msg(*m, MsgChannel::SendQueued);
+            }
+
+            if (!ok) {
+                trace() << "monitor is gone... removing" << endl;
+                remove(monitor);
+            }
+
+            continue;
+        }
+
+        if (!monitor->send_msg(*m, MsgChannel::SendQueued) || monitor->pending() > MAX_MONITOR_BACKLOG) {
+            trace() << "monitor is blocking... removing" << endl;
+            remove(monitor);
+            continue;
+        }
+
+        m_pending.insert(monitor);
+    }
+}
+
+void MonitorFeed::remember(const MonStatsMsg &m)
+{
+    map<string, string> lines = parse_stats_lines(m.statmsg);
+
+    if (lines.count("State") && lines["State"] == "Offline") {
+        m_hosts.erase(m.hostid);
+        m_texts.erase(m.hostid);
+    } else {
+        map<string, string> &known = m_hosts[m.hostid];
+
+        for (map<string, string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            known[it->first] = it->second;
+        }
+
+        m_texts[m.hostid] = stats_lines(known);
+    }
+
+    ++m_version;
+}
+
+/* A monitor that logged in gets the hosts known so far.  The snapshot is
+   built only if something changed since the last one, so a burst of
+   monitors logging in costs one.  */
+void MonitorFeed::welcome(CompileServer *monitor, Batch &batch, bool snapshot)
+{
+    if (snapshot && m_snapshotVersion != m_version) {
+        delete m_snapshot;
+        m_snapshot = new MonSnapshotMsg;
+        m_snapshot->version = m_version;
+        m_snapshotVersion = m_version;
+
+        if (!m_snapshot->setHosts(m_texts)) {
+            trace() << "the monitor snapshot is too large, sending the hosts one by one" << endl;
+            delete m_snapshot;
+            m_snapshot = 0;
+        }
+    }
+
+    bool ok = true;
+
+    if (snapshot && m_snapshot) {
+        ok = monitor->send_msg(*m_snapshot, MsgChannel::SendQueued);
+        batch.known = m_hosts;
+    } else {
+        for (map<uint32_t, string>::const_iterator it = m_texts.begin(); ok && it != m_texts.end(); ++it) {
+            MonStatsMsg m(it->first, it->second);
+            ok = batch.batch_msec ? sendStats(monitor, batch, &m)
+                 : monitor->send_msg(m, MsgChannel::SendQueued);
+        }
+    }
+
+    if (!ok) {
+        trace() << "monitor is gone... removing" << endl;
+        remove(monitor);
+    }
+}
+
+/* Only what changed since the last batch goes to a batching monitor, and
+   only the last value of it.  A host it doesn't know yet is sent right
+   away though, as the job notifications after it refer to it.  */
+bool MonitorFeed::sendStats(CompileServer *monitor, Batch &batch, Msg *_m)
+{
+    MonStatsMsg *m = static_cast<MonStatsMsg *>(_m);
+    map<string, string> lines = parse_stats_lines(m->statmsg);
+    map<unsigned, map<string, string> >::iterator known = batch.known.find(m->hostid);
+
+    if (known == batch.known.end()) {
+        if (lines.count("State") && lines["State"] == "Offline") {
+            batch.changed.erase(m->hostid);
+            return true;
+        }
+
+        batch.known[m->hostid] = lines;
+        return monitor->send_msg(*m, MsgChannel::SendQueued);
+    }
+
+    map<string, string> &changed = batch.changed[m->hostid];
+
+    for (map<string, string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+        map<string, string>::const_iterator k = known->second.find(it->first);
+
+        if (k == known->second.end() || k->second != it->second) {
+            changed[it->first] = it->second;
+        } else {
+            changed.erase(it->first);
+        }
+    }
+
+    if (changed.empty()) {
+        batch.changed.erase(m->hostid);
+    }
+
+    return true;
+}
+
+/* Sends what the batching monitors got since their last batch, if it's
+   time for it.  Returns the msec until the next batch is due.  */
+int MonitorFeed::flushBatches()
+{
+    unsigned long long now = now_msec();
+    int timeout = INT_MAX;
+    list<CompileServer *> stalled;
+
+    for (map<CompileServer *, Batch *>::iterator it = m_monitors.begin(); it != m_monitors.end(); ++it) {
+        CompileServer *monitor = it->first;
+        Batch &batch = *it->second;
+
+        if (!batch.batch_msec) {
+            continue;
+        }
+
+        if (now < batch.last_sent + batch.batch_msec) {
+            timeout = min(timeout, int(batch.last_sent + batch.batch_msec - now));
+            continue;
+        }
+
+        timeout = min(timeout, int(batch.batch_msec));
+
+        if (monitor->pending() > MAX_MONITOR_BACKLOG) {
+            if (!batch.stalled_since) {
+                batch.stalled_since = time(0);
+            } else if (time(0) - batch.stalled_since > MONITOR_STALL_TIMEOUT) {
+                stalled.push_back(monitor);
+            }
+
+            continue;
+        }
+
+        if (batch.dropped) {
+            trace() << "monitor missed " << batch.dropped << " job notifications" << endl;
+            batch.dropped = 0;
+        }
+
+        batch.stalled_since = 0;
+        batch.last_sent = now;
+
+        for (map<unsigned, map<string, string> >::const_iterator c = batch.changed.begin();
+                c != batch.changed.end(); ++c) {
+            map<string, string> &known = batch.known[c->first];
+            map<string, string>::const_iterator state = c->second.find("State");
+
+            if (!monitor->send_msg(MonStatsMsg(c->first, stats_lines(c->second)),
+                                   MsgChannel::SendQueued)) {
+                stalled.push_back(monitor);
+                break;
+            }
+
+            if (state != c->second.end() && state->second == "Offline") {
+                batch.known.erase(c->first);
+            } else {
+                for (map<string, string>::const_iterator l = c->second.begin(); l != c->second.end(); ++l) {
+                    known[l->first] = l->second;
+                }
+            }
+        }
+
+        batch.changed.clear();
+
+        if (monitor->pending()) {
+            m_pending.insert(monitor);
+        }
+    }
+
+    for (list<CompileServer *>::const_iterator it = stalled.begin(); it != stalled.end(); ++it) {
+        trace() << "monitor is blocking... removing" << endl;
+        remove(*it);
+    }
+
+    return timeout;
+}
+
+/* One write per monitor for what was queued since the last one, polls
+   for writing on those that didn't take everything.  */
+void MonitorFeed::flushMonitors()
+{
+    for (set<CompileServer *>::iterator it = m_pending.begin(); it != m_pending.end();) {
+        CompileServer *monitor = *it++;
+
+        if (!monitor->flush(false)) {
+            trace() << "can't send to " << monitor->name << "... removing" << endl;
+            remove(monitor);
+            continue;
+        }
+
+        if (monitor->pending()) {
+            m_poller.watch(monitor->fd, Poller::Write);
+        } else {
+            m_poller.unwatch(monitor->fd);
+            m_pending.erase(monitor);
+        }
+    }
+}
+
+void MonitorFeed::remove(CompileServer *monitor)
+{
+    map<CompileServer *, Batch *>::iterator it = m_monitors.find(monitor);
+
+    if (it == m_monitors.end()) {
+        return;
+    }
+
+    m_poller.unwatch(monitor->fd);
+    m_pending.erase(monitor);
+    delete it->second;
+    m_monitors.erase(it);
+    delete monitor;
+    __atomic_sub_fetch(&m_count, 1, __ATOMIC_RELEASE);
+}
+
+void *MonitorFeed::thread(void *arg)
+{
+    MonitorFeed *feed = static_cast<MonitorFeed *>(arg);
+
+    while (true) {
+        int timeout = feed->run();
+
+        if (feed->m_stop) {
+            break;
+        }
+
+        int ready = feed->m_poller.wait(timeout == INT_MAX ? -1 : timeout);
+
+        if (ready < 0 && errno != EINTR) {
+            log_perror("monitor poller");
+            struct timespec pause = { 0, MONITOR_RETRY_MSEC * 1000 * 1000 };
+            nanosleep(&pause, 0);
+        }
+
+        // the monitors that can take more are flushed by run() anyway
+        for (int r = 0; r < ready; ++r) {
+            if (feed->m_poller.ready_fd(r) == feed->m_wake[0]) {
+                char buffer[64];
+
+                while (read(feed->m_wake[0], buffer, sizeof(buffer)) > 0) {
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MONITORFEED_H
+#define MONITORFEED_H
+
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "../services/comm.h"
+#include "../services/poller.h"
+
+class CompileServer;
+
+/* What the monitors are told about a host, formatted by the feed.  */
+struct MonitorHostStats {
+    MonitorHostStats()
+        : hostId(0)
+        , maxJobs(0)
+        , noRemote(false)
+        , speed(0)
+        , hasStats(false)
+        , load(0)
+        , loadAvg1(0)
+        , loadAvg5(0)
+        , loadAvg10(0)
+        , freeMem(0)
+    {
+    }
+
+    unsigned int hostId;
+    std::string name;
+    std::string ip;
+    std::string platform;
+    int maxJobs;
+    bool noRemote;
+    float speed;
+    // the load averages and free memory are only known from a StatsMsg
+    bool hasStats;
+    int load;
+    int loadAvg1;
+    int loadAvg5;
+    int loadAvg10;
+    int freeMem;
+};
+
+/* The monitors, fed by a thread of their own if started, so that slow
+   monitors and the formatting and batching of what they get don't hold
+   up the scheduling.  The scheduler queues what happened without
+   waiting, the feed sends it on.  Without the thread the main loop runs
+   the feed with flush().  Only the main loop may call anything but the
+   thread functions.  Once a monitor logged in, the feed keeps the stats
+   of the hosts, monitors logging in later get them from there.  */
+class MonitorFeed
+{
+public:
+    MonitorFeed();
+    ~MonitorFeed();
+
+    // false if the thread couldn't be started, the log has to be
+    // asynchronous for it
+    bool start();
+    // the monitors are closed
+    void stop();
+
+    // MONITOR logged in, the feed owns it from now on; it gets the hosts
+    // known so far as MonSnapshotMsg if it wants a snapshot
+    void add(CompileServer *monitor, unsigned int batch_msec, bool snapshot);
+    // takes M
+    void notify(Msg *m);
+    void hostStats(const MonitorHostStats &stats);
+    // closes all monitors
+    void dropAll();
+
+    bool empty() const
+    {
+        return !__atomic_load_n(&m_count, __ATOMIC_ACQUIRE);
+    }
+
+    // the stats of the hosts are kept, since the first monitor logged in
+    bool tracking() const
+    {
+        return m_tracking;
+    }
+
+    /* Wakes the thread for what was queued, or sends it right away
+       without one.  Returns the msec until the feed wants to run again.  */
+    int flush();
+
+private:
+    MonitorFeed(const MonitorFeed &);
+    MonitorFeed &operator=(const MonitorFeed &);
+
+    struct Event;
+    struct Batch;
+
+    void push(Event *event);
+    int run();
+    void handle(Event *event);
+    void send(Msg *m);
+    void remember(const MonStatsMsg &m);
+    void welcome(CompileServer *monitor, Batch &batch, bool snapshot);
+    bool sendStats(CompileServer *monitor, Batch &batch, Msg *m);
+    int flushBatches();
+    void flushMonitors();
+    void remove(CompileServer *monitor);
+    static void *thread(void *feed);
+
+    // the events are a list with a consumed stub node in front, pushed to
+    // by the main loop and taken from by the feed, see push()
+    Event *m_head;
+    Event *m_tail;
+    bool m_queued;
+
+    unsigned int m_count;
+    bool m_tracking;
+    // host id -> stats lines by key, and them formatted
+    std::map<unsigned int, std::map<std::string, std::string> > m_hosts;
+    std::map<uint32_t, std::string> m_texts;
+    // grows with every change of m_hosts
+    uint32_t m_version;
+    // 0 if the hosts don't fit one
+    MonSnapshotMsg *m_snapshot;
+    uint32_t m_snapshotVersion;
+    std::map<CompileServer *, Batch *> m_monitors;
+    // the monitors with queued output
+    std::set<CompileServer *> m_pending;
+    Poller m_poller;
+    int m_wake[2];
+    bool m_threaded;
+    bool m_stop;
+    pthread_t m_thread;
+};
+
+#endif
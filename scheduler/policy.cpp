@@ -0,0 +1,517 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "policy.h"
+
+#include <float.h>
+
+#include <algorithm>
+
+#include "../services/logging.h"
+
+#include "compileserver.h"
+#include "job.h"
+#include "serverindex.h"
+
+#define DEBUG_SCHEDULER 0
+
+// jobs known to take this many times the average go to idle servers
+#define HEAVY_JOB_FACTOR 4
+
+using namespace std;
+
+float server_speed(CompileServer *cs, Job *job)
+{
+    if (cs->lastCompiledJobs().size() == 0 || cs->cumCompiled().compileTimeUser() == 0) {
+        return 0;
+    } else {
+        float f = cs->lastCompiledJobs().speed();
+
+        // we only care for the load if we're about to add a job to it
+        if (job) {
+            if (job->submitter() == cs) {
+                /* The submitter of a job gets more speed if it's capable of handling its requests on its own.
+                   So if he is equally fast to the rest of the farm it will be preferred to chose him
+                   to compile the job.  Then this can be done locally without needing the preprocessor.
+                   However if there are more requests than the number of jobs the submitter can handle,
+                   it is assumed the submitter is doing a massively parallel build, in which case it is
+                   better not to build on the submitter and let it do other work (such as preprocessing
+                   output for other nodes) that can be done only locally.  */
+                if (cs->submittedJobsCount() <= cs->maxJobs()) {
+                    f *= 1.1;
+                } else {
+                    f *= 0.1;    // penalize heavily
+                }
+            } else { // ignoring load for submitter - assuming the load is our own
+                f *= float(1000 - cs->load()) / 1000;
+            }
+        }
+
+        /* below we add a pessimism factor - assuming the first job a computer got is not representative,
+           which the calibration benchmark is */
+        if (cs->lastCompiledJobs().size() < 7 && !cs->benchmark().done) {
+            f *= (-0.5 * cs->lastCompiledJobs().size() + 4.5);
+        }
+
+        return f;
+    }
+}
+
+float rank_speed(CompileServer *cs)
+{
+    float speed;
+
+    if (cs->lastCompiledJobs().size() == 0) {
+        speed = (cs->jobList().size() == 0 && cs->maxJobs() > 0) ? FLT_MAX : 0;
+    } else {
+        speed = server_speed(cs);
+
+        if (cs->load() < 1000) {
+            speed *= float(1000 - cs->load()) / 1000;
+        } else {
+            speed = 0;
+        }
+    }
+
+    return speed;
+}
+
+bool job_stat(Job *job, const JobDoneMsg &msg, JobStat &st)
+{
+    /* We don't want to base our timings on failed or too small jobs.  */
+    if (msg.out_uncompressed < 4096
+            || msg.exitcode != 0) {
+        return false;
+    }
+
+    st.setOutputSize(msg.out_uncompressed);
+    st.setCompileTimeReal(msg.real_msec);
+    st.setCompileTimeUser(msg.user_msec);
+    st.setCompileTimeSys(msg.sys_msec);
+    st.setJobId(job->id());
+
+    if (job->argFlags() & CompileJob::Flag_g) {
+        st.setOutputSize(st.outputSize() * 10 / 36);    // average over 1900 jobs: faktor 3.6 in osize
+    } else if (job->argFlags() & CompileJob::Flag_g3) {
+        st.setOutputSize(st.outputSize() * 10 / 45);    // average over way less jobs: factor 1.25 over -g
+    }
+
+    // the difference between the -O flags isn't as big as the one between -O0 and -O>=1
+    // the numbers are actually for gcc 3.3 - but they are _very_ rough heurstics anyway)
+    if (job->argFlags() & CompileJob::Flag_O
+            || job->argFlags() & CompileJob::Flag_O2
+            || job->argFlags() & CompileJob::Flag_Ol2) {
+        st.setOutputSize(st.outputSize() * 58 / 35);
+    }
+
+    if (job->server()->lastCompiledJobs().size() >= 7) {
+        /* Smooth out spikes by not allowing one job to add more than
+           20% of the current speed.  */
+        float this_speed = (float) st.outputSize() / (float) st.compileTimeUser();
+        /* The current speed of the server, but without adjusting to the current
+           job, hence no second argument.  */
+        float cur_speed = server_speed(job->server());
+
+        if ((this_speed / 1.2) > cur_speed) {
+            st.setOutputSize((long unsigned) (cur_speed * 1.2 * st.compileTimeUser()));
+        } else if ((this_speed * 1.2) < cur_speed) {
+            st.setOutputSize((long unsigned)(cur_speed / 1.2 * st.compileTimeUser()));
+        }
+    }
+
+    return true;
+}
+
+/* Given a candidate CS and a JOB, check all installed environments
+   on the CS for a match.  Return an empty string if none of the required
+   environments for this job is installed.  Otherwise return the
+   host platform of the first found installed environment which is among
+   the requested.  That can be send to the client, which then completely
+   specifies which environment to use (name, host platform and target
+   platform).  */
+string envs_match(const ServerIndex &servers, CompileServer *cs, const Job *job)
+{
+    if (job->submitter() == cs) {
+        return cs->hostPlatform();    // it will compile itself
+    }
+
+    /* Look at each env which could be installed from the client (i.e.
+       those coming with the job) if the candidate CS has it installed for
+       the requested target platform, and additionally could run it.  */
+    const EnvIds &environments = job->environmentIds();
+    const EnvIds &installed = job->targetEnvironmentIds();
+
+    for (size_t i = 0; i < environments.size(); ++i) {
+        if (servers.hasEnvironment(cs, installed[i])
+                && cs->platforms_compatible(name_of(env_platform(environments[i])))) {
+            return name_of(env_platform(environments[i]));
+        }
+    }
+
+    return string();
+}
+
+/* Whether CS can take JOB at all.  Servers busy installing an environment
+   can't, that's the daemon's single install slot.  */
+static bool usable(CompileServer *cs, Job *job)
+{
+    /* For now ignore overloaded servers.  */
+    /* Pre-loadable (cs->jobList().size()) == (cs->maxJobs()) is checked later.  */
+    if ((int(cs->jobList().size()) > cs->maxJobs()) || (cs->load() >= 1000)) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
+                <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
+#endif
+        return false;
+    }
+
+    // incompatible architecture or busy installing
+    if (!cs->can_install(job).size()) {
+#if DEBUG_SCHEDULER > 2
+        trace() << cs->nodeName() << " can't install " << job->id() << endl;
+#endif
+        return false;
+    }
+
+    /* Don't use non-chroot-able daemons for remote jobs.  XXX */
+    if (!cs->chrootPossible() && cs != job->submitter()) {
+        trace() << cs->nodeName() << " can't use chroot\n";
+        return false;
+    }
+
+    // Check if remote & if remote allowed
+    if (!cs->check_remote(job)) {
+        trace() << cs->nodeName() << " fails remote job check\n";
+        return false;
+    }
+
+#if DEBUG_SCHEDULER > 1
+    trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
+            cs->jobList().size() << " speed: " << server_speed(cs, job) << " compile time " <<
+            cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() << endl;
+#endif
+
+    return true;
+}
+
+/* The heuristic icecream always used: every server compiles once, then the
+   fastest server with a free slot wins, preferring servers that have the
+   environment installed unless only few have it.  */
+class LegacyPolicy : public SchedulerPolicy
+{
+public:
+    virtual const char *name() const
+    {
+        return "legacy";
+    }
+
+    virtual CompileServer *pick(const PickRequest &request);
+
+private:
+    /* One search through the servers, fastest first.  */
+    struct ServerPick {
+        ServerPick(Job *j, const ServerIndex &s, bool install)
+            : job(j)
+            , servers(s)
+            , prefer_install(install)
+            , heavy(false)
+            , best(0)
+            , bestui(0)
+            , bestpre(0)
+            , busy(0)
+        {
+        }
+
+        bool consider(CompileServer *cs);
+
+        Job *job;
+        const ServerIndex &servers;
+        // whether a server that has to install the environment is preferred
+        bool prefer_install;
+        // whether the job is expected to take much longer than most
+        bool heavy;
+        CompileServer *best;
+        // best uninstalled
+        CompileServer *bestui;
+        // best preloadable host
+        CompileServer *bestpre;
+        // best server with other jobs, for heavy jobs
+        CompileServer *busy;
+    };
+};
+
+/* Returns true if no better server can come anymore.  */
+bool LegacyPolicy::ServerPick::consider(CompileServer *cs)
+{
+    if (!usable(cs, job)) {
+        return false;
+    }
+
+    bool installed = !envs_match(servers, cs, job).empty();
+
+    if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
+        /* Make all servers compile a job at least once, so we'll get an
+           idea about their speed.  */
+        if (installed) {
+            best = cs;
+        } else {
+            // if there is one server that already got the environment and one that
+            // hasn't compiled at all, pick the one with environment first
+            bestui = cs;
+        }
+
+        return true;
+    }
+
+    /* The earlier servers were faster, so the first one with a free
+       slot is the one to take.  The fastest full one is preloaded
+       if there is nothing else.  */
+    if (int(cs->jobList().size()) >= cs->maxJobs()) {
+        if (!bestpre) {
+            bestpre = cs;
+        }
+    } else if (heavy && cs->jobList().size() != 0) {
+        /* Heavy jobs would slow down the others there, an idle
+           server is better if there is one.  */
+        if (!busy) {
+            busy = cs;
+        }
+    } else if (installed) {
+        if (!best) {
+            best = cs;
+        }
+    } else if (!bestui) {
+        bestui = cs;
+    }
+
+    return prefer_install ? bestui != 0 : best != 0;
+}
+
+CompileServer *LegacyPolicy::pick(const PickRequest &request)
+{
+    Job *job = request.job;
+    CompileServer *submitter = job->submitter();
+    const ServerIndex::Ranking &ranking = request.servers.ranking();
+
+    /* The servers that have one of the environments installed.  */
+    size_t matches = 0;
+    const EnvIds &environments = job->targetEnvironmentIds();
+
+    for (EnvIds::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        matches += request.servers.countEnvironment(*it);
+    }
+
+    // to make sure we find the fast computers at least after some time, we overwrite
+    // the install rule for every 19th job - if the farm is only filled a bit
+    ServerPick pick(job, request.servers, (matches < 11) && (matches < (ranking.size() / 3)) && ((job->id() % 19) != 0));
+    pick.heavy = request.guessMsec > HEAVY_JOB_FACTOR * request.averageMsec;
+
+    /* The servers are ranked without a job, but a submitter can compile its
+       own jobs at a different speed, see server_speed().  So it's looked at
+       where that puts it, unless it didn't compile anything yet.  */
+    bool submitter_pending = submitter->lastCompiledJobs().size() != 0
+                             && request.servers.contains(submitter);
+    float submitter_speed = server_speed(submitter, job);
+    bool done = false;
+
+    for (ServerIndex::Ranking::const_iterator it = ranking.begin();
+            !done && it != ranking.end(); ++it) {
+        if (submitter_pending && submitter_speed >= it->first) {
+            submitter_pending = false;
+            done = pick.consider(submitter);
+
+            if (done) {
+                break;
+            }
+        }
+
+        if (it->second == submitter && submitter->lastCompiledJobs().size() != 0) {
+            continue;
+        }
+
+        done = pick.consider(it->second);
+    }
+
+    if (!done && submitter_pending) {
+        pick.consider(submitter);
+    }
+
+    if (pick.bestui && pick.prefer_install) {
+        pick.best = 0;
+    }
+
+    if (!pick.best && !pick.bestui) {
+        pick.best = pick.busy;
+    }
+
+    if (pick.best) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking best installed " << pick.best->nodeName() << " " <<  server_speed(pick.best, job) << endl;
+#endif
+        return pick.best;
+    }
+
+    if (pick.bestui) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking best uninstalled " << pick.bestui->nodeName() << " " <<  server_speed(pick.bestui, job) << endl;
+#endif
+        return pick.bestui;
+    }
+
+    if (pick.bestpre) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "taking best preload " << pick.bestpre->nodeName() << " " <<  server_speed(pick.bestpre, job) << endl;
+#endif
+    }
+
+    return pick.bestpre;
+}
+
+/* Takes the server expected to have the job done first, counting the wait
+   for a free slot, the install of a missing environment, the transfer over
+   the link to the submitter and the compile itself at the speed of the
+   server.  */
+class CompletionTimePolicy : public SchedulerPolicy
+{
+public:
+    virtual const char *name() const
+    {
+        return "completion";
+    }
+
+    virtual CompileServer *pick(const PickRequest &request);
+
+private:
+    static float estimate(const PickRequest &request, CompileServer *cs);
+};
+
+/* When CS would be done with the job, in msec from now.  Servers that
+   never compiled anything are assumed to be as fast as the farm.  */
+float CompletionTimePolicy::estimate(const PickRequest &request, CompileServer *cs)
+{
+    Job *job = request.job;
+    float speed = server_speed(cs, job);
+
+    if (speed <= 0) {
+        speed = request.farmSpeed;
+
+        if (cs != job->submitter()) {
+            speed *= float(1000 - cs->load()) / 1000;
+        }
+    }
+
+    if (speed <= 0) {
+        return FLT_MAX;
+    }
+
+    float factor = request.farmSpeed / speed;
+    float msec = request.guessMsec * factor;
+    int jobs = cs->jobList().size();
+
+    /* The jobs that came first have to make room, each job on a slot
+       taking what jobs take on average there.  */
+    if (jobs >= cs->maxJobs()) {
+        msec += float(jobs - cs->maxJobs() + 1) * request.averageMsec * factor
+                / max(cs->maxJobs(), 1);
+    }
+
+    if (envs_match(request.servers, cs, job).empty()) {
+        msec += request.installMsec;
+    }
+
+    /* A far away server has to be that much faster to be worth it.  */
+    if (cs != job->submitter()) {
+        msec += cs->transferMsec(job->submitter()->name, request.transferSize);
+    }
+
+    return msec;
+}
+
+CompileServer *CompletionTimePolicy::pick(const PickRequest &request)
+{
+    Job *job = request.job;
+    CompileServer *submitter = job->submitter();
+    CompileServer *best = 0;
+    float best_msec = FLT_MAX;
+
+    if (request.servers.contains(submitter) && usable(submitter, job)) {
+        best = submitter;
+        best_msec = estimate(request, submitter);
+    }
+
+    /* Nothing can be faster than compiling at the ranked speed right away,
+       so once that is later than the best estimate, the slower servers
+       are not worth looking at.  */
+    const ServerIndex::Ranking &ranking = request.servers.ranking();
+
+    for (ServerIndex::Ranking::const_iterator it = ranking.begin(); it != ranking.end(); ++it) {
+        CompileServer *cs = it->second;
+
+        if (best && it->first < FLT_MAX) {
+            float bound = it->first > 0 ? request.guessMsec * request.farmSpeed / it->first : FLT_MAX;
+
+            if (bound >= best_msec) {
+                break;
+            }
+        }
+
+        if (cs == submitter || !usable(cs, job)) {
+            continue;
+        }
+
+        float msec = estimate(request, cs);
+
+        if (!best || msec < best_msec) {
+            best = cs;
+            best_msec = msec;
+        }
+    }
+
+#if DEBUG_SCHEDULER > 1
+    if (best) {
+        trace() << "taking " << best->nodeName() << ", done in " << best_msec << "ms" << endl;
+    }
+#endif
+
+    return best;
+}
+
+SchedulerPolicy *SchedulerPolicy::create(const string &name)
+{
+    if (name == "completion") {
+        return new CompletionTimePolicy;
+    }
+
+    if (name == "legacy") {
+        return new LegacyPolicy;
+    }
+
+    return 0;
+}
+
+const char *SchedulerPolicy::defaultName()
+{
+    return "completion";
+}
+
+const char *SchedulerPolicy::names()
+{
+    return "completion|legacy";
+}
@@ -0,0 +1,90 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <string>
+
+class CompileServer;
+class Job;
+class ServerIndex;
+
+/* What pick_server() knows about a job when it asks the policy.  The times
+   are user times in milliseconds, as the daemons report them.  */
+struct PickRequest {
+    PickRequest(Job *j, const ServerIndex &s)
+        : job(j)
+        , servers(s)
+        , guessMsec(0)
+        , averageMsec(0)
+        , farmSpeed(0)
+        , installMsec(0)
+        , transferSize(0)
+    {
+    }
+
+    Job *job;
+    const ServerIndex &servers;
+    // what the job is expected to take, and what jobs take on average
+    unsigned long guessMsec;
+    unsigned long averageMsec;
+    // output per user msec of all jobs, in the units of server_speed()
+    float farmSpeed;
+    // what installing an environment on a server takes
+    unsigned long installMsec;
+    // the bytes of source and object files the job is expected to move
+    unsigned long transferSize;
+};
+
+/* Decides which of the servers compiles a job.  pick_server() handles the
+   cases that leave no choice (preferred hosts, trivial jobs, no statistics
+   yet) and asks the policy for all others.  */
+class SchedulerPolicy
+{
+public:
+    virtual ~SchedulerPolicy() {}
+
+    virtual const char *name() const = 0;
+    // 0 if no server can take the job now
+    virtual CompileServer *pick(const PickRequest &request) = 0;
+
+    // 0 for an unknown name
+    static SchedulerPolicy *create(const std::string &name);
+    static const char *defaultName();
+    // the known names, separated by '|', for the usage message
+    static const char *names();
+};
+
+class JobDoneMsg;
+struct JobStat;
+
+float server_speed(CompileServer *cs, Job *job = 0);
+/* The speed CS is ranked with in the ServerIndex.  Servers that never
+   compiled anything come first while they are idle, so that every server
+   gets to compile at least once.  */
+float rank_speed(CompileServer *cs);
+/* What the finished JOB tells about the speed of its server, with the
+   output size weighed by the flags.  False for failed or too small jobs,
+   they tell nothing.  */
+bool job_stat(Job *job, const JobDoneMsg &msg, JobStat &st);
+std::string envs_match(const ServerIndex &servers, CompileServer *cs, const Job *job);
+
+#endif
@@ -0,0 +1,617 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+/* Replays a trace recorded by icecc-scheduler --trace-file against
+   simulated daemons, to see what a scheduling policy would have made of
+   that load.  The jobs come at the recorded times and take what they took,
+   scaled by how fast the server they compiled on was compared to the one
+   the policy picks.  The simulated daemons report a load from their jobs
+   only, and preprocessing and transfers are not simulated.  */
+
+#ifndef _GNU_SOURCE
+// getopt_long
+#define _GNU_SOURCE 1
+#endif
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include "../services/comm.h"
+#include "../services/logging.h"
+
+#include "compileserver.h"
+#include "job.h"
+#include "jobcost.h"
+#include "jobstat.h"
+#include "policy.h"
+#include "serverindex.h"
+#include "trace.h"
+
+using namespace std;
+
+// what installing an environment is assumed to take, like the scheduler does
+#define ENV_INSTALL_MSEC 5000
+
+struct SimHost;
+
+struct SimJob {
+    SimJob()
+        : job(0), done(0), server(0), requested(0), started(-1), finished(-1) {}
+
+    Job *job;
+    const TraceRecord *done;
+    SimHost *server;
+    double requested;
+    double started;
+    double finished;
+};
+
+struct SimHost {
+    SimHost()
+        : cs(0), factor(1), running(0), installing(false), online(0), busyMsec(0), onlineMsec(0) {}
+
+    CompileServer *cs;
+    // how much longer than the farm average a job takes here
+    double factor;
+    int running;
+    bool installing;
+    list<SimJob *> waiting;  // preloaded, until a slot is free
+    double online;
+    double busyMsec;  // slot msec used
+    double onlineMsec;  // slot msec available
+};
+
+struct Event {
+    enum Type {
+        RECORD,
+        INSTALLED,
+        FINISHED
+    };
+
+    double msec;
+    unsigned long seq;  // keeps events at the same time in order
+    Type type;
+    const TraceRecord *record;
+    SimHost *host;
+    SimJob *job;
+
+    bool operator<(const Event &other) const
+    {
+        return msec != other.msec ? msec > other.msec : seq > other.seq;
+    }
+};
+
+class Replay
+{
+public:
+    Replay(SchedulerPolicy *policy, unsigned long install_msec)
+        : m_policy(policy), m_installMsec(install_msec), m_seq(0), m_installs(0) {}
+
+    void load(const vector<TraceRecord> &records);
+    void run();
+    void report() const;
+
+private:
+    void push(double msec, Event::Type type, const TraceRecord *record, SimHost *host, SimJob *job);
+    void handle(const Event &event, double now);
+    void schedule(double now);
+    CompileServer *pick(Job *job);
+    void start(SimJob *job, double now);
+    void update(SimHost *host);
+    double recordedFactor(const SimJob *job) const;
+
+    SchedulerPolicy *m_policy;
+    unsigned long m_installMsec;
+    unsigned long m_seq;
+    priority_queue<Event> m_events;
+    ServerIndex m_index;
+    list<CompileServer *> m_css;
+    map<unsigned, SimHost *> m_hosts;  // by recorded host id
+    map<CompileServer *, SimHost *> m_byServer;
+    map<unsigned, const TraceRecord *> m_done;  // by job id, from the server
+    map<unsigned, double> m_factors;  // by recorded host id
+    map<unsigned, unsigned> m_recordedServer;  // by job id
+    list<SimJob *> m_queue;
+    vector<SimJob *> m_jobs;
+    JobStatHistory m_jobStats;
+    JobCosts m_costs;
+    unsigned long m_installs;
+};
+
+void Replay::push(double msec, Event::Type type, const TraceRecord *record, SimHost *host,
+                  SimJob *job)
+{
+    Event event;
+    event.msec = msec;
+    event.seq = m_seq++;
+    event.type = type;
+    event.record = record;
+    event.host = host;
+    event.job = job;
+    m_events.push(event);
+}
+
+/* How fast the hosts are is learned from the whole trace first, as user
+   time per output byte compared to the farm.  */
+void Replay::load(const vector<TraceRecord> &records)
+{
+    map<unsigned, pair<double, double> > per_host;
+    double user = 0, out = 0;
+
+    for (vector<TraceRecord>::const_iterator it = records.begin(); it != records.end(); ++it) {
+        if (it->type == TraceRecord::BEGIN) {
+            m_recordedServer[it->job] = it->host;
+        } else if (it->type == TraceRecord::DONE && (it->flags & TraceRecord::FROM_SERVER)) {
+            m_done[it->job] = &*it;
+
+            if (it->exitcode == 0 && it->outSize >= 4096 && it->userMsec) {
+                per_host[it->host].first += it->userMsec;
+                per_host[it->host].second += it->outSize;
+                user += it->userMsec;
+                out += it->outSize;
+            }
+        }
+
+        push(it->msec, Event::RECORD, &*it, 0, 0);
+    }
+
+    for (map<unsigned, pair<double, double> >::const_iterator it = per_host.begin();
+            it != per_host.end(); ++it) {
+        if (user > 0 && it->second.second > 0) {
+            m_factors[it->first] = (it->second.first / it->second.second) / (user / out);
+        }
+    }
+}
+
+/* The factor of the host the job compiled on when it was recorded.  */
+double Replay::recordedFactor(const SimJob *job) const
+{
+    map<unsigned, unsigned>::const_iterator server = m_recordedServer.find(job->job->id());
+
+    if (server == m_recordedServer.end()) {
+        return 1;
+    }
+
+    map<unsigned, double>::const_iterator factor = m_factors.find(server->second);
+    return factor != m_factors.end() ? max(factor->second, 0.01) : 1;
+}
+
+void Replay::update(SimHost *host)
+{
+    CompileServer *cs = host->cs;
+    // they report much like this, if the jobs are all they do
+    cs->setLoad(min(999, host->running * 1000 / max(cs->maxJobs(), 1)));
+    m_index.setSpeed(cs, rank_speed(cs));
+}
+
+void Replay::handle(const Event &event, double now)
+{
+    if (event.type == Event::INSTALLED) {
+        SimHost *host = event.host;
+        host->installing = false;
+        host->cs->setBusyInstalling(0);
+        m_index.setEnvironments(host->cs, host->cs->compilerVersionIds());
+
+        while (!host->waiting.empty() && host->running < host->cs->maxJobs()) {
+            SimJob *job = host->waiting.front();
+            host->waiting.pop_front();
+            start(job, now);
+        }
+
+        update(host);
+        return;
+    }
+
+    if (event.type == Event::FINISHED) {
+        SimJob *job = event.job;
+        SimHost *host = job->server;
+        job->finished = now;
+        --host->running;
+        host->busyMsec += now - job->started;
+        host->cs->removeJob(job->job);
+
+        JobDoneMsg msg(job->job->id(), job->done->exitcode);
+        msg.real_msec = job->finished - job->started;
+        msg.user_msec = job->done->userMsec * host->factor / recordedFactor(job);
+        msg.in_uncompressed = job->done->inSize;
+        msg.out_uncompressed = job->done->outSize;
+        JobStat st;
+
+        if (job_stat(job->job, msg, st)) {
+            host->cs->appendCompiledJob(st);
+            job->job->submitter()->appendRequestedJobs(st);
+            m_jobStats.append(st);
+        }
+
+        if (msg.exitcode == 0 && msg.user_msec) {
+            m_costs.learn(job->job->fileName(), msg.user_msec, msg.in_uncompressed,
+                          msg.out_uncompressed);
+        }
+
+        if (!host->waiting.empty() && !host->installing) {
+            SimJob *next = host->waiting.front();
+            host->waiting.pop_front();
+            start(next, now);
+        }
+
+        update(host);
+        return;
+    }
+
+    const TraceRecord *record = event.record;
+
+    switch (record->type) {
+    case TraceRecord::LOGIN: {
+        SimHost *host = new SimHost;
+        /* Nothing is sent to it, but MsgChannel wants a file descriptor.  A
+           text based one doesn't say hello and has the current protocol.  */
+        host->cs = new CompileServer(open("/dev/null", O_RDWR), 0, 0, true);
+        host->cs->name = record->name;
+        host->cs->setNodeName(record->name);
+        host->cs->setHostPlatform(record->platform);
+        host->cs->setMaxJobs(record->maxJobs);
+        host->cs->setNoRemote(record->flags & TraceRecord::NO_REMOTE);
+        host->cs->setChrootPossible(record->flags & TraceRecord::CHROOT);
+        host->cs->setCompilerVersions(record->envs);
+        host->cs->setType(CompileServer::DAEMON);
+        host->cs->setHostId(record->host);
+        host->factor = m_factors.count(record->host) ? m_factors[record->host] : 1;
+        host->online = now;
+        m_hosts[record->host] = host;
+        m_byServer[host->cs] = host;
+        m_css.push_back(host->cs);
+        m_index.add(host->cs, 0);
+        m_index.setEnvironments(host->cs, host->cs->compilerVersionIds());
+        update(host);
+        break;
+    }
+    case TraceRecord::LOGOUT: {
+        map<unsigned, SimHost *>::iterator it = m_hosts.find(record->host);
+
+        /* The jobs it has are finished still, it goes away for new ones.  */
+        if (it != m_hosts.end() && m_index.contains(it->second->cs)) {
+            it->second->onlineMsec += (now - it->second->online) * it->second->cs->maxJobs();
+            it->second->online = -1;
+            m_index.remove(it->second->cs);
+            m_css.remove(it->second->cs);
+        }
+
+        break;
+    }
+    case TraceRecord::REQUEST: {
+        map<unsigned, SimHost *>::iterator submitter = m_hosts.find(record->host);
+        map<unsigned, const TraceRecord *>::const_iterator done = m_done.find(record->job);
+
+        // jobs that never compiled anywhere can't be replayed
+        if (submitter == m_hosts.end() || done == m_done.end()) {
+            break;
+        }
+
+        SimJob *job = new SimJob;
+        job->job = new Job(record->job, submitter->second->cs);
+        job->job->setEnvironments(record->envs);
+        job->job->setTargetPlatform(record->platform);
+        job->job->setArgFlags(record->flags);
+        job->job->setFileName(record->name);
+        job->job->setPreferredHost(record->preferredHost);
+        job->job->setJobClass(record->jobClass);
+        job->done = done->second;
+        job->requested = now;
+        m_jobs.push_back(job);
+        m_queue.push_back(job);
+        break;
+    }
+    default:
+        // what the policy decided then is what is replaced here
+        break;
+    }
+}
+
+/* Like pick_server() in the scheduler, without the trivial jobs that stay
+   on their submitter.  */
+CompileServer *Replay::pick(Job *job)
+{
+    if (!job->preferredHost().empty()) {
+        for (list<CompileServer *>::const_iterator it = m_css.begin(); it != m_css.end(); ++it) {
+            if ((*it)->matches(job->preferredHost()) && (*it)->is_eligible(job)) {
+                return *it;
+            }
+        }
+
+        return 0;
+    }
+
+    if (m_jobStats.empty()) {
+        // the scheduler picks one at random
+        for (list<CompileServer *>::const_iterator it = m_css.begin(); it != m_css.end(); ++it) {
+            if ((*it)->is_eligible(job)) {
+                return *it;
+            }
+        }
+
+        return 0;
+    }
+
+    PickRequest request(job, m_index);
+    JobCost cost;
+    bool known = m_costs.predict(job->fileName(), cost);
+    request.averageMsec = m_jobStats.cumulated().compileTimeUser() / m_jobStats.size();
+
+    if (known) {
+        request.guessMsec = cost.userMsec;
+        request.transferSize = cost.inputSize + cost.outputSize;
+    } else if (job->submitter()->lastRequestedJobs().size() > 0) {
+        request.guessMsec = job->submitter()->cumRequested().compileTimeUser()
+                            / job->submitter()->lastRequestedJobs().size();
+    } else {
+        request.guessMsec = request.averageMsec;
+    }
+
+    if (m_jobStats.cumulated().compileTimeUser()) {
+        request.farmSpeed = float(m_jobStats.cumulated().outputSize())
+                            / m_jobStats.cumulated().compileTimeUser();
+    }
+
+    request.installMsec = m_installMsec;
+    return m_policy->pick(request);
+}
+
+void Replay::start(SimJob *job, double now)
+{
+    SimHost *host = job->server;
+    job->started = now;
+    ++host->running;
+    push(now + job->done->realMsec * host->factor / recordedFactor(job), Event::FINISHED, 0, host,
+         job);
+}
+
+/* Each waiting job gets a server if one can take it, in the order they
+   came, like empty_queue() in the scheduler.  */
+void Replay::schedule(double now)
+{
+    for (list<SimJob *>::iterator it = m_queue.begin(); it != m_queue.end();) {
+        SimJob *job = *it;
+        CompileServer *cs = pick(job->job);
+
+        if (!cs) {
+            ++it;
+            continue;
+        }
+
+        it = m_queue.erase(it);
+        SimHost *host = m_byServer[cs];
+        bool installed = !envs_match(m_index, cs, job->job).empty();
+        job->server = host;
+        job->job->setServer(cs);
+        job->job->setState(Job::COMPILING);
+        cs->appendJob(job->job);
+
+        if (!installed) {
+            string platform = cs->can_install(job->job);
+            Environments envs = cs->compilerVersions();
+            Environments wanted = job->job->environments();
+
+            for (Environments::const_iterator env = wanted.begin(); env != wanted.end(); ++env) {
+                if (env->first == platform) {
+                    envs.push_back(*env);
+                    break;
+                }
+            }
+
+            cs->setCompilerVersions(envs);
+            cs->setBusyInstalling(time(0));
+            host->installing = true;
+            ++m_installs;
+            push(now + m_installMsec, Event::INSTALLED, 0, host, 0);
+        }
+
+        if (host->installing || host->running >= cs->maxJobs()) {
+            host->waiting.push_back(job);
+        } else {
+            start(job, now);
+        }
+
+        update(host);
+    }
+}
+
+void Replay::run()
+{
+    while (!m_events.empty()) {
+        double now = m_events.top().msec;
+
+        while (!m_events.empty() && m_events.top().msec == now) {
+            Event event = m_events.top();
+            m_events.pop();
+            handle(event, now);
+        }
+
+        schedule(now);
+    }
+}
+
+static double percentile(vector<double> values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, size_t(p * values.size()))];
+}
+
+void Replay::report() const
+{
+    vector<double> waits;
+    double first = -1, last = 0, busy = 0, available = 0;
+    size_t unfinished = 0;
+
+    for (vector<SimJob *>::const_iterator it = m_jobs.begin(); it != m_jobs.end(); ++it) {
+        if ((*it)->finished < 0) {
+            ++unfinished;
+            continue;
+        }
+
+        waits.push_back((*it)->started - (*it)->requested);
+
+        if (first < 0 || (*it)->requested < first) {
+            first = (*it)->requested;
+        }
+
+        last = max(last, (*it)->finished);
+    }
+
+    for (map<unsigned, SimHost *>::const_iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        const SimHost *host = it->second;
+        busy += host->busyMsec;
+        available += host->onlineMsec;
+
+        if (host->online >= 0) {
+            available += (last - max(host->online, first)) * host->cs->maxJobs();
+        }
+    }
+
+    double sum = 0;
+
+    for (vector<double>::const_iterator it = waits.begin(); it != waits.end(); ++it) {
+        sum += *it;
+    }
+
+    cout << "policy: " << m_policy->name() << "\n"
+         << "jobs: " << waits.size() << " (" << unfinished << " could not be placed)\n"
+         << "makespan: " << (first < 0 ? 0 : (last - first) / 1000) << " s\n"
+         << "queue wait: mean " << (waits.empty() ? 0 : sum / waits.size())
+         << " ms, median " << percentile(waits, 0.5)
+         << " ms, 95% " << percentile(waits, 0.95)
+         << " ms, max " << percentile(waits, 1) << " ms\n"
+         << "utilization: " << (available > 0 ? 100 * busy / available : 0) << " %\n"
+         << "environment installs: " << m_installs << endl;
+}
+
+static void usage(const char *reason = 0)
+{
+    if (reason) {
+        cerr << reason << endl;
+    }
+
+    cerr << "usage: icecc-scheduler-replay [options] <trace file>\n"
+         << "Options:\n"
+         << "  -P, --policy <" << SchedulerPolicy::names() << ">\n"
+         << "  -i, --install-msec <msec>\n"
+         << "  -h, --help\n"
+         << "  -v[v[v]]]\n"
+         << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    SchedulerPolicy *policy = 0;
+    unsigned long install_msec = ENV_INSTALL_MSEC;
+    int debug_level = Error;
+
+    while (true) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            { "policy", 1, NULL, 'P'},
+            { "install-msec", 1, NULL, 'i'},
+            { "help", 0, NULL, 'h' },
+            { 0, 0, 0, 0 }
+        };
+
+        const int c = getopt_long(argc, argv, "P:i:hv", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'P':
+            delete policy;
+            policy = SchedulerPolicy::create(optarg);
+
+            if (!policy) {
+                usage("Error: Unknown scheduling policy specified");
+            }
+
+            break;
+        case 'i':
+            install_msec = strtoul(optarg, 0, 10);
+            break;
+        case 'v':
+
+            if (debug_level & Warning) {
+                if (debug_level & Info) {
+                    debug_level |= Debug;
+                } else {
+                    debug_level |= Info;
+                }
+            } else {
+                debug_level |= Warning;
+            }
+
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+    }
+
+    setup_debug(debug_level, "");
+
+    if (!policy) {
+        policy = SchedulerPolicy::create(SchedulerPolicy::defaultName());
+    }
+
+    TraceReader reader;
+    vector<TraceRecord> records;
+    TraceRecord record;
+
+    if (!reader.open(argv[optind])) {
+        cerr << argv[optind] << " is not a scheduler trace" << endl;
+        return 1;
+    }
+
+    while (reader.read(record)) {
+        records.push_back(record);
+    }
+
+    if (reader.error()) {
+        cerr << "the trace is broken after " << records.size() << " records, replaying those" << endl;
+    }
+
+    Replay replay(policy, install_msec);
+    replay.load(records);
+    replay.run();
+    replay.report();
+    return 0;
+}
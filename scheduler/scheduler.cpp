@@ -32,33 +32,111 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <time.h>
+#include <float.h>
+#include <limits.h>
 #include <getopt.h>
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <queue>
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <stdio.h>
 #include <pwd.h>
+#include <netdb.h>
+#include <poll.h>
 #include "../services/comm.h"
+#include "../services/exitcode.h"
 #include "../services/logging.h"
 #include "../services/job.h"
+#include "../services/poller.h"
 #include "config.h"
 
 #include "compileserver.h"
+#include "federation.h"
 #include "job.h"
+#include "jobcost.h"
+#include "metrics.h"
+#include "monitorfeed.h"
+#include "policy.h"
+#include "serverindex.h"
+#include "statsfile.h"
+#include "trace.h"
 
 #define DEBUG_SCHEDULER 0
 
+// how often the statistics are saved, in seconds
+#define STATS_SAVE_INTERVAL 300
+
+// how often a scheduler tells its standby schedulers that it's alive, in seconds
+#define STANDBY_PING_INTERVAL 2
+// a standby scheduler takes over when the primary one is silent that long
+#define STANDBY_TIMEOUT 10
+// how long the jobs of the primary scheduler wait for their daemons to log in
+#define STANDBY_JOB_TIMEOUT 60
+// the state sent to a standby scheduler at once
+#define STANDBY_CHUNK (256 * 1024)
+// queued state a standby scheduler may have before it is considered blocking
+#define MAX_STANDBY_BACKLOG (64 * 1024 * 1024)
+
+// how often the schedulers of other farms are told the free slots, in seconds
+#define FEDERATION_INTERVAL 2
+// connecting to the scheduler of another farm, and again after it went away
+#define FEDERATION_CONNECT_TIMEOUT 2
+#define FEDERATION_RETRY 30
+// set in the ids of the jobs of other farms, and never in the ones of this one
+#define FEDERATED_JOB_BIT 0x80000000U
+
+// jobs known to take less user time (ms) are compiled by the submitter
+#define TRIVIAL_JOB_MSEC 100
+// what installing an environment takes until the first one was seen
+#define ENV_INSTALL_MSEC 5000
+
+// how often idle servers may be sent environments ahead of time, in seconds
+#define SEED_INTERVAL 2
+// environments asked for that often recently are seeded to idle servers
+#define SEED_MIN_REQUESTS 20
+// the popularity of an environment halves that often, in seconds
+#define ENV_POPULARITY_HALFLIFE 300
+// servers fetching an environment ahead of time at once
+#define MAX_SEEDING 4
+
+// default weights of the job classes in the fair share of the farm
+#define INTERACTIVE_WEIGHT 8
+#define CI_WEIGHT 2
+#define BATCH_WEIGHT 1
+// what a job counts in the fair share when nothing is known about it, in ms
+#define FAIR_SHARE_UNIT_MSEC 1000
+
+// jobs compiling for less than that are never given a duplicate, in seconds
+#define HEDGE_MIN_SECONDS 10
+
+// how often the submitters of waiting jobs are told how long they take, in seconds
+#define WAIT_NOTICE_INTERVAL 5
+
+// how often an idle server compiles the calibration benchmark, in seconds
+#define BENCHMARK_INTERVAL 1800
+// how often a quarantined one gets another chance, in seconds
+#define BENCHMARK_RETRY 300
+// a benchmark not back by then is given up, in seconds
+#define BENCHMARK_TIMEOUT 120
+// servers compiling the benchmark at once
+#define MAX_BENCHMARKING 2
+// a server taking that many times longer than its best run is quarantined
+#define BENCHMARK_SLOWDOWN 2
+
 /* TODO:
    * leak check
    * are all filedescs closed when done?
@@ -94,6 +172,11 @@ using namespace std;
 static string pidFilePath;
 
 static map<int, CompileServer *> fd2cs;
+static Poller poller;
+// channels with output queued by queue_msg(), see flush_channels()
+static set<int> pending_fds;
+// channels with messages left in their input buffer, see handle_input()
+static set<int> unhandled_fds;
 static volatile sig_atomic_t exit_main_loop = false;
 
 time_t starttime;
@@ -102,7 +185,11 @@ static unsigned int scheduler_port = 8765;
 
 // A subset of connected_hosts representing the compiler servers
 static list<CompileServer *> css;
-static list<CompileServer *> monitors;
+// the logged in compile servers by environment and speed
+static ServerIndex server_index;
+static MonitorFeed monitor_feed;
+
+static Metrics metrics;
 static list<CompileServer *> controls;
 static list<string> block_css;
 static unsigned int new_job_id;
@@ -113,14 +200,75 @@ static map<unsigned int, Job *> jobs;
 struct UnansweredList {
     list<Job *> l;
     CompileServer *server;
+    unsigned int job_class;
+    /* The requests are answered by weighted fair queueing: the list with
+       the earliest virtual time goes first, and the time advances by the
+       cost of each request answered divided by the weight of the class.  */
+    double vtime;
     bool remove_job(Job *);
 };
+// one list per submitter and job class
 static list<UnansweredList *> toanswer;
+// the virtual time of the last request answered, new lists start there
+static double fair_vtime = 0;
+static unsigned int class_weights[JC_COUNT] = { INTERACTIVE_WEIGHT, CI_WEIGHT, BATCH_WEIGHT };
+static const char *const class_names[JC_COUNT] = { "interactive", "ci", "batch" };
+
+static JobStatHistory all_job_stats(2000);
+// what the jobs for each source file cost the last times
+static JobCosts job_costs;
+// how long the servers took to install an environment recently
+static unsigned long install_msec = ENV_INSTALL_MSEC;
+// what the jobs send and get back on average, preprocessed and uncompressed
+static unsigned long transfer_size = 0;
+// how often the environments were asked for recently, see seed_environments()
+static map<pair<string, string>, double> env_popularity;
+// the servers fetching an environment from another one for seed_environments()
+static set<CompileServer *> seeding;
+static SchedulerPolicy *policy = 0;
+static StatsFile *stats_file = 0;
+// what happens in the farm is recorded there, for icecc-scheduler-replay
+static TraceWriter *trace_writer = 0;
+// jobs running that many times longer than expected get a duplicate, 0: never
+static float hedge_factor = 0;
+static time_t last_hedge_check = 0;
+static time_t last_wait_check = 0;
+// the object files the benchmark gave in each environment, and on which servers
+static map<pair<string, string>, map<string, set<string> > > benchmark_hashes;
+
+/* The compression dictionary of an environment, see CompressionDictMsg.  */
+struct CompressionDict {
+    unsigned int id;
+    string data;
+};
+static map<pair<string, string>, CompressionDict> compression_dicts;
+// about 110 KB each
+#define MAX_COMPRESSION_DICTS 256
 
-static list<JobStat> all_job_stats;
-static JobStat cum_job_stats;
+// standby schedulers, they get sent what changes, see replicate()
+static list<CompileServer *> standbys;
 
-static float server_speed(CompileServer *cs, Job *job = 0);
+/* A job of the primary scheduler, as a standby scheduler knows it.  */
+struct StandbyJob {
+    string server;
+    string submitter;
+};
+static map<unsigned int, StandbyJob> standby_jobs;
+// when the standby scheduler took over from the primary one
+static time_t takeover_time = 0;
+
+static Federation federation;
+// jobs sent to another farm that didn't answer yet, by id
+static map<unsigned int, CompileServer *> federation_pending;
+// jobs of this farm compiling in another one, by the id they have there
+static map<unsigned int, CompileServer *> federation_jobs;
+// the last id given to a job of another farm
+static unsigned int federated_job_id = 0;
+
+static void rank_server(CompileServer *cs);
+static bool forward_job(Job *job);
+static void take_over_jobs();
+static void replicate(const string &lines);
 static void broadcast_scheduler_version();
 
 /* Searches the queue for JOB and removes it.
@@ -142,69 +290,22 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
     JobStat st;
 
-    /* We don't want to base our timings on failed or too small jobs.  */
-    if (msg->out_uncompressed < 4096
-            || msg->exitcode != 0) {
+    if (!job_stat(job, *msg, st)) {
         return;
     }
 
-    st.setOutputSize(msg->out_uncompressed);
-    st.setCompileTimeReal(msg->real_msec);
-    st.setCompileTimeUser(msg->user_msec);
-    st.setCompileTimeSys(msg->sys_msec);
-    st.setJobId(job->id());
-
-    if (job->argFlags() & CompileJob::Flag_g) {
-        st.setOutputSize(st.outputSize() * 10 / 36);    // average over 1900 jobs: faktor 3.6 in osize
-    } else if (job->argFlags() & CompileJob::Flag_g3) {
-        st.setOutputSize(st.outputSize() * 10 / 45);    // average over way less jobs: factor 1.25 over -g
-    }
-
-    // the difference between the -O flags isn't as big as the one between -O0 and -O>=1
-    // the numbers are actually for gcc 3.3 - but they are _very_ rough heurstics anyway)
-    if (job->argFlags() & CompileJob::Flag_O
-            || job->argFlags() & CompileJob::Flag_O2
-            || job->argFlags() & CompileJob::Flag_Ol2) {
-        st.setOutputSize(st.outputSize() * 58 / 35);
-    }
-
-    if (job->server()->lastCompiledJobs().size() >= 7) {
-        /* Smooth out spikes by not allowing one job to add more than
-           20% of the current speed.  */
-        float this_speed = (float) st.outputSize() / (float) st.compileTimeUser();
-        /* The current speed of the server, but without adjusting to the current
-           job, hence no second argument.  */
-        float cur_speed = server_speed(job->server());
-
-        if ((this_speed / 1.2) > cur_speed) {
-            st.setOutputSize((long unsigned) (cur_speed * 1.2 * st.compileTimeUser()));
-        } else if ((this_speed * 1.2) < cur_speed) {
-            st.setOutputSize((long unsigned)(cur_speed / 1.2 * st.compileTimeUser()));
-        }
-    }
-
     job->server()->appendCompiledJob(st);
-    job->server()->setCumCompiled(job->server()->cumCompiled() + st);
-
-    if (job->server()->lastCompiledJobs().size() > 200) {
-        job->server()->setCumCompiled(job->server()->cumCompiled() - *job->server()->lastCompiledJobs().begin());
-        job->server()->popCompiledJob();
-    }
-
+    rank_server(job->server());
     job->submitter()->appendRequestedJobs(st);
-    job->submitter()->setCumRequested(job->submitter()->cumRequested() + st);
+    all_job_stats.append(st);
 
-    if (job->submitter()->lastRequestedJobs().size() > 200) {
-        job->submitter()->setCumRequested(job->submitter()->cumRequested() - *job->submitter()->lastRequestedJobs().begin());
-        job->submitter()->popRequestedJobs();
-    }
-
-    all_job_stats.push_back(st);
-    cum_job_stats += st;
-
-    if (all_job_stats.size() > 2000) {
-        cum_job_stats -= *all_job_stats.begin();
-        all_job_stats.pop_front();
+    if (!standbys.empty()) {
+        time_t now = time(0);
+        replicate(StatsFile::statLine("job", st)
+                  + StatsFile::nodeLine(job->server()->nodeName(), now)
+                  + StatsFile::statLine("compiled", st)
+                  + StatsFile::nodeLine(job->submitter()->nodeName(), now)
+                  + StatsFile::statLine("requested", st));
     }
 
 #if DEBUG_SCHEDULER > 1
@@ -227,99 +328,152 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 
 static bool handle_end(CompileServer *cs, Msg *);
 
+/* Queues a message that isn't urgent, see flush_channels().  */
+static bool queue_msg(CompileServer *cs, const Msg &m)
+{
+    if (!cs->send_msg(m, MsgChannel::SendQueued)) {
+        return false;
+    }
+
+    pending_fds.insert(cs->fd);
+    return true;
+}
+
+static unsigned long long now_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void record_trace(TraceRecord &record)
+{
+    if (trace_writer && !trace_writer->write(record)) {
+        log_error() << "writing the trace failed, not recording anymore" << endl;
+        delete trace_writer;
+        trace_writer = 0;
+    }
+}
+
 static void notify_monitors(Msg *m)
 {
-    list<CompileServer *>::iterator it;
-    list<CompileServer *>::iterator it_old;
+    // the feed keeps the stats of the hosts for the monitors to come
+    if (monitor_feed.empty() && (m->type != M_MON_STATS || !monitor_feed.tracking())) {
+        delete m;
+        return;
+    }
 
-    for (it = monitors.begin(); it != monitors.end();) {
-        it_old = it++;
+    monitor_feed.notify(m);
+}
+
+/* Sends LINES to the standby schedulers, which apply them to their copy
+   of the state, see apply_standby_state().  */
+static void replicate(const string &lines)
+{
+    for (list<CompileServer *>::iterator it = standbys.begin(); it != standbys.end();) {
+        CompileServer *standby = *it++;
 
-        /* If we can't send it, don't be clever, simply close this monitor.  */
-        if (!(*it_old)->send_msg(*m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
-            trace() << "monitor is blocking... removing" << endl;
-            handle_end(*it_old, 0);
+        if (!queue_msg(standby, StandbyStateMsg(lines)) || standby->pending() > MAX_STANDBY_BACKLOG) {
+            trace() << "standby scheduler is blocking... removing" << endl;
+            handle_end(standby, 0);
         }
     }
+}
 
-    delete m;
+static void replicate_job_done(Job *job)
+{
+    if (!standbys.empty() && job->server()) {
+        replicate("done " + toString(job->id()) + "\n");
+    }
 }
 
-static float server_speed(CompileServer *cs, Job *job)
+static CompileServer *find_channel(int fd)
 {
-    if (cs->lastCompiledJobs().size() == 0 || cs->cumCompiled().compileTimeUser() == 0) {
-        return 0;
-    } else {
-        float f = (float)cs->cumCompiled().outputSize()
-                  / (float) cs->cumCompiled().compileTimeUser();
-
-        // we only care for the load if we're about to add a job to it
-        if (job) {
-            if (job->submitter() == cs) {
-                /* The submitter of a job gets more speed if it's capable of handling its requests on its own.
-                   So if he is equally fast to the rest of the farm it will be preferred to chose him
-                   to compile the job.  Then this can be done locally without needing the preprocessor.
-                   However if there are more requests than the number of jobs the submitter can handle,
-                   it is assumed the submitter is doing a massively parallel build, in which case it is
-                   better not to build on the submitter and let it do other work (such as preprocessing
-                   output for other nodes) that can be done only locally.  */
-                if (cs->submittedJobsCount() <= cs->maxJobs()) {
-                    f *= 1.1;
-                } else {
-                    f *= 0.1;    // penalize heavily
-                }
-            } else { // ignoring load for submitter - assuming the load is our own
-                f *= float(1000 - cs->load()) / 1000;
+    map<int, CompileServer *>::const_iterator it = fd2cs.find(fd);
+
+    if (it != fd2cs.end()) {
+        return it->second;
+    }
+
+    return 0;
+}
+
+/* Sends the messages queued with queue_msg() during this main loop
+   iteration, one write per channel, and polls for writing on the
+   channels that didn't take everything.  Urgent messages (like UseCSMsg)
+   are sent right away and take the queued ones along.  */
+static void flush_channels()
+{
+    list<int> failed;
+
+    for (set<int>::iterator it = pending_fds.begin(); it != pending_fds.end();) {
+        int fd = *it;
+        CompileServer *cs = find_channel(fd);
+
+        if (!cs || !cs->flush(false)) {
+            if (cs) {
+                failed.push_back(fd);
             }
+
+            pending_fds.erase(it++);
+            continue;
         }
 
-        // below we add a pessimism factor - assuming the first job a computer got is not representative
-        if (cs->lastCompiledJobs().size() < 7) {
-            f *= (-0.5 * cs->lastCompiledJobs().size() + 4.5);
+        int events = fd2cs.count(fd) ? Poller::Read : 0;
+
+        if (cs->pending()) {
+            events |= Poller::Write;
+            ++it;
+        } else {
+            pending_fds.erase(it++);
         }
 
-        return f;
+        poller.watch(fd, events);
+    }
+
+    /* handle_end() may remove more channels (standbys), look them up again.  */
+    for (list<int>::const_iterator it = failed.begin(); it != failed.end(); ++it) {
+        if (CompileServer *cs = find_channel(*it)) {
+            trace() << "can't send to " << cs->name << "... removing" << endl;
+            handle_end(cs, 0);
+        }
     }
 }
 
+/* Orders CS among the servers pick_server() looks at first.  */
+static void rank_server(CompileServer *cs)
+{
+    server_index.setSpeed(cs, rank_speed(cs));
+}
+
+/* The monitor feed formats it, see MonitorFeed.  */
 static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
 {
-    if (monitors.empty()) {
+    if (!monitor_feed.tracking()) {
         return;
     }
 
-    string msg;
-    char buffer[1000];
-    sprintf(buffer, "Name:%s\n", cs->nodeName().c_str());
-    msg += buffer;
-    sprintf(buffer, "IP:%s\n", cs->name.c_str());
-    msg += buffer;
-    sprintf(buffer, "MaxJobs:%d\n", cs->maxJobs());
-    msg += buffer;
-    sprintf(buffer, "NoRemote:%s\n", cs->noRemote() ? "true" : "false");
-    msg += buffer;
-    sprintf(buffer, "Platform:%s\n", cs->hostPlatform().c_str());
-    msg += buffer;
-    sprintf(buffer, "Speed:%f\n", server_speed(cs));
-    msg += buffer;
+    MonitorHostStats stats;
+    stats.hostId = cs->hostId();
+    stats.name = cs->nodeName();
+    stats.ip = cs->name;
+    stats.platform = cs->hostPlatform();
+    stats.maxJobs = cs->maxJobs();
+    stats.noRemote = cs->noRemote();
+    stats.speed = server_speed(cs);
 
     if (m) {
-        sprintf(buffer, "Load:%d\n", m->load);
-        msg += buffer;
-        sprintf(buffer, "LoadAvg1:%d\n", m->loadAvg1);
-        msg += buffer;
-        sprintf(buffer, "LoadAvg5:%d\n", m->loadAvg5);
-        msg += buffer;
-        sprintf(buffer, "LoadAvg10:%d\n", m->loadAvg10);
-        msg += buffer;
-        sprintf(buffer, "FreeMem:%d\n", m->freeMem);
-        msg += buffer;
+        stats.hasStats = true;
+        stats.load = m->load;
+        stats.loadAvg1 = m->loadAvg1;
+        stats.loadAvg5 = m->loadAvg5;
+        stats.loadAvg10 = m->loadAvg10;
+        stats.freeMem = m->freeMem;
     } else {
-        sprintf(buffer, "Load:%d\n", cs->load());
-        msg += buffer;
+        stats.load = cs->load();
     }
 
-    notify_monitors(new MonStatsMsg(cs->hostId(), msg));
+    monitor_feed.hostStats(stats);
 }
 
 static Job *create_new_job(CompileServer *submitter)
@@ -334,14 +488,46 @@ static Job *create_new_job(CompileServer *submitter)
 
 static void enqueue_job_request(Job *job)
 {
-    if (!toanswer.empty() && toanswer.back()->server == job->submitter()) {
-        toanswer.back()->l.push_back(job);
-    } else {
-        UnansweredList *newone = new UnansweredList();
-        newone->server = job->submitter();
-        newone->l.push_back(job);
-        toanswer.push_back(newone);
+    ++metrics.queuedJobs;
+
+    for (list<UnansweredList *>::iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        if ((*it)->server == job->submitter() && (*it)->job_class == job->jobClass()) {
+            (*it)->l.push_back(job);
+            return;
+        }
+    }
+
+    UnansweredList *newone = new UnansweredList();
+    newone->server = job->submitter();
+    newone->job_class = job->jobClass();
+    newone->vtime = fair_vtime;
+    newone->l.push_back(job);
+    toanswer.push_back(newone);
+}
+
+static bool earlier_request(const UnansweredList *l1, const UnansweredList *l2)
+{
+    return l1->vtime < l2->vtime;
+}
+
+/* What answering the job counts against the fair share of its submitter,
+   the user time it is expected to take.  */
+static unsigned long share_cost(Job *job)
+{
+    JobCost cost;
+
+    if (job_costs.predict(job->fileName(), cost)) {
+        return max((unsigned long) cost.userMsec, 1UL);
     }
+
+    const CompileServer *submitter = job->submitter();
+
+    if (submitter->lastRequestedJobs().size() > 0) {
+        return max(submitter->cumRequested().compileTimeUser()
+                   / submitter->lastRequestedJobs().size(), 1UL);
+    }
+
+    return FAIR_SHARE_UNIT_MSEC;
 }
 
 static Job *get_job_request(void)
@@ -364,7 +550,10 @@ static void remove_job_request(void)
 
     UnansweredList *first = toanswer.front();
     toanswer.pop_front();
+    fair_vtime = max(fair_vtime, first->vtime);
+    first->vtime += double(share_cost(first->l.front())) / class_weights[first->job_class];
     first->l.pop_front();
+    --metrics.queuedJobs;
 
     if (first->l.empty()) {
         delete first;
@@ -375,6 +564,44 @@ static void remove_job_request(void)
 
 static string dump_job(Job *job);
 
+/* Tells the log, the monitors and the trace about the request M for JOB.  */
+static void announce_request(Job *job, GetCSMsg *m)
+{
+    CompileServer *submitter = job->submitter();
+    std::ostream &dbg = log_info();
+    dbg << "NEW " << job->id() << " client="
+        << submitter->nodeName() << " versions=[";
+
+    Environments envs = job->environments();
+
+    for (Environments::const_iterator it = envs.begin();
+            it != envs.end();) {
+        dbg << it->second << "(" << it->first << ")";
+
+        if (++it != envs.end()) {
+            dbg << ", ";
+        }
+    }
+
+    dbg << "] " << m->filename << " " << job->language() << " "
+        << class_names[job->jobClass()] << endl;
+    notify_monitors(new MonGetCSMsg(job->id(), submitter->hostId(), m));
+
+    if (trace_writer) {
+        TraceRecord record;
+        record.type = TraceRecord::REQUEST;
+        record.host = submitter->hostId();
+        record.job = job->id();
+        record.name = m->filename;
+        record.platform = m->target;
+        record.envs = m->versions;
+        record.preferredHost = m->preferred_host;
+        record.flags = m->arg_flags;
+        record.jobClass = job->jobClass();
+        record_trace(record);
+    }
+}
+
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 {
     GetCSMsg *m = dynamic_cast<GetCSMsg *>(_m);
@@ -397,24 +624,22 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setLocalClientId(m->client_id);
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
+        job->setJobClass(m->job_class < JC_COUNT ? m->job_class : uint32_t(JC_INTERACTIVE));
+        job->setAllowDuplicate(m->allow_duplicate && m->count == 1);
+        job->setLeased(m->lease && m->count == 1);
         enqueue_job_request(job);
-        std::ostream &dbg = log_info();
-        dbg << "NEW " << job->id() << " client="
-            << submitter->nodeName() << " versions=[";
-
-        Environments envs = job->environments();
+        ++metrics.jobsRequested;
 
-        for (Environments::const_iterator it = envs.begin();
-                it != envs.end();) {
-            dbg << it->second << "(" << it->first << ")";
-
-            if (++it != envs.end()) {
-                dbg << ", ";
-            }
+        for (Environments::const_iterator it = m->versions.begin(); it != m->versions.end(); ++it) {
+            env_popularity[*it] += 1;
         }
 
-        dbg << "] " << m->filename << " " << job->language() << endl;
-        notify_monitors(new MonGetCSMsg(job->id(), submitter->hostId(), m));
+        /* A lease is announced once a client takes it, see handle_use_lease().  */
+        if (job->leased()) {
+            trace() << "NEW " << job->id() << " lease for " << submitter->nodeName() << endl;
+        } else {
+            announce_request(job, m);
+        }
 
         if (!master_job) {
             master_job = job;
@@ -426,6 +651,36 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
     return true;
 }
 
+/* A client of CS got the compile server of a job granted ahead of time.  */
+static bool handle_use_lease(CompileServer *cs, Msg *_m)
+{
+    UseLeaseMsg *m = dynamic_cast<UseLeaseMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    map<unsigned int, Job *>::const_iterator it = jobs.find(m->job_id);
+
+    if (it == jobs.end() || it->second->submitter() != cs || !it->second->leased()) {
+        trace() << "handle_use_lease: no lease " << m->job_id << " of " << cs->nodeName() << endl;
+        return false;
+    }
+
+    Job *job = it->second;
+    job->setLeased(false);
+    job->setLocalClientId(m->client_id);
+    job->setFileName(m->filename);
+    job->setArgFlags(m->arg_flags);
+    job->setLanguage((m->lang == CompileJob::Lang_C) ? "C" : "C++");
+
+    GetCSMsg request(job->environments(), m->filename, m->lang, 1, job->targetPlatform(),
+                     m->arg_flags, string(), job->minimalHostVersion(), job->jobClass());
+    request.client_id = m->client_id;
+    announce_request(job, &request);
+    return true;
+}
+
 static bool handle_local_job(CompileServer *cs, Msg *_m)
 {
     JobLocalBeginMsg *m = dynamic_cast<JobLocalBeginMsg *>(_m);
@@ -437,6 +692,7 @@ static bool handle_local_job(CompileServer *cs, Msg *_m)
     ++new_job_id;
     trace() << "handle_local_job " << m->outfile << " " << m->id << endl;
     cs->insertClientJobId(m->id, new_job_id);
+    ++metrics.jobsLocal;
     notify_monitors(new MonLocalJobBeginMsg(new_job_id, m->outfile, m->stime, cs->hostId()));
     return true;
 }
@@ -455,41 +711,40 @@ static bool handle_local_job_done(CompileServer *cs, Msg *_m)
     return true;
 }
 
-/* Given a candidate CS and a JOB, check all installed environments
-   on the CS for a match.  Return an empty string if none of the required
-   environments for this job is installed.  Otherwise return the
-   host platform of the first found installed environment which is among
-   the requested.  That can be send to the client, which then completely
-   specifies which environment to use (name, host platform and target
-   platform).  */
-static string envs_match(CompileServer *cs, const Job *job)
-{
-    if (job->submitter() == cs) {
-        return cs->hostPlatform();    // it will compile itself
-    }
-
-    Environments compilerVersions = cs->compilerVersions();
-
-    /* Check all installed envs on the candidate CS ...  */
-    for (Environments::const_iterator it = compilerVersions.begin();
-            it != compilerVersions.end(); ++it) {
-        if (it->first == job->targetPlatform()) {
-            /* ... IT now is an installed environment which produces code for
-               the requested target platform.  Now look at each env which
-               could be installed from the client (i.e. those coming with the
-               job) if it matches in name and additionally could be run
-               by the candidate CS.  */
-            Environments environments = job->environments();
-            for (Environments::const_iterator it2 = environments.begin();
-                    it2 != environments.end(); ++it2) {
-                if (it->second == it2->second && cs->platforms_compatible(it2->first)) {
-                    return it2->first;
-                }
-            }
-        }
+/* What JOB is expected to take in user msec, 0 if nothing is known yet.
+   If the file was compiled before, that's what it will take again.
+   Otherwise see, if this submitter already had other jobs.  Use them as
+   base.  */
+static unsigned long guess_msec(Job *job)
+{
+    JobCost cost;
+
+    if (job_costs.predict(job->fileName(), cost)) {
+        return cost.userMsec;
+    }
+
+    if (job->submitter()->lastRequestedJobs().size() > 0) {
+        return job->submitter()->cumRequested().compileTimeUser()
+               / job->submitter()->lastRequestedJobs().size();
+    }
+
+    /* Otherwise simply average over all jobs.  */
+    if (all_job_stats.size() > 0) {
+        return all_job_stats.cumulated().compileTimeUser() / all_job_stats.size();
+    }
+
+    return 0;
+}
+
+// output per user msec of all jobs, in the units of server_speed()
+static float farm_speed()
+{
+    if (!all_job_stats.cumulated().compileTimeUser()) {
+        return 0;
     }
 
-    return string();
+    return float(all_job_stats.cumulated().outputSize())
+           / all_job_stats.cumulated().compileTimeUser();
 }
 
 static CompileServer *pick_server(Job *job)
@@ -523,6 +778,14 @@ static CompileServer *pick_server(Job *job)
 
 #endif
 
+    JobCost cost;
+    bool known = job_costs.predict(job->fileName(), cost);
+
+    // servers take it only if the memory it took the last times fits
+    if (known) {
+        job->setMemoryKb(cost.memoryKb);
+    }
+
     /* if the user wants to test/prefer one specific daemon, we look for that one first */
     if (!job->preferredHost().empty()) {
         for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
@@ -534,8 +797,22 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
+    /* Jobs for files that compiled quickly the last times are not worth
+       the transfer, the submitter compiles them itself if it can.  */
+    CompileServer *submitter = job->submitter();
+
+    if (known && cost.userMsec < TRIVIAL_JOB_MSEC
+            && int(submitter->jobList().size()) < submitter->maxJobs()
+            && submitter->can_install(job).size() && server_index.contains(submitter)) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "trivial job " << job->id() << " (" << cost.userMsec << "ms) stays on "
+                << submitter->nodeName() << endl;
+#endif
+        return submitter;
+    }
+
     /* If we have no statistics simply use any server which is usable.  */
-    if (!all_job_stats.size ()) {
+    if (all_job_stats.empty()) {
         CompileServer *selected = NULL;
         int eligible_count = 0;
 
@@ -550,148 +827,281 @@ static CompileServer *pick_server(Job *job)
         }
 
         if( selected != NULL ) {
-            trace() << "no job stats - returning randomly selected " << selected->nodeName() << " load: " << selected->load() << " can install: " << selected->can_install(job) << endl;
+            if (log_enabled(Debug)) {
+                trace() << "no job stats - returning randomly selected " << selected->nodeName() << " load: " << selected->load() << " can install: " << selected->can_install(job) << endl;
+            }
             return selected;
         }
 
         return 0;
     }
 
-    /* Now guess about the job.  First see, if this submitter already
-       had other jobs.  Use them as base.  */
-    JobStat guess;
+    /* Now guess about the job.  */
+    PickRequest request(job, server_index);
+    request.averageMsec = all_job_stats.cumulated().compileTimeUser() / all_job_stats.size();
+    request.guessMsec = guess_msec(job);
 
-    if (job->submitter()->lastRequestedJobs().size() > 0) {
-        guess = job->submitter()->cumRequested()
-                / job->submitter()->lastRequestedJobs().size();
-    } else {
-        /* Otherwise simply average over all jobs.  */
-        guess = cum_job_stats / all_job_stats.size();
+    if (known) {
+        request.transferSize = cost.inputSize + cost.outputSize;
     }
 
-    CompileServer *best = 0;
-    // best uninstalled
-    CompileServer *bestui = 0;
-    // best preloadable host
-    CompileServer *bestpre = 0;
+    request.farmSpeed = farm_speed();
 
-    uint matches = 0;
+    request.installMsec = install_msec;
 
-    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
-        CompileServer *cs = *it;
+    if (!known) {
+        request.transferSize = transfer_size;
+    }
 
-        /* For now ignore overloaded servers.  */
-        /* Pre-loadable (cs->jobList().size()) == (cs->maxJobs()) is checked later.  */
-        if ((int(cs->jobList().size()) > cs->maxJobs()) || (cs->load() >= 1000)) {
-#if DEBUG_SCHEDULER > 1
-            trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
-                    <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
-#endif
-            continue;
+    return policy->pick(request);
+}
+
+static bool has_environment(const CompileServer *cs, const pair<string, string> &env)
+{
+    return cs->compilerVersionIds().contains(intern_env(env));
+}
+
+static bool popular_first(const pair<double, pair<string, string> > &e1,
+                          const pair<double, pair<string, string> > &e2)
+{
+    return e1.first > e2.first;
+}
+
+/* Environments are installed when the first job needs them, which then
+   waits for the client to upload it, and every server pays for that when
+   a new toolchain is rolled out.  So servers that are idle get the
+   popular environments they don't have yet from a server that has them.
+   They don't take jobs meanwhile, like when installing for a job.  */
+static void seed_environments()
+{
+    static time_t last_seed = 0;
+    static time_t last_decay = 0;
+    time_t now = time(0);
+
+    if (!last_decay) {
+        last_decay = now;
+    }
+
+    if (now - last_decay >= ENV_POPULARITY_HALFLIFE) {
+        for (map<pair<string, string>, double>::iterator it = env_popularity.begin();
+                it != env_popularity.end();) {
+            it->second /= 2;
+
+            if (it->second < 1) {
+                env_popularity.erase(it++);
+            } else {
+                ++it;
+            }
         }
 
-        // incompatible architecture or busy installing
-        if (!cs->can_install(job).size()) {
-#if DEBUG_SCHEDULER > 2
-            trace() << cs->nodeName() << " can't install " << job->id() << endl;
-#endif
-            continue;
+        last_decay = now;
+    }
+
+    if (now - last_seed < SEED_INTERVAL || seeding.size() >= MAX_SEEDING) {
+        return;
+    }
+
+    last_seed = now;
+
+    vector<pair<double, pair<string, string> > > hot;
+
+    for (map<pair<string, string>, double>::const_iterator it = env_popularity.begin();
+            it != env_popularity.end(); ++it) {
+        if (it->second >= SEED_MIN_REQUESTS) {
+            hot.push_back(make_pair(it->second, it->first));
         }
+    }
 
-        /* Don't use non-chroot-able daemons for remote jobs.  XXX */
-        if (!cs->chrootPossible() && cs != job->submitter()) {
-            trace() << cs->nodeName() << " can't use chroot\n";
-            continue;
+    sort(hot.begin(), hot.end(), popular_first);
+
+    for (size_t i = 0; i < hot.size() && seeding.size() < MAX_SEEDING; ++i) {
+        const pair<string, string> &env = hot[i].second;
+        CompileServer *source = 0;
+
+        /* The least busy server that has it sends it.  */
+        for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+            CompileServer *cs = *it;
+
+            if (IS_PROTOCOL_43(cs) && !cs->busyInstalling() && cs->remotePort()
+                    && seeding.find(cs) == seeding.end() && has_environment(cs, env)
+                    && (!source || cs->jobList().size() < source->jobList().size())) {
+                source = cs;
+            }
         }
 
-        // Check if remote & if remote allowed
-        if (!cs->check_remote(job)) {
-            trace() << cs->nodeName() << " fails remote job check\n";
+        if (!source) {
             continue;
         }
 
+        for (list<CompileServer *>::const_iterator it = css.begin();
+                it != css.end() && seeding.size() < MAX_SEEDING; ++it) {
+            CompileServer *cs = *it;
 
-#if DEBUG_SCHEDULER > 1
-        trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
-                cs->jobList().size() << " speed: " << server_speed(cs, job) << " compile time " <<
-                cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() << endl;
-#endif
+            if (cs == source || !IS_PROTOCOL_43(cs) || !server_index.contains(cs)
+                    || cs->busyInstalling() || !cs->jobList().empty() || cs->maxJobs() <= 0
+                    || cs->load() >= 500 || cs->noRemote() || !cs->chrootPossible()
+                    || !cs->platforms_compatible(env.first) || has_environment(cs, env)) {
+                continue;
+            }
 
-        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
-            /* Make all servers compile a job at least once, so we'll get an
-               idea about their speed.  */
-            if (!envs_match(cs, job).empty()) {
-                best = cs;
-                matches++;
-            } else {
-                // if there is one server that already got the environment and one that
-                // hasn't compiled at all, pick the one with environment first
-                bestui = cs;
+            trace() << "seeding " << env.second << "(" << env.first << ") to " << cs->nodeName()
+                    << " from " << source->nodeName() << endl;
+
+            if (queue_msg(cs, FetchEnvMsg(env.first, env.second, source->name,
+                                          source->remotePort()))) {
+                cs->setBusyInstalling(now);
+                seeding.insert(cs);
             }
+        }
+    }
+}
 
-            break;
+/* Idle servers compile the benchmark from time to time, which tells
+   how fast they are before they got any jobs and finds the broken ones,
+   see handle_benchmark_result().  */
+static void benchmark_servers()
+{
+    unsigned long long now = now_msec();
+    time_t now_sec = now / 1000;
+    int running = 0;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        BenchmarkInfo &info = (*it)->benchmark();
+
+        if (info.sent_msec && now - info.sent_msec > BENCHMARK_TIMEOUT * 1000) {
+            info.sent_msec = 0;
+            info.done = now_sec;    // don't ask again right away
         }
 
-        if (!envs_match(cs, job).empty()) {
-            if (!best) {
-                best = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    best = cs;
-                } else {
-                    bestpre = cs;
-                }
-            }
+        running += info.sent_msec != 0;
+    }
 
-            matches++;
-        } else {
-            if (!bestui) {
-                bestui = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    bestui = cs;
-                } else {
-                    bestpre = cs;
-                }
-            }
+    for (list<CompileServer *>::const_iterator it = css.begin();
+            it != css.end() && running < MAX_BENCHMARKING; ++it) {
+        CompileServer *cs = *it;
+        BenchmarkInfo &info = cs->benchmark();
+        Environments envs = cs->compilerVersions();
+        time_t interval = cs->quarantined() ? BENCHMARK_RETRY : BENCHMARK_INTERVAL;
+
+        if (!IS_PROTOCOL_54(cs) || !server_index.contains(cs) || info.sent_msec
+                || (info.done && now_sec - info.done < interval) || envs.empty()
+                || !cs->jobList().empty() || cs->load() >= 500 || cs->busyInstalling()
+                || !cs->chrootPossible() || cs->maxJobs() <= 0) {
+            continue;
+        }
+
+        // a different environment each time
+        Environments::const_iterator env = envs.begin();
+        advance(env, info.runs % envs.size());
+
+        if (queue_msg(cs, BenchmarkMsg(env->first, env->second))) {
+            trace() << "benchmark of " << env->second << "(" << env->first << ") on "
+                    << cs->nodeName() << endl;
+            info.sent_msec = now;
+            info.runs++;
+            running++;
         }
     }
+}
+
+static bool handle_benchmark_result(CompileServer *cs, Msg *_m)
+{
+    BenchmarkResultMsg *m = dynamic_cast<BenchmarkResultMsg *>(_m);
 
-    // to make sure we find the fast computers at least after some time, we overwrite
-    // the install rule for every 19th job - if the farm is only filled a bit
-    if (bestui && ((matches < 11) && (matches < (css.size() / 3))) && ((job->id() % 19) != 0)) {
-        best = 0;
+    if (!m) {
+        return false;
     }
 
-    if (best) {
-#if DEBUG_SCHEDULER > 1
-        trace() << "taking best installed " << best->nodeName() << " " <<  server_speed(best, job) << endl;
-#endif
-        return best;
+    BenchmarkInfo &info = cs->benchmark();
+    unsigned long long now = now_msec();
+    pair<string, string> env(m->target, m->environment);
+
+    if (info.sent_msec && now - info.sent_msec >= m->real_msec) {
+        info.overhead_msec = now - info.sent_msec - m->real_msec;
     }
 
-    if (bestui) {
-#if DEBUG_SCHEDULER > 1
-        trace() << "taking best uninstalled " << bestui->nodeName() << " " <<  server_speed(bestui, job) << endl;
-#endif
-        return bestui;
+    info.sent_msec = 0;
+    info.done = now / 1000;
+
+    if (m->status == EXIT_COMPILER_MISSING) {
+        // an environment without the compiler the benchmark wants
+        return true;
     }
 
-    if (bestpre) {
-#if DEBUG_SCHEDULER > 1
-        trace() << "taking best preload " << bestui->nodeName() << " " <<  server_speed(bestui, job) << endl;
-#endif
+    string problem;
+
+    if (m->status != 0) {
+        problem = "compiler failed with " + toString(m->status);
+    } else {
+        map<string, set<string> > &hashes = benchmark_hashes[env];
+
+        for (map<string, set<string> >::iterator it = hashes.begin(); it != hashes.end(); ++it) {
+            it->second.erase(cs->nodeName());
+        }
+
+        hashes[m->hash].insert(cs->nodeName());
+        size_t most = 0;
+
+        for (map<string, set<string> >::const_iterator it = hashes.begin(); it != hashes.end();
+                ++it) {
+            most = max(most, it->second.size());
+        }
+
+        // the others agree on another object file
+        if (hashes[m->hash].size() + 1 < most) {
+            problem = "object file differs from the other servers";
+        }
+
+        unsigned long &best = info.best_msec[env];
+
+        if (!best || m->user_msec < best) {
+            best = m->user_msec;
+        } else if (m->user_msec > best * BENCHMARK_SLOWDOWN) {
+            problem = "took " + toString(m->user_msec) + " ms, " + toString(best) + " ms at best";
+        }
+    }
+
+    info.user_msec = m->user_msec;
+
+    if (problem.empty() && m->user_msec && cs->lastCompiledJobs().empty()) {
+        /* Until it compiled jobs, this is how fast it is.  The benchmark is
+           compiled with -O2, scaled like job_stat() does.  */
+        JobStat st;
+        st.setOutputSize(m->out_size * 58 / 35);
+        st.setCompileTimeReal(m->real_msec);
+        st.setCompileTimeUser(m->user_msec);
+        cs->appendCompiledJob(st);
+        rank_server(cs);
+    }
+
+    if (!problem.empty() && !cs->quarantined()) {
+        log_warning() << "quarantining " << cs->nodeName() << " (" << cs->name << "), benchmark of "
+                      << m->environment << ": " << problem << endl;
+    } else if (problem.empty() && cs->quarantined()) {
+        log_info() << "benchmark of " << cs->nodeName() << " passed, taking jobs again" << endl;
     }
 
-    return bestpre;
+    cs->setQuarantined(!problem.empty());
+    return true;
+}
+
+static void remember_servers()
+{
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        if (server_index.contains(*it)) {
+            stats_file->remember(*it);
+        }
+    }
+}
+
+static void save_stats()
+{
+    if (trace_writer) {
+        trace_writer->flush();
+    }
+
+    remember_servers();
+    stats_file->save(all_job_stats, job_costs, install_msec);
 }
 
 /* Prunes the list of connected servers by those which haven't
@@ -735,8 +1145,9 @@ static time_t prune_servers()
             if ((*it)->maxJobs() >= 0) {
                 trace() << "send ping " << (*it)->nodeName() << endl;
                 (*it)->setMaxJobs((*it)->maxJobs() * -1);   // better not give it away
+                rank_server(*it);
 
-                if ((*it)->send_msg(PingMsg())) {
+                if (queue_msg(*it, PingMsg())) {
                     // give it MAX_SCHEDULER_PONG to answer a ping
                     (*it)->last_talk = time(0) - MAX_SCHEDULER_PING
                                        + 2 * MAX_SCHEDULER_PONG;
@@ -787,51 +1198,88 @@ static Job *delay_current_job()
     return get_job_request();
 }
 
-static bool empty_queue()
+/* The first dictionary a server trained for an environment is the one of
+   the farm, as all daemons have to agree on it.  Later ones are dropped.  */
+static bool handle_compression_dict(CompileServer *cs, Msg *_m)
 {
-    Job *job = get_job_request();
+    CompressionDictMsg *m = dynamic_cast<CompressionDictMsg *>(_m);
 
-    if (!job) {
+    if (!m || !m->id || m->data.empty()) {
         return false;
     }
 
-    assert(!css.empty());
+    pair<string, string> env(m->target, m->version);
+    map<pair<string, string>, CompressionDict>::iterator it = compression_dicts.find(env);
 
-    Job *first_job = job;
-    CompileServer *cs = 0;
+    if (it == compression_dicts.end()) {
+        if (compression_dicts.size() >= MAX_COMPRESSION_DICTS) {
+            return true;
+        }
 
-    while (true) {
-        cs = pick_server(job);
+        CompressionDict &dict = compression_dicts[env];
+        dict.id = m->id;
+        dict.data = m->data;
+        trace() << cs->nodeName() << " trained dictionary " << m->id << " for " << m->version
+                << "(" << m->target << ")" << endl;
+        cs->addDict(m->id);
+    } else if (it->second.id == m->id) {
+        cs->addDict(m->id);
+    }
 
-        if (cs) {
-            break;
-        }
+    return true;
+}
 
-        /* Ignore the load on the submitter itself if no other host could
-           be found.  We only obey to its max job number.  */
-        cs = job->submitter();
+/* The submitter gets the dictionary of the environment ahead of USECS, so
+   its client can compress with it.  The server gets it too, but it is used
+   from the next job on, as the client may be faster than the scheduler
+   connection of the server.  */
+static void offer_dict(Job *job, CompileServer *cs, UseCSMsg &usecs)
+{
+    CompileServer *submitter = job->submitter();
 
-        if (!((int(cs->jobList().size()) < cs->maxJobs())
-                && job->preferredHost().empty()
-                /* This should be trivially true.  */
-                && cs->can_install(job).size())) {
-            job = delay_current_job();
+    if (cs == submitter || submitter->type() != CompileServer::DAEMON
+            || !IS_PROTOCOL_62(cs) || !IS_PROTOCOL_62(submitter)) {
+        return;
+    }
 
-            if ((job == first_job) || !job) { // no job found in the whole toanswer list
-                trace() << "No suitable host found, delaying" << endl;
-                return false;
-            }
-        } else {
+    Environments environments = job->environments();
+    map<pair<string, string>, CompressionDict>::const_iterator dict = compression_dicts.end();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == usecs.host_platform) {
+            dict = compression_dicts.find(*it);
             break;
         }
     }
 
-    remove_job_request();
+    if (dict == compression_dicts.end()) {
+        return;
+    }
+
+    CompressionDictMsg msg(dict->first.first, dict->first.second, dict->second.id,
+                           dict->second.data);
+    bool server_had_it = cs->hasDict(msg.id);
+
+    if (!server_had_it && queue_msg(cs, msg)) {
+        cs->addDict(msg.id);
+    }
 
+    if (!submitter->hasDict(msg.id) && queue_msg(submitter, msg)) {
+        submitter->addDict(msg.id);
+    }
+
+    if (server_had_it && submitter->hasDict(msg.id)) {
+        usecs.dict_id = msg.id;
+    }
+}
+
+/* Gives JOB to CS and tells the submitter about it.  */
+static void assign_job(Job *job, CompileServer *cs)
+{
     job->setState(Job::WAITINGFORCS);
     job->setServer(cs);
 
-    string host_platform = envs_match(cs, job);
+    string host_platform = envs_match(server_index, cs, job);
     bool gotit = true;
 
     if (host_platform.empty()) {
@@ -843,16 +1291,15 @@ static bool empty_queue()
     unsigned matched_job_id = 0;
     unsigned count = 0;
 
-    list<JobStat> lastRequestedJobs = job->submitter()->lastRequestedJobs();
-    for (list<JobStat>::const_iterator l = lastRequestedJobs.begin();
-            l != lastRequestedJobs.end(); ++l) {
+    const JobStatHistory &lastRequestedJobs = job->submitter()->lastRequestedJobs();
+    const JobStatHistory &lastCompiledJobs = cs->lastCompiledJobs();
+
+    for (size_t l = 0; l < lastRequestedJobs.size(); ++l) {
         unsigned rcount = 0;
 
-        list<JobStat> lastCompiledJobs = cs->lastCompiledJobs();
-        for (list<JobStat>::const_iterator r = lastCompiledJobs.begin();
-                r != lastCompiledJobs.end(); ++r) {
-            if (l->jobId() == r->jobId()) {
-                matched_job_id = l->jobId();
+        for (size_t r = 0; r < lastCompiledJobs.size(); ++r) {
+            if (lastRequestedJobs.at(l).jobId() == lastCompiledJobs.at(r).jobId()) {
+                matched_job_id = lastRequestedJobs.at(l).jobId();
             }
 
             if (++rcount > 16) {
@@ -868,10 +1315,47 @@ static bool empty_queue()
     UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
 
+    /* Rather than the client uploading the environment over what may be
+       a slow link, the server fetches it from another one that has it.
+       That is told before the client, so it knows to wait for it.  */
+    CompileServer *source = 0;
+
+    if (!gotit && IS_PROTOCOL_44(cs) && IS_PROTOCOL_44(job->submitter())) {
+        Environments environments = job->environments();
+        pair<string, string> env;
+
+        for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+            if (it->first == host_platform) {
+                env = *it;
+                break;
+            }
+        }
+
+        for (list<CompileServer *>::const_iterator it = css.begin();
+                !env.second.empty() && it != css.end(); ++it) {
+            if (*it != cs && IS_PROTOCOL_44(*it) && !(*it)->busyInstalling() && (*it)->remotePort()
+                    && has_environment(*it, env)
+                    && (!source || (*it)->jobList().size() < source->jobList().size())) {
+                source = *it;
+            }
+        }
+
+        if (source && cs->send_msg(FetchEnvMsg(env.first, env.second, source->name,
+                                               source->remotePort(), job->id()))) {
+            trace() << cs->nodeName() << " fetches " << env.second << "(" << env.first
+                    << ") from " << source->nodeName() << " for job " << job->id() << endl;
+            m2.env_from_peer = 1;
+            ++metrics.envPeerFetches;
+        }
+    }
+
+    offer_dict(job, cs, m2);
+
     if (!job->submitter()->send_msg(m2)) {
         trace() << "failed to deliver job " << job->id() << endl;
+        ++metrics.deliveryFailures;
         handle_end(job->submitter(), 0);   // will care for the rest
-        return true;
+        return;
     }
 
 #if DEBUG_SCHEDULER >= 0
@@ -882,10 +1366,19 @@ static bool empty_queue()
     }
 #endif
     cs->appendJob(job);
+    rank_server(cs);
+
+    if (!standbys.empty()) {
+        replicate("assign " + toString(job->id()) + " " + cs->nodeName() + " "
+                  + job->submitter()->nodeName() + "\n");
+    }
+
+    ++metrics.jobsAssigned;
 
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
         cs->setBusyInstalling(time(0));
+        ++metrics.envInstalls;
     }
 
     string env;
@@ -908,10 +1401,263 @@ static bool empty_queue()
             (*it)->appendEnvironment(make_pair(cs->hostPlatform(), env));
         }
     }
+}
+
+static bool empty_queue()
+{
+    /* The submitter with the earliest virtual time goes first, the others
+       follow in order if nothing can be found for it.  */
+    toanswer.sort(earlier_request);
+    Job *job = get_job_request();
+
+    if (!job) {
+        return false;
+    }
+
+    assert(!css.empty());
 
+    Job *first_job = job;
+    CompileServer *cs = 0;
+
+    while (true) {
+        struct timeval start, end;
+        gettimeofday(&start, 0);
+        cs = pick_server(job);
+        gettimeofday(&end, 0);
+        metrics.pickServerSeconds.observe((end.tv_sec - start.tv_sec)
+                                          + (end.tv_usec - start.tv_usec) / 1000000.0);
+
+        if (cs) {
+            break;
+        }
+
+        /* Ignore the load on the submitter itself if no other host could
+           be found.  We only obey to its max job number.  */
+        cs = job->submitter();
+
+        if (!((int(cs->jobList().size()) < cs->maxJobs())
+                && job->preferredHost().empty()
+                /* This should be trivially true.  */
+                && cs->can_install(job).size())) {
+            if (forward_job(job)) {
+                remove_job_request();
+                return true;
+            }
+
+            job = delay_current_job();
+
+            if ((job == first_job) || !job) { // no job found in the whole toanswer list
+                trace() << "No suitable host found, delaying" << endl;
+                return false;
+            }
+        } else {
+            break;
+        }
+    }
+
+    remove_job_request();
+    assign_job(job, cs);
     return true;
 }
 
+/* A job compiling much longer than expected, on a server that is swapping
+   or throttled, holds up the build.  While there are free slots and no
+   requests waiting, its client is given another server for a duplicate,
+   the first result wins and the client cancels the other one.  */
+static void hedge_stragglers()
+{
+    time_t now = time(0);
+
+    if (hedge_factor <= 0 || !toanswer.empty() || now == last_hedge_check) {
+        return;
+    }
+
+    last_hedge_check = now;
+    float farm = farm_speed();
+    list<unsigned int> stragglers;
+
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        Job *job = it->second;
+
+        if (job->state() != Job::COMPILING || !job->allowDuplicate() || job->hedged()
+                || !job->startOnScheduler() || job->server() == job->submitter()
+                || !job->preferredHost().empty()) {
+            continue;
+        }
+
+        float expected = guess_msec(job);
+        float speed = server_speed(job->server(), job);
+
+        if (speed > 0 && farm > 0) {
+            expected *= farm / speed;
+        }
+
+        if (expected > 0 && now - job->startOnScheduler()
+                >= max(float(HEDGE_MIN_SECONDS), hedge_factor * expected / 1000)) {
+            stragglers.push_back(it->first);
+        }
+    }
+
+    /* Giving out a job may end its submitter, so they are looked up again.  */
+    for (list<unsigned int>::const_iterator it = stragglers.begin(); it != stragglers.end(); ++it) {
+        map<unsigned int, Job *>::const_iterator jit = jobs.find(*it);
+
+        if (jit == jobs.end()) {
+            continue;
+        }
+
+        Job *job = jit->second;
+        CompileServer *submitter = job->submitter();
+        CompileServer *best = 0;
+        float best_speed = 0;
+
+        for (list<CompileServer *>::const_iterator cit = css.begin(); cit != css.end(); ++cit) {
+            CompileServer *cs = *cit;
+
+            if (cs == job->server() || cs == submitter || !server_index.contains(cs)
+                    || !cs->is_eligible(job)) {
+                continue;
+            }
+
+            float speed = server_speed(cs, job);
+
+            if (speed <= 0) {
+                speed = farm;
+            }
+
+            if (!best || speed > best_speed) {
+                best = cs;
+                best_speed = speed;
+            }
+        }
+
+        if (!best) {
+            break;  // the farm is busy, no duplicates then
+        }
+
+        Job *duplicate = create_new_job(submitter);
+        duplicate->setEnvironments(job->environments());
+        duplicate->setTargetPlatform(job->targetPlatform());
+        duplicate->setArgFlags(job->argFlags());
+        duplicate->setLanguage(job->language());
+        duplicate->setFileName(job->fileName());
+        duplicate->setLocalClientId(job->localClientId());
+        duplicate->setMinimalHostVersion(job->minimalHostVersion());
+        duplicate->setJobClass(job->jobClass());
+        duplicate->setHedged(true);
+        job->setHedged(true);
+        ++metrics.jobsHedged;
+
+        log_info() << "HEDGE " << job->id() << " on " << job->server()->nodeName()
+                   << " after " << now - job->startOnScheduler() << "s, duplicate "
+                   << duplicate->id() << " on " << best->nodeName() << endl;
+
+        GetCSMsg request(duplicate->environments(), duplicate->fileName(),
+                         duplicate->language() == "C" ? CompileJob::Lang_C : CompileJob::Lang_CXX,
+                         1, duplicate->targetPlatform(), duplicate->argFlags(), string(),
+                         duplicate->minimalHostVersion(), duplicate->jobClass());
+        notify_monitors(new MonGetCSMsg(duplicate->id(), submitter->hostId(), &request));
+        assign_job(duplicate, best);
+    }
+}
+
+/* While jobs wait for servers, their submitters are told how long they will
+   take, see JobWaitMsg.  The farm starts about as many jobs as it has slots
+   in the time an average job takes, and the lists take turns.  */
+static void notify_waiting_jobs()
+{
+    time_t now = time(0);
+
+    if (toanswer.empty() || now == last_wait_check || !all_job_stats.size()) {
+        return;
+    }
+
+    last_wait_check = now;
+    unsigned long slots = 0;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        if (server_index.contains(*it) && (*it)->maxJobs() > 0) {
+            slots += (*it)->maxJobs();
+        }
+    }
+
+    if (!slots) {
+        return;
+    }
+
+    unsigned long average = all_job_stats.cumulated().compileTimeUser() / all_job_stats.size();
+    float farm = farm_speed();
+
+    for (list<UnansweredList *>::const_iterator lit = toanswer.begin(); lit != toanswer.end(); ++lit) {
+        CompileServer *submitter = (*lit)->server;
+
+        if (submitter->type() == CompileServer::FEDERATION || !IS_PROTOCOL_61(submitter)) {
+            continue;
+        }
+
+        // the lists that get their turn before this one
+        unsigned long earlier = 0;
+
+        for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+            if (*it != *lit && (*it)->vtime <= (*lit)->vtime) {
+                ++earlier;
+            }
+        }
+
+        float speed = server_speed(submitter);
+        unsigned long position = 0;
+
+        for (list<Job *>::const_iterator jit = (*lit)->l.begin(); jit != (*lit)->l.end();
+                ++jit, ++position) {
+            Job *job = *jit;
+
+            if (job->leased() || now - job->waitNotice() < WAIT_NOTICE_INTERVAL) {
+                continue;
+            }
+
+            unsigned long ahead = min(position * toanswer.size() + earlier,
+                                      (unsigned long) metrics.queuedJobs);
+            unsigned long msec = guess_msec(job);
+
+            if (!msec) {
+                msec = average;
+            }
+
+            unsigned long remote = (ahead + 1) * average / slots + msec;
+            unsigned long local = msec;
+
+            if (speed > 0 && farm > 0) {
+                local = msec * farm / speed;
+            }
+
+            job->setWaitNotice(now);
+            trace() << "WAIT " << job->id() << " remote=" << remote << "ms local=" << local
+                    << "ms" << endl;
+            queue_msg(submitter, JobWaitMsg(job->localClientId(), remote, local));
+        }
+    }
+}
+
+/* Tells TO, or all daemons, which daemons keep results.  */
+static void send_result_owners(CompileServer *to = 0)
+{
+    list<string> owners;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        if ((*it)->resultCache() && (*it)->remotePort()) {
+            owners.push_back((*it)->name + ":" + toString((*it)->remotePort()));
+        }
+    }
+
+    ResultOwnersMsg msg(owners);
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        if ((!to || *it == to) && IS_PROTOCOL_50(*it)) {
+            queue_msg(*it, msg);
+        }
+    }
+}
+
 static bool handle_login(CompileServer *cs, Msg *_m)
 {
     LoginMsg *m = dynamic_cast<LoginMsg *>(_m);
@@ -921,11 +1667,22 @@ static bool handle_login(CompileServer *cs, Msg *_m)
     }
 
     std::ostream &dbg = trace();
+    ConfCSMsg conf;
+
+    /* Daemons logging in again after a restart only send the digest of
+       the environments they had, as long as it is known.  */
+    if (!m->env_digest.empty()) {
+        conf.need_environments = !stats_file->environments(m->env_digest, m->envs);
+    } else if (!m->envs.empty()) {
+        stats_file->rememberEnvironments(environments_digest(m->envs), m->envs);
+    }
 
     cs->setRemotePort(m->port);
     cs->setCompilerVersions(m->envs);
     cs->setMaxJobs(m->max_kids);
+    cs->setMaxLocalJobs(m->max_local_jobs);
     cs->setNoRemote(m->noremote);
+    cs->setResultCache(m->result_cache);
 
     if (m->nodename.length()) {
         cs->setNodeName(m->nodename);
@@ -967,13 +1724,37 @@ static bool handle_login(CompileServer *cs, Msg *_m)
         ++it;
     }
 
+    stats_file->restore(cs);
+
+    ++metrics.daemonLogins;
     css.push_back(cs);
 
+    if (trace_writer) {
+        TraceRecord record;
+        record.type = TraceRecord::LOGIN;
+        record.host = cs->hostId();
+        record.name = cs->nodeName();
+        record.platform = cs->hostPlatform();
+        record.maxJobs = cs->maxJobs();
+        record.flags = (cs->noRemote() ? TraceRecord::NO_REMOTE : 0)
+                       | (cs->chrootPossible() ? TraceRecord::CHROOT : 0);
+        record.envs = cs->compilerVersions();
+        record_trace(record);
+    }
+
+    server_index.add(cs, 0);
+    server_index.setEnvironments(cs, cs->compilerVersionIds());
+    rank_server(cs);
+    take_over_jobs();
+
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
-        cs->send_msg(ConfCSMsg());
+        queue_msg(cs, conf);
     }
 
+    // the other daemons only need to hear about one more owner
+    send_result_owners(cs->resultCache() ? 0 : cs);
+
     return true;
 }
 
@@ -987,6 +1768,23 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
 
     CompileServer *cs = static_cast<CompileServer *>(mc);
     cs->setCompilerVersions(m->envs);
+    server_index.setEnvironments(cs, cs->compilerVersionIds());
+
+    if (!m->envs.empty()) {
+        stats_file->rememberEnvironments(environments_digest(m->envs), m->envs);
+    }
+    seeding.erase(cs);
+
+    /* Daemons log in again once they installed an environment.  */
+    if (cs->busyInstalling()) {
+        unsigned long msec = (time(0) - cs->busyInstalling()) * 1000;
+        install_msec = (install_msec * 3 + msec) / 4;
+
+        if (!standbys.empty()) {
+            replicate("install " + toString(install_msec) + "\n");
+        }
+    }
+
     cs->setBusyInstalling(0);
 
     std::ostream &dbg = trace();
@@ -1000,7 +1798,7 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
-        cs->send_msg(ConfCSMsg());
+        queue_msg(cs, ConfCSMsg());
     }
 
     return false;
@@ -1014,18 +1812,556 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
         return false;
     }
 
-    monitors.push_back(cs);
     // monitors really want to be fed lazily
     cs->setBulkTransfer();
+    cs->setState(CompileServer::LOGGEDIN);
 
-    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+    // no expected data from them, the monitor feed has them from now on
+    fd2cs.erase(cs->fd);
+    poller.unwatch(cs->fd);
+    pending_fds.erase(cs->fd);
+    unhandled_fds.erase(cs->fd);
+
+    // only the first one, the feed keeps the stats from then on
+    bool replay = !monitor_feed.tracking();
+    monitor_feed.add(cs, m->batch_msec, m->snapshot);
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); replay && it != css.end(); ++it) {
         handle_monitor_stats(*it);
     }
 
-    fd2cs.erase(cs->fd);   // no expected data from them
     return true;
 }
 
+/* A standby scheduler gets everything known so far, and then what
+   changes, see replicate().  */
+static bool handle_standby_login(CompileServer *cs, Msg *_m)
+{
+    StandbyLoginMsg *m = dynamic_cast<StandbyLoginMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    log_info() << "standby scheduler " << cs->name << " connected" << endl;
+    standbys.push_back(cs);
+    cs->setBulkTransfer();
+
+    ostringstream out;
+    remember_servers();
+    stats_file->write(out, all_job_stats, job_costs, install_msec);
+
+    for (map<unsigned int, Job *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (it->second->server()) {
+            out << "assign " << it->first << " " << it->second->server()->nodeName() << " "
+                << it->second->submitter()->nodeName() << "\n";
+        }
+    }
+
+    out << "nextid " << new_job_id << "\n";
+
+    /* In pieces of whole lines, messages are limited in size.  */
+    string state = out.str();
+
+    for (size_t pos = 0; pos < state.size();) {
+        size_t end = min(pos + STANDBY_CHUNK, state.size());
+
+        if (end < state.size()) {
+            size_t newline = state.rfind('\n', end - 1);
+            end = (newline != string::npos && newline >= pos) ? newline + 1
+                  : state.find('\n', pos) + 1;
+        }
+
+        if (!queue_msg(cs, StandbyStateMsg(state.substr(pos, end - pos)))) {
+            return false;
+        }
+
+        pos = end;
+    }
+
+    return true;
+}
+
+/* Applies what the primary scheduler sent to the copy of its state.  */
+static void apply_standby_state(const string &lines)
+{
+    istringstream in(lines);
+    string line;
+
+    while (getline(in, line)) {
+        if (stats_file->parse(line, all_job_stats, job_costs, install_msec)) {
+            continue;
+        }
+
+        istringstream words(line);
+        string what;
+        unsigned int id;
+        words >> what;
+
+        if (what == "assign") {
+            StandbyJob job;
+
+            if (words >> id >> job.server >> job.submitter) {
+                standby_jobs[id] = job;
+            }
+        } else if (what == "done") {
+            if (words >> id) {
+                standby_jobs.erase(id);
+            }
+        } else if (what == "nextid") {
+            words >> new_job_id;
+        }
+    }
+}
+
+static bool port_in_use(int port)
+{
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    int optval = 1;
+    struct sockaddr_in myaddr;
+    myaddr.sin_family = AF_INET;
+    myaddr.sin_port = htons(port);
+    myaddr.sin_addr.s_addr = INADDR_ANY;
+
+    bool ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == 0
+               && bind(fd, (struct sockaddr *) &myaddr, sizeof(myaddr)) < 0 && errno == EADDRINUSE;
+    close(fd);
+    return ret;
+}
+
+/* Keeps a copy of the state of the scheduler on HOST until it goes away.
+   Returns false if the scheduler should exit instead of taking over.  */
+static bool stand_by(const string &host)
+{
+    MsgChannel *primary = Service::createChannel(host, scheduler_port, 10);
+
+    if (!primary) {
+        log_warning() << "primary scheduler " << host << " not reachable, taking over" << endl;
+        return true;
+    }
+
+    if (!IS_PROTOCOL_40(primary) || !primary->send_msg(StandbyLoginMsg())) {
+        log_error() << "primary scheduler " << host << " can't have standby schedulers" << endl;
+        delete primary;
+        return false;
+    }
+
+    log_info() << "standing by for the scheduler on " << host << endl;
+    poller.watch(primary->fd, Poller::Read);
+    bool lost = false;
+
+    while (!lost && !exit_main_loop) {
+        int ready = poller.wait(STANDBY_TIMEOUT * 1000);
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ready < 0) {
+            log_perror("poller");
+            break;
+        }
+
+        if (ready == 0) {
+            log_warning() << "primary scheduler " << host << " is not answering" << endl;
+            break;
+        }
+
+        while (!primary->read_a_bit() || primary->has_msg()) {
+            Msg *msg = primary->get_msg();
+
+            if (!msg) {
+                lost = true;
+                break;
+            }
+
+            if (StandbyStateMsg *m = dynamic_cast<StandbyStateMsg *>(msg)) {
+                apply_standby_state(m->lines);
+            }
+
+            delete msg;
+        }
+    }
+
+    poller.unwatch(primary->fd);
+    delete primary;
+
+    if (exit_main_loop) {
+        return false;
+    }
+
+    log_warning() << "taking over from the primary scheduler on " << host << " with "
+                  << standby_jobs.size() << " jobs" << endl;
+    takeover_time = time(0);
+
+    /* If it runs on this machine, it may not have released its ports yet.  */
+    for (int i = 0; i < STANDBY_TIMEOUT && port_in_use(scheduler_port); ++i) {
+        sleep(1);
+    }
+
+    return true;
+}
+
+/* The jobs a standby scheduler knows from the primary one are created
+   again once their server and submitter logged in, so that their slots
+   stay taken until the daemons report them done.  */
+static void take_over_jobs()
+{
+    if (standby_jobs.empty()) {
+        return;
+    }
+
+    if (time(0) - takeover_time > STANDBY_JOB_TIMEOUT) {
+        log_info() << "giving up " << standby_jobs.size() << " jobs of the primary scheduler" << endl;
+        standby_jobs.clear();
+        return;
+    }
+
+    map<string, CompileServer *> servers;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        if (server_index.contains(*it)) {
+            servers[(*it)->nodeName()] = *it;
+        }
+    }
+
+    for (map<unsigned int, StandbyJob>::iterator it = standby_jobs.begin(); it != standby_jobs.end();) {
+        map<string, CompileServer *>::const_iterator server = servers.find(it->second.server);
+        map<string, CompileServer *>::const_iterator submitter = servers.find(it->second.submitter);
+
+        if (server == servers.end() || submitter == servers.end() || jobs.count(it->first)) {
+            ++it;
+            continue;
+        }
+
+        Job *job = new Job(it->first, submitter->second);
+        job->setServer(server->second);
+        job->setState(Job::COMPILING);
+        server->second->appendJob(job);
+        rank_server(server->second);
+        jobs[it->first] = job;
+        trace() << "took over job " << it->first << " on " << it->second.server << endl;
+        standby_jobs.erase(it++);
+    }
+}
+
+/* The jobs of other farms get ids of their own, so that the other farm
+   doesn't mistake them for its own jobs.  The random part keeps them apart
+   from the ones of other schedulers the farm borrows servers from.  */
+static Job *create_federated_job(CompileServer *peer)
+{
+    if (!federated_job_id) {
+        unsigned int tag = ((unsigned int) getpid() * 2654435761U) ^ (unsigned int) time(0);
+        federated_job_id = FEDERATED_JOB_BIT | ((tag & 0x7ff) << 20);
+    }
+
+    do {
+        federated_job_id = (federated_job_id & ~0xfffffU) | ((federated_job_id + 1) & 0xfffffU);
+    } while (jobs.count(federated_job_id));
+
+    Job *job = new Job(federated_job_id, peer);
+    jobs[federated_job_id] = job;
+    return job;
+}
+
+/* Tells TO, or all federated schedulers, how many slots the servers have
+   free for other farms.  None while jobs of this farm are waiting.  */
+static void send_federation_capacity(CompileServer *to = 0)
+{
+    map<pair<string, string>, unsigned int> free_slots;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); toanswer.empty() && it != css.end(); ++it) {
+        CompileServer *cs = *it;
+        int slots = cs->maxJobs() - int(cs->jobList().size());
+
+        if (slots <= 0 || cs->noRemote() || cs->busyInstalling() || !server_index.contains(cs)) {
+            continue;
+        }
+
+        free_slots[make_pair(cs->hostPlatform(), string())] += slots;
+        Environments envs = cs->compilerVersions();
+
+        for (Environments::const_iterator env = envs.begin(); env != envs.end(); ++env) {
+            free_slots[*env] += slots;
+        }
+    }
+
+    FederationCapacityMsg msg;
+
+    for (map<pair<string, string>, unsigned int>::const_iterator it = free_slots.begin();
+            it != free_slots.end(); ++it) {
+        msg.envs.push_back(it->first);
+        msg.slots.push_back(it->second);
+    }
+
+    for (list<FederationPeer>::iterator it = federation.peers().begin();
+            it != federation.peers().end(); ++it) {
+        if (it->channel && (!to || it->channel == to)) {
+            queue_msg(it->channel, msg);
+        }
+    }
+}
+
+/* Sends JOB, for which no server is free here, to the scheduler of
+   another farm.  */
+static bool forward_job(Job *job)
+{
+    if (federation.empty() || job->leased() || job->allowDuplicate()
+            || !job->preferredHost().empty() || !job->masterJobFor().empty()) {
+        return false;
+    }
+
+    JobCost cost;
+    unsigned long size = job_costs.predict(job->fileName(), cost)
+                         ? cost.inputSize + cost.outputSize : transfer_size;
+    FederationPeer *peer = federation.pick(job->environments(), guess_msec(job), size,
+                                           install_msec);
+
+    if (!peer) {
+        return false;
+    }
+
+    GetCSMsg request(job->environments(), job->fileName(),
+                     job->language() == "C" ? CompileJob::Lang_C : CompileJob::Lang_CXX, 1,
+                     job->targetPlatform(), job->argFlags(), string(),
+                     job->minimalHostVersion(), job->jobClass());
+    request.client_id = job->id();
+
+    if (!queue_msg(peer->channel, request)) {
+        return false;
+    }
+
+    trace() << "FORWARD " << job->id() << " to " << peer->channel->nodeName() << endl;
+    federation.taken(peer, job->environments());
+    federation_pending[job->id()] = peer->channel;
+    return true;
+}
+
+/* The scheduler of another farm connected, see Federation.  */
+static bool handle_federation_login(CompileServer *cs, Msg *_m)
+{
+    FederationLoginMsg *m = dynamic_cast<FederationLoginMsg *>(_m);
+
+    if (!m || !IS_PROTOCOL_57(cs)) {
+        return false;
+    }
+
+    cs->setNodeName(m->netname + "@" + cs->name);
+    log_info() << "federated scheduler " << cs->nodeName() << " connected" << endl;
+    federation.connected(cs);
+    send_federation_capacity(cs);
+    return true;
+}
+
+/* A job of another farm that found no server there.  It is answered at
+   once, with a server or without one, the jobs of this farm come first.  */
+static bool handle_federated_request(CompileServer *peer, Msg *_m)
+{
+    GetCSMsg *m = dynamic_cast<GetCSMsg *>(_m);
+
+    if (!m) {
+        return false;
+    }
+
+    Job *job = create_federated_job(peer);
+    job->setEnvironments(m->versions);
+    job->setTargetPlatform(m->target);
+    job->setArgFlags(m->arg_flags);
+    job->setLanguage((m->lang == CompileJob::Lang_C) ? "C" : "C++");
+    job->setFileName(m->filename);
+    job->setLocalClientId(m->client_id);
+    job->setMinimalHostVersion(m->minimal_host_version);
+    job->setJobClass(m->job_class < JC_COUNT ? m->job_class : uint32_t(JC_INTERACTIVE));
+
+    CompileServer *cs = toanswer.empty() ? pick_server(job) : 0;
+
+    if (!cs) {
+        trace() << "no server for job " << m->client_id << " of " << peer->nodeName() << endl;
+        jobs.erase(job->id());
+        delete job;
+        return queue_msg(peer, UseCSMsg(string(), string(), 0, 0, false, m->client_id, 0));
+    }
+
+    trace() << "LEND " << job->id() << " " << m->filename << " of " << peer->nodeName() << endl;
+    ++metrics.jobsLent;
+    assign_job(job, cs);
+    return true;
+}
+
+/* The answer to forward_job().  The submitter gets the server of the other
+   farm, the job is that farm's from now on.  */
+static bool handle_federated_answer(CompileServer *peer, Msg *_m)
+{
+    UseCSMsg *m = dynamic_cast<UseCSMsg *>(_m);
+
+    if (!m || peer->type() != CompileServer::FEDERATION) {
+        return false;
+    }
+
+    map<unsigned int, CompileServer *>::iterator it = federation_pending.find(m->client_id);
+    Job *job = 0;
+
+    if (it != federation_pending.end() && it->second == peer) {
+        federation_pending.erase(it);
+
+        if (jobs.count(m->client_id)) {
+            job = jobs[m->client_id];
+        }
+    }
+
+    if (job && m->hostname.empty()) {
+        trace() << "no server for job " << job->id() << " in " << peer->nodeName() << endl;
+
+        if (FederationPeer *p = federation.peer(peer)) {
+            p->freeSlots.clear();
+        }
+
+        enqueue_job_request(job);
+        return true;
+    }
+
+    if (m->hostname.empty()) {
+        return true;
+    }
+
+    m->client_id = job ? job->localClientId() : 0;
+    m->matched_job_id = 0;
+    // the dictionaries of the other farm are not ours
+    m->dict_id = 0;
+
+    if (!job || !job->submitter()->send_msg(*m)) {
+        trace() << "job " << m->job_id << " in " << peer->nodeName() << " not wanted anymore" << endl;
+        return queue_msg(peer, JobDoneMsg(m->job_id, 255, JobDoneMsg::FROM_SUBMITTER));
+    }
+
+    trace() << "FORWARDED " << job->id() << " to " << m->hostname << " of "
+            << peer->nodeName() << " as " << m->job_id << endl;
+    ++metrics.jobsForwarded;
+    federation_jobs[m->job_id] = peer;
+    notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(), 0)));
+    jobs.erase(job->id());
+    delete job;
+    return true;
+}
+
+/* A job compiled in another farm is done, that one keeps its statistics.
+   What its submitter reports goes there.  */
+static bool handle_federated_job_done(CompileServer *cs, JobDoneMsg *m)
+{
+    map<unsigned int, CompileServer *>::iterator it = federation_jobs.find(m->job_id);
+    CompileServer *peer = it->second;
+    federation_jobs.erase(it);
+
+    if (cs != peer) {
+        return queue_msg(peer, *m);
+    }
+
+    return true;
+}
+
+/* Connects to the scheduler of another farm, 0 if that failed.  */
+static CompileServer *connect_federation_peer(const string &host, unsigned int port)
+{
+    struct hostent *he = gethostbyname(host.c_str());
+
+    if (!he || he->h_length != 4) {
+        log_warning() << "unknown federated scheduler host " << host << endl;
+        return 0;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr.s_addr, he->h_addr_list[0], he->h_length);
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        log_perror("socket()");
+        return 0;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if ((connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+            || poll(&pfd, 1, FEDERATION_CONNECT_TIMEOUT * 1000) != 1
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+        trace() << "connecting to federated scheduler " << host << " failed" << endl;
+        close(fd);
+        return 0;
+    }
+
+    CompileServer *cs = new CompileServer(fd, (struct sockaddr *) &addr, sizeof(addr), false);
+    pfd.events = POLLIN;
+
+    // the login depends on the protocol version
+    while (cs->protocol && !cs->protocol_ready() && !cs->at_eof()) {
+        if (poll(&pfd, 1, FEDERATION_CONNECT_TIMEOUT * 1000) != 1 || !cs->read_a_bit()) {
+            break;
+        }
+    }
+
+    if (!cs->protocol_ready() || !IS_PROTOCOL_57(cs)) {
+        log_warning() << "federated scheduler " << host << " doesn't answer or is too old" << endl;
+        delete cs;
+        return 0;
+    }
+
+    return cs;
+}
+
+/* Keeps the schedulers given with --federate connected and tells all
+   federated ones about the free slots.  Returns when to be called again,
+   in seconds.  */
+static time_t update_federation(const char *netname)
+{
+    static time_t last_capacity = 0;
+    time_t now = time(0);
+
+    for (list<FederationPeer>::iterator it = federation.peers().begin();
+            it != federation.peers().end(); ++it) {
+        if (it->channel || it->host.empty() || it->nextConnect > now) {
+            continue;
+        }
+
+        CompileServer *cs = connect_federation_peer(it->host, it->port);
+
+        if (!cs || !cs->send_msg(FederationLoginMsg(netname))) {
+            delete cs;
+            it->nextConnect = now + FEDERATION_RETRY;
+            continue;
+        }
+
+        cs->setType(CompileServer::FEDERATION);
+        cs->setState(CompileServer::LOGGEDIN);
+        cs->setNodeName(it->host);
+        cs->last_talk = now;
+        fd2cs[cs->fd] = cs;
+        poller.watch(cs->fd, Poller::Read);
+        it->channel = cs;
+        log_info() << "connected to federated scheduler " << it->host << endl;
+        send_federation_capacity(cs);
+    }
+
+    if (now - last_capacity >= FEDERATION_INTERVAL) {
+        send_federation_capacity();
+        last_capacity = now;
+    }
+
+    return FEDERATION_INTERVAL;
+}
+
 static bool handle_job_begin(CompileServer *cs, Msg *_m)
 {
     JobBeginMsg *m = dynamic_cast<JobBeginMsg *>(_m);
@@ -1050,6 +2386,14 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
     job->setStartTime(m->stime);
     job->setStartOnScheduler(time(0));
     notify_monitors(new MonJobBeginMsg(m->job_id, m->stime, cs->hostId()));
+
+    if (trace_writer) {
+        TraceRecord record;
+        record.type = TraceRecord::BEGIN;
+        record.host = cs->hostId();
+        record.job = m->job_id;
+        record_trace(record);
+    }
 #if DEBUG_SCHEDULER >= 0
     trace() << "BEGIN: " << m->job_id << " client=" << job->submitter()->nodeName()
             << "(" << job->targetPlatform() << ")" << " server="
@@ -1099,11 +2443,13 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
                         for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
                             if (*jit == j) {
                                 l->l.erase(jit);
+                                --metrics.queuedJobs;
                                 break;
                             }
                         }
 
                         if (l->l.empty()) {
+                            delete l;
                             it = toanswer.erase(it);
                             break;
                         }
@@ -1112,6 +2458,8 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
         }
     } else if (jobs.find(m->job_id) != jobs.end()) {
         j = jobs[m->job_id];
+    } else if (federation_jobs.count(m->job_id)) {
+        return handle_federated_job_done(cs, m);
     }
 
     if (!j) {
@@ -1119,6 +2467,13 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
         return false;
     }
 
+    if (j->state() == Job::PENDING && m->exitcode == CLIENT_WAS_WAITING_FOR_CS) {
+        // not needed anymore, it was taken out of the queue above
+        jobs.erase(j->id());
+        delete j;
+        return true;
+    }
+
     if (j->state() == Job::PENDING) {
         trace() << "job ID still pending ?! scheduler recently restarted? " << m->job_id << endl;
         return false;
@@ -1172,12 +2527,57 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
                 << " status=" << m->exitcode << endl;
     }
 
+    if (trace_writer && !j->leased()) {
+        TraceRecord record;
+        record.type = TraceRecord::DONE;
+        record.host = cs->hostId();
+        record.job = m->job_id;
+        record.exitcode = m->exitcode;
+        record.flags = m->is_from_server() ? TraceRecord::FROM_SERVER : 0;
+        record.realMsec = m->real_msec;
+        record.userMsec = m->user_msec;
+        record.inSize = m->in_uncompressed;
+        record.outSize = m->out_uncompressed;
+        record_trace(record);
+    }
+
+    if (m->is_from_server()) {
+        ++metrics.jobsDone;
+        metrics.jobsFailed += m->exitcode != 0;
+        metrics.inBytes += m->in_compressed;
+        metrics.outBytes += m->out_compressed;
+    }
+
     if (j->server()) {
         j->server()->removeJob(j);
+        rank_server(j->server());
     }
 
     add_job_stats(j, m);
-    notify_monitors(new MonJobDoneMsg(*m));
+
+    if (m->exitcode == 0 && m->user_msec) {
+        job_costs.learn(j->fileName(), m->user_msec, m->in_uncompressed, m->out_uncompressed,
+                        m->max_rss);
+        unsigned long size = m->in_uncompressed + m->out_uncompressed;
+        transfer_size = transfer_size ? (transfer_size * 15 + size) / 16 : size;
+
+        JobCost cost;
+
+        if (!standbys.empty() && job_costs.predict(j->fileName(), cost)) {
+            replicate(StatsFile::costLine(j->fileName(), cost));
+        }
+    }
+
+    if (!j->leased()) {
+        notify_monitors(new MonJobDoneMsg(*m));
+    }
+
+    // the scheduler of the farm it came from is done with it too
+    if (j->submitter()->type() == CompileServer::FEDERATION && m->is_from_server()) {
+        queue_msg(j->submitter(), *m);
+    }
+
+    replicate_job_done(j);
     jobs.erase(m->job_id);
     delete j;
 
@@ -1190,6 +2590,7 @@ static bool handle_ping(CompileServer *cs, Msg * /*_m*/)
 
     if (cs->maxJobs() < 0) {
         cs->setMaxJobs(cs->maxJobs() * -1);
+        rank_server(cs);
     }
 
     return true;
@@ -1203,24 +2604,43 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
         return false;
     }
 
+    // it needs no ping while it reports
+    cs->last_talk = time(0);
+
     /* Before protocol 25, ping and stat handling was
        clutched together.  */
     if (!IS_PROTOCOL_25(cs)) {
-        cs->last_talk = time(0);
-
         if (cs && (cs->maxJobs() < 0)) {
             cs->setMaxJobs(cs->maxJobs() * -1);
         }
     }
 
-    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
-        if (*it == cs) {
-            (*it)->setLoad(m->load);
-            handle_monitor_stats(*it, m);
-            return true;
-        }
+    if (!server_index.contains(cs)) {
+        return false;
+    }
+
+    cs->setLoad(m->load);
+    cs->setFreeMem(m->freeMem);
+
+    if (trace_writer) {
+        TraceRecord record;
+        record.type = TraceRecord::STATS;
+        record.host = cs->hostId();
+        record.load = m->load;
+        record_trace(record);
+    }
+
+    for (list<PeerLink>::const_iterator it = m->links.begin(); it != m->links.end(); ++it) {
+        cs->setPeerLink(*it);
+    }
 
-    return false;
+    if (!m->phases.empty()) {
+        cs->addPhaseCounts(m->phases);
+    }
+
+    rank_server(cs);
+    handle_monitor_stats(cs, m);
+    return true;
 }
 
 static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
@@ -1315,6 +2735,81 @@ static bool handle_control_login(CompileServer *cs)
     return cs->send_msg(TextMsg(o.str()));
 }
 
+/* The state of each compile server for the "metrics" command, in the
+   Prometheus text format like Metrics::write().  */
+static void write_node_metrics(ostream &out)
+{
+    static const char *const names[] = {
+        "icecc_node_jobs", "icecc_node_max_jobs", "icecc_node_load", "icecc_node_installing",
+        "icecc_node_quarantined", "icecc_node_benchmark_user_msec",
+        "icecc_node_benchmark_overhead_msec"
+    };
+    static const char *const helps[] = {
+        "Jobs the compile server has.", "Jobs the compile server takes at most.",
+        "Load of the compile server, 1000 is fully loaded.",
+        "Whether the compile server is installing an environment.",
+        "Whether the compile server gets no jobs after failing the benchmark.",
+        "CPU time the last benchmark took on the compile server.",
+        "What the last benchmark took on top of compiling, with the round trip."
+    };
+
+    for (int metric = 0; metric < 7; ++metric) {
+        out << "# HELP " << names[metric] << " " << helps[metric] << "\n";
+        out << "# TYPE " << names[metric] << " gauge\n";
+
+        for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+            const CompileServer *cs = *it;
+            long value = metric == 0 ? long(cs->jobList().size())
+                         : metric == 1 ? long(cs->maxJobs())
+                         : metric == 2 ? long(cs->load())
+                         : metric == 3 ? long(cs->busyInstalling() != 0)
+                         : metric == 4 ? long(cs->quarantined())
+                         : metric == 5 ? long(cs->benchmark().user_msec)
+                         : long(cs->benchmark().overhead_msec);
+            out << names[metric] << "{node=\"" << cs->nodeName() << "\",ip=\"" << cs->name
+                << "\"} " << value << "\n";
+        }
+    }
+
+    /* What the daemons reported about the phases of their jobs, to tell
+       a slow compiler from slow transfers or a slow setup.  */
+    out << "# HELP icecc_node_phase_seconds Durations of the phases of the jobs on the compile server.\n";
+    out << "# TYPE icecc_node_phase_seconds histogram\n";
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        const CompileServer *cs = *it;
+        const vector<unsigned long long> &counts = cs->phaseCounts();
+
+        if (counts.size() != PHASE_COUNT * PHASE_VALUES) {
+            continue;
+        }
+
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const unsigned long long *values = &counts[phase * PHASE_VALUES];
+            string labels = "node=\"" + cs->nodeName() + "\",ip=\"" + cs->name + "\",phase=\""
+                            + job_phase_names[phase] + "\"";
+            unsigned long long cumulative = 0;
+
+            for (int bucket = 0; bucket < PHASE_BUCKETS; ++bucket) {
+                cumulative += values[bucket];
+                out << "icecc_node_phase_seconds_bucket{" << labels << ",le=\"";
+
+                if (bucket < PHASE_BUCKETS - 1) {
+                    out << job_phase_bucket_msec[bucket] / 1000.0;
+                } else {
+                    out << "+Inf";
+                }
+
+                out << "\"} " << cumulative << "\n";
+            }
+
+            out << "icecc_node_phase_seconds_sum{" << labels << "} "
+                << values[PHASE_BUCKETS] / 1000.0 << "\n";
+            out << "icecc_node_phase_seconds_count{" << labels << "} " << cumulative << "\n";
+        }
+    }
+}
+
 static bool handle_line(CompileServer *cs, Msg *_m)
 {
     TextMsg *m = dynamic_cast<TextMsg *>(_m);
@@ -1376,6 +2871,43 @@ static bool handle_line(CompileServer *cs, Msg *_m)
             if (!cs->send_msg(TextMsg(" " + dump_job(it->second)))) {
                 return false;
             }
+    } else if (cmd == "metrics" || cmd == "get") {
+        /* "GET /metrics HTTP/1.x" is answered as a HTTP server would, so
+           that it can be scraped as well.  */
+        bool http = cmd == "get";
+
+        if (http && (l.empty() || l.front() != "/metrics")) {
+            cs->send_msg(TextMsg("HTTP/1.0 404 Not Found\r\n\r"));
+            shutdown(cs->fd, SHUT_WR);
+            handle_end(cs, 0);
+            return false;
+        }
+
+        ostringstream out;
+        metrics.write(out);
+        write_node_metrics(out);
+
+        if (http && !cs->send_msg(TextMsg("HTTP/1.0 200 OK\r\n"
+                                          "Content-Type: text/plain; version=0.0.4\r\n\r"))) {
+            return false;
+        }
+
+        list<string> lines;
+        split_string(out.str(), "\n", lines);
+
+        for (list<string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            if (!cs->send_msg(TextMsg(*it), MsgChannel::SendQueued)) {
+                return false;
+            }
+        }
+
+        if (http) {
+            // the response ends with the connection, without the goodbye
+            cs->flush();
+            shutdown(cs->fd, SHUT_WR);
+            handle_end(cs, 0);
+            return false;
+        }
     } else if (cmd == "quit" || cmd == "exit") {
         handle_end(cs, 0);
         return false;
@@ -1450,7 +2982,7 @@ static bool handle_line(CompileServer *cs, Msg *_m)
         }
     } else if (cmd == "help") {
         if (!cs->send_msg(TextMsg(
-                             "listcs\nlistblocks\nlistjobs\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
+                             "listcs\nlistblocks\nlistjobs\nmetrics\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
             return false;
         }
     } else {
@@ -1478,7 +3010,22 @@ static bool try_login(CompileServer *cs, Msg *m)
         break;
     case M_MON_LOGIN:
         cs->setType(CompileServer::MONITOR);
-        ret = handle_mon_login(cs, m);
+
+        // C is not ours anymore
+        if (handle_mon_login(cs, m)) {
+            delete m;
+            return false;
+        }
+
+        ret = false;
+        break;
+    case M_STANDBY_LOGIN:
+        cs->setType(CompileServer::STANDBY);
+        ret = handle_standby_login(cs, m);
+        break;
+    case M_FEDERATION_LOGIN:
+        cs->setType(CompileServer::FEDERATION);
+        ret = handle_federation_login(cs, m);
         break;
     default:
         log_info() << "Invalid first message " << (char)m->type << endl;
@@ -1496,6 +3043,37 @@ static bool try_login(CompileServer *cs, Msg *m)
     return ret;
 }
 
+/* Removes the jobs TOREMOVE compiles or submitted, it went away.  */
+static void drop_jobs_of(CompileServer *toremove)
+{
+    for (map<unsigned int, Job *>::iterator mit = jobs.begin(); mit != jobs.end();) {
+        Job *job = mit->second;
+
+        if (job->server() == toremove || job->submitter() == toremove) {
+            trace() << "STOP (DAEMON2) FOR " << mit->first << endl;
+            ++metrics.jobsLost;
+            notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
+
+            /* If this job is removed because the submitter is removed
+            also remove the job from the servers joblist.  */
+            if (job->server() && job->server() != toremove) {
+                job->server()->removeJob(job);
+                rank_server(job->server());
+            }
+
+            if (job->server()) {
+                job->server()->setBusyInstalling(0);
+            }
+
+            replicate_job_done(job);
+            jobs.erase(mit++);
+            delete job;
+        } else {
+            ++mit;
+        }
+    }
+}
+
 static bool handle_end(CompileServer *toremove, Msg *m)
 {
 #if DEBUG_SCHEDULER > 1
@@ -1506,15 +3084,22 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 
     switch (toremove->type()) {
     case CompileServer::MONITOR:
-        assert(find(monitors.begin(), monitors.end(), toremove) != monitors.end());
-        monitors.remove(toremove);
-#if DEBUG_SCHEDULER > 1
-        trace() << "handle_end(moni) " << monitors.size() << endl;
-#endif
+        // one that logged in belongs to the monitor feed
         break;
     case CompileServer::DAEMON:
         log_info() << "remove daemon " << toremove->nodeName() << endl;
 
+        if (find(css.begin(), css.end(), toremove) != css.end()) {
+            ++metrics.daemonLogouts;
+
+            if (trace_writer) {
+                TraceRecord record;
+                record.type = TraceRecord::LOGOUT;
+                record.host = toremove->hostId();
+                record_trace(record);
+            }
+        }
+
         notify_monitors(new MonStatsMsg(toremove->hostId(), "State:Offline\n"));
 
         /* A daemon disconnected.  We must remove it from the css list,
@@ -1522,7 +3107,17 @@ static bool handle_end(CompileServer *toremove, Msg *m)
         There might be still clients connected running on the machine on which
          the daemon died.  We expect that the daemon dying makes the client
          disconnect soon too.  */
+        if (server_index.contains(toremove)) {
+            stats_file->remember(toremove);
+        }
+
         css.remove(toremove);
+        server_index.remove(toremove);
+        seeding.erase(toremove);
+
+        if (toremove->resultCache()) {
+            send_result_owners();
+        }
 
         /* Unfortunately the toanswer queues are also tagged based on the daemon,
            so we need to clean them up also.  */
@@ -1534,6 +3129,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
 
                 for (jit = l->l.begin(); jit != l->l.end(); ++jit) {
                     trace() << "STOP (DAEMON) FOR " << (*jit)->id() << endl;
+                    --metrics.queuedJobs;
                     notify_monitors(new MonJobDoneMsg(JobDoneMsg((*jit)->id(),  255)));
 
                     if ((*jit)->server()) {
@@ -1551,29 +3147,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
             }
         }
 
-        for (map<unsigned int, Job *>::iterator mit = jobs.begin(); mit != jobs.end();) {
-            Job *job = mit->second;
-
-            if (job->server() == toremove || job->submitter() == toremove) {
-                trace() << "STOP (DAEMON2) FOR " << mit->first << endl;
-                notify_monitors(new MonJobDoneMsg(JobDoneMsg(job->id(),  255)));
-
-                /* If this job is removed because the submitter is removed
-                also remove the job from the servers joblist.  */
-                if (job->server() && job->server() != toremove) {
-                    job->server()->removeJob(job);
-                }
-
-                if (job->server()) {
-                    job->server()->setBusyInstalling(0);
-                }
-
-                jobs.erase(mit++);
-                delete job;
-            } else {
-                ++mit;
-            }
-        }
+        drop_jobs_of(toremove);
 
         for (list<CompileServer *>::iterator itr = css.begin(); itr != css.end(); ++itr) {
             (*itr)->eraseCSFromBlacklist(toremove);
@@ -1584,12 +3158,50 @@ static bool handle_end(CompileServer *toremove, Msg *m)
         toremove->send_msg(TextMsg("200 Good Bye!"));
         controls.remove(toremove);
 
+        break;
+    case CompileServer::STANDBY:
+        log_info() << "remove standby scheduler " << toremove->name << endl;
+        standbys.remove(toremove);
+
+        break;
+    case CompileServer::FEDERATION:
+        log_info() << "remove federated scheduler " << toremove->nodeName() << endl;
+        federation.disconnected(toremove, time(0) + FEDERATION_RETRY);
+
+        // what was sent there and not answered yet looks for a server here again
+        for (map<unsigned int, CompileServer *>::iterator it = federation_pending.begin();
+                it != federation_pending.end();) {
+            if (it->second != toremove) {
+                ++it;
+                continue;
+            }
+
+            if (jobs.count(it->first)) {
+                enqueue_job_request(jobs[it->first]);
+            }
+
+            federation_pending.erase(it++);
+        }
+
+        for (map<unsigned int, CompileServer *>::iterator it = federation_jobs.begin();
+                it != federation_jobs.end();) {
+            if (it->second == toremove) {
+                federation_jobs.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        drop_jobs_of(toremove);
         break;
     default:
         trace() << "remote end had UNKNOWN type?" << endl;
         break;
     }
 
+    poller.unwatch(toremove->fd);
+    pending_fds.erase(toremove->fd);
+    unhandled_fds.erase(toremove->fd);
     fd2cs.erase(toremove->fd);
     delete toremove;
     return true;
@@ -1642,11 +3254,27 @@ static bool handle_activity(CompileServer *cs)
         ret = handle_line(cs, m);
         break;
     case M_GET_CS:
-        ret = handle_cs_request(cs, m);
+        ret = cs->type() == CompileServer::FEDERATION ? handle_federated_request(cs, m)
+              : handle_cs_request(cs, m);
+        break;
+    case M_USE_CS:
+        ret = handle_federated_answer(cs, m);
+        break;
+    case M_FEDERATION_CAPACITY:
+        federation.setCapacity(cs, *static_cast<FederationCapacityMsg *>(m));
+        break;
+    case M_USE_LEASE:
+        ret = handle_use_lease(cs, m);
         break;
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(cs, m);
         break;
+    case M_BENCHMARK_RESULT:
+        ret = handle_benchmark_result(cs, m);
+        break;
+    case M_COMPRESSION_DICT:
+        ret = handle_compression_dict(cs, m);
+        break;
     default:
         log_info() << "Invalid message type arrived " << (char)m->type << endl;
         handle_end(cs, m);
@@ -1658,6 +3286,42 @@ static bool handle_activity(CompileServer *cs)
     return ret;
 }
 
+/* Handles the messages that arrived for the channel at fd, after reading
+   from it if READ is set.  */
+static void handle_input(int fd, bool read)
+{
+    map<int, CompileServer *>::iterator it = fd2cs.find(fd);
+
+    if (it == fd2cs.end()) {
+        return;
+    }
+
+    CompileServer *cs = it->second;
+    unhandled_fds.erase(fd);
+
+    if (read) {
+        while (!cs->read_a_bit() || cs->has_msg()) {
+            if (!handle_activity(cs)) {
+                break;
+            }
+        }
+    } else {
+        while (cs->has_msg()) {
+            if (!handle_activity(cs)) {
+                break;
+            }
+        }
+    }
+
+    /* handle_activity() can delete cs, or stop with messages left in
+       the buffer, which don't make the poller wake up.  */
+    it = fd2cs.find(fd);
+
+    if (it != fd2cs.end() && it->second->has_msg()) {
+        unhandled_fds.insert(fd);
+    }
+}
+
 static int open_broad_listener(int port)
 {
     int listen_fd;
@@ -1781,6 +3445,16 @@ static void usage(const char *reason = 0)
          << "  -l, --log-file <file>\n"
          << "  -d, --daemonize\n"
          << "  -u, --user-uid\n"
+         << "  -P, --policy <" << SchedulerPolicy::names() << ">\n"
+         << "  -s, --stats-file <file>\n"
+         << "  -S, --standby <primary scheduler host>\n"
+         << "  -w, --class-weights <interactive>,<ci>,<batch>\n"
+         << "  -t, --trace-file <file>\n"
+         << "  -H, --hedge-factor <factor>\n"
+         << "  -A, --async-log <KB/s>\n"
+         << "  -M, --monitor-thread\n"
+         << "  -F, --federate <scheduler host>[:<port>]\n"
+         << "  -C, --federation-cost <msec per MB>\n"
          << "  -v[v[v]]]\n"
          << endl;
 
@@ -1811,6 +3485,12 @@ int main(int argc, char *argv[])
     bool detach = false;
     int debug_level = Error;
     string logfile;
+    string stats_path;
+    string standby_host;
+    string trace_path;
+    bool async_log = false;
+    int async_log_rate = 0;
+    bool monitor_thread = false;
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno = 0;
@@ -1840,10 +3520,20 @@ int main(int argc, char *argv[])
             { "daemonize", 0, NULL, 'd'},
             { "log-file", 1, NULL, 'l'},
             { "user-uid", 1, NULL, 'u'},
+            { "policy", 1, NULL, 'P'},
+            { "stats-file", 1, NULL, 's'},
+            { "standby", 1, NULL, 'S'},
+            { "class-weights", 1, NULL, 'w'},
+            { "trace-file", 1, NULL, 't'},
+            { "hedge-factor", 1, NULL, 'H'},
+            { "async-log", 1, NULL, 'A'},
+            { "monitor-thread", 0, NULL, 'M'},
+            { "federate", 1, NULL, 'F'},
+            { "federation-cost", 1, NULL, 'C'},
             { 0, 0, 0, 0 }
         };
 
-        const int c = getopt_long(argc, argv, "n:p:hl:vdr:u:", long_options, &option_index);
+        const int c = getopt_long(argc, argv, "n:p:hl:vdr:u:P:s:S:w:t:H:A:MF:C:", long_options, &option_index);
 
         if (c == -1) {
             break;    // eoo
@@ -1899,6 +3589,108 @@ int main(int argc, char *argv[])
             }
 
             break;
+        case 'P':
+
+            if (optarg && *optarg) {
+                delete policy;
+                policy = SchedulerPolicy::create(optarg);
+
+                if (!policy) {
+                    usage("Error: Unknown scheduling policy specified");
+                }
+            } else {
+                usage("Error: -P requires argument");
+            }
+
+            break;
+        case 's':
+            stats_path = optarg ? optarg : "";
+            break;
+        case 't':
+
+            if (optarg && *optarg) {
+                trace_path = optarg;
+            } else {
+                usage("Error: -t requires argument");
+            }
+
+            break;
+        case 'H':
+
+            if (!optarg || atof(optarg) < 0) {
+                usage("Error: -H requires a factor of at least 1, or 0");
+            }
+
+            hedge_factor = atof(optarg);
+
+            if (hedge_factor > 0 && hedge_factor < 1) {
+                usage("Error: -H requires a factor of at least 1, or 0");
+            }
+
+            break;
+        case 'A':
+
+            if (optarg && *optarg) {
+                async_log_rate = max(atoi(optarg), 0);
+                async_log = true;
+            } else {
+                usage("Error: -A requires argument");
+            }
+
+            break;
+        case 'M':
+            monitor_thread = true;
+            break;
+        case 'F': {
+            string host = optarg ? optarg : "";
+            string::size_type colon = host.rfind(':');
+            unsigned int port = 8765;
+
+            if (colon != string::npos) {
+                port = atoi(host.c_str() + colon + 1);
+                host.erase(colon);
+            }
+
+            if (host.empty() || !port) {
+                usage("Error: -F requires a host and optionally a port");
+            }
+
+            federation.addHost(host, port);
+            break;
+        }
+        case 'C':
+
+            if (optarg && *optarg) {
+                federation.setMsecPerMB(atoi(optarg));
+            } else {
+                usage("Error: -C requires argument");
+            }
+
+            break;
+        case 'S':
+
+            if (optarg && *optarg) {
+                standby_host = optarg;
+            } else {
+                usage("Error: -S requires argument");
+            }
+
+            break;
+        case 'w': {
+            unsigned int weights[JC_COUNT];
+
+            if (!optarg || sscanf(optarg, "%u,%u,%u", &weights[JC_INTERACTIVE],
+                                  &weights[JC_CI], &weights[JC_BATCH]) != JC_COUNT
+                    || !weights[JC_INTERACTIVE] || !weights[JC_CI] || !weights[JC_BATCH]) {
+                usage("Error: -w requires three weights greater than 0");
+            }
+
+            for (int i = 0; i < JC_COUNT; ++i) {
+                class_weights[i] = weights[i];
+            }
+
+            break;
+        }
         case 'u':
 
             if (optarg && *optarg) {
@@ -1962,10 +3754,68 @@ int main(int argc, char *argv[])
 
     log_info() << "ICECREAM scheduler " VERSION " starting up, port " << scheduler_port << endl;
 
+    if (!policy) {
+        policy = SchedulerPolicy::create(SchedulerPolicy::defaultName());
+    }
+
+    log_info() << "scheduling policy: " << policy->name() << endl;
+
+    /* Saved as a temporary file renamed over it, by the user dropped to.
+       Better to find out now than when the statistics are lost.  */
+    if (!stats_path.empty()) {
+        string::size_type slash = stats_path.rfind('/');
+        string stats_dir = slash == string::npos ? "." : stats_path.substr(0, slash + 1);
+
+        if (access(stats_dir.c_str(), W_OK | X_OK) != 0) {
+            log_perror(("Error: can't save the statistics file in " + stats_dir).c_str());
+            return 1;
+        }
+    }
+
+    stats_file = new StatsFile(stats_path);
+
+    if (!stats_path.empty()) {
+        stats_file->load(all_job_stats, job_costs, install_msec);
+    }
+
+    if (!trace_path.empty()) {
+        trace_writer = new TraceWriter;
+
+        if (!trace_writer->open(trace_path)) {
+            log_perror("opening the trace file failed");
+            return 1;
+        }
+
+        log_info() << "recording the farm to " << trace_path << endl;
+    }
+
+    time_t last_stats_save = time(0);
+    time_t last_standby_ping = 0;
+
     if (detach) {
         daemon(0, 0);
     }
 
+    // the threads don't survive daemon(), the monitor feed logs from its own
+    bool logging_async = false;
+
+    if (async_log || monitor_thread) {
+        logging_async = start_async_logging(async_log_rate * 1024UL);
+
+        if (!logging_async) {
+            log_error() << "failed to start logging asynchronously" << endl;
+        }
+    }
+
+    if (monitor_thread && (!logging_async || !monitor_feed.start())) {
+        log_error() << "failed to start the monitor thread, feeding them from the main loop" << endl;
+    }
+
+    /* A standby scheduler opens its ports only when it takes over.  */
+    if (!standby_host.empty() && !stand_by(standby_host)) {
+        return 1;
+    }
+
     listen_fd = open_tcp_listener(scheduler_port);
 
     if (listen_fd < 0) {
@@ -2008,15 +3858,29 @@ int main(int argc, char *argv[])
     broadcast_scheduler_version();
     last_announce = starttime;
 
+    bool listening = false;
+    poller.watch(broad_fd, Poller::Read);
+
     while (!exit_main_loop) {
-        struct timeval tv;
-        tv.tv_usec = 0;
-        tv.tv_sec = prune_servers();
+        int timeout = prune_servers() * 1000;
 
         while (empty_queue()) {
             continue;
         }
 
+        if (hedge_factor > 0) {
+            hedge_stragglers();
+            timeout = min(timeout, 1000);
+        }
+
+        if (!toanswer.empty()) {
+            notify_waiting_jobs();
+            timeout = min(timeout, 1000);
+        }
+
+        seed_environments();
+        benchmark_servers();
+
         /* Announce ourselves from time to time, to make other possible schedulers disconnect
            their daemons if we are the preferred scheduler (daemons with version new enough
            should automatically select the best scheduler, but old daemons connect randomly). */
@@ -2025,211 +3889,191 @@ int main(int argc, char *argv[])
             last_announce = time(NULL);
         }
 
-        fd_set read_set;
-        int max_fd = 0;
-        FD_ZERO(&read_set);
+        if (last_stats_save + STATS_SAVE_INTERVAL < time(NULL)) {
+            save_stats();
+            last_stats_save = time(NULL);
+        }
 
-        if (time(0) >= next_listen) {
-            max_fd = listen_fd;
-            FD_SET(listen_fd, &read_set);
+        if (!federation.empty()) {
+            timeout = min(timeout, int(update_federation(netname)) * 1000);
+        }
 
-            if (text_fd > max_fd) {
-                max_fd = text_fd;
+        if (!standbys.empty()) {
+            if (last_standby_ping + STANDBY_PING_INTERVAL <= time(NULL)) {
+                replicate("nextid " + toString(new_job_id) + "\n");
+                last_standby_ping = time(NULL);
             }
 
-            FD_SET(text_fd, &read_set);
+            timeout = min(timeout, STANDBY_PING_INTERVAL * 1000);
         }
 
-        if (broad_fd > max_fd) {
-            max_fd = broad_fd;
+        if (!listening && time(0) >= next_listen) {
+            poller.watch(listen_fd, Poller::Read);
+            poller.watch(text_fd, Poller::Read);
+            listening = true;
+        } else if (!listening) {
+            /* Wake up when it's time to accept connections again.  */
+            timeout = min(timeout, int(next_listen - time(0)) * 1000);
         }
 
-        FD_SET(broad_fd, &read_set);
-
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            bool ok = true;
-            ++it;
-
-            /* handle_activity() can delete c and make the iterator
-               invalid.  */
-            while (ok && cs->has_msg()) {
-                if (!handle_activity(cs)) {
-                    ok = false;
-                }
-            }
+        set<int> unhandled;
+        unhandled.swap(unhandled_fds);
 
-            if (ok) {
-                if (i > max_fd) {
-                    max_fd = i;
-                }
+        for (set<int>::const_iterator it = unhandled.begin(); it != unhandled.end(); ++it) {
+            handle_input(*it, false);
+        }
 
-                FD_SET(i, &read_set);
-            }
+        if (!unhandled_fds.empty()) {
+            timeout = 0;
         }
 
-        max_fd = select(max_fd + 1, &read_set, NULL, NULL, &tv);
+        timeout = min(timeout, monitor_feed.flush());
+        flush_channels();
+
+        int ready = poller.wait(timeout);
 
-        if (max_fd < 0 && errno == EINTR) {
+        if (ready < 0 && errno == EINTR) {
             continue;
         }
 
-        if (max_fd < 0) {
-            log_perror("select()");
+        if (ready < 0) {
+            log_perror("poller");
             return 1;
         }
 
-        if (FD_ISSET(listen_fd, &read_set)) {
-            max_fd--;
-            bool pending_connections = true;
-
-            while (pending_connections) {
-                remote_len = sizeof(remote_addr);
-                remote_fd = accept(listen_fd,
-                                   (struct sockaddr *) &remote_addr,
-                                   &remote_len);
+        for (int r = 0; r < ready; ++r) {
+            int fd = poller.ready_fd(r);
 
-                if (remote_fd < 0) {
-                    pending_connections = false;
-                }
+            if (fd == listen_fd) {
+                bool pending_connections = true;
 
-                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
-                        && errno != EWOULDBLOCK) {
-                    log_perror("accept()");
-                    /* don't quit because of ECONNABORTED, this can happen during
-                     * floods  */
-                }
+                while (pending_connections) {
+                    remote_len = sizeof(remote_addr);
+                    remote_fd = accept(listen_fd,
+                                       (struct sockaddr *) &remote_addr,
+                                       &remote_len);
 
-                if (remote_fd >= 0) {
-                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
-                    trace() << "accepted " << cs->name << endl;
-                    cs->last_talk = time(0);
+                    if (remote_fd < 0) {
+                        pending_connections = false;
+                    }
 
-                    if (!cs->protocol) { // protocol mismatch
-                        delete cs;
-                        continue;
+                    if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
+                            && errno != EWOULDBLOCK) {
+                        log_perror("accept()");
+                        /* don't quit because of ECONNABORTED, this can happen during
+                         * floods  */
                     }
 
-                    fd2cs[cs->fd] = cs;
+                    if (remote_fd >= 0) {
+                        CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
+                        trace() << "accepted " << cs->name << endl;
+                        cs->last_talk = time(0);
 
-                    while (!cs->read_a_bit() || cs->has_msg()) {
-                        if (! handle_activity(cs)) {
-                            break;
+                        if (!cs->protocol) { // protocol mismatch
+                            delete cs;
+                            continue;
                         }
+
+                        fd2cs[cs->fd] = cs;
+                        poller.watch(cs->fd, Poller::Read);
+                        handle_input(cs->fd, true);
                     }
                 }
-            }
 
-            next_listen = time(0) + 1;
-        }
+                /* Don't listen for a second, so that accepting doesn't
+                   starve the connected daemons.  */
+                next_listen = time(0) + 1;
+                poller.unwatch(listen_fd);
+                poller.unwatch(text_fd);
+                listening = false;
+            } else if (fd == text_fd) {
+                remote_len = sizeof(remote_addr);
+                remote_fd = accept(text_fd,
+                                   (struct sockaddr *) &remote_addr,
+                                   &remote_len);
 
-        if (max_fd && FD_ISSET(text_fd, &read_set)) {
-            max_fd--;
-            remote_len = sizeof(remote_addr);
-            remote_fd = accept(text_fd,
-                               (struct sockaddr *) &remote_addr,
-                               &remote_len);
+                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
+                    log_perror("accept()");
+                    /* Don't quit the scheduler just because a debugger couldn't
+                       connect.  */
+                }
 
-            if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
-                log_perror("accept()");
-                /* Don't quit the scheduler just because a debugger couldn't
-                   connect.  */
-            }
+                if (remote_fd >= 0) {
+                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
+                    fd2cs[cs->fd] = cs;
+                    poller.watch(cs->fd, Poller::Read);
 
-            if (remote_fd >= 0) {
-                CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
-                fd2cs[cs->fd] = cs;
+                    if (!handle_control_login(cs)) {
+                        handle_end(cs, 0);
+                        continue;
+                    }
 
-                if (!handle_control_login(cs)) {
-                    handle_end(cs, 0);
-                    continue;
+                    handle_input(cs->fd, true);
                 }
 
-                while (!cs->read_a_bit() || cs->has_msg())
-                    if (!handle_activity(cs)) {
-                        break;
+            } else if (fd == broad_fd) {
+                char buf[BROAD_BUFLEN];
+                struct sockaddr_in broad_addr;
+                socklen_t broad_len = sizeof(broad_addr);
+                /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
+                   announcing itself (4 bytes + time). */
+                const int schedbuflen = 4 + sizeof(uint64_t);
+
+                int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
+                                      &broad_len);
+                if (buflen != 1 && buflen != schedbuflen) {
+                    int err = errno;
+                    log_perror("recvfrom()");
+
+                    /* Some linux 2.6 kernels can return from select with
+                       data available, and then return from read() with EAGAIN
+                    even on a blocking socket (breaking POSIX).  Happens
+                     when the arriving packet has a wrong checksum.  So
+                     we ignore EAGAIN here, but still abort for all other errors. */
+                    if (err != EAGAIN) {
+                        return -1;
                     }
-            }
-        }
-
-        if (max_fd && FD_ISSET(broad_fd, &read_set)) {
-            max_fd--;
-            char buf[BROAD_BUFLEN];
-            struct sockaddr_in broad_addr;
-            socklen_t broad_len = sizeof(broad_addr);
-            /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
-               announcing itself (4 bytes + time). */
-            const int schedbuflen = 4 + sizeof(uint64_t);
-
-            int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
-                                  &broad_len);
-            if (buflen != 1 && buflen != schedbuflen) {
-                int err = errno;
-                log_perror("recvfrom()");
-
-                /* Some linux 2.6 kernels can return from select with
-                   data available, and then return from read() with EAGAIN
-                even on a blocking socket (breaking POSIX).  Happens
-                 when the arriving packet has a wrong checksum.  So
-                 we ignore EAGAIN here, but still abort for all other errors. */
-                if (err != EAGAIN) {
-                    return -1;
                 }
-            }
-            /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
-            else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
-                log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
-                           << ":" << ntohs(broad_addr.sin_port)
-                           << " (version " << int(buf[0]) << ")\n";
-                int reply_len = prepare_broadcast_reply(buf, netname);
-                if (sendto(broad_fd, buf, reply_len, 0,
-                           (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
-                    log_perror("sendto()");
-                }
-            }
-            else if (buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
-                /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
-                   or the same version but was started earlier. */
-                uint64_t tmp_time;
-                memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
-                time_t other_time = tmp_time;
-                if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
-                    if (!css.empty() || !monitors.empty()) {
-                        log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
+                else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
+                    log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
                                << ":" << ntohs(broad_addr.sin_port)
-                               << " (version " << int(buf[3]) << ") has announced itself as a preferred"
-                            " scheduler, disconnecting all connections." << endl;
-                        while (!css.empty())
-                            handle_end(css.front(), NULL);
-                        while (!monitors.empty())
-                            handle_end(monitors.front(), NULL);
+                               << " (version " << int(buf[0]) << ")\n";
+                    int reply_len = prepare_broadcast_reply(buf, netname);
+                    if (sendto(broad_fd, buf, reply_len, 0,
+                               (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
+                        log_perror("sendto()");
                     }
                 }
-            }
-        }
-
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
-                max_fd && it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            /* handle_activity can delete the channel from the fd2cs list,
-               hence advance the iterator right now, so it doesn't become
-               invalid.  */
-            ++it;
-
-            if (FD_ISSET(i, &read_set)) {
-                while (!cs->read_a_bit() || cs->has_msg()) {
-                    if (!handle_activity(cs)) {
-                        break;
+                else if (buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
+                    /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
+                       or the same version but was started earlier. */
+                    uint64_t tmp_time;
+                    memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
+                    time_t other_time = tmp_time;
+                    if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
+                        if (!css.empty() || !monitor_feed.empty()) {
+                            log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                                   << ":" << ntohs(broad_addr.sin_port)
+                                   << " (version " << int(buf[3]) << ") has announced itself as a preferred"
+                                " scheduler, disconnecting all connections." << endl;
+                            while (!css.empty())
+                                handle_end(css.front(), NULL);
+                            monitor_feed.dropAll();
+                        }
                     }
                 }
-
-                max_fd--;
+            } else if (poller.ready_events(r) & Poller::Read) {
+                /* handle_activity() can delete channels, handle_input()
+                   looks them up by fd.  */
+                handle_input(fd, true);
             }
         }
     }
 
+    save_stats();
+    monitor_feed.stop();
+
     shutdown(broad_fd, SHUT_RDWR);
     close(broad_fd);
     unlink(pidFilePath.c_str());
@@ -0,0 +1,99 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "serverindex.h"
+
+using namespace std;
+
+void ServerIndex::add(CompileServer *cs, float speed)
+{
+    m_rank[cs] = m_ranking.insert(make_pair(speed, cs));
+}
+
+void ServerIndex::remove(CompileServer *cs)
+{
+    setEnvironments(cs, EnvSet());
+    m_serverEnvs.erase(cs);
+
+    map<CompileServer *, Ranking::iterator>::iterator it = m_rank.find(cs);
+
+    if (it != m_rank.end()) {
+        m_ranking.erase(it->second);
+        m_rank.erase(it);
+    }
+}
+
+/* The environments are keyed like envs_match() looks for them, by the
+   target platform and the name.  */
+void ServerIndex::setEnvironments(CompileServer *cs, const EnvSet &envs)
+{
+    EnvSet &current = m_serverEnvs[cs];
+
+    for (EnvIds::const_iterator it = current.ids().begin(); it != current.ids().end(); ++it) {
+        map<EnvId, size_t>::iterator count = m_envCounts.find(*it);
+
+        if (count != m_envCounts.end() && !--count->second) {
+            m_envCounts.erase(count);
+        }
+    }
+
+    current = envs;
+
+    for (EnvIds::const_iterator it = current.ids().begin(); it != current.ids().end(); ++it) {
+        m_envCounts[*it]++;
+    }
+}
+
+bool ServerIndex::hasEnvironment(CompileServer *cs, EnvId env) const
+{
+    map<CompileServer *, EnvSet>::const_iterator it = m_serverEnvs.find(cs);
+
+    return it != m_serverEnvs.end() && it->second.contains(env);
+}
+
+size_t ServerIndex::countEnvironment(EnvId env) const
+{
+    map<EnvId, size_t>::const_iterator it = m_envCounts.find(env);
+
+    return it == m_envCounts.end() ? 0 : it->second;
+}
+
+void ServerIndex::setSpeed(CompileServer *cs, float speed)
+{
+    map<CompileServer *, Ranking::iterator>::iterator it = m_rank.find(cs);
+
+    if (it == m_rank.end()) {
+        return;
+    }
+
+    if (it->second->first == speed) {
+        return;
+    }
+
+    m_ranking.erase(it->second);
+    it->second = m_ranking.insert(make_pair(speed, cs));
+}
+
+float ServerIndex::speed(CompileServer *cs) const
+{
+    map<CompileServer *, Ranking::iterator>::const_iterator it = m_rank.find(cs);
+
+    return it == m_rank.end() ? 0 : it->second->first;
+}
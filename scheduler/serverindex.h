@@ -0,0 +1,68 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SERVERINDEX_H
+#define SERVERINDEX_H
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "../services/comm.h"
+#include "envid.h"
+
+class CompileServer;
+
+/* Lookup structures for pick_server(), updated as servers log in, change
+   their installed environments and report their speed, so that picking a
+   server for a job doesn't have to look at every one of them.  */
+class ServerIndex
+{
+public:
+    typedef std::multimap<float, CompileServer *, std::greater<float> > Ranking;
+
+    void add(CompileServer *cs, float speed);
+    void remove(CompileServer *cs);
+    bool contains(CompileServer *cs) const
+    {
+        return m_rank.count(cs);
+    }
+
+    void setEnvironments(CompileServer *cs, const EnvSet &envs);
+    bool hasEnvironment(CompileServer *cs, EnvId env) const;
+    // servers that have the environment installed
+    size_t countEnvironment(EnvId env) const;
+
+    // the servers, fastest first
+    void setSpeed(CompileServer *cs, float speed);
+    float speed(CompileServer *cs) const;
+    const Ranking &ranking() const
+    {
+        return m_ranking;
+    }
+
+private:
+    std::map<EnvId, size_t> m_envCounts;
+    std::map<CompileServer *, EnvSet> m_serverEnvs;
+    Ranking m_ranking;
+    std::map<CompileServer *, Ranking::iterator> m_rank;
+};
+
+#endif
@@ -0,0 +1,378 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "statsfile.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "../services/logging.h"
+
+#include "compileserver.h"
+#include "jobcost.h"
+
+// how long the statistics of a server that doesn't log in anymore are kept
+#define STATS_MAX_AGE (30 * 24 * 60 * 60)
+// the jobs kept per server, as in CompileServer
+#define NODE_HISTORY 200
+// environment lists kept, the ones seen last
+#define MAX_ENV_SETS 1000
+
+#define STATS_FILE_MAGIC "ICECC-SCHEDULER-STATS 1"
+
+using namespace std;
+
+StatsFile::StatsFile(const string &path)
+    : m_path(path)
+{
+}
+
+string StatsFile::statLine(const char *what, const JobStat &st)
+{
+    ostringstream line;
+    line << what << ' ' << st.outputSize() << ' ' << st.compileTimeReal() << ' '
+         << st.compileTimeUser() << ' ' << st.compileTimeSys() << '\n';
+    return line.str();
+}
+
+string StatsFile::nodeLine(const string &name, time_t seen)
+{
+    ostringstream line;
+    line << "node " << (long) seen << ' ' << name << '\n';
+    return line.str();
+}
+
+string StatsFile::costLine(const string &file, const JobCost &cost)
+{
+    ostringstream line;
+    line << "jobcost " << cost.userMsec << ' ' << cost.inputSize << ' ' << cost.outputSize
+         << ' ' << cost.memoryKb << ' ' << cost.samples << ' ' << file << '\n';
+    return line.str();
+}
+
+/* Job ids start again at 1 after a restart, so the saved ones are dropped.  */
+static bool read_stat(const char *line, JobStat &st)
+{
+    unsigned long output, real, user, sys;
+
+    if (sscanf(line, "%lu %lu %lu %lu", &output, &real, &user, &sys) != 4) {
+        return false;
+    }
+
+    st.setOutputSize(output);
+    st.setCompileTimeReal(real);
+    st.setCompileTimeUser(user);
+    st.setCompileTimeSys(sys);
+    return true;
+}
+
+static void append_stat(vector<JobStat> &history, const JobStat &st)
+{
+    if (history.size() >= NODE_HISTORY) {
+        history.erase(history.begin());
+    }
+
+    history.push_back(st);
+}
+
+bool StatsFile::parse(const string &line, JobStatHistory &jobs, JobCosts &costs,
+                      unsigned long &install_msec)
+{
+    string::size_type space = line.find(' ');
+
+    if (space == string::npos) {
+        return false;
+    }
+
+    string what = line.substr(0, space);
+    const char *args = line.c_str() + space + 1;
+    JobStat st;
+
+    if (what == "install") {
+        sscanf(args, "%lu", &install_msec);
+    } else if (what == "job") {
+        if (read_stat(args, st)) {
+            jobs.append(st);
+        }
+    } else if (what == "node") {
+        long seen;
+        int name = 0;
+        m_node.clear();
+
+        if (sscanf(args, "%ld %n", &seen, &name) >= 1 && name && args[name]
+                && time(0) - seen < STATS_MAX_AGE) {
+            m_node = args + name;
+            m_nodes[m_node].seen = seen;
+        }
+    } else if (what == "envset") {
+        long seen;
+        int digest = 0;
+        m_envset.clear();
+
+        if (sscanf(args, "%ld %n", &seen, &digest) >= 1 && digest && args[digest]
+                && time(0) - seen < STATS_MAX_AGE) {
+            m_envset = args + digest;
+            m_envsets[m_envset].seen = seen;
+        }
+    } else if (what == "env") {
+        map<string, EnvSet>::iterator envset = m_envsets.find(m_envset);
+        const char *version = strchr(args, ' ');
+
+        if (envset != m_envsets.end() && version && version[1]) {
+            envset->second.envs.push_back(make_pair(string(args, version - args),
+                                                    string(version + 1)));
+        }
+    } else if (what == "compiled" || what == "requested") {
+        map<string, Node>::iterator node = m_nodes.find(m_node);
+
+        if (node != m_nodes.end() && read_stat(args, st)) {
+            append_stat(what == "compiled" ? node->second.compiled : node->second.requested, st);
+        }
+    } else if (what == "cost") {
+        JobCost cost;
+        int file = 0;
+
+        if (sscanf(args, "%u %u %u %u %n", &cost.userMsec, &cost.inputSize,
+                   &cost.outputSize, &cost.samples, &file) >= 4 && file && args[file]) {
+            costs.restore(args + file, cost);
+        }
+    } else if (what == "jobcost") {
+        // "cost" with the memory, written since it is known
+        JobCost cost;
+        int file = 0;
+
+        if (sscanf(args, "%u %u %u %u %u %n", &cost.userMsec, &cost.inputSize,
+                   &cost.outputSize, &cost.memoryKb, &cost.samples, &file) >= 5
+                && file && args[file]) {
+            costs.restore(args + file, cost);
+        }
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* The file is text, a line per job statistic or file cost.  The compiled
+   and requested jobs belong to the node line before them, the env lines to
+   the envset line before them.  */
+bool StatsFile::load(JobStatHistory &jobs, JobCosts &costs, unsigned long &install_msec)
+{
+    ifstream in(m_path.c_str());
+
+    if (!in) {
+        if (errno != ENOENT) {
+            log_perror("open of statistics file failed");
+        }
+
+        return false;
+    }
+
+    string line;
+
+    if (!getline(in, line) || line != STATS_FILE_MAGIC) {
+        log_warning() << m_path << " is not a scheduler statistics file, ignoring it" << endl;
+        return false;
+    }
+
+    while (getline(in, line)) {
+        parse(line, jobs, costs, install_msec);
+    }
+
+    m_node.clear();
+    m_envset.clear();
+    log_info() << "loaded statistics of " << jobs.size() << " jobs, " << m_nodes.size()
+               << " servers and " << costs.size() << " files from " << m_path << endl;
+    return true;
+}
+
+void StatsFile::write(ostream &out, const JobStatHistory &jobs, const JobCosts &costs,
+                      unsigned long install_msec)
+{
+    out << "install " << install_msec << '\n';
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        out << statLine("job", jobs.at(i));
+    }
+
+    time_t now = time(0);
+
+    for (map<string, Node>::iterator it = m_nodes.begin(); it != m_nodes.end();) {
+        if (now - it->second.seen >= STATS_MAX_AGE) {
+            m_nodes.erase(it++);
+            continue;
+        }
+
+        out << nodeLine(it->first, it->second.seen);
+
+        for (size_t i = 0; i < it->second.compiled.size(); ++i) {
+            out << statLine("compiled", it->second.compiled[i]);
+        }
+
+        for (size_t i = 0; i < it->second.requested.size(); ++i) {
+            out << statLine("requested", it->second.requested[i]);
+        }
+
+        ++it;
+    }
+
+    for (map<string, EnvSet>::iterator it = m_envsets.begin(); it != m_envsets.end();) {
+        if (now - it->second.seen >= STATS_MAX_AGE) {
+            m_envsets.erase(it++);
+            continue;
+        }
+
+        out << "envset " << (long) it->second.seen << ' ' << it->first << '\n';
+
+        for (Environments::const_iterator env = it->second.envs.begin();
+                env != it->second.envs.end(); ++env) {
+            out << "env " << env->first << ' ' << env->second << '\n';
+        }
+
+        ++it;
+    }
+
+    vector<pair<string, JobCost> > files;
+    costs.files(files);
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        out << costLine(files[i].first, files[i].second);
+    }
+}
+
+/* Written to a temporary file first, so that a crash while saving keeps the
+   previous statistics.  */
+bool StatsFile::save(const JobStatHistory &jobs, const JobCosts &costs, unsigned long install_msec)
+{
+    if (m_path.empty()) {
+        return true;
+    }
+
+    string tmp = m_path + ".tmp";
+    ofstream out(tmp.c_str());
+
+    if (!out) {
+        log_perror("open of statistics file failed");
+        return false;
+    }
+
+    out << STATS_FILE_MAGIC << '\n';
+    write(out, jobs, costs, install_msec);
+    out.close();
+
+    if (out.fail()) {
+        log_perror("write of statistics file failed");
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    if (rename(tmp.c_str(), m_path.c_str()) < 0) {
+        log_perror("rename of statistics file failed");
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    trace() << "saved statistics to " << m_path << endl;
+    return true;
+}
+
+void StatsFile::restore(CompileServer *cs)
+{
+    map<string, Node>::iterator it = m_nodes.find(cs->nodeName());
+
+    if (it == m_nodes.end()) {
+        return;
+    }
+
+    if (cs->lastCompiledJobs().empty() && cs->lastRequestedJobs().empty()) {
+        for (size_t i = 0; i < it->second.compiled.size(); ++i) {
+            cs->appendCompiledJob(it->second.compiled[i]);
+        }
+
+        for (size_t i = 0; i < it->second.requested.size(); ++i) {
+            cs->appendRequestedJobs(it->second.requested[i]);
+        }
+    }
+
+    m_nodes.erase(it);
+}
+
+void StatsFile::remember(CompileServer *cs)
+{
+    if (cs->nodeName().empty()) {
+        return;
+    }
+
+    Node &node = m_nodes[cs->nodeName()];
+    node.seen = time(0);
+    node.compiled.clear();
+    node.requested.clear();
+
+    const JobStatHistory &compiled = cs->lastCompiledJobs();
+
+    for (size_t i = 0; i < compiled.size(); ++i) {
+        node.compiled.push_back(compiled.at(i));
+    }
+
+    const JobStatHistory &requested = cs->lastRequestedJobs();
+
+    for (size_t i = 0; i < requested.size(); ++i) {
+        node.requested.push_back(requested.at(i));
+    }
+}
+
+void StatsFile::rememberEnvironments(const string &digest, const Environments &envs)
+{
+    EnvSet &envset = m_envsets[digest];
+    envset.seen = time(0);
+    envset.envs = envs;
+
+    if (m_envsets.size() <= MAX_ENV_SETS) {
+        return;
+    }
+
+    map<string, EnvSet>::iterator oldest = m_envsets.begin();
+
+    for (map<string, EnvSet>::iterator it = m_envsets.begin(); it != m_envsets.end(); ++it) {
+        if (it->second.seen < oldest->second.seen) {
+            oldest = it;
+        }
+    }
+
+    m_envsets.erase(oldest);
+}
+
+bool StatsFile::environments(const string &digest, Environments &envs)
+{
+    map<string, EnvSet>::iterator it = m_envsets.find(digest);
+
+    if (it == m_envsets.end()) {
+        return false;
+    }
+
+    it->second.seen = time(0);
+    envs = it->second.envs;
+    return true;
+}
@@ -0,0 +1,107 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STATSFILE_H
+#define STATSFILE_H
+
+#include <time.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "../services/comm.h"
+#include "jobstat.h"
+
+class CompileServer;
+struct JobCost;
+class JobCosts;
+
+/* The statistics the scheduler learned, saved from time to time and loaded
+   again at startup, so that a restarted scheduler still knows how fast the
+   servers are and what the source files cost.  Servers are known by their
+   node name.  The statistics of servers that are not connected are kept
+   until they log in again, or for a month.  */
+class StatsFile
+{
+public:
+    explicit StatsFile(const std::string &path);
+
+    const std::string &path() const
+    {
+        return m_path;
+    }
+
+    bool load(JobStatHistory &jobs, JobCosts &costs, unsigned long &install_msec);
+    bool save(const JobStatHistory &jobs, const JobCosts &costs, unsigned long install_msec);
+
+    /* The lines of the file, also what a standby scheduler gets sent.  Lines
+       that are not statistics are not parsed, these return false.  */
+    void write(std::ostream &out, const JobStatHistory &jobs, const JobCosts &costs,
+               unsigned long install_msec);
+    bool parse(const std::string &line, JobStatHistory &jobs, JobCosts &costs,
+               unsigned long &install_msec);
+    static std::string statLine(const char *what, const JobStat &st);
+    static std::string nodeLine(const std::string &name, time_t seen);
+    static std::string costLine(const std::string &file, const JobCost &cost);
+
+    // gives a server logging in what it compiled and requested before
+    void restore(CompileServer *cs);
+    // keeps the statistics of a server that goes away, or is about to be saved
+    void remember(CompileServer *cs);
+
+    /* The environment lists of the servers by environments_digest(), so
+       that they only send the digest when they log in again.  */
+    void rememberEnvironments(const std::string &digest, const Environments &envs);
+    bool environments(const std::string &digest, Environments &envs);
+
+private:
+    struct Node {
+        Node()
+            : seen(0)
+        {
+        }
+
+        time_t seen;
+        std::vector<JobStat> compiled;
+        std::vector<JobStat> requested;
+    };
+
+    struct EnvSet {
+        EnvSet()
+            : seen(0)
+        {
+        }
+
+        time_t seen;
+        Environments envs;
+    };
+
+    std::string m_path;
+    std::map<std::string, Node> m_nodes;
+    // the node the compiled and requested lines belong to
+    std::string m_node;
+    std::map<std::string, EnvSet> m_envsets;
+    // the environment list the env lines belong to
+    std::string m_envset;
+};
+
+#endif
@@ -0,0 +1,235 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "trace.h"
+
+#include <arpa/inet.h>
+
+using namespace std;
+
+#define TRACE_MAGIC "ICECC-TRACE 1\n"
+
+static void put(ostream &out, uint32_t value)
+{
+    value = htonl(value);
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void put(ostream &out, const string &s)
+{
+    put(out, uint32_t(s.size()));
+    out.write(s.data(), s.size());
+}
+
+static bool get(istream &in, uint32_t &value)
+{
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+        return false;
+    }
+
+    value = ntohl(value);
+    return true;
+}
+
+static bool get(istream &in, int32_t &value)
+{
+    uint32_t v;
+
+    if (!get(in, v)) {
+        return false;
+    }
+
+    value = int32_t(v);
+    return true;
+}
+
+static bool get(istream &in, string &s)
+{
+    uint32_t len;
+
+    // nothing in a trace is that long, it must be broken
+    if (!get(in, len) || len > 65536) {
+        return false;
+    }
+
+    s.resize(len);
+    return len == 0 || in.read(&s[0], len);
+}
+
+TraceWriter::TraceWriter()
+{
+    gettimeofday(&m_start, 0);
+}
+
+bool TraceWriter::open(const string &path)
+{
+    m_out.open(path.c_str(), ios::out | ios::trunc | ios::binary);
+    m_out << TRACE_MAGIC;
+    gettimeofday(&m_start, 0);
+    return m_out.good();
+}
+
+bool TraceWriter::write(TraceRecord &record)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    record.msec = (now.tv_sec - m_start.tv_sec) * 1000 + (now.tv_usec - m_start.tv_usec) / 1000;
+
+    m_out.put(record.type);
+    put(m_out, record.msec);
+    put(m_out, record.host);
+
+    switch (record.type) {
+    case TraceRecord::LOGIN:
+        put(m_out, record.name);
+        put(m_out, record.platform);
+        put(m_out, record.maxJobs);
+        put(m_out, record.flags);
+        put(m_out, uint32_t(record.envs.size()));
+
+        for (Environments::const_iterator it = record.envs.begin(); it != record.envs.end(); ++it) {
+            put(m_out, it->first);
+            put(m_out, it->second);
+        }
+
+        break;
+    case TraceRecord::STATS:
+        put(m_out, record.load);
+        break;
+    case TraceRecord::REQUEST:
+        put(m_out, record.job);
+        put(m_out, record.name);
+        put(m_out, record.platform);
+        put(m_out, record.preferredHost);
+        put(m_out, record.flags);
+        put(m_out, record.jobClass);
+        put(m_out, uint32_t(record.envs.size()));
+
+        for (Environments::const_iterator it = record.envs.begin(); it != record.envs.end(); ++it) {
+            put(m_out, it->first);
+            put(m_out, it->second);
+        }
+
+        break;
+    case TraceRecord::BEGIN:
+        put(m_out, record.job);
+        break;
+    case TraceRecord::DONE:
+        put(m_out, record.job);
+        put(m_out, uint32_t(record.exitcode));
+        put(m_out, record.flags);
+        put(m_out, record.realMsec);
+        put(m_out, record.userMsec);
+        put(m_out, record.inSize);
+        put(m_out, record.outSize);
+        break;
+    default:
+        break;
+    }
+
+    return m_out.good();
+}
+
+void TraceWriter::flush()
+{
+    m_out.flush();
+}
+
+bool TraceReader::open(const string &path)
+{
+    m_error = false;
+    m_in.open(path.c_str(), ios::in | ios::binary);
+    string magic(sizeof(TRACE_MAGIC) - 1, '\0');
+
+    if (!m_in.read(&magic[0], magic.size()) || magic != TRACE_MAGIC) {
+        m_error = true;
+        return false;
+    }
+
+    return true;
+}
+
+static bool get_envs(istream &in, Environments &envs)
+{
+    uint32_t count;
+
+    if (!get(in, count)) {
+        return false;
+    }
+
+    envs.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        string platform, name;
+
+        if (!get(in, platform) || !get(in, name)) {
+            return false;
+        }
+
+        envs.push_back(make_pair(platform, name));
+    }
+
+    return true;
+}
+
+bool TraceReader::read(TraceRecord &record)
+{
+    record = TraceRecord();
+    int type = m_in.get();
+
+    if (type == EOF) {
+        return false;
+    }
+
+    record.type = char(type);
+    bool ok = get(m_in, record.msec) && get(m_in, record.host);
+
+    switch (record.type) {
+    case TraceRecord::LOGIN:
+        ok = ok && get(m_in, record.name) && get(m_in, record.platform)
+             && get(m_in, record.maxJobs) && get(m_in, record.flags) && get_envs(m_in, record.envs);
+        break;
+    case TraceRecord::LOGOUT:
+        break;
+    case TraceRecord::STATS:
+        ok = ok && get(m_in, record.load);
+        break;
+    case TraceRecord::REQUEST:
+        ok = ok && get(m_in, record.job) && get(m_in, record.name)
+             && get(m_in, record.platform) && get(m_in, record.preferredHost)
+             && get(m_in, record.flags) && get(m_in, record.jobClass) && get_envs(m_in, record.envs);
+        break;
+    case TraceRecord::BEGIN:
+        ok = ok && get(m_in, record.job);
+        break;
+    case TraceRecord::DONE:
+        ok = ok && get(m_in, record.job) && get(m_in, record.exitcode) && get(m_in, record.flags)
+             && get(m_in, record.realMsec) && get(m_in, record.userMsec)
+             && get(m_in, record.inSize) && get(m_in, record.outSize);
+        break;
+    default:
+        ok = false;
+        break;
+    }
+
+    m_error = !ok;
+    return ok;
+}
@@ -0,0 +1,114 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <fstream>
+#include <string>
+
+#include "../services/comm.h"
+
+/* One event of a farm, as the scheduler saw it.  Which of the fields mean
+   something depends on the type, the others are 0 or empty.  */
+struct TraceRecord {
+    enum Type {
+        LOGIN = 'L',     // host, name, platform, envs, maxJobs, flags (NO_REMOTE, CHROOT)
+        LOGOUT = 'E',    // host
+        STATS = 'S',     // host, load
+        REQUEST = 'G',   // one per job: host (the submitter), job, name (the file),
+                         // platform (the target), envs, preferredHost, flags (arg flags),
+                         // jobClass
+        BEGIN = 'B',     // host (the server), job
+        DONE = 'D'       // host (who sent it), job, exitcode, flags (FROM_SERVER),
+                         // realMsec, userMsec, inSize, outSize (uncompressed)
+    };
+
+    enum {
+        NO_REMOTE = 1,
+        CHROOT = 2,
+        FROM_SERVER = 1
+    };
+
+    TraceRecord()
+        : type(0), msec(0), host(0), job(0), maxJobs(0), flags(0), jobClass(0)
+        , load(0), exitcode(0), realMsec(0), userMsec(0), inSize(0), outSize(0) {}
+
+    char type;
+    uint32_t msec;  // since the trace started
+    uint32_t host;
+    uint32_t job;
+    uint32_t maxJobs;
+    uint32_t flags;
+    uint32_t jobClass;
+    uint32_t load;
+    int32_t exitcode;
+    uint32_t realMsec;
+    uint32_t userMsec;
+    uint32_t inSize;
+    uint32_t outSize;
+    std::string name;
+    std::string platform;
+    std::string preferredHost;
+    Environments envs;
+};
+
+/* Records the events of a farm to a file, for icecc-scheduler-replay.
+   The file is binary: a header, then one record after the other, the
+   numbers in network byte order and the strings with their length
+   before them.  */
+class TraceWriter
+{
+public:
+    TraceWriter();
+
+    bool open(const std::string &path);
+    bool write(TraceRecord &record);
+    void flush();
+
+private:
+    std::ofstream m_out;
+    struct timeval m_start;
+};
+
+class TraceReader
+{
+public:
+    TraceReader()
+        : m_error(false) {}
+
+    bool open(const std::string &path);
+    // false at the end or on an error, error() tells
+    bool read(TraceRecord &record);
+    bool error() const
+    {
+        return m_error;
+    }
+
+private:
+    std::ifstream m_in;
+    bool m_error;
+};
+
+#endif
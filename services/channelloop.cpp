@@ -0,0 +1,299 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <time.h>
+#include <vector>
+
+#include "logging.h"
+#include "channelloop.h"
+
+using namespace std;
+
+static long long now_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void ChannelHandler::handle_timeout(ChannelLoop *loop, MsgChannel *c)
+{
+    log_warning() << "no message from " << c->name << " within the timeout" << endl;
+    loop->remove(c);
+    handle_end(loop, c);
+}
+
+void ChannelHandler::handle_raw(ChannelLoop *loop, MsgChannel *c)
+{
+    log_warning() << "unexpected raw data from " << c->name << endl;
+    loop->remove(c);
+    handle_end(loop, c);
+}
+
+ChannelLoop::ChannelLoop()
+{
+}
+
+bool ChannelLoop::add(MsgChannel *c, ChannelHandler *h, int timeout)
+{
+    Entry e;
+    e.channel = c;
+    e.handler = h;
+    e.timeout = timeout;
+    e.deadline = timeout ? now_msec() + timeout : 0;
+    e.sending = false;
+    channels[c->fd] = e;
+
+    if (!poller.watch(c->fd, Poller::Read | (c->pending() ? Poller::Write : 0))) {
+        channels.erase(c->fd);
+        return false;
+    }
+
+    return true;
+}
+
+void ChannelLoop::remove(MsgChannel *c)
+{
+    if (!contains(c)) {
+        return;
+    }
+
+    poller.unwatch(c->fd);
+    channels.erase(c->fd);
+}
+
+bool ChannelLoop::contains(MsgChannel *c) const
+{
+    map<int, Entry>::const_iterator it = channels.find(c->fd);
+    return it != channels.end() && it->second.channel == c;
+}
+
+void ChannelLoop::set_timeout(MsgChannel *c, int timeout)
+{
+    Entry *e = find(c->fd, c);
+
+    if (e) {
+        e->timeout = timeout;
+        e->deadline = timeout ? now_msec() + timeout : 0;
+    }
+}
+
+ChannelLoop::Entry *ChannelLoop::find(int fd, MsgChannel *c)
+{
+    map<int, Entry>::iterator it = channels.find(fd);
+
+    if (it == channels.end() || it->second.channel != c) {
+        return 0;
+    }
+
+    return &it->second;
+}
+
+void ChannelLoop::end(MsgChannel *c)
+{
+    ChannelHandler *h = find(c->fd, c)->handler;
+    remove(c);
+    h->handle_end(this, c);
+}
+
+/* Also watched for writing after everything is sent, so that handle_sent()
+   is always called from the loop and never from within send().  */
+void ChannelLoop::update_write(Entry &e)
+{
+    int fd = e.channel->fd;
+    poller.watch(fd, Poller::Read | (e.sending || e.channel->pending() ? Poller::Write : 0));
+}
+
+bool ChannelLoop::send(MsgChannel *c, const Msg &m)
+{
+    Entry *e = find(c->fd, c);
+
+    if (!e || !c->send_msg(m, MsgChannel::SendQueued) || !c->flush(false)) {
+        return false;
+    }
+
+    e->sending = true;
+    update_write(*e);
+    return true;
+}
+
+void ChannelLoop::handle_write(int fd, MsgChannel *c)
+{
+    if (!c->flush(false)) {
+        end(c);
+        return;
+    }
+
+    Entry *e = find(fd, c);
+
+    if (c->pending()) {
+        return;
+    }
+
+    bool sent = e->sending;
+    e->sending = false;
+    update_write(*e);
+
+    if (sent) {
+        e->handler->handle_sent(this, c);
+    }
+}
+
+/* Hands over all complete messages, as the socket may not become readable
+   again for those already buffered.  */
+void ChannelLoop::handle_read(int fd, MsgChannel *c)
+{
+    if (!c->raw_pending() && !c->read_a_bit()) {
+        end(c);
+        return;
+    }
+
+    for (;;) {
+        Entry *e = find(fd, c);
+
+        if (!e) {
+            return;
+        }
+
+        if (c->raw_pending()) {
+            e->handler->handle_raw(this, c);
+
+            if (!find(fd, c) || c->raw_pending()) {
+                return;
+            }
+
+            continue;
+        }
+
+        if (!c->has_msg()) {
+            return;
+        }
+
+        Msg *m = c->get_msg(0);
+
+        if (!m) {
+            end(c);
+            return;
+        }
+
+        if (e->timeout) {
+            e->deadline = now_msec() + e->timeout;
+        }
+
+        e->handler->handle_msg(this, c, m);
+    }
+}
+
+void ChannelLoop::handle_timeouts()
+{
+    long long now = now_msec();
+    vector<pair<int, MsgChannel *> > expired;
+
+    for (map<int, Entry>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (it->second.timeout && it->second.deadline <= now) {
+            it->second.deadline = now + it->second.timeout;
+            expired.push_back(make_pair(it->first, it->second.channel));
+        }
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i) {
+        Entry *e = find(expired[i].first, expired[i].second);
+
+        if (e) {
+            e->handler->handle_timeout(this, e->channel);
+        }
+    }
+}
+
+int ChannelLoop::next_timeout(int timeout) const
+{
+    long long now = now_msec();
+
+    for (map<int, Entry>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        if (!it->second.timeout) {
+            continue;
+        }
+
+        long long left = it->second.deadline > now ? it->second.deadline - now : 0;
+
+        if (timeout < 0 || left < timeout) {
+            timeout = left;
+        }
+    }
+
+    return timeout;
+}
+
+bool ChannelLoop::run_once(int timeout)
+{
+    if (channels.empty()) {
+        return false;
+    }
+
+    int ret = poller.wait(next_timeout(timeout));
+
+    if (ret < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+
+        log_perror("ChannelLoop::run_once()");
+        return false;
+    }
+
+    // the handlers change what is watched
+    vector<pair<int, int> > ready;
+
+    for (int i = 0; i < ret; ++i) {
+        ready.push_back(make_pair(poller.ready_fd(i), poller.ready_events(i)));
+    }
+
+    for (size_t i = 0; i < ready.size(); ++i) {
+        int fd = ready[i].first;
+        map<int, Entry>::iterator it = channels.find(fd);
+
+        if (it == channels.end()) {
+            continue;
+        }
+
+        MsgChannel *c = it->second.channel;
+
+        if (ready[i].second & Poller::Write) {
+            handle_write(fd, c);
+        }
+
+        if ((ready[i].second & Poller::Read) && find(fd, c)) {
+            handle_read(fd, c);
+        }
+    }
+
+    handle_timeouts();
+    return !channels.empty();
+}
+
+void ChannelLoop::run()
+{
+    while (run_once()) {
+    }
+}
@@ -0,0 +1,117 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef ICECREAM_CHANNELLOOP_H
+#define ICECREAM_CHANNELLOOP_H
+
+#include <map>
+
+#include "comm.h"
+#include "poller.h"
+
+class ChannelLoop;
+
+/* What a ChannelLoop calls for the events of a channel.  The callbacks may
+   send, add and remove channels, including the one they are called for.  */
+class ChannelHandler
+{
+public:
+    virtual ~ChannelHandler() {}
+
+    // a message arrived, the handler owns it
+    virtual void handle_msg(ChannelLoop *loop, MsgChannel *c, Msg *m) = 0;
+
+    // the channel reached EOF, failed or sent something invalid; it is
+    // removed from the loop already and may be deleted
+    virtual void handle_end(ChannelLoop *loop, MsgChannel *c) = 0;
+
+    // everything sent with ChannelLoop::send() is written to the socket
+    virtual void handle_sent(ChannelLoop *, MsgChannel *) {}
+
+    // nothing arrived within the timeout of the channel, which is
+    // restarted; the default ends the channel
+    virtual void handle_timeout(ChannelLoop *loop, MsgChannel *c);
+
+    // raw data after a FileRawMsg is readable, to be taken with read_raw();
+    // no messages arrive until it is all read.  The default ends the channel.
+    virtual void handle_raw(ChannelLoop *loop, MsgChannel *c);
+};
+
+/* Drives many MsgChannels from one thread: messages are read and handed
+   to the handlers as they complete, and sends are queued and written as
+   the sockets take them, so that nothing blocks on a single peer.  The
+   blocking calls of MsgChannel (get_msg() with a timeout, send_msg()
+   with SendBlocking) must not be used on channels in a loop.  */
+class ChannelLoop
+{
+public:
+    ChannelLoop();
+
+    // watches c, timeout is the milliseconds without a message until
+    // handle_timeout(), 0 for none; false <--> error
+    bool add(MsgChannel *c, ChannelHandler *h, int timeout = 0);
+    // stops watching c without calling the handler, queued output is kept
+    // in the channel
+    void remove(MsgChannel *c);
+    bool contains(MsgChannel *c) const;
+    void set_timeout(MsgChannel *c, int timeout);
+
+    // queues m for c and writes what the socket takes now, the rest as
+    // it becomes writable; false <--> error, c is not ended then
+    bool send(MsgChannel *c, const Msg &m);
+
+    // waits at most timeout milliseconds (-1: forever) for events and
+    // calls the handlers; false <--> no channels left or error
+    bool run_once(int timeout = -1);
+    // calls run_once() until no channels are left
+    void run();
+
+    size_t size() const
+    {
+        return channels.size();
+    }
+
+private:
+    ChannelLoop(const ChannelLoop &);
+    ChannelLoop &operator=(const ChannelLoop &);
+
+    struct Entry {
+        MsgChannel *channel;
+        ChannelHandler *handler;
+        int timeout;
+        long long deadline;
+        // handle_sent() is due once the output is written
+        bool sending;
+    };
+
+    Entry *find(int fd, MsgChannel *c);
+    void end(MsgChannel *c);
+    void update_write(Entry &e);
+    void handle_read(int fd, MsgChannel *c);
+    void handle_write(int fd, MsgChannel *c);
+    void handle_timeouts();
+    int next_timeout(int timeout) const;
+
+    std::map<int, Entry> channels;
+    Poller poller;
+};
+
+#endif
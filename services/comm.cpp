@@ -31,6 +31,7 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #if HAVE_NETINET_TCP_VAR_H
@@ -40,13 +41,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <assert.h>
 #include <lzo/lzo1x.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 #include <stdio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #ifdef HAVE_LIBCAP_NG
 #include <cap-ng.h>
 #endif
@@ -54,6 +66,7 @@
 #include "logging.h"
 #include "job.h"
 #include "comm.h"
+#include "resultkey.h"
 
 using namespace std;
 
@@ -66,6 +79,182 @@ using namespace std;
 
 #define MAX_MSG_SIZE 1 * 1024 * 1024
 
+/* Decompressed chunks are recycled instead of freed, so streaming a large
+   file doesn't allocate a new buffer for every FileChunkMsg.  Each buffer
+   keeps its capacity in a header in front of the data.  */
+#define CHUNK_BUFFER_HEADER 16
+#define CHUNK_BUFFER_MIN 128 * 1024
+#define CHUNK_POOL_SIZE 8
+
+static list<unsigned char *> chunk_pool;
+
+static size_t chunk_capacity(unsigned char *buf)
+{
+    size_t capacity;
+    memcpy(&capacity, buf - CHUNK_BUFFER_HEADER, sizeof(capacity));
+    return capacity;
+}
+
+unsigned char *MsgChannel::get_chunk_buffer(size_t len)
+{
+    for (list<unsigned char *>::iterator it = chunk_pool.begin(); it != chunk_pool.end(); ++it) {
+        if (chunk_capacity(*it) >= len) {
+            unsigned char *buf = *it;
+            chunk_pool.erase(it);
+            return buf;
+        }
+    }
+
+    size_t capacity = len > CHUNK_BUFFER_MIN ? len : CHUNK_BUFFER_MIN;
+    unsigned char *mem = (unsigned char *) malloc(capacity + CHUNK_BUFFER_HEADER);
+    memcpy(mem, &capacity, sizeof(capacity));
+    return mem + CHUNK_BUFFER_HEADER;
+}
+
+void MsgChannel::release_chunk_buffer(unsigned char *buf)
+{
+    if (!buf) {
+        return;
+    }
+
+    if (chunk_pool.size() < CHUNK_POOL_SIZE) {
+        chunk_pool.push_back(buf);
+    } else {
+        free(buf - CHUNK_BUFFER_HEADER);
+    }
+}
+
+/* The codecs we can decode, sent to the other side since protocol 36.  */
+static uint32_t local_codecs()
+{
+    uint32_t codecs = (1 << C_LZO) | (1 << C_STORED);
+#ifdef HAVE_ZSTD
+    codecs |= 1 << C_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+    codecs |= 1 << C_LZ4;
+#endif
+    return codecs;
+}
+
+static const char *codec_name(CompressionCodec codec)
+{
+    switch (codec) {
+    case C_ZSTD:
+        return "zstd";
+    case C_LZ4:
+        return "lz4";
+    case C_STORED:
+        return "none";
+    default:
+        return "lzo";
+    }
+}
+
+/* The codec we'd like to write with, unless the other side can't decode it.
+   $ICECC_COMPRESSION can be one of "zstd", "lz4", "lzo" or "none", optionally
+   followed by ":level", or "auto".  Returns whether the codec is chosen per
+   chunk, see MsgChannel::setAdaptiveCompression().  */
+static bool default_compression(CompressionCodec &codec, int &level)
+{
+#if defined(HAVE_ZSTD)
+    codec = C_ZSTD;
+#elif defined(HAVE_LZ4)
+    codec = C_LZ4;
+#else
+    codec = C_LZO;
+#endif
+    level = 0;
+
+    const char *env = getenv("ICECC_COMPRESSION");
+
+    if (!env || !*env || !strcmp(env, "auto")) {
+        return true;
+    }
+
+    string name = env;
+    string::size_type colon = name.find(':');
+
+    if (colon != string::npos) {
+        level = atoi(name.c_str() + colon + 1);
+        name = name.substr(0, colon);
+    }
+
+    if (name == "zstd") {
+        codec = C_ZSTD;
+    } else if (name == "lz4") {
+        codec = C_LZ4;
+    } else if (name == "lzo") {
+        codec = C_LZO;
+    } else if (name == "none") {
+        codec = C_STORED;
+    } else {
+        log_warning() << "unknown ICECC_COMPRESSION " << env << ", using default" << endl;
+        level = 0;
+        return true;
+    }
+
+    if (!(local_codecs() & (1 << codec))) {
+        log_warning() << "ICECC_COMPRESSION " << env << " not supported by this build, using LZO" << endl;
+        codec = C_LZO;
+    }
+
+    return false;
+}
+
+/* The modes the adaptive compression picks from, with what they take and
+   gain on preprocessed source until measured on the connection.  */
+struct CompressionMode {
+    CompressionCodec codec;
+    int level;
+    double usec_per_kb;
+    double ratio; // compressed / uncompressed
+};
+
+static const CompressionMode compression_modes[] = {
+    { C_STORED, 0, 0, 1 },
+    { C_LZ4, 1, 2, 0.35 },
+    { C_LZO, 0, 3, 0.33 },
+    { C_ZSTD, 1, 4, 0.22 },
+    { C_ZSTD, 3, 8, 0.2 },
+    { C_ZSTD, 9, 30, 0.17 }
+};
+
+#define COMPRESSION_MODES int(sizeof(compression_modes) / sizeof(compression_modes[0]))
+
+// every this many chunks a mode next to the best one is measured again
+#define COMPRESSION_PROBE_INTERVAL 16
+// smaller chunks say little about the speed of a mode
+#define COMPRESSION_MIN_SAMPLE 4096
+
+/* What the modes cost on one connection, smoothed over the last chunks.  */
+struct AdaptiveCompression {
+    AdaptiveCompression()
+        : chunks(0)
+        , probe_up(false)
+    {
+        for (int i = 0; i < COMPRESSION_MODES; ++i) {
+            usec_per_kb[i] = compression_modes[i].usec_per_kb;
+            ratio[i] = compression_modes[i].ratio;
+        }
+    }
+
+    void measured(int mode, size_t in_len, size_t out_len, double usec)
+    {
+        if (in_len < COMPRESSION_MIN_SAMPLE || compression_modes[mode].codec == C_STORED) {
+            return;
+        }
+
+        usec_per_kb[mode] = (usec_per_kb[mode] * 3 + usec * 1024 / in_len) / 4;
+        ratio[mode] = (ratio[mode] * 3 + double(out_len) / in_len) / 4;
+    }
+
+    double usec_per_kb[COMPRESSION_MODES];
+    double ratio[COMPRESSION_MODES];
+    unsigned int chunks;
+    bool probe_up;
+};
+
 /* TODO
  * buffered in/output per MsgChannel
     + move read* into MsgChannel, create buffer-fill function
@@ -98,7 +287,7 @@ bool MsgChannel::read_a_bit()
             break;
         }
 
-        ssize_t ret = read(fd, buf, count);
+        ssize_t ret = read_socket(buf, count);
 
         if (ret > 0) {
             count -= ret;
@@ -126,6 +315,92 @@ bool MsgChannel::read_a_bit()
     return !error;
 }
 
+bool MsgChannel::prefetch(size_t max)
+{
+    if (text_based || raw_togo || !protocol_ready()) {
+        return false;
+    }
+
+    chop_input();
+
+    while (inofs - intogo < max) {
+        size_t count = min(max - (inofs - intogo), size_t(65536));
+
+        if (inbuflen - inofs < count) {
+            inbuflen = inofs + count;
+            inbuf = (char *) realloc(inbuf, inbuflen);
+        }
+
+        ssize_t ret = read_socket(inbuf + inofs, count);
+
+        if (ret > 0) {
+            inofs += ret;
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        bool more = ret < 0 && errno == EAGAIN;
+
+        if (ret == 0) {
+            eof = true;
+        }
+
+        return update_state() && more;
+    }
+
+    update_state();
+    return false;
+}
+
+ssize_t MsgChannel::read_socket(void *buf, size_t count)
+{
+    if (!is_unix_socket()) {
+        return read(fd, buf, count);
+    }
+
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t ret = recvmsg(fd, &mh, 0);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < nfds; ++i) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fcntl(passed, F_SETFD, FD_CLOEXEC);
+            received_fds.push_back(passed);
+        }
+    }
+
+    return ret;
+}
+
 bool MsgChannel::update_state(void)
 {
     switch (instate) {
@@ -179,7 +454,25 @@ bool MsgChannel::update_state(void)
                     return false;
                 }
 
-                instate = NEED_LEN;
+                if (IS_PROTOCOL_36(this)) {
+                    /* Tell the other side which codecs we can decode.  */
+                    uint32_t codecs = local_codecs();
+
+                    for (int i = 0; i < 4; ++i) {
+                        vers[i] = codecs >> (i * 8);
+                    }
+
+                    writefull(vers, 4);
+
+                    if (!flush_writebuf(true)) {
+                        return false;
+                    }
+
+                    instate = NEED_COMPRESSION;
+                } else {
+                    instate = NEED_LEN;
+                }
+
                 /* Don't consume bytes from messages.  */
                 break;
             } else {
@@ -188,13 +481,39 @@ bool MsgChannel::update_state(void)
         }
 
         /* FALLTHROUGH if the protocol setup was complete (instate was changed
-        to NEED_LEN then).  */
-        if (instate != NEED_LEN) {
+        to NEED_COMPRESSION or NEED_LEN then).  */
+        if (instate == NEED_PROTO) {
             break;
         }
 
+    case NEED_COMPRESSION:
+
+        if (instate == NEED_COMPRESSION) {
+            if (inofs - intogo < 4) {
+                break;
+            }
+
+            unsigned char codecs[4];
+            memcpy(codecs, inbuf + intogo, 4);
+            intogo += 4;
+
+            remote_codecs = 1 << C_LZO;
+
+            for (int i = 0; i < 4; ++i) {
+                remote_codecs |= codecs[i] << (i * 8);
+            }
+
+            instate = NEED_LEN;
+        }
+        /* FALLTHROUGH */
+
     case NEED_LEN:
 
+        /* Raw data following a FileRawMsg isn't framed, see read_raw().  */
+        if (raw_togo) {
+            break;
+        }
+
         if (text_based) {
             // Skip any leading whitespace
             for (; inofs < intogo; ++inofs)
@@ -273,17 +592,19 @@ void MsgChannel::chop_output()
 
 void MsgChannel::writefull(const void *_buf, size_t count)
 {
-    if (msgtogo + count >= msgbuflen) {
+    /* Output may still be pending after a partial non-blocking write,
+       append after it.  */
+    if (msgofs + msgtogo + count >= msgbuflen) {
         /* Realloc to a multiple of 128.  */
-        msgbuflen = (msgtogo + count + 127) & ~(size_t)127;
+        msgbuflen = (msgofs + msgtogo + count + 127) & ~(size_t)127;
         msgbuf = (char *) realloc(msgbuf, msgbuflen);
     }
 
-    memcpy(msgbuf + msgtogo, _buf, count);
+    memcpy(msgbuf + msgofs + msgtogo, _buf, count);
     msgtogo += count;
 }
 
-bool MsgChannel::flush_writebuf(bool blocking)
+bool MsgChannel::flush_writebuf(bool blocking, bool *would_block)
 {
     const char *buf = msgbuf + msgofs;
     bool error = false;
@@ -331,6 +652,9 @@ bool MsgChannel::flush_writebuf(bool blocking)
                 }
 
                 /* Timeout or real error --> error.  */
+            } else if (would_block && errno == EAGAIN) {
+                *would_block = true;
+                break;
             }
 
             log_perror("flush_writebuf() failed");
@@ -460,11 +784,184 @@ void MsgChannel::read_environments(Environments &envs)
     }
 }
 
+string environments_digest(const Environments &envs)
+{
+    vector<string> sorted;
+
+    for (Environments::const_iterator it = envs.begin(); it != envs.end(); ++it) {
+        sorted.push_back(it->first + '\0' + it->second);
+    }
+
+    sort(sorted.begin(), sorted.end());
+    ResultKey key;
+
+    for (vector<string>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+        key.add(it->c_str(), it->size() + 1);
+    }
+
+    return key.hex();
+}
+
+void MsgChannel::setCompression(CompressionCodec _codec, int level)
+{
+    codec = _codec;
+    codec_level = level;
+    adaptive_compression = false;
+}
+
+void MsgChannel::setAdaptiveCompression()
+{
+    adaptive_compression = true;
+}
+
+string MsgChannel::compressionMode() const
+{
+    string mode = codec_name(last_codec);
+
+    if (last_codec == C_ZSTD || last_codec == C_LZ4) {
+        char level[16];
+        snprintf(level, sizeof(level), ":%d", last_level);
+        mode += level;
+    }
+
+    return mode;
+}
+
+void MsgChannel::setCompressionDict(const string &dict, bool write)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_DDict *ddict = ZSTD_createDDict(dict.data(), dict.size());
+    unsigned int id = ddict ? ZSTD_getDictID_fromDDict(ddict) : 0;
+
+    if (!id) {
+        log_error() << "not a zstd dictionary" << endl;
+        ZSTD_freeDDict(ddict);
+        return;
+    }
+
+    ZSTD_freeDDict(zstd_ddict);
+    zstd_ddict = ddict;
+    dict_id = id;
+    dict_write = write;
+    compression_dict = dict;
+
+    for (map<int, ZSTD_CDict *>::iterator it = zstd_cdicts.begin(); it != zstd_cdicts.end(); ++it) {
+        ZSTD_freeCDict(it->second);
+    }
+
+    zstd_cdicts.clear();
+#else
+    (void) dict;
+    (void) write;
+#endif
+}
+
+/* The congestion window can be sent per round trip, that is what the
+   connection carries as far as the kernel found out.  */
+double MsgChannel::link_bytes_per_usec() const
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    if (addr && addr->sa_family == AF_INET) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt) {
+            return double(info.tcpi_snd_cwnd) * info.tcpi_snd_mss / info.tcpi_rtt;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* The mode for which compressing LEN bytes and sending the result takes
+   least, now and then one next to it to see whether that got cheaper.  */
+int MsgChannel::choose_compression(size_t len, CompressionCodec &used_codec, int &level)
+{
+    used_codec = compressionCodec();
+    level = codec_level;
+
+    if (!adaptive_compression || !IS_PROTOCOL_36(this)) {
+        return -1;
+    }
+
+    uint32_t usable = remote_codecs & local_codecs();
+
+    if (is_unix_socket() && (usable & (1 << C_STORED))) {
+        used_codec = C_STORED;
+        level = 0;
+        return -1;
+    }
+
+    double bytes_per_usec = link_bytes_per_usec();
+
+    if (!bytes_per_usec || len < COMPRESSION_MIN_SAMPLE) {
+        return -1;
+    }
+
+    if (!adaptive) {
+        adaptive = new AdaptiveCompression;
+    }
+
+    int best = -1;
+    double best_usec = 0;
+
+    for (int i = 0; i < COMPRESSION_MODES; ++i) {
+        if (!(usable & (1 << compression_modes[i].codec))) {
+            continue;
+        }
+
+        double usec = adaptive->usec_per_kb[i] / 1024 + adaptive->ratio[i] / bytes_per_usec;
+
+        if (best < 0 || usec < best_usec) {
+            best = i;
+            best_usec = usec;
+        }
+    }
+
+    if (best < 0) {
+        return -1;
+    }
+
+    int mode = best;
+
+    if (++adaptive->chunks % COMPRESSION_PROBE_INTERVAL == 0) {
+        adaptive->probe_up = !adaptive->probe_up;
+        int step = adaptive->probe_up ? 1 : -1;
+
+        for (int i = best + step; i >= 0 && i < COMPRESSION_MODES; i += step) {
+            if (usable & (1 << compression_modes[i].codec)) {
+                mode = i;
+                break;
+            }
+        }
+    }
+
+    used_codec = compression_modes[mode].codec;
+    level = compression_modes[mode].level;
+    return mode;
+}
+
+CompressionCodec MsgChannel::compressionCodec() const
+{
+    if (!IS_PROTOCOL_36(this) || !(remote_codecs & local_codecs() & (1 << codec))) {
+        return C_LZO;
+    }
+
+    return codec;
+}
+
 void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
 {
     lzo_uint uncompressed_len;
     lzo_uint compressed_len;
+    uint32_t used_codec = C_LZO;
     uint32_t tmp;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this >> used_codec;
+    }
+
     *this >> tmp;
     uncompressed_len = tmp;
     *this >> tmp;
@@ -485,23 +982,89 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         return;
     }
 
-    *uncompressed_buf = new unsigned char[uncompressed_len];
+    *uncompressed_buf = get_chunk_buffer(uncompressed_len);
 
     if (uncompressed_len && compressed_len) {
-        const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+        const char *compressed_buf = inbuf + intogo;
+        bool ok = false;
+
+        switch (used_codec) {
+        case C_LZO: {
+            /* lzo1x_decompress() doesn't need any work memory.  */
+            int ret = lzo1x_decompress((const lzo_byte *)compressed_buf, compressed_len,
+                                       *uncompressed_buf, &uncompressed_len, 0);
+            ok = (ret == LZO_E_OK);
+
+            if (!ok) {
+                log_error() << "lzo decompression failed: " << ret << endl;
+            }
 
-        if (ret != LZO_E_OK) {
+            break;
+        }
+        case C_STORED:
+            ok = compressed_len == uncompressed_len;
+
+            if (ok) {
+                memcpy(*uncompressed_buf, compressed_buf, compressed_len);
+            } else {
+                log_error() << "stored chunk of the wrong length" << endl;
+            }
+
+            break;
+#ifdef HAVE_ZSTD
+        case C_ZSTD: {
+            if (!zstd_dctx) {
+                zstd_dctx = ZSTD_createDCtx();
+            }
+
+            unsigned int frame_dict = ZSTD_getDictID_fromFrame(compressed_buf, compressed_len);
+
+            if (frame_dict && frame_dict != dict_id) {
+                log_error() << "chunk compressed with unknown dictionary " << frame_dict << endl;
+                break;
+            }
+
+            size_t ret = frame_dict
+                         ? ZSTD_decompress_usingDDict(zstd_dctx, *uncompressed_buf, uncompressed_len,
+                                                      compressed_buf, compressed_len, zstd_ddict)
+                         : ZSTD_decompressDCtx(zstd_dctx, *uncompressed_buf, uncompressed_len,
+                                               compressed_buf, compressed_len);
+            ok = !ZSTD_isError(ret) && ret == uncompressed_len;
+
+            if (!ok) {
+                log_error() << "zstd decompression failed: "
+                            << (ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "short output") << endl;
+            }
+
+            break;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case C_LZ4: {
+            int ret = LZ4_decompress_safe(compressed_buf, (char *) *uncompressed_buf,
+                                          compressed_len, uncompressed_len);
+            ok = (ret >= 0 && (lzo_uint) ret == uncompressed_len);
+
+            if (!ok) {
+                log_error() << "lz4 decompression failed: " << ret << endl;
+            }
+
+            break;
+        }
+#endif
+        default:
+            log_error() << "unsupported compression codec " << used_codec << endl;
+            break;
+        }
+
+        if (!ok) {
             /* This should NEVER happen.
             Remove the buffer, and indicate there is nothing in it,
             but don't reset the compressed_len, so our caller know,
             that there actually was something read in.  */
             log_error() << "internal error - decompression of data from " << dump().c_str()
-                        << " failed: " << ret << endl;
-            delete [] *uncompressed_buf;
+                        << " failed" << endl;
+            release_chunk_buffer(*uncompressed_buf);
             *uncompressed_buf = 0;
             uncompressed_len = 0;
         }
@@ -517,32 +1080,137 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
 
 void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
 {
-    lzo_uint in_len = _in_len;
-    lzo_uint out_len = _out_len;
-    out_len = in_len + in_len / 64 + 16 + 3;
-    *this << in_len;
-    size_t msgtogo_old = msgtogo;
-    *this << (uint32_t) 0;
+    CompressionCodec used_codec;
+    int level;
+    size_t in_len = _in_len;
+    size_t out_len;
+    int mode = choose_compression(in_len, used_codec, level);
+
+    switch (used_codec) {
+#ifdef HAVE_ZSTD
+    case C_ZSTD:
+        out_len = ZSTD_compressBound(in_len);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case C_LZ4:
+        out_len = LZ4_compressBound(in_len);
+        break;
+#endif
+    default:
+        out_len = in_len + in_len / 64 + 16 + 3;
+        break;
+    }
 
-    if (msgtogo + out_len >= msgbuflen) {
+    if (IS_PROTOCOL_36(this)) {
+        *this << (uint32_t) used_codec;
+    }
+
+    *this << (uint32_t) in_len;
+    size_t msgtogo_old = msgtogo;
+    *this << (uint32_t) 0;
+
+    if (msgofs + msgtogo + out_len >= msgbuflen) {
         /* Realloc to a multiple of 128.  */
-        msgbuflen = (msgtogo + out_len + 127) & ~(size_t)127;
+        msgbuflen = (msgofs + msgtogo + out_len + 127) & ~(size_t)127;
         msgbuf = (char *) realloc(msgbuf, msgbuflen);
     }
 
-    lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-    lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-    int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-    free(wrkmem);
+    char *out_buf = msgbuf + msgofs + msgtogo;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    switch (used_codec) {
+    case C_STORED:
+        memcpy(out_buf, in_buf, in_len);
+        out_len = in_len;
+        break;
+#ifdef HAVE_ZSTD
+    case C_ZSTD: {
+        if (!zstd_cctx) {
+            zstd_cctx = ZSTD_createCCtx();
+        }
+
+        size_t ret;
+
+        if (dict_write) {
+            ZSTD_CDict *&cdict = zstd_cdicts[level ? level : 1];
+
+            if (!cdict) {
+                cdict = ZSTD_createCDict(compression_dict.data(), compression_dict.size(),
+                                         level ? level : 1);
+            }
+
+            ret = ZSTD_compress_usingCDict(zstd_cctx, out_buf, out_len, in_buf, in_len, cdict);
+        } else {
+            ret = ZSTD_compressCCtx(zstd_cctx, out_buf, out_len, in_buf, in_len,
+                                    level ? level : 1);
+        }
+
+        if (ZSTD_isError(ret)) {
+            /* this should NEVER happen */
+            log_error() << "internal error - zstd compression failed: "
+                        << ZSTD_getErrorName(ret) << endl;
+            out_len = 0;
+        } else {
+            out_len = ret;
+        }
+
+        break;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case C_LZ4: {
+        if (!lz4_state) {
+            lz4_state = malloc(LZ4_sizeofState());
+        }
+
+        int ret = LZ4_compress_fast_extState(lz4_state, (const char *) in_buf, out_buf,
+                                             in_len, out_len, level > 0 ? level : 1);
+
+        if (ret <= 0) {
+            /* this should NEVER happen */
+            log_error() << "internal error - lz4 compression failed: " << ret << endl;
+            out_len = 0;
+        } else {
+            out_len = ret;
+        }
+
+        break;
+    }
+#endif
+    default: {
+        lzo_uint lzo_out_len = out_len;
+
+        if (!lzo_wrkmem) {
+            lzo_wrkmem = malloc(LZO1X_MEM_COMPRESS);
+        }
+
+        int ret = lzo1x_1_compress(in_buf, in_len, (lzo_byte *) out_buf, &lzo_out_len,
+                                   lzo_wrkmem);
+
+        if (ret != LZO_E_OK) {
+            /* this should NEVER happen */
+            log_error() << "internal error - compression failed: " << ret << endl;
+            lzo_out_len = 0;
+        }
+
+        out_len = lzo_out_len;
+        break;
+    }
+    }
 
-    if (ret != LZO_E_OK) {
-        /* this should NEVER happen */
-        log_error() << "internal error - compression failed: " << ret << endl;
-        out_len = 0;
+    if (mode >= 0 && out_len) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        adaptive->measured(mode, in_len, out_len,
+                           (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
     }
 
+    last_codec = used_codec;
+    last_level = level;
     uint32_t _olen = htonl(out_len);
-    memcpy(msgbuf + msgtogo_old, &_olen, 4);
+    memcpy(msgbuf + msgofs + msgtogo_old, &_olen, 4);
     msgtogo += out_len;
     _out_len = out_len;
 }
@@ -573,6 +1241,46 @@ void MsgChannel::write_line(const string &line)
     }
 }
 
+void MsgChannel::read_bytes(string &data)
+{
+    uint32_t len;
+    *this >> len;
+
+    if (len > inofs - intogo) {
+        data.clear();
+    } else {
+        data.assign(inbuf + intogo, len);
+        intogo += len;
+    }
+}
+
+void MsgChannel::write_bytes(const string &data)
+{
+    *this << (uint32_t) data.size();
+    writefull(data.data(), data.size());
+}
+
+bool MsgChannel::unread_input(string &data) const
+{
+    /* In the middle of the protocol setup or of raw data the state is more
+       than the bytes.  */
+    if (text_based || raw_togo || instate == NEED_PROTO || instate == NEED_COMPRESSION
+            || msgtogo) {
+        return false;
+    }
+
+    data.clear();
+
+    /* The length of the message at hand was taken from the input already.  */
+    if (instate == FILL_BUF || instate == HAS_MSG) {
+        uint32_t len = htonl(inmsglen);
+        data.assign((const char *) &len, 4);
+    }
+
+    data.append(inbuf + intogo, inofs - intogo);
+    return true;
+}
+
 static int prepare_connect(const string &hostname, unsigned short p,
                            struct sockaddr_in &remote_addr)
 {
@@ -696,6 +1404,109 @@ MsgChannel *Service::createChannel(const string &hostname, unsigned short p, int
     return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
 }
 
+MsgChannel *Service::connectChannel(const string &hostname, unsigned short p, int timeout)
+{
+    int remote_fd;
+    struct sockaddr_in remote_addr;
+
+    if ((remote_fd = prepare_connect(hostname, p, remote_addr)) < 0) {
+        return 0;
+    }
+
+    if (!connect_async(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr), timeout)) {
+        return 0;    // remote_fd is already closed
+    }
+
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr), false);
+
+    if (c->protocol == 0) {
+        delete c;
+        c = 0;
+    }
+
+    return c;
+}
+
+int Service::startConnect(const string &hostname, unsigned short p)
+{
+    int remote_fd;
+    struct sockaddr_in remote_addr;
+
+    if ((remote_fd = prepare_connect(hostname, p, remote_addr)) < 0) {
+        return -1;
+    }
+
+    fcntl(remote_fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr)) < 0
+            && errno != EINPROGRESS && errno != EAGAIN) {
+        trace() << "connect failed on " << hostname << endl;
+        close(remote_fd);
+        return -1;
+    }
+
+    return remote_fd;
+}
+
+MsgChannel *Service::connectedChannel(int remote_fd)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    struct sockaddr_storage remote_addr;
+    socklen_t len = sizeof(remote_addr);
+
+    if (getsockopt(remote_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error
+            || getpeername(remote_fd, (struct sockaddr *)&remote_addr, &len) < 0) {
+        close(remote_fd);
+        return 0;
+    }
+
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *)&remote_addr, len, false);
+
+    if (c->protocol == 0) {
+        delete c;
+        c = 0;
+    }
+
+    return c;
+}
+
+MsgChannel *Service::adoptChannel(int remote_fd, int protocol, uint32_t remote_codecs,
+                                  const string &unread)
+{
+    struct sockaddr_storage remote_addr;
+    socklen_t len = sizeof(remote_addr);
+    memset(&remote_addr, 0, sizeof(remote_addr));
+
+    if (getpeername(remote_fd, (struct sockaddr *)&remote_addr, &len) != 0) {
+        log_perror("getpeername()");
+        close(remote_fd);
+        return 0;
+    }
+
+    /* Unnamed unix sockets come without a path, the channel expects one.  */
+    if (remote_addr.ss_family == AF_UNIX) {
+        len = sizeof(remote_addr);
+    }
+
+    /* Text based channels skip the protocol setup, make it binary with the
+       outcome of the setup somebody else made.  */
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *)&remote_addr, len, true);
+    c->text_based = false;
+    c->protocol = protocol;
+    c->remote_codecs = remote_codecs | (1 << C_LZO);
+
+    if (!unread.empty()) {
+        c->inbuf = (char *) realloc(c->inbuf, unread.size());
+        c->inbuflen = unread.size();
+        memcpy(c->inbuf, unread.data(), unread.size());
+        c->inofs = unread.size();
+        c->update_state();
+    }
+
+    return c;
+}
+
 MsgChannel *Service::createChannel(const string &socket_path)
 {
     int remote_fd;
@@ -741,6 +1552,60 @@ bool MsgChannel::eq_ip(const MsgChannel &s) const
             && memcmp(&s1->sin_addr, &s2->sin_addr, sizeof(s1->sin_addr)) == 0);
 }
 
+uint32_t MsgChannel::rtt_usec() const
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    if (addr && addr->sa_family == AF_INET) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            return info.tcpi_rtt;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* The DSCP code points CS6, AF41 and CS1, and the priorities that put
+   them in the bands of pfifo_fast, the default queue of the hosts.  */
+static const int traffic_tos[] = { 0xc0, 0x88, 0x20 };
+static const int traffic_priority[] = { 6, 0, 1 };
+
+void MsgChannel::setTrafficClass(TrafficClass tc, unsigned long bytes_per_sec)
+{
+    if (!addr || addr->sa_family != AF_INET) {
+        return;
+    }
+
+    int tos = traffic_tos[tc];
+
+    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+        log_perror("setsockopt IP_TOS");
+    }
+
+#ifdef SO_PRIORITY
+    int priority = traffic_priority[tc];
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0) {
+        log_perror("setsockopt SO_PRIORITY");
+    }
+#endif
+#ifdef SO_MAX_PACING_RATE
+    // the kernel paces TCP itself since Linux 4.13
+    unsigned int rate = ~0U;
+
+    if (tc == TC_BULK && bytes_per_sec) {
+        rate = min(bytes_per_sec, (unsigned long) ~0U);
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+#else
+    (void) bytes_per_sec;
+#endif
+}
+
 MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
 {
     MsgChannel *c = new MsgChannel(fd, _a, _l, false);
@@ -785,6 +1650,19 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     intogo = 0;
     eof = false;
     text_based = text;
+    raw_togo = 0;
+    remote_codecs = 1 << C_LZO;
+    adaptive_compression = default_compression(codec, codec_level);
+    adaptive = 0;
+    last_codec = C_LZO;
+    last_level = 0;
+    lzo_wrkmem = 0;
+    zstd_cctx = 0;
+    zstd_dctx = 0;
+    lz4_state = 0;
+    dict_id = 0;
+    dict_write = false;
+    zstd_ddict = 0;
 
     int on = 1;
 
@@ -856,9 +1734,27 @@ MsgChannel::~MsgChannel()
         free(inbuf);
     }
 
+    while (!received_fds.empty()) {
+        close(received_fds.front());
+        received_fds.pop_front();
+    }
+
     if (addr) {
         free(addr);
     }
+
+    delete adaptive;
+    free(lzo_wrkmem);
+    free(lz4_state);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDCtx(zstd_dctx);
+    ZSTD_freeDDict(zstd_ddict);
+
+    for (map<int, ZSTD_CDict *>::iterator it = zstd_cdicts.begin(); it != zstd_cdicts.end(); ++it) {
+        ZSTD_freeCDict(it->second);
+    }
+#endif
 }
 
 string MsgChannel::dump() const
@@ -875,7 +1771,7 @@ bool MsgChannel::wait_for_protocol()
         return false;
     }
 
-    while (instate == NEED_PROTO) {
+    while (instate == NEED_PROTO || instate == NEED_COMPRESSION) {
         fd_set set;
         FD_ZERO(&set);
         FD_SET(fd, &set);
@@ -1090,6 +1986,72 @@ Msg *MsgChannel::get_msg(int timeout)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_FILE_RAW:
+        m = new FileRawMsg;
+        break;
+    case M_STANDBY_LOGIN:
+        m = new StandbyLoginMsg;
+        break;
+    case M_STANDBY_STATE:
+        m = new StandbyStateMsg;
+        break;
+    case M_FETCH_ENV:
+        m = new FetchEnvMsg;
+        break;
+    case M_GET_ENV:
+        m = new GetEnvMsg;
+        break;
+    case M_USE_LEASE:
+        m = new UseLeaseMsg;
+        break;
+    case M_WORKER_JOB:
+        m = new WorkerJobMsg;
+        break;
+    case M_RESULT_KEY:
+        m = new ResultKeyMsg;
+        break;
+    case M_GET_RESULT:
+        m = new GetResultMsg;
+        break;
+    case M_PUT_RESULT:
+        m = new PutResultMsg;
+        break;
+    case M_RESULT_OWNERS:
+        m = new ResultOwnersMsg;
+        break;
+    case M_HEADER_MANIFEST:
+        m = new HeaderManifestMsg;
+        break;
+    case M_HEADER_REQUEST:
+        m = new HeaderRequestMsg;
+        break;
+    case M_BENCHMARK:
+        m = new BenchmarkMsg;
+        break;
+    case M_BENCHMARK_RESULT:
+        m = new BenchmarkResultMsg;
+        break;
+    case M_FEDERATION_LOGIN:
+        m = new FederationLoginMsg;
+        break;
+    case M_FEDERATION_CAPACITY:
+        m = new FederationCapacityMsg;
+        break;
+    case M_OUTPUT_CHUNK:
+        m = new OutputChunkMsg;
+        break;
+    case M_JOB_WAIT:
+        m = new JobWaitMsg;
+        break;
+    case M_COMPRESSION_DICT:
+        m = new CompressionDictMsg;
+        break;
+    case M_CHUNK_MANIFEST:
+        m = new ChunkManifestMsg;
+        break;
+    case M_MON_SNAPSHOT:
+        m = new MonSnapshotMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
@@ -1100,6 +2062,19 @@ Msg *MsgChannel::get_msg(int timeout)
     }
 
     m->fill_from_channel(this);
+
+    if (m->type == M_FILE_RAW) {
+        uint64_t len = static_cast<FileRawMsg *>(m)->len;
+
+        if (len > (size_t) -1) {
+            log_error() << "raw data of " << len << " bytes is too big" << endl;
+            delete m;
+            return 0;
+        }
+
+        raw_togo = len;
+    }
+
     instate = NEED_LEN;
     update_state();
 
@@ -1121,82 +2096,392 @@ bool MsgChannel::send_msg(const Msg &m, int flags)
         *this << (uint32_t) 0;
         m.send_to_channel(this);
         uint32_t len = htonl(msgtogo - msgtogo_old - 4);
-        memcpy(msgbuf + msgtogo_old, &len, 4);
+        memcpy(msgbuf + msgofs + msgtogo_old, &len, 4);
     }
 
     if ((flags & SendBulkOnly) && msgtogo < 4096) {
         return true;
     }
 
+    if (flags & SendQueued) {
+        return true;
+    }
+
     return flush_writebuf((flags & SendBlocking));
 }
 
-#include "getifaddrs.h"
-#include <net/if.h>
-#include <sys/ioctl.h>
-
-/* Returns a filedesc. or a negative value for errors.  */
-static int open_send_broadcast(int port, const char* buf, int size)
+bool MsgChannel::send_msg_fd(const Msg &m, int pass_fd)
 {
-    int ask_fd;
-    struct sockaddr_in remote_addr;
-
-    if ((ask_fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
-        log_perror("open_send_broadcast socket");
-        return -1;
-    }
-
-    if (fcntl(ask_fd, F_SETFD, FD_CLOEXEC) < 0) {
-        log_perror("open_send_broadcast fcntl");
-        close(ask_fd);
-        return -1;
-    }
+    return send_msg_fds(m, &pass_fd, 1);
+}
 
-    int optval = 1;
+bool MsgChannel::send_msg_fds(const Msg &m, const int *pass_fds, size_t count)
+{
+    assert(count > 0 && count <= 4);
 
-    if (setsockopt(ask_fd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0) {
-        log_perror("open_send_broadcast setsockopt");
-        close(ask_fd);
-        return -1;
+    if (!send_msg(m, SendQueued)) {
+        return false;
     }
 
-    struct kde_ifaddrs *addrs;
-
-    int ret = kde_getifaddrs(&addrs);
+    /* The descriptor arrives with the first byte of this sendmsg(), which
+       is no later than the message itself.  */
+    struct iovec iov;
+    iov.iov_base = msgbuf + msgofs;
+    iov.iov_len = msgtogo;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), pass_fds, count * sizeof(int));
 
-    if (ret < 0) {
-        return ret;
-    }
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
 
-    for (struct kde_ifaddrs *addr = addrs; addr != NULL; addr = addr->ifa_next) {
-        /*
-         * See if this interface address is IPv4...
-         */
+    for (;;) {
+        ssize_t ret = sendmsg(fd, &mh, flags);
 
-        if (addr->ifa_addr == NULL || addr->ifa_addr->sa_family != AF_INET
-                || addr->ifa_netmask == NULL || addr->ifa_name == NULL) {
+        if (ret < 0 && errno == EINTR) {
             continue;
         }
 
-        if (ntohl(((struct sockaddr_in *) addr->ifa_addr)->sin_addr.s_addr) == 0x7f000001) {
-            trace() << "ignoring localhost " << addr->ifa_name << endl;
-            continue;
+        if (ret < 0 && errno == EAGAIN) {
+            fd_set write_set;
+            FD_ZERO(&write_set);
+            FD_SET(fd, &write_set);
+            struct timeval tv;
+            tv.tv_sec = 20;
+            tv.tv_usec = 0;
+
+            if (select(fd + 1, NULL, &write_set, NULL, &tv) > 0 || errno == EINTR) {
+                continue;
+            }
         }
 
-        if ((addr->ifa_flags & IFF_POINTOPOINT) || !(addr->ifa_flags & IFF_BROADCAST)) {
-            log_info() << "ignoring tunnels " << addr->ifa_name << endl;
-            continue;
+        if (ret <= 0) {
+            log_perror("sendmsg() failed");
+            return false;
         }
 
-        if (addr->ifa_broadaddr) {
-            log_info() << "broadcast "
-                       << addr->ifa_name << " "
-                       << inet_ntoa(((sockaddr_in *)addr->ifa_broadaddr)->sin_addr)
-                       << endl;
+        msgofs += ret;
+        msgtogo -= ret;
+        break;
+    }
 
-            remote_addr.sin_family = AF_INET;
-            remote_addr.sin_port = htons(port);
-            remote_addr.sin_addr = ((sockaddr_in *)addr->ifa_broadaddr)->sin_addr;
+    chop_output();
+    return flush_writebuf(true);
+}
+
+int MsgChannel::take_fd()
+{
+    if (received_fds.empty()) {
+        return -1;
+    }
+
+    int ret = received_fds.front();
+    received_fds.pop_front();
+    return ret;
+}
+
+bool MsgChannel::flush(bool blocking)
+{
+    if (blocking) {
+        return flush_writebuf(true);
+    }
+
+    bool would_block = false;
+    return flush_writebuf(false, &would_block);
+}
+
+bool MsgChannel::send_raw_file(int file_fd, size_t len)
+{
+    if (!send_msg(FileRawMsg(len))) {
+        return false;
+    }
+
+#ifdef HAVE_SYS_SENDFILE_H
+    bool use_sendfile = true;
+#else
+    bool use_sendfile = false;
+#endif
+
+    while (len) {
+        ssize_t ret;
+
+        if (use_sendfile) {
+#ifdef HAVE_SYS_SENDFILE_H
+            ret = sendfile(fd, file_fd, NULL, len);
+
+            if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = false;
+                continue;
+            }
+#endif
+        } else {
+            char buf[65536];
+            ret = read(file_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+            if (ret > 0) {
+                writefull(buf, ret);
+
+                if (!flush_writebuf(true)) {
+                    return false;
+                }
+            }
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            fd_set write_set;
+            FD_ZERO(&write_set);
+            FD_SET(fd, &write_set);
+            struct timeval tv;
+            tv.tv_sec = 20;
+            tv.tv_usec = 0;
+
+            if (select(fd + 1, NULL, &write_set, NULL, &tv) > 0 || errno == EINTR) {
+                continue;
+            }
+        }
+
+        if (ret <= 0) {
+            log_perror("send_raw_file() failed");
+            return false;
+        }
+
+        len -= ret;
+    }
+
+    return true;
+}
+
+ssize_t MsgChannel::read_raw(int out_fd)
+{
+    size_t moved = 0;
+
+    /* First whatever got buffered together with the FileRawMsg.  */
+    while (raw_togo && inofs > intogo) {
+        size_t count = inofs - intogo;
+        ssize_t ret = write(out_fd, inbuf + intogo, count < raw_togo ? count : raw_togo);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            return -1;
+        }
+
+        intogo += ret;
+        raw_togo -= ret;
+        moved += ret;
+    }
+
+    chop_input();
+
+#ifdef HAVE_SPLICE
+    bool use_splice = true;
+#else
+    bool use_splice = false;
+#endif
+
+    /* Return now and then, so that callers with other channels don't starve
+       while a big transfer arrives at full speed.  */
+    while (raw_togo && moved < MAX_MSG_SIZE) {
+        ssize_t ret;
+
+        if (use_splice) {
+#ifdef HAVE_SPLICE
+            ret = splice(fd, NULL, out_fd, NULL, raw_togo, SPLICE_F_MOVE);
+
+            if (ret < 0 && errno == EINVAL) {
+                // out_fd is not a pipe
+                use_splice = false;
+                continue;
+            }
+#endif
+        } else {
+            char buf[65536];
+            ret = read(fd, buf, raw_togo < sizeof(buf) ? raw_togo : sizeof(buf));
+
+            for (ssize_t off = 0; ret > 0 && off < ret;) {
+                ssize_t written = write(out_fd, buf + off, ret - off);
+
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+
+                if (written < 0) {
+                    return -1;
+                }
+
+                off += written;
+            }
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            break;
+        }
+
+        if (ret == 0) {
+            eof = true;
+        }
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        raw_togo -= ret;
+        moved += ret;
+    }
+
+    if (!raw_togo) {
+        /* Messages may follow the raw data in inbuf.  */
+        if (!update_state()) {
+            return -1;
+        }
+    }
+
+    return moved;
+}
+
+ssize_t MsgChannel::read_raw(void *buf, size_t len)
+{
+    char *out = (char *) buf;
+    size_t moved = 0;
+
+    if (len > raw_togo) {
+        len = raw_togo;
+    }
+
+    if (inofs > intogo) {
+        moved = inofs - intogo < len ? inofs - intogo : len;
+        memcpy(out, inbuf + intogo, moved);
+        intogo += moved;
+        chop_input();
+    }
+
+    while (moved < len) {
+        ssize_t ret = read(fd, out + moved, len - moved);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && errno == EAGAIN) {
+            break;
+        }
+
+        if (ret == 0) {
+            eof = true;
+        }
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        moved += ret;
+    }
+
+    raw_togo -= moved;
+
+    if (!raw_togo) {
+        if (!update_state()) {
+            return -1;
+        }
+    }
+
+    return moved;
+}
+
+#include "getifaddrs.h"
+#include <net/if.h>
+#include <sys/ioctl.h>
+
+/* Returns a filedesc. or a negative value for errors.  */
+static int open_send_broadcast(int port, const char* buf, int size)
+{
+    int ask_fd;
+    struct sockaddr_in remote_addr;
+
+    if ((ask_fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        log_perror("open_send_broadcast socket");
+        return -1;
+    }
+
+    if (fcntl(ask_fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("open_send_broadcast fcntl");
+        close(ask_fd);
+        return -1;
+    }
+
+    int optval = 1;
+
+    if (setsockopt(ask_fd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0) {
+        log_perror("open_send_broadcast setsockopt");
+        close(ask_fd);
+        return -1;
+    }
+
+    struct kde_ifaddrs *addrs;
+
+    int ret = kde_getifaddrs(&addrs);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (struct kde_ifaddrs *addr = addrs; addr != NULL; addr = addr->ifa_next) {
+        /*
+         * See if this interface address is IPv4...
+         */
+
+        if (addr->ifa_addr == NULL || addr->ifa_addr->sa_family != AF_INET
+                || addr->ifa_netmask == NULL || addr->ifa_name == NULL) {
+            continue;
+        }
+
+        if (ntohl(((struct sockaddr_in *) addr->ifa_addr)->sin_addr.s_addr) == 0x7f000001) {
+            trace() << "ignoring localhost " << addr->ifa_name << endl;
+            continue;
+        }
+
+        if ((addr->ifa_flags & IFF_POINTOPOINT) || !(addr->ifa_flags & IFF_BROADCAST)) {
+            log_info() << "ignoring tunnels " << addr->ifa_name << endl;
+            continue;
+        }
+
+        if (addr->ifa_broadaddr) {
+            log_info() << "broadcast "
+                       << addr->ifa_name << " "
+                       << inet_ntoa(((sockaddr_in *)addr->ifa_broadaddr)->sin_addr)
+                       << endl;
+
+            remote_addr.sin_family = AF_INET;
+            remote_addr.sin_port = htons(port);
+            remote_addr.sin_addr = ((sockaddr_in *)addr->ifa_broadaddr)->sin_addr;
 
             if (sendto(ask_fd, buf, size, 0, (struct sockaddr *)&remote_addr,
                        sizeof(remote_addr)) != size) {
@@ -1280,6 +2565,109 @@ static void get_broad_data(const char* buf, const char** name, int* version, tim
     }
 }
 
+/* The scheduler last chosen by broadcast for a netname, which is asked
+   directly as well next time, in case broadcasts are filtered or slow.  */
+struct CachedScheduler {
+    string netname;
+    string host; // IP address
+    unsigned int port;
+    int version;
+    time_t start_time;
+};
+
+static string scheduler_cache_dir()
+{
+    if (getuid() == 0) {
+        return "/var/cache/icecc";
+    }
+
+    const char *cache = getenv("XDG_CACHE_HOME");
+
+    if (cache && *cache) {
+        return cache;
+    }
+
+    const char *home = getenv("HOME");
+    return home && *home ? string(home) + "/.cache" : string();
+}
+
+static list<CachedScheduler> read_scheduler_cache()
+{
+    list<CachedScheduler> schedulers;
+    string dir = scheduler_cache_dir();
+    FILE *file = dir.empty() ? 0 : fopen((dir + "/icecc-schedulers").c_str(), "r");
+    char netname[BROAD_BUFLEN];
+    char host[INET_ADDRSTRLEN];
+    unsigned int port;
+    int version;
+    long long start_time;
+
+    while (file && fscanf(file, "%31s %15s %u %d %lld", netname, host, &port, &version,
+                          &start_time) == 5) {
+        CachedScheduler scheduler;
+        scheduler.netname = netname;
+        scheduler.host = host;
+        scheduler.port = port;
+        scheduler.version = version;
+        scheduler.start_time = start_time;
+        schedulers.push_back(scheduler);
+    }
+
+    if (file) {
+        fclose(file);
+    }
+
+    return schedulers;
+}
+
+static void write_scheduler_cache(const CachedScheduler &chosen)
+{
+    string dir = scheduler_cache_dir();
+
+    if (dir.empty() || chosen.netname.empty() || chosen.netname.find(' ') != string::npos) {
+        return;
+    }
+
+    list<CachedScheduler> schedulers = read_scheduler_cache();
+    string file_name = dir + "/icecc-schedulers";
+    char pid[16];
+    snprintf(pid, sizeof(pid), ".%d", int(getpid()));
+    string tmp_name = file_name + pid;
+    mkdir(dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    FILE *file = fopen(tmp_name.c_str(), "w");
+
+    if (!file) {
+        return;
+    }
+
+    fprintf(file, "%s %s %u %d %lld\n", chosen.netname.c_str(), chosen.host.c_str(),
+            chosen.port, chosen.version, (long long) chosen.start_time);
+
+    for (list<CachedScheduler>::const_iterator it = schedulers.begin(); it != schedulers.end(); ++it) {
+        if (strcasecmp(it->netname.c_str(), chosen.netname.c_str()) != 0) {
+            fprintf(file, "%s %s %u %d %lld\n", it->netname.c_str(), it->host.c_str(),
+                    it->port, it->version, (long long) it->start_time);
+        }
+    }
+
+    if (fclose(file) != 0 || rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+        unlink(tmp_name.c_str());
+    }
+}
+
+/* Sends the discovery request BUF to the scheduler at HOST:PORT only.  */
+static bool ask_scheduler(int ask_fd, const string &host, unsigned int port, const char *buf,
+                          int size)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    return inet_aton(host.c_str(), &addr.sin_addr)
+           && sendto(ask_fd, buf, size, 0, (struct sockaddr *) &addr, sizeof(addr)) == size;
+}
+
 DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
                              const std::string &_schedname, int port)
     : netname(_netname)
@@ -1290,6 +2678,8 @@ DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
     , best_version(0)
     , best_start_time(0)
     , multiple(false)
+    , cached_port(0)
+    , cached_version(0)
 {
     time0 = time(0);
 
@@ -1321,6 +2711,19 @@ DiscoverSched::DiscoverSched(const std::string &_netname, int _timeout,
     } else {
         char buf = PROTOCOL_VERSION;
         ask_fd = open_send_broadcast(sport, &buf, 1);
+        list<CachedScheduler> cached = read_scheduler_cache();
+
+        for (list<CachedScheduler>::const_iterator it = cached.begin();
+                ask_fd >= 0 && it != cached.end(); ++it) {
+            if (strcasecmp(it->netname.c_str(), netname.c_str()) == 0 && it->port == sport
+                    && ask_scheduler(ask_fd, it->host, it->port, &buf, 1)) {
+                trace() << "asking the scheduler found last at " << it->host << ":" << it->port
+                        << endl;
+                cached_name = it->host;
+                cached_port = it->port;
+                cached_version = it->version;
+            }
+        }
     }
 }
 
@@ -1392,7 +2795,13 @@ MsgChannel *DiscoverSched::try_get_scheduler()
             }
         }
 
-        if (timed_out()) {
+        /* The one chosen last time, or a newer version of it, doesn't
+           need to wait for the others.  A newer scheduler elsewhere makes
+           it drop its daemons anyway.  */
+        bool known = best_version != 0 && schedname == cached_name && sport == cached_port
+                     && best_version >= cached_version;
+
+        if (timed_out() || known) {
             if (best_version == 0) {
                 return 0;
             }
@@ -1409,6 +2818,13 @@ MsgChannel *DiscoverSched::try_get_scheduler()
                 if (status == 0 || (status < 0 && (errno == EISCONN || errno == EINPROGRESS))) {
                     int fd = ask_fd;
                     ask_fd = -1;
+                    CachedScheduler chosen;
+                    chosen.netname = netname;
+                    chosen.host = schedname;
+                    chosen.port = sport;
+                    chosen.version = best_version;
+                    chosen.start_time = best_start_time;
+                    write_scheduler_cache(chosen);
                     return Service::createChannel(fd,
                                                   (struct sockaddr *) &remote_addr, sizeof(remote_addr));
                 }
@@ -1449,6 +2865,12 @@ list<string> get_netnames(int timeout, int port)
 
     char buf = PROTOCOL_VERSION;
     ask_fd = open_send_broadcast(port, &buf, 1);
+    list<CachedScheduler> cached = read_scheduler_cache();
+
+    for (list<CachedScheduler>::const_iterator it = cached.begin();
+            ask_fd >= 0 && it != cached.end(); ++it) {
+        ask_scheduler(ask_fd, it->host, it->port, &buf, 1);
+    }
 
     do {
         char buf2[BROAD_BUFLEN];
@@ -1517,6 +2939,21 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
         *c >> version;
         minimal_host_version = max( minimal_host_version, int( version ));
     }
+
+    job_class = JC_INTERACTIVE;
+    if (IS_PROTOCOL_41(c)) {
+        *c >> job_class;
+    }
+
+    allow_duplicate = 0;
+    if (IS_PROTOCOL_46(c)) {
+        *c >> allow_duplicate;
+    }
+
+    lease = 0;
+    if (IS_PROTOCOL_47(c)) {
+        *c >> lease;
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -1540,6 +2977,15 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_34(c)) {
         *c << minimal_host_version;
     }
+    if (IS_PROTOCOL_41(c)) {
+        *c << job_class;
+    }
+    if (IS_PROTOCOL_46(c)) {
+        *c << allow_duplicate;
+    }
+    if (IS_PROTOCOL_47(c)) {
+        *c << lease;
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -1557,6 +3003,28 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    if (IS_PROTOCOL_39(c)) {
+        *c >> channel_protocol;
+        *c >> channel_codecs;
+    } else {
+        channel_protocol = 0;
+        channel_codecs = 0;
+    }
+
+    env_from_peer = 0;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> env_from_peer;
+    }
+
+    dict_id = 0;
+    dict.clear();
+
+    if (IS_PROTOCOL_62(c)) {
+        *c >> dict_id;
+        c->read_bytes(dict);
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -1572,7 +3040,21 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
-}
+
+    if (IS_PROTOCOL_39(c)) {
+        *c << channel_protocol;
+        *c << channel_codecs;
+    }
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << env_from_peer;
+    }
+
+    if (IS_PROTOCOL_62(c)) {
+        *c << dict_id;
+        c->write_bytes(dict);
+    }
+}
 
 void CompileFileMsg::fill_from_channel(MsgChannel *c)
 {
@@ -1625,6 +3107,46 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_38(c)) {
+        uint32_t raw = 0;
+        *c >> raw;
+        raw_output = raw;
+    }
+    if (IS_PROTOCOL_49(c)) {
+        uint32_t stream = 0;
+        *c >> stream;
+        stream_output = stream;
+    }
+    if (IS_PROTOCOL_51(c)) {
+        uint32_t cpp = 0;
+        *c >> cpp;
+        remote_cpp = cpp;
+    }
+    if (IS_PROTOCOL_52(c)) {
+        uint32_t has_pch = 0;
+        *c >> has_pch;
+        pch = has_pch;
+    }
+    if (IS_PROTOCOL_58(c)) {
+        uint32_t interleaved = 0;
+        *c >> interleaved;
+        interleaved_output = interleaved;
+    }
+    if (IS_PROTOCOL_60(c)) {
+        list<string> outputs;
+        *c >> outputs;
+        job->setCommandOutputs(outputs);
+    }
+    dict_id = 0;
+    if (IS_PROTOCOL_62(c)) {
+        *c >> dict_id;
+    }
+    chunked = false;
+    if (IS_PROTOCOL_63(c)) {
+        uint32_t is_chunked = 0;
+        *c >> is_chunked;
+        chunked = is_chunked;
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -1661,6 +3183,30 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+    if (IS_PROTOCOL_38(c)) {
+        *c << (uint32_t) raw_output;
+    }
+    if (IS_PROTOCOL_49(c)) {
+        *c << (uint32_t) stream_output;
+    }
+    if (IS_PROTOCOL_51(c)) {
+        *c << (uint32_t) remote_cpp;
+    }
+    if (IS_PROTOCOL_52(c)) {
+        *c << (uint32_t) pch;
+    }
+    if (IS_PROTOCOL_58(c)) {
+        *c << (uint32_t) interleaved_output;
+    }
+    if (IS_PROTOCOL_60(c)) {
+        *c << job->commandOutputs();
+    }
+    if (IS_PROTOCOL_62(c)) {
+        *c << dict_id;
+    }
+    if (IS_PROTOCOL_63(c)) {
+        *c << (uint32_t) chunked;
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -1669,6 +3215,11 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
 // hardcoded).  For clang, the binary is just clang for both C/C++.
 string CompileFileMsg::remote_compiler_name() const
 {
+    // a command of icerun, which the environment has to have
+    if (job->language() == CompileJob::Lang_Custom) {
+        return job->compilerName();
+    }
+
     if (job->compilerName().find("clang") != string::npos) {
         return "clang";
     }
@@ -1686,7 +3237,7 @@ CompileJob *CompileFileMsg::takeJob()
 void FileChunkMsg::fill_from_channel(MsgChannel *c)
 {
     if (del_buf) {
-        delete [] buffer;
+        MsgChannel::release_chunk_buffer(buffer);
     }
 
     buffer = 0;
@@ -1702,13 +3253,52 @@ void FileChunkMsg::send_to_channel(MsgChannel *c) const
     c->writecompressed(buffer, len, compressed);
 }
 
+void OutputChunkMsg::fill_from_channel(MsgChannel *c)
+{
+    if (del_buf) {
+        MsgChannel::release_chunk_buffer(buffer);
+    }
+
+    buffer = 0;
+    del_buf = true;
+
+    Msg::fill_from_channel(c);
+    *c >> file;
+    c->readcompressed(&buffer, len, compressed);
+}
+
+void OutputChunkMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << file;
+    c->writecompressed(buffer, len, compressed);
+}
+
 FileChunkMsg::~FileChunkMsg()
 {
     if (del_buf) {
-        delete [] buffer;
+        MsgChannel::release_chunk_buffer(buffer);
     }
 }
 
+void FileRawMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    // the length is sent as two halves, files can be 4GiB or bigger
+    uint32_t len_high;
+    uint32_t len_low;
+    *c >> len_high;
+    *c >> len_low;
+    len = ((uint64_t) len_high << 32) | len_low;
+}
+
+void FileRawMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << (uint32_t) (len >> 32);
+    *c << (uint32_t) len;
+}
+
 void CompileResultMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -1791,6 +3381,7 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags)
     user_msec = 0;
     sys_msec = 0;
     pfaults = 0;
+    max_rss = 0;
     in_compressed = 0;
     in_uncompressed = 0;
     out_compressed = 0;
@@ -1813,6 +3404,10 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     *c >> out_uncompressed;
     *c >> flags;
     exitcode = (int) _exitcode;
+
+    if (IS_PROTOCOL_55(c)) {
+        *c >> max_rss;
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -1829,16 +3424,22 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     *c << out_compressed;
     *c << out_uncompressed;
     *c << flags;
+
+    if (IS_PROTOCOL_55(c)) {
+        *c << max_rss;
+    }
 }
 
 LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std::string _host_platform)
     : Msg(M_LOGIN)
     , port(myport)
     , max_kids(0)
+    , max_local_jobs(0)
     , noremote(false)
     , chroot_possible(false)
     , nodename(_nodename)
     , host_platform(_host_platform)
+    , result_cache(0)
 {
 #ifdef HAVE_LIBCAP_NG
     chroot_possible = capng_have_capability(CAPNG_EFFECTIVE, CAP_SYS_CHROOT);
@@ -1866,6 +3467,23 @@ void LoginMsg::fill_from_channel(MsgChannel *c)
     }
 
     noremote = (net_noremote != 0);
+    max_local_jobs = 0;
+
+    if (IS_PROTOCOL_48(c)) {
+        *c >> max_local_jobs;
+    }
+
+    result_cache = 0;
+
+    if (IS_PROTOCOL_50(c)) {
+        *c >> result_cache;
+    }
+
+    env_digest.clear();
+
+    if (IS_PROTOCOL_56(c)) {
+        *c >> env_digest;
+    }
 }
 
 void LoginMsg::send_to_channel(MsgChannel *c) const
@@ -1881,6 +3499,18 @@ void LoginMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_26(c)) {
         *c << noremote;
     }
+
+    if (IS_PROTOCOL_48(c)) {
+        *c << max_local_jobs;
+    }
+
+    if (IS_PROTOCOL_50(c)) {
+        *c << result_cache;
+    }
+
+    if (IS_PROTOCOL_56(c)) {
+        *c << env_digest;
+    }
 }
 
 void ConfCSMsg::fill_from_channel(MsgChannel *c)
@@ -1890,6 +3520,13 @@ void ConfCSMsg::fill_from_channel(MsgChannel *c)
     *c >> max_scheduler_ping;
     string bench_source; // unused, kept for backwards compatibility
     *c >> bench_source;
+    uint32_t net_need_environments = 0;
+
+    if (IS_PROTOCOL_56(c)) {
+        *c >> net_need_environments;
+    }
+
+    need_environments = net_need_environments != 0;
 }
 
 void ConfCSMsg::send_to_channel(MsgChannel *c) const
@@ -1899,8 +3536,20 @@ void ConfCSMsg::send_to_channel(MsgChannel *c) const
     *c << max_scheduler_ping;
     string bench_source;
     *c << bench_source;
+
+    if (IS_PROTOCOL_56(c)) {
+        *c << need_environments;
+    }
 }
 
+const uint32_t job_phase_bucket_msec[PHASE_BUCKETS - 1] = {
+    10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000
+};
+
+const char *const job_phase_names[PHASE_COUNT] = {
+    "setup", "input", "compile", "output"
+};
+
 void StatsMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -1909,6 +3558,44 @@ void StatsMsg::fill_from_channel(MsgChannel *c)
     *c >> loadAvg5;
     *c >> loadAvg10;
     *c >> freeMem;
+
+    links.clear();
+
+    if (IS_PROTOCOL_42(c)) {
+        uint32_t count;
+        *c >> count;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            PeerLink link;
+            *c >> link.peer;
+            *c >> link.rtt_usec;
+            *c >> link.bytes_per_sec;
+            links.push_back(link);
+        }
+    }
+
+    phases.clear();
+
+    if (IS_PROTOCOL_53(c)) {
+        uint32_t count;
+        *c >> count;
+
+        for (uint32_t i = 0; i < count && i < PHASE_COUNT * PHASE_VALUES; ++i) {
+            uint32_t value;
+            *c >> value;
+            phases.push_back(value);
+        }
+
+        // from a newer daemon with more phases
+        for (uint32_t i = PHASE_COUNT * PHASE_VALUES; i < count; ++i) {
+            uint32_t value;
+            *c >> value;
+        }
+
+        if (phases.size() != PHASE_COUNT * PHASE_VALUES) {
+            phases.clear();
+        }
+    }
 }
 
 void StatsMsg::send_to_channel(MsgChannel *c) const
@@ -1919,6 +3606,24 @@ void StatsMsg::send_to_channel(MsgChannel *c) const
     *c << loadAvg5;
     *c << loadAvg10;
     *c << freeMem;
+
+    if (IS_PROTOCOL_42(c)) {
+        *c << (uint32_t) links.size();
+
+        for (list<PeerLink>::const_iterator it = links.begin(); it != links.end(); ++it) {
+            *c << it->peer;
+            *c << it->rtt_usec;
+            *c << it->bytes_per_sec;
+        }
+    }
+
+    if (IS_PROTOCOL_53(c)) {
+        *c << (uint32_t) phases.size();
+
+        for (vector<uint32_t>::const_iterator it = phases.begin(); it != phases.end(); ++it) {
+            *c << *it;
+        }
+    }
 }
 
 void GetNativeEnvMsg::fill_from_channel(MsgChannel *c)
@@ -1958,6 +3663,11 @@ void EnvTransferMsg::fill_from_channel(MsgChannel *c)
     Msg::fill_from_channel(c);
     *c >> name;
     *c >> target;
+    hash.clear();
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> hash;
+    }
 }
 
 void EnvTransferMsg::send_to_channel(MsgChannel *c) const
@@ -1965,6 +3675,10 @@ void EnvTransferMsg::send_to_channel(MsgChannel *c) const
     Msg::send_to_channel(c);
     *c << name;
     *c << target;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << hash;
+    }
 }
 
 void MonGetCSMsg::fill_from_channel(MsgChannel *c)
@@ -2031,6 +3745,37 @@ void MonLocalJobBeginMsg::send_to_channel(MsgChannel *c) const
     *c << shorten_filename(file);
 }
 
+void MonLoginMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    batch_msec = 0;
+
+    if (IS_PROTOCOL_45(c)) {
+        *c >> batch_msec;
+    }
+
+    snapshot = false;
+
+    if (IS_PROTOCOL_64(c)) {
+        uint32_t wants_snapshot = 0;
+        *c >> wants_snapshot;
+        snapshot = wants_snapshot;
+    }
+}
+
+void MonLoginMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+
+    if (IS_PROTOCOL_45(c)) {
+        *c << batch_msec;
+    }
+
+    if (IS_PROTOCOL_64(c)) {
+        *c << (uint32_t) snapshot;
+    }
+}
+
 void MonStatsMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -2045,6 +3790,393 @@ void MonStatsMsg::send_to_channel(MsgChannel *c) const
     *c << statmsg;
 }
 
+void MonSnapshotMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> version;
+    *c >> size;
+    c->read_bytes(data);
+}
+
+void MonSnapshotMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << version;
+    *c << size;
+    c->write_bytes(data);
+}
+
+/* Each host is its id and the length of its lines, in network byte
+   order, and the lines.  */
+bool MonSnapshotMsg::setHosts(const map<uint32_t, string> &hosts)
+{
+    string plain;
+
+    for (map<uint32_t, string>::const_iterator it = hosts.begin(); it != hosts.end(); ++it) {
+        uint32_t header[2] = { htonl(it->first), htonl(it->second.size()) };
+        plain.append((const char *) header, sizeof(header));
+        plain += it->second;
+    }
+
+    lzo_uint out_len = plain.size() + plain.size() / 64 + 16 + 3;
+
+    // the rest of the message has to fit as well
+    if (out_len > MAX_MSG_SIZE - 64) {
+        return false;
+    }
+
+    vector<char> out(out_len);
+    vector<char> wrkmem(LZO1X_MEM_COMPRESS);
+
+    if (lzo1x_1_compress((const lzo_byte *) plain.data(), plain.size(), (lzo_byte *) &out[0],
+                         &out_len, &wrkmem[0]) != LZO_E_OK) {
+        log_error() << "compressing the monitor snapshot failed" << endl;
+        return false;
+    }
+
+    size = plain.size();
+    data.assign(&out[0], out_len);
+    return true;
+}
+
+bool MonSnapshotMsg::hosts(map<uint32_t, string> &hosts) const
+{
+    hosts.clear();
+
+    if (size > 16 * MAX_MSG_SIZE) {
+        return false;
+    }
+
+    vector<char> plain(size + 1);
+    lzo_uint plain_len = size;
+
+    if (size && lzo1x_decompress_safe((const lzo_byte *) data.data(), data.size(),
+                                      (lzo_byte *) &plain[0], &plain_len, 0) != LZO_E_OK) {
+        return false;
+    }
+
+    if (plain_len != size) {
+        return false;
+    }
+
+    size_t pos = 0;
+
+    while (pos < plain_len) {
+        uint32_t header[2];
+
+        if (plain_len - pos < sizeof(header)) {
+            return false;
+        }
+
+        memcpy(header, &plain[pos], sizeof(header));
+        pos += sizeof(header);
+        uint32_t len = ntohl(header[1]);
+
+        if (plain_len - pos < len) {
+            return false;
+        }
+
+        hosts[ntohl(header[0])].assign(&plain[pos], len);
+        pos += len;
+    }
+
+    return true;
+}
+
+void StandbyStateMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> lines;
+}
+
+void StandbyStateMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << lines;
+}
+
+void FetchEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> hostname;
+    *c >> port;
+    job_id = 0;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c >> job_id;
+    }
+}
+
+void FetchEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << hostname;
+    *c << port;
+
+    if (IS_PROTOCOL_44(c)) {
+        *c << job_id;
+    }
+}
+
+void GetEnvMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+}
+
+void GetEnvMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+}
+
+void UseLeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t _lang;
+    *c >> job_id;
+    *c >> client_id;
+    *c >> filename;
+    *c >> _lang;
+    *c >> arg_flags;
+    lang = static_cast<CompileJob::Language>(_lang);
+}
+
+void UseLeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << job_id;
+    *c << client_id;
+    *c << shorten_filename(filename);
+    *c << (uint32_t) lang;
+    *c << arg_flags;
+}
+
+void WorkerJobMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> protocol;
+    *c >> remote_codecs;
+    c->read_bytes(unread);
+    *c >> mem_limit;
+    *c >> result_owners;
+    c->read_bytes(dict);
+}
+
+void WorkerJobMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << protocol;
+    *c << remote_codecs;
+    c->write_bytes(unread);
+    *c << mem_limit;
+    *c << result_owners;
+    c->write_bytes(dict);
+}
+
+void ResultKeyMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void ResultKeyMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void GetResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void GetResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void PutResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void PutResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void ResultOwnersMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> owners;
+}
+
+void ResultOwnersMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << owners;
+}
+
+void BenchmarkMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> target;
+    *c >> environment;
+}
+
+void BenchmarkMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << target;
+    *c << environment;
+}
+
+void BenchmarkResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> target;
+    *c >> environment;
+    *c >> status;
+    *c >> real_msec;
+    *c >> user_msec;
+    *c >> out_size;
+    *c >> hash;
+}
+
+void BenchmarkResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << target;
+    *c << environment;
+    *c << status;
+    *c << real_msec;
+    *c << user_msec;
+    *c << out_size;
+    *c << hash;
+}
+
+void FederationLoginMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> netname;
+}
+
+void FederationLoginMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << netname;
+}
+
+void FederationCapacityMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    c->read_environments(envs);
+    slots.clear();
+
+    for (size_t i = 0; i < envs.size(); ++i) {
+        uint32_t free_slots;
+        *c >> free_slots;
+        slots.push_back(free_slots);
+    }
+}
+
+void FederationCapacityMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    c->write_environments(envs);
+
+    for (std::list<uint32_t>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+        *c << *it;
+    }
+}
+
+void JobWaitMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> client_id;
+    *c >> remote_msec;
+    *c >> local_msec;
+}
+
+void JobWaitMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << client_id;
+    *c << remote_msec;
+    *c << local_msec;
+}
+
+void CompressionDictMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> target;
+    *c >> version;
+    *c >> id;
+    c->read_bytes(data);
+}
+
+void CompressionDictMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << target;
+    *c << version;
+    *c << id;
+    c->write_bytes(data);
+}
+
+void ChunkManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hashes;
+}
+
+void ChunkManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hashes;
+}
+
+void HeaderManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> cpp_flags;
+    *c >> system_dirs;
+    *c >> files;
+    *c >> hashes;
+}
+
+void HeaderManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << cpp_flags;
+    *c << system_dirs;
+    *c << files;
+    *c << hashes;
+}
+
+void HeaderRequestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hashes;
+}
+
+void HeaderRequestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hashes;
+}
+
 void TextMsg::fill_from_channel(MsgChannel *c)
 {
     c->read_line(text);
@@ -33,10 +33,13 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <map>
+#include <vector>
+
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 35
+#define PROTOCOL_VERSION 64
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -60,6 +63,65 @@
 #define IS_PROTOCOL_33(c) ((c)->protocol >= 33)
 #define IS_PROTOCOL_34(c) ((c)->protocol >= 34)
 #define IS_PROTOCOL_35(c) ((c)->protocol >= 35)
+#define IS_PROTOCOL_36(c) ((c)->protocol >= 36)
+#define IS_PROTOCOL_37(c) ((c)->protocol >= 37)
+#define IS_PROTOCOL_38(c) ((c)->protocol >= 38)
+#define IS_PROTOCOL_39(c) ((c)->protocol >= 39)
+#define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
+#define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
+#define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
+#define IS_PROTOCOL_47(c) ((c)->protocol >= 47)
+#define IS_PROTOCOL_48(c) ((c)->protocol >= 48)
+#define IS_PROTOCOL_49(c) ((c)->protocol >= 49)
+#define IS_PROTOCOL_50(c) ((c)->protocol >= 50)
+#define IS_PROTOCOL_51(c) ((c)->protocol >= 51)
+#define IS_PROTOCOL_52(c) ((c)->protocol >= 52)
+#define IS_PROTOCOL_53(c) ((c)->protocol >= 53)
+#define IS_PROTOCOL_54(c) ((c)->protocol >= 54)
+#define IS_PROTOCOL_55(c) ((c)->protocol >= 55)
+#define IS_PROTOCOL_56(c) ((c)->protocol >= 56)
+#define IS_PROTOCOL_57(c) ((c)->protocol >= 57)
+#define IS_PROTOCOL_58(c) ((c)->protocol >= 58)
+#define IS_PROTOCOL_59(c) ((c)->protocol >= 59)
+#define IS_PROTOCOL_60(c) ((c)->protocol >= 60)
+#define IS_PROTOCOL_61(c) ((c)->protocol >= 61)
+#define IS_PROTOCOL_62(c) ((c)->protocol >= 62)
+#define IS_PROTOCOL_63(c) ((c)->protocol >= 63)
+#define IS_PROTOCOL_64(c) ((c)->protocol >= 64)
+
+/* Codecs usable for compressed data (FileChunkMsg).  Since protocol 36 both
+   sides send a bitmask of (1 << codec) for the codecs they can decode right
+   after the protocol version, and every compressed block is tagged with the
+   codec used.  LZO is always available and used with older peers.  */
+enum CompressionCodec {
+    C_LZO = 0,
+    C_ZSTD = 1,
+    C_LZ4 = 2,
+    C_STORED = 3  // uncompressed, for links where compressing costs more than it saves
+};
+
+/* Priority classes of job requests (GetCSMsg, since protocol 41).  The
+   scheduler shares the farm between the submitters and weights their share
+   by the class, so interactive builds are not starved by batch builds.  */
+enum JobClass {
+    JC_INTERACTIVE = 0,
+    JC_CI = 1,
+    JC_BATCH = 2,
+    JC_COUNT
+};
+
+/* What a connection carries, see MsgChannel::setTrafficClass().  The
+   network and the queues of the hosts send the first ones ahead of bulk
+   transfers like environments, which may also be paced.  */
+enum TrafficClass {
+    TC_CONTROL,      // scheduler messages
+    TC_INTERACTIVE,  // compile jobs, their sources and results
+    TC_BULK          // environments
+};
 
 enum MsgType {
     // so far unknown
@@ -126,7 +188,61 @@ enum MsgType {
     M_VERIFY_ENV,
     M_VERIFY_ENV_RESULT,
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
-    M_BLACKLIST_HOST_ENV
+    M_BLACKLIST_HOST_ENV,
+    // generic file transfer, the data follows unframed and uncompressed
+    M_FILE_RAW,
+
+    // standby S --> S, first message sent
+    M_STANDBY_LOGIN,
+    // S --> standby S, the state that changed
+    M_STANDBY_STATE,
+
+    // S --> CS, to install an environment from another CS ahead of time
+    M_FETCH_ENV,
+    // CS --> CS, answered like a client upload, with M_TRANFER_ENV
+    M_GET_ENV,
+    // CS --> S, a client got a compile server granted to the CS ahead of time
+    M_USE_LEASE,
+    // CS --> its pre-forked job process, after a M_COMPILE_FILE
+    M_WORKER_JOB,
+
+    // C --> CS, after the preprocessed source
+    M_RESULT_KEY,
+    // CS --> CS, to the daemon owning the key of a job's result
+    M_GET_RESULT,
+    M_PUT_RESULT,
+    // S --> CS, the daemons that keep results
+    M_RESULT_OWNERS,
+
+    // C --> CS, the files a job not preprocessed yet includes
+    M_HEADER_MANIFEST,
+    // CS --> C, the ones of them the compile server doesn't have
+    M_HEADER_REQUEST,
+
+    // S --> CS, compile the benchmark
+    M_BENCHMARK,
+    // CS --> S
+    M_BENCHMARK_RESULT,
+
+    // S --> S, first message to the scheduler of another farm
+    M_FEDERATION_LOGIN,
+    // S --> S, the job slots a scheduler has free for other farms
+    M_FEDERATION_CAPACITY,
+
+    // CS --> C, a chunk of one of the outputs sent at once
+    M_OUTPUT_CHUNK,
+
+    // S --> CS, what a job waiting for a server is expected to take
+    M_JOB_WAIT,
+
+    // CS --> S, S --> CS, a zstd dictionary for the sources of an environment
+    M_COMPRESSION_DICT,
+
+    // C --> CS, the hashes of the chunks of a source
+    M_CHUNK_MANIFEST,
+
+    // S --> MON, the stats of all hosts at once
+    M_MON_SNAPSHOT
 };
 
 class MsgChannel;
@@ -134,6 +250,9 @@ class MsgChannel;
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
 
+// a hash of ENVS that doesn't depend on their order
+std::string environments_digest(const Environments &envs);
+
 class Msg
 {
 public:
@@ -147,13 +266,21 @@ public:
     enum MsgType type;
 };
 
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+struct AdaptiveCompression;
+
 class MsgChannel
 {
 public:
     enum SendFlags {
         SendBlocking = 1 << 0,
         SendNonBlocking = 1 << 1,
-        SendBulkOnly = 1 << 2
+        SendBulkOnly = 1 << 2,
+        // only queue the message, it is sent by flush() or the next send_msg()
+        SendQueued = 1 << 3
     };
 
     virtual ~MsgChannel();
@@ -167,6 +294,44 @@ public:
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
 
+    // sends the message (blocking) together with a duplicate of pass_fd,
+    // only over unix domain sockets; false <--> error
+    bool send_msg_fd(const Msg &, int pass_fd);
+    // the same with COUNT descriptors, at most 4
+    bool send_msg_fds(const Msg &, const int *pass_fds, size_t count);
+
+    // a file descriptor that was passed along with the messages read so far
+    // (see send_msg_fd()), the caller owns it; -1 if there is none
+    int take_fd();
+
+    // sends queued output, without blocking only as much as the socket
+    // takes right now; false <--> error
+    bool flush(bool blocking = true);
+
+    // bytes queued, but not written to the socket yet
+    size_t pending() const
+    {
+        return msgtogo;
+    }
+
+    // sends a FileRawMsg and then len bytes from file_fd's current offset,
+    // with sendfile() where available; false <--> error
+    bool send_raw_file(int file_fd, size_t len);
+
+    // bytes of raw data after a FileRawMsg that were not read yet, no
+    // other messages are available until they are
+    size_t raw_pending() const
+    {
+        return raw_togo;
+    }
+
+    // moves the raw data available right now to out_fd, with splice() if
+    // out_fd is a pipe; returns the number of bytes moved or -1 on error
+    ssize_t read_raw(int out_fd);
+
+    // like read_raw(int), but stores at most len bytes at buf
+    ssize_t read_raw(void *buf, size_t len);
+
     bool has_msg(void) const
     {
         return eof || instate == HAS_MSG;
@@ -174,6 +339,11 @@ public:
 
     bool read_a_bit(void);
 
+    // reads what the socket has into the input buffer, up to MAX bytes
+    // buffered, without taking messages; false once there is no more to
+    // read ahead: at MAX, at EOF or on an error
+    bool prefetch(size_t max);
+
     bool at_eof(void) const
     {
         return instate != HAS_MSG && eof;
@@ -184,6 +354,58 @@ public:
         return text_based;
     }
 
+    // the protocol version (and codecs) are negotiated
+    bool protocol_ready(void) const
+    {
+        return protocol > 0 && instate != NEED_PROTO && instate != NEED_COMPRESSION;
+    }
+
+    uint32_t remoteCodecs(void) const
+    {
+        return remote_codecs;
+    }
+
+    bool is_unix_socket(void) const
+    {
+        return addr && addr->sa_family == AF_UNIX;
+    }
+
+    // the kernel's smoothed round-trip time of the TCP connection in
+    // microseconds, 0 if it isn't known
+    uint32_t rtt_usec(void) const;
+    // marks the packets of the connection with the class, bulk traffic is
+    // paced to at most bytes_per_sec if that isn't 0
+    void setTrafficClass(TrafficClass tc, unsigned long bytes_per_sec = 0);
+
+    // the codec used for writecompressed(), falls back to LZO if the other side
+    // can't decode it; level is codec specific (0 means the default level)
+    void setCompression(CompressionCodec codec, int level = 0);
+    CompressionCodec compressionCodec() const;
+    // let writecompressed() pick the codec and level of each chunk from what
+    // compressing and sending the last ones cost on this connection, the
+    // default unless $ICECC_COMPRESSION names a codec
+    void setAdaptiveCompression();
+    // what writecompressed() used last, like "zstd:3" or "none"
+    std::string compressionMode() const;
+    // zstd chunks that were compressed with the dictionary can be read, and
+    // if write is set writecompressed() uses it for zstd; see
+    // CompressionDictMsg.  Does nothing without zstd.
+    void setCompressionDict(const std::string &dict, bool write = true);
+    // its ID, 0 if there is none
+    uint32_t compressionDictId() const
+    {
+        return dict_id;
+    }
+    const std::string &compressionDict() const
+    {
+        return compression_dict;
+    }
+
+    // buffers returned by readcompressed() come from a pool, give them back
+    // with release_chunk_buffer() instead of deleting them
+    static unsigned char *get_chunk_buffer(size_t len);
+    static void release_chunk_buffer(unsigned char *buf);
+
     void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
     void writecompressed(const unsigned char *in_buf,
                          size_t _in_len, size_t &_out_len);
@@ -191,6 +413,14 @@ public:
     void read_environments(Environments &envs);
     void read_line(std::string &line);
     void write_line(const std::string &line);
+    // binary data, which unlike strings may contain 0 bytes
+    void read_bytes(std::string &data);
+    void write_bytes(const std::string &data);
+
+    // the input read from the socket already, but not taken as messages,
+    // to continue the channel in another process with
+    // Service::adoptChannel(); false <--> that's impossible right now
+    bool unread_input(std::string &data) const;
 
     bool eq_ip(const MsgChannel &s) const;
 
@@ -215,14 +445,21 @@ protected:
     MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false);
 
     bool wait_for_protocol();
-    // returns false if there was an error sending something
-    bool flush_writebuf(bool blocking);
+    // returns false if there was an error sending something, unless
+    // would_block is given and the socket isn't ready for more data
+    bool flush_writebuf(bool blocking, bool *would_block = 0);
     void writefull(const void *_buf, size_t count);
     // returns false if there was an error in the protocol setup
     bool update_state(void);
     void chop_input(void);
     void chop_output(void);
     bool wait_for_msg(int timeout);
+    // read() that also collects passed file descriptors on unix sockets
+    ssize_t read_socket(void *buf, size_t count);
+    // the index into the adaptive modes, -1 if the fixed codec is used
+    int choose_compression(size_t len, CompressionCodec &used_codec, int &level);
+    // bytes per microsecond the connection carries, 0 if not known
+    double link_bytes_per_usec() const;
 
     char *msgbuf;
     size_t msgbuflen;
@@ -235,6 +472,7 @@ protected:
 
     enum {
         NEED_PROTO,
+        NEED_COMPRESSION,
         NEED_LEN,
         FILL_BUF,
         HAS_MSG
@@ -243,6 +481,31 @@ protected:
     uint32_t inmsglen;
     bool eof;
     bool text_based;
+    size_t raw_togo;
+
+    // bitmask of codecs the other side can decode
+    uint32_t remote_codecs;
+    CompressionCodec codec;
+    int codec_level;
+    bool adaptive_compression;
+    struct AdaptiveCompression *adaptive;
+    CompressionCodec last_codec;
+    int last_level;
+
+    // compression state, allocated on first use and kept with the channel
+    void *lzo_wrkmem;
+    struct ZSTD_CCtx_s *zstd_cctx;
+    struct ZSTD_DCtx_s *zstd_dctx;
+    void *lz4_state;
+    uint32_t dict_id;
+    bool dict_write;
+    std::string compression_dict;
+    // the dictionary digested for each compression level used
+    std::map<int, struct ZSTD_CDict_s *> zstd_cdicts;
+    struct ZSTD_DDict_s *zstd_ddict;
+
+    // file descriptors received with SCM_RIGHTS, see take_fd()
+    std::list<int> received_fds;
 
 private:
     friend class Service;
@@ -259,6 +522,22 @@ public:
     static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
     static MsgChannel *createChannel(const std::string &domain_socket);
     static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+    // like createChannel(host, p, timeout), but returns as soon as the
+    // connection is made, the protocol setup continues with read_a_bit()
+    // (see MsgChannel::protocol_ready())
+    static MsgChannel *connectChannel(const std::string &host, unsigned short p, int timeout);
+    // starts connecting to host:p without waiting for it, -1 on error; the
+    // socket becomes readable when the connection is made (the other side
+    // sends its protocol version right away) or failed
+    static int startConnect(const std::string &host, unsigned short p);
+    // the channel on a socket from startConnect() that became readable,
+    // 0 if connecting failed (the socket is closed then)
+    static MsgChannel *connectedChannel(int remote_fd);
+    // takes over a connected remote_fd on which somebody else already did
+    // the protocol setup, with the outcome given, and the input it read
+    // ahead (see MsgChannel::unread_input())
+    static MsgChannel *adoptChannel(int remote_fd, int protocol, uint32_t remote_codecs,
+                                    const std::string &unread = std::string());
 };
 
 // --------------------------------------------------------------------------
@@ -327,6 +606,11 @@ private:
     int best_version;
     time_t best_start_time;
     bool multiple;
+    // the scheduler chosen by the last broadcast, which is asked directly
+    // too and taken as soon as it answers
+    std::string cached_name;
+    unsigned int cached_port;
+    int cached_version;
 
     void attempt_scheduler_connect();
 };
@@ -357,12 +641,17 @@ public:
         : Msg(M_GET_CS)
         , count(1)
         , arg_flags(0)
-        , client_id(0) {}
+        , client_id(0)
+        , minimal_host_version(0)
+        , job_class(JC_INTERACTIVE)
+        , allow_duplicate(0)
+        , lease(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
              std::string _target, unsigned int _arg_flags,
-             const std::string &host, int _minimal_host_version)
+             const std::string &host, int _minimal_host_version,
+             unsigned int _job_class)
         : Msg(M_GET_CS)
         , versions(envs)
         , filename(f)
@@ -372,7 +661,10 @@ public:
         , arg_flags(_arg_flags)
         , client_id(0)
         , preferred_host(host)
-        , minimal_host_version(_minimal_host_version) {}
+        , minimal_host_version(_minimal_host_version)
+        , job_class(_job_class)
+        , allow_duplicate(0)
+        , lease(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -386,13 +678,24 @@ public:
     uint32_t client_id;
     std::string preferred_host;
     int minimal_host_version;
+    uint32_t job_class; // JobClass
+    // the client takes another UseCSMsg while its job is compiled, for a
+    // duplicate of a straggling job (protocol 46)
+    uint32_t allow_duplicate;
+    // asked for by the local daemon itself, for the next client asking for a
+    // compile server like this, see UseLeaseMsg (protocol 47)
+    uint32_t lease;
 };
 
 class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(M_USE_CS) {}
+        : Msg(M_USE_CS)
+        , env_from_peer(0)
+        , channel_protocol(0)
+        , channel_codecs(0)
+        , dict_id(0) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(M_USE_CS),
@@ -402,7 +705,11 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          env_from_peer(0),
+          channel_protocol(0),
+          channel_codecs(0),
+          dict_id(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -414,6 +721,18 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // without got_env: the compile server gets the environment from another
+    // one, the client only has to wait for it with VerifyEnvMsg (protocol 44)
+    uint32_t env_from_peer;
+    // if non-zero, the local daemon passes a connection to the compile server
+    // along with this message and has set it up with this protocol and
+    // codecs already, see Service::adoptChannel()
+    uint32_t channel_protocol;
+    uint32_t channel_codecs;
+    // the compression dictionary of the environment both daemons have, the
+    // local daemon passes it on in dict (protocol 62)
+    uint32_t dict_id;
+    std::string dict;
 };
 
 class GetNativeEnvMsg : public Msg
@@ -455,6 +774,13 @@ class CompileFileMsg : public Msg
 public:
     CompileFileMsg(CompileJob *j, bool delete_job = false)
         : Msg(M_COMPILE_FILE)
+        , raw_output(false)
+        , stream_output(false)
+        , remote_cpp(false)
+        , pch(false)
+        , interleaved_output(false)
+        , dict_id(0)
+        , chunked(false)
         , deleteit(delete_job)
         , job(j) {}
 
@@ -469,6 +795,28 @@ public:
     virtual void send_to_channel(MsgChannel *c) const;
     CompileJob *takeJob();
 
+    // send the object files back uncompressed with FileRawMsg (protocol 38)
+    bool raw_output;
+    // the client takes FileChunkMsgs of the object file already while it is
+    // compiled, before CompileResultMsg, which is then followed by just
+    // EndMsg if it succeeded (protocol 49)
+    bool stream_output;
+    // the source isn't preprocessed, HeaderManifestMsg follows and the
+    // compile server preprocesses it (protocol 51)
+    bool remote_cpp;
+    // the job uses a precompiled header, which comes first as the one file
+    // of a HeaderManifestMsg (protocol 52)
+    bool pch;
+    // send the object file and the .dwo file at once as OutputChunkMsgs
+    // rather than one after the other (protocol 58)
+    bool interleaved_output;
+    // the FileChunkMsgs are compressed with this dictionary of the
+    // environment, see CompressionDictMsg (protocol 62)
+    uint32_t dict_id;
+    // the preprocessed source comes as ChunkManifestMsg and the chunks the
+    // compile server doesn't have (protocol 63)
+    bool chunked;
+
 private:
     std::string remote_compiler_name() const;
 
@@ -506,6 +854,53 @@ private:
     FileChunkMsg &operator=(const FileChunkMsg &);
 };
 
+/* The outputs of a job come as these interleaved, tagged with the file,
+   see CompileFileMsg::interleaved_output.  An empty one ends its file.  */
+class OutputChunkMsg : public FileChunkMsg
+{
+public:
+    enum OutputFile {
+        OBJECT_FILE,
+        DWO_FILE,
+        OUTPUT_FILES
+    };
+
+    OutputChunkMsg(uint32_t _file, unsigned char *_buffer, size_t _len)
+        : FileChunkMsg(_buffer, _len)
+        , file(_file)
+    {
+        type = M_OUTPUT_CHUNK;
+    }
+
+    OutputChunkMsg()
+        : file(OBJECT_FILE)
+    {
+        type = M_OUTPUT_CHUNK;
+    }
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t file;
+};
+
+/* Announces len bytes of raw file data directly following this message on
+   the channel, see MsgChannel::send_raw_file() and read_raw().  Used for data
+   that is compressed already, like environment tarballs, or that is cheaper
+   to send than to compress on fast links, see CompileFileMsg::raw_output.  */
+class FileRawMsg : public Msg
+{
+public:
+    FileRawMsg(uint64_t _len = 0)
+        : Msg(M_FILE_RAW)
+        , len(_len) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint64_t len;
+};
+
 class CompileResultMsg : public Msg
 {
 public:
@@ -544,7 +939,9 @@ public:
 };
 
 enum SpecialExits {
-    CLIENT_WAS_WAITING_FOR_CS = 200
+    CLIENT_WAS_WAITING_FOR_CS = 200,
+    // a compile server granted ahead of time that no client needed
+    LEASE_RETURNED = 201
 };
 
 class JobDoneMsg : public Msg
@@ -578,6 +975,7 @@ public:
     uint32_t user_msec; /* user time used */
     uint32_t sys_msec; /* system time used */
     uint32_t pfaults; /* page faults */
+    uint32_t max_rss; /* peak memory of the compiler in KiB, since protocol 55 */
 
     int exitcode; /* exit code */
 
@@ -627,7 +1025,9 @@ public:
     LoginMsg(unsigned int myport, const std::string &_nodename, const std::string _host_platform);
     LoginMsg()
         : Msg(M_LOGIN)
-        , port(0) {}
+        , port(0)
+        , max_local_jobs(0)
+        , result_cache(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -635,10 +1035,20 @@ public:
     uint32_t port;
     Environments envs;
     uint32_t max_kids;
+    // slots for local jobs that don't compile (linking, icerun), which the
+    // daemon runs besides the max_kids compile jobs; 0 if they share them
+    // (since protocol 48)
+    uint32_t max_local_jobs;
     bool noremote;
     bool chroot_possible;
     std::string nodename;
     std::string host_platform;
+    // the daemon keeps results of other daemons' jobs (since protocol 50)
+    uint32_t result_cache;
+    /* environments_digest() of the environments.  A daemon logging in again
+       with the environments it had leaves envs empty, the scheduler knows
+       them by the digest or asks for them (since protocol 56).  */
+    std::string env_digest;
 };
 
 class ConfCSMsg : public Msg
@@ -647,15 +1057,50 @@ public:
     ConfCSMsg()
         : Msg(M_CS_CONF)
         , max_scheduler_pong(MAX_SCHEDULER_PONG)
-        , max_scheduler_ping(MAX_SCHEDULER_PING) {}
+        , max_scheduler_ping(MAX_SCHEDULER_PING)
+        , need_environments(false) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
 
     uint32_t max_scheduler_pong;
     uint32_t max_scheduler_ping;
+    // the env_digest of the login was unknown, the daemon sends its
+    // environments again (since protocol 56)
+    bool need_environments;
+};
+
+/* The network between a compile server and a peer that sent it jobs.
+   The throughput is in preprocessed (uncompressed) bytes, so it includes
+   what the compression gains on that link.  */
+struct PeerLink {
+    PeerLink()
+        : rtt_usec(0)
+        , bytes_per_sec(0) {}
+
+    std::string peer; // IP address
+    uint32_t rtt_usec;
+    uint32_t bytes_per_sec; // 0 if not measured
 };
 
+/* The phases of the jobs on a compile server, whose durations daemons
+   report in StatsMsg.  Each phase has PHASE_VALUES values there, counts of
+   the durations in milliseconds up to each of job_phase_bucket_msec and
+   above all of them, followed by the sum of the milliseconds.  */
+enum JobPhase {
+    PHASE_SETUP,    // until the compiler starts
+    PHASE_INPUT,    // receiving the input
+    PHASE_COMPILE,  // the compiler running after that
+    PHASE_OUTPUT,   // sending the result
+    PHASE_COUNT
+};
+
+#define PHASE_BUCKETS 10
+#define PHASE_VALUES (PHASE_BUCKETS + 1)
+
+extern const uint32_t job_phase_bucket_msec[PHASE_BUCKETS - 1];
+extern const char *const job_phase_names[PHASE_COUNT];
+
 class StatsMsg : public Msg
 {
 public:
@@ -683,6 +1128,14 @@ public:
     uint32_t loadAvg5;
     uint32_t loadAvg10;
     uint32_t freeMem;
+
+    /* What the daemon measured on the connections of the peers that sent
+       it jobs since the last report (since protocol 42).  */
+    std::list<PeerLink> links;
+
+    /* PHASE_COUNT * PHASE_VALUES values for the jobs since the last report,
+       or none (since protocol 53).  */
+    std::vector<uint32_t> phases;
 };
 
 class EnvTransferMsg : public Msg
@@ -691,9 +1144,63 @@ public:
     EnvTransferMsg()
         : Msg(M_TRANFER_ENV) {}
 
-    EnvTransferMsg(const std::string &_target, const std::string &_name)
+    EnvTransferMsg(const std::string &_target, const std::string &_name,
+                   const std::string &_hash = std::string())
         : Msg(M_TRANFER_ENV)
         , name(_name)
+        , target(_target)
+        , hash(_hash) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    // what the installed environment hashes to, if sent by another daemon
+    // (since protocol 44)
+    std::string hash;
+};
+
+/* Makes the daemon get an environment from the daemon at hostname:port,
+   which has it installed.  The daemon logs in again when it is done, or
+   right away if it doesn't want it.  */
+class FetchEnvMsg : public Msg
+{
+public:
+    FetchEnvMsg()
+        : Msg(M_FETCH_ENV)
+        , port(0)
+        , job_id(0) {}
+
+    FetchEnvMsg(const std::string &_target, const std::string &_name,
+                const std::string &_hostname, unsigned int _port, unsigned int _job_id = 0)
+        : Msg(M_FETCH_ENV)
+        , name(_name)
+        , target(_target)
+        , hostname(_hostname)
+        , port(_port)
+        , job_id(_job_id) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    std::string hostname;
+    uint32_t port;
+    // the job that needs it, 0 if it's fetched ahead of time (since protocol 44)
+    uint32_t job_id;
+};
+
+class GetEnvMsg : public Msg
+{
+public:
+    GetEnvMsg()
+        : Msg(M_GET_ENV) {}
+
+    GetEnvMsg(const std::string &_target, const std::string &_name)
+        : Msg(M_GET_ENV)
+        , name(_name)
         , target(_target) {}
 
     virtual void fill_from_channel(MsgChannel *c);
@@ -703,6 +1210,322 @@ public:
     std::string target;
 };
 
+/* A job the scheduler gave a compile server for with GetCSMsg::lease
+   is for this client and file after all.  */
+class UseLeaseMsg : public Msg
+{
+public:
+    UseLeaseMsg()
+        : Msg(M_USE_LEASE)
+        , job_id(0)
+        , client_id(0)
+        , lang(CompileJob::Lang_C)
+        , arg_flags(0) {}
+
+    UseLeaseMsg(unsigned int _job_id, unsigned int _client_id, const GetCSMsg &request)
+        : Msg(M_USE_LEASE)
+        , job_id(_job_id)
+        , client_id(_client_id)
+        , filename(request.filename)
+        , lang(request.lang)
+        , arg_flags(request.arg_flags) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t job_id;
+    uint32_t client_id;
+    std::string filename;
+    CompileJob::Language lang;
+    uint32_t arg_flags;
+};
+
+/* The connection of the compile job that the CompileFileMsg before this
+   was for, passed along with it: the channel to the client and the pipe the
+   results go to the daemon by, see MsgChannel::send_msg_fds().  */
+class WorkerJobMsg : public Msg
+{
+public:
+    WorkerJobMsg()
+        : Msg(M_WORKER_JOB)
+        , protocol(0)
+        , remote_codecs(0)
+        , mem_limit(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // of the client channel, for Service::adoptChannel()
+    uint32_t protocol;
+    uint32_t remote_codecs;
+    std::string unread;
+    uint32_t mem_limit;
+    // see ResultRing
+    std::list<std::string> result_owners;
+    // see MsgChannel::compressionDict()
+    std::string dict;
+};
+
+/* The key of the job's result (see ResultKey), which the compile server
+   looks up with the daemon owning it before compiling the job further.  */
+class ResultKeyMsg : public Msg
+{
+public:
+    ResultKeyMsg(const std::string &_key = std::string())
+        : Msg(M_RESULT_KEY)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+/* Answered with a CompileResultMsg and the files like from a compile
+   server, or just EndMsg if the result isn't stored.  */
+class GetResultMsg : public Msg
+{
+public:
+    GetResultMsg(const std::string &_key = std::string())
+        : Msg(M_GET_RESULT)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+/* Followed by the CompileResultMsg and files of a successful job, like a
+   compile server sends them, for the daemon to store.  */
+class PutResultMsg : public Msg
+{
+public:
+    PutResultMsg(const std::string &_key = std::string())
+        : Msg(M_PUT_RESULT)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+/* The daemons that keep results, as "host:port", see ResultRing.  */
+class ResultOwnersMsg : public Msg
+{
+public:
+    ResultOwnersMsg()
+        : Msg(M_RESULT_OWNERS) {}
+
+    ResultOwnersMsg(const std::list<std::string> &_owners)
+        : Msg(M_RESULT_OWNERS)
+        , owners(_owners) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<std::string> owners;
+};
+
+/* The source of a job with CompileFileMsg::remote_cpp and the files it may
+   include, by their absolute path on the client and the MD5 of their
+   contents.  The source comes first.  The compile server answers with
+   HeaderRequestMsg, gets the files it asked for as FileChunkMsgs ending in
+   EndMsg each, and then compiles with the files where they are on the
+   client.  For CompileFileMsg::pch it carries just the precompiled header,
+   the same way.  A ThinLTO backend job sends its bitcode, the index and the
+   modules the index imports from like this, with just -fthinlto-index= as
+   cpp_flags (protocol 59), and a command of icerun the files it reads, with
+   no cpp_flags (protocol 60).  */
+class HeaderManifestMsg : public Msg
+{
+public:
+    HeaderManifestMsg()
+        : Msg(M_HEADER_MANIFEST) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // the flags the client would have preprocessed with (Arg_Local)
+    std::list<std::string> cpp_flags;
+    // the compiler's own include directories, searched after the others
+    std::list<std::string> system_dirs;
+    std::list<std::string> files;
+    std::list<std::string> hashes;
+};
+
+/* The hashes of the files in HeaderManifestMsg to send, in the order they
+   are to be sent.  */
+class HeaderRequestMsg : public Msg
+{
+public:
+    HeaderRequestMsg()
+        : Msg(M_HEADER_REQUEST) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<std::string> hashes;
+};
+
+/* Has an idle daemon compile the benchmark it ships in one of its
+   environments, answered with BenchmarkResultMsg (since protocol 54).  */
+class BenchmarkMsg : public Msg
+{
+public:
+    BenchmarkMsg()
+        : Msg(M_BENCHMARK) {}
+
+    BenchmarkMsg(const std::string &_target, const std::string &_environment)
+        : Msg(M_BENCHMARK)
+        , target(_target)
+        , environment(_environment) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string target;
+    std::string environment;
+};
+
+/* How compiling the benchmark went.  The same environment has to produce
+   the same object file everywhere, HASH is its MD5.  */
+class BenchmarkResultMsg : public Msg
+{
+public:
+    BenchmarkResultMsg()
+        : Msg(M_BENCHMARK_RESULT)
+        , status(0)
+        , real_msec(0)
+        , user_msec(0)
+        , out_size(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string target;
+    std::string environment;
+    uint32_t status;  // of the compiler, or an EXIT_* if it didn't run
+    uint32_t real_msec;
+    uint32_t user_msec;
+    uint32_t out_size;
+    std::string hash;
+};
+
+/* Federated schedulers (since protocol 57) tell each other their free job
+   slots with FederationCapacityMsg.  A job that finds no server in its own
+   farm is sent to another one as a GetCSMsg with the client_id set to its
+   job id there, and answered at once with a UseCSMsg with the same
+   client_id, one with an empty hostname if there is no server for it after
+   all.  JobDoneMsg of such jobs go to the other scheduler as well.  */
+class FederationLoginMsg : public Msg
+{
+public:
+    FederationLoginMsg()
+        : Msg(M_FEDERATION_LOGIN) {}
+
+    FederationLoginMsg(const std::string &_netname)
+        : Msg(M_FEDERATION_LOGIN)
+        , netname(_netname) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string netname;
+};
+
+/* The free slots of the servers that have each of the environments, with
+   an empty version for the servers of a platform that may install one.
+   Empty while the scheduler's own jobs are waiting.  */
+class FederationCapacityMsg : public Msg
+{
+public:
+    FederationCapacityMsg()
+        : Msg(M_FEDERATION_CAPACITY) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    Environments envs;
+    std::list<uint32_t> slots; // one per environment
+};
+
+/* While the farm is busy, the scheduler tells the daemon of a job waiting
+   for a server (since protocol 61) how long the job is expected to take,
+   the wait in the queue included, and how long it would take on the
+   submitter.  The daemon may cancel the request like one of a client that
+   went away and compile the job itself.  */
+class JobWaitMsg : public Msg
+{
+public:
+    JobWaitMsg()
+        : Msg(M_JOB_WAIT)
+        , client_id(0)
+        , remote_msec(0)
+        , local_msec(0) {}
+
+    JobWaitMsg(uint32_t _client_id, uint32_t _remote_msec, uint32_t _local_msec)
+        : Msg(M_JOB_WAIT)
+        , client_id(_client_id)
+        , remote_msec(_remote_msec)
+        , local_msec(_local_msec) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t client_id;
+    uint32_t remote_msec;
+    uint32_t local_msec;
+};
+
+/* A compile server that trained a zstd dictionary on the sources of an
+   environment sends it to the scheduler, which hands the first one it got
+   to the daemons of jobs in that environment (since protocol 62).  Clients
+   compress their sources with it, see UseCSMsg::dict_id.  */
+class CompressionDictMsg : public Msg
+{
+public:
+    CompressionDictMsg()
+        : Msg(M_COMPRESSION_DICT)
+        , id(0) {}
+
+    CompressionDictMsg(const std::string &_target, const std::string &_version, uint32_t _id,
+                       const std::string &_data)
+        : Msg(M_COMPRESSION_DICT)
+        , target(_target)
+        , version(_version)
+        , id(_id)
+        , data(_data) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string target;
+    std::string version;
+    // the zstd dictionary ID
+    uint32_t id;
+    std::string data;
+};
+
+/* The preprocessed source of a job with CompileFileMsg::chunked, split
+   into chunks where its contents say so, by the MD5 of each.  The compile
+   server keeps the chunks with the files of HeaderManifestMsg and answers
+   with HeaderRequestMsg the same way, the chunks it asked for come as
+   FileChunkMsgs ending in EndMsg each (since protocol 63).  */
+class ChunkManifestMsg : public Msg
+{
+public:
+    ChunkManifestMsg()
+        : Msg(M_CHUNK_MANIFEST) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // in the order they make up the source
+    std::list<std::string> hashes;
+};
+
 class GetInternalStatus : public Msg
 {
 public:
@@ -716,8 +1539,19 @@ public:
 class MonLoginMsg : public Msg
 {
 public:
-    MonLoginMsg()
-        : Msg(M_MON_LOGIN) {}
+    MonLoginMsg(uint32_t _batch_msec = 0, bool _snapshot = false)
+        : Msg(M_MON_LOGIN)
+        , batch_msec(_batch_msec)
+        , snapshot(_snapshot) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    /* If not 0, the monitor gets what happened in this interval together,
+       and MonStatsMsg only with the lines that changed (protocol 45).  */
+    uint32_t batch_msec;
+    // the hosts come as MonSnapshotMsg instead of a MonStatsMsg each (protocol 64)
+    bool snapshot;
 };
 
 class MonGetCSMsg : public GetCSMsg
@@ -731,7 +1565,8 @@ public:
     }
 
     MonGetCSMsg(int jobid, int hostid, GetCSMsg *m)
-        : GetCSMsg(Environments(), m->filename, m->lang, 1, m->target, 0, std::string(), false)
+        : GetCSMsg(Environments(), m->filename, m->lang, 1, m->target, 0, std::string(), false,
+                   JC_INTERACTIVE)
         , job_id(jobid)
         , clientid(hostid)
     {
@@ -824,6 +1659,59 @@ public:
     std::string statmsg;
 };
 
+/* The stats of all hosts the scheduler knows, what a monitor that logged
+   in with MonLoginMsg::snapshot gets first instead of a MonStatsMsg for
+   each.  What changes afterwards comes as usual.  The scheduler builds it
+   once for all monitors logging in until something changes, so the data
+   is kept compressed with LZO, which every build has (protocol 64).  */
+class MonSnapshotMsg : public Msg
+{
+public:
+    MonSnapshotMsg()
+        : Msg(M_MON_SNAPSHOT)
+        , version(0)
+        , size(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // host id -> the lines of MonStatsMsg::statmsg; false if it doesn't fit a message
+    bool setHosts(const std::map<uint32_t, std::string> &hosts);
+    // false if the data is broken
+    bool hosts(std::map<uint32_t, std::string> &hosts) const;
+
+    // grows with every change of the stats, a monitor can tell snapshots apart
+    uint32_t version;
+    // of the data uncompressed
+    uint32_t size;
+    std::string data;
+};
+
+class StandbyLoginMsg : public Msg
+{
+public:
+    StandbyLoginMsg()
+        : Msg(M_STANDBY_LOGIN) {}
+};
+
+/* Lines in the format of the scheduler's statistics file, see
+   scheduler/statsfile.h, and about the jobs.  */
+class StandbyStateMsg : public Msg
+{
+public:
+    StandbyStateMsg()
+        : Msg(M_STANDBY_STATE) {}
+
+    StandbyStateMsg(const std::string &_lines)
+        : Msg(M_STANDBY_STATE)
+        , lines(_lines) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string lines;
+};
+
 class TextMsg : public Msg
 {
 public:
@@ -150,6 +150,30 @@ public:
         return m_dwarf_fission;
     }
 
+    // the index of a ThinLTO backend job (-fthinlto-index=), only known
+    // to the client
+    void setThinLTOIndex(const std::string &file)
+    {
+        m_thinlto_index = file;
+    }
+
+    std::string thinLTOIndex() const
+    {
+        return m_thinlto_index;
+    }
+
+    // the files a command of icerun (Lang_Custom) writes, relative to the
+    // working directory; set for the ones run remotely
+    void setCommandOutputs(const std::list<std::string> &files)
+    {
+        m_command_outputs = files;
+    }
+
+    std::list<std::string> commandOutputs() const
+    {
+        return m_command_outputs;
+    }
+
     void setWorkingDirectory(const std::string& dir)
     {
         m_working_directory = dir;
@@ -198,6 +222,8 @@ private:
     std::string m_input_file, m_output_file;
     std::string m_working_directory;
     std::string m_target_platform;
+    std::string m_thinlto_index;
+    std::list<std::string> m_command_outputs;
     bool m_dwarf_fission;
 };
 
@@ -25,6 +25,12 @@
 #include "logging.h"
 #include <fstream>
 #include <signal.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #ifdef __linux__
 #include <dlfcn.h>
 #endif
@@ -37,15 +43,343 @@ ostream *logfile_info = 0;
 ostream *logfile_warning = 0;
 ostream *logfile_error = 0;
 string logfile_prefix;
+int trace_fd = -1;
+unsigned int trace_job_id = 0;
 
-static ofstream logfile_null("/dev/null");
+// without a buffer it is bad, and nothing written to it is even formatted
+static ostream logfile_null(0);
 static ofstream logfile_file;
 static string logfile_filename;
 
 void reset_debug(int);
 
+/* The asynchronous log: every thread writes its lines into a ring of its
+   own, which only the writer thread takes them from, so neither waits
+   for the other.  A line that doesn't fit is dropped.  */
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_LINE_SIZE 1024
+
+struct LogRing {
+    char buffer[LOG_RING_SIZE];
+    unsigned long head; // moved by the thread logging
+    unsigned long tail; // moved by the writer
+    LogRing *next;
+};
+
+static LogRing *log_rings = 0;
+static __thread LogRing *thread_ring = 0;
+static __thread char thread_line[LOG_LINE_SIZE];
+static __thread size_t thread_line_len = 0;
+static unsigned long log_dropped = 0;
+
+static bool async_logging = false;
+static bool async_stop = false;
+static volatile sig_atomic_t async_reopen = 0;
+static unsigned long async_rate_limit = 0;
+static int async_fd = -1;
+static pthread_t async_writer;
+
+static void ring_push(const char *data, size_t len)
+{
+    LogRing *ring = thread_ring;
+
+    if (!ring) {
+        ring = thread_ring = new LogRing;
+        ring->head = ring->tail = 0;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        }
+    }
+
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (LOG_RING_SIZE - (head - tail) < len) {
+        __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t pos = head % LOG_RING_SIZE;
+    size_t first = min(len, (size_t) LOG_RING_SIZE - pos);
+    memcpy(ring->buffer + pos, data, first);
+    memcpy(ring->buffer, data + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+static size_t ring_take(LogRing *ring, char *data, size_t max)
+{
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+    size_t len = min(max, (size_t)(head - tail));
+    size_t pos = tail % LOG_RING_SIZE;
+    size_t first = min(len, (size_t) LOG_RING_SIZE - pos);
+    memcpy(data, ring->buffer + pos, first);
+    memcpy(data + first, ring->buffer, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Collects the pieces of a line to put it into the ring at once.  */
+class AsyncLogBuf : public streambuf
+{
+protected:
+    virtual int overflow(int c)
+    {
+        if (c != EOF) {
+            char ch = c;
+            xsputn(&ch, 1);
+        }
+
+        return 0;
+    }
+
+    virtual streamsize xsputn(const char *data, streamsize len)
+    {
+        for (streamsize i = 0; i < len; ++i) {
+            thread_line[thread_line_len++] = data[i];
+
+            if (data[i] == '\n' || thread_line_len == LOG_LINE_SIZE) {
+                ring_push(thread_line, thread_line_len);
+                thread_line_len = 0;
+            }
+        }
+
+        return len;
+    }
+};
+
+// never written to, the threads write to their own streams
+ostream async_log(0);
+static __thread ostream *thread_stream = 0;
+
+ostream &thread_log_stream()
+{
+    if (!thread_stream) {
+        thread_stream = new ostream(new AsyncLogBuf);
+    }
+
+    return *thread_stream;
+}
+
+static void open_async_fd()
+{
+    int fd = logfile_filename.empty() ? dup(STDERR_FILENO)
+             : open(logfile_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+    if (fd >= 0) {
+        if (async_fd >= 0) {
+            close(async_fd);
+        }
+
+        async_fd = fd;
+    }
+}
+
+static void write_all(const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(async_fd, data, len);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+}
+
+static void *async_write_log(void *)
+{
+    char buffer[65536];
+    time_t second = 0;
+    unsigned long written = 0;
+    unsigned long dropped = 0;
+
+    while (true) {
+        bool stop = __atomic_load_n(&async_stop, __ATOMIC_ACQUIRE);
+
+        if (async_reopen) {
+            async_reopen = 0;
+            open_async_fd();
+        }
+
+        time_t now = time(0);
+
+        if (now != second) {
+            second = now;
+            written = 0;
+        }
+
+        size_t total = 0;
+
+        for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+            size_t budget = sizeof(buffer);
+
+            // what is left at the end is written regardless
+            if (async_rate_limit && !stop) {
+                budget = min(budget, (size_t)(written < async_rate_limit ? async_rate_limit - written : 0));
+            }
+
+            size_t len = ring_take(ring, buffer, budget);
+            write_all(buffer, len);
+            written += len;
+            total += len;
+        }
+
+        unsigned long now_dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+
+        if (now_dropped != dropped) {
+            int len = snprintf(buffer, sizeof(buffer), "[%d] %lu log messages were dropped\n",
+                               (int) getpid(), now_dropped - dropped);
+            write_all(buffer, len);
+            dropped = now_dropped;
+        }
+
+        if (!total) {
+            if (stop) {
+                break;
+            }
+
+            struct timespec pause = { 0, 20 * 1000 * 1000 };
+            nanosleep(&pause, 0);
+        }
+    }
+
+    return 0;
+}
+
+/* Waits a while for what was logged to be written.  */
+static void async_flush()
+{
+    for (int i = 0; i < 1000; ++i) {
+        bool empty = true;
+
+        for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+            if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                empty = false;
+            }
+        }
+
+        if (empty) {
+            return;
+        }
+
+        struct timespec pause = { 0, 2 * 1000 * 1000 };
+        nanosleep(&pause, 0);
+    }
+}
+
+static void stop_async_logging()
+{
+    if (!async_logging) {
+        return;
+    }
+
+    __atomic_store_n(&async_stop, true, __ATOMIC_RELEASE);
+    pthread_join(async_writer, 0);
+    async_logging = false;
+    async_stop = false;
+    close(async_fd);
+    async_fd = -1;
+}
+
+/* The writer thread isn't there in a forked child, it logs like before.  */
+static void async_logging_child()
+{
+    if (!async_logging) {
+        return;
+    }
+
+    async_logging = false;
+    close(async_fd);
+    async_fd = -1;
+    log_rings = 0;
+    thread_ring = 0;
+    thread_line_len = 0;
+    setup_debug(debug_level, logfile_filename, logfile_prefix);
+}
+
+bool start_async_logging(unsigned long rate_limit)
+{
+    static bool registered = false;
+
+    if (async_logging) {
+        return true;
+    }
+
+    open_async_fd();
+
+    if (async_fd < 0) {
+        return false;
+    }
+
+    flush_debug();
+    async_rate_limit = rate_limit;
+
+    if (pthread_create(&async_writer, 0, async_write_log, 0) != 0) {
+        close(async_fd);
+        async_fd = -1;
+        return false;
+    }
+
+    if (!registered) {
+        pthread_atfork(0, 0, async_logging_child);
+        atexit(stop_async_logging);
+        registered = true;
+    }
+
+    async_logging = true;
+    ostream **streams[] = { &logfile_trace, &logfile_info, &logfile_warning, &logfile_error };
+
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); ++i) {
+        if (*streams[i] && *streams[i] != &logfile_null) {
+            *streams[i] = &async_log;
+        }
+    }
+
+    return true;
+}
+
+/* Opens $ICECC_TRACE_FILE once, before a daemon's job processes lose
+   the view of the file system.  A new file starts the JSON array, whose
+   end is optional in the format, so processes only ever append.  */
+static void open_trace_file()
+{
+    const char *file = getenv("ICECC_TRACE_FILE");
+
+    if (trace_fd >= 0 || !file || !*file) {
+        return;
+    }
+
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+
+    if (trace_fd < 0) {
+        return;
+    }
+
+    struct stat st;
+
+    if (flock(trace_fd, LOCK_EX) == 0) {
+        if (fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+            ssize_t ret = write(trace_fd, "[\n", 2);
+            (void) ret;
+        }
+
+        flock(trace_fd, LOCK_UN);
+    }
+}
+
 void setup_debug(int level, const string &filename, const string &prefix)
 {
+    open_trace_file();
+
     string fname = filename;
     debug_level = level;
     logfile_prefix = prefix;
@@ -111,14 +445,18 @@ void setup_debug(int level, const string &filename, const string &prefix)
 
 void reset_debug(int)
 {
+    // the writer thread opens the file again
+    if (async_logging) {
+        async_reopen = 1;
+        return;
+    }
+
     setup_debug(debug_level, logfile_filename);
 }
 
 void close_debug()
 {
-    if (logfile_null.is_open()) {
-        logfile_null.close();
-    }
+    stop_async_logging();
 
     if (logfile_file.is_open()) {
         logfile_file.close();
@@ -131,8 +469,8 @@ void close_debug()
    this before forking.  */
 void flush_debug()
 {
-    if (logfile_null.is_open()) {
-        logfile_null.flush();
+    if (async_logging) {
+        async_flush();
     }
 
     if (logfile_file.is_open()) {
@@ -141,3 +479,38 @@ void flush_debug()
 }
 
 unsigned log_block::nesting;
+
+/* A complete event, written at once to not get mixed up with those of
+   other processes.  */
+void trace_span(const char *name, const timeval &start, const timeval &end, unsigned int job_id)
+{
+    if (trace_fd < 0) {
+        return;
+    }
+
+    string label;
+
+    for (const char *p = name; *p; ++p) {
+        if (*p == '"' || *p == '\\') {
+            label += '\\';
+        }
+
+        if ((unsigned char)*p >= ' ') {
+            label += *p;
+        }
+    }
+
+    long long ts = start.tv_sec * 1000000LL + start.tv_usec;
+    long long dur = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_usec - start.tv_usec);
+    char event[512];
+    int len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{\"job\":%u}},\n",
+                       label.c_str(), logfile_prefix.empty() ? "daemon" : "client", ts, dur,
+                       (int) getpid(), (int) getpid(), job_id);
+
+    if (len > 0 && len < (int) sizeof(event)) {
+        ssize_t ret = write(trace_fd, event, len);
+        (void) ret;
+    }
+}
@@ -39,23 +39,52 @@ enum DebugLevels {
     Debug = 8
 };
 
+extern int debug_level;
 extern std::ostream *logfile_info;
 extern std::ostream *logfile_warning;
 extern std::ostream *logfile_error;
 extern std::ostream *logfile_trace;
 extern std::string logfile_prefix;
 
+/* With $ICECC_TRACE_FILE set, setup_debug() opens it for appending spans
+   of the work of the job in TRACE_JOB_ID as Chrome trace events, which
+   chrome://tracing and Perfetto load.  Every log_block is such a span.  */
+extern int trace_fd;
+extern unsigned int trace_job_id;
+
 void setup_debug(int level, const std::string &logfile = "", const std::string &prefix = "");
 void reset_debug(int);
 void close_debug();
 void flush_debug();
 
+/* From then on the log is written by a thread of its own, at most
+   RATE_LIMIT bytes a second if not 0, and what doesn't fit in its
+   buffers is dropped and counted.  */
+bool start_async_logging(unsigned long rate_limit);
+
+/* Once it has started, the streams above are all async_log, which stands
+   for the stream of the thread logging, as one stream isn't for several
+   threads at a time.  */
+extern std::ostream async_log;
+std::ostream &thread_log_stream();
+
+static inline std::ostream &log_stream(std::ostream *os)
+{
+    return os == &async_log ? thread_log_stream() : *os;
+}
+
+/* To not even build a message that wouldn't be written.  */
+static inline bool log_enabled(int level)
+{
+    return debug_level & level;
+}
+
 static inline std::ostream &output_date(std::ostream &os)
 {
     time_t t = time(0);
-    struct tm *tmp = localtime(&t);
+    struct tm tmp;
     char buf[64];
-    strftime(buf, sizeof(buf), "%T: ", tmp);
+    strftime(buf, sizeof(buf), "%T: ", localtime_r(&t, &tmp));
 
     if (logfile_prefix.size()) {
         os << logfile_prefix;
@@ -73,7 +102,11 @@ static inline std::ostream &log_info()
         return std::cerr;
     }
 
-    return output_date(*logfile_info);
+    if (!log_enabled(Info)) {
+        return log_stream(logfile_info);
+    }
+
+    return output_date(log_stream(logfile_info));
 }
 
 static inline std::ostream &log_warning()
@@ -82,7 +115,11 @@ static inline std::ostream &log_warning()
         return std::cerr;
     }
 
-    return output_date(*logfile_warning);
+    if (!log_enabled(Warning)) {
+        return log_stream(logfile_warning);
+    }
+
+    return output_date(log_stream(logfile_warning));
 }
 
 
@@ -92,7 +129,11 @@ static inline std::ostream &log_error()
         return std::cerr;
     }
 
-    return output_date(*logfile_error);
+    if (!log_enabled(Error)) {
+        return log_stream(logfile_error);
+    }
+
+    return output_date(log_stream(logfile_error));
 }
 
 static inline std::ostream &trace()
@@ -101,7 +142,11 @@ static inline std::ostream &trace()
         return std::cerr;
     }
 
-    return output_date(*logfile_trace);
+    if (!log_enabled(Debug)) {
+        return log_stream(logfile_trace);
+    }
+
+    return output_date(log_stream(logfile_trace));
 }
 
 static inline void log_errno(const char *prefix, int tmp_errno)
@@ -114,6 +159,8 @@ static inline void log_perror(const char *prefix)
     log_errno(prefix, errno);
 }
 
+void trace_span(const char *name, const timeval &start, const timeval &end, unsigned int job_id);
+
 class log_block
 {
     static unsigned nesting;
@@ -123,6 +170,7 @@ class log_block
 public:
     log_block(const char *label = 0)
     {
+        m_label = 0;
 #ifndef NDEBUG
 
         for (unsigned i = 0; i < nesting; ++i) {
@@ -131,18 +179,32 @@ public:
 
         log_info() << "<" << (label ? label : "") << ">\n";
 
-        m_label = strdup(label ? label : "");
         ++nesting;
-        gettimeofday(&m_start, 0);
+#else
+
+        if (trace_fd < 0) {
+            return;
+        }
+
 #endif
+        m_label = strdup(label ? label : "");
+        gettimeofday(&m_start, 0);
     }
 
     ~log_block()
     {
-#ifndef NDEBUG
+        if (!m_label) {
+            return;
+        }
+
         timeval end;
         gettimeofday(&end, 0);
 
+        if (trace_fd >= 0) {
+            trace_span(m_label, m_start, end, trace_job_id);
+        }
+
+#ifndef NDEBUG
         --nesting;
 
         for (unsigned i = 0; i < nesting; ++i) {
@@ -152,9 +214,9 @@ public:
         log_info() << "</" << m_label << ": "
                    << (end.tv_sec - m_start.tv_sec) * 1000 + (end.tv_usec - m_start.tv_usec) / 1000
                    << "ms>\n";
+#endif
 
         free(m_label);
-#endif
     }
 };
 
@@ -0,0 +1,231 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <poll.h>
+#endif
+
+#include "logging.h"
+#include "poller.h"
+
+using namespace std;
+
+// ready descriptors reported by one wait()
+#define MAX_EVENTS 256
+
+Poller::Poller()
+    : backend_fd(-1)
+{
+}
+
+Poller::~Poller()
+{
+    if (backend_fd >= 0) {
+        close(backend_fd);
+    }
+}
+
+bool Poller::init()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (backend_fd < 0) {
+        backend_fd = epoll_create(64);
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    if (backend_fd < 0) {
+        backend_fd = kqueue();
+    }
+#else
+    return true;
+#endif
+
+    if (backend_fd < 0) {
+        log_perror("creating poller failed");
+        return false;
+    }
+
+    if (fcntl(backend_fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("poller fcntl()");
+    }
+
+    return true;
+}
+
+int Poller::watched(int fd) const
+{
+    map<int, int>::const_iterator it = fds.find(fd);
+    return it == fds.end() ? 0 : it->second;
+}
+
+bool Poller::watch(int fd, int events)
+{
+    int old_events = watched(fd);
+
+    if (events == old_events) {
+        return true;
+    }
+
+    if (!init()) {
+        return false;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    ev.events = 0;
+
+    if (events & Read) {
+        ev.events |= EPOLLIN;
+    }
+
+    if (events & Write) {
+        ev.events |= EPOLLOUT;
+    }
+
+    ev.data.fd = fd;
+    int op = !events ? EPOLL_CTL_DEL : old_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if (epoll_ctl(backend_fd, op, fd, &ev) < 0) {
+        log_perror("epoll_ctl()");
+        return false;
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    struct kevent changes[2];
+    int nchanges = 0;
+
+    if ((events ^ old_events) & Read) {
+        EV_SET(&changes[nchanges++], fd, EVFILT_READ, (events & Read) ? EV_ADD : EV_DELETE, 0, 0, 0);
+    }
+
+    if ((events ^ old_events) & Write) {
+        EV_SET(&changes[nchanges++], fd, EVFILT_WRITE, (events & Write) ? EV_ADD : EV_DELETE, 0, 0, 0);
+    }
+
+    if (kevent(backend_fd, changes, nchanges, NULL, 0, NULL) < 0) {
+        log_perror("kevent()");
+        return false;
+    }
+#endif
+
+    if (events) {
+        fds[fd] = events;
+    } else {
+        fds.erase(fd);
+    }
+
+    return true;
+}
+
+int Poller::wait(int timeout)
+{
+    ready.clear();
+
+    if (!init()) {
+        return -1;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    /* Level-triggered, so whatever doesn't fit is reported next time.  */
+    struct epoll_event events[MAX_EVENTS];
+    int ret = epoll_wait(backend_fd, events, MAX_EVENTS, timeout);
+
+    for (int i = 0; i < ret; ++i) {
+        Ready r;
+        r.fd = events[i].data.fd;
+        r.events = 0;
+        int want = watched(r.fd);
+
+        /* Hangups and errors are reported for whatever is watched, so the
+           next read or write runs into them.  */
+        if ((want & Read) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            r.events |= Read;
+        }
+
+        if ((want & Write) && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            r.events |= Write;
+        }
+
+        ready.push_back(r);
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    struct kevent events[MAX_EVENTS];
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    int ret = kevent(backend_fd, NULL, 0, events, MAX_EVENTS, timeout < 0 ? NULL : &ts);
+
+    for (int i = 0; i < ret; ++i) {
+        Ready r;
+        r.fd = events[i].ident;
+        r.events = events[i].filter == EVFILT_WRITE ? Write : Read;
+        ready.push_back(r);
+    }
+#else
+    vector<struct pollfd> pfds;
+    pfds.reserve(fds.size());
+
+    for (map<int, int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        struct pollfd p;
+        p.fd = it->first;
+        p.events = ((it->second & Read) ? POLLIN : 0) | ((it->second & Write) ? POLLOUT : 0);
+        p.revents = 0;
+        pfds.push_back(p);
+    }
+
+    int ret = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout);
+
+    for (size_t i = 0; ret > 0 && i < pfds.size(); ++i) {
+        if (!pfds[i].revents) {
+            continue;
+        }
+
+        Ready r;
+        r.fd = pfds[i].fd;
+        r.events = 0;
+
+        if ((pfds[i].events & POLLIN) && (pfds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+            r.events |= Read;
+        }
+
+        if ((pfds[i].events & POLLOUT) && (pfds[i].revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL))) {
+            r.events |= Write;
+        }
+
+        ready.push_back(r);
+    }
+#endif
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    return ready.size();
+}
@@ -0,0 +1,85 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_POLLER_H
+#define ICECREAM_POLLER_H
+
+#include <map>
+#include <vector>
+
+/* Waits for activity on many file descriptors at once, without the
+   FD_SETSIZE limit of select() and without passing all of them to the
+   kernel on every call.  Uses epoll on Linux, kqueue on the BSDs and
+   OS X and poll() elsewhere.  Readiness is level-triggered, as the
+   channels read in bounded pieces.  Descriptors have to be unwatched
+   before they are closed.  */
+class Poller
+{
+public:
+    enum Events {
+        Read = 1 << 0,
+        Write = 1 << 1
+    };
+
+    Poller();
+    ~Poller();
+
+    // watches fd for the given events (Read | Write), 0 stops watching it;
+    // false <--> error
+    bool watch(int fd, int events);
+    void unwatch(int fd)
+    {
+        watch(fd, 0);
+    }
+
+    // the events fd is watched for
+    int watched(int fd) const;
+
+    // waits at most timeout milliseconds (-1: forever), returns the number
+    // of ready file descriptors or -1 on error; EOF and errors count as Read
+    int wait(int timeout);
+    int ready_fd(int i) const
+    {
+        return ready[i].fd;
+    }
+    int ready_events(int i) const
+    {
+        return ready[i].events;
+    }
+
+private:
+    Poller(const Poller &);
+    Poller &operator=(const Poller &);
+
+    bool init();
+
+    struct Ready {
+        int fd;
+        int events;
+    };
+
+    std::map<int, int> fds;
+    std::vector<Ready> ready;
+    // epoll or kqueue descriptor, created on first use (kqueues are not
+    // inherited by fork(), which daemon() does)
+    int backend_fd;
+};
+
+#endif
@@ -0,0 +1,152 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "job.h"
+#include "resultkey.h"
+
+using namespace std;
+
+// points of each daemon on the ring, so that the keys spread evenly
+#define RING_POINTS 64
+
+ResultKey::ResultKey(const CompileJob &job)
+{
+    md5_init(&state);
+
+    add(job.targetPlatform());
+    add(job.environmentVersion());
+
+    /* The compiler as the compile server knows it (see CompileFileMsg), so
+       that it comes to the same key.  */
+    if (job.language() == CompileJob::Lang_Custom) {
+        add(job.compilerName());
+    } else if (job.compilerName().find("clang") != string::npos) {
+        add("clang");
+    } else {
+        add(job.language() == CompileJob::Lang_CXX ? "g++" : "gcc");
+    }
+
+    add(string(1, char('0' + job.language())));
+
+    list<string> flags = job.remoteFlags();
+    appendList(flags, job.restFlags());
+
+    for (list<string>::const_iterator it = flags.begin(); it != flags.end(); ++it) {
+        add(*it);
+    }
+
+    /* Clang gets these on the command line, and with split DWARF the
+       object file names the .dwo file.  */
+    add(job.inputFile());
+    add(job.workingDirectory());
+
+    if (job.dwarfFissionEnabled()) {
+        add(job.outputFile());
+    }
+}
+
+ResultKey::ResultKey()
+{
+    md5_init(&state);
+}
+
+void ResultKey::add(const string &s)
+{
+    // with the terminating 0, so that the strings can't run into each other
+    add(s.c_str(), s.size() + 1);
+}
+
+void ResultKey::add(const void *data, size_t len)
+{
+    md5_append(&state, (const md5_byte_t *) data, len);
+}
+
+string ResultKey::hex()
+{
+    md5_byte_t digest[16];
+    md5_finish(&state, digest);
+
+    char digest_hex[33];
+
+    for (int i = 0; i < 16; ++i) {
+        sprintf(digest_hex + i * 2, "%02x", digest[i]);
+    }
+
+    return string(digest_hex, 32);
+}
+
+bool ResultKey::valid(const string &key)
+{
+    return key.size() == 32 && key.find_first_not_of("0123456789abcdef") == string::npos;
+}
+
+static uint32_t ring_point(const string &s)
+{
+    md5_state_t state;
+    md5_byte_t digest[16];
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *) s.data(), s.size());
+    md5_finish(&state, digest);
+    return (uint32_t(digest[0]) << 24) | (uint32_t(digest[1]) << 16)
+           | (uint32_t(digest[2]) << 8) | uint32_t(digest[3]);
+}
+
+void ResultRing::setMembers(const list<string> &members)
+{
+    m_members = members;
+    points.clear();
+
+    for (list<string>::const_iterator it = members.begin(); it != members.end(); ++it) {
+        for (int i = 0; i < RING_POINTS; ++i) {
+            char suffix[16];
+            sprintf(suffix, "#%d", i);
+            points[ring_point(*it + suffix)] = *it;
+        }
+    }
+}
+
+bool ResultRing::owner(const string &key, string &host, unsigned int &port) const
+{
+    if (points.empty() || !ResultKey::valid(key)) {
+        return false;
+    }
+
+    uint32_t point = strtoul(key.substr(0, 8).c_str(), 0, 16);
+    map<uint32_t, string>::const_iterator it = points.lower_bound(point);
+
+    if (it == points.end()) {
+        it = points.begin();
+    }
+
+    string::size_type colon = it->second.rfind(':');
+
+    if (colon == string::npos) {
+        return false;
+    }
+
+    host = it->second.substr(0, colon);
+    port = atoi(it->second.c_str() + colon + 1);
+    return port != 0;
+}
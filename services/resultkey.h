@@ -0,0 +1,85 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_RESULTKEY_H
+#define ICECREAM_RESULTKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "md5.h"
+
+class CompileJob;
+
+/* What the result of compiling a job depends on: the environment, the
+   compiler and its flags, and the preprocessed source, which is added as
+   it is sent.  Jobs with the same key have the same object file, so a
+   result stored for one is used for the others (see ResultKeyMsg).  */
+class ResultKey
+{
+public:
+    explicit ResultKey(const CompileJob &job);
+    // of just what is added, like the contents of a file
+    ResultKey();
+
+    void add(const void *data, size_t len);
+    // the key in hex, nothing can be added after it
+    std::string hex();
+
+    // whether KEY looks like what hex() returns, so it can be a file name
+    static bool valid(const std::string &key);
+
+private:
+    void add(const std::string &s);
+
+    md5_state_t state;
+};
+
+/* The daemons that keep results, as "host:port", on a consistent-hash
+   ring.  Every key is owned by the daemon with the next point on the ring,
+   so a daemon joining or leaving only moves the keys next to its points.  */
+class ResultRing
+{
+public:
+    void setMembers(const std::list<std::string> &members);
+
+    const std::list<std::string> &members() const
+    {
+        return m_members;
+    }
+
+    bool empty() const
+    {
+        return points.empty();
+    }
+
+    // the daemon that owns KEY, false if there is none
+    bool owner(const std::string &key, std::string &host, unsigned int &port) const;
+
+private:
+    std::list<std::string> m_members;
+    std::map<uint32_t, std::string> points;
+};
+
+#endif
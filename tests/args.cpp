@@ -2,6 +2,8 @@
 #include <list>
 #include <string>
 #include <iostream>
+#include <stdio.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -57,9 +59,53 @@ static void test_3() {
    restore_icecc_color_diagnostics();
 }
 
+static void test_4() {
+   const char * argv[] = { "clang", "-include-pch", "pch.h.pch", "-c", "main.cpp", "-o", "main.o", 0 };
+   backup_icecc_color_diagnostics();
+   test_run("4", argv, false, "local:0 language:C++ compiler:clang local:'-include-pch, pch.h.pch' remote:'-c' rest:''");
+   restore_icecc_color_diagnostics();
+}
+
+static void test_5() {
+   const char * argv[] = { "gcc", "-include", "testargs-pch", "-c", "main.cpp", "-o", "main.o", 0 };
+   FILE *gch = fopen("testargs-pch.gch", "w");
+   if (gch)
+     fclose(gch);
+   backup_icecc_color_diagnostics();
+   test_run("5", argv, false, "local:0 language:C++ compiler:gcc local:'-include, testargs-pch' remote:'-c' rest:''");
+   restore_icecc_color_diagnostics();
+   unlink("testargs-pch.gch");
+}
+
+static void test_6() {
+   const char * argv[] = { "gcc", "-include", "testargs-pch", "-c", "main.cpp", "-o", "main.o", 0 };
+   backup_icecc_color_diagnostics();
+   test_run("6", argv, false, "local:1 language:C compiler:gcc local:'-include, testargs-pch' remote:'-c' rest:'main.cpp'");
+   restore_icecc_color_diagnostics();
+}
+
+static void test_7() {
+   const char * argv[] = { "clang", "-x", "ir", "-fthinlto-index=main.o.thinlto.bc", "-c", "main.o", "-o", "main-lto.o", 0 };
+   backup_icecc_color_diagnostics();
+   test_run("7", argv, false, "local:0 language:C compiler:clang local:'-fthinlto-index=main.o.thinlto.bc' remote:'-c' rest:'-x, ir'");
+   restore_icecc_color_diagnostics();
+}
+
+static void test_8() {
+   const char * argv[] = { "gcc", "-x", "ir", "-fthinlto-index=main.o.thinlto.bc", "-c", "main.o", "-o", "main-lto.o", 0 };
+   backup_icecc_color_diagnostics();
+   test_run("8", argv, false, "local:1 language:C compiler:gcc local:'-fthinlto-index=main.o.thinlto.bc' remote:'-c' rest:'-x, ir, main.o'");
+   restore_icecc_color_diagnostics();
+}
+
 int main() {
   test_1();
   test_2();
   test_3();
+  test_4();
+  test_5();
+  test_6();
+  test_7();
+  test_8();
   exit(0);
 }
@@ -0,0 +1,272 @@
+#! /bin/bash
+
+# The end-to-end benchmark of a farm on one machine.  A scheduler and
+# daemons run in network namespaces whose links are shaped with netem, and
+# a workload is built at each -j level locally and with icecc.  See README.
+
+prefix="$1"
+testdir="$2"
+shift
+shift
+daemons=4
+maxjobs=2
+delay=1
+rate=100
+loss=0
+jlevels="1 4 8 16"
+runs=3
+files=100
+sources=
+cflags="-O2"
+
+usage()
+{
+    echo Usage: "$0 <install_prefix> <resultsdir> [--daemons=N] [--max-jobs=N] [--delay=ms]"
+    echo "       [--rate=Mbit] [--loss=percent] [--jobs=\"1 4 8 16\"] [--runs=N]"
+    echo "       [--files=N | --sources=dir] [--cflags=flags]"
+    exit 2
+}
+
+while test -n "$1"; do
+    case "$1" in
+        --daemons=*) daemons=`echo $1 | sed 's/^--daemons=//'` ;;
+        --max-jobs=*) maxjobs=`echo $1 | sed 's/^--max-jobs=//'` ;;
+        --delay=*) delay=`echo $1 | sed 's/^--delay=//'` ;;
+        --rate=*) rate=`echo $1 | sed 's/^--rate=//'` ;;
+        --loss=*) loss=`echo $1 | sed 's/^--loss=//'` ;;
+        --jobs=*) jlevels=`echo $1 | sed 's/^--jobs=//'` ;;
+        --runs=*) runs=`echo $1 | sed 's/^--runs=//'` ;;
+        --files=*) files=`echo $1 | sed 's/^--files=//'` ;;
+        --sources=*) sources=`echo $1 | sed 's/^--sources=//'` ;;
+        --cflags=*) cflags=`echo $1 | sed 's/^--cflags=//'` ;;
+        *) usage ;;
+    esac
+    shift
+done
+
+if test -z "$prefix" -o ! -x "$prefix"/bin/icecc -o -z "$testdir"; then
+    usage
+fi
+
+if test `id -u` -ne 0; then
+    echo "The network namespaces need root."
+    exit 2
+fi
+
+for tool in ip tc make; do
+    if ! which $tool >/dev/null 2>&1; then
+        echo "$tool is missing."
+        exit 2
+    fi
+done
+
+export LC_ALL=C
+unset MAKEFLAGS
+unset ICECC
+unset ICECC_VERSION
+unset ICECC_DEBUG
+unset ICECC_LOGFILE
+unset ICECC_PREFERRED_HOST
+unset ICECC_TRACE_FILE
+
+testdir=`realpath -m "$testdir"`
+mkdir -p "$testdir"
+srcdir=`dirname "$0"`
+srcdir=`realpath "$srcdir"`
+
+# the scheduler is on the bridge, node 0 is the one that builds
+bridge=icebench0
+net=10.77.0
+nodes=`seq 0 $daemons`
+
+cleanup()
+{
+    for pid in $daemon_pids $scheduler_pid; do
+        kill $pid 2>/dev/null
+    done
+    wait 2>/dev/null
+    for node in $nodes; do
+        ip netns del icebench$node 2>/dev/null
+    done
+    ip link del $bridge 2>/dev/null
+}
+
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+setup_network()
+{
+    ip link add $bridge type bridge || exit 2
+    ip addr add $net.1/24 dev $bridge
+    ip link set $bridge up
+    for node in $nodes; do
+        ns=icebench$node
+        ip netns add $ns || exit 2
+        ip link add icebv$node type veth peer name eth0 netns $ns || exit 2
+        ip link set icebv$node master $bridge up
+        ip -n $ns addr add $net.$((node + 10))/24 dev eth0
+        ip -n $ns link set lo up
+        ip -n $ns link set eth0 up
+        # what a node sends goes through its netem, once each way
+        tc -n $ns qdisc add dev eth0 root netem delay ${delay}ms rate ${rate}mbit loss ${loss}% || exit 2
+    done
+}
+
+start_farm()
+{
+    "$prefix"/sbin/icecc-scheduler -p 8767 -l "$testdir"/scheduler.log -v &
+    scheduler_pid=$!
+    daemon_pids=
+    for node in $nodes; do
+        rm -rf "$testdir"/envs-node$node
+        ip netns exec icebench$node env ICECC_TEST_SOCKET="$testdir"/socket-node$node \
+            ICECC_TRACE_FILE="$testdir"/trace.json \
+            "$prefix"/sbin/iceccd -s $net.1:8767 -b "$testdir"/envs-node$node \
+            -l "$testdir"/node$node.log -N node$node -m $maxjobs -v &
+        daemon_pids="$daemon_pids $!"
+    done
+    for time in `seq 1 10`; do
+        sleep 1
+        notready=
+        # ensure log file flush
+        kill -HUP $daemon_pids 2>/dev/null
+        for node in $nodes; do
+            grep -q "Connected to scheduler" "$testdir"/node$node.log 2>/dev/null || notready=1
+        done
+        if test -z "$notready"; then
+            return
+        fi
+    done
+    echo "The daemons did not connect to the scheduler."
+    exit 2
+}
+
+# the make*.cpp files of test.sh, as many as asked for
+generate_sources()
+{
+    sources="$testdir"/sources
+    rm -rf "$sources"
+    mkdir -p "$sources"
+    cp "$srcdir"/make.h "$sources"/
+    for i in `seq 1 $files`; do
+        cat > "$sources"/make$i.cpp <<EOF
+#include "make.h"
+
+std::map<std::string, std::vector<int> > table$i;
+
+void make$i()
+    {
+    std::cout << std::setw($i) << table$i.size() << std::endl;
+    }
+EOF
+    done
+}
+
+# one object per source, no linking, so that only the compiles count
+write_makefile()
+{
+    makefile="$testdir"/Makefile
+    objs=
+    rules=
+    for file in `find "$sources" -name '*.c' -o -name '*.cpp' -o -name '*.cc' | sort`; do
+        obj=`echo "${file#$sources/}" | tr / _`.o
+        objs="$objs $obj"
+        case "$file" in
+            *.c) compiler='$(CC) $(CFLAGS)' ;;
+            *) compiler='$(CXX) $(CFLAGS)' ;;
+        esac
+        rules="$rules$obj: $file
+	$compiler -c $file -o \$@
+"
+    done
+    if test -z "$objs"; then
+        echo "No sources in $sources."
+        exit 2
+    fi
+    printf "all:%s\n\n%s" "$objs" "$rules" > "$makefile"
+}
+
+# builds at -j $1, with icecc if $2 is set, prints the seconds it took
+# or nothing if the build failed
+build()
+{
+    wrapper=
+    if test -n "$2"; then
+        wrapper="$prefix/bin/icecc "
+    fi
+    rm -rf "$testdir"/build
+    mkdir -p "$testdir"/build
+    start=`date +%s.%N`
+    ip netns exec icebench0 env ICECC_TEST_SOCKET="$testdir"/socket-node0 \
+        ICECC_TRACE_FILE="$testdir"/trace.json \
+        make -s -C "$testdir"/build -f "$makefile" -j $1 CFLAGS="$cflags" \
+        CC="${wrapper}gcc" CXX="${wrapper}g++" >>"$testdir"/build.log 2>&1 || return
+    end=`date +%s.%N`
+    echo "$start $end" | awk '{ printf "%.2f\n", $2 - $1 }'
+}
+
+# build, and the end of the benchmark if it failed
+timed_build()
+{
+    time=`build "$@"`
+    if test -z "$time"; then
+        echo "The build failed, see $testdir/build.log." >&2
+        exit 2
+    fi
+}
+
+median()
+{
+    tr ' ' '\n' | grep -v '^$' | sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# the seconds of each phase in the trace, summed over the jobs, in the order of $phases
+phase_sums()
+{
+    sed -n 's/.*"name":"\([^"]*\)".*"dur":\([0-9]*\).*/\1\t\2/p' "$testdir"/trace.json | \
+        awk -F '\t' -v phases="$phases" '
+            { sum[$1] += $2 }
+            END {
+                n = split(phases, p, ",")
+                for (i = 1; i <= n; ++i) {
+                    printf "\t%.2f", sum[p[i]] / 1000000
+                }
+            }'
+}
+
+phases="scheduler,connect,receive input,compile"
+
+if test -z "$sources"; then
+    generate_sources
+fi
+
+sources=`realpath "$sources"`
+write_makefile
+setup_network
+start_farm
+rm -f "$testdir"/build.log
+
+# the first build sends the environment to the servers, that isn't measured
+timed_build $daemons icecc
+
+echo "# $daemons servers with $maxjobs jobs, ${delay}ms ${rate}Mbit ${loss}% loss per link,"\
+     "`echo $objs | wc -w` files, median of $runs runs"
+printf "jobs\tlocal_sec\ticecc_sec\tspeedup\tscheduler_sec\tconnect_sec\tinput_sec\tcompile_sec\n"
+
+for j in $jlevels; do
+    local_times=
+    icecc_times=
+    for run in `seq 1 $runs`; do
+        timed_build $j
+        local_times="$local_times $time"
+        # the daemons keep it open
+        : > "$testdir"/trace.json
+        timed_build $j icecc
+        icecc_times="$icecc_times $time"
+    done
+    local_time=`echo $local_times | median`
+    icecc_time=`echo $icecc_times | median`
+    speedup=`echo "$local_time $icecc_time" | awk '{ printf "%.2f", $2 > 0 ? $1 / $2 : 0 }'`
+    # the phases are those of the last run
+    printf "%s\t%s\t%s\t%s%s\n" $j $local_time $icecc_time $speedup "`phase_sums`"
+done
@@ -0,0 +1,482 @@
+/* Microbenchmarks of the protocol code, over socketpairs:
+
+   - encode/decode: send_msg() and get_msg() of the common messages
+   - chunk-encode/chunk-decode: FileChunkMsg, that is writecompressed() and
+     readcompressed(), with each codec, chunk size and kind of data
+   - stream: a file sent as FileChunkMsgs by another process, like a
+     client sends its source, with each codec
+
+   Every case runs for the given time and prints one tab separated line,
+   after a header line, so that the output of two builds can be compared:
+
+     ./msgbench -t 500 > new.tsv
+*/
+
+#ifndef _GNU_SOURCE
+// getopt_long
+#define _GNU_SOURCE 1
+#endif
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "comm.h"
+#include "logging.h"
+
+using namespace std;
+
+// messages queued at once before the other side decodes them
+#define BATCH 64
+// what the client sends its source in, see write_server_cpp()
+#define STREAM_CHUNK 100000
+
+static unsigned long long now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void usage(const char *reason = 0)
+{
+    if (reason) {
+        cerr << reason << endl;
+    }
+
+    cerr << "usage: msgbench [options]\n"
+         << "Options:\n"
+         << "  -t, --time <msec>          each case runs (300)\n"
+         << "  -s, --stream <MB>          sent in each stream case (64)\n"
+         << "  -f, --filter <text>        only the cases with it in their name\n"
+         << "  -h, --help\n"
+         << endl;
+    exit(1);
+}
+
+static void report(const char *bench, const string &name, const string &codec, size_t bytes,
+                   unsigned long long ops, unsigned long long usec, double ratio)
+{
+    double seconds = usec ? usec / 1000000.0 : 1e-6;
+    cout << bench << '\t' << name << '\t' << codec << '\t' << bytes << '\t'
+         << (unsigned long long)(ops / seconds) << '\t'
+         << ops * bytes / seconds / (1024 * 1024) << '\t' << ratio << endl;
+}
+
+/* Two ends of a socketpair, set up as if they negotiated the current
+   protocol with all codecs.  */
+static bool channel_pair(MsgChannel *&a, MsgChannel *&b)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return false;
+    }
+
+    uint32_t codecs = (1 << C_LZO) | (1 << C_ZSTD) | (1 << C_LZ4) | (1 << C_STORED);
+    a = Service::adoptChannel(fds[0], PROTOCOL_VERSION, codecs);
+    b = Service::adoptChannel(fds[1], PROTOCOL_VERSION, codecs);
+    return a && b;
+}
+
+/* Something like preprocessed source, which compresses about as well.  */
+static string text_data(size_t len)
+{
+    static const char *const words[] = {
+        "static", "inline", "const", "unsigned", "int", "char", "struct", "return",
+        "if", "else", "for", "while", "std::string", "size_t", "void", "namespace"
+    };
+    string data;
+
+    while (data.size() < len) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s %s name_%lu(%s *p%lu) { return p->field_%lu + %lu; }\n",
+                 words[random() % 16], words[random() % 16], random() % 5000,
+                 words[random() % 16], random() % 8, random() % 300, random() % 1000);
+        data += line;
+    }
+
+    data.resize(len);
+    return data;
+}
+
+/* Something like an object file, runs of zeros between hardly compressible
+   code.  */
+static string binary_data(size_t len)
+{
+    string data;
+
+    while (data.size() < len) {
+        if (random() % 4 == 0) {
+            data.append(random() % 64, '\0');
+        } else {
+            for (int i = random() % 256; i > 0; --i) {
+                data += char(random());
+            }
+        }
+    }
+
+    data.resize(len);
+    return data;
+}
+
+/* Sends BATCH copies of M from A and gets them at B until the time is up.
+   Returns false if the channels broke.  */
+static bool run_messages(MsgChannel *a, MsgChannel *b, const Msg &m, unsigned long long duration,
+                         unsigned long long &ops, unsigned long long &encode_usec,
+                         unsigned long long &decode_usec)
+{
+    unsigned long long end = now_usec() + duration;
+    ops = encode_usec = decode_usec = 0;
+
+    while (now_usec() < end) {
+        unsigned long long start = now_usec();
+
+        for (int i = 0; i < BATCH; ++i) {
+            if (!a->send_msg(m, MsgChannel::SendQueued)) {
+                return false;
+            }
+        }
+
+        encode_usec += now_usec() - start;
+        int decoded = 0;
+
+        while (decoded < BATCH) {
+            if (a->pending() && !a->flush(false)) {
+                return false;
+            }
+
+            if (!b->read_a_bit()) {
+                return false;
+            }
+
+            while (b->has_msg() && !b->at_eof()) {
+                start = now_usec();
+                Msg *r = b->get_msg(0);
+                decode_usec += now_usec() - start;
+
+                if (!r) {
+                    return false;
+                }
+
+                delete r;
+                ++decoded;
+            }
+        }
+
+        ops += BATCH;
+    }
+
+    return true;
+}
+
+/* The size of M on the wire.  */
+static size_t message_size(MsgChannel *a, MsgChannel *b, const Msg &m)
+{
+    size_t before = a->pending();
+    a->send_msg(m, MsgChannel::SendQueued);
+    size_t size = a->pending() - before;
+
+    while (a->pending()) {
+        a->flush(false);
+        b->read_a_bit();
+    }
+
+    delete b->get_msg(1);
+    return size;
+}
+
+static bool wanted(const string &name, const string &filter)
+{
+    return filter.empty() || name.find(filter) != string::npos;
+}
+
+static void bench_messages(unsigned long long duration, const string &filter)
+{
+    Environments envs;
+
+    for (int i = 0; i < 8; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "gcc-%d.%d-x86_64-0123456789abcdef.tar.gz", 9 + i, i);
+        envs.push_back(make_pair(string("x86_64"), string(name)));
+    }
+
+    CompileJob job;
+    job.setLanguage(CompileJob::Lang_CXX);
+    job.setCompilerName("g++");
+    job.setEnvironmentVersion(envs.front().second);
+    job.setTargetPlatform("x86_64");
+    job.setInputFile("/home/user/src/project/lib/module/file.cpp");
+    job.setOutputFile("lib/module/CMakeFiles/module.dir/file.cpp.o");
+    job.setWorkingDirectory("/home/user/src/project/build");
+    job.setJobID(4711);
+
+    for (int i = 0; i < 12; ++i) {
+        char flag[64];
+        snprintf(flag, sizeof(flag), "-DPROJECT_FEATURE_%d=1", i);
+        job.appendFlag(flag, Arg_Rest);
+    }
+
+    job.appendFlag("-O2", Arg_Remote);
+    job.appendFlag("-g", Arg_Remote);
+    job.appendFlag("-fPIC", Arg_Rest);
+    job.appendFlag("-std=c++17", Arg_Rest);
+    job.appendFlag("-Wall", Arg_Rest);
+    job.appendFlag("-MD", Arg_Local);
+
+    HeaderManifestMsg manifest;
+
+    for (int i = 0; i < 300; ++i) {
+        char file[96];
+        snprintf(file, sizeof(file), "/usr/include/c++/12/bits/header_%d.h", i);
+        manifest.files.push_back(file);
+        manifest.hashes.push_back("0123456789abcdef0123456789abcdef");
+    }
+
+    manifest.cpp_flags.push_back("-DPROJECT_FEATURE_0=1");
+    manifest.system_dirs.push_back("/usr/include");
+
+    CompileResultMsg result;
+    result.err = text_data(2000);
+
+    JobDoneMsg done(4711, 0);
+    done.real_msec = 2100;
+    done.user_msec = 1900;
+    done.in_uncompressed = 800000;
+    done.in_compressed = 150000;
+
+    StatsMsg stats;
+    stats.load = 300;
+    stats.loadAvg1 = stats.loadAvg5 = stats.loadAvg10 = 2000;
+    stats.freeMem = 16000;
+
+    LoginMsg login(10245, "node42", "x86_64");
+    login.envs = envs;
+    login.max_kids = 16;
+
+    vector<pair<string, const Msg *> > msgs;
+    GetCSMsg getcs(envs, job.inputFile(), CompileJob::Lang_CXX, 1, "x86_64", 0, "", 0,
+                   JC_INTERACTIVE);
+    UseCSMsg usecs("x86_64", "10.0.0.42", 10245, 4711, true, 1, 0);
+    CompileFileMsg compile(&job);
+    JobBeginMsg begin(4711);
+    JobWaitMsg wait(1, 2000, 1500);
+    PingMsg ping;
+    msgs.push_back(make_pair(string("PingMsg"), (const Msg *) &ping));
+    msgs.push_back(make_pair(string("GetCSMsg"), (const Msg *) &getcs));
+    msgs.push_back(make_pair(string("UseCSMsg"), (const Msg *) &usecs));
+    msgs.push_back(make_pair(string("CompileFileMsg"), (const Msg *) &compile));
+    msgs.push_back(make_pair(string("HeaderManifestMsg"), (const Msg *) &manifest));
+    msgs.push_back(make_pair(string("CompileResultMsg"), (const Msg *) &result));
+    msgs.push_back(make_pair(string("JobBeginMsg"), (const Msg *) &begin));
+    msgs.push_back(make_pair(string("JobDoneMsg"), (const Msg *) &done));
+    msgs.push_back(make_pair(string("JobWaitMsg"), (const Msg *) &wait));
+    msgs.push_back(make_pair(string("StatsMsg"), (const Msg *) &stats));
+    msgs.push_back(make_pair(string("LoginMsg"), (const Msg *) &login));
+
+    for (vector<pair<string, const Msg *> >::const_iterator it = msgs.begin(); it != msgs.end(); ++it) {
+        if (!wanted(it->first, filter)) {
+            continue;
+        }
+
+        MsgChannel *a, *b;
+
+        if (!channel_pair(a, b)) {
+            exit(1);
+        }
+
+        size_t size = message_size(a, b, *it->second);
+        unsigned long long ops, encode_usec, decode_usec;
+
+        if (!run_messages(a, b, *it->second, duration, ops, encode_usec, decode_usec)) {
+            cerr << "sending " << it->first << " failed" << endl;
+            exit(1);
+        }
+
+        report("encode", it->first, "-", size, ops, encode_usec, 1);
+        report("decode", it->first, "-", size, ops, decode_usec, 1);
+        delete a;
+        delete b;
+    }
+}
+
+static const CompressionCodec codecs[] = { C_LZO, C_ZSTD, C_LZ4, C_STORED };
+
+static void bench_chunks(unsigned long long duration, const string &filter)
+{
+    static const size_t sizes[] = { 4096, 65536, 1024 * 1024 };
+    static const char *const kinds[] = { "text", "binary" };
+
+    for (int kind = 0; kind < 2; ++kind) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            string data = kind ? binary_data(sizes[s]) : text_data(sizes[s]);
+            char name[64];
+            snprintf(name, sizeof(name), "FileChunkMsg-%s-%lu", kinds[kind], (unsigned long) sizes[s]);
+
+            if (!wanted(name, filter)) {
+                continue;
+            }
+
+            for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+                MsgChannel *a, *b;
+
+                if (!channel_pair(a, b)) {
+                    exit(1);
+                }
+
+                a->setCompression(codecs[c]);
+                FileChunkMsg chunk((unsigned char *) data.data(), data.size());
+                message_size(a, b, chunk);
+                double ratio = chunk.compressed ? double(data.size()) / chunk.compressed : 0;
+                unsigned long long ops, encode_usec, decode_usec;
+
+                if (!run_messages(a, b, chunk, duration, ops, encode_usec, decode_usec)) {
+                    cerr << "sending " << name << " failed" << endl;
+                    exit(1);
+                }
+
+                report("chunk-encode", name, a->compressionMode(), data.size(), ops, encode_usec, ratio);
+                report("chunk-decode", name, a->compressionMode(), data.size(), ops, decode_usec, ratio);
+                delete a;
+                delete b;
+            }
+        }
+    }
+}
+
+/* A child process sends MB of source with the codec, blocking like the
+   client does, and this one receives it.  */
+static void bench_stream(unsigned int mb, const string &filter)
+{
+    if (!wanted("stream", filter)) {
+        return;
+    }
+
+    string data = text_data(STREAM_CHUNK);
+
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+        MsgChannel *a, *b;
+
+        if (!channel_pair(a, b)) {
+            exit(1);
+        }
+
+        // what the codec falls back to shows with the first chunk
+        a->setCompression(codecs[c]);
+        FileChunkMsg chunk((unsigned char *) data.data(), data.size());
+        message_size(a, b, chunk);
+        string codec = a->compressionMode();
+
+        unsigned long long start = now_usec();
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+
+        if (pid == 0) {
+            delete b;
+            unsigned long long total = (unsigned long long) mb * 1024 * 1024;
+
+            for (unsigned long long sent = 0; sent < total; sent += data.size()) {
+                if (!a->send_msg(chunk)) {
+                    _exit(1);
+                }
+            }
+
+            _exit(a->send_msg(EndMsg()) ? 0 : 1);
+        }
+
+        delete a;
+        unsigned long long chunks = 0;
+
+        while (Msg *m = b->get_msg(60)) {
+            MsgType type = m->type;
+            delete m;
+
+            if (type != M_FILE_CHUNK) {
+                break;
+            }
+
+            ++chunks;
+        }
+
+        unsigned long long usec = now_usec() - start;
+        int status = 1;
+        waitpid(pid, &status, 0);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            cerr << "the stream sender failed" << endl;
+            exit(1);
+        }
+
+        report("stream", "FileChunkMsg-text", codec, data.size(), chunks, usec, 1);
+        delete b;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long duration = 300 * 1000;
+    unsigned int stream_mb = 64;
+    string filter;
+
+    while (true) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            { "time", 1, NULL, 't' },
+            { "stream", 1, NULL, 's' },
+            { "filter", 1, NULL, 'f' },
+            { "help", 0, NULL, 'h' },
+            { 0, 0, 0, 0 }
+        };
+
+        const int c = getopt_long(argc, argv, "t:s:f:h", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 't':
+            duration = (unsigned long long) atoi(optarg) * 1000;
+            break;
+        case 's':
+            stream_mb = atoi(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (!duration || !stream_mb) {
+        usage("Error: the time and the stream size have to be positive");
+    }
+
+    setup_debug(Error);
+    signal(SIGPIPE, SIG_IGN);
+    // the same data in every run
+    srandom(1);
+
+    cout << "bench\tcase\tcodec\tbytes\tops_per_sec\tmb_per_sec\tratio" << endl;
+    bench_messages(duration, filter);
+    bench_chunks(duration, filter);
+    bench_stream(stream_mb, filter);
+    return 0;
+}
@@ -0,0 +1,440 @@
+/* A load generator for the scheduler.  Many fake daemons log in to a real
+   icecc-scheduler, report their load from time to time and ask for compile
+   servers at a given rate, as their clients would.  The fake server that
+   gets a job reports it begun right away and done after the compile time.
+   At the end the latency from sending GetCSMsg to getting UseCSMsg back is
+   reported, and with -P the CPU time the scheduler used meanwhile.
+
+   Example, against a scheduler started with -p 8767:
+
+     icecc-scheduler -p 8767 & ./scaletest -s localhost:8767 -d 2000 -r 500 -P $!
+*/
+
+#ifndef _GNU_SOURCE
+// getopt_long
+#define _GNU_SOURCE 1
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "comm.h"
+#include "logging.h"
+#include "poller.h"
+
+using namespace std;
+
+// the fake daemons listen on ports from there, that's how UseCSMsg names them
+#define FIRST_PORT 20000
+
+struct FakeDaemon {
+    FakeDaemon()
+        : channel(0), index(0), running(0), next_stats(0), monitor(false) {}
+
+    MsgChannel *channel;
+    int index;
+    int running;
+    unsigned long long next_stats;
+    bool monitor;
+};
+
+struct Request {
+    unsigned long long sent;
+    FakeDaemon *submitter;
+};
+
+static unsigned long long now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* The user and system time the process used so far, in clock ticks.  */
+static unsigned long long cpu_ticks(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", int(pid));
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return 0;
+    }
+
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+
+    // the fields after the command, which can contain anything but ')'
+    const char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        return 0;
+    }
+
+    return utime + stime;
+}
+
+static double percentile(vector<double> &sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+static void usage(const char *reason = 0)
+{
+    if (reason) {
+        cerr << reason << endl;
+    }
+
+    cerr << "usage: scaletest [options]\n"
+         << "Options:\n"
+         << "  -s, --scheduler <host>[:<port>]  (localhost:8765)\n"
+         << "  -d, --daemons <count>            fake daemons (1000)\n"
+         << "  -j, --jobs <count>               jobs each of them takes (4)\n"
+         << "  -r, --rate <requests/s>          over all daemons (200)\n"
+         << "  -c, --compile-msec <msec>        what a job takes (2000)\n"
+         << "  -i, --stats-interval <msec>      between load reports of a daemon (2000)\n"
+         << "  -m, --monitors <count>           monitors to connect as well (0)\n"
+         << "  -t, --time <seconds>             how long to generate load (30)\n"
+         << "  -P, --pid <pid>                  of the scheduler, to report its CPU use\n"
+         << "  -h, --help\n"
+         << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    string host = "localhost";
+    unsigned short port = 8765;
+    int daemon_count = 1000;
+    int max_jobs = 4;
+    double rate = 200;
+    unsigned int compile_msec = 2000;
+    unsigned int stats_msec = 2000;
+    int monitor_count = 0;
+    int seconds = 30;
+    pid_t scheduler_pid = 0;
+
+    while (true) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            { "scheduler", 1, NULL, 's' },
+            { "daemons", 1, NULL, 'd' },
+            { "jobs", 1, NULL, 'j' },
+            { "rate", 1, NULL, 'r' },
+            { "compile-msec", 1, NULL, 'c' },
+            { "stats-interval", 1, NULL, 'i' },
+            { "monitors", 1, NULL, 'm' },
+            { "time", 1, NULL, 't' },
+            { "pid", 1, NULL, 'P' },
+            { "help", 0, NULL, 'h' },
+            { 0, 0, 0, 0 }
+        };
+
+        const int c = getopt_long(argc, argv, "s:d:j:r:c:i:m:t:P:h", long_options, &option_index);
+
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 's': {
+            host = optarg;
+            string::size_type colon = host.rfind(':');
+
+            if (colon != string::npos) {
+                port = atoi(host.c_str() + colon + 1);
+                host = host.substr(0, colon);
+            }
+
+            break;
+        }
+        case 'd':
+            daemon_count = atoi(optarg);
+            break;
+        case 'j':
+            max_jobs = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'c':
+            compile_msec = atoi(optarg);
+            break;
+        case 'i':
+            stats_msec = atoi(optarg);
+            break;
+        case 'm':
+            monitor_count = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'P':
+            scheduler_pid = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (daemon_count <= 0 || max_jobs <= 0 || rate <= 0 || stats_msec == 0) {
+        usage("Error: the counts, the rate and the interval have to be positive");
+    }
+
+    setup_debug(Error);
+
+    /* Every fake daemon is a connection.  */
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Environments envs;
+    envs.push_back(make_pair(string("x86_64"), string("scaletest.tar.gz")));
+
+    Poller poller;
+    vector<FakeDaemon *> daemons;
+    map<int, FakeDaemon *> by_fd;
+    unsigned long long start = now_usec();
+
+    /* Connect all of them first and let the protocol setups run in
+       parallel, one after the other takes too long for thousands.  */
+    for (int i = 0; i < daemon_count + monitor_count; ++i) {
+        FakeDaemon *d = new FakeDaemon;
+        d->index = i;
+        d->monitor = i >= daemon_count;
+        d->channel = Service::connectChannel(host, port, 10);
+
+        if (!d->channel) {
+            cerr << "connecting to the scheduler failed after " << i << " connections" << endl;
+            return 1;
+        }
+
+        by_fd[d->channel->fd] = d;
+        poller.watch(d->channel->fd, Poller::Read);
+
+        if (!d->monitor) {
+            daemons.push_back(d);
+        }
+    }
+
+    size_t setting_up = by_fd.size();
+
+    for (map<int, FakeDaemon *>::const_iterator it = by_fd.begin(); it != by_fd.end(); ++it) {
+        if (it->second->channel->protocol_ready()) {
+            --setting_up;
+        }
+    }
+
+    while (setting_up > 0) {
+        int ready = poller.wait(10000);
+
+        if (ready <= 0) {
+            cerr << "the protocol setup with the scheduler timed out" << endl;
+            return 1;
+        }
+
+        for (int r = 0; r < ready; ++r) {
+            MsgChannel *c = by_fd[poller.ready_fd(r)]->channel;
+
+            if (c->protocol_ready()) {
+                continue;
+            }
+
+            if (!c->read_a_bit() || c->at_eof()) {
+                cerr << "the scheduler closed a connection during the protocol setup" << endl;
+                return 1;
+            }
+
+            if (c->protocol_ready()) {
+                --setting_up;
+            }
+        }
+    }
+
+    for (map<int, FakeDaemon *>::const_iterator it = by_fd.begin(); it != by_fd.end(); ++it) {
+        FakeDaemon *d = it->second;
+
+        if (d->monitor) {
+            if (!d->channel->send_msg(MonLoginMsg())) {
+                cerr << "monitor login failed" << endl;
+                return 1;
+            }
+
+            continue;
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "scaletest%d", d->index);
+        LoginMsg login(FIRST_PORT + d->index, name, "x86_64");
+        login.envs = envs;
+        login.max_kids = max_jobs;
+        login.noremote = false;
+        login.chroot_possible = true;
+
+        if (!d->channel->send_msg(login)) {
+            cerr << "login of " << name << " failed" << endl;
+            return 1;
+        }
+
+        // spread the reports over the interval
+        d->next_stats = start + (unsigned long long)stats_msec * 1000 * d->index / daemon_count;
+    }
+
+    cout << daemon_count << " daemons and " << monitor_count << " monitors connected in "
+         << (now_usec() - start) / 1000 << " ms" << endl;
+
+    map<unsigned int, Request> requests;  // by client id
+    multimap<unsigned long long, pair<FakeDaemon *, unsigned int> > finishing;  // jobs by when
+    vector<double> latencies;
+    unsigned int next_client_id = 0;
+    unsigned long long sent = 0, failed = 0, monitor_msgs = 0;
+
+    start = now_usec();
+    unsigned long long end = start + (unsigned long long)seconds * 1000000;
+    unsigned long long cpu_start = scheduler_pid ? cpu_ticks(scheduler_pid) : 0;
+    // the answers to the last requests may take a while
+    unsigned long long drain = end + (unsigned long long)compile_msec * 1000 + 5000000;
+
+    while (true) {
+        unsigned long long now = now_usec();
+
+        if (now >= drain || (now >= end && requests.empty())) {
+            break;
+        }
+
+        /* As many requests as the rate allows since the start.  */
+        unsigned long long due = now < end ? (unsigned long long)((now - start) * rate / 1000000) : sent;
+
+        while (sent < due) {
+            FakeDaemon *d = daemons[random() % daemons.size()];
+            char file[64];
+            snprintf(file, sizeof(file), "/scaletest/file%lu.c", (unsigned long)(random() % 5000));
+            GetCSMsg get(envs, file, CompileJob::Lang_C, 1, "x86_64", 0, "", 0, JC_INTERACTIVE);
+            get.client_id = ++next_client_id;
+            Request r;
+            r.sent = now_usec();
+            r.submitter = d;
+            requests[get.client_id] = r;
+            ++sent;
+
+            if (!d->channel->send_msg(get, MsgChannel::SendQueued)) {
+                ++failed;
+            }
+        }
+
+        while (!finishing.empty() && finishing.begin()->first <= now) {
+            FakeDaemon *d = finishing.begin()->second.first;
+            JobDoneMsg done(finishing.begin()->second.second, 0);
+            done.real_msec = done.user_msec = compile_msec;
+            done.in_uncompressed = done.in_compressed = 100000;
+            done.out_uncompressed = done.out_compressed = 50000;
+            --d->running;
+            d->channel->send_msg(done, MsgChannel::SendQueued);
+            finishing.erase(finishing.begin());
+        }
+
+        for (vector<FakeDaemon *>::const_iterator it = daemons.begin(); it != daemons.end(); ++it) {
+            FakeDaemon *d = *it;
+
+            if (d->next_stats <= now) {
+                StatsMsg stats;
+                stats.load = min(999, d->running * 1000 / max_jobs);
+                stats.loadAvg1 = stats.loadAvg5 = stats.loadAvg10 = stats.load;
+                stats.freeMem = 1000;
+                d->channel->send_msg(stats, MsgChannel::SendQueued);
+                d->next_stats = now + (unsigned long long)stats_msec * 1000;
+            }
+
+            if (d->channel->pending()) {
+                d->channel->flush(false);
+            }
+        }
+
+        int ready = poller.wait(1);
+
+        for (int r = 0; r < ready; ++r) {
+            FakeDaemon *d = by_fd[poller.ready_fd(r)];
+
+            if (!d->channel->read_a_bit() && !d->channel->has_msg()) {
+                cerr << "the scheduler closed the connection of " << d->index << endl;
+                return 1;
+            }
+
+            while (d->channel->has_msg()) {
+                Msg *msg = d->channel->get_msg(0);
+
+                if (!msg) {
+                    break;
+                }
+
+                if (d->monitor) {
+                    ++monitor_msgs;
+                } else if (msg->type == M_USE_CS) {
+                    UseCSMsg *use = static_cast<UseCSMsg *>(msg);
+                    map<unsigned int, Request>::iterator req = requests.find(use->client_id);
+
+                    if (req != requests.end()) {
+                        latencies.push_back((now_usec() - req->second.sent) / 1000.0);
+                        requests.erase(req);
+                    }
+
+                    int server = int(use->port) - FIRST_PORT;
+
+                    if (server >= 0 && server < int(daemons.size())) {
+                        FakeDaemon *s = daemons[server];
+                        ++s->running;
+                        s->channel->send_msg(JobBeginMsg(use->job_id), MsgChannel::SendQueued);
+                        finishing.insert(make_pair(now_usec() + (unsigned long long)compile_msec * 1000,
+                                                   make_pair(s, use->job_id)));
+                    }
+                }
+
+                delete msg;
+            }
+        }
+    }
+
+    double elapsed = (now_usec() - start) / 1000000.0;
+    sort(latencies.begin(), latencies.end());
+
+    cout << "requests: " << sent << " sent, " << latencies.size() << " answered, "
+         << requests.size() << " unanswered, " << failed << " failed to send\n"
+         << "latency: median " << percentile(latencies, 0.5)
+         << " ms, 90% " << percentile(latencies, 0.9)
+         << " ms, 99% " << percentile(latencies, 0.99)
+         << " ms, max " << percentile(latencies, 1) << " ms\n";
+
+    if (monitor_count) {
+        cout << "monitor messages: " << monitor_msgs << "\n";
+    }
+
+    if (scheduler_pid) {
+        unsigned long long ticks = cpu_ticks(scheduler_pid) - cpu_start;
+        cout << "scheduler CPU: " << 100.0 * ticks / sysconf(_SC_CLK_TCK) / elapsed << " %\n";
+    }
+
+    cout << flush;
+    return 0;
+}
@@ -68,19 +68,22 @@ mkdir -p "$testdir"
 
 skipped_tests=
 chroot_disabled=
+# extra options of the daemons, for the tests needing them restarted
+localice_args=
+remoteice_args=
 
 start_ice()
 {
     $valgrind "$prefix"/sbin/icecc-scheduler -p 8767 -l "$testdir"/scheduler.log -v -v -v &
     scheduler_pid=$!
     echo $scheduler_pid > "$testdir"/scheduler.pid
-    ICECC_TEST_SOCKET="$testdir"/socket-localice $valgrind "$prefix"/sbin/iceccd --no-remote -s localhost:8767 -b "$testdir"/envs-localice -l "$testdir"/localice.log -N localice -m 2 -v -v -v &
+    ICECC_TEST_SOCKET="$testdir"/socket-localice $valgrind "$prefix"/sbin/iceccd --no-remote -s localhost:8767 -b "$testdir"/envs-localice -l "$testdir"/localice.log -N localice -m 2 -v -v -v $localice_args &
     localice_pid=$!
     echo $localice_pid > "$testdir"/localice.pid
-    ICECC_TEST_SOCKET="$testdir"/socket-remoteice1 $valgrind "$prefix"/sbin/iceccd -p 10246 -s localhost:8767 -b "$testdir"/envs-remoteice1 -l "$testdir"/remoteice1.log -N remoteice1 -m 2 -v -v -v &
+    ICECC_TEST_SOCKET="$testdir"/socket-remoteice1 $valgrind "$prefix"/sbin/iceccd -p 10246 -s localhost:8767 -b "$testdir"/envs-remoteice1 -l "$testdir"/remoteice1.log -N remoteice1 -m 2 -v -v -v $remoteice_args &
     remoteice1_pid=$!
     echo $remoteice1_pid > "$testdir"/remoteice1.pid
-    ICECC_TEST_SOCKET="$testdir"/socket-remoteice2 $valgrind "$prefix"/sbin/iceccd -p 10247 -s localhost:8767 -b "$testdir"/envs-remoteice2 -l "$testdir"/remoteice2.log -N remoteice2 -m 2 -v -v -v &
+    ICECC_TEST_SOCKET="$testdir"/socket-remoteice2 $valgrind "$prefix"/sbin/iceccd -p 10247 -s localhost:8767 -b "$testdir"/envs-remoteice2 -l "$testdir"/remoteice2.log -N remoteice2 -m 2 -v -v -v $remoteice_args &
     remoteice2_pid=$!
     echo $remoteice2_pid > "$testdir"/remoteice2.pid
     notready=
@@ -673,6 +676,130 @@ debug_test()
     echo
 }
 
+# Compiles the source ($2) on remoteice1 with the environment given after it
+# (VAR=value ...) and checks the object file is the one the compiler makes
+# without icecc. The logs of the run are left for the caller ($1 names it)
+# to check.
+remote_compile_test()
+{
+    name="$1"
+    shift
+    source="$1"
+    shift
+    output="$testdir"/`basename "$source" | sed 's/\.[^.]*$//'`.o
+
+    reset_logs remote "$name"
+    env "$@" ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_TEST_REMOTEBUILD=1 ICECC_PREFERRED_HOST=remoteice1 ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log $valgrind "$prefix"/bin/icecc \
+        $GXX -Wall -Werror -c "$source" -o "$output" 2>>"$testdir"/stderr.log
+    if test $? -ne 0; then
+        echo "$name failed."
+        stop_ice 0
+        exit 2
+    fi
+    mv "$output" "$output".remoteice
+    $GXX -Wall -Werror -c "$source" -o "$output"
+
+    remove_debug_info="s/DW_AT_\(GNU_dwo_\(id\|name\)\|comp_dir\|producer\|linkage_name\|name\).*//g"
+    readelf -wlLiaprmfFoRt "$output" | sed -e "$remove_debug_info" > "$output".readelf.txt
+    readelf -wlLiaprmfFoRt "$output".remoteice | sed -e "$remove_debug_info" > "$output".remote.readelf.txt
+    if ! diff -q "$output".remote.readelf.txt "$output".readelf.txt; then
+        echo "Output mismatch ($name)"
+        stop_ice 0
+        exit 2
+    fi
+    rm -f "$output" "$output".remoteice "$output".readelf.txt "$output".remote.readelf.txt
+
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_error icecc "<building_local>"
+    check_log_error icecc "local build forced"
+}
+
+# Check that compile servers with --result-cache keep results for each
+# other: the first compile stores its result with the owner of its key,
+# the second one gets it from there instead of compiling.
+result_cache_test()
+{
+    echo Running result cache test.
+    remote_compile_test "result cache store" plain.cpp
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_error remoteice1 "result key of the client doesn't match"
+    # the result is stored after the client has it
+    wait_for_log_message "remoteice1 remoteice2" "stored result"
+
+    remote_compile_test "result cache hit" plain.cpp
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message remoteice1 "is stored already"
+    echo Result cache test successful.
+    echo
+}
+
+# Check that $ICECC_LOCAL_CACHE keeps the result of a remote compile and a
+# second compile takes it from there without asking the scheduler.
+local_cache_test()
+{
+    echo Running local cache test.
+    rm -rf "$testdir"/localcache
+    remote_compile_test "local cache store" plain.cpp ICECC_LOCAL_CACHE="$testdir"/localcache
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    if ! ls "$testdir"/localcache/*.o >/dev/null 2>&1; then
+        echo "Error, local cache has no result."
+        stop_ice 0
+        exit 2
+    fi
+
+    remote_compile_test "local cache hit" plain.cpp ICECC_LOCAL_CACHE="$testdir"/localcache
+    check_log_message icecc "using locally stored result"
+    check_log_error icecc "Have to use host 127.0.0.1:10246"
+    rm -rf "$testdir"/localcache
+    echo Local cache test successful.
+    echo
+}
+
+# Check that with $ICECC_REMOTE_PREPROCESS the compile server preprocesses
+# the source itself from the headers the client lists, and that a second
+# job finds them all in the header store.
+remote_preprocess_test()
+{
+    echo Running remote preprocess test.
+    remote_compile_test "remote preprocess" includes.cpp ICECC_REMOTE_PREPROCESS=1
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message remoteice1 "job has [0-9]* files"
+
+    remote_compile_test "remote preprocess, headers stored" includes.cpp ICECC_REMOTE_PREPROCESS=1
+    check_log_message remoteice1 "job has [0-9]* files, 0 missing"
+    echo Remote preprocess test successful.
+    echo
+}
+
+# Check that with $ICECC_RAW_OUTPUT the object file comes back uncompressed
+# as one raw transfer.
+raw_output_test()
+{
+    echo Running raw output test.
+    remote_compile_test "raw output" plain.cpp ICECC_RAW_OUTPUT=1
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message icecc "receiving [0-9]* bytes raw"
+    echo Raw output test successful.
+    echo
+}
+
+# Check that the local daemon with --connection-pool sets up a connection
+# to the compile server after a job and gives it to the client of the next.
+connection_pool_test()
+{
+    echo Running connection pool test.
+    remote_compile_test "connection pool fill" plain.cpp
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message localice "pooled connection [0-9]* to 127.0.0.1:10246"
+
+    remote_compile_test "connection pool use" plain.cpp
+    check_log_message icecc "Have to use host 127.0.0.1:10246"
+    check_log_message localice "giving the client a pooled connection to 127.0.0.1:10246"
+    echo Connection pool test successful.
+    echo
+}
+
 reset_logs()
 {
     type="$1"
@@ -756,6 +883,24 @@ check_log_message()
     fi
 }
 
+# waits a while for the message ($2) in any of the logs ($1), for what
+# daemons do after the client is done
+wait_for_log_message()
+{
+    for time in `seq 1 10`; do
+        for log in $1; do
+            if grep -q "$2" "$testdir"/${log}.log; then
+                return
+            fi
+        done
+        sleep 0.5
+        flush_logs
+    done
+    echo "Error, none of the logs $1 contains: $2"
+    stop_ice 0
+    exit 2
+}
+
 check_log_message_count()
 {
     log="$1"
@@ -884,6 +1029,23 @@ else
     skipped_tests="$skipped_tests clang"
 fi
 
+if test -z "$chroot_disabled"; then
+    local_cache_test
+    remote_preprocess_test
+    raw_output_test
+
+    # these need the daemons started with other options
+    reset_logs local "Restarting icecream"
+    stop_ice 1
+    localice_args="--connection-pool 1"
+    remoteice_args="--result-cache 16"
+    start_ice
+    check_logs_for_generic_errors
+
+    result_cache_test
+    connection_pool_test
+fi
+
 reset_logs local "Closing down"
 stop_ice 1
 check_logs_for_generic_errors